@@ -44,6 +44,8 @@ endif(CMAKE_COMPILER_IS_GNUCC AND NOT MINGW AND NOT OS2)
 check_include_file(argp.h HAVE_ARGP_H)
 check_include_file(pty.h HAVE_PTY_H)
 check_include_file(termios.h HAVE_TERMIOS_H)
+check_include_file(sys/uio.h HAVE_SYS_UIO_H)
+check_include_file(sys/epoll.h HAVE_SYS_EPOLL_H)
 
 if (WIN32)
   check_include_file(wspiapi.h HAVE_WSPIAPI_H)
@@ -68,6 +70,12 @@ check_include_file(openssl/blowfish.h HAVE_OPENSSL_BLOWFISH_H)
 set(CMAKE_REQUIRED_INCLUDES ${OPENSSL_INCLUDE_DIRS})
 check_include_file(openssl/des.h HAVE_OPENSSL_DES_H)
 
+set(CMAKE_REQUIRED_INCLUDES ${OPENSSL_INCLUDE_DIRS})
+check_include_file(openssl/ec.h HAVE_OPENSSL_EC_H)
+
+set(CMAKE_REQUIRED_INCLUDES ${OPENSSL_INCLUDE_DIRS})
+check_include_file(openssl/ecdh.h HAVE_OPENSSL_ECDH_H)
+
 if (CMAKE_HAVE_PTHREAD_H)
   set(HAVE_PTHREAD_H 1)
 endif (CMAKE_HAVE_PTHREAD_H)
@@ -116,6 +124,8 @@ if (UNIX)
 
     check_library_exists(util forkpty "" HAVE_LIBUTIL)
     check_function_exists(getaddrinfo HAVE_GETADDRINFO)
+    check_function_exists(accept4 HAVE_ACCEPT4)
+    check_function_exists(sched_setaffinity HAVE_SCHED_SETAFFINITY)
     check_function_exists(poll HAVE_POLL)
     check_function_exists(select HAVE_SELECT)
     check_function_exists(cfmakeraw HAVE_CFMAKERAW)
@@ -11,6 +11,12 @@ option(WITH_INTERNAL_DOC "Compile doxygen internal documentation" OFF)
 option(WITH_TESTING "Build with unit tests" OFF)
 option(WITH_CLIENT_TESTING "Build with client tests; requires a running sshd" OFF)
 option(WITH_BENCHMARKS "Build benchmarks tools" OFF)
+option(WITH_CLIENT_ONLY "Build a client-only library without server and SSH1 support" OFF)
+
+if (WITH_CLIENT_ONLY)
+  set(WITH_SERVER OFF)
+  set(WITH_SSH1 OFF)
+endif (WITH_CLIENT_ONLY)
 
 if(WITH_BENCHMARKS)
   set(WITH_TESTING ON)
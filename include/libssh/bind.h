@@ -37,13 +37,25 @@ struct ssh_bind_struct {
   char *banner;
   char *dsakey;
   char *rsakey;
+  char *ecdsakey;
   char *bindaddr;
   socket_t bindfd;
   unsigned int bindport;
   unsigned int log_verbosity;
+  /* share the port between several processes, the kernel balances the
+   * incoming connections, see SSH_BIND_OPTIONS_REUSEPORT */
+  int reuseport;
 
   int blocking;
   int toaccept;
+
+  /* host keys parsed at the first accept and shared refcounted across
+   * sessions, see ssh_bind_accept_fd() */
+  ssh_private_key dsa;
+  ssh_private_key rsa;
+  ssh_private_key ecdsa;
+  /* serialized KEXINIT method lists, identical for every session */
+  ssh_buffer kexinit_cache;
 };
 
 struct ssh_poll_handle_struct *ssh_bind_get_poll(struct ssh_bind_struct
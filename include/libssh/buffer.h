@@ -22,6 +22,8 @@
 #ifndef BUFFER_H_
 #define BUFFER_H_
 
+#include <stdarg.h>
+
 #include "libssh/libssh.h"
 /*
  * Describes a buffer state
@@ -35,9 +37,20 @@ struct ssh_buffer_struct {
     uint32_t used;
     uint32_t allocated;
     uint32_t pos;
+    uint32_t reserve;   /* preallocation hint, see ssh_buffer_reserve() */
+    uint32_t highwater; /* aged peak of used, drives shrinking on reinit */
 };
 
 LIBSSH_API void ssh_buffer_free(ssh_buffer buffer);
+LIBSSH_API int ssh_buffer_reserve(ssh_buffer buffer, uint32_t len);
+LIBSSH_API void *ssh_buffer_reserve_data(ssh_buffer buffer, uint32_t len);
+LIBSSH_API int ssh_buffer_commit_data(ssh_buffer buffer, uint32_t len);
+LIBSSH_API int ssh_buffer_pack(ssh_buffer buffer, const char *format, ...);
+LIBSSH_API int ssh_buffer_pack_va(ssh_buffer buffer, const char *format,
+    va_list ap);
+LIBSSH_API int ssh_buffer_unpack(ssh_buffer buffer, const char *format, ...);
+LIBSSH_API int ssh_buffer_unpack_va(ssh_buffer buffer, const char *format,
+    va_list ap);
 LIBSSH_API void *ssh_buffer_get_begin(ssh_buffer buffer);
 LIBSSH_API uint32_t ssh_buffer_get_len(ssh_buffer buffer);
 LIBSSH_API ssh_buffer ssh_buffer_new(void);
@@ -47,9 +60,16 @@ int buffer_add_u16(ssh_buffer buffer, uint16_t data);
 int buffer_add_u32(ssh_buffer buffer, uint32_t data);
 int buffer_add_u64(ssh_buffer buffer, uint64_t data);
 int buffer_add_data(ssh_buffer buffer, const void *data, uint32_t len);
+/* buffer_allocate reserves len bytes at the tail for the caller to fill */
+void *buffer_allocate(ssh_buffer buffer, uint32_t len);
+/* buffer_chop drops len bytes from the tail, undoing part of an allocate */
+int buffer_chop(ssh_buffer buffer, uint32_t len);
+/* buffer_swap exchanges the contents of two buffers without copying */
+void buffer_swap(ssh_buffer a, ssh_buffer b);
 int buffer_prepend_data(ssh_buffer buffer, const void *data, uint32_t len);
 int buffer_add_buffer(ssh_buffer buffer, ssh_buffer source);
 int buffer_reinit(ssh_buffer buffer);
+void buffer_pool_cleanup(void);
 
 /* buffer_get_rest returns a pointer to the current position into the buffer */
 void *buffer_get_rest(ssh_buffer buffer);
@@ -70,4 +90,32 @@ ssh_string buffer_get_mpint(ssh_buffer buffer);
 uint32_t buffer_pass_bytes_end(ssh_buffer buffer, uint32_t len);
 uint32_t buffer_pass_bytes(ssh_buffer buffer, uint32_t len);
 
+/*
+ * Inline fast paths for the hottest getters, same deal as in string.h:
+ * the exported out-of-line definitions in buffer.c remain for the ABI,
+ * internal callers get the field access without a PLT round-trip.
+ */
+#ifndef SSH_GETTERS_NO_INLINE
+static inline void *ssh_buffer_get_begin_inline(struct ssh_buffer_struct *buffer) {
+  return buffer->data;
+}
+
+static inline uint32_t ssh_buffer_get_len_inline(struct ssh_buffer_struct *buffer) {
+  return buffer->used;
+}
+
+static inline void *buffer_get_rest_inline(struct ssh_buffer_struct *buffer) {
+  return buffer->data + buffer->pos;
+}
+
+static inline uint32_t buffer_get_rest_len_inline(struct ssh_buffer_struct *buffer) {
+  return buffer->used - buffer->pos;
+}
+
+#define ssh_buffer_get_begin(b) ssh_buffer_get_begin_inline(b)
+#define ssh_buffer_get_len(b) ssh_buffer_get_len_inline(b)
+#define buffer_get_rest(b) buffer_get_rest_inline(b)
+#define buffer_get_rest_len(b) buffer_get_rest_len_inline(b)
+#endif /* SSH_GETTERS_NO_INLINE */
+
 #endif /* BUFFER_H_ */
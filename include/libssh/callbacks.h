@@ -110,6 +110,28 @@ typedef void (*ssh_status_callback) (ssh_session session, float status,
 typedef void (*ssh_global_request_callback) (ssh_session session,
                                         ssh_message message, void *userdata);
 
+/**
+ * @brief Process-wide buffer memory high-water callback.
+ * Fired once each time a session's buffer memory usage crosses the
+ * configured threshold upward, see ssh_set_memory_highwater_callback().
+ * @param session Session whose usage crossed the threshold
+ * @param used Bytes of buffer memory the session holds
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_memory_highwater_callback) (ssh_session session,
+		size_t used, void *userdata);
+
+/**
+ * @brief Set the process-wide memory high-water callback.
+ *
+ * The callback fires from the session's own thread when that session's
+ * buffer memory usage, as reported by ssh_get_memory_usage(), crosses
+ * the threshold upward; it is re-armed once usage falls back below.
+ * Pass a NULL callback or a threshold of 0 to disable.
+ */
+LIBSSH_API void ssh_set_memory_highwater_callback(size_t threshold,
+		ssh_memory_highwater_callback cb, void *userdata);
+
 /**
  * The structure to replace libssh functions with appropriate callbacks.
  */
@@ -271,6 +293,24 @@ typedef struct ssh_packet_callbacks_struct *ssh_packet_callbacks;
  */
 LIBSSH_API int ssh_set_callbacks(ssh_session session, ssh_callbacks cb);
 
+/**
+ * @brief Hook the handling of one packet type.
+ *
+ * The hook runs before the library's own handler whenever a packet of
+ * the given type arrives, straight from the dispatch table with no list
+ * walk. Return SSH_PACKET_USED to steal the packet (e.g. consume
+ * SSH_MSG_CHANNEL_DATA without the default buffering) or
+ * SSH_PACKET_NOT_USED to let the normal handler run.
+ *
+ * @param session  The session to hook.
+ * @param type     The SSH2 packet type to intercept.
+ * @param cb       The hook, NULL to remove a previous one.
+ * @param userdata Passed to the hook.
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_packet_set_hook(ssh_session session, uint8_t type,
+    ssh_packet_callback cb, void *userdata);
+
 /**
  * @brief SSH channel data callback. Called when data is available on a channel
  * @param session Current session handler
@@ -348,6 +388,31 @@ typedef void (*ssh_channel_exit_signal_callback) (ssh_session session,
                                             const char *lang,
                                             void *userdata);
 
+/**
+ * @brief SSH channel write drained callback. Called when queued outgoing
+ * data of the channel has been completely handed to the transport, ie
+ * the moment a writer may push more data without it piling up locally.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_channel_write_drained_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            void *userdata);
+
+/**
+ * @brief SSH channel window grow callback. Called when the remote side
+ * enlarged its receive window, so writes can make progress again.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param bytes how many bytes were added to the window
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_channel_window_grow_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            uint32_t bytes,
+                                            void *userdata);
+
 struct ssh_channel_callbacks_struct {
   /** DON'T SET THIS use ssh_callbacks_init() instead. */
   size_t size;
@@ -379,6 +444,15 @@ struct ssh_channel_callbacks_struct {
    * This functions will be called when an exit signal has been received
    */
   ssh_channel_exit_signal_callback channel_exit_signal_function;
+  /**
+   * This function will be called when the queued outgoing data of the
+   * channel has fully drained
+   */
+  ssh_channel_write_drained_callback channel_write_drained_function;
+  /**
+   * This function will be called when the remote window grows
+   */
+  ssh_channel_window_grow_callback channel_window_grow_function;
 };
 typedef struct ssh_channel_callbacks_struct *ssh_channel_callbacks;
 
@@ -403,6 +477,25 @@ typedef struct ssh_channel_callbacks_struct *ssh_channel_callbacks;
  *
  * @return SSH_OK on success, SSH_ERROR on error.
  */
+/**
+ * @brief Capture a channel's output through a callback, bounded.
+ *
+ * Blocks until the remote end sends EOF, delivering stdout and stderr
+ * fragments to the sink straight out of the channel buffers. See the
+ * implementation notes on the limit and on sink return values in
+ * channels.c; intended for exec-style workloads where the output is
+ * one burst followed by EOF.
+ *
+ * @param channel  The channel to capture.
+ * @param sink     Callback receiving the fragments, returns the number
+ *                 of bytes consumed or a negative value to abort.
+ * @param userdata Passed to the sink.
+ * @param limit    Maximum total bytes to deliver, 0 for no bound.
+ * @return SSH_OK on EOF, SSH_ERROR on error, abort or reached limit.
+ */
+LIBSSH_API int ssh_channel_capture_output(ssh_channel channel,
+    ssh_channel_data_callback sink, void *userdata, uint64_t limit);
+
 LIBSSH_API int ssh_set_channel_callbacks(ssh_channel channel,
                                          ssh_channel_callbacks cb);
 
@@ -22,6 +22,7 @@
 #ifndef CHANNELS_H_
 #define CHANNELS_H_
 #include "libssh/priv.h"
+#include "libssh/misc.h"
 
 /**  @internal
  * Describes the different possible states in a
@@ -47,29 +48,136 @@ enum ssh_channel_state_e {
   SSH_CHANNEL_STATE_CLOSED
 };
 
+/* prebuilt SSH2_MSG_CHANNEL_OPEN image for repeated identical opens;
+ * only the local channel id is patched per open, see
+ * ssh_channel_open_forward_template_new() in channels.c */
+struct ssh_channel_open_template_struct {
+    ssh_buffer image;   /* the complete message bytes */
+    uint32_t id_offset; /* offset of the channel id placeholder */
+    uint32_t window;
+    uint32_t maxpacket;
+};
+
+/* lock-free single-producer/single-consumer byte ring feeding a channel
+ * from a worker thread, see ssh_channel_ring_enable() */
+struct ssh_channel_ring_struct {
+    unsigned char *data;
+    uint32_t size;          /* power of two, index math is a mask */
+    /* head and tail sit on their own cache lines so the producer and the
+     * consumer don't bounce the same line on every push and pop */
+    char pad0[64];
+    volatile uint32_t head; /* consumer index, moved by the drain only */
+    char pad1[60];
+    volatile uint32_t tail; /* producer index, moved by the writer only */
+    char pad2[60];
+};
+
+/* The layout of this struct is ABI-internal (it never crosses the
+ * library boundary) and is ordered by access pattern rather than by
+ * topic, so it can keep evolving. The first 64 bytes hold everything
+ * the per-packet receive demux reads, so dispatching a data packet
+ * looked up through ssh_channel_from_local() touches exactly one cache
+ * line of the channel even with tens of thousands of them. The send
+ * and scheduling fields follow, setup and diagnostic data sits at the
+ * end. Add new hot fields at the top and keep the line budget. */
 struct ssh_channel_struct {
-    struct ssh_channel_struct *prev;
-    struct ssh_channel_struct *next;
+    /* --- first cache line: the receive demux working set --- */
     ssh_session session; /* SSH_SESSION pointer */
+    ssh_buffer stdout_buffer;
+    ssh_buffer stderr_buffer;
+    ssh_channel_callbacks callbacks;
     uint32_t local_channel;
-    uint32_t local_window;
-    int local_eof;
-    uint32_t local_maxpacket;
-
     uint32_t remote_channel;
+    uint32_t local_window;
     uint32_t remote_window;
-    int remote_eof; /* end of file received */
-    uint32_t remote_maxpacket;
     enum ssh_channel_state_e state;
+    uint32_t remote_maxpacket;
+    int local_eof;
+    int remote_eof; /* end of file received */
+
+    /* --- send path and scheduler --- */
+    struct ssh_channel_struct *prev;
+    struct ssh_channel_struct *next;
+    /* queued outbound data served by the fairness scheduler, see
+     * channel_sched_flush() */
+    ssh_buffer out_queue;
+    int priority;              /* enum ssh_channel_priority_e */
+    uint32_t sched_deficit;    /* deficit round-robin credit in bytes */
+    uint32_t queue_frame_rest; /* bytes left of the frame at the queue head */
+    int queue_frame_stderr;
+    uint32_t local_maxpacket;
     int delayed_close;
-    ssh_buffer stdout_buffer;
-    ssh_buffer stderr_buffer;
+    /* fd pump bound with ssh_channel_attach_fd(), NULL otherwise */
+    struct ssh_channel_fd_pump_struct *pump;
+    /* cross-thread write ring, NULL unless ssh_channel_ring_enable()d */
+    struct ssh_channel_ring_struct *ring;
+    /* in-library relay of incoming data into another channel's send
+     * queue, see ssh_channel_splice() */
+    struct ssh_channel_struct *splice_peer; /* data is forwarded there */
+    struct ssh_channel_struct *splice_src;  /* back pointer on the peer */
+    uint64_t splice_remaining; /* bytes left to forward, 0 is unlimited */
+    int splice_eof_pending;    /* pass EOF on once out_queue drained */
+
+    /* auto-scaling of the receive window, only read on a refill, see
+     * grow_window() */
+    uint32_t window_target;
+    int window_fixed;
+    struct ssh_timestamp window_last_grow;
+    /* EWMA rate and round-trip estimation feeding the adaptive window
+     * sizing and ssh_channel_get_stats(), see ssh_rate_est_update() */
+    uint32_t rate_est_in;       /* received payload bytes per second */
+    uint32_t rate_est_in_acc;
+    struct ssh_timestamp rate_est_in_ts;
+    uint32_t rate_est_out;      /* sent payload bytes per second */
+    uint32_t rate_est_out_acc;
+    struct ssh_timestamp rate_est_out_ts;
+    uint32_t drain_est;         /* remote window grants, bytes per second */
+    uint32_t drain_est_acc;
+    struct ssh_timestamp drain_est_ts;
+    uint32_t rtt_est_ms;        /* window-adjust round trip estimate */
+    int rtt_probe_armed;
+    struct ssh_timestamp rtt_probe;
+
+    /* --- cold: setup, lifecycle and accounting --- */
     void *userarg;
     int version;
     int blocking;
+    /* skip the compression effort for this channel's data, see
+     * ssh_channel_set_compression() */
+    int compress_bypass;
     int exit_status;
     enum ssh_channel_request_state_e request_state;
-    ssh_channel_callbacks callbacks;
+    /* the SSH_MSG_CHANNEL_OPEN confirmation is still in flight; channel
+     * requests and data issued meanwhile are queued on the channel and
+     * released by the confirmation handler, see channel_request_send() */
+    int open_pending;
+    /* one channel request held back behind the pending open: the request
+     * name, its payload and the want_reply flag */
+    char *early_request;
+    ssh_buffer early_request_buf;
+    int early_request_reply;
+    /* references held on the channel, see ssh_channel_ref() */
+    int refcount;
+    /* set once the channel has been closed and unlinked from the session */
+    int detached;
+    /* token-bucket pacing of both directions, see
+     * ssh_channel_set_rate_limit() */
+    uint64_t rate_limit;       /* bytes per second, 0 when unlimited */
+    uint64_t rate_burst;       /* bucket capacity in bytes */
+    uint64_t rate_out_tokens;
+    uint64_t rate_in_tokens;
+    struct ssh_timestamp rate_out_since;
+    struct ssh_timestamp rate_in_since;
+    /* one-shot drain watermark, fired from the socket flush when the
+     * buffered output falls to the threshold, see
+     * ssh_channel_write_notify() */
+    uint32_t drain_threshold;
+    ssh_channel_drain_callback drain_cb;
+    void *drain_userdata;
+    /* performance counters, see ssh_channel_get_stats() */
+    struct ssh_channel_stats_struct stats;
+    struct ssh_timestamp stall_since; /* when the remote window closed */
+    int stalled;
 };
 
 SSH_PACKET_CALLBACK(ssh_packet_channel_open_conf);
@@ -90,8 +198,19 @@ int channel_default_bufferize(ssh_channel channel, void *data, int len,
         int is_stderr);
 uint32_t ssh_channel_new_id(ssh_session session);
 ssh_channel ssh_channel_from_local(ssh_session session, uint32_t id);
+void ssh_channel_table_register(ssh_session session, ssh_channel channel);
 int channel_write_common(ssh_channel channel, const void *data,
     uint32_t len, int is_stderr);
+int channel_write2(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr);
+int channel_sched_flush(ssh_session session);
+int channel_ring_drain_all(ssh_session session);
+uint32_t ssh_channel_memory_usage(ssh_channel channel);
+int channel_accept_queue_dispatch(ssh_session session, ssh_message msg);
+void ssh_channel_drain_notify(ssh_session session, uint32_t buffered);
+void channel_accept_queues_free(ssh_session session);
+void channel_fd_pump_update(ssh_channel channel);
+void channel_fd_pump_detach(ssh_channel channel);
 #ifdef WITH_SSH1
 SSH_PACKET_CALLBACK(ssh_packet_data1);
 SSH_PACKET_CALLBACK(ssh_packet_close1);
@@ -104,6 +223,8 @@ int channel_change_pty_size1(ssh_channel channel, int cols, int rows);
 int channel_request_shell1(ssh_channel channel);
 int channel_request_exec1(ssh_channel channel, const char *cmd);
 int channel_write1(ssh_channel channel, const void *data, int len);
+int channel_write1_common(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr);
 
 #endif
 
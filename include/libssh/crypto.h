@@ -40,9 +40,28 @@
 #undef cbc_decrypt
 #endif
 
+#ifdef HAVE_ECC
+#include <openssl/ec.h>
+#endif
+
+enum ssh_key_exchange_e {
+  /* diffie-hellman-group1-sha1 */
+  SSH_KEX_DH_GROUP1_SHA1=1,
+  /* ecdh-sha2-nistp256 */
+  SSH_KEX_ECDH_SHA2_NISTP256
+};
+
 struct ssh_crypto_struct {
     bignum e,f,x,k,y;
-    unsigned char session_id[SHA_DIGEST_LEN];
+#ifdef HAVE_ECC
+    EC_KEY *ecdh_privkey;
+    ssh_string ecdh_client_pubkey;
+    ssh_string ecdh_server_pubkey;
+#endif
+    unsigned char session_id[SHA256_DIGEST_LEN];
+    /* length of session_id, depends on the kex digest */
+    uint32_t digest_len;
+    enum ssh_key_exchange_e kex_type;
 
     unsigned char encryptIV[SHA_DIGEST_LEN*2];
     unsigned char decryptIV[SHA_DIGEST_LEN*2];
@@ -53,15 +72,29 @@ struct ssh_crypto_struct {
     unsigned char encryptMAC[SHA_DIGEST_LEN];
     unsigned char decryptMAC[SHA_DIGEST_LEN];
     unsigned char hmacbuf[EVP_MAX_MD_SIZE];
+    /* scratch buffer reused by packet_encrypt/packet_decrypt, grown on
+     * demand so no allocation happens in the per-packet path */
+    unsigned char *crypt_scratch;
+    uint32_t crypt_scratch_len;
+    /* persistent per-direction HMAC contexts, keyed on first use after the
+     * key exchange and reset between packets instead of rebuilt */
+    HMACCTX encrypt_mac_ctx;
+    HMACCTX decrypt_mac_ctx;
     struct crypto_struct *in_cipher, *out_cipher; /* the cipher structures/objects */
     ssh_string server_pubkey;
     const char *server_pubkey_type;
+    /* MD5 of server_pubkey, computed once on the first
+     * ssh_get_pubkey_hash() and handed out from here afterwards */
+    unsigned char server_pubkey_hash[MD5_DIGEST_LEN];
+    int server_pubkey_hash_valid;
     int do_compress_out; /* idem */
     int do_compress_in; /* don't set them, set the option instead */
     int delayed_compress_in; /* Use of zlib@openssh.org */
     int delayed_compress_out;
     void *compress_out_ctx; /* don't touch it */
     void *compress_in_ctx; /* really, don't */
+    int compress_out_level; /* level currently set on compress_out_ctx */
+    ssh_buffer compress_scratch; /* reused output buffer for (de)compression */
 };
 
 struct crypto_struct {
@@ -91,6 +124,8 @@ struct crypto_struct {
     void (*cbc_decrypt)(struct crypto_struct *cipher, void *in, void *out,
         unsigned long len, void *IV);
 #endif
+    /* releases backend resources held in key, may be NULL */
+    void (*cleanup)(struct crypto_struct *cipher);
 };
 
 /* vim: set ts=2 sw=2 et cindent: */
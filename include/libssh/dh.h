@@ -31,8 +31,11 @@ int dh_generate_e(ssh_session session);
 int dh_generate_f(ssh_session session);
 int dh_generate_x(ssh_session session);
 int dh_generate_y(ssh_session session);
+void ssh_dh_precompute(void);
+void ssh_dh_precompute_flush(void);
 
 int ssh_crypto_init(void);
+int ssh_crypto_backend_init(void);
 void ssh_crypto_finalize(void);
 
 ssh_string dh_get_e(ssh_session session);
@@ -35,7 +35,11 @@ struct ssh_public_key_struct {
 #elif HAVE_LIBCRYPTO
     DSA *dsa_pub;
     RSA *rsa_pub;
+#ifdef HAVE_ECC
+    EC_KEY *ecdsa_pub;
 #endif
+#endif
+    int refcount; /* 0 for keys not managed by the pubkey cache */
 };
 
 struct ssh_private_key_struct {
@@ -46,7 +50,11 @@ struct ssh_private_key_struct {
 #elif defined HAVE_LIBCRYPTO
     DSA *dsa_priv;
     RSA *rsa_priv;
+#ifdef HAVE_ECC
+    EC_KEY *ecdsa_priv;
+#endif
 #endif
+    int refcount; /* 0 for keys not managed by the keyfile cache */
 };
 
 typedef struct signature_struct {
@@ -57,6 +65,9 @@ typedef struct signature_struct {
 #elif defined HAVE_LIBCRYPTO
     DSA_SIG *dsa_sign;
     ssh_string rsa_sign;
+#ifdef HAVE_ECC
+    ECDSA_SIG *ecdsa_sign;
+#endif
 #endif
 } SIGNATURE;
 
@@ -70,6 +81,9 @@ ssh_private_key privatekey_make_rsa(ssh_session session, ssh_buffer buffer,
 
 ssh_public_key publickey_make_dss(ssh_session session, ssh_buffer buffer);
 ssh_public_key publickey_make_rsa(ssh_session session, ssh_buffer buffer, int type);
+#ifdef HAVE_ECC
+ssh_public_key publickey_make_ecdsa(ssh_session session, ssh_buffer buffer);
+#endif
 ssh_public_key publickey_from_string(ssh_session session, ssh_string pubkey_s);
 ssh_string signature_to_string(SIGNATURE *sign);
 #if defined HAVE_LIBCRYPTO
@@ -82,6 +96,13 @@ ssh_string ssh_do_sign_with_agent(struct ssh_session_struct *session,
 ssh_string ssh_do_sign(ssh_session session,ssh_buffer sigbuf,
         ssh_private_key privatekey);
 ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey);
+/* asynchronous signature jobs, see ssh_userauth_pubkey() */
+int ssh_sign_job_start(ssh_session session, ssh_buffer sigbuf,
+    ssh_private_key privatekey);
+int ssh_sign_job_pending(ssh_session session);
+int ssh_sign_job_done(ssh_session session);
+ssh_string ssh_sign_job_finish(ssh_session session);
+void ssh_sign_job_abort(ssh_session session);
 ssh_string ssh_encrypt_rsa1(ssh_session session, ssh_string data, ssh_public_key key);
 
 #endif /* KEYS_H_ */
@@ -79,6 +79,7 @@ LIBSSH_API int channel_write(ssh_channel channel, const void *data, uint32_t len
 LIBSSH_API void privatekey_free(ssh_private_key prv);
 LIBSSH_API ssh_private_key privatekey_from_file(ssh_session session, const char *filename,
     int type, const char *passphrase);
+LIBSSH_API void ssh_privatekey_cache_enable(int enable);
 LIBSSH_API void publickey_free(ssh_public_key key);
 LIBSSH_API int ssh_publickey_to_file(ssh_session session, const char *file,
     ssh_string pubkey, int type);
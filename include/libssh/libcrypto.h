@@ -32,10 +32,19 @@
 #include <openssl/md5.h>
 #include <openssl/hmac.h>
 typedef SHA_CTX* SHACTX;
+typedef SHA256_CTX* SHA256CTX;
 typedef MD5_CTX*  MD5CTX;
 typedef HMAC_CTX* HMACCTX;
 
 #define SHA_DIGEST_LEN SHA_DIGEST_LENGTH
+#define SHA256_DIGEST_LEN SHA256_DIGEST_LENGTH
+
+#if defined(HAVE_OPENSSL_EC_H) && defined(HAVE_OPENSSL_ECDH_H)
+#define HAVE_ECC 1
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/objects.h>
+#endif
 #ifdef MD5_DIGEST_LEN
     #undef MD5_DIGEST_LEN
 #endif
@@ -28,9 +28,11 @@
 
 #include <gcrypt.h>
 typedef gcry_md_hd_t SHACTX;
+typedef gcry_md_hd_t SHA256CTX;
 typedef gcry_md_hd_t MD5CTX;
 typedef gcry_md_hd_t HMACCTX;
 #define SHA_DIGEST_LEN 20
+#define SHA256_DIGEST_LEN 32
 #define MD5_DIGEST_LEN 16
 #define EVP_MAX_MD_SIZE 36
 
@@ -109,16 +109,62 @@ extern "C" {
 typedef struct ssh_agent_struct* ssh_agent;
 typedef struct ssh_buffer_struct* ssh_buffer;
 typedef struct ssh_channel_struct* ssh_channel;
+typedef struct ssh_channel_open_template_struct* ssh_channel_open_template;
 typedef struct ssh_message_struct* ssh_message;
 typedef struct ssh_pcap_file_struct* ssh_pcap_file;
 typedef struct ssh_private_key_struct* ssh_private_key;
 typedef struct ssh_public_key_struct* ssh_public_key;
 typedef struct ssh_key_struct* ssh_key;
+typedef struct ssh_options_snapshot_struct* ssh_options_snapshot;
+typedef struct ssh_pool_struct* ssh_pool;
 typedef struct ssh_scp_struct* ssh_scp;
 typedef struct ssh_session_struct* ssh_session;
 typedef struct ssh_string_struct* ssh_string;
 typedef struct ssh_event_struct* ssh_event;
 
+/* performance counters of a session, see ssh_get_stats() */
+struct ssh_stats_struct {
+    uint64_t bytes_encrypted;   /* bytes run through the out cipher */
+    uint64_t bytes_decrypted;   /* bytes run through the in cipher */
+    uint64_t packets_in;        /* SSH packets received */
+    uint64_t packets_out;       /* SSH packets sent */
+    uint64_t compressed_in;     /* compressed payload bytes received */
+    uint64_t compressed_out;    /* compressed payload bytes sent */
+    uint64_t poll_wakeups;      /* returns from poll on the session's context */
+    uint64_t kex_duration_ms;   /* time spent in key exchange */
+    uint64_t window_stall_ms;   /* writes stalled on a closed remote window */
+    uint64_t msg_queue_depth;   /* requests awaiting ssh_message_get() */
+    uint32_t rate_in_ewma;      /* smoothed inbound wire bytes per second */
+    uint32_t rate_out_ewma;     /* smoothed outbound wire bytes per second */
+};
+typedef struct ssh_stats_struct* ssh_stats;
+
+/* algorithm negotiation profiles, see SSH_OPTIONS_PROFILE */
+enum ssh_profile_e {
+	SSH_PROFILE_DEFAULT=0,
+	SSH_PROFILE_COMPAT,
+	SSH_PROFILE_THROUGHPUT,
+	SSH_PROFILE_LOWLAT,
+	SSH_PROFILE_BENCHMARK
+};
+
+enum ssh_channel_priority_e {
+	SSH_CHANNEL_PRIORITY_INTERACTIVE=0,
+	SSH_CHANNEL_PRIORITY_BULK
+};
+
+/* performance counters of a channel, see ssh_channel_get_stats() */
+struct ssh_channel_stats_struct {
+    uint64_t bytes_in;          /* payload bytes received */
+    uint64_t bytes_out;         /* payload bytes written */
+    uint64_t window_stall_ms;   /* writes stalled on a closed remote window */
+    uint32_t rate_in_ewma;      /* smoothed received payload bytes per second */
+    uint32_t rate_out_ewma;     /* smoothed sent payload bytes per second */
+    uint32_t drain_rate_ewma;   /* smoothed remote window grants per second */
+    uint32_t rtt_ewma_ms;       /* window-adjust round trip estimate */
+};
+typedef struct ssh_channel_stats_struct* ssh_channel_stats;
+
 /* Socket type */
 #ifdef _WIN32
 #ifndef socket_t
@@ -182,7 +228,8 @@ enum ssh_channel_type_e {
 	SSH_CHANNEL_SESSION,
 	SSH_CHANNEL_DIRECT_TCPIP,
 	SSH_CHANNEL_FORWARDED_TCPIP,
-	SSH_CHANNEL_X11
+	SSH_CHANNEL_X11,
+	SSH_CHANNEL_AUTH_AGENT
 };
 
 enum ssh_channel_requests_e {
@@ -240,7 +287,8 @@ enum ssh_keytypes_e{
   SSH_KEYTYPE_UNKNOWN=0,
   SSH_KEYTYPE_DSS=1,
   SSH_KEYTYPE_RSA,
-  SSH_KEYTYPE_RSA1
+  SSH_KEYTYPE_RSA1,
+  SSH_KEYTYPE_ECDSA
 };
 
 /* Error return codes */
@@ -301,7 +349,19 @@ enum ssh_options_e {
   SSH_OPTIONS_BINDADDR,
   SSH_OPTIONS_STRICTHOSTKEYCHECK,
   SSH_OPTIONS_COMPRESSION,
-  SSH_OPTIONS_COMPRESSION_LEVEL
+  SSH_OPTIONS_COMPRESSION_LEVEL,
+  SSH_OPTIONS_REKEY_DATA,
+  SSH_OPTIONS_REKEY_TIME,
+  SSH_OPTIONS_PROFILE,
+  SSH_OPTIONS_TCP_NODELAY,
+  SSH_OPTIONS_TCP_KEEPALIVE,
+  SSH_OPTIONS_TCP_QUICKACK,
+  SSH_OPTIONS_TCP_SNDBUF,
+  SSH_OPTIONS_TCP_RCVBUF,
+  SSH_OPTIONS_DEFERRED_HOSTKEY,
+  SSH_OPTIONS_KEEPALIVE_INTERVAL,
+  SSH_OPTIONS_TCP_MSS_ALIGN,
+  SSH_OPTIONS_IP_TOS
 };
 
 enum {
@@ -327,9 +387,17 @@ enum ssh_scp_request_types {
 
 LIBSSH_API int ssh_blocking_flush(ssh_session session, int timeout);
 LIBSSH_API ssh_channel ssh_channel_accept_x11(ssh_channel channel, int timeout_ms);
+LIBSSH_API int ssh_channel_attach_fd(ssh_channel channel, socket_t fd);
+LIBSSH_API int ssh_channel_splice(ssh_channel channel, ssh_channel peer,
+    uint64_t limit);
+LIBSSH_API int ssh_channel_unsplice(ssh_channel channel);
 LIBSSH_API int ssh_channel_change_pty_size(ssh_channel channel,int cols,int rows);
 LIBSSH_API int ssh_channel_close(ssh_channel channel);
+LIBSSH_API int ssh_session_close_channels(ssh_session session);
 LIBSSH_API void ssh_channel_free(ssh_channel channel);
+LIBSSH_API void ssh_channel_ref(ssh_channel channel);
+LIBSSH_API int ssh_channel_set_priority(ssh_channel channel,
+    enum ssh_channel_priority_e priority);
 LIBSSH_API int ssh_channel_get_exit_status(ssh_channel channel);
 LIBSSH_API ssh_session ssh_channel_get_session(ssh_channel channel);
 LIBSSH_API int ssh_channel_is_closed(ssh_channel channel);
@@ -338,13 +406,54 @@ LIBSSH_API int ssh_channel_is_open(ssh_channel channel);
 LIBSSH_API ssh_channel ssh_channel_new(ssh_session session);
 LIBSSH_API int ssh_channel_open_forward(ssh_channel channel, const char *remotehost,
     int remoteport, const char *sourcehost, int localport);
+LIBSSH_API ssh_channel_open_template ssh_channel_open_forward_template_new(
+    ssh_session session, const char *remotehost, int remoteport,
+    const char *sourcehost, int localport);
+LIBSSH_API void ssh_channel_open_template_free(ssh_channel_open_template tmpl);
+LIBSSH_API int ssh_channel_open_forward_template(ssh_channel channel,
+    ssh_channel_open_template tmpl);
+LIBSSH_API int ssh_channel_open_forward_template_async(ssh_channel channel,
+    ssh_channel_open_template tmpl);
+LIBSSH_API int ssh_channel_open_wait(ssh_channel channel);
 LIBSSH_API int ssh_channel_open_session(ssh_channel channel);
+LIBSSH_API int ssh_channel_open_auth_agent(ssh_channel channel);
+LIBSSH_API int ssh_channel_open_auth_agent_async(ssh_channel channel);
 LIBSSH_API int ssh_channel_poll(ssh_channel channel, int is_stderr);
+LIBSSH_API int ssh_channel_poll_buffered(ssh_channel channel, int is_stderr);
+LIBSSH_API int ssh_channel_pump(ssh_channel channel, int timeout);
+typedef void (*ssh_channel_accept_callback)(ssh_channel channel,
+    void *userdata);
+LIBSSH_API int ssh_channel_accept_subscribe(ssh_session session,
+    int channeltype, ssh_channel_accept_callback cb, void *userdata);
+LIBSSH_API ssh_channel ssh_channel_accept_pop(ssh_session session,
+    int channeltype);
+LIBSSH_API int ssh_channel_ring_enable(ssh_channel channel, uint32_t size);
+LIBSSH_API int ssh_channel_ring_write(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr);
 LIBSSH_API int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_stderr);
+LIBSSH_API int ssh_channel_read_nocopy(ssh_channel channel, void **dest, int is_stderr);
+LIBSSH_API int ssh_channel_set_window(ssh_channel channel, uint32_t size);
+
+/* Scatter-gather segment for the vectored write functions. Defined here
+ * instead of using struct iovec so that callers do not depend on
+ * <sys/uio.h>. */
+struct ssh_iovec_struct {
+    const void *data;
+    size_t len;
+};
+LIBSSH_API int ssh_channel_writev(ssh_channel channel,
+    const struct ssh_iovec_struct *iov, int iovcnt);
+LIBSSH_API int ssh_channel_read_release(ssh_channel channel, uint32_t count, int is_stderr);
 LIBSSH_API int ssh_channel_read_nonblocking(ssh_channel channel, void *dest, uint32_t count,
     int is_stderr);
+struct timespec; /* absolute CLOCK_REALTIME deadline */
+LIBSSH_API int ssh_channel_read_deadline(ssh_channel channel, void *dest,
+    uint32_t count, int is_stderr, const struct timespec *deadline);
+LIBSSH_API int ssh_channel_request_auth_agent(ssh_channel channel);
 LIBSSH_API int ssh_channel_request_env(ssh_channel channel, const char *name, const char *value);
 LIBSSH_API int ssh_channel_request_exec(ssh_channel channel, const char *cmd);
+LIBSSH_API int ssh_channel_request_exec_async(ssh_channel channel, const char *cmd);
+LIBSSH_API int ssh_channel_request_wait(ssh_channel channel);
 LIBSSH_API int ssh_channel_request_pty(ssh_channel channel);
 LIBSSH_API int ssh_channel_request_pty_size(ssh_channel channel, const char *term,
     int cols, int rows);
@@ -358,7 +467,12 @@ LIBSSH_API int ssh_channel_send_eof(ssh_channel channel);
 LIBSSH_API int ssh_channel_select(ssh_channel *readchans, ssh_channel *writechans, ssh_channel *exceptchans, struct
         timeval * timeout);
 LIBSSH_API void ssh_channel_set_blocking(ssh_channel channel, int blocking);
+LIBSSH_API void ssh_channel_set_compression(ssh_channel channel, int enable);
 LIBSSH_API int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len);
+typedef void (*ssh_channel_drain_callback)(ssh_channel channel,
+    void *userdata);
+LIBSSH_API int ssh_channel_write_notify(ssh_channel channel,
+    uint32_t bytes_threshold, ssh_channel_drain_callback cb, void *userdata);
 LIBSSH_API uint32_t ssh_channel_window_size(ssh_channel channel);
 
 LIBSSH_API int ssh_try_publickey_from_file(ssh_session session, const char *keyfile,
@@ -375,6 +489,8 @@ LIBSSH_API int ssh_finalize(void);
 LIBSSH_API ssh_channel ssh_forward_accept(ssh_session session, int timeout_ms);
 LIBSSH_API int ssh_forward_cancel(ssh_session session, const char *address, int port);
 LIBSSH_API int ssh_forward_listen(ssh_session session, const char *address, int port, int *bound_port);
+LIBSSH_API int ssh_forward_listen_async(ssh_session session, const char *address, int port);
+LIBSSH_API int ssh_global_requests_wait(ssh_session session);
 LIBSSH_API void ssh_free(ssh_session session);
 LIBSSH_API const char *ssh_get_disconnect_message(ssh_session session);
 LIBSSH_API const char *ssh_get_error(void *error);
@@ -385,10 +501,23 @@ LIBSSH_API char *ssh_get_issue_banner(ssh_session session);
 LIBSSH_API int ssh_get_openssh_version(ssh_session session);
 LIBSSH_API ssh_string ssh_get_pubkey(ssh_session session);
 LIBSSH_API int ssh_get_pubkey_hash(ssh_session session, unsigned char **hash);
+/* CPU capability bits reported by ssh_get_cpu_features() */
+#define SSH_CPU_AESNI  0x01
+#define SSH_CPU_PCLMUL 0x02
+#define SSH_CPU_AVX2   0x04
+#define SSH_CPU_SHA    0x08
+#define SSH_CPU_NEON   0x10
+LIBSSH_API uint32_t ssh_get_cpu_features(void);
 LIBSSH_API int ssh_get_random(void *where,int len,int strong);
+LIBSSH_API int ssh_get_stats(ssh_session session, ssh_stats stats);
+LIBSSH_API int ssh_channel_get_stats(ssh_channel channel,
+    ssh_channel_stats stats);
 LIBSSH_API int ssh_get_version(ssh_session session);
 LIBSSH_API int ssh_get_status(ssh_session session);
 LIBSSH_API int ssh_init(void);
+LIBSSH_API int ssh_init_minimal(void);
+LIBSSH_API int ssh_set_deadline(ssh_session session, int timeout_ms);
+LIBSSH_API int ssh_get_deadline_remaining(ssh_session session);
 LIBSSH_API int ssh_is_blocking(ssh_session session);
 LIBSSH_API int ssh_is_connected(ssh_session session);
 LIBSSH_API int ssh_is_server_known(ssh_session session);
@@ -397,12 +526,17 @@ LIBSSH_API ssh_channel ssh_message_channel_request_open_reply_accept(ssh_message
 LIBSSH_API int ssh_message_channel_request_reply_success(ssh_message msg);
 LIBSSH_API void ssh_message_free(ssh_message msg);
 LIBSSH_API ssh_message ssh_message_get(ssh_session session);
+LIBSSH_API int ssh_set_message_queue_limit(ssh_session session, uint32_t limit);
 LIBSSH_API int ssh_message_subtype(ssh_message msg);
 LIBSSH_API int ssh_message_type(ssh_message msg);
 LIBSSH_API int ssh_mkdir (const char *pathname, mode_t mode);
 LIBSSH_API ssh_session ssh_new(void);
 
 LIBSSH_API int ssh_options_copy(ssh_session src, ssh_session *dest);
+LIBSSH_API ssh_options_snapshot ssh_options_freeze(ssh_session session);
+LIBSSH_API int ssh_options_apply_snapshot(ssh_session session,
+    ssh_options_snapshot snapshot);
+LIBSSH_API void ssh_options_snapshot_free(ssh_options_snapshot snapshot);
 LIBSSH_API int ssh_options_getopt(ssh_session session, int *argcptr, char **argv);
 LIBSSH_API int ssh_options_parse_config(ssh_session session, const char *filename);
 LIBSSH_API int ssh_options_set(ssh_session session, enum ssh_options_e type, const void *value);
@@ -411,6 +545,9 @@ LIBSSH_API int ssh_pcap_file_close(ssh_pcap_file pcap);
 LIBSSH_API void ssh_pcap_file_free(ssh_pcap_file pcap);
 LIBSSH_API ssh_pcap_file ssh_pcap_file_new(void);
 LIBSSH_API int ssh_pcap_file_open(ssh_pcap_file pcap, const char *filename);
+LIBSSH_API void ssh_pcap_file_set_snaplen(ssh_pcap_file pcap, uint32_t snaplen);
+LIBSSH_API void ssh_pcap_file_set_control_only(ssh_pcap_file pcap, int control_only);
+LIBSSH_API void ssh_pcap_file_set_sampling(ssh_pcap_file pcap, uint32_t rate);
 
 LIBSSH_API enum ssh_keytypes_e ssh_privatekey_type(ssh_private_key privatekey);
 
@@ -421,6 +558,7 @@ LIBSSH_API int ssh_pki_import_privkey_base64(ssh_key key, ssh_session session,
 LIBSSH_API int ssh_userauth_pki_pubkey(ssh_session session, const char *username,
                             ssh_string publickey, ssh_key privatekey);
 LIBSSH_API void ssh_print_hexa(const char *descr, const unsigned char *what, size_t len);
+LIBSSH_API void ssh_reconnect_cache_enable(int enable);
 LIBSSH_API int ssh_scp_accept_request(ssh_scp scp);
 LIBSSH_API int ssh_scp_close(ssh_scp scp);
 LIBSSH_API int ssh_scp_deny_request(ssh_scp scp, const char *reason);
@@ -428,8 +566,11 @@ LIBSSH_API void ssh_scp_free(ssh_scp scp);
 LIBSSH_API int ssh_scp_init(ssh_scp scp);
 LIBSSH_API int ssh_scp_leave_directory(ssh_scp scp);
 LIBSSH_API ssh_scp ssh_scp_new(ssh_session session, int mode, const char *location);
+LIBSSH_API int ssh_scp_pipeline(ssh_scp scp, int enable);
+LIBSSH_API int ssh_scp_drain(ssh_scp scp);
 LIBSSH_API int ssh_scp_pull_request(ssh_scp scp);
 LIBSSH_API int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode);
+LIBSSH_API int ssh_scp_push_fd(ssh_scp scp, int fd, uint64_t size);
 LIBSSH_API int ssh_scp_push_file(ssh_scp scp, const char *filename, size_t size, int perms);
 LIBSSH_API int ssh_scp_push_file64(ssh_scp scp, const char *filename, uint64_t size, int perms);
 LIBSSH_API int ssh_scp_read(ssh_scp scp, void *buffer, size_t size);
@@ -442,6 +583,30 @@ LIBSSH_API int ssh_select(ssh_channel *channels, ssh_channel *outchannels, socke
     fd_set *readfds, struct timeval *timeout);
 LIBSSH_API int ssh_service_request(ssh_session session, const char *service);
 LIBSSH_API void ssh_set_blocking(ssh_session session, int blocking);
+LIBSSH_API int ssh_session_set_crypto_offload(ssh_session session, int enable);
+LIBSSH_API int ssh_session_set_busy_poll(ssh_session session, int usec);
+LIBSSH_API size_t ssh_get_memory_usage(ssh_session session);
+LIBSSH_API int ssh_session_set_memory_limit(ssh_session session, size_t limit);
+LIBSSH_API int ssh_channel_set_rate_limit(ssh_channel channel, uint64_t rate,
+    uint64_t burst);
+LIBSSH_API int ssh_session_set_rate_limit(ssh_session session, uint64_t rate,
+    uint64_t burst);
+LIBSSH_API void ssh_resolver_cache_set_ttl(int positive_seconds,
+    int negative_seconds);
+LIBSSH_API ssh_pool ssh_pool_new(void);
+LIBSSH_API void ssh_pool_free(ssh_pool pool);
+LIBSSH_API void ssh_pool_set_idle_timeout(ssh_pool pool, int seconds);
+LIBSSH_API int ssh_pool_add(ssh_pool pool, ssh_session session);
+LIBSSH_API int ssh_pool_add_class(ssh_pool pool, ssh_session session,
+    int channel_class);
+LIBSSH_API ssh_session ssh_pool_get(ssh_pool pool, const char *host, int port,
+    const char *user);
+LIBSSH_API ssh_session ssh_pool_get_class(ssh_pool pool, const char *host,
+    int port, const char *user, int channel_class);
+LIBSSH_API int ssh_pool_release(ssh_pool pool, ssh_session session);
+LIBSSH_API int ssh_pool_prune(ssh_pool pool);
+LIBSSH_API int ssh_set_cork(ssh_session session, int cork);
+LIBSSH_API int ssh_session_flush(ssh_session session);
 LIBSSH_API void ssh_set_fd_except(ssh_session session);
 LIBSSH_API void ssh_set_fd_toread(ssh_session session);
 LIBSSH_API void ssh_set_fd_towrite(ssh_session session);
@@ -492,7 +657,12 @@ LIBSSH_API ssh_event ssh_event_new(void);
 LIBSSH_API int ssh_event_add_fd(ssh_event event, socket_t fd, short events,
                                     ssh_event_callback cb, void *userdata);
 LIBSSH_API int ssh_event_add_session(ssh_event event, ssh_session session);
+LIBSSH_API int ssh_session_get_fd_events(ssh_session session, socket_t *fd,
+                                    short *events);
+LIBSSH_API int ssh_session_process_events(ssh_session session, short revents);
 LIBSSH_API int ssh_event_dopoll(ssh_event event, int timeout);
+LIBSSH_API int ssh_event_set_spin(ssh_event event, int budget);
+LIBSSH_API int ssh_event_set_affinity(ssh_event event, int cpu);
 LIBSSH_API int ssh_event_remove_fd(ssh_event event, socket_t fd);
 LIBSSH_API int ssh_event_remove_session(ssh_event event, ssh_session session);
 LIBSSH_API void ssh_event_free(ssh_event event);
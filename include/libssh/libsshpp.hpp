@@ -58,9 +58,41 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#if defined(__cplusplus) && __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#include <cstddef>
+#define SSH_CPP_HAS_SPAN 1
+#endif
+#endif
+
+/* the fast paths are noexcept where the dialect knows the keyword */
+#if __cplusplus >= 201103L
+#define SSH_CPP_NOEXCEPT noexcept
+#else
+#define SSH_CPP_NOEXCEPT
+#endif
+
 namespace ssh {
 
 class Channel;
+
+/** @brief Result of a noexcept I/O fast path: either a byte count or a
+ * negative SSH_* error code, no exception involved either way. The
+ * wrapper adds no branch of its own on top of the C call.
+ */
+class IoResult {
+public:
+  IoResult(int rc) : rc(rc) {}
+  /** @brief true unless the operation failed */
+  bool ok() const { return rc >= 0; }
+  /** @brief bytes transferred, only meaningful when ok() */
+  int bytes() const { return rc; }
+  /** @brief the raw ssh_channel_read()/write() return code */
+  int error() const { return rc; }
+private:
+  int rc;
+};
 /** Some people do not like C++ exceptions. With this define, we give
  * the choice to use or not exceptions.
  * @brief if defined, disable C++ exceptions for libssh c++ wrapper
@@ -130,9 +162,28 @@ public:
     c_session=ssh_new();
   }
   ~Session(){
-    ssh_free(c_session);
+    if(c_session != NULL)
+      ssh_free(c_session);
     c_session=NULL;
   }
+#if __cplusplus >= 201103L
+  /** @brief Moves ownership of the underlying ssh_session; the
+   * moved-from object becomes an empty shell that is safe to destroy,
+   * so sessions can live in containers and be returned from factories.
+   */
+  Session(Session &&other) noexcept : c_session(other.c_session){
+    other.c_session=NULL;
+  }
+  Session &operator=(Session &&other) noexcept {
+    if(this != &other){
+      if(c_session != NULL)
+        ssh_free(c_session);
+      c_session=other.c_session;
+      other.c_session=NULL;
+    }
+    return *this;
+  }
+#endif
   /** @brief sets an SSH session options
    * @param type Type of option
    * @param option cstring containing the value of option
@@ -407,9 +458,29 @@ public:
     this->session=&session;
   }
   ~Channel(){
-    ssh_channel_free(channel);
+    if(channel != NULL)
+      ssh_channel_free(channel);
     channel=NULL;
   }
+#if __cplusplus >= 201103L
+  /** @brief Moves ownership of the underlying ssh_channel; the
+   * moved-from object becomes an empty shell that is safe to destroy.
+   */
+  Channel(Channel &&other) noexcept
+      : session(other.session), channel(other.channel){
+    other.channel=NULL;
+  }
+  Channel &operator=(Channel &&other) noexcept {
+    if(this != &other){
+      if(channel != NULL)
+        ssh_channel_free(channel);
+      session=other.session;
+      channel=other.channel;
+      other.channel=NULL;
+    }
+    return *this;
+  }
+#endif
 
   /** @brief accept an incoming X11 connection
    * @param[in] timeout_ms timeout for waiting, in ms
@@ -573,6 +644,38 @@ public:
     ssh_throw(ret);
     return ret;
   }
+  /** @brief noexcept read fast path: maps straight onto
+   * ssh_channel_read() and reports errors through the result object
+   * instead of an exception, so hot loops pay for no unwind machinery.
+   * @see IoResult
+   */
+  IoResult tryRead(void *dest, size_t count, bool is_stderr=false) SSH_CPP_NOEXCEPT {
+    /* handle int overflow */
+    if(count > 0x7fffffff)
+      count = 0x7fffffff;
+    return IoResult(ssh_channel_read(channel,dest,count,is_stderr));
+  }
+  /** @brief noexcept write fast path, see Channel::tryRead
+   * @see IoResult
+   */
+  IoResult tryWrite(const void *data, size_t len, bool is_stderr=false) SSH_CPP_NOEXCEPT {
+    if(is_stderr){
+      return IoResult(ssh_channel_write_stderr(channel,data,len));
+    }
+    return IoResult(ssh_channel_write(channel,data,len));
+  }
+#ifdef SSH_CPP_HAS_SPAN
+  /** @brief span-based noexcept write, forwarding to the same C call
+   * as Channel::tryWrite */
+  IoResult write(std::span<const std::byte> data, bool is_stderr=false) noexcept {
+    return tryWrite(data.data(), data.size(), is_stderr);
+  }
+  /** @brief span-based noexcept read, forwarding to the same C call
+   * as Channel::tryRead */
+  IoResult read(std::span<std::byte> dest, bool is_stderr=false) noexcept {
+    return tryRead(dest.data(), dest.size(), is_stderr);
+  }
+#endif
 private:
   ssh_session getCSession(){
     return session->getCSession();
@@ -84,6 +84,10 @@ struct ssh_channel_request {
 
 struct ssh_message_struct {
     ssh_session session;
+    /* intrusive links, used while the message sits in the delayed
+     * message queue of the session */
+    struct ssh_message_struct *msg_prev;
+    struct ssh_message_struct *msg_next;
     int type;
     struct ssh_auth_request auth_request;
     struct ssh_channel_request_open channel_request_open;
@@ -101,5 +105,6 @@ int ssh_message_handle_channel_request(ssh_session session, ssh_channel channel,
     const char *request, uint8_t want_reply);
 void ssh_message_queue(ssh_session session, ssh_message message);
 ssh_message ssh_message_pop_head(ssh_session session);
+void ssh_message_queue_unlink(ssh_session session, ssh_message message);
 
 #endif /* MESSAGES_H_ */
@@ -78,7 +78,11 @@ const void *_ssh_list_pop_head(struct ssh_list *list);
   ((type)_ssh_list_pop_head(ssh_list))
 
 void ssh_timestamp_init(struct ssh_timestamp *ts);
+void ssh_timestamp_cache_refresh(void);
 int ssh_timeout_elapsed(struct ssh_timestamp *ts, int timeout);
+int ssh_timestamp_elapsed_ms(struct ssh_timestamp *ts);
+void ssh_rate_est_update(uint32_t *ewma, uint32_t *acc,
+    struct ssh_timestamp *since, uint32_t bytes);
 int ssh_timeout_update(struct ssh_timestamp *ts, int timeout);
 
 #endif /* MISC_H_ */
@@ -27,6 +27,9 @@ typedef struct packet_struct {
 	int valid;
 	uint32_t len;
 	uint8_t type;
+	/* chaff (SSH_MSG_IGNORE and friends) flagged from the first decrypted
+	 * block, to be MAC-verified and dropped without dispatch */
+	uint8_t discard;
 } PACKET;
 
 /** different state of packet reading. */
@@ -41,6 +44,7 @@ enum ssh_packet_state_e {
 };
 
 int packet_send(ssh_session session);
+int packet_send2(ssh_session session);
 
 #ifdef WITH_SSH1
 int packet_send1(ssh_session session) ;
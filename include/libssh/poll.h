@@ -147,12 +147,23 @@ void ssh_poll_remove_events(ssh_poll_handle p, short events);
 socket_t ssh_poll_get_fd(ssh_poll_handle p);
 void ssh_poll_set_fd(ssh_poll_handle p, socket_t fd);
 void ssh_poll_set_callback(ssh_poll_handle p, ssh_poll_callback cb, void *userdata);
+/* one-shot timers hashed on a wheel in the poll context, see poll.c */
+typedef struct ssh_poll_timer_struct *ssh_poll_timer;
+typedef void (*ssh_poll_timer_callback)(void *userdata);
+ssh_poll_timer ssh_poll_timer_arm(ssh_poll_ctx ctx, int timeout_ms,
+    ssh_poll_timer_callback cb, void *userdata);
+void ssh_poll_timer_cancel(ssh_poll_timer timer);
+/* shared keepalive scheduler, one tick per poll context */
+void ssh_keepalive_attach(ssh_poll_ctx ctx, ssh_session session);
+void ssh_keepalive_detach(ssh_session session);
 ssh_poll_ctx ssh_poll_ctx_new(size_t chunk_size);
 void ssh_poll_ctx_free(ssh_poll_ctx ctx);
 int ssh_poll_ctx_add(ssh_poll_ctx ctx, ssh_poll_handle p);
 int ssh_poll_ctx_add_socket (ssh_poll_ctx ctx, struct ssh_socket_struct *s);
 void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p);
 int ssh_poll_ctx_dopoll(ssh_poll_ctx ctx, int timeout);
+void ssh_poll_ctx_set_spin(ssh_poll_ctx ctx, int budget);
+uint64_t ssh_poll_ctx_get_wakeups(ssh_poll_ctx ctx);
 ssh_poll_ctx ssh_poll_get_default_ctx(ssh_session session);
 
 #endif /* POLL_H_ */
@@ -105,6 +105,32 @@
 #include "libssh/callbacks.h"
 #include "libssh/crypto.h"
 
+/*
+ * Atomic reference counters. On GCC these compile to lock-free atomic
+ * instructions, so a reference can be taken or dropped from any thread
+ * without involving the mutex callbacks registered for the crypto
+ * libraries. ssh_refcount_dec() returns the new count; the dropper seeing
+ * zero owns the object and may free it.
+ */
+#if defined(__GNUC__)
+#define ssh_refcount_inc(r) ((void) __sync_add_and_fetch((r), 1))
+#define ssh_refcount_dec(r) __sync_sub_and_fetch((r), 1)
+#else
+#define ssh_refcount_inc(r) ((void) (++(*(r))))
+#define ssh_refcount_dec(r) (--(*(r)))
+#endif
+
+/*
+ * Full memory barrier for the lock-free rings: a producer publishes its
+ * payload before moving its index, a consumer finishes reading before
+ * giving the space back.
+ */
+#if defined(__GNUC__)
+#define ssh_memory_barrier() __sync_synchronize()
+#else
+#define ssh_memory_barrier() do { } while(0)
+#endif
+
 /* some constants */
 #define MAX_PACKET_LEN 262144
 #define ERROR_BUFFERLEN 1024
@@ -129,7 +155,14 @@ typedef struct kex_struct {
 struct error_struct {
 /* error handling */
     int error_code;
+    /* messages without format conversions are kept as the string literal
+     * and only rendered into error_buffer when ssh_get_error() asks */
+    const char *error_str;
     char error_buffer[ERROR_BUFFERLEN];
+    /* object identity and write sequence backing the per-thread error
+     * slots, see ssh_error_init() in error.c */
+    uint32_t error_gen;
+    uint32_t error_seq;
 };
 
 /* TODO: remove that include */
@@ -154,23 +187,38 @@ int ssh_send_banner(ssh_session session, int is_server);
 SSH_PACKET_CALLBACK(ssh_packet_dh_reply);
 SSH_PACKET_CALLBACK(ssh_packet_newkeys);
 SSH_PACKET_CALLBACK(ssh_packet_service_accept);
+void ssh_reconnect_cache_store(ssh_session session);
+void ssh_reconnect_cache_set_identity(ssh_session session, const char *file);
+const char *ssh_reconnect_cache_get_identity(ssh_session session);
+void ssh_reconnect_cache_set_auth_methods(ssh_session session, int methods);
+int ssh_reconnect_cache_get_auth_methods(ssh_session session);
+void ssh_reconnect_cache_flush(void);
 
 /* config.c */
 int ssh_config_parse_file(ssh_session session, const char *filename);
 
 /* errors.c */
+void ssh_error_init(struct error_struct *err);
 void ssh_set_error(void *error, int code, const char *descr, ...) PRINTF_ATTRIBUTE(3, 4);
 void ssh_set_error_oom(void *);
 void ssh_set_error_invalid(void *, const char *);
 
 /* in crypt.c */
+int ssh_send_keepalive(ssh_session session);
 uint32_t packet_decrypt_len(ssh_session session,char *crypted);
 int packet_decrypt(ssh_session session, void *packet,unsigned int len);
+int packet_decrypt_to(ssh_session session, void *dst, const void *src,
+    uint32_t len);
+void *packet_decrypt_scratch(ssh_session session, const void *src,
+    uint32_t len);
 unsigned char *packet_encrypt(ssh_session session,void *packet,unsigned int len);
  /* it returns the hmac buffer if exists*/
+void ssh_crypt_worker_stop(ssh_session session);
 struct ssh_poll_handle_struct;
 
 int packet_hmac_verify(ssh_session session,ssh_buffer buffer,unsigned char *mac);
+int packet_hmac_verify2(ssh_session session, const void *data1, uint32_t len1,
+    const void *data2, uint32_t len2, unsigned char *mac);
 
 struct ssh_socket_struct;
 
@@ -180,22 +228,35 @@ void ssh_packet_set_callbacks(ssh_session session, ssh_packet_callbacks callback
 void ssh_packet_set_default_callbacks(ssh_session session);
 void ssh_packet_process(ssh_session session, uint8_t type);
 /* connect.c */
+struct addrinfo;
 socket_t ssh_connect_host(ssh_session session, const char *host,const char
         *bind_addr, int port, long timeout, long usec);
 socket_t ssh_connect_host_nonblocking(ssh_session session, const char *host,
 		const char *bind_addr, int port);
+int ssh_connect_ai(ssh_session session, const char *host, int port,
+		struct addrinfo **ai);
+socket_t ssh_connect_ai_nonblocking(ssh_session session, struct addrinfo *itr,
+		const char *bind_addr);
 void ssh_sock_set_nonblocking(socket_t sock);
 void ssh_sock_set_blocking(socket_t sock);
+void ssh_resolver_cache_flush(void);
+void ssh_kex_cache_flush(void);
 
 /* in kex.c */
 extern const char *ssh_kex_nums[];
 int ssh_send_kex(ssh_session session, int server_kex);
 void ssh_list_kex(ssh_session session, KEX *kex);
 int set_kex(ssh_session session);
+void kex_methods_free(KEX *kex);
+const char *ssh_profile_ciphers(int profile);
+const char *ssh_profile_compression(int profile);
+const char *ssh_benchmark_cipher_order(void);
+void ssh_benchmark_cipher_flush(void);
 int verify_existing_algo(int algo, const char *name);
 char **space_tokenize(const char *chain);
 int ssh_get_kex1(ssh_session session);
 char *ssh_find_matching(const char *in_d, const char *what_d);
+int ssh_kex_select_kex_type(ssh_session session, const char *name);
 
 
 /* in base64.c */
@@ -213,9 +274,36 @@ uint32_t ssh_crc32(const char *buf, uint32_t len);
 /* match.c */
 int match_hostname(const char *host, const char *pattern, unsigned int len);
 
+/* known_hosts.c */
+void ssh_knownhosts_cache_flush(void);
+
+/* keyfiles.c */
+void ssh_privatekey_cache_flush(void);
+
+/* keys.c */
+void ssh_pubkey_cache_flush(void);
+
 int message_handle(ssh_session session, void *user, uint8_t type, ssh_buffer packet);
 /* log.c */
 
+/* verbosity levels above SSH_LOG_MAX_LEVEL are dropped at compile time,
+ * e.g. -DSSH_LOG_MAX_LEVEL=SSH_LOG_PROTOCOL removes the per-packet and
+ * calltrace logging from the library entirely */
+#ifndef SSH_LOG_MAX_LEVEL
+#define SSH_LOG_MAX_LEVEL SSH_LOG_FUNCTIONS
+#endif
+
+/* wrapper doing the verbosity checks before the format arguments are
+ * evaluated; the ssh_log in the body is the real function from log.c */
+#define ssh_log(session, verbosity, ...) \
+    do { \
+        ssh_session _log_session = (ssh_session)(session); \
+        if ((verbosity) <= SSH_LOG_MAX_LEVEL && \
+            (verbosity) <= _log_session->log_verbosity) { \
+            ssh_log(_log_session, (verbosity), __VA_ARGS__); \
+        } \
+    } while(0)
+
 /* misc.c */
 #ifdef _WIN32
 int gettimeofday(struct timeval *__p, void *__t);
@@ -271,8 +359,15 @@ SSH_PACKET_CALLBACK(ssh_packet_kexdh_init);
 /** Get the size of an array */
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
-/** Overwrite the complete string with 'X' */
-#define BURN_STRING(x) do { if ((x) != NULL) memset((x), 'X', strlen((x))); } while(0)
+/* options.c: free an option string unless it is borrowed from the
+ * session's shared options snapshot */
+void ssh_options_field_free(ssh_session session, char **field);
+
+/* misc.c: wipe secrets in a way the compiler can't optimize out */
+void ssh_burn(void *data, size_t len);
+
+/** Overwrite the complete string, the wipe can't be optimized out */
+#define BURN_STRING(x) do { if ((x) != NULL) ssh_burn((x), strlen((x))); } while(0)
 
 #ifdef HAVE_LIBGCRYPT
 /* gcrypt_missing.c */
@@ -46,6 +46,10 @@ struct ssh_scp_struct {
   char *request_name;
   char *warning;
   int request_mode;
+  /* pipelined sink mode: headers go out without waiting for their ack,
+   * see ssh_scp_pipeline() */
+  int pipelined;
+  int pending_acks;
 };
 
 int ssh_scp_read_string(ssh_scp scp, char *buffer, size_t len);
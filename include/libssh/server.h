@@ -45,7 +45,9 @@ enum ssh_bind_options_e {
   SSH_BIND_OPTIONS_RSAKEY,
   SSH_BIND_OPTIONS_BANNER,
   SSH_BIND_OPTIONS_LOG_VERBOSITY,
-  SSH_BIND_OPTIONS_LOG_VERBOSITY_STR
+  SSH_BIND_OPTIONS_LOG_VERBOSITY_STR,
+  SSH_BIND_OPTIONS_ECDSAKEY,
+  SSH_BIND_OPTIONS_REUSEPORT
 };
 
 typedef struct ssh_bind_struct* ssh_bind;
@@ -111,6 +113,10 @@ LIBSSH_API ssh_bind ssh_bind_new(void);
  *                This specifies the file containing the private host dsa key
  *                used by SSHv2. (const char *).
  *
+ *              - SSH_BIND_OPTIONS_ECDSAKEY
+ *                This specifies the file containing the private host ecdsa key
+ *                used by SSHv2. (const char *).
+ *
  *              - SSH_BIND_OPTIONS_BANNER
  *                That the server banner (version string) for SSH.
  *                (const char *).
@@ -224,6 +230,70 @@ LIBSSH_API void ssh_bind_fd_toaccept(ssh_bind ssh_bind_o);
  */
 LIBSSH_API int ssh_bind_accept(ssh_bind ssh_bind_o, ssh_session session);
 
+/**
+ * @brief Accept several pending connections in one call.
+ *
+ * Blocks until at least one connection arrives, like ssh_bind_accept(),
+ * and then drains the rest of the kernel's accept queue without
+ * blocking, initializing one preallocated session per connection. One
+ * wakeup per batch instead of one per connection is what keeps the
+ * acceptance rate up during reconnect storms. Combine with
+ * SSH_BIND_OPTIONS_REUSEPORT to let the kernel balance incoming
+ * connections across several processes sharing the port.
+ *
+ * @param  ssh_bind_o     The ssh server bind to accept connections on.
+ * @param  sessions       An array of preallocated ssh sessions.
+ * @param  count          The number of entries in the array.
+ * @see ssh_bind_accept
+ * @return The number of sessions established, at least 1, or SSH_ERROR
+ *         on error.
+ */
+LIBSSH_API int ssh_bind_accept_batch(ssh_bind ssh_bind_o,
+    ssh_session *sessions, int count);
+
+/**
+ * @brief Initialize a session for a connection accepted by the caller.
+ *
+ * This is the building block for multi-threaded server engines: one
+ * thread accepts on the bind socket (or on several, with SO_REUSEPORT)
+ * and hands each file descriptor to a worker thread, which calls this
+ * function and then drives the session from its own ssh_poll_ctx.
+ * Sessions share no mutable state once initialized, so workers only
+ * need the ssh_threads_callbacks_struct protection around the library
+ * globals.
+ *
+ * The session takes ownership of the file descriptor on success; on
+ * error the caller must close it.
+ *
+ * @param  ssh_bind_o     The ssh server bind holding the configuration.
+ * @param  session        A preallocated ssh session.
+ * @param  fd             A file descriptor of an already accepted
+ *                        connection.
+ * @see ssh_bind_accept
+ * @return SSH_OK when the session is set up
+ */
+LIBSSH_API int ssh_bind_accept_fd(ssh_bind ssh_bind_o, ssh_session session,
+    socket_t fd);
+
+/**
+ * @brief Wire a server session and a client session together in memory.
+ *
+ * Connects the two sessions over an in-process loopback transport
+ * instead of a socket, so tests and colocated services skip TCP (and
+ * the kernel) entirely. After this call, drive the client with
+ * ssh_connect() and the server with ssh_handle_key_exchange() from two
+ * threads, or interleave both in nonblocking mode from one.
+ *
+ * @param  ssh_bind_o     The ssh server bind holding the host keys and
+ *                        configuration. No listening socket is needed.
+ * @param  session        A preallocated ssh session for the server side.
+ * @param  client         A preallocated ssh session for the client side.
+ * @see ssh_bind_accept_fd
+ * @return SSH_OK when both sessions are wired, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_bind_accept_loopback(ssh_bind ssh_bind_o,
+    ssh_session session, ssh_session client);
+
 /**
  * @brief Handles the key exchange and set up encryption
  *
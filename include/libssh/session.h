@@ -62,6 +62,16 @@ enum ssh_pending_call_e {
 /* libssh calls may block an undefined amount of time */
 #define SSH_SESSION_FLAG_BLOCKING 1
 
+/* One outstanding SSH_MSG_GLOBAL_REQUEST expecting a reply. The server
+ * answers global requests in the order they were sent (RFC 4254 sec. 4),
+ * so a FIFO of these matches every SSH_MSG_REQUEST_SUCCESS/FAILURE to
+ * its request. See global_request() in channels.c. */
+struct ssh_global_req_struct {
+    struct ssh_global_req_struct *next;
+    char *name; /* request type, for logging and error messages */
+    enum ssh_channel_request_state_e state;
+};
+
 struct ssh_session_struct {
     struct error_struct error;
     struct ssh_socket_struct *socket;
@@ -73,6 +83,33 @@ struct ssh_session_struct {
     int openssh;
     uint32_t send_seq;
     uint32_t recv_seq;
+    /* reentry guard of the channel output scheduler */
+    int sched_flushing;
+    /* automatic rekeying, see ssh_client_rekey_check(). The limits are
+     * 0 when disabled; the basis fields snapshot the traffic counters
+     * and the clock at the last NEWKEYS. */
+    uint64_t rekey_limit_bytes;
+    uint64_t rekey_limit_seconds;
+    uint64_t rekey_basis_bytes;
+    struct ssh_timestamp rekey_since;
+    int rekeying;
+    int rekey_sent_kexinit;
+    enum ssh_session_state_e rekey_saved_state;
+    /* exchange hash of the first key exchange; it stays the session
+     * identifier for the key derivation of every later rekey */
+    unsigned char first_session_id[SHA256_DIGEST_LEN];
+    uint32_t first_session_id_len;
+/* performance counters, see ssh_get_stats() */
+    struct ssh_stats_struct stats;
+    struct ssh_timestamp stats_kex_start;
+    int stats_in_kex;
+    /* EWMA transport rate estimation, see ssh_rate_est_update() */
+    uint32_t rate_est_in;       /* inbound wire bytes per second */
+    uint32_t rate_est_in_acc;
+    struct ssh_timestamp rate_est_in_ts;
+    uint32_t rate_est_out;      /* outbound wire bytes per second */
+    uint32_t rate_est_out_acc;
+    struct ssh_timestamp rate_est_out_ts;
 /* status flags */
     int closed;
     int closed_by_except;
@@ -85,6 +122,27 @@ struct ssh_session_struct {
 
     /* session flags (SSH_SESSION_FLAG_*) */
     int flags;
+    /* cork mode: small packets pile up in the socket buffer until a
+     * flush, see ssh_set_cork() */
+    int corked;
+    /* batched random bytes for packet padding, see packet_send2() */
+    unsigned char pad_pool[1024];
+    uint32_t pad_pool_left;
+    /* deferred host key checking: the userauth service request is sent
+     * as soon as the key exchange ends so its round trip overlaps the
+     * caller's known_hosts lookup, and opening a channel before
+     * ssh_is_server_known() said SSH_SERVER_KNOWN_OK is an error. See
+     * SSH_OPTIONS_DEFERRED_HOSTKEY. */
+    int deferred_hostkey;
+    int hostkey_verified;
+    /* native keepalive: the poll context the session is scheduled on
+     * walks all its keepalive sessions with one timer tick, see
+     * ssh_keepalive_attach() */
+    int keepalive_interval; /* seconds, 0 to disable */
+    uint64_t keepalive_last_ms;
+    struct ssh_poll_ctx_struct *keepalive_ctx;
+    struct ssh_session_struct *keepalive_prev;
+    struct ssh_session_struct *keepalive_next;
 
     ssh_string banner; /* that's the issue banner from
                        the server */
@@ -102,16 +160,58 @@ struct ssh_session_struct {
     enum ssh_dh_state_e dh_handshake_state;
     enum ssh_auth_service_state_e auth_service_state;
     enum ssh_auth_state_e auth_state;
-    enum ssh_channel_request_state_e global_req_state;
+    /* FIFO of global requests awaiting their in-order reply */
+    struct ssh_global_req_struct *global_reqs;
+    struct ssh_global_req_struct *global_reqs_tail;
     ssh_string dh_server_signature; /* information used by dh_handshake. */
+    /* in-flight asynchronous publickey signature, see
+     * ssh_userauth_pubkey() */
+    struct ssh_sign_job_struct *sign_job;
+    /* partial userauth packet parked while the signature worker runs,
+     * keeping out_buffer free for keepalives and protocol replies */
+    ssh_buffer sign_packet;
     KEX server_kex;
     KEX client_kex;
+    /* pre-serialized server KEXINIT method lists handed over by the
+     * ssh_bind at accept time, see ssh_send_kex() */
+    ssh_buffer kexinit_methods_cache;
     ssh_buffer in_hashbuf;
     ssh_buffer out_hashbuf;
     struct ssh_crypto_struct *current_crypto;
+    /* out_crypto is the context the outbound direction encrypts with. It
+     * aliases current_crypto except between our NEWKEYS and the peer's
+     * during a rekey, where it already points at next_crypto so outbound
+     * traffic can resume before the inbound direction has switched.
+     * It never owns the struct; current_crypto/next_crypto do. */
+    struct ssh_crypto_struct *out_crypto;
     struct ssh_crypto_struct *next_crypto;  /* next_crypto is going to be used after a SSH2_MSG_NEWKEYS */
+    /* MAC offload worker, NULL unless ssh_session_set_crypto_offload()d */
+    struct ssh_crypt_worker_struct *crypt_worker;
+    /* session-wide token-bucket pacing, see ssh_session_set_rate_limit().
+     * The timer re-runs the scheduler while pacing holds back data. */
+    uint64_t rate_limit;       /* bytes per second, 0 when unlimited */
+    uint64_t rate_burst;       /* bucket capacity in bytes */
+    uint64_t rate_out_tokens;
+    uint64_t rate_in_tokens;
+    struct ssh_timestamp rate_out_since;
+    struct ssh_timestamp rate_in_since;
+    struct ssh_poll_timer_struct *pacing_timer;
+    /* microseconds of nonblocking polling before a blocking wait,
+     * see ssh_session_set_busy_poll(). 0 means go to sleep at once. */
+    int busy_poll_usec;
+    /* buffer memory cap, see ssh_session_set_memory_limit(). Above the
+     * cap grow_window() stops granting window, so the remote side
+     * stalls instead of buffers growing unbounded. 0 means uncapped. */
+    size_t memory_limit;
+    /* set while above the global high-water threshold, so the telemetry
+     * callback fires once per upward crossing */
+    int mem_highwater_notified;
 
     ssh_channel channels; /* linked list of channels */
+    /* lookup table indexed by local channel id, so per-packet demux does
+     * not need to walk the channel list. The list stays authoritative. */
+    ssh_channel *channel_table;
+    uint32_t channel_table_size;
     int maxchannel;
     int exec_channel_opened; /* version 1 only. more
                                 info in channels1.c */
@@ -120,13 +220,39 @@ struct ssh_session_struct {
 /* keyb interactive data */
     struct ssh_kbdint_struct *kbdint;
     int version; /* 1 or 2 */
+    /* hot path entry points, installed when the protocol version is
+     * decided so the shared callers never test version at runtime */
+    int (*packet_send_fn)(ssh_session session);
+    int (*channel_write_fn)(ssh_channel channel, const void *data,
+        uint32_t len, int is_stderr);
     /* server host keys */
     ssh_private_key rsa_key;
     ssh_private_key dsa_key;
+    ssh_private_key ecdsa_key;
     /* auths accepted by server */
     int auth_methods;
     int hostkeys; /* contains type of host key wanted by client, in server impl */
-    struct ssh_list *ssh_message_list; /* list of delayed SSH messages */
+    /* intrusive queue of delayed SSH messages, linked through the
+     * msg_prev/msg_next fields of the messages themselves. Queueing is
+     * off until ssh_message_get() asks for it or the first message is
+     * queued, mirroring the lazily created list it replaces. */
+    struct ssh_message_struct *msg_queue_head;
+    struct ssh_message_struct *msg_queue_tail;
+    int msg_queue_enabled;
+    /* depth bookkeeping of the message queue: total and per request type
+     * (SSH_REQUEST_AUTH..SSH_REQUEST_GLOBAL), so targeted scans bail out
+     * in O(1) when nothing of the type is queued and the cap can refuse
+     * floods, see ssh_message_queue() */
+    uint32_t msg_queue_depth;
+    uint32_t msg_queue_typecount[SSH_REQUEST_GLOBAL + 1];
+    uint32_t msg_queue_limit; /* 0 = unbounded */
+    /* per-listener FIFOs of pre-accepted incoming channels, see
+     * ssh_channel_accept_subscribe() */
+    struct ssh_list *accept_queues;
+    /* channels with an armed drain watermark, see
+     * ssh_channel_write_notify() */
+    int drain_watchers;
+    int drain_firing; /* reentrancy guard, callbacks may flush again */
     int (*ssh_message_callback)( struct ssh_session_struct *session, ssh_message msg, void *userdata);
     void *ssh_message_callback_data;
     int log_verbosity; /*cached copy of the option structure */
@@ -136,6 +262,20 @@ struct ssh_session_struct {
     ssh_callbacks callbacks; /* Callbacks to user functions */
     struct ssh_packet_callbacks_struct default_packet_callbacks;
     struct ssh_list *packet_callbacks;
+    /* flat per-type dispatch compiled from packet_callbacks so handling
+     * a packet is one indexed call; rebuilt lazily after the callback
+     * list changed. Types served by several callback structs keep the
+     * chained list walk, see ssh_packet_process(). */
+    struct {
+        ssh_packet_callback cb;
+        void *user;
+        int chained;
+    } packet_dispatch[256];
+    int packet_dispatch_valid;
+    /* application fast-path hooks tried before the regular handler,
+     * see ssh_packet_set_hook() */
+    ssh_packet_callback packet_hooks[256];
+    void *packet_hooks_user[256];
     struct ssh_socket_callbacks_struct socket_callbacks;
     ssh_poll_ctx default_poll_ctx;
     /* options */
@@ -147,10 +287,30 @@ struct ssh_session_struct {
     char *bindaddr; /* bind the client to an ip addr */
     char *xbanner; /* TODO: looks like it is not needed */
     struct ssh_list *identity;
+    /* shared frozen options this session borrows its strings from,
+     * see ssh_options_freeze() */
+    struct ssh_options_snapshot_struct *opts_snapshot;
     char *sshdir;
     char *knownhosts;
     char *wanted_methods[10];
     char compressionlevel;
+    /* set for the duration of one packet_send() when the payload is known
+     * to be incompressible, see channel_write_common() */
+    int compress_hint;
+    /* TCP tuning applied once the socket fd is known, see
+     * ssh_socket_set_tcp_options(). -1 (flags) and 0 (buffer sizes)
+     * leave the kernel defaults alone. */
+    int tcp_nodelay;
+    int tcp_keepalive;
+    int tcp_quickack;
+    int tcp_sndbuf;
+    int tcp_mss_align;
+    int tcp_rcvbuf;
+    int ip_tos; /* DSCP/TOS marking of the connection */
+    /* session-wide deadline every internal wait respects, see
+     * ssh_set_deadline() */
+    struct ssh_timestamp deadline_ts;
+    int deadline_ms; /* total budget in ms, -1 when no deadline is set */
     unsigned long timeout; /* seconds */
     unsigned long timeout_usec;
     unsigned int port;
@@ -171,5 +331,9 @@ int ssh_handle_packets(ssh_session session, int timeout);
 int ssh_handle_packets_termination(ssh_session session, int timeout,
     ssh_termination_function fct, void *user);
 void ssh_socket_exception_callback(int code, int errno_code, void *user);
+void ssh_client_rekey_check(ssh_session session);
+/* memory accounting, see ssh_get_memory_usage() */
+int ssh_memory_watch_active(ssh_session session);
+size_t ssh_memory_usage_update(ssh_session session);
 
 #endif /* SESSION_H_ */
@@ -62,8 +62,11 @@ extern "C" {
 #endif /* _WIN32 */
 
 typedef struct sftp_attributes_struct* sftp_attributes;
+typedef struct sftp_arena_struct* sftp_arena;
 typedef struct sftp_client_message_struct* sftp_client_message;
 typedef struct sftp_dir_struct* sftp_dir;
+typedef struct sftp_dir_bulk_struct* sftp_dir_bulk;
+typedef struct sftp_dir_entry_struct* sftp_dir_entry;
 typedef struct sftp_ext_struct *sftp_ext;
 typedef struct sftp_file_struct* sftp_file;
 typedef struct sftp_message_struct* sftp_message;
@@ -73,25 +76,64 @@ typedef struct sftp_session_struct* sftp_session;
 typedef struct sftp_status_message_struct* sftp_status_message;
 typedef struct sftp_statvfs_struct* sftp_statvfs_t;
 
+/* Number of buckets of the response hash table. Request ids are sequential
+ * so a power of two spreads them perfectly. */
+#define SFTP_QUEUE_BUCKETS 64
+
 struct sftp_session_struct {
     ssh_session session;
     ssh_channel channel;
     int server_version;
     int client_version;
     int version;
-    sftp_request_queue queue;
+    /* received responses hashed by request id, see sftp_enqueue() */
+    sftp_request_queue queue[SFTP_QUEUE_BUCKETS];
     uint32_t id_counter;
     int errnum;
     void **handles;
     sftp_ext ext;
+    /* server reply coalescing, see sftp_reply_cork() */
+    ssh_buffer reply_queue;
+    int reply_corked;
+    /* server side: sequential SSH_FXP_READ detection for
+     * sftp_reply_data_fd(), tracks where the last read ended */
+    int read_fd;
+    uint64_t read_next_offset;
+    /* client-side attribute cache, see sftp_attr_cache_enable() */
+    struct sftp_attr_cache_struct *attr_cache;
+    /* incremental frame reassembly of inbound sftp packets, fed from
+     * the channel without blocking; partial_need is the length of the
+     * frame under reassembly, 0 while its length prefix is incomplete.
+     * See sftp_packet_read(). */
+    ssh_buffer partial;
+    uint32_t partial_need;
+    /* transfer limits negotiated with limits@openssh.com, 0 when the
+     * server did not report them */
+    uint64_t limit_max_packet;
+    uint64_t limit_max_read;
+    uint64_t limit_max_write;
+    uint64_t limit_max_open_handles;
 };
 
+/* Number of buckets of the attribute cache hash table */
+#define SFTP_ATTR_CACHE_BUCKETS 64
+
+/* flush threshold for queued server replies */
+#define SFTP_REPLY_QUEUE_LIMIT (256 * 1024)
+
 struct sftp_packet_struct {
     sftp_session sftp;
     uint8_t type;
     ssh_buffer payload;
 };
 
+/* outstanding readahead request, see sftp_file_set_readahead() */
+struct sftp_ra_request_struct {
+    uint32_t id;
+    uint64_t offset;
+    uint32_t len;
+};
+
 /* file handler */
 struct sftp_file_struct {
     sftp_session sftp;
@@ -100,6 +142,20 @@ struct sftp_file_struct {
     ssh_string handle;
     int eof;
     int nonblocking;
+    /* readahead engine, disabled unless sftp_file_set_readahead() is used */
+    uint32_t ra_requests;                    /* requests kept in flight */
+    uint32_t ra_chunk;                       /* bytes per request */
+    struct sftp_ra_request_struct *ra_queue; /* ring of ra_requests entries */
+    uint32_t ra_head;
+    uint32_t ra_count;
+    ssh_buffer ra_buffer;                    /* received, unconsumed data */
+    char *ra_scratch;                        /* ra_chunk bytes staging area */
+    /* write pipelining, disabled unless sftp_file_set_write_window() is used */
+    uint32_t ww_requests;                    /* writes kept in flight */
+    uint32_t *ww_queue;                      /* ring of outstanding request ids */
+    uint32_t ww_head;
+    uint32_t ww_count;
+    int ww_error;                            /* first SSH_FX_* failure seen */
 };
 
 struct sftp_dir_struct {
@@ -111,6 +167,35 @@ struct sftp_dir_struct {
     int eof; /* end of directory listing */
 };
 
+/* one entry of a bulk directory listing, see sftp_dir_bulk_begin() */
+struct sftp_dir_entry_struct {
+    const char *name;     /* points into the batch arena */
+    const char *longname; /* ls -l output on openssh, not reliable else */
+    uint32_t flags;
+    uint8_t type;
+    uint64_t size;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t permissions;
+    uint32_t atime;
+    uint32_t mtime;
+};
+
+/* bulk directory enumeration cursor, see sftp_dir_bulk_begin() */
+struct sftp_dir_bulk_struct {
+    sftp_session sftp;
+    sftp_dir dir;
+    uint32_t n_requests;                     /* READDIRs kept in flight */
+    uint32_t *queue;                         /* ring of outstanding ids */
+    uint32_t head;
+    uint32_t pending;
+    struct sftp_dir_entry_struct *entries;   /* decoded current batch */
+    uint32_t entries_size;                   /* allocated entries */
+    uint32_t batch_count;
+    uint32_t batch_pos;
+    ssh_buffer arena;                        /* batch string storage */
+};
+
 struct sftp_message_struct {
     sftp_session sftp;
     uint8_t packet_type;
@@ -132,6 +217,9 @@ struct sftp_client_message_struct {
     int attr_num;
     ssh_buffer attrbuf; /* used by sftp_reply_attrs */
     ssh_string data; /* can be newpath of rename() */
+    /* when set, the struct, filename, handle and data share this single
+     * bump-allocated block, see sftp_get_client_message() */
+    sftp_arena arena;
 };
 
 struct sftp_request_queue_struct {
@@ -172,6 +260,9 @@ struct sftp_attributes_struct {
     uint32_t extended_count;
     ssh_string extended_type;
     ssh_string extended_data;
+    /* when set, the struct and all its strings live in this single
+     * bump-allocated block, see sftp_parse_attr() */
+    sftp_arena arena;
 };
 
 struct sftp_statvfs_struct {
@@ -321,6 +412,60 @@ LIBSSH_API sftp_attributes sftp_readdir(sftp_session session, sftp_dir dir);
  */
 LIBSSH_API int sftp_dir_eof(sftp_dir dir);
 
+/**
+ * @brief Start a bulk enumeration of an open directory.
+ *
+ * Unlike sftp_readdir(), which sends a new SSH_FXP_READDIR only once its
+ * current batch is exhausted, the bulk cursor keeps n_requests READDIRs
+ * in flight and decodes each reply into a single per-batch arena instead
+ * of allocating every entry separately. Use it for very large
+ * directories where one round trip per batch dominates.
+ *
+ * The directory must not be read with sftp_readdir() while a bulk cursor
+ * is active on it.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param dir           The directory handle returned by sftp_opendir().
+ *
+ * @param n_requests    Number of READDIR requests to keep in flight. 0
+ *                      selects a default.
+ *
+ * @return              A cursor to pass to sftp_dir_bulk_next(), NULL on
+ *                      error with ssh and sftp error set.
+ *
+ * @see                 sftp_dir_bulk_next()
+ * @see                 sftp_dir_bulk_free()
+ */
+LIBSSH_API sftp_dir_bulk sftp_dir_bulk_begin(sftp_session sftp, sftp_dir dir,
+    uint32_t n_requests);
+
+/**
+ * @brief Return the next entry of a bulk directory enumeration.
+ *
+ * The returned entry and its strings live in the cursor's batch arena:
+ * they stay valid until the next call that crosses a batch boundary or
+ * until sftp_dir_bulk_free(), so copy out anything you keep.
+ *
+ * @param bulk          The cursor from sftp_dir_bulk_begin().
+ *
+ * @return              The next entry, NULL at end of directory or on
+ *                      error. Check sftp_dir_eof() to tell the two
+ *                      apart.
+ */
+LIBSSH_API sftp_dir_entry sftp_dir_bulk_next(sftp_dir_bulk bulk);
+
+/**
+ * @brief Release a bulk enumeration cursor.
+ *
+ * Outstanding READDIR replies are drained and discarded. The directory
+ * handle itself stays open and must still be closed with
+ * sftp_closedir().
+ *
+ * @param bulk          The cursor from sftp_dir_bulk_begin().
+ */
+LIBSSH_API void sftp_dir_bulk_free(sftp_dir_bulk bulk);
+
 /**
  * @brief Get information about a file or directory.
  *
@@ -348,6 +493,23 @@ LIBSSH_API sftp_attributes sftp_stat(sftp_session session, const char *path);
  */
 LIBSSH_API sftp_attributes sftp_lstat(sftp_session session, const char *path);
 
+/**
+ * @brief Enable or disable the client-side attribute cache.
+ *
+ * With the cache enabled, sftp_stat() and sftp_lstat() answer repeated
+ * lookups of the same path from memory for up to ttl_ms milliseconds
+ * instead of doing a round trip. Mutating operations done through this
+ * sftp session invalidate the affected paths immediately; changes made
+ * by other clients are only bounded by the TTL.
+ *
+ * @param sftp          The sftp session handle.
+ * @param ttl_ms        Lifetime of a cached entry in milliseconds, 0
+ *                      disables and empties the cache.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+LIBSSH_API int sftp_attr_cache_enable(sftp_session sftp, int ttl_ms);
+
 /**
  * @brief Get information about a file or directory from a file handle.
  *
@@ -432,6 +594,124 @@ LIBSSH_API void sftp_file_set_blocking(sftp_file handle);
  */
 LIBSSH_API ssize_t sftp_read(sftp_file file, void *buf, size_t count);
 
+/**
+ * @brief Enable pipelined readahead on an open file.
+ *
+ * Keeps up to n_requests SSH_FXP_READ requests of chunk_size bytes in
+ * flight and makes plain sftp_read() serve from the prefetched data, so
+ * sequential transfers are no longer bound by one round trip per chunk.
+ * Only useful for sequential reads; the prefetched data is dropped if the
+ * file offset is changed with sftp_seek() or sftp_rewind().
+ *
+ * @param file          The opened sftp file handle.
+ *
+ * @param n_requests    Number of requests to keep in flight. 0 disables
+ *                      readahead and drains pending requests.
+ *
+ * @param chunk_size    Size in bytes of each request. 0 selects a default
+ *                      suitable for most servers (32KB).
+ *
+ * @return              0 on success, < 0 on error with ssh and sftp error
+ *                      set.
+ */
+LIBSSH_API int sftp_file_set_readahead(sftp_file file, uint32_t n_requests,
+    uint32_t chunk_size);
+
+/**
+ * @brief Allow several sftp_write() requests to be in flight at once.
+ *
+ * By default sftp_write() waits for the server's status reply before it
+ * returns, which limits uploads to one chunk per round trip. With a write
+ * window of n_requests, sftp_write() returns as soon as the data has been
+ * sent and only blocks when n_requests writes are still unacknowledged.
+ *
+ * Server errors are reported by a later sftp_write() or by
+ * sftp_file_flush(). Call sftp_file_flush() before reading back a region
+ * that has just been written; sftp_close() drains the window implicitly.
+ *
+ * @param file          The opened sftp file handle.
+ *
+ * @param n_requests    Number of writes to keep in flight. 0 restores the
+ *                      synchronous behavior and drains pending writes.
+ *
+ * @return              0 on success, < 0 on error with ssh and sftp error
+ *                      set.
+ */
+LIBSSH_API int sftp_file_set_write_window(sftp_file file, uint32_t n_requests);
+
+/**
+ * @brief Wait until every outstanding write on the file has been
+ * acknowledged by the server.
+ *
+ * @param file          The opened sftp file handle.
+ *
+ * @return              0 on success, < 0 if a pending write failed, with
+ *                      ssh and sftp error set.
+ */
+LIBSSH_API int sftp_file_flush(sftp_file file);
+
+/**
+ * @brief Download a file over several sftp sessions at once.
+ *
+ * The remote file is split into one contiguous range per session and the
+ * ranges are fetched in parallel. Sessions on separate ssh connections
+ * additionally spread the cipher load over several cores. Each session
+ * must be dedicated to the call for its duration; without thread support
+ * the ranges run one after the other.
+ *
+ * @param sftps         Array of initialized sftp sessions.
+ *
+ * @param count         Number of sessions in the array, at least 1.
+ *
+ * @param remotefile    The file to download.
+ *
+ * @param localfile     The local path to write, created or truncated.
+ *
+ * @param mode          Permissions for the local file if it is created.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if any range failed.
+ */
+LIBSSH_API int sftp_parallel_get(sftp_session *sftps, int count,
+    const char *remotefile, const char *localfile, mode_t mode);
+
+/**
+ * @brief Upload a file over several sftp sessions at once.
+ *
+ * The counterpart of sftp_parallel_get(), the same session rules apply.
+ *
+ * @param sftps         Array of initialized sftp sessions.
+ *
+ * @param count         Number of sessions in the array, at least 1.
+ *
+ * @param localfile     The file to upload.
+ *
+ * @param remotefile    The remote path to write, created or truncated.
+ *
+ * @param mode          Permissions for the remote file if it is created.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if any range failed.
+ */
+LIBSSH_API int sftp_parallel_put(sftp_session *sftps, int count,
+    const char *localfile, const char *remotefile, mode_t mode);
+
+/**
+ * @brief Download the rest of an open remote file straight to a local
+ * file descriptor.
+ *
+ * Read responses are pipelined and each payload is written with
+ * pwrite() at its remote offset directly from the parsed packet, with
+ * no intermediate buffer. The transfer starts at the current position
+ * of the remote file and writes at the same offsets in fd.
+ *
+ * @param file          The open remote file to read.
+ *
+ * @param fd            A local file descriptor open for writing.
+ *
+ * @return              The number of bytes transferred, SSH_ERROR on
+ *                      error. Not supported on Windows.
+ */
+LIBSSH_API ssize_t sftp_get_to_fd(sftp_file file, int fd);
+
 /**
  * @brief Start an asynchronous read from a file using an opened sftp file handle.
  *
@@ -722,6 +1002,37 @@ LIBSSH_API sftp_statvfs_t sftp_fstatvfs(sftp_file file);
  */
 LIBSSH_API void sftp_statvfs_free(sftp_statvfs_t statvfs_o);
 
+/**
+ * @brief Create a hard link on the server.
+ *
+ * Uses the hardlink@openssh.com extension; check sftp->ext or call this
+ * and look for SSH_REQUEST_DENIED when the server does not advertise it.
+ *
+ * @param  sftp         The sftp session handle.
+ *
+ * @param  oldpath      The path of the existing file.
+ *
+ * @param  newpath      The path of the link to create.
+ *
+ * @return              0 on success, < 0 on error with ssh and sftp
+ *                      error set.
+ */
+LIBSSH_API int sftp_hardlink(sftp_session sftp, const char *oldpath,
+    const char *newpath);
+
+/**
+ * @brief Flush an open file to disk on the server.
+ *
+ * Uses the fsync@openssh.com extension; servers that do not advertise
+ * it make this fail with SSH_REQUEST_DENIED.
+ *
+ * @param  file         An opened file.
+ *
+ * @return              0 on success, < 0 on error with ssh and sftp
+ *                      error set.
+ */
+LIBSSH_API int sftp_fsync(sftp_file file);
+
 /**
  * @brief Canonicalize a sftp path.
  *
@@ -771,6 +1082,12 @@ int sftp_packet_write(sftp_session sftp,uint8_t type, ssh_buffer payload);
 void sftp_packet_free(sftp_packet packet);
 int buffer_add_attributes(ssh_buffer buffer, sftp_attributes attr);
 sftp_attributes sftp_parse_attr(sftp_session session, ssh_buffer buf,int expectname);
+/* per-message bump allocator, released with one free of the arena */
+sftp_arena sftp_arena_new(size_t size);
+void *sftp_arena_alloc(sftp_arena arena, size_t len);
+char *sftp_arena_strdup(sftp_arena arena, const char *str);
+char *sftp_arena_get_string_char(sftp_arena arena, ssh_buffer buf);
+ssh_string sftp_arena_get_string(sftp_arena arena, ssh_buffer buf);
 /* sftpserver.c */
 
 sftp_client_message sftp_get_client_message(sftp_session sftp);
@@ -786,7 +1103,14 @@ int sftp_reply_names_add(sftp_client_message msg, const char *file,
     const char *longname, sftp_attributes attr);
 int sftp_reply_names(sftp_client_message msg);
 int sftp_reply_data(sftp_client_message msg, const void *data, int len);
+/* sftp_reply_data_fd reads the file bytes straight into the reply packet
+ * and primes kernel readahead for sequential readers; returns the number
+ * of bytes sent, 0 on end of file, < 0 on error */
+int sftp_reply_data_fd(sftp_client_message msg, int fd, uint64_t offset,
+    uint32_t len);
 void sftp_handle_remove(sftp_session sftp, void *handle);
+void sftp_reply_cork(sftp_session sftp);
+int sftp_reply_flush(sftp_session sftp);
 
 /* SFTP commands and constants */
 #define SSH_FXP_INIT 1
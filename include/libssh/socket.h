@@ -29,20 +29,35 @@ struct ssh_poll_handle_struct;
 struct ssh_socket_struct;
 typedef struct ssh_socket_struct* ssh_socket;
 
+/* in-process loopback transport, see ssh_bind_accept_loopback() */
+struct ssh_loopback_pair_struct;
+typedef struct ssh_loopback_pair_struct* ssh_loopback_pair;
+
 int ssh_socket_init(void);
 void ssh_socket_cleanup(void);
 ssh_socket ssh_socket_new(ssh_session session);
 void ssh_socket_reset(ssh_socket s);
 void ssh_socket_free(ssh_socket s);
 void ssh_socket_set_fd(ssh_socket s, socket_t fd);
+int ssh_socket_get_mss(ssh_socket s);
 socket_t ssh_socket_get_fd_in(ssh_socket s);
 #ifndef _WIN32
 int ssh_socket_unix(ssh_socket s, const char *path);
 void ssh_execute_command(const char *command, socket_t in, socket_t out);
 int ssh_socket_connect_proxycommand(ssh_socket s, const char *command);
+ssh_loopback_pair ssh_loopback_pair_new(void);
+void ssh_loopback_pair_unref(ssh_loopback_pair pair);
+int ssh_socket_loopback_attach(ssh_socket s, ssh_loopback_pair pair, int side);
 #endif
+int ssh_socket_is_loopback(ssh_socket s);
+void ssh_socket_loopback_kick(ssh_socket s);
 void ssh_socket_close(ssh_socket s);
+void ssh_socket_set_tcp_options(ssh_socket s);
+void ssh_socket_set_read_hint(ssh_socket s, uint32_t len);
 int ssh_socket_write(ssh_socket s,const void *buffer, int len);
+
+int ssh_socket_write_iov(ssh_socket s, const struct ssh_iovec_struct *iov,
+    int count);
 int ssh_socket_is_open(ssh_socket s);
 int ssh_socket_fd_isset(ssh_socket s, fd_set *set);
 void ssh_socket_fd_set(ssh_socket s, fd_set *set, socket_t *max_fd);
@@ -61,6 +76,7 @@ void ssh_socket_set_callbacks(ssh_socket s, ssh_socket_callbacks callbacks);
 int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int revents, void *v_s);
 struct ssh_poll_handle_struct * ssh_socket_get_poll_handle_in(ssh_socket s);
 struct ssh_poll_handle_struct * ssh_socket_get_poll_handle_out(ssh_socket s);
+struct ssh_poll_handle_struct * ssh_socket_get_race_poll(ssh_socket s);
 
 int ssh_socket_connect(ssh_socket s, const char *host, int port, const char *bind_addr);
 
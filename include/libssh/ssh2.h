@@ -14,6 +14,9 @@
 #define SSH2_MSG_KEXDH_INIT 30
 #define SSH2_MSG_KEXDH_REPLY 31
 
+#define SSH2_MSG_KEX_ECDH_INIT 30
+#define SSH2_MSG_KEX_ECDH_REPLY 31
+
 #define SSH2_MSG_KEX_DH_GEX_REQUEST_OLD 30
 #define SSH2_MSG_KEX_DH_GEX_GROUP 31
 #define SSH2_MSG_KEX_DH_GEX_INIT 32
@@ -39,4 +39,36 @@ __attribute__ ((packed))
 #endif
 ;
 
+void ssh_string_freelist_flush(void);
+
+/*
+ * Inline fast paths for the hottest getters. Packet parsing makes
+ * millions of these calls per second at line rate and each one was a
+ * real call through the PLT. The exported out-of-line definitions in
+ * string.c remain for the ABI; string.c defines SSH_GETTERS_NO_INLINE
+ * so they are not shadowed there.
+ */
+#if !defined(SSH_GETTERS_NO_INLINE) && !defined(_WIN32)
+#include <arpa/inet.h>
+
+static inline size_t ssh_string_len_inline(struct ssh_string_struct *s) {
+  if (s == NULL) {
+    return 0;
+  }
+
+  return ntohl(s->size);
+}
+
+static inline void *ssh_string_data_inline(struct ssh_string_struct *s) {
+  if (s == NULL) {
+    return NULL;
+  }
+
+  return s->string;
+}
+
+#define ssh_string_len(s) ssh_string_len_inline(s)
+#define ssh_string_data(s) ssh_string_data_inline(s)
+#endif /* SSH_GETTERS_NO_INLINE */
+
 #endif /* STRING_H_ */
@@ -33,11 +33,20 @@ SHACTX sha1_init(void);
 void sha1_update(SHACTX c, const void *data, unsigned long len);
 void sha1_final(unsigned char *md,SHACTX c);
 void sha1(unsigned char *digest,int len,unsigned char *hash);
+SHA256CTX sha256_init(void);
+void sha256_update(SHA256CTX c, const void *data, unsigned long len);
+void sha256_final(unsigned char *md,SHA256CTX c);
+void sha256(unsigned char *digest, int len, unsigned char *hash);
 #define HMAC_SHA1 1
 #define HMAC_MD5 2
 HMACCTX hmac_init(const void *key,int len,int type);
 void hmac_update(HMACCTX c, const void *data, unsigned long len);
 void hmac_final(HMACCTX ctx,unsigned char *hashmacbuf,unsigned int *len);
+void hmac_final_reset(HMACCTX ctx,unsigned char *hashmacbuf,unsigned int *len);
+void hmac_free(HMACCTX ctx);
+
+/* 1 when the CPU hashes SHA in hardware (SHA-NI), see wrapper.c */
+int ssh_digest_accel(void);
 
 int crypt_set_algorithms(ssh_session );
 int crypt_set_algorithms_server(ssh_session session);
@@ -47,6 +47,8 @@
 #include <arpa/inet.h>
 #endif
 
+#include <sys/socket.h>
+
 #include "libssh/agent.h"
 #include "libssh/priv.h"
 #include "libssh/socket.h"
@@ -54,12 +56,59 @@
 #include "libssh/session.h"
 #include "libssh/keys.h"
 #include "libssh/poll.h"
+#include "libssh/misc.h"
 
 /* macro to check for "agent failure" message */
 #define agent_failed(x) \
   (((x) == SSH_AGENT_FAILURE) || ((x) == SSH_COM_AGENT2_FAILURE) || \
    ((x) == SSH2_AGENT_FAILURE))
 
+#if defined(__GNUC__)
+#define HAVE_AGENT_CACHE
+#endif
+
+#ifdef HAVE_AGENT_CACHE
+
+/* how long a fetched identity list stays valid */
+#define AGENT_IDENT_CACHE_TTL 1000
+
+/* One agent serves the whole machine, so there is no point in opening a
+ * fresh connection and re-fetching the identity list for every session.
+ * The connection and the last identities answer are cached per thread;
+ * the connection is handed to sessions as a dup() of the cached fd, and
+ * the identity list expires after AGENT_IDENT_CACHE_TTL milliseconds so
+ * added or removed keys are picked up.
+ */
+static __thread int agent_cache_fd = -1;
+static __thread char *agent_cache_path;
+static __thread ssh_buffer agent_cache_ident;
+static __thread unsigned int agent_cache_count;
+static __thread struct ssh_timestamp agent_cache_stamp;
+
+static void agent_ident_cache_invalidate(void) {
+  if (agent_cache_ident) {
+    ssh_buffer_free(agent_cache_ident);
+    agent_cache_ident = NULL;
+  }
+  agent_cache_count = 0;
+}
+
+void ssh_agent_cache_flush(void) {
+  if (agent_cache_fd >= 0) {
+    close(agent_cache_fd);
+    agent_cache_fd = -1;
+  }
+  SAFE_FREE(agent_cache_path);
+  agent_ident_cache_invalidate();
+}
+
+#else /* HAVE_AGENT_CACHE */
+
+void ssh_agent_cache_flush(void) {
+}
+
+#endif /* HAVE_AGENT_CACHE */
+
 static uint32_t agent_get_u32(const void *vp) {
   const uint8_t *p = (const uint8_t *)vp;
   uint32_t v;
@@ -95,7 +144,12 @@ static size_t atomicio(ssh_socket s, void *buf, size_t n, int do_read) {
     if (do_read) {
       res = read(fd, b + pos, n - pos);
     } else {
+#ifdef MSG_NOSIGNAL
+      /* a dead agent must show up as EPIPE, not as SIGPIPE */
+      res = send(fd, b + pos, n - pos, MSG_NOSIGNAL);
+#else
       res = write(fd, b + pos, n - pos);
+#endif
     }
     switch (res) {
       case -1:
@@ -166,6 +220,9 @@ void agent_free(ssh_agent agent) {
 
 static int agent_connect(ssh_session session) {
   const char *auth_sock = NULL;
+#ifdef HAVE_AGENT_CACHE
+  socket_t fd;
+#endif
 
   if (session == NULL || session->agent == NULL) {
     return -1;
@@ -174,9 +231,36 @@ static int agent_connect(ssh_session session) {
   auth_sock = getenv("SSH_AUTH_SOCK");
 
   if (auth_sock && *auth_sock) {
+#ifdef HAVE_AGENT_CACHE
+    if (agent_cache_fd >= 0 && agent_cache_path != NULL &&
+        strcmp(agent_cache_path, auth_sock) == 0) {
+      fd = dup(agent_cache_fd);
+      if (fd >= 0) {
+        ssh_socket_set_fd(session->agent->sock, fd);
+        session->agent->from_cache = 1;
+        return 0;
+      }
+    }
+#endif
     if (ssh_socket_unix(session->agent->sock, auth_sock) < 0) {
       return -1;
     }
+#ifdef HAVE_AGENT_CACHE
+    /* park a duplicate so the next session skips the connect */
+    session->agent->from_cache = 0;
+    if (agent_cache_fd >= 0) {
+      close(agent_cache_fd);
+    }
+    SAFE_FREE(agent_cache_path);
+    agent_cache_fd = dup(ssh_socket_get_fd_in(session->agent->sock));
+    if (agent_cache_fd >= 0) {
+      agent_cache_path = strdup(auth_sock);
+      if (agent_cache_path == NULL) {
+        close(agent_cache_fd);
+        agent_cache_fd = -1;
+      }
+    }
+#endif
     return 0;
   }
 
@@ -203,13 +287,12 @@ static int agent_decode_reply(struct ssh_session_struct *session, int type) {
 }
 #endif
 
-static int agent_talk(struct ssh_session_struct *session,
-    struct ssh_buffer_struct *request, struct ssh_buffer_struct *reply) {
+static int agent_send_request(struct ssh_session_struct *session,
+    struct ssh_buffer_struct *request) {
   uint32_t len = 0;
-  uint8_t payload[1024] = {0};
+  uint8_t payload[4] = {0};
 
   len = buffer_get_rest_len(request);
-  ssh_log(session, SSH_LOG_PACKET, "agent_talk - len of request: %u", len);
   agent_put_u32(payload, len);
 
   /* send length and then the request packet */
@@ -227,6 +310,37 @@ static int agent_talk(struct ssh_session_struct *session,
     return -1;
   }
 
+  return 0;
+}
+
+static int agent_talk(struct ssh_session_struct *session,
+    struct ssh_buffer_struct *request, struct ssh_buffer_struct *reply) {
+  uint32_t len = 0;
+  uint8_t payload[1024] = {0};
+
+  ssh_log(session, SSH_LOG_PACKET, "agent_talk - len of request: %u",
+      buffer_get_rest_len(request));
+
+  if (agent_send_request(session, request) < 0) {
+#ifdef HAVE_AGENT_CACHE
+    if (session->agent->from_cache) {
+      /* the agent may have been restarted since the connection was
+       * cached; reconnect and try once more */
+      ssh_log(session, SSH_LOG_PROTOCOL,
+          "Cached agent connection is dead, reconnecting");
+      ssh_socket_close(session->agent->sock);
+      ssh_agent_cache_flush();
+      if (agent_connect(session) < 0 ||
+          agent_send_request(session, request) < 0) {
+        return -1;
+      }
+    } else
+#endif
+    {
+      return -1;
+    }
+  }
+
   /* wait for response, read the length of the response packet */
   if (atomicio(session->agent->sock, payload, 4, 1) != 4) {
     ssh_log(session, SSH_LOG_PACKET, "atomicio read response length failed: %s",
@@ -283,6 +397,27 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
       return 0;
   }
 
+#ifdef HAVE_AGENT_CACHE
+  /* serve the identity list from the cache while it is fresh */
+  if (session->version == 2 && agent_cache_ident != NULL &&
+      !ssh_timeout_elapsed(&agent_cache_stamp, AGENT_IDENT_CACHE_TTL)) {
+    reply = ssh_buffer_new();
+    if (reply != NULL &&
+        buffer_add_data(reply, buffer_get_rest(agent_cache_ident),
+          buffer_get_rest_len(agent_cache_ident)) == 0) {
+      ssh_log(session, SSH_LOG_PACKET,
+          "agent_ident_count - %u identities from cache", agent_cache_count);
+      if (session->agent->ident) {
+        ssh_buffer_free(session->agent->ident);
+      }
+      session->agent->ident = reply;
+      session->agent->count = agent_cache_count;
+      return session->agent->count;
+    }
+    ssh_buffer_free(reply);
+  }
+#endif
+
   /* send message to the agent requesting the list of identities */
   request = ssh_buffer_new();
   if (buffer_add_u8(request, c1) < 0) {
@@ -327,8 +462,24 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
     return -1;
   }
 
+#ifdef HAVE_AGENT_CACHE
+  if (session->version == 2) {
+    agent_ident_cache_invalidate();
+    agent_cache_ident = ssh_buffer_new();
+    if (agent_cache_ident != NULL) {
+      if (buffer_add_data(agent_cache_ident, buffer_get_rest(reply),
+            buffer_get_rest_len(reply)) == 0) {
+        agent_cache_count = session->agent->count;
+        ssh_timestamp_init(&agent_cache_stamp);
+      } else {
+        agent_ident_cache_invalidate();
+      }
+    }
+  }
+#endif
+
   if (session->agent->ident) {
-    buffer_reinit(session->agent->ident);
+    ssh_buffer_free(session->agent->ident);
   }
   session->agent->ident = reply;
 
@@ -457,6 +608,10 @@ ssh_string agent_sign_data(struct ssh_session_struct *session,
   }
   if (agent_failed(type)) {
     ssh_log(session, SSH_LOG_RARE, "Agent reports failure in signing the key");
+#ifdef HAVE_AGENT_CACHE
+    /* the key we offered has probably been removed from the agent */
+    agent_ident_cache_invalidate();
+#endif
     ssh_buffer_free(reply);
     return NULL;
   } else if (type != SSH2_AGENT_SIGN_RESPONSE) {
@@ -69,8 +69,8 @@ static int ask_userauth(ssh_session session) {
   do {
   	rc=ssh_service_request(session,"ssh-userauth");
   	if(ssh_is_blocking(session)){
-  	  if(rc==SSH_AGAIN)
-  	    ssh_handle_packets(session,-1);
+  	  if(rc==SSH_AGAIN && ssh_handle_packets(session,-1) != SSH_OK)
+  	    break;
   	} else {
   	  /* nonblocking */
   	  ssh_handle_packets(session,0);
@@ -167,6 +167,10 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_failure){
     session->auth_methods |= SSH_AUTH_METHOD_HOSTBASED;
   }
 
+  /* remember the mask so a reconnection to this server can skip the
+   * "none" probe, see ssh_reconnect_cache_enable() */
+  ssh_reconnect_cache_set_auth_methods(session, session->auth_methods);
+
 end:
   ssh_string_free(auth);
   SAFE_FREE(auth_methods);
@@ -255,11 +259,17 @@ static int wait_auth_status(ssh_session session) {
   enter_function();
 
   if(ssh_is_blocking(session)){
-    if(ssh_handle_packets_termination(session,-1,auth_status_termination,
-        session) == SSH_ERROR){
+    rc = ssh_handle_packets_termination(session,-1,auth_status_termination,
+        session);
+    if (rc == SSH_ERROR) {
       leave_function();
       return SSH_AUTH_ERROR;
     }
+    if (rc == SSH_AGAIN) {
+      /* session deadline ran out before the server answered */
+      leave_function();
+      return SSH_AUTH_AGAIN;
+    }
   } else {
     if(ssh_handle_packets(session, 0) == SSH_ERROR){
       leave_function();
@@ -327,6 +337,10 @@ int ssh_userauth_list(ssh_session session, const char *username) {
     return SSH_AUTH_METHOD_PASSWORD;
   }
 #endif
+  if (session->auth_methods == 0) {
+    /* a previous connection to this server may already know the answer */
+    session->auth_methods = ssh_reconnect_cache_get_auth_methods(session);
+  }
   if (session->auth_methods == 0) {
     ssh_userauth_none(session, username);
   }
@@ -685,6 +699,9 @@ int ssh_userauth_pubkey(ssh_session session, const char *username,
   case SSH_PENDING_CALL_AUTH_PUBKEY:
     ssh_string_free(user);
     user=NULL;
+    if (ssh_sign_job_pending(session)) {
+      goto signing;
+    }
     goto pending;
   default:
     ssh_set_error(session,SSH_FATAL,"Bad call during pending SSH call in ssh_userauth_pubkey");
@@ -748,13 +765,68 @@ int ssh_userauth_pubkey(ssh_session session, const char *username,
   ssh_string_free(algo);
   ssh_string_free(pkstr);
 
+  if (!ssh_is_blocking(session)) {
+    /* hand the modular exponentiation to a worker so the poll loop
+     * stays responsive; the partial userauth packet is parked aside,
+     * keeping out_buffer usable for keepalives and protocol replies
+     * built while we wait for the signature */
+    switch (ssh_sign_job_start(session, session->out_buffer, privatekey)) {
+    case SSH_AGAIN:
+      session->sign_packet = session->out_buffer;
+      session->out_buffer = ssh_buffer_new();
+      if (session->out_buffer == NULL) {
+        /* no spare buffer; take the packet back and sign in place */
+        session->out_buffer = session->sign_packet;
+        session->sign_packet = NULL;
+        ssh_sign_job_abort(session);
+        break;
+      }
+      session->pending_call_state=SSH_PENDING_CALL_AUTH_PUBKEY;
+      leave_function();
+      return SSH_AUTH_AGAIN;
+    case SSH_ERROR:
+      leave_function();
+      return rc;
+    default: /* no worker available, sign in place */
+      break;
+    }
+  }
+
   sign = ssh_do_sign(session,session->out_buffer, privatekey);
   if(sign == NULL) {
     ssh_set_error_oom(session);
     leave_function();
     return rc;
   }
+  goto have_sign;
+
+signing:
+  if (ssh_sign_job_done(session) == 0) {
+    leave_function();
+    return SSH_AUTH_AGAIN;
+  }
+  sign = ssh_sign_job_finish(session);
+  if (session->sign_packet != NULL) {
+    /* put the parked packet back under construction; out_buffer is
+     * empty between dispatches so the signature lands right after it */
+    if (sign != NULL &&
+        buffer_add_data(session->out_buffer,
+          buffer_get_rest(session->sign_packet),
+          buffer_get_rest_len(session->sign_packet)) < 0) {
+      ssh_set_error_oom(session);
+      ssh_string_free(sign);
+      sign = NULL;
+    }
+    ssh_buffer_free(session->sign_packet);
+    session->sign_packet = NULL;
+  }
+  if (sign == NULL) {
+    session->pending_call_state=SSH_PENDING_CALL_NONE;
+    leave_function();
+    return rc;
+  }
 
+have_sign:
   if (buffer_add_ssh_string(session->out_buffer,sign) < 0) {
     ssh_set_error_oom(session);
     ssh_string_free(sign);
@@ -1346,6 +1418,13 @@ int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
 
   enter_function();
 
+  /* if a previous connection already saw this server deny "none" and
+   * advertise its methods, seed the mask: the probe below then returns
+   * SSH_AUTH_DENIED without a round trip */
+  if (session->auth_methods == 0) {
+    session->auth_methods = ssh_reconnect_cache_get_auth_methods(session);
+  }
+
   /* Always test none authentication */
   rc = ssh_userauth_none(session, NULL);
   if (rc == SSH_AUTH_ERROR || rc == SSH_AUTH_SUCCESS) {
@@ -1353,6 +1432,15 @@ int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
     return rc;
   }
 
+  /* no point offering keys to a server which does not accept publickey */
+  if (session->auth_methods != 0 &&
+      (session->auth_methods & SSH_AUTH_METHOD_PUBLICKEY) == 0) {
+    ssh_log(session, SSH_LOG_PROTOCOL,
+        "Server does not accept publickey authentication");
+    leave_function();
+    return SSH_AUTH_DENIED;
+  }
+
   /* Try authentication with ssh-agent first */
 #ifndef _WIN32
   if (agent_is_running(session)) {
@@ -1418,6 +1506,27 @@ int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
 #endif
 
 
+  /* an identity that already authenticated against this server is worth
+   * trying first: every refused offer below costs a round trip */
+  {
+    const char *last = ssh_reconnect_cache_get_identity(session);
+
+    if (last != NULL) {
+      for (it = ssh_list_get_iterator(session->identity);
+           it != NULL;
+           it = it->next) {
+        if (strcmp((const char *)it->data, last) == 0) {
+          if (it != ssh_list_get_iterator(session->identity)) {
+            const void *data = it->data;
+            ssh_list_remove(session->identity, it);
+            ssh_list_prepend(session->identity, data);
+          }
+          break;
+        }
+      }
+    }
+  }
+
   for (it = ssh_list_get_iterator(session->identity);
        it != NULL;
        it = it->next) {
@@ -1525,6 +1634,7 @@ int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
     /* auth success */
     ssh_log(session, SSH_LOG_PROTOCOL,
         "Successfully authenticated using %s", privkey_file);
+    ssh_reconnect_cache_set_identity(session, privkey_file);
     ssh_string_free(pubkey_string);
     privatekey_free(privkey);
 
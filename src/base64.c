@@ -33,6 +33,44 @@ static char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                          "abcdefghijklmnopqrstuvwxyz"
                          "0123456789+/";
 
+/* Maps a base64 character to its 6 bit value, 0xff marks invalid chars.
+ * A direct lookup replaces the strchr() walk over the alphabet which
+ * dominated decoding time. */
+static const unsigned char revalphabet[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff,   62, 0xff, 0xff, 0xff,   63,
+    52,   53,   54,   55,   56,   57,   58,   59,
+    60,   61, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff,    0,    1,    2,    3,    4,    5,    6,
+     7,    8,    9,   10,   11,   12,   13,   14,
+    15,   16,   17,   18,   19,   20,   21,   22,
+    23,   24,   25, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff,   26,   27,   28,   29,   30,   31,   32,
+    33,   34,   35,   36,   37,   38,   39,   40,
+    41,   42,   43,   44,   45,   46,   47,   48,
+    49,   50,   51, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
 /* Transformations */
 #define SET_A(n, i) do { (n) |= ((i) & 63) <<18; } while (0)
 #define SET_B(n, i) do { (n) |= ((i) & 63) <<12; } while (0)
@@ -85,14 +123,22 @@ ssh_buffer base64_to_bin(const char *source) {
 
   len = strlen(ptr);
   while (len > 4) {
-    if (_base64_to_bin(block, ptr, 3) < 0) {
-      goto error;
+    /* Decode a batch of blocks before appending, so the buffer is not
+     * grown 3 bytes at a time. */
+    unsigned char chunk[3 * 256];
+    size_t chunklen = 0;
+
+    while (len > 4 && chunklen < sizeof(chunk)) {
+      if (_base64_to_bin(chunk + chunklen, ptr, 3) < 0) {
+        goto error;
+      }
+      chunklen += 3;
+      len -= 4;
+      ptr += 4;
     }
-    if (buffer_add_data(buffer, block, 3) < 0) {
+    if (buffer_add_data(buffer, chunk, chunklen) < 0) {
       goto error;
     }
-    len -= 4;
-    ptr += 4;
   }
 
   /*
@@ -166,15 +212,13 @@ error:
   return NULL;
 }
 
-#define BLOCK(letter, n) do {ptr = strchr(alphabet, source[n]); \
-                             if(!ptr) return -1; \
-                             i = ptr - alphabet; \
+#define BLOCK(letter, n) do {i = revalphabet[(unsigned char) source[n]]; \
+                             if(i > 63) return -1; \
                              SET_##letter(*block, i); \
                          } while(0)
 
 /* Returns 0 if ok, -1 if not (ie invalid char into the stuff) */
 static int to_block4(unsigned long *block, const char *source, int num) {
-  char *ptr;
   unsigned int i;
 
   *block = 0;
@@ -22,6 +22,10 @@
  */
 
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for accept4() */
+#endif
+
 #include "config.h"
 
 #include <errno.h>
@@ -38,6 +42,11 @@
 #include "libssh/buffer.h"
 #include "libssh/socket.h"
 #include "libssh/session.h"
+#include "libssh/string.h"
+#include "libssh/keys.h"
+#include "libssh/poll.h"
+
+extern const char *supported_methods[];
 
 /**
  * @addtogroup libssh_server
@@ -124,6 +133,28 @@ static socket_t bind_socket(ssh_bind sshbind, const char *hostname,
         return -1;
     }
 
+    if (sshbind->reuseport) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+                       (char *)&opt, sizeof(opt)) < 0) {
+            ssh_set_error(sshbind,
+                          SSH_FATAL,
+                          "Setting SO_REUSEPORT failed: %s",
+                          strerror(errno));
+            freeaddrinfo (ai);
+            close(s);
+            return -1;
+        }
+#else
+        ssh_set_error(sshbind,
+                      SSH_FATAL,
+                      "SO_REUSEPORT is not supported on this platform");
+        freeaddrinfo (ai);
+        close(s);
+        return -1;
+#endif
+    }
+
     if (bind(s, ai->ai_addr, ai->ai_addrlen) != 0) {
         ssh_set_error(sshbind,
                       SSH_FATAL,
@@ -148,6 +179,7 @@ ssh_bind ssh_bind_new(void) {
     return NULL;
   }
   ZERO_STRUCTP(ptr);
+  ssh_error_init(&ptr->error);
   ptr->bindfd = SSH_INVALID_SOCKET;
   ptr->bindport= 22;
   ptr->log_verbosity = 0;
@@ -274,6 +306,7 @@ void ssh_bind_free(ssh_bind sshbind){
   SAFE_FREE(sshbind->banner);
   SAFE_FREE(sshbind->dsakey);
   SAFE_FREE(sshbind->rsakey);
+  SAFE_FREE(sshbind->ecdsakey);
   SAFE_FREE(sshbind->bindaddr);
 
   for (i = 0; i < 10; i++) {
@@ -282,53 +315,130 @@ void ssh_bind_free(ssh_bind sshbind){
     }
   }
 
+  privatekey_free(sshbind->dsa);
+  privatekey_free(sshbind->rsa);
+  privatekey_free(sshbind->ecdsa);
+  ssh_buffer_free(sshbind->kexinit_cache);
+
   SAFE_FREE(sshbind);
 }
 
-
-int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
-  ssh_private_key dsa = NULL;
-  ssh_private_key rsa = NULL;
-  socket_t fd = SSH_INVALID_SOCKET;
+/** @internal
+ * @brief builds the serialized KEXINIT method lists shared by every
+ * session of this bind
+ *
+ * The lists depend only on the bind options and on which host keys are
+ * loaded, so they are rendered once; ssh_send_kex() copies the blob
+ * into the packet and the hash buffer instead of re-serializing ten
+ * strings per accept. The entries mirror what server_set_kex() puts in
+ * server_kex.methods.
+ */
+static int ssh_bind_kexinit_cache_build(ssh_bind sshbind) {
+  char hostkeys[64] = {0};
+  const char *wanted;
+  ssh_string str;
   int i;
 
-  if (sshbind->bindfd == SSH_INVALID_SOCKET) {
-    ssh_set_error(sshbind, SSH_FATAL,
-        "Can't accept new clients on a not bound socket.");
+  if (sshbind->kexinit_cache != NULL) {
+    return SSH_OK;
+  }
+  sshbind->kexinit_cache = ssh_buffer_new();
+  if (sshbind->kexinit_cache == NULL) {
     return SSH_ERROR;
   }
+
+  if (sshbind->ecdsa != NULL) {
+    strcat(hostkeys, "ecdsa-sha2-nistp256,");
+  }
+  if (sshbind->dsa != NULL) {
+    strcat(hostkeys, "ssh-dss,");
+  }
+  if (sshbind->rsa != NULL || hostkeys[0] == '\0') {
+    strcat(hostkeys, "ssh-rsa,");
+  }
+  hostkeys[strlen(hostkeys) - 1] = '\0';
+
+  for (i = 0; i < 10; i++) {
+    if (i == SSH_HOSTKEYS) {
+      /* server_set_kex() overrides this entry with the loaded keys */
+      wanted = hostkeys;
+    } else if ((wanted = sshbind->wanted_methods[i]) == NULL) {
+      wanted = supported_methods[i];
+    }
+    str = ssh_string_from_char(wanted);
+    if (str == NULL) {
+      goto error;
+    }
+    if (buffer_add_ssh_string(sshbind->kexinit_cache, str) < 0) {
+      ssh_string_free(str);
+      goto error;
+    }
+    ssh_string_free(str);
+  }
+
+  return SSH_OK;
+error:
+  ssh_buffer_free(sshbind->kexinit_cache);
+  sshbind->kexinit_cache = NULL;
+  return SSH_ERROR;
+}
+
+
+/* everything an accepted session needs besides its transport: host keys,
+ * options, the prebuilt kexinit proposal. Shared by ssh_bind_accept_fd()
+ * and ssh_bind_accept_loopback(). */
+static int ssh_bind_accept_session_setup(ssh_bind sshbind,
+    ssh_session session) {
+  int i;
+
   if(session == NULL){
   	ssh_set_error(sshbind, SSH_FATAL,"session is null");
   	return SSH_ERROR;
   }
-  if (sshbind->dsakey == NULL && sshbind->rsakey == NULL) {
+  if (sshbind->dsakey == NULL && sshbind->rsakey == NULL &&
+      sshbind->ecdsakey == NULL) {
     ssh_set_error(sshbind, SSH_FATAL,
-        "DSA or RSA host key file must be set before accept()");
+        "DSA, RSA or ECDSA host key file must be set before accept()");
     return SSH_ERROR;
   }
 
-  if (sshbind->dsakey) {
-    dsa = _privatekey_from_file(sshbind, sshbind->dsakey, SSH_KEYTYPE_DSS);
-    if (dsa == NULL) {
+  /* the host keys are parsed at the first accept and kept on the bind;
+   * every session takes a reference instead of re-reading the files */
+  if (sshbind->dsakey && sshbind->dsa == NULL) {
+    sshbind->dsa = _privatekey_from_file(sshbind, sshbind->dsakey,
+        SSH_KEYTYPE_DSS);
+    if (sshbind->dsa == NULL) {
       return SSH_ERROR;
     }
+    if (sshbind->dsa->refcount == 0) {
+      sshbind->dsa->refcount = 1;
+    }
   }
 
-  if (sshbind->rsakey) {
-    rsa = _privatekey_from_file(sshbind, sshbind->rsakey, SSH_KEYTYPE_RSA);
-    if (rsa == NULL) {
-      privatekey_free(dsa);
+  if (sshbind->rsakey && sshbind->rsa == NULL) {
+    sshbind->rsa = _privatekey_from_file(sshbind, sshbind->rsakey,
+        SSH_KEYTYPE_RSA);
+    if (sshbind->rsa == NULL) {
       return SSH_ERROR;
     }
+    if (sshbind->rsa->refcount == 0) {
+      sshbind->rsa->refcount = 1;
+    }
   }
 
-  fd = accept(sshbind->bindfd, NULL, NULL);
-  if (fd == SSH_INVALID_SOCKET) {
-    ssh_set_error(sshbind, SSH_FATAL,
-        "Accepting a new connection: %s",
-        strerror(errno));
-    privatekey_free(dsa);
-    privatekey_free(rsa);
+  if (sshbind->ecdsakey && sshbind->ecdsa == NULL) {
+    sshbind->ecdsa = _privatekey_from_file(sshbind, sshbind->ecdsakey,
+        SSH_KEYTYPE_ECDSA);
+    if (sshbind->ecdsa == NULL) {
+      return SSH_ERROR;
+    }
+    if (sshbind->ecdsa->refcount == 0) {
+      sshbind->ecdsa->refcount = 1;
+    }
+  }
+
+  if (ssh_bind_kexinit_cache_build(sshbind) != SSH_OK) {
+    ssh_set_error_oom(sshbind);
     return SSH_ERROR;
   }
 
@@ -340,8 +450,6 @@ int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
     if (sshbind->wanted_methods[i]) {
       session->wanted_methods[i] = strdup(sshbind->wanted_methods[i]);
       if (session->wanted_methods[i] == NULL) {
-        privatekey_free(dsa);
-        privatekey_free(rsa);
         return SSH_ERROR;
       }
     }
@@ -353,31 +461,198 @@ int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
     SAFE_FREE(session->bindaddr);
     session->bindaddr = strdup(sshbind->bindaddr);
     if (session->bindaddr == NULL) {
-      privatekey_free(dsa);
-      privatekey_free(rsa);
       return SSH_ERROR;
     }
   }
 
   session->log_verbosity = sshbind->log_verbosity;
 
+  ssh_buffer_free(session->kexinit_methods_cache);
+  session->kexinit_methods_cache = ssh_buffer_new();
+  if (session->kexinit_methods_cache == NULL ||
+      buffer_add_data(session->kexinit_methods_cache,
+        buffer_get_rest(sshbind->kexinit_cache),
+        buffer_get_rest_len(sshbind->kexinit_cache)) < 0) {
+    ssh_set_error_oom(sshbind);
+    return SSH_ERROR;
+  }
+
+  sshbind->dsa ? sshbind->dsa->refcount++ : 0;
+  sshbind->rsa ? sshbind->rsa->refcount++ : 0;
+  sshbind->ecdsa ? sshbind->ecdsa->refcount++ : 0;
+  session->dsa_key = sshbind->dsa;
+  session->rsa_key = sshbind->rsa;
+  session->ecdsa_key = sshbind->ecdsa;
+
+  return SSH_OK;
+}
+
+int ssh_bind_accept_fd(ssh_bind sshbind, ssh_session session, socket_t fd) {
+  if (ssh_bind_accept_session_setup(sshbind, session) != SSH_OK) {
+    return SSH_ERROR;
+  }
+
   ssh_socket_free(session->socket);
   session->socket = ssh_socket_new(session);
   if (session->socket == NULL) {
     /* perhaps it may be better to copy the error from session to sshbind */
     ssh_set_error_oom(sshbind);
-    privatekey_free(dsa);
-    privatekey_free(rsa);
     return SSH_ERROR;
   }
   ssh_socket_set_fd(session->socket, fd);
   ssh_socket_get_poll_handle_out(session->socket);
-  session->dsa_key = dsa;
-  session->rsa_key = rsa;
 
 return SSH_OK;
 }
 
+/**
+ * @brief Wire a server session and a client session together in memory.
+ *
+ * Sets the server session up exactly like ssh_bind_accept_fd(), but
+ * instead of a file descriptor the two sessions share an in-process
+ * loopback transport: no listening socket, no TCP, no socketpair. After
+ * this call the client side runs ssh_connect() and the server side
+ * ssh_handle_key_exchange() as usual, either from two threads or
+ * interleaved in nonblocking mode from one.
+ *
+ * @param  sshbind  The ssh server bind holding the host keys and options.
+ *
+ * @param  session  A preallocated ssh session for the server side. See
+ *                  ssh_new().
+ *
+ * @param  client   A preallocated ssh session for the client side; its
+ *                  ssh_connect() will talk to @a session instead of
+ *                  opening a socket.
+ *
+ * @return SSH_OK when both sessions are wired, SSH_ERROR on error.
+ */
+int ssh_bind_accept_loopback(ssh_bind sshbind, ssh_session session,
+    ssh_session client) {
+#ifdef _WIN32
+  (void) session;
+  (void) client;
+  ssh_set_error(sshbind, SSH_FATAL,
+      "Loopback transport is not supported on this platform");
+  return SSH_ERROR;
+#else
+  ssh_loopback_pair pair;
+
+  if (client == NULL || client->socket == NULL) {
+    ssh_set_error(sshbind, SSH_FATAL, "client session is null");
+    return SSH_ERROR;
+  }
+  if (ssh_bind_accept_session_setup(sshbind, session) != SSH_OK) {
+    return SSH_ERROR;
+  }
+
+  pair = ssh_loopback_pair_new();
+  if (pair == NULL) {
+    ssh_set_error_oom(sshbind);
+    return SSH_ERROR;
+  }
+  /* the pair starts at refcount 0; each attach takes a reference */
+  ssh_socket_loopback_attach(session->socket, pair, 0);
+  ssh_socket_loopback_attach(client->socket, pair, 1);
+  ssh_socket_get_poll_handle_out(session->socket);
+
+  return SSH_OK;
+#endif
+}
+
+static socket_t bind_accept_socket(ssh_bind sshbind) {
+#ifdef HAVE_ACCEPT4
+  /* one syscall less than accept() plus fcntl(), and the descriptor
+   * never leaks into forked children */
+  return accept4(sshbind->bindfd, NULL, NULL, SOCK_CLOEXEC);
+#else
+  return accept(sshbind->bindfd, NULL, NULL);
+#endif
+}
+
+int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
+  socket_t fd = SSH_INVALID_SOCKET;
+
+  if (sshbind->bindfd == SSH_INVALID_SOCKET) {
+    ssh_set_error(sshbind, SSH_FATAL,
+        "Can't accept new clients on a not bound socket.");
+    return SSH_ERROR;
+  }
+
+  fd = bind_accept_socket(sshbind);
+  if (fd == SSH_INVALID_SOCKET) {
+    ssh_set_error(sshbind, SSH_FATAL,
+        "Accepting a new connection: %s",
+        strerror(errno));
+    return SSH_ERROR;
+  }
+
+  if (ssh_bind_accept_fd(sshbind, session, fd) == SSH_ERROR) {
+    /* the session never took ownership of the socket */
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+int ssh_bind_accept_batch(ssh_bind sshbind, ssh_session *sessions,
+    int count) {
+  socket_t fd;
+  int accepted = 0;
+
+  if (sshbind == NULL || sessions == NULL || count <= 0) {
+    return SSH_ERROR;
+  }
+  if (sshbind->bindfd == SSH_INVALID_SOCKET) {
+    ssh_set_error(sshbind, SSH_FATAL,
+        "Can't accept new clients on a not bound socket.");
+    return SSH_ERROR;
+  }
+
+  while (accepted < count) {
+    if (accepted > 0) {
+      /* only the first accept may block; the rest of the batch drains
+       * whatever the kernel queued behind it during the same wakeup */
+      ssh_pollfd_t pfd;
+
+      pfd.fd = sshbind->bindfd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (ssh_poll(&pfd, 1, 0) <= 0) {
+        break;
+      }
+    }
+
+    fd = bind_accept_socket(sshbind);
+    if (fd == SSH_INVALID_SOCKET) {
+      if (accepted > 0) {
+        break;
+      }
+      ssh_set_error(sshbind, SSH_FATAL,
+          "Accepting a new connection: %s",
+          strerror(errno));
+      return SSH_ERROR;
+    }
+
+    if (ssh_bind_accept_fd(sshbind, sessions[accepted], fd) == SSH_ERROR) {
+      /* the session never took ownership of the socket */
+#ifdef _WIN32
+      closesocket(fd);
+#else
+      close(fd);
+#endif
+      return accepted > 0 ? accepted : SSH_ERROR;
+    }
+    accepted++;
+  }
+
+  return accepted;
+}
+
 
 /**
  * @}
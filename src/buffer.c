@@ -21,6 +21,11 @@
  * MA 02111-1307, USA.
  */
 
+#include <stdarg.h>
+/* keep the exported getter definitions unshadowed by the inline
+ * fast paths in the header */
+#define SSH_GETTERS_NO_INLINE
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -30,6 +35,7 @@
 
 #include "libssh/priv.h"
 #include "libssh/buffer.h"
+#include "libssh/misc.h"
 
 /**
  * @defgroup libssh_buffer The SSH buffer functions.
@@ -73,14 +79,62 @@ static void buffer_verify(ssh_buffer buf){
 #define buffer_verify(x)
 #endif
 
+/*
+ * Recycling pool for buffers.
+ *
+ * Almost every packet cycle allocates and frees a couple of buffers
+ * (session->in_buffer, session->out_buffer, sftp packets, ...). To avoid
+ * hammering the allocator on this hot path, freed buffers are parked on a
+ * small per-thread freelist, keeping their backing array, and handed out
+ * again by ssh_buffer_new(). Backing arrays bigger than
+ * BUFFER_POOL_MAX_ALLOCATED are released before pooling so the cache stays
+ * bounded. The pool is only enabled when thread local storage is
+ * available; otherwise ssh_buffer_new()/ssh_buffer_free() fall back to
+ * plain malloc()/free().
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_BUFFER_POOL 1
+#define BUFFER_POOL_SIZE 16
+#define BUFFER_POOL_MAX_ALLOCATED 0x10000
+
+static __thread struct ssh_buffer_struct *buffer_pool[BUFFER_POOL_SIZE];
+static __thread int buffer_pool_count;
+#endif
+
+/** @internal
+ *
+ * @brief Release the buffers cached by the pool of the calling thread.
+ */
+void buffer_pool_cleanup(void) {
+#ifdef HAVE_BUFFER_POOL
+  while (buffer_pool_count > 0) {
+    struct ssh_buffer_struct *buf = buffer_pool[--buffer_pool_count];
+
+    SAFE_FREE(buf->data);
+    SAFE_FREE(buf);
+  }
+#endif
+}
+
 /**
  * @brief Create a new SSH buffer.
  *
  * @return A newly initialized SSH buffer, NULL on error.
  */
 struct ssh_buffer_struct *ssh_buffer_new(void) {
-  struct ssh_buffer_struct *buf = malloc(sizeof(struct ssh_buffer_struct));
+  struct ssh_buffer_struct *buf;
+
+#ifdef HAVE_BUFFER_POOL
+  if (buffer_pool_count > 0) {
+    buf = buffer_pool[--buffer_pool_count];
+    buf->reserve = 0;
+    buf->highwater = 0;
+    buffer_verify(buf);
+    return buf;
+  }
+#endif
 
+  buf = malloc(sizeof(struct ssh_buffer_struct));
   if (buf == NULL) {
     return NULL;
   }
@@ -103,8 +157,19 @@ void ssh_buffer_free(struct ssh_buffer_struct *buffer) {
   if (buffer->data) {
     /* burn the data */
     memset(buffer->data, 0, buffer->allocated);
-    SAFE_FREE(buffer->data);
   }
+
+#ifdef HAVE_BUFFER_POOL
+  if (buffer_pool_count < BUFFER_POOL_SIZE &&
+      buffer->allocated <= BUFFER_POOL_MAX_ALLOCATED) {
+    buffer->used = 0;
+    buffer->pos = 0;
+    buffer_pool[buffer_pool_count++] = buffer;
+    return;
+  }
+#endif
+
+  SAFE_FREE(buffer->data);
   memset(buffer, 'X', sizeof(*buffer));
   SAFE_FREE(buffer);
 }
@@ -152,15 +217,61 @@ static void buffer_shift(ssh_buffer buffer){
  * @return              0 on success, < 0 on error.
  */
 int buffer_reinit(struct ssh_buffer_struct *buffer) {
+  uint32_t target;
+
   buffer_verify(buffer);
+  if (buffer->used > buffer->highwater) {
+    buffer->highwater = buffer->used;
+  }
   memset(buffer->data, 0, buffer->used);
   buffer->used = 0;
   buffer->pos = 0;
-  if(buffer->allocated > 127) {
-    if (realloc_buffer(buffer, 127) < 0) {
+
+  /* Keep enough capacity for the recent peak or the caller's hint, and
+   * only give memory back once the allocation exceeds twice that, so a
+   * steady packet size never oscillates between shrink and regrow. */
+  target = buffer->highwater > buffer->reserve ?
+      buffer->highwater : buffer->reserve;
+  if (target < 127) {
+    target = 127;
+  }
+  if (buffer->allocated > 2 * target) {
+    if (realloc_buffer(buffer, target) < 0) {
       return -1;
     }
   }
+  /* age the peak so a one-off spike does not pin capacity forever */
+  buffer->highwater -= buffer->highwater / 8;
+
+  buffer_verify(buffer);
+  return 0;
+}
+
+/**
+ * @brief Preallocate and pin capacity on a buffer.
+ *
+ * The buffer grows to hold at least len bytes right away and
+ * buffer_reinit() will not shrink it below that, so a caller that knows
+ * its typical payload size avoids the grow/shrink churn of the default
+ * policy. A second call replaces the previous hint.
+ *
+ * @param[in]  buffer   The buffer to reserve space in.
+ *
+ * @param[in]  len      The expected payload size in bytes.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+int ssh_buffer_reserve(struct ssh_buffer_struct *buffer, uint32_t len) {
+  if (buffer == NULL) {
+    return -1;
+  }
+  buffer_verify(buffer);
+
+  buffer->reserve = len;
+  if (buffer->allocated < len && realloc_buffer(buffer, len) < 0) {
+    return -1;
+  }
+
   buffer_verify(buffer);
   return 0;
 }
@@ -181,9 +292,15 @@ int buffer_reinit(struct ssh_buffer_struct *buffer) {
 int buffer_add_data(struct ssh_buffer_struct *buffer, const void *data, uint32_t len) {
   buffer_verify(buffer);
   if (buffer->allocated < (buffer->used + len)) {
-    if(buffer->pos > 0)
+    /* Reclaim the consumed head only once at least half of the array is
+     * dead. A channel buffer whose reader lags behind the writer then has
+     * every byte memmove'd at most once on average, instead of the whole
+     * unread tail sliding down on each append. */
+    if (buffer->pos >= buffer->allocated / 2) {
       buffer_shift(buffer);
-    if (realloc_buffer(buffer, buffer->used + len) < 0) {
+    }
+    if (buffer->allocated < (buffer->used + len) &&
+        realloc_buffer(buffer, buffer->used + len) < 0) {
       return -1;
     }
   }
@@ -194,6 +311,149 @@ int buffer_add_data(struct ssh_buffer_struct *buffer, const void *data, uint32_t
   return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Reserve len bytes at the tail of a buffer.
+ *
+ * The caller fills the returned area itself, which lets a producer write
+ * straight into the buffer instead of staging the data elsewhere and
+ * copying it in with buffer_add_data().
+ *
+ * @param[in]  buffer   The buffer to grow.
+ *
+ * @param[in]  len      The number of bytes to reserve.
+ *
+ * @return              A pointer to the reserved area, NULL on error.
+ */
+void *buffer_allocate(struct ssh_buffer_struct *buffer, uint32_t len) {
+  void *ptr;
+
+  buffer_verify(buffer);
+  if (buffer->allocated < (buffer->used + len)) {
+    if (buffer->pos >= buffer->allocated / 2) {
+      buffer_shift(buffer);
+    }
+    if (buffer->allocated < (buffer->used + len) &&
+        realloc_buffer(buffer, buffer->used + len) < 0) {
+      return NULL;
+    }
+  }
+
+  ptr = buffer->data + buffer->used;
+  buffer->used += len;
+  buffer_verify(buffer);
+
+  return ptr;
+}
+
+/**
+ * @brief Reserve a writable area at the tail of a buffer.
+ *
+ * The returned area is not part of the buffer content yet: fill it, then
+ * publish the bytes actually produced with ssh_buffer_commit_data(). This
+ * lets a caller format a message or read file data straight into an
+ * outgoing buffer instead of staging it elsewhere and copying it in.
+ *
+ * The pointer is invalidated by any other operation on the buffer.
+ *
+ * @param[in]  buffer   The buffer to reserve space in.
+ *
+ * @param[in]  len      The number of writable bytes needed.
+ *
+ * @return              A pointer to the writable area, NULL on error.
+ *
+ * @see ssh_buffer_commit_data()
+ */
+void *ssh_buffer_reserve_data(struct ssh_buffer_struct *buffer, uint32_t len) {
+  void *ptr;
+
+  if (buffer == NULL) {
+    return NULL;
+  }
+
+  /* get the space the way buffer_allocate() would, but keep it
+   * uncommitted until the caller filled it */
+  ptr = buffer_allocate(buffer, len);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  buffer->used -= len;
+
+  return ptr;
+}
+
+/**
+ * @brief Publish bytes written into an area from ssh_buffer_reserve_data().
+ *
+ * @param[in]  buffer   The buffer the area was reserved in.
+ *
+ * @param[in]  len      The number of bytes actually written, at most the
+ *                      reserved length.
+ *
+ * @return              0 on success, < 0 if len exceeds the reservation.
+ */
+int ssh_buffer_commit_data(struct ssh_buffer_struct *buffer, uint32_t len) {
+  if (buffer == NULL || buffer->allocated - buffer->used < len) {
+    return -1;
+  }
+
+  buffer->used += len;
+  buffer_verify(buffer);
+
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Drop len bytes from the tail of a buffer.
+ *
+ * Used to give back the unfilled part of an area obtained with
+ * buffer_allocate(), e.g. after a short read into it.
+ *
+ * @param[in]  buffer   The buffer to shrink.
+ *
+ * @param[in]  len      The number of bytes to drop.
+ *
+ * @return              0 on success, < 0 if the buffer holds fewer bytes.
+ */
+int buffer_chop(struct ssh_buffer_struct *buffer, uint32_t len) {
+  buffer_verify(buffer);
+  if (buffer->used - buffer->pos < len) {
+    return -1;
+  }
+
+  buffer->used -= len;
+  buffer_verify(buffer);
+
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Exchange the contents of two buffers without copying.
+ *
+ * Both buffers keep their identity (callers holding either pointer see
+ * the other one's data afterwards), only the storage and the read and
+ * write positions move.
+ *
+ * @param[in]  a        The first buffer.
+ *
+ * @param[in]  b        The second buffer.
+ */
+void buffer_swap(struct ssh_buffer_struct *a, struct ssh_buffer_struct *b) {
+  struct ssh_buffer_struct tmp;
+
+  buffer_verify(a);
+  buffer_verify(b);
+
+  tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
 /**
  * @internal
  *
@@ -599,6 +859,331 @@ struct ssh_string_struct *buffer_get_mpint(struct ssh_buffer_struct *buffer) {
   return str;
 }
 
+/**
+ * @brief Serialize a list of fields into the buffer from a format string.
+ *
+ * One format character describes one argument:
+ *  - 'b': uint8_t
+ *  - 'w': uint16_t
+ *  - 'd': uint32_t
+ *  - 'q': uint64_t
+ *  - 's': const char *, written as an SSH string (uint32_t length + bytes)
+ *  - 'S': ssh_string, written in wire form
+ *  - 'P': size_t length followed by a const void *, written raw
+ *
+ * Integers are passed in host order and converted on the way. The total
+ * size is computed up front and the buffer grown once, with no
+ * intermediate ssh_string allocation, which replaces the usual run of
+ * individually-checked buffer_add_*() calls with a single branch.
+ *
+ * @param[in]  buffer   The buffer to append to.
+ *
+ * @param[in]  format   The format string.
+ *
+ * @param[in]  ap       The fields, one per format character.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error; the buffer
+ *                      is unchanged on error.
+ *
+ * @see ssh_buffer_unpack()
+ */
+int ssh_buffer_pack_va(struct ssh_buffer_struct *buffer, const char *format,
+    va_list ap) {
+  va_list ap_size;
+  const char *p;
+  char *out;
+  uint32_t needed = 0;
+  uint32_t u32;
+  uint64_t u64;
+  uint16_t u16;
+  const char *cstring;
+  ssh_string str;
+  const void *blob;
+  size_t len;
+
+  if (buffer == NULL || format == NULL) {
+    return SSH_ERROR;
+  }
+
+  va_copy(ap_size, ap);
+  for (p = format; *p != '\0'; p++) {
+    switch (*p) {
+      case 'b':
+        (void) va_arg(ap_size, unsigned int);
+        needed += sizeof(uint8_t);
+        break;
+      case 'w':
+        (void) va_arg(ap_size, unsigned int);
+        needed += sizeof(uint16_t);
+        break;
+      case 'd':
+        (void) va_arg(ap_size, uint32_t);
+        needed += sizeof(uint32_t);
+        break;
+      case 'q':
+        (void) va_arg(ap_size, uint64_t);
+        needed += sizeof(uint64_t);
+        break;
+      case 's':
+        cstring = va_arg(ap_size, const char *);
+        if (cstring == NULL) {
+          va_end(ap_size);
+          return SSH_ERROR;
+        }
+        needed += sizeof(uint32_t) + strlen(cstring);
+        break;
+      case 'S':
+        str = va_arg(ap_size, ssh_string);
+        if (str == NULL) {
+          va_end(ap_size);
+          return SSH_ERROR;
+        }
+        needed += sizeof(uint32_t) + ssh_string_len(str);
+        break;
+      case 'P':
+        len = va_arg(ap_size, size_t);
+        blob = va_arg(ap_size, const void *);
+        if (blob == NULL && len > 0) {
+          va_end(ap_size);
+          return SSH_ERROR;
+        }
+        needed += len;
+        break;
+      default:
+        va_end(ap_size);
+        return SSH_ERROR;
+    }
+  }
+  va_end(ap_size);
+
+  out = buffer_allocate(buffer, needed);
+  if (out == NULL) {
+    return SSH_ERROR;
+  }
+
+  for (p = format; *p != '\0'; p++) {
+    switch (*p) {
+      case 'b':
+        *out++ = (uint8_t) va_arg(ap, unsigned int);
+        break;
+      case 'w':
+        u16 = htons((uint16_t) va_arg(ap, unsigned int));
+        memcpy(out, &u16, sizeof(u16));
+        out += sizeof(u16);
+        break;
+      case 'd':
+        u32 = htonl(va_arg(ap, uint32_t));
+        memcpy(out, &u32, sizeof(u32));
+        out += sizeof(u32);
+        break;
+      case 'q':
+        u64 = htonll(va_arg(ap, uint64_t));
+        memcpy(out, &u64, sizeof(u64));
+        out += sizeof(u64);
+        break;
+      case 's':
+        cstring = va_arg(ap, const char *);
+        len = strlen(cstring);
+        u32 = htonl((uint32_t) len);
+        memcpy(out, &u32, sizeof(u32));
+        memcpy(out + sizeof(u32), cstring, len);
+        out += sizeof(u32) + len;
+        break;
+      case 'S':
+        str = va_arg(ap, ssh_string);
+        len = ssh_string_len(str);
+        u32 = htonl((uint32_t) len);
+        memcpy(out, &u32, sizeof(u32));
+        memcpy(out + sizeof(u32), ssh_string_data(str), len);
+        out += sizeof(u32) + len;
+        break;
+      case 'P':
+        len = va_arg(ap, size_t);
+        blob = va_arg(ap, const void *);
+        memcpy(out, blob, len);
+        out += len;
+        break;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Serialize fields into the buffer, see ssh_buffer_pack_va().
+ */
+int ssh_buffer_pack(struct ssh_buffer_struct *buffer, const char *format,
+    ...) {
+  va_list ap;
+  int rc;
+
+  va_start(ap, format);
+  rc = ssh_buffer_pack_va(buffer, format, ap);
+  va_end(ap);
+
+  return rc;
+}
+
+/**
+ * @brief Parse fields from the buffer following a format string.
+ *
+ * The mirror of ssh_buffer_pack(): the same format characters, each
+ * argument a pointer to where the field is stored.
+ *  - 'b': uint8_t *
+ *  - 'w': uint16_t *
+ *  - 'd': uint32_t *
+ *  - 'q': uint64_t *
+ *  - 's': char **, receives a NUL-terminated copy to free by the caller
+ *  - 'S': ssh_string *, receives a string to free by the caller
+ *  - 'P': size_t length followed by a void *, filled with raw bytes
+ *
+ * Integers come out in host order. On error nothing the caller must
+ * free is left behind: strings parsed before the failing field are
+ * released and their pointers set to NULL.
+ *
+ * @param[in]  buffer   The buffer to read from.
+ *
+ * @param[in]  format   The format string.
+ *
+ * @param[in]  ap       Pointers to the field destinations.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on a malformed or
+ *                      truncated buffer.
+ */
+int ssh_buffer_unpack_va(struct ssh_buffer_struct *buffer, const char *format,
+    va_list ap) {
+  va_list ap_clean;
+  const char *p;
+  uint32_t u32;
+  uint64_t u64;
+  uint16_t u16;
+  char **cstring;
+  ssh_string *str;
+  void *blob;
+  size_t len;
+  int ok = 1;
+
+  if (buffer == NULL || format == NULL) {
+    return SSH_ERROR;
+  }
+
+  va_copy(ap_clean, ap);
+  for (p = format; ok && *p != '\0'; p++) {
+    switch (*p) {
+      case 'b':
+        ok = buffer_get_u8(buffer, va_arg(ap, uint8_t *)) ==
+            sizeof(uint8_t);
+        break;
+      case 'w':
+        ok = buffer_get_data(buffer, &u16, sizeof(u16)) == sizeof(u16);
+        if (ok) {
+          *va_arg(ap, uint16_t *) = ntohs(u16);
+        }
+        break;
+      case 'd':
+        ok = buffer_get_data(buffer, &u32, sizeof(u32)) == sizeof(u32);
+        if (ok) {
+          *va_arg(ap, uint32_t *) = ntohl(u32);
+        }
+        break;
+      case 'q':
+        ok = buffer_get_data(buffer, &u64, sizeof(u64)) == sizeof(u64);
+        if (ok) {
+          *va_arg(ap, uint64_t *) = ntohll(u64);
+        }
+        break;
+      case 's':
+        cstring = va_arg(ap, char **);
+        *cstring = NULL;
+        ok = buffer_get_data(buffer, &u32, sizeof(u32)) == sizeof(u32);
+        if (!ok) {
+          break;
+        }
+        u32 = ntohl(u32);
+        if (buffer->used - buffer->pos < u32) {
+          ok = 0;
+          break;
+        }
+        *cstring = malloc(u32 + 1);
+        if (*cstring == NULL) {
+          ok = 0;
+          break;
+        }
+        buffer_get_data(buffer, *cstring, u32);
+        (*cstring)[u32] = '\0';
+        break;
+      case 'S':
+        str = va_arg(ap, ssh_string *);
+        *str = buffer_get_ssh_string(buffer);
+        ok = *str != NULL;
+        break;
+      case 'P':
+        len = va_arg(ap, size_t);
+        blob = va_arg(ap, void *);
+        ok = buffer_get_data(buffer, blob, len) == len;
+        break;
+      default:
+        ok = 0;
+        break;
+    }
+  }
+
+  if (!ok) {
+    /* release what the walk above handed out before it failed */
+    const char *q;
+
+    for (q = format; q < p - 1; q++) {
+      switch (*q) {
+        case 'b':
+          (void) va_arg(ap_clean, uint8_t *);
+          break;
+        case 'w':
+          (void) va_arg(ap_clean, uint16_t *);
+          break;
+        case 'd':
+          (void) va_arg(ap_clean, uint32_t *);
+          break;
+        case 'q':
+          (void) va_arg(ap_clean, uint64_t *);
+          break;
+        case 's':
+          cstring = va_arg(ap_clean, char **);
+          SAFE_FREE(*cstring);
+          break;
+        case 'S':
+          str = va_arg(ap_clean, ssh_string *);
+          ssh_string_free(*str);
+          *str = NULL;
+          break;
+        case 'P':
+          (void) va_arg(ap_clean, size_t);
+          (void) va_arg(ap_clean, void *);
+          break;
+      }
+    }
+    va_end(ap_clean);
+    return SSH_ERROR;
+  }
+  va_end(ap_clean);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Parse fields from the buffer, see ssh_buffer_unpack_va().
+ */
+int ssh_buffer_unpack(struct ssh_buffer_struct *buffer, const char *format,
+    ...) {
+  va_list ap;
+  int rc;
+
+  va_start(ap, format);
+  rc = ssh_buffer_unpack_va(buffer, format, ap);
+  va_end(ap);
+
+  return rc;
+}
+
 /** @} */
 
 /* vim: set ts=4 sw=4 et cindent: */
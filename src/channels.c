@@ -30,6 +30,11 @@
 
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#else
+#include <winsock2.h>
 #endif
 
 #include "libssh/priv.h"
@@ -40,13 +45,14 @@
 #include "libssh/channels.h"
 #include "libssh/session.h"
 #include "libssh/misc.h"
+#include "libssh/poll.h"
 #include "libssh/messages.h"
 #if WITH_SERVER
 #include "libssh/server.h"
 #endif
 
 #define WINDOWBASE 128000
-#define WINDOWLIMIT (WINDOWBASE/2)
+#define WINDOWMAX (2*1024*1024)
 
 /**
  * @defgroup libssh_channel The SSH channel functions
@@ -59,6 +65,31 @@
 
 static ssh_channel channel_from_msg(ssh_session session, ssh_buffer packet);
 
+/* bulk channels get this many queued bytes per scheduling round, see
+ * channel_sched_flush() */
+#define CHANNEL_SCHED_QUANTUM 16384
+
+/* the fd pump reads this much per poll event and stops reading the fd
+ * once this many bytes wait in the scheduler queue */
+#define CHANNEL_PUMP_CHUNK 16384
+#define CHANNEL_PUMP_QUEUE_MAX (4 * CHANNEL_SCHED_QUANTUM)
+
+/* estimated wire bytes around a DATA payload: binary packet length and
+ * padding fields, padding, MAC and the channel data header. Used for
+ * MSS alignment, where erring high only wastes a few bytes of the last
+ * segment. */
+#define CHANNEL_WIRE_OVERHEAD 64
+
+/* a channel-to-fd pump, see ssh_channel_attach_fd() */
+struct ssh_channel_fd_pump_struct {
+  ssh_channel channel;
+  socket_t fd;
+  ssh_poll_handle poll;
+  int fd_eof;      /* the read side of the fd hit end of file */
+  int eof_pending; /* channel EOF waits for the out_queue to drain */
+  int sink_blocked; /* the fd stopped accepting writes, hold the window */
+};
+
 /**
  * @brief Allocate a new channel.
  *
@@ -95,9 +126,19 @@ ssh_channel ssh_channel_new(ssh_session session) {
     return NULL;
   }
 
+  channel->out_queue = ssh_buffer_new();
+  if (channel->out_queue == NULL) {
+    ssh_set_error_oom(session);
+    ssh_buffer_free(channel->stderr_buffer);
+    ssh_buffer_free(channel->stdout_buffer);
+    SAFE_FREE(channel);
+    return NULL;
+  }
+
   channel->session = session;
   channel->version = session->version;
   channel->exit_status = -1;
+  channel->refcount = 1;
 
   if(session->channels == NULL) {
     session->channels = channel;
@@ -125,6 +166,50 @@ uint32_t ssh_channel_new_id(ssh_session session) {
   return ++(session->maxchannel);
 }
 
+/**
+ * @internal
+ *
+ * @brief Enter a channel into the id-indexed lookup table.
+ *
+ * Must be called once the local channel id has been assigned. Local ids
+ * are small sequential integers (see ssh_channel_new_id), so a plain
+ * array gives constant time lookups. On allocation failure the channel
+ * is simply not indexed and lookups fall back to the list walk.
+ */
+void ssh_channel_table_register(ssh_session session, ssh_channel channel) {
+  uint32_t id = channel->local_channel;
+  ssh_channel *table;
+  uint32_t size;
+
+  if (id >= session->channel_table_size) {
+    size = session->channel_table_size ? session->channel_table_size : 16;
+    while (size <= id) {
+      size *= 2;
+    }
+    table = realloc(session->channel_table, size * sizeof(ssh_channel));
+    if (table == NULL) {
+      return;
+    }
+    memset(table + session->channel_table_size, 0,
+        (size - session->channel_table_size) * sizeof(ssh_channel));
+    session->channel_table = table;
+    session->channel_table_size = size;
+  }
+
+  session->channel_table[id] = channel;
+}
+
+static void channel_table_remove(ssh_session session, ssh_channel channel) {
+  uint32_t id = channel->local_channel;
+
+  if (id < session->channel_table_size &&
+      session->channel_table[id] == channel) {
+    session->channel_table[id] = NULL;
+  }
+}
+
+static int channel_early_request_flush(ssh_channel channel);
+
 /**
  * @internal
  *
@@ -172,6 +257,20 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_conf){
       (long unsigned int) channel->remote_maxpacket);
 
   channel->state = SSH_CHANNEL_STATE_OPEN;
+  channel->open_pending = 0;
+  /* a stall recorded before the confirmation was the open round trip,
+   * not a closed window */
+  channel->stalled = 0;
+
+  if (channel->early_request != NULL) {
+    /* release the request held back behind the open, in the same
+     * dispatch pass that learned the remote id */
+    channel_early_request_flush(channel);
+  }
+  if (buffer_get_rest_len(channel->out_queue) > 0) {
+    /* early data rides out right behind the request */
+    channel_sched_flush(session);
+  }
   leave_function();
   return SSH_PACKET_USED;
 }
@@ -212,6 +311,14 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_fail){
       error);
   SAFE_FREE(error);
   channel->state=SSH_CHANNEL_STATE_OPEN_DENIED;
+  channel->open_pending = 0;
+  if (channel->early_request != NULL) {
+    /* the queued request can never be sent, wake any waiter */
+    SAFE_FREE(channel->early_request);
+    ssh_buffer_free(channel->early_request_buf);
+    channel->early_request_buf = NULL;
+    channel->request_state = SSH_CHANNEL_REQ_STATE_ERROR;
+  }
   return SSH_PACKET_USED;
 }
 
@@ -233,65 +340,88 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_fail){
  *
  * @param[in]  payload   The buffer containing additional payload for the query.
  */
-static int channel_open(ssh_channel channel, const char *type_c, int window,
-    int maxpacket, ssh_buffer payload) {
+static int channel_open_send(ssh_channel channel, const char *type_c,
+    int window, int maxpacket, ssh_buffer payload) {
   ssh_session session = channel->session;
-  ssh_string type = NULL;
-  int err=SSH_ERROR;
 
-  enter_function();
+  if (session->deferred_hostkey && !session->hostkey_verified) {
+    /* the deferred check must have passed before anything rides the
+     * connection, see SSH_OPTIONS_DEFERRED_HOSTKEY */
+    ssh_set_error(session, SSH_FATAL,
+        "Host key verification is still pending on this session");
+    return SSH_ERROR;
+  }
+
   channel->local_channel = ssh_channel_new_id(session);
+  ssh_channel_table_register(session, channel);
   channel->local_maxpacket = maxpacket;
   channel->local_window = window;
+  if (channel->window_target == 0) {
+    channel->window_target = window;
+  }
 
   ssh_log(session, SSH_LOG_PROTOCOL,
       "Creating a channel %d with %d window and %d max packet",
       channel->local_channel, window, maxpacket);
 
-  type = ssh_string_from_char(type_c);
-  if (type == NULL) {
-    ssh_set_error_oom(session);
-    leave_function();
-    return err;
-  }
-
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_OPEN) < 0 ||
-      buffer_add_ssh_string(session->out_buffer,type) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->local_channel)) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->local_window)) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->local_maxpacket)) < 0) {
+  if (ssh_buffer_pack(session->out_buffer, "bsddd",
+        SSH2_MSG_CHANNEL_OPEN,
+        type_c,
+        channel->local_channel,
+        channel->local_window,
+        channel->local_maxpacket) != SSH_OK) {
     ssh_set_error_oom(session);
-    ssh_string_free(type);
-    leave_function();
-    return err;
+    return SSH_ERROR;
   }
 
-  ssh_string_free(type);
-
   if (payload != NULL) {
     if (buffer_add_buffer(session->out_buffer, payload) < 0) {
       ssh_set_error_oom(session);
-      leave_function();
-      return err;
+      return SSH_ERROR;
     }
   }
 
   if (packet_send(session) == SSH_ERROR) {
-    leave_function();
-    return err;
+    return SSH_ERROR;
   }
 
   ssh_log(session, SSH_LOG_PACKET,
       "Sent a SSH_MSG_CHANNEL_OPEN type %s for channel %d",
       type_c, channel->local_channel);
 
+  channel->open_pending = 1;
+
+  return SSH_OK;
+}
+
+static int channel_open_wait(ssh_channel channel) {
+  ssh_session session = channel->session;
+
   /* Todo: fix this into a correct loop */
   /* wait until channel is opened by server */
   while(channel->state == SSH_CHANNEL_STATE_NOT_OPEN){
-    ssh_handle_packets(session,-1);
+    if (ssh_handle_packets(session,-1) != SSH_OK) {
+      break;
+    }
   }
   if(channel->state == SSH_CHANNEL_STATE_OPEN)
-    err=SSH_OK;
+    return SSH_OK;
+
+  return SSH_ERROR;
+}
+
+static int channel_open(ssh_channel channel, const char *type_c, int window,
+    int maxpacket, ssh_buffer payload) {
+  ssh_session session = channel->session;
+  int err;
+
+  enter_function();
+
+  err = channel_open_send(channel, type_c, window, maxpacket, payload);
+  if (err == SSH_OK) {
+    err = channel_open_wait(channel);
+  }
+
   leave_function();
   return err;
 }
@@ -301,6 +431,14 @@ ssh_channel ssh_channel_from_local(ssh_session session, uint32_t id) {
   ssh_channel initchan = session->channels;
   ssh_channel channel;
 
+  /* the table answers in constant time for indexed channels */
+  if (id < session->channel_table_size) {
+    channel = session->channel_table[id];
+    if (channel != NULL && channel->local_channel == id) {
+      return channel;
+    }
+  }
+
   /* We assume we are always the local */
   if (initchan == NULL) {
     return NULL;
@@ -316,6 +454,141 @@ ssh_channel ssh_channel_from_local(ssh_session session, uint32_t id) {
   return channel;
 }
 
+/**
+ * @internal
+ * @brief returns the receive window size the channel aims for
+ */
+static uint32_t channel_window_target(ssh_channel channel) {
+  return channel->window_target != 0 ? channel->window_target : WINDOWBASE;
+}
+
+/* interval the pacing timer re-runs the scheduler with while a rate
+ * limit is holding back data */
+#define CHANNEL_PACING_TICK_MS 10
+
+#define CHANNEL_PACING_UNLIMITED ((uint64_t) -1)
+
+static void ssh_pacing_tick(void *userdata);
+
+/** @internal
+ * @brief Refill a pacing bucket at rate bytes per second, up to burst,
+ * and return the spendable amount.
+ *
+ * The clock is only advanced when at least one token was credited, so
+ * low rates accumulate across sub-millisecond calls instead of losing
+ * the remainder to truncation.
+ */
+static uint64_t ssh_rate_refill(uint64_t *tokens, struct ssh_timestamp *since,
+    uint64_t rate, uint64_t burst) {
+  int elapsed = ssh_timestamp_elapsed_ms(since);
+
+  if (elapsed > 0) {
+    uint64_t add = rate * (uint64_t) elapsed / 1000;
+
+    if (add > 0) {
+      *tokens += add;
+      if (*tokens > burst) {
+        *tokens = burst;
+      }
+      ssh_timestamp_init(since);
+    }
+  }
+
+  return *tokens;
+}
+
+/* smallest allowance of the channel and session buckets for one
+ * direction, CHANNEL_PACING_UNLIMITED when no limit applies */
+static uint64_t channel_pacing_allowance(ssh_channel channel, int outbound) {
+  ssh_session session = channel->session;
+  uint64_t allow = CHANNEL_PACING_UNLIMITED;
+  uint64_t t;
+
+  if (channel->rate_limit > 0) {
+    allow = outbound ?
+        ssh_rate_refill(&channel->rate_out_tokens, &channel->rate_out_since,
+            channel->rate_limit, channel->rate_burst) :
+        ssh_rate_refill(&channel->rate_in_tokens, &channel->rate_in_since,
+            channel->rate_limit, channel->rate_burst);
+  }
+  if (session->rate_limit > 0) {
+    t = outbound ?
+        ssh_rate_refill(&session->rate_out_tokens, &session->rate_out_since,
+            session->rate_limit, session->rate_burst) :
+        ssh_rate_refill(&session->rate_in_tokens, &session->rate_in_since,
+            session->rate_limit, session->rate_burst);
+    if (t < allow) {
+      allow = t;
+    }
+  }
+
+  return allow;
+}
+
+static void channel_pacing_consume(ssh_channel channel, int outbound,
+    uint64_t n) {
+  ssh_session session = channel->session;
+
+  if (channel->rate_limit > 0) {
+    uint64_t *tokens = outbound ?
+        &channel->rate_out_tokens : &channel->rate_in_tokens;
+
+    *tokens = *tokens > n ? *tokens - n : 0;
+  }
+  if (session->rate_limit > 0) {
+    uint64_t *tokens = outbound ?
+        &session->rate_out_tokens : &session->rate_in_tokens;
+
+    *tokens = *tokens > n ? *tokens - n : 0;
+  }
+}
+
+/** @internal
+ * @brief Schedule a pacing tick on the poll context the session runs
+ * on, so held-back data is flushed without the application spinning.
+ */
+static void ssh_pacing_arm(ssh_session session) {
+  ssh_poll_handle h;
+  ssh_poll_ctx ctx;
+
+  if (session->pacing_timer != NULL || session->socket == NULL) {
+    return;
+  }
+  h = ssh_socket_get_poll_handle_out(session->socket);
+  if (h == NULL) {
+    return;
+  }
+  ctx = ssh_poll_get_ctx(h);
+  if (ctx == NULL) {
+    return;
+  }
+  session->pacing_timer = ssh_poll_timer_arm(ctx, CHANNEL_PACING_TICK_MS,
+      ssh_pacing_tick, session);
+}
+
+/**
+ * @internal
+ * @brief Bytes of buffer memory a channel currently holds allocated.
+ */
+uint32_t ssh_channel_memory_usage(ssh_channel channel) {
+  uint32_t used = 0;
+
+  if (channel->stdout_buffer != NULL) {
+    used += channel->stdout_buffer->allocated;
+  }
+  if (channel->stderr_buffer != NULL) {
+    used += channel->stderr_buffer->allocated;
+  }
+  if (channel->out_queue != NULL) {
+    used += channel->out_queue->allocated;
+  }
+  if (channel->ring != NULL) {
+    used += channel->ring->size;
+  }
+
+  return used;
+}
+
 /**
  * @internal
  * @brief grows the local window and send a packet to the other party
@@ -324,9 +597,64 @@ ssh_channel ssh_channel_from_local(ssh_session session, uint32_t id) {
  * @param minimumsize The minimum acceptable size for the new window.
  */
 static int grow_window(ssh_session session, ssh_channel channel, int minimumsize) {
-  uint32_t new_window = minimumsize > WINDOWBASE ? minimumsize : WINDOWBASE;
+  uint32_t target = channel_window_target(channel);
+  uint32_t new_window;
 
   enter_function();
+  if (session->rekeying && session->out_crypto != session->next_crypto) {
+    /* no data packets between KEXINIT and our NEWKEYS; the window is
+     * grown again by the first read after the rekey */
+    leave_function();
+    return SSH_OK;
+  }
+  if (channel->pump != NULL && channel->pump->sink_blocked) {
+    /* the fd behind the pump stopped accepting writes; advertising more
+     * window would only buffer data for a sink that is already behind.
+     * channel_fd_pump_drain() resumes the growth once the backlog is
+     * flushed, so TCP backpressure propagates to the sender end to end. */
+    leave_function();
+    return SSH_OK;
+  }
+  /* Auto-scale the receive window: if the remote side managed to fill more
+   * than half of it since the previous refill less than a second ago, the
+   * window is the bottleneck rather than the consumer. Double it, up to
+   * WINDOWMAX, the way OpenSSH does.
+   */
+  if (!channel->window_fixed &&
+      channel->local_window <= target / 2 &&
+      channel->window_last_grow.seconds != 0 &&
+      !ssh_timeout_elapsed(&channel->window_last_grow, 1000) &&
+      target < WINDOWMAX) {
+    target *= 2;
+    channel->window_target = target;
+    ssh_log(session, SSH_LOG_PROTOCOL,
+        "Scaling receive window target (channel %d:%d) up to %d bytes",
+        channel->local_channel, channel->remote_channel, target);
+  }
+  ssh_timestamp_init(&channel->window_last_grow);
+  /* Measured sizing: with a rate and a round-trip estimate the needed
+   * window is their product (one round trip in flight plus one
+   * buffered). This runs ahead of the doubling heuristic on long fat
+   * links and never shrinks the target. */
+  if (!channel->window_fixed &&
+      channel->rate_est_in > 0 && channel->rtt_est_ms > 0) {
+    uint64_t bdp = (uint64_t) channel->rate_est_in *
+        channel->rtt_est_ms / 1000 * 2;
+
+    if (bdp > WINDOWMAX) {
+      bdp = WINDOWMAX;
+    }
+    if ((uint32_t) bdp > target) {
+      target = (uint32_t) bdp;
+      channel->window_target = target;
+      ssh_log(session, SSH_LOG_PROTOCOL,
+          "Sizing receive window target (channel %d:%d) to %d bytes "
+          "from the measured rate and round trip",
+          channel->local_channel, channel->remote_channel, target);
+    }
+  }
+
+  new_window = (uint32_t) minimumsize > target ? (uint32_t) minimumsize : target;
   if(new_window <= channel->local_window){
     ssh_log(session,SSH_LOG_PROTOCOL,
         "growing window (channel %d:%d) to %d bytes : not needed (%d bytes)",
@@ -335,6 +663,61 @@ static int grow_window(ssh_session session, ssh_channel channel, int minimumsize
     leave_function();
     return SSH_OK;
   }
+  /* Memory backpressure: above the configured cap the window is not
+   * regrown, so the remote side stalls on window control instead of
+   * the buffers growing unbounded. A caller that needs window to make
+   * any progress at all still gets exactly that much, which keeps a
+   * blocked reader from deadlocking against a full session.
+   */
+  if (ssh_memory_watch_active(session)) {
+    size_t used = ssh_memory_usage_update(session);
+
+    if (session->memory_limit > 0 && used >= session->memory_limit) {
+      if ((uint32_t) minimumsize > channel->local_window) {
+        new_window = (uint32_t) minimumsize;
+      } else {
+        ssh_log(session, SSH_LOG_PROTOCOL,
+            "Withholding window growth (channel %d:%d): %zu bytes of "
+            "buffers against a %zu bytes cap",
+            channel->local_channel, channel->remote_channel,
+            used, session->memory_limit);
+        leave_function();
+        return SSH_OK;
+      }
+    }
+  }
+
+  /* Receive-side pacing: granting window is what lets the remote side
+   * send, so capping the increment to the bucket caps its rate. The
+   * increment never drops below what the caller needs to make progress.
+   */
+  if (channel->rate_limit > 0 || session->rate_limit > 0) {
+    uint64_t allow = channel_pacing_allowance(channel, 0);
+    uint32_t increment = new_window - channel->local_window;
+    uint32_t needed = 0;
+
+    if ((uint32_t) minimumsize > channel->local_window) {
+      needed = (uint32_t) minimumsize - channel->local_window;
+    }
+    if (allow < increment) {
+      increment = allow > needed ? (uint32_t) allow : needed;
+      ssh_pacing_arm(session);
+    }
+    if (increment == 0) {
+      leave_function();
+      return SSH_OK;
+    }
+    channel_pacing_consume(channel, 0, increment);
+    new_window = channel->local_window + increment;
+  }
+
+  if (channel->local_window == 0 && !channel->rtt_probe_armed) {
+    /* the remote side is window-blocked right now, so the gap between
+     * this refill and the next data packet approximates the round trip */
+    channel->rtt_probe_armed = 1;
+    ssh_timestamp_init(&channel->rtt_probe);
+  }
+
   /* WINDOW_ADJUST packet needs a relative increment rather than an absolute
    * value, so we give here the missing bytes needed to reach new_window
    */
@@ -366,6 +749,197 @@ error:
   return SSH_ERROR;
 }
 
+/** @internal
+ * @brief Pushes the splice state of a destination channel forward: once
+ * its send queue drained, a pending EOF is passed on and the source's
+ * receive window is refilled. Called whenever the queue may have made
+ * progress, so the window coupling is what the origin actually feels.
+ */
+static void channel_splice_update(ssh_channel channel) {
+  if (buffer_get_rest_len(channel->out_queue) > 0) {
+    return;
+  }
+  if (channel->splice_eof_pending) {
+    channel->splice_eof_pending = 0;
+    if (channel->local_eof == 0 &&
+        channel->state == SSH_CHANNEL_STATE_OPEN) {
+      ssh_channel_send_eof(channel);
+    }
+  }
+  if (channel->splice_src != NULL) {
+    ssh_channel src = channel->splice_src;
+
+    if (src->local_window < channel_window_target(src) / 2) {
+      grow_window(src->session, src, 0);
+    }
+  }
+}
+
+/** @internal
+ * @brief The source end of a splice saw EOF or close: break the link and
+ * pass the EOF on to the peer, after everything queued before it.
+ */
+static void channel_splice_forward_eof(ssh_channel channel) {
+  ssh_channel peer = channel->splice_peer;
+
+  if (peer == NULL) {
+    return;
+  }
+  ssh_channel_unsplice(channel);
+  if (buffer_get_rest_len(peer->out_queue) > 0) {
+    peer->splice_eof_pending = 1;
+  } else if (peer->local_eof == 0 &&
+             peer->state == SSH_CHANNEL_STATE_OPEN) {
+    ssh_channel_send_eof(peer);
+  }
+}
+
+/** @internal
+ * @brief Pacing timer: flush held-back output and regrow withheld
+ * receive windows once the buckets refilled.
+ */
+static void ssh_pacing_tick(void *userdata) {
+  ssh_session session = userdata;
+  ssh_channel it;
+
+  session->pacing_timer = NULL;
+  channel_sched_flush(session);
+
+  if (session->channels == NULL) {
+    return;
+  }
+  it = session->channels;
+  do {
+    if ((it->rate_limit > 0 || session->rate_limit > 0) &&
+        it->state == SSH_CHANNEL_STATE_OPEN &&
+        it->local_window < channel_window_target(it) / 2) {
+      grow_window(session, it, 0);
+    }
+    it = it->next;
+  } while (it != session->channels);
+}
+
+/* default burst when the caller passes 0: an eighth of a second worth
+ * of data, but never less than a packet */
+static uint64_t channel_rate_default_burst(uint64_t rate) {
+  uint64_t burst = rate / 8;
+
+  return burst > 32768 ? burst : 32768;
+}
+
+/**
+ * @brief Limit the data rate of a channel.
+ *
+ * Both directions are paced with a token bucket each: outgoing data is
+ * held in the channel output queue and flushed as the bucket refills,
+ * and the receive window is only granted at the configured rate so the
+ * remote side slows down by window control. Pacing is driven by a poll
+ * timer, no spinning or sleeping is involved.
+ *
+ * @param[in]  channel  The channel to limit.
+ *
+ * @param[in]  rate     Bytes per second for each direction, 0 to remove
+ *                      the limit.
+ *
+ * @param[in]  burst    Bucket capacity in bytes, 0 for a default of an
+ *                      eighth of a second of data.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid channel.
+ *
+ * @see ssh_session_set_rate_limit()
+ */
+int ssh_channel_set_rate_limit(ssh_channel channel, uint64_t rate,
+    uint64_t burst) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  channel->rate_limit = rate;
+  if (rate > 0) {
+    channel->rate_burst = burst != 0 ? burst :
+        channel_rate_default_burst(rate);
+    channel->rate_out_tokens = channel->rate_burst;
+    channel->rate_in_tokens = channel->rate_burst;
+    ssh_timestamp_init(&channel->rate_out_since);
+    ssh_timestamp_init(&channel->rate_in_since);
+  } else if (channel->session != NULL) {
+    /* released data may be flushable right away */
+    channel_sched_flush(channel->session);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Limit the aggregate data rate of every channel of a session.
+ *
+ * Works like ssh_channel_set_rate_limit() but with one bucket per
+ * direction shared by all channels; a per-channel limit and the session
+ * limit combine, the stricter one wins at any moment.
+ *
+ * @param[in]  session  The session to limit.
+ *
+ * @param[in]  rate     Bytes per second for each direction, 0 to remove
+ *                      the limit.
+ *
+ * @param[in]  burst    Bucket capacity in bytes, 0 for a default of an
+ *                      eighth of a second of data.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid session.
+ */
+int ssh_session_set_rate_limit(ssh_session session, uint64_t rate,
+    uint64_t burst) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+
+  session->rate_limit = rate;
+  if (rate > 0) {
+    session->rate_burst = burst != 0 ? burst :
+        channel_rate_default_burst(rate);
+    session->rate_out_tokens = session->rate_burst;
+    session->rate_in_tokens = session->rate_burst;
+    ssh_timestamp_init(&session->rate_out_since);
+    ssh_timestamp_init(&session->rate_in_since);
+  } else {
+    channel_sched_flush(session);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Set the size of the local receive window of a channel.
+ *
+ * By default the window starts at 128KB and is scaled up automatically
+ * when the remote side keeps it full, up to 2MB. This function pins the
+ * window to a fixed size instead, for applications which want to bound
+ * per-channel buffering or know the bandwidth-delay product of their
+ * link.
+ *
+ * @param[in]  channel  The channel to configure.
+ *
+ * @param[in]  size     The window size in bytes. 0 returns to automatic
+ *                      scaling.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_channel_set_window(ssh_channel channel, uint32_t size) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  channel->window_target = size;
+  channel->window_fixed = (size != 0);
+
+  if (channel->state == SSH_CHANNEL_STATE_OPEN &&
+      size > channel->local_window) {
+    return grow_window(channel->session, channel, size);
+  }
+
+  return SSH_OK;
+}
+
 /**
  * @internal
  *
@@ -435,6 +1009,35 @@ SSH_PACKET_CALLBACK(channel_rcv_change_window) {
       channel->remote_window);
 
   channel->remote_window += bytes;
+  /* the grants mirror what the remote application consumed, so their
+   * rate is the drain rate of the far end */
+  ssh_rate_est_update(&channel->drain_est, &channel->drain_est_acc,
+      &channel->drain_est_ts, bytes);
+
+  if (channel->stalled && channel->remote_window > 0) {
+    /* a writer was waiting on the closed window, account the stall */
+    int stalled_ms = ssh_timestamp_elapsed_ms(&channel->stall_since);
+
+    channel->stats.window_stall_ms += stalled_ms;
+    session->stats.window_stall_ms += stalled_ms;
+    channel->stalled = 0;
+  }
+
+  if (ssh_callbacks_exists(channel->callbacks, channel_window_grow_function)) {
+    channel->callbacks->channel_window_grow_function(session,
+                                                    channel,
+                                                    bytes,
+                                                    channel->callbacks->userdata);
+  }
+
+  /* the reopened window is the moment queued writers can make progress
+   * again, give every channel of the session a scheduling round */
+  channel_sched_flush(session);
+
+  if (channel->pump != NULL) {
+    /* the queue may have drained, re-arm the fd pump */
+    channel_fd_pump_update(channel);
+  }
 
   leave_function();
   return SSH_PACKET_USED;
@@ -443,8 +1046,8 @@ SSH_PACKET_CALLBACK(channel_rcv_change_window) {
 /* is_stderr is set to 1 if the data are extended, ie stderr */
 SSH_PACKET_CALLBACK(channel_rcv_data){
   ssh_channel channel;
-  ssh_string str;
   ssh_buffer buf;
+  uint32_t strlen;
   size_t len;
   int is_stderr;
   int rest;
@@ -469,13 +1072,19 @@ SSH_PACKET_CALLBACK(channel_rcv_data){
     buffer_get_u32(packet, &ignore);
   }
 
-  str = buffer_get_ssh_string(packet);
-  if (str == NULL) {
+  /* read the payload in place from the packet buffer instead of going
+   * through an intermediate ssh_string copy */
+  if (buffer_get_u32(packet, &strlen) != sizeof(uint32_t)) {
+    ssh_log(session, SSH_LOG_PACKET, "Invalid data packet!");
+    leave_function();
+    return SSH_PACKET_USED;
+  }
+  len = ntohl(strlen);
+  if (len > buffer_get_rest_len(packet)) {
     ssh_log(session, SSH_LOG_PACKET, "Invalid data packet!");
     leave_function();
     return SSH_PACKET_USED;
   }
-  len = ssh_string_len(str);
 
   ssh_log(session, SSH_LOG_PROTOCOL,
       "Channel receiving %" PRIdS " bytes data in %d (local win=%d remote win=%d)",
@@ -492,11 +1101,20 @@ SSH_PACKET_CALLBACK(channel_rcv_data){
         channel->local_window);
   }
 
-  if (channel_default_bufferize(channel, ssh_string_data(str), len,
-        is_stderr) < 0) {
-    ssh_string_free(str);
-    leave_function();
-    return SSH_PACKET_USED;
+  channel->stats.bytes_in += len;
+  ssh_rate_est_update(&channel->rate_est_in, &channel->rate_est_in_acc,
+      &channel->rate_est_in_ts, len);
+  if (channel->rtt_probe_armed) {
+    /* first data after a window refill sent while the window was shut:
+     * the sender was blocked, so the gap is about one round trip */
+    int rtt = ssh_timestamp_elapsed_ms(&channel->rtt_probe);
+
+    channel->rtt_probe_armed = 0;
+    if (channel->rtt_est_ms == 0) {
+      channel->rtt_est_ms = rtt;
+    } else {
+      channel->rtt_est_ms += (rtt - (int) channel->rtt_est_ms) / 4;
+    }
   }
 
   if (len <= channel->local_window) {
@@ -510,14 +1128,80 @@ SSH_PACKET_CALLBACK(channel_rcv_data){
       channel->local_window,
       channel->remote_window);
 
-  ssh_string_free(str);
+  if (channel->splice_peer != NULL && len > 0) {
+    /* spliced relay: move the decrypted payload straight into the peer's
+     * send queue; channel_sched_flush_one() re-fragments it to the
+     * peer's maxpacket on the way out, so the application never sees
+     * the bytes at all */
+    ssh_channel peer = channel->splice_peer;
+    size_t take = len;
 
-  if(ssh_callbacks_exists(channel->callbacks, channel_data_function)) {
-      if(is_stderr) {
-        buf = channel->stderr_buffer;
-      } else {
-        buf = channel->stdout_buffer;
+    if (channel->splice_remaining > 0 && take > channel->splice_remaining) {
+      take = (size_t)channel->splice_remaining;
+    }
+    if (channel_write_common(peer, buffer_get_rest(packet), take,
+          is_stderr) < 0) {
+      /* the peer stopped taking data (closed or EOF sent); break the
+       * link and deliver the payload through the normal buffers */
+      ssh_channel_unsplice(channel);
+    } else {
+      if (channel->splice_remaining > 0) {
+        channel->splice_remaining -= take;
+        if (channel->splice_remaining == 0) {
+          ssh_channel_unsplice(channel);
+        }
+      }
+      buffer_pass_bytes(packet, take);
+      len -= take;
+      if (len == 0) {
+        /* coupled backpressure: the window is only refilled while the
+         * peer's queue keeps draining, so a slow far end stalls the
+         * origin on window control instead of growing our buffers */
+        if (buffer_get_rest_len(peer->out_queue) < CHANNEL_PUMP_QUEUE_MAX &&
+            channel->local_window < channel_window_target(channel) / 2) {
+          if (grow_window(session, channel, 0) < 0) {
+            leave_function();
+            return -1;
+          }
+        }
+        leave_function();
+        return SSH_PACKET_USED;
       }
+    }
+  }
+
+  buf = NULL;
+  if (ssh_callbacks_exists(channel->callbacks, channel_data_function)) {
+    buf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
+  }
+
+  if (buf != NULL && buffer_get_rest_len(buf) == 0) {
+    /* with an on_data consumer and nothing queued, hand the decrypted
+     * payload straight to the application and only spill what it leaves
+     * over; the common case never touches stdout_buffer at all */
+    rest = channel->callbacks->channel_data_function(channel->session,
+                                              channel,
+                                              buffer_get_rest(packet),
+                                              len,
+                                              is_stderr,
+                                              channel->callbacks->userdata);
+    if (rest < 0 || (size_t)rest > len) {
+      rest = 0;
+    }
+    if ((size_t)rest < len &&
+        channel_default_bufferize(channel,
+          (char *)buffer_get_rest(packet) + rest, len - rest,
+          is_stderr) < 0) {
+      leave_function();
+      return SSH_PACKET_USED;
+    }
+  } else {
+    if (channel_default_bufferize(channel, buffer_get_rest(packet), len,
+          is_stderr) < 0) {
+      leave_function();
+      return SSH_PACKET_USED;
+    }
+    if (buf != NULL) {
       rest = channel->callbacks->channel_data_function(channel->session,
                                                 channel,
                                                 buffer_get_rest(buf),
@@ -527,12 +1211,20 @@ SSH_PACKET_CALLBACK(channel_rcv_data){
       if(rest > 0) {
         buffer_pass_bytes(buf, rest);
       }
-      if (channel->local_window + buffer_get_rest_len(buf) < WINDOWLIMIT) {
-        if (grow_window(session, channel, 0) < 0) {
-          leave_function();
-          return -1;
-        }
-      }
+    }
+  }
+  buffer_pass_bytes(packet, len);
+
+  if (buf != NULL &&
+      channel->local_window + buffer_get_rest_len(buf) < channel_window_target(channel) / 2) {
+    if (grow_window(session, channel, 0) < 0) {
+      leave_function();
+      return -1;
+    }
+  }
+
+  if (channel->pump != NULL) {
+    channel_fd_pump_update(channel);
   }
 
   leave_function();
@@ -565,6 +1257,12 @@ SSH_PACKET_CALLBACK(channel_rcv_eof) {
                                                channel->callbacks->userdata);
   }
 
+  channel_splice_forward_eof(channel);
+
+  if (channel->pump != NULL) {
+    channel_fd_pump_update(channel);
+  }
+
   leave_function();
   return SSH_PACKET_USED;
 }
@@ -612,6 +1310,17 @@ SSH_PACKET_CALLBACK(channel_rcv_close) {
                                                  channel->callbacks->userdata);
     }
 
+	channel_splice_forward_eof(channel);
+	if (channel->splice_src != NULL) {
+		/* we were the sink of a splice; the source has nowhere to
+		 * forward to anymore */
+		ssh_channel_unsplice(channel->splice_src);
+	}
+
+	if (channel->pump != NULL) {
+		channel_fd_pump_update(channel);
+	}
+
 	leave_function();
 	return SSH_PACKET_USED;
 }
@@ -888,6 +1597,64 @@ int ssh_channel_open_session(ssh_channel channel) {
   return channel_open(channel,"session",64000,32000,NULL);
 }
 
+/**
+ * @brief Open an agent forwarding channel toward the client's agent.
+ *
+ * Sent by a server once the client granted agent forwarding with
+ * ssh_channel_request_auth_agent(). Each channel carries one agent
+ * conversation at a time; the agent protocol serializes request and
+ * reply on a channel, so a bastion handling concurrent sign requests
+ * should open one channel per in-flight request (see
+ * ssh_channel_open_auth_agent_async()).
+ *
+ * @param[in]  channel  An allocated channel.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ *
+ * @see ssh_channel_request_auth_agent()
+ */
+int ssh_channel_open_auth_agent(ssh_channel channel) {
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+
+  return channel_open(channel,"auth-agent@openssh.com",64000,32000,NULL);
+}
+
+/**
+ * @brief Send the open for an agent forwarding channel without waiting
+ *        for the confirmation.
+ *
+ * Issue one of these per concurrent agent request and collect the
+ * confirmations with ssh_channel_open_wait(): a burst of N sign
+ * requests costs about one open round trip instead of N, and the
+ * requests then proceed in parallel on their own channels instead of
+ * queueing behind a single agent conversation.
+ *
+ * @param[in]  channel  An allocated channel.
+ *
+ * @return              SSH_OK when the open was sent, SSH_ERROR if an
+ *                      error occured.
+ *
+ * @see ssh_channel_open_wait()
+ */
+int ssh_channel_open_auth_agent_async(ssh_channel channel) {
+  ssh_session session;
+  int rc;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+
+  enter_function();
+  rc = channel_open_send(channel, "auth-agent@openssh.com", 64000, 32000,
+      NULL);
+  leave_function();
+
+  return rc;
+}
+
 /**
  * @brief Open a TCP/IP forwarding channel.
  *
@@ -970,179 +1737,1386 @@ error:
   return rc;
 }
 
-
 /**
- * @brief Close and free a channel.
+ * @brief Build a reusable open template for a direct-tcpip destination.
  *
- * @param[in]  channel  The channel to free.
+ * The complete SSH2_MSG_CHANNEL_OPEN message is serialized once; each
+ * open from the template only patches the local channel id into the
+ * prebuilt image, so a relay opening thousands of channels to the same
+ * destination skips the per-open string building entirely.
  *
- * @warning Any data unread on this channel will be lost.
+ * @param[in]  session  The session the template will be used on.
+ *
+ * @param[in]  remotehost The remote host to connect (host name or IP).
+ *
+ * @param[in]  remoteport The remote port.
+ *
+ * @param[in]  sourcehost The numeric IP address of the machine from where the
+ *                        connection request originates. This is mostly for
+ *                        logging purposes.
+ *
+ * @param[in]  localport  The port on the host from where the connection
+ *                        originated. This is mostly for logging purposes.
+ *
+ * @return              The template, NULL on error. Free it with
+ *                      ssh_channel_open_template_free().
+ *
+ * @see ssh_channel_open_forward_template()
+ * @see ssh_channel_open_forward_template_async()
  */
-void ssh_channel_free(ssh_channel channel) {
-  ssh_session session;
+ssh_channel_open_template ssh_channel_open_forward_template_new(
+    ssh_session session, const char *remotehost, int remoteport,
+    const char *sourcehost, int localport) {
+  ssh_channel_open_template tmpl = NULL;
 
-  if (channel == NULL) {
+  if (remotehost == NULL || sourcehost == NULL) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return NULL;
+  }
+
+  tmpl = malloc(sizeof(struct ssh_channel_open_template_struct));
+  if (tmpl == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(tmpl);
+  tmpl->window = 64000;
+  tmpl->maxpacket = 32000;
+  /* message type, type string and its length word precede the id */
+  tmpl->id_offset = sizeof(uint8_t) + sizeof(uint32_t) +
+      strlen("direct-tcpip");
+
+  tmpl->image = ssh_buffer_new();
+  if (tmpl->image == NULL) {
+    ssh_set_error_oom(session);
+    SAFE_FREE(tmpl);
+    return NULL;
+  }
+
+  if (ssh_buffer_pack(tmpl->image, "bsdddsdsd",
+        SSH2_MSG_CHANNEL_OPEN,
+        "direct-tcpip",
+        (uint32_t) 0, /* patched per open */
+        tmpl->window,
+        tmpl->maxpacket,
+        remotehost,
+        (uint32_t) remoteport,
+        sourcehost,
+        (uint32_t) localport) != SSH_OK) {
+    ssh_set_error_oom(session);
+    ssh_channel_open_template_free(tmpl);
+    return NULL;
+  }
+
+  return tmpl;
+}
+
+/**
+ * @brief Free a channel open template.
+ *
+ * @param[in]  tmpl     The template to free.
+ */
+void ssh_channel_open_template_free(ssh_channel_open_template tmpl) {
+  if (tmpl == NULL) {
     return;
   }
 
-  session = channel->session;
-  enter_function();
+  ssh_buffer_free(tmpl->image);
+  SAFE_FREE(tmpl);
+}
+
+/**
+ * @internal
+ *
+ * @brief Send a SSH_MSG_CHANNEL_OPEN from a prebuilt template.
+ */
+static int channel_open_template_send(ssh_channel channel,
+    ssh_channel_open_template tmpl) {
+  ssh_session session = channel->session;
+  unsigned char *image = buffer_get_rest(tmpl->image);
+  uint32_t id;
 
-  if (session->alive && channel->state == SSH_CHANNEL_STATE_OPEN) {
-    ssh_channel_close(channel);
+  if (session->deferred_hostkey && !session->hostkey_verified) {
+    ssh_set_error(session, SSH_FATAL,
+        "Host key verification is still pending on this session");
+    return SSH_ERROR;
   }
 
-  /* handle the "my channel is first on session list" case */
-  if (session->channels == channel) {
-    session->channels = channel->next;
+  channel->local_channel = ssh_channel_new_id(session);
+  ssh_channel_table_register(session, channel);
+  channel->local_maxpacket = tmpl->maxpacket;
+  channel->local_window = tmpl->window;
+  if (channel->window_target == 0) {
+    channel->window_target = tmpl->window;
   }
 
-  /* handle the "my channel is the only on session list" case */
-  if (channel->next == channel) {
-    session->channels = NULL;
-  } else {
-    channel->prev->next = channel->next;
-    channel->next->prev = channel->prev;
+  id = htonl(channel->local_channel);
+  memcpy(image + tmpl->id_offset, &id, sizeof(uint32_t));
+
+  if (buffer_add_data(session->out_buffer, image,
+        buffer_get_rest_len(tmpl->image)) < 0) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
   }
 
-  ssh_buffer_free(channel->stdout_buffer);
-  ssh_buffer_free(channel->stderr_buffer);
+  if (packet_send(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
 
-  /* debug trick to catch use after frees */
-  memset(channel, 'X', sizeof(struct ssh_channel_struct));
-  SAFE_FREE(channel);
+  ssh_log(session, SSH_LOG_PACKET,
+      "Sent a templated SSH_MSG_CHANNEL_OPEN for channel %d",
+      channel->local_channel);
 
-  leave_function();
+  channel->open_pending = 1;
+
+  return SSH_OK;
 }
 
 /**
- * @brief Send an end of file on the channel.
+ * @brief Open a TCP/IP forwarding channel from a template and wait for
+ *        the server's confirmation.
  *
- * This doesn't close the channel. You may still read from it but not write.
+ * @param[in]  channel  An allocated channel.
  *
- * @param[in]  channel  The channel to send the eof to.
+ * @param[in]  tmpl     The template built by
+ *                      ssh_channel_open_forward_template_new().
  *
  * @return              SSH_OK on success, SSH_ERROR if an error occured.
- *
- * @see channel_close()
- * @see channel_free()
  */
-int ssh_channel_send_eof(ssh_channel channel){
+int ssh_channel_open_forward_template(ssh_channel channel,
+    ssh_channel_open_template tmpl) {
   ssh_session session;
-  int rc = SSH_ERROR;
+  int rc;
 
-  if(channel == NULL) {
-      return rc;
+  if (channel == NULL || tmpl == NULL) {
+    return SSH_ERROR;
   }
-
   session = channel->session;
-  enter_function();
 
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_EOF) < 0) {
-    ssh_set_error_oom(session);
-    goto error;
-  }
-  if (buffer_add_u32(session->out_buffer,htonl(channel->remote_channel)) < 0) {
-    ssh_set_error_oom(session);
-    goto error;
+  enter_function();
+  rc = channel_open_template_send(channel, tmpl);
+  if (rc == SSH_OK) {
+    rc = channel_open_wait(channel);
   }
-  rc = packet_send(session);
-  ssh_log(session, SSH_LOG_PACKET,
-      "Sent a EOF on client channel (%d:%d)",
-      channel->local_channel,
-      channel->remote_channel);
-
-  channel->local_eof = 1;
-
   leave_function();
-  return rc;
-error:
-  buffer_reinit(session->out_buffer);
 
-  leave_function();
   return rc;
 }
 
 /**
- * @brief Close a channel.
+ * @brief Open a TCP/IP forwarding channel from a template without
+ *        waiting for the confirmation.
  *
- * This sends an end of file and then closes the channel. You won't be able
- * to recover any data the server was going to send or was in buffers.
+ * The protocol lets any number of SSH_MSG_CHANNEL_OPEN be in flight, so
+ * issue a whole batch of these back to back and then collect each
+ * confirmation with ssh_channel_open_wait(): N opens cost about one
+ * round trip instead of N.
  *
- * @param[in]  channel  The channel to close.
+ * @param[in]  channel  An allocated channel.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @param[in]  tmpl     The template built by
+ *                      ssh_channel_open_forward_template_new().
  *
- * @see channel_free()
- * @see channel_eof()
+ * @return              SSH_OK when the open was sent, SSH_ERROR if an
+ *                      error occured.
+ *
+ * @see ssh_channel_open_wait()
  */
-int ssh_channel_close(ssh_channel channel){
+int ssh_channel_open_forward_template_async(ssh_channel channel,
+    ssh_channel_open_template tmpl) {
   ssh_session session;
-  int rc = 0;
+  int rc;
 
-  if(channel == NULL) {
+  if (channel == NULL || tmpl == NULL) {
     return SSH_ERROR;
   }
-
   session = channel->session;
-  enter_function();
-
-  if (channel->local_eof == 0) {
-    rc = ssh_channel_send_eof(channel);
-  }
 
-  if (rc != SSH_OK) {
-    leave_function();
-    return rc;
-  }
+  enter_function();
+  rc = channel_open_template_send(channel, tmpl);
+  leave_function();
 
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_CLOSE) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->remote_channel)) < 0) {
-    ssh_set_error_oom(session);
-    goto error;
-  }
+  return rc;
+}
 
-  rc = packet_send(session);
-  ssh_log(session, SSH_LOG_PACKET,
-      "Sent a close on client channel (%d:%d)",
-      channel->local_channel,
-      channel->remote_channel);
+/**
+ * @brief Wait until the server answered the channel's open request.
+ *
+ * Confirmations are matched to channels by id as they arrive, so the
+ * channels of a batch may be waited on in any order.
+ *
+ * @param[in]  channel  A channel whose open was sent asynchronously.
+ *
+ * @return              SSH_OK when the channel is open, SSH_ERROR if the
+ *                      open was denied or an error occured.
+ */
+int ssh_channel_open_wait(ssh_channel channel) {
+  ssh_session session;
+  int rc;
 
-  if(rc == SSH_OK) {
-    channel->state=SSH_CHANNEL_STATE_CLOSED;
+  if (channel == NULL) {
+    return SSH_ERROR;
   }
+  session = channel->session;
 
+  enter_function();
+  rc = channel_open_wait(channel);
   leave_function();
-  return rc;
-error:
-  buffer_reinit(session->out_buffer);
 
-  leave_function();
   return rc;
 }
 
-int channel_write_common(ssh_channel channel, const void *data,
-    uint32_t len, int is_stderr) {
+
+/**
+ * @brief Close and free a channel.
+ *
+ * @param[in]  channel  The channel to free.
+ *
+ * @warning Any data unread on this channel will be lost.
+ */
+void ssh_channel_free(ssh_channel channel) {
   ssh_session session;
-  int origlen = len;
-  size_t effectivelen;
-  size_t maxpacketlen;
 
-  if(channel == NULL) {
-      return -1;
+  if (channel == NULL) {
+    return;
   }
+
   session = channel->session;
-  if(data == NULL) {
-      ssh_set_error_invalid(session, __FUNCTION__);
-      return -1;
-  }
   enter_function();
 
-  /*
-   * Handle the max packet len from remote side, be nice
-   * 10 bytes for the headers
-   */
-  maxpacketlen = channel->remote_maxpacket - 10;
+  if (channel->detached == 0) {
+    channel->detached = 1;
+
+    channel_fd_pump_detach(channel);
+    ssh_channel_unsplice(channel);
+    if (channel->splice_src != NULL) {
+      ssh_channel_unsplice(channel->splice_src);
+    }
+
+    if (channel->drain_cb != NULL) {
+      channel->drain_cb = NULL;
+      if (session->drain_watchers > 0) {
+        session->drain_watchers--;
+      }
+    }
+
+    if (session->alive && channel->state == SSH_CHANNEL_STATE_OPEN) {
+      ssh_channel_close(channel);
+    }
+
+    channel_table_remove(session, channel);
+
+    /* handle the "my channel is first on session list" case */
+    if (session->channels == channel) {
+      session->channels = channel->next;
+    }
+
+    /* handle the "my channel is the only on session list" case */
+    if (channel->next == channel) {
+      session->channels = NULL;
+    } else {
+      channel->prev->next = channel->next;
+      channel->next->prev = channel->prev;
+    }
+  }
+
+  if (ssh_refcount_dec(&channel->refcount) > 0) {
+    /* another thread still holds a reference taken with ssh_channel_ref(),
+     * the memory is released with the last one */
+    leave_function();
+    return;
+  }
+
+  ssh_buffer_free(channel->stdout_buffer);
+  ssh_buffer_free(channel->stderr_buffer);
+  ssh_buffer_free(channel->out_queue);
+  SAFE_FREE(channel->early_request);
+  ssh_buffer_free(channel->early_request_buf);
+  if (channel->ring != NULL) {
+    SAFE_FREE(channel->ring->data);
+    SAFE_FREE(channel->ring);
+  }
+
+  /* debug trick to catch use after frees */
+  memset(channel, 'X', sizeof(struct ssh_channel_struct));
+  SAFE_FREE(channel);
+
+  leave_function();
+}
+
+/**
+ * @brief Take an additional reference on a channel.
+ *
+ * The reference counter is atomic, so a worker thread may pin the channel
+ * it operates on while another thread drives the session. Each reference,
+ * including the implicit one owned since ssh_channel_new(), is released
+ * with ssh_channel_free(); the first release also closes the channel and
+ * detaches it from its session, the last one frees the memory.
+ *
+ * This protects the channel pointer held across calls, it does not make
+ * concurrent calls on the same channel or session safe.
+ *
+ * @param[in]  channel  The channel to reference.
+ */
+void ssh_channel_ref(ssh_channel channel) {
+  if (channel == NULL) {
+    return;
+  }
+  ssh_refcount_inc(&channel->refcount);
+}
+
+/**
+ * @brief Snapshot the performance counters of a channel.
+ *
+ * @param[in]  channel  The channel to inspect.
+ *
+ * @param[out] stats    A caller-allocated ssh_channel_stats_struct
+ *                      receiving a copy of the counters.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid argument.
+ *
+ * @see ssh_get_stats()
+ */
+int ssh_channel_get_stats(ssh_channel channel, ssh_channel_stats stats) {
+  if (channel == NULL || stats == NULL) {
+    return SSH_ERROR;
+  }
+
+  *stats = channel->stats;
+  if (channel->stalled) {
+    /* fold in the stall still in progress */
+    stats->window_stall_ms += ssh_timestamp_elapsed_ms(&channel->stall_since);
+  }
+  stats->rate_in_ewma = channel->rate_est_in;
+  stats->rate_out_ewma = channel->rate_est_out;
+  stats->drain_rate_ewma = channel->drain_est;
+  stats->rtt_ewma_ms = channel->rtt_est_ms;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Set the scheduling priority of a channel.
+ *
+ * When several channels of one session have pending output, interactive
+ * channels are always served before bulk ones and bulk channels share
+ * the link fairly among themselves. Marking a file transfer channel as
+ * SSH_CHANNEL_PRIORITY_BULK keeps a shell on the same session
+ * responsive next to it.
+ *
+ * @param[in]  channel  The channel to configure.
+ *
+ * @param[in]  priority SSH_CHANNEL_PRIORITY_INTERACTIVE (the default)
+ *                      or SSH_CHANNEL_PRIORITY_BULK.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid argument.
+ */
+int ssh_channel_set_priority(ssh_channel channel,
+    enum ssh_channel_priority_e priority) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (priority != SSH_CHANNEL_PRIORITY_INTERACTIVE &&
+      priority != SSH_CHANNEL_PRIORITY_BULK) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  channel->priority = priority;
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief writes buffered channel data out to the pump's fd
+ *
+ * Drains stdout then stderr; a short write leaves the rest for the next
+ * POLLOUT. The receive window is replenished the same way
+ * ssh_channel_read() does it once the buffers empty out.
+ */
+static int channel_fd_pump_drain(struct ssh_channel_fd_pump_struct *pump) {
+  ssh_channel channel = pump->channel;
+  ssh_buffer bufs[2];
+  ssh_buffer buf;
+  int w;
+  int i;
+
+  bufs[0] = channel->stdout_buffer;
+  bufs[1] = channel->stderr_buffer;
+  for (i = 0; i < 2; i++) {
+    buf = bufs[i];
+    while (buf != NULL && buffer_get_rest_len(buf) > 0) {
+      w = send(pump->fd, buffer_get_rest(buf), buffer_get_rest_len(buf), 0);
+      if (w < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          /* the sink's send buffer is full; freeze the receive window
+           * until the POLLOUT that drains this backlog */
+          pump->sink_blocked = 1;
+          return SSH_OK;
+        }
+        return SSH_ERROR;
+      }
+      buffer_pass_bytes(buf, w);
+    }
+  }
+  pump->sink_blocked = 0;
+
+  if (channel->local_window < channel_window_target(channel) / 2) {
+    if (grow_window(channel->session, channel, 0) < 0) {
+      return SSH_ERROR;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief reads the pump's fd into the channel scheduler queue
+ *
+ * Stops once CHANNEL_PUMP_QUEUE_MAX bytes are queued; the POLLIN event
+ * is re-armed from channel_fd_pump_update() when the remote window
+ * lets the queue drain again.
+ */
+static int channel_fd_pump_fill(struct ssh_channel_fd_pump_struct *pump) {
+  ssh_channel channel = pump->channel;
+  char buf[CHANNEL_PUMP_CHUNK];
+  int r;
+
+  while (channel->state == SSH_CHANNEL_STATE_OPEN &&
+      buffer_get_rest_len(channel->out_queue) < CHANNEL_PUMP_QUEUE_MAX) {
+    r = recv(pump->fd, buf, sizeof(buf), 0);
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return SSH_OK;
+      }
+      return SSH_ERROR;
+    }
+    if (r == 0) {
+      pump->fd_eof = 1;
+      pump->eof_pending = 1;
+      return SSH_OK;
+    }
+    if (channel_write_common(channel, buf, r, 0) < 0) {
+      return SSH_ERROR;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief tears the pump down and closes its fd
+ */
+void channel_fd_pump_detach(ssh_channel channel) {
+  struct ssh_channel_fd_pump_struct *pump = channel->pump;
+
+  if (pump == NULL) {
+    return;
+  }
+  channel->pump = NULL;
+
+  ssh_poll_free(pump->poll);
+#ifdef _WIN32
+  closesocket(pump->fd);
+#else
+  close(pump->fd);
+#endif
+  SAFE_FREE(pump);
+}
+
+/** @internal
+ * @brief advances the pump after channel activity
+ *
+ * Called from the data, window adjust, eof and close handlers: sends
+ * the deferred channel EOF once the scheduler queue drained, pushes
+ * buffered data at the fd and recomputes the poll events. Detaches the
+ * pump when both directions are finished.
+ */
+void channel_fd_pump_update(ssh_channel channel) {
+  struct ssh_channel_fd_pump_struct *pump = channel->pump;
+  short events = 0;
+
+  if (pump == NULL) {
+    return;
+  }
+
+  /* the fd side ended; the EOF must trail the queued data */
+  if (pump->eof_pending &&
+      buffer_get_rest_len(channel->out_queue) == 0 &&
+      channel->state == SSH_CHANNEL_STATE_OPEN &&
+      channel->local_eof == 0) {
+    pump->eof_pending = 0;
+    if (ssh_channel_send_eof(channel) == SSH_ERROR) {
+      channel_fd_pump_detach(channel);
+      return;
+    }
+  }
+
+  if (channel_fd_pump_drain(pump) == SSH_ERROR) {
+    channel_fd_pump_detach(channel);
+    return;
+  }
+
+  if (channel->state == SSH_CHANNEL_STATE_CLOSED ||
+      (pump->fd_eof && pump->eof_pending == 0 && channel->remote_eof &&
+       (channel->stdout_buffer == NULL ||
+        buffer_get_rest_len(channel->stdout_buffer) == 0) &&
+       (channel->stderr_buffer == NULL ||
+        buffer_get_rest_len(channel->stderr_buffer) == 0) &&
+       buffer_get_rest_len(channel->out_queue) == 0)) {
+    channel_fd_pump_detach(channel);
+    return;
+  }
+
+  if (pump->fd_eof == 0 && channel->state == SSH_CHANNEL_STATE_OPEN &&
+      buffer_get_rest_len(channel->out_queue) < CHANNEL_PUMP_QUEUE_MAX) {
+    events |= POLLIN;
+  }
+  if ((channel->stdout_buffer != NULL &&
+       buffer_get_rest_len(channel->stdout_buffer) > 0) ||
+      (channel->stderr_buffer != NULL &&
+       buffer_get_rest_len(channel->stderr_buffer) > 0)) {
+    events |= POLLOUT;
+  }
+  ssh_poll_set_events(pump->poll, events);
+}
+
+static int channel_fd_pump_cb(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  struct ssh_channel_fd_pump_struct *pump = userdata;
+  ssh_channel channel = pump->channel;
+
+  (void)p;
+  (void)fd;
+
+  if (revents & POLLERR) {
+    channel_fd_pump_detach(channel);
+    return -1;
+  }
+  if (revents & POLLOUT) {
+    if (channel_fd_pump_drain(pump) == SSH_ERROR) {
+      channel_fd_pump_detach(channel);
+      return -1;
+    }
+  }
+  if (revents & (POLLIN | POLLHUP)) {
+    if (channel_fd_pump_fill(pump) == SSH_ERROR) {
+      channel_fd_pump_detach(channel);
+      return -1;
+    }
+  }
+
+  channel_fd_pump_update(channel);
+  if (channel->pump == NULL) {
+    /* the update detached us and freed the poll handle */
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Pump data between a channel and a file descriptor.
+ *
+ * Registers the descriptor with the session's poll context and moves
+ * bytes in both directions inside the library: what arrives on the
+ * channel is written to the descriptor and what the descriptor yields
+ * is sent on the channel, honoring the flow control window in each
+ * direction. This replaces the per-connection read/select/write loop
+ * applications otherwise run on top of ssh_channel_open_forward().
+ *
+ * The descriptor is switched to non-blocking mode and is owned by the
+ * channel from here on: it is closed when both directions have seen
+ * end of file or when the channel is freed. The pump progresses
+ * whenever the session processes packets, e.g. from
+ * ssh_handle_packets().
+ *
+ * @param[in]  channel  An open channel.
+ *
+ * @param[in]  fd       The socket to bind to the channel.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_channel_open_forward()
+ */
+int ssh_channel_attach_fd(ssh_channel channel, socket_t fd) {
+  struct ssh_channel_fd_pump_struct *pump;
+  ssh_session session;
+
+  if (channel == NULL || fd == SSH_INVALID_SOCKET) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+  if (channel->state != SSH_CHANNEL_STATE_OPEN || channel->pump != NULL) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  pump = malloc(sizeof(struct ssh_channel_fd_pump_struct));
+  if (pump == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(pump);
+  pump->channel = channel;
+  pump->fd = fd;
+
+  ssh_sock_set_nonblocking(fd);
+
+  pump->poll = ssh_poll_new(fd, POLLIN, channel_fd_pump_cb, pump);
+  if (pump->poll == NULL) {
+    SAFE_FREE(pump);
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  if (ssh_poll_ctx_add(ssh_poll_get_default_ctx(session), pump->poll) < 0) {
+    ssh_poll_free(pump->poll);
+    SAFE_FREE(pump);
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+  channel->pump = pump;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Forward a channel's incoming data into another channel.
+ *
+ * Data arriving on the source channel is moved from the packet layer
+ * straight into the destination's send queue, re-fragmented only when
+ * the destination's maximum packet size requires it. The application
+ * never sees the bytes, which removes the read and write copies of a
+ * relay loop. The two channels may belong to different sessions.
+ *
+ * The flow control of both legs is coupled: the source's receive
+ * window is only refilled while the destination's queue drains, so a
+ * slow far end stalls the origin instead of buffering in the relay.
+ * End of file on the source is passed on to the destination after the
+ * forwarded data. Data already queued in the source's read buffers
+ * stays there for the application.
+ *
+ * @param[in]  channel  An open channel whose data is to be forwarded.
+ *
+ * @param[in]  peer     An open channel receiving the forwarded data.
+ *
+ * @param[in]  limit    Stop forwarding after that many bytes and revert
+ *                      to normal delivery, 0 for no limit.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_channel_unsplice()
+ */
+int ssh_channel_splice(ssh_channel channel, ssh_channel peer,
+    uint64_t limit) {
+  ssh_session session;
+
+  if (channel == NULL || peer == NULL || channel == peer) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+  enter_function();
+
+  if (channel->state != SSH_CHANNEL_STATE_OPEN ||
+      peer->state != SSH_CHANNEL_STATE_OPEN || peer->local_eof) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "Both channels must be open to splice them");
+    leave_function();
+    return SSH_ERROR;
+  }
+  if (peer->splice_src != NULL && peer->splice_src != channel) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "Channel %d:%d is already the destination of a splice",
+        peer->local_channel, peer->remote_channel);
+    leave_function();
+    return SSH_ERROR;
+  }
+
+  if (channel->splice_peer != NULL) {
+    ssh_channel_unsplice(channel);
+  }
+  channel->splice_peer = peer;
+  channel->splice_remaining = limit;
+  peer->splice_src = channel;
+
+  leave_function();
+  return SSH_OK;
+}
+
+/**
+ * @brief Break the splice link of a channel.
+ *
+ * Data already moved to the destination's send queue is still sent;
+ * data arriving afterwards is delivered to the application again.
+ *
+ * @param[in]  channel  The source channel of an ssh_channel_splice().
+ *
+ * @return              SSH_OK, or SSH_ERROR on a NULL channel.
+ *
+ * @see ssh_channel_splice()
+ */
+int ssh_channel_unsplice(ssh_channel channel) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (channel->splice_peer != NULL) {
+    channel->splice_peer->splice_src = NULL;
+    channel->splice_peer = NULL;
+  }
+  channel->splice_remaining = 0;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Send an end of file on the channel.
+ *
+ * This doesn't close the channel. You may still read from it but not write.
+ *
+ * @param[in]  channel  The channel to send the eof to.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ *
+ * @see channel_close()
+ * @see channel_free()
+ */
+int ssh_channel_send_eof(ssh_channel channel){
+  ssh_session session;
+  int rc = SSH_ERROR;
+
+  if(channel == NULL) {
+      return rc;
+  }
+
+  session = channel->session;
+  enter_function();
+
+  /* queued data must reach the wire before the EOF; the window adjust
+   * handler flushes the queue, so wait for it to drain */
+  channel_sched_flush(session);
+  while (buffer_get_rest_len(channel->out_queue) > 0 &&
+      session->session_state != SSH_SESSION_STATE_ERROR &&
+      channel->state == SSH_CHANNEL_STATE_OPEN) {
+    if (ssh_handle_packets(session, -1) != SSH_OK) {
+      break;
+    }
+  }
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_EOF) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+  if (buffer_add_u32(session->out_buffer,htonl(channel->remote_channel)) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+  rc = packet_send(session);
+  ssh_log(session, SSH_LOG_PACKET,
+      "Sent a EOF on client channel (%d:%d)",
+      channel->local_channel,
+      channel->remote_channel);
+
+  channel->local_eof = 1;
+
+  leave_function();
+  return rc;
+error:
+  buffer_reinit(session->out_buffer);
+
+  leave_function();
+  return rc;
+}
+
+/**
+ * @brief Close a channel.
+ *
+ * This sends an end of file and then closes the channel. You won't be able
+ * to recover any data the server was going to send or was in buffers.
+ *
+ * @param[in]  channel  The channel to close.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ *
+ * @see channel_free()
+ * @see channel_eof()
+ */
+int ssh_channel_close(ssh_channel channel){
+  ssh_session session;
+  int rc = 0;
+
+  if(channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  session = channel->session;
+  enter_function();
+
+  if (channel->local_eof == 0) {
+    rc = ssh_channel_send_eof(channel);
+  }
+
+  if (rc != SSH_OK) {
+    leave_function();
+    return rc;
+  }
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_CLOSE) < 0 ||
+      buffer_add_u32(session->out_buffer, htonl(channel->remote_channel)) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  rc = packet_send(session);
+  ssh_log(session, SSH_LOG_PACKET,
+      "Sent a close on client channel (%d:%d)",
+      channel->local_channel,
+      channel->remote_channel);
+
+  if(rc == SSH_OK) {
+    channel->state=SSH_CHANNEL_STATE_CLOSED;
+  }
+
+  leave_function();
+  return rc;
+error:
+  buffer_reinit(session->out_buffer);
+
+  leave_function();
+  return rc;
+}
+
+/**
+ * @brief Close every open channel of a session in one batch.
+ *
+ * Equivalent to calling ssh_channel_close() on each open channel, but
+ * the session is corked for the duration: the EOF and CLOSE messages of
+ * all channels pile up in the write buffer and reach the socket in a
+ * few large writes instead of one write per channel. No reply is waited
+ * for; the close confirmations stream back and are processed by the
+ * normal packet dispatch as the session polls, so tearing down
+ * thousands of channels costs one round trip.
+ *
+ * @param[in]  session  The session whose channels to close.
+ *
+ * @return              The number of channels closed, SSH_ERROR if an
+ *                      error occured.
+ *
+ * @see ssh_channel_close()
+ */
+int ssh_session_close_channels(ssh_session session) {
+  ssh_channel it;
+  int closed = 0;
+  int corked;
+  int rc = SSH_OK;
+
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  if (session->channels == NULL) {
+    return 0;
+  }
+  enter_function();
+
+  corked = session->corked;
+  session->corked = 1;
+
+  it = session->channels;
+  do {
+    if (it->state == SSH_CHANNEL_STATE_OPEN) {
+      rc = ssh_channel_close(it);
+      if (rc != SSH_OK) {
+        break;
+      }
+      closed++;
+    }
+    it = it->next;
+  } while (it != session->channels);
+
+  session->corked = corked;
+  if (corked == 0 && ssh_socket_is_open(session->socket)) {
+    ssh_socket_nonblocking_flush(session->socket);
+  }
+
+  leave_function();
+  return rc == SSH_OK ? closed : SSH_ERROR;
+}
+
+/** @internal
+ * @brief Send one SSH2_MSG_CHANNEL_DATA packet with the given payload.
+ *
+ * The caller has already clamped len to the remote window and to the
+ * remote maximum packet size.
+ */
+static int channel_send_data_packet(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  ssh_session session = channel->session;
+
+  /* hint the payload size so out_buffer keeps its capacity across the
+   * per-packet reinit */
+  ssh_buffer_reserve(session->out_buffer, len + 16);
+  if (buffer_add_u8(session->out_buffer, is_stderr ?
+				SSH2_MSG_CHANNEL_EXTENDED_DATA : SSH2_MSG_CHANNEL_DATA) < 0 ||
+      buffer_add_u32(session->out_buffer,
+        htonl(channel->remote_channel)) < 0) {
+      ssh_set_error_oom(session);
+      goto error;
+  }
+  /* stderr message has an extra field */
+  if (is_stderr &&
+      buffer_add_u32(session->out_buffer, htonl(SSH2_EXTENDED_DATA_STDERR)) < 0) {
+      ssh_set_error_oom(session);
+      goto error;
+  }
+  /* append payload data */
+  if (buffer_add_u32(session->out_buffer, htonl(len)) < 0 ||
+      buffer_add_data(session->out_buffer, data, len) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  session->compress_hint = channel->compress_bypass;
+  if (packet_send(session) == SSH_ERROR) {
+    session->compress_hint = 0;
+    return SSH_ERROR;
+  }
+  session->compress_hint = 0;
+
+  ssh_log(session, SSH_LOG_RARE,
+      "channel_write wrote %ld bytes", (long int) len);
+
+  channel->remote_window -= len;
+  channel->stats.bytes_out += len;
+  ssh_rate_est_update(&channel->rate_est_out, &channel->rate_est_out_acc,
+      &channel->rate_est_out_ts, len);
+
+  return SSH_OK;
+error:
+  buffer_reinit(session->out_buffer);
+
+  return SSH_ERROR;
+}
+
+/** @internal
+ * @brief Send queued data of one channel, at most budget bytes.
+ *
+ * The queue holds framed writes: a stderr flag, the payload length and
+ * the payload itself, so stdout and stderr data keep their relative
+ * order. A frame may be cut into several packets; the cut position is
+ * remembered in queue_frame_rest across calls.
+ *
+ * @param[in] budget  Byte budget of this round, 0 for no limit.
+ *
+ * @return            The number of bytes sent, -1 on error.
+ */
+/** @internal
+ * @brief caps a data payload size so the resulting SSH packet fills an
+ * integral number of TCP segments
+ *
+ * Active with SSH_OPTIONS_TCP_MSS_ALIGN. Without it a maximally-sized
+ * packet ends in a nearly empty segment whose delivery the peer's stack
+ * may delay, which shows up as tail latency on medium-sized messages.
+ */
+static uint32_t channel_mss_align(ssh_session session, uint32_t maxpacketlen) {
+  uint32_t segments;
+  int mss;
+
+  if (session->tcp_mss_align == 0) {
+    return maxpacketlen;
+  }
+  mss = ssh_socket_get_mss(session->socket);
+  if (mss <= CHANNEL_WIRE_OVERHEAD) {
+    return maxpacketlen;
+  }
+  segments = (maxpacketlen + CHANNEL_WIRE_OVERHEAD) / (uint32_t) mss;
+  if (segments == 0) {
+    return maxpacketlen;
+  }
+
+  return segments * (uint32_t) mss - CHANNEL_WIRE_OVERHEAD;
+}
+
+static int channel_sched_flush_one(ssh_channel channel, uint32_t budget) {
+  ssh_session session = channel->session;
+  uint32_t maxpacketlen =
+      channel_mss_align(session, channel->remote_maxpacket - 10);
+  uint32_t sent = 0;
+
+  while (buffer_get_rest_len(channel->out_queue) > 0) {
+    uint32_t chunk;
+
+    if (channel->queue_frame_rest == 0) {
+      uint8_t stderr_flag;
+      uint32_t framelen;
+
+      if (buffer_get_u8(channel->out_queue, &stderr_flag) == 0 ||
+          buffer_get_u32(channel->out_queue, &framelen) != sizeof(uint32_t)) {
+        ssh_set_error(session, SSH_FATAL, "Corrupted channel output queue");
+        return -1;
+      }
+      channel->queue_frame_stderr = stderr_flag;
+      channel->queue_frame_rest = framelen;
+    }
+
+    if (channel->remote_window == 0) {
+      ssh_log(session, SSH_LOG_PROTOCOL,
+          "Wait for a growing window message...");
+      if (!channel->stalled) {
+        ssh_timestamp_init(&channel->stall_since);
+        channel->stalled = 1;
+      }
+      break;
+    }
+    if (budget > 0 && sent >= budget) {
+      break;
+    }
+
+    chunk = channel->queue_frame_rest;
+    if (chunk > channel->remote_window) {
+      chunk = channel->remote_window;
+    }
+    if (chunk > maxpacketlen) {
+      chunk = maxpacketlen;
+    }
+    if (budget > 0 && chunk > budget - sent) {
+      chunk = budget - sent;
+    }
+
+    if (channel->rate_limit > 0 || session->rate_limit > 0) {
+      uint64_t allow = channel_pacing_allowance(channel, 1);
+
+      if (allow == 0) {
+        /* bucket empty, the pacing timer resumes the flush */
+        ssh_pacing_arm(session);
+        break;
+      }
+      if ((uint64_t) chunk > allow) {
+        chunk = (uint32_t) allow;
+      }
+      channel_pacing_consume(channel, 1, chunk);
+    }
+
+    if (channel_send_data_packet(channel, buffer_get_rest(channel->out_queue),
+          chunk, channel->queue_frame_stderr) != SSH_OK) {
+      return -1;
+    }
+    buffer_pass_bytes(channel->out_queue, chunk);
+    channel->queue_frame_rest -= chunk;
+    sent += chunk;
+  }
+
+  if (buffer_get_rest_len(channel->out_queue) == 0) {
+    /* let the queue buffer age down to its high-water policy */
+    buffer_reinit(channel->out_queue);
+    if (sent > 0 &&
+        ssh_callbacks_exists(channel->callbacks, channel_write_drained_function)) {
+      channel->callbacks->channel_write_drained_function(session,
+                                                channel,
+                                                channel->callbacks->userdata);
+    }
+  }
+
+  return sent;
+}
+
+/** @internal
+ * @brief Flush the output queues of all channels of a session.
+ *
+ * Interactive channels are drained first so a shell keystroke is never
+ * queued behind a bulk transfer's packets. Bulk channels then share the
+ * link by deficit round-robin: each gets CHANNEL_SCHED_QUANTUM bytes of
+ * credit per round and carries unused credit to the next one, which
+ * converges to an equal byte share even with unequal write sizes.
+ */
+int channel_sched_flush(ssh_session session) {
+  ssh_channel it;
+  int progress;
+  int sent;
+
+  if (session->channels == NULL || session->sched_flushing) {
+    /* packet_send() may dispatch a window adjust which re-enters us;
+     * the running flush loop picks the new window up by itself */
+    return SSH_OK;
+  }
+  if (session->rekeying && session->out_crypto != session->next_crypto) {
+    /* no data packets between KEXINIT and our NEWKEYS (RFC 4253 7.1); once
+     * the outbound direction runs on the new keys the queue may drain even
+     * though the peer's NEWKEYS is still in flight */
+    return SSH_OK;
+  }
+  session->sched_flushing = 1;
+
+  do {
+    progress = 0;
+
+    it = session->channels;
+    do {
+      if (it->priority == SSH_CHANNEL_PRIORITY_INTERACTIVE &&
+          buffer_get_rest_len(it->out_queue) > 0) {
+        sent = channel_sched_flush_one(it, 0);
+        if (sent < 0) {
+          session->sched_flushing = 0;
+          return SSH_ERROR;
+        }
+        progress += sent;
+      }
+      it = it->next;
+    } while (it != session->channels);
+
+    it = session->channels;
+    do {
+      if (it->priority == SSH_CHANNEL_PRIORITY_BULK &&
+          buffer_get_rest_len(it->out_queue) > 0) {
+        it->sched_deficit += CHANNEL_SCHED_QUANTUM;
+        sent = channel_sched_flush_one(it, it->sched_deficit);
+        if (sent < 0) {
+          session->sched_flushing = 0;
+          return SSH_ERROR;
+        }
+        it->sched_deficit -= sent;
+        if (buffer_get_rest_len(it->out_queue) == 0) {
+          /* an idle channel does not save up credit */
+          it->sched_deficit = 0;
+        }
+        progress += sent;
+      }
+      it = it->next;
+    } while (it != session->channels);
+  } while (progress > 0);
+
+  session->sched_flushing = 0;
+
+  it = session->channels;
+  do {
+    if (it->splice_src != NULL || it->splice_eof_pending) {
+      /* a drained queue is what unblocks the other end of a splice */
+      channel_splice_update(it);
+    }
+    it = it->next;
+  } while (it != session->channels);
+
+  return SSH_OK;
+}
+
+/* a ring buffers whole frames: a stderr flag, the length, the payload */
+#define CHANNEL_RING_HEADER (sizeof(uint8_t) + sizeof(uint32_t))
+#define CHANNEL_RING_DEFAULT_SIZE (256 * 1024)
+
+static uint32_t channel_ring_used(struct ssh_channel_ring_struct *ring) {
+  /* the indices run free and wrap modulo 2^32, the difference is exact
+   * as long as the ring is smaller than that */
+  return ring->tail - ring->head;
+}
+
+static void channel_ring_copy_in(struct ssh_channel_ring_struct *ring,
+    uint32_t pos, const void *data, uint32_t len) {
+  uint32_t off = pos & (ring->size - 1);
+  uint32_t first = ring->size - off;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(ring->data + off, data, first);
+  memcpy(ring->data, (const char *) data + first, len - first);
+}
+
+static void channel_ring_copy_out(struct ssh_channel_ring_struct *ring,
+    uint32_t pos, void *data, uint32_t len) {
+  uint32_t off = pos & (ring->size - 1);
+  uint32_t first = ring->size - off;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(data, ring->data + off, first);
+  memcpy((char *) data + first, ring->data, len - first);
+}
+
+/**
+ * @brief Give a channel a lock-free ring for writes from another thread.
+ *
+ * A worker thread then feeds the channel with ssh_channel_ring_write()
+ * while the thread running the session's event loop drains the ring into
+ * the channel's output queue, without a mutex between the two: the ring
+ * is strictly single-producer/single-consumer, one writer thread per
+ * channel. Several channels of one multiplexed session may each have
+ * their own writer this way.
+ *
+ * Call this before the producer thread starts; the ring is drained from
+ * ssh_handle_packets(), so the loop thread must keep calling it (or
+ * ssh_channel_pump()) with a bounded timeout, a push does not wake a
+ * sleeping poll.
+ *
+ * @param[in]  channel  The channel to enable the ring on.
+ *
+ * @param[in]  size     Ring capacity in bytes, rounded up to a power of
+ *                      two. 0 for the default (256KB).
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_channel_ring_write()
+ */
+int ssh_channel_ring_enable(ssh_channel channel, uint32_t size) {
+  struct ssh_channel_ring_struct *ring;
+  uint32_t rounded = 1;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (channel->ring != NULL) {
+    return SSH_OK;
+  }
+  if (size == 0) {
+    size = CHANNEL_RING_DEFAULT_SIZE;
+  }
+  while (rounded < size) {
+    rounded <<= 1;
+  }
+
+  ring = malloc(sizeof(struct ssh_channel_ring_struct));
+  if (ring == NULL) {
+    ssh_set_error_oom(channel->session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(ring);
+  ring->data = malloc(rounded);
+  if (ring->data == NULL) {
+    SAFE_FREE(ring);
+    ssh_set_error_oom(channel->session);
+    return SSH_ERROR;
+  }
+  ring->size = rounded;
+  channel->ring = ring;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Push data on a channel's ring from the producer thread.
+ *
+ * This is the only channel entry point that may be called while another
+ * thread drives the session: it touches nothing but the ring. The write
+ * is all-or-nothing so the consumer always pops whole frames; when the
+ * ring is too full the call returns 0 and the producer retries, which is
+ * the backpressure of a consumer that can't keep up with 16 workers.
+ *
+ * @param[in]  channel   The channel to write to.
+ *
+ * @param[in]  data      The data to queue.
+ *
+ * @param[in]  len       The number of bytes to queue.
+ *
+ * @param[in]  is_stderr 1 for the stderr stream, 0 for stdout.
+ *
+ * @return              len when the data was queued, 0 when the ring is
+ *                      currently full, SSH_ERROR if the data can never
+ *                      fit or the ring is not enabled.
+ *
+ * @see ssh_channel_ring_enable()
+ */
+int ssh_channel_ring_write(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  struct ssh_channel_ring_struct *ring;
+  uint8_t flag = is_stderr ? 1 : 0;
+  uint32_t tail;
+
+  if (channel == NULL || channel->ring == NULL || data == NULL) {
+    return SSH_ERROR;
+  }
+  ring = channel->ring;
+  if (len == 0) {
+    return 0;
+  }
+  if (CHANNEL_RING_HEADER + len > ring->size) {
+    return SSH_ERROR;
+  }
+  if (ring->size - channel_ring_used(ring) < CHANNEL_RING_HEADER + len) {
+    return 0;
+  }
+
+  tail = ring->tail;
+  channel_ring_copy_in(ring, tail, &flag, sizeof(flag));
+  channel_ring_copy_in(ring, tail + sizeof(flag), &len, sizeof(len));
+  channel_ring_copy_in(ring, tail + CHANNEL_RING_HEADER, data, len);
+  /* the payload must be visible before the new tail is */
+  ssh_memory_barrier();
+  ring->tail = tail + CHANNEL_RING_HEADER + (uint32_t) len;
+
+  return (int) len;
+}
+
+static int channel_ring_drain(ssh_channel channel) {
+  struct ssh_channel_ring_struct *ring = channel->ring;
+  uint32_t head = ring->head;
+  uint8_t flag;
+  uint32_t framelen;
+
+  while (ring->tail - head >= CHANNEL_RING_HEADER) {
+    channel_ring_copy_out(ring, head, &flag, sizeof(flag));
+    channel_ring_copy_out(ring, head + sizeof(flag), &framelen,
+        sizeof(framelen));
+    head += CHANNEL_RING_HEADER;
+
+    /* the payload may wrap; the stream doesn't mind the frame arriving
+     * as two writes, so don't bounce it through a bounce buffer */
+    while (framelen > 0) {
+      uint32_t off = head & (ring->size - 1);
+      uint32_t chunk = ring->size - off;
+
+      if (chunk > framelen) {
+        chunk = framelen;
+      }
+      if (channel_write_common(channel, ring->data + off, chunk, flag) < 0) {
+        return SSH_ERROR;
+      }
+      head += chunk;
+      framelen -= chunk;
+      /* out_queue took a copy, give the space back right away */
+      ssh_memory_barrier();
+      ring->head = head;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief Drain every enabled write ring of a session.
+ *
+ * Runs on the event loop thread, the single consumer of the rings.
+ */
+int channel_ring_drain_all(ssh_session session) {
+  ssh_channel it;
+
+  if (session->channels == NULL) {
+    return SSH_OK;
+  }
+
+  it = session->channels;
+  do {
+    if (it->ring != NULL && channel_ring_drain(it) == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+    it = it->next;
+  } while (it != session->channels);
+
+  return SSH_OK;
+}
+
+int channel_write_common(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  ssh_session session;
+  int rc;
+
+  if(channel == NULL) {
+      return -1;
+  }
+  session = channel->session;
+  if(data == NULL) {
+      ssh_set_error_invalid(session, __FUNCTION__);
+      return -1;
+  }
+  enter_function();
 
   if (channel->local_eof) {
     ssh_set_error(session, SSH_REQUEST_DENIED,
@@ -1153,73 +3127,227 @@ int channel_write_common(ssh_channel channel, const void *data,
     return -1;
   }
 
-  if (channel->state != SSH_CHANNEL_STATE_OPEN || channel->delayed_close != 0) {
+  if ((channel->state != SSH_CHANNEL_STATE_OPEN && !channel->open_pending) ||
+      channel->delayed_close != 0) {
     ssh_set_error(session, SSH_REQUEST_DENIED, "Remote channel is closed");
     leave_function();
     return -1;
   }
 
+#ifdef WITH_SSH1
+  /* per-version pointer installed at banner analysis; the SSH-2 data
+   * path never tests the protocol version at runtime */
+  rc = session->channel_write_fn(channel, data, len, is_stderr);
+#else
+  rc = channel_write2(channel, data, len, is_stderr);
+#endif
+  leave_function();
+  return rc;
+}
+
+/** @internal
+ * @brief SSH-2 data path of channel_write_common(), reached through
+ * session->channel_write_fn. The caller already validated the channel
+ * state.
+ */
+int channel_write2(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  ssh_session session = channel->session;
+  int origlen = len;
+
+  ssh_client_rekey_check(session);
+
+  /* queue the write as one frame and let the scheduler interleave it
+   * with the other channels of the session */
+  if (len > 0) {
+    if (buffer_add_u8(channel->out_queue, is_stderr ? 1 : 0) < 0 ||
+        buffer_add_u32(channel->out_queue, len) < 0 ||
+        buffer_add_data(channel->out_queue, data, len) < 0) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
+
+  if (channel_sched_flush(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+
+  /* data not covered by the remote window stays queued and is flushed
+   * on the next window adjust, the caller does not have to retry */
+  return origlen;
+}
+
+#ifdef WITH_SSH1
+/** @internal
+ * @brief SSH-1 side of the channel_write_fn dispatch. SSH-1 has no
+ * stderr stream, so is_stderr is dropped.
+ */
+int channel_write1_common(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  (void) is_stderr;
+
+  return channel_write1(channel, data, len);
+}
+#endif
+
+/**
+ * @brief Blocking vectored write on a channel.
+ *
+ * Slices the iovec directly into maximally-sized SSH_MSG_CHANNEL_DATA
+ * packets: a packet payload may span several segments and a segment may
+ * span several packets, without the caller having to join its buffers
+ * first.
+ *
+ * @param[in]  channel  The channel to write to.
+ *
+ * @param[in]  iov      An array of data segments to write in order.
+ *
+ * @param[in]  iovcnt   The number of segments in iov.
+ *
+ * @return              The number of bytes written, SSH_ERROR on error.
+ *
+ * @see ssh_channel_write()
+ */
+int ssh_channel_writev(ssh_channel channel,
+    const struct ssh_iovec_struct *iov, int iovcnt) {
+  ssh_session session;
+  uint64_t total = 0;
+  uint64_t written = 0;
+  size_t maxpacketlen;
+  size_t seg_off = 0;
+  int i = 0;
+  int n;
+
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+  session = channel->session;
+  if(iov == NULL || iovcnt < 0) {
+      ssh_set_error_invalid(session, __FUNCTION__);
+      return SSH_ERROR;
+  }
+  enter_function();
+
+  for (n = 0; n < iovcnt; n++) {
+    total += iov[n].len;
+  }
+
+  if (channel->local_eof) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "Can't write to channel %d:%d  after EOF was sent",
+        channel->local_channel,
+        channel->remote_channel);
+    leave_function();
+    return SSH_ERROR;
+  }
+
+  if ((channel->state != SSH_CHANNEL_STATE_OPEN && !channel->open_pending) ||
+      channel->delayed_close != 0) {
+    ssh_set_error(session, SSH_REQUEST_DENIED, "Remote channel is closed");
+    leave_function();
+    return SSH_ERROR;
+  }
+
 #ifdef WITH_SSH1
   if (channel->version == 1) {
-    int rc = channel_write1(channel, data, len);
+    /* SSH-1 has no packet size worth optimizing for, write the segments
+     * one after the other */
     leave_function();
-    return rc;
+    for (n = 0; n < iovcnt; n++) {
+      if (iov[n].len > 0 &&
+          channel_write_common(channel, iov[n].data, iov[n].len, 0) < 0) {
+        return SSH_ERROR;
+      }
+      written += iov[n].len;
+    }
+    return written;
   }
 #endif
 
-  while (len > 0) {
-    if (channel->remote_window < len) {
-      ssh_log(session, SSH_LOG_PROTOCOL,
-          "Remote window is %d bytes. going to write %d bytes",
-          channel->remote_window,
-          len);
-      /* What happens when the channel window is zero? */
-      if(channel->remote_window == 0) {
-          /* nothing can be written */
-          ssh_log(session, SSH_LOG_PROTOCOL,
-                "Wait for a growing window message...");
-          return 0;
+  /* writev slices the segments into packets directly; queued frames of
+   * this channel must go on the wire first to keep the byte order */
+  if (buffer_get_rest_len(channel->out_queue) > 0) {
+    if (channel_sched_flush(session) == SSH_ERROR) {
+      leave_function();
+      return SSH_ERROR;
+    }
+    if (buffer_get_rest_len(channel->out_queue) > 0) {
+      /* still window-blocked, fall back to queueing the segments */
+      leave_function();
+      for (n = 0; n < iovcnt; n++) {
+        if (iov[n].len > 0 &&
+            channel_write_common(channel, iov[n].data, iov[n].len, 0) < 0) {
+          return SSH_ERROR;
+        }
+        written += iov[n].len;
       }
-      effectivelen = len > channel->remote_window ? channel->remote_window : len;
-    } else {
-      effectivelen = len;
+      return written;
     }
-    effectivelen = effectivelen > maxpacketlen ? maxpacketlen : effectivelen;
-    if (buffer_add_u8(session->out_buffer, is_stderr ?
-				SSH2_MSG_CHANNEL_EXTENDED_DATA : SSH2_MSG_CHANNEL_DATA) < 0 ||
-        buffer_add_u32(session->out_buffer,
-          htonl(channel->remote_channel)) < 0) {
-        ssh_set_error_oom(session);
-        goto error;
+  }
+
+  /*
+   * Handle the max packet len from remote side, be nice
+   * 10 bytes for the headers
+   */
+  maxpacketlen = channel_mss_align(session, channel->remote_maxpacket - 10);
+
+  while (written < total) {
+    size_t effectivelen = total - written;
+    size_t remaining;
+
+    if (channel->remote_window == 0) {
+      ssh_log(session, SSH_LOG_PROTOCOL,
+          "Wait for a growing window message...");
+      break;
     }
-    /* stderr message has an extra field */
-    if (is_stderr && 
-        buffer_add_u32(session->out_buffer, htonl(SSH2_EXTENDED_DATA_STDERR)) < 0) {
-        ssh_set_error_oom(session);
-        goto error;
+    if (effectivelen > channel->remote_window) {
+      effectivelen = channel->remote_window;
     }
-    /* append payload data */
-    if (buffer_add_u32(session->out_buffer, htonl(effectivelen)) < 0 ||
-        buffer_add_data(session->out_buffer, data, effectivelen) < 0) {
+    if (effectivelen > maxpacketlen) {
+      effectivelen = maxpacketlen;
+    }
+
+    if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_DATA) < 0 ||
+        buffer_add_u32(session->out_buffer,
+          htonl(channel->remote_channel)) < 0 ||
+        buffer_add_u32(session->out_buffer, htonl(effectivelen)) < 0) {
       ssh_set_error_oom(session);
       goto error;
     }
 
+    /* fill the packet payload across the segment boundaries */
+    remaining = effectivelen;
+    while (remaining > 0) {
+      size_t chunk = iov[i].len - seg_off;
+
+      if (chunk > remaining) {
+        chunk = remaining;
+      }
+      if (chunk > 0 &&
+          buffer_add_data(session->out_buffer,
+            (const char *)iov[i].data + seg_off, chunk) < 0) {
+        ssh_set_error_oom(session);
+        goto error;
+      }
+      seg_off += chunk;
+      remaining -= chunk;
+      if (seg_off == iov[i].len) {
+        i++;
+        seg_off = 0;
+      }
+    }
+
     if (packet_send(session) == SSH_ERROR) {
       leave_function();
       return SSH_ERROR;
     }
 
-    ssh_log(session, SSH_LOG_RARE,
-        "channel_write wrote %ld bytes", (long int) effectivelen);
-
     channel->remote_window -= effectivelen;
-    len -= effectivelen;
-    data = ((uint8_t*)data + effectivelen);
+    written += effectivelen;
   }
 
   leave_function();
-  return origlen;
+  return written;
 error:
   buffer_reinit(session->out_buffer);
 
@@ -1231,6 +3359,83 @@ uint32_t ssh_channel_window_size(ssh_channel channel) {
     return channel->remote_window;
 }
 
+/**
+ * @brief Arm a one-shot drain watermark on the channel.
+ *
+ * The callback fires from the socket's nonblocking flush once the
+ * output buffered for the wire falls to bytes_threshold or less, so a
+ * bulk producer can keep the pipe full with bounded buffering instead
+ * of polling or blocking in a flush. The watermark disarms before the
+ * callback runs; rearm from the callback to keep streaming.
+ *
+ * @param[in]  channel  The channel to notify for.
+ *
+ * @param[in]  bytes_threshold  Fire when this many output bytes or less
+ *                              remain buffered. 0 waits for a full drain.
+ *
+ * @param[in]  cb       The function to call, or NULL to disarm.
+ *
+ * @param[in]  userdata Passed to the callback.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @warning The callback must not free the channel.
+ */
+int ssh_channel_write_notify(ssh_channel channel, uint32_t bytes_threshold,
+    ssh_channel_drain_callback cb, void *userdata) {
+  ssh_session session;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+
+  if (channel->drain_cb != NULL && session->drain_watchers > 0) {
+    session->drain_watchers--;
+  }
+  channel->drain_threshold = bytes_threshold;
+  channel->drain_cb = cb;
+  channel->drain_userdata = userdata;
+  if (cb != NULL) {
+    session->drain_watchers++;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Fire the armed drain watermarks of a session.
+ *
+ * Called from the socket layer after a flush with the amount of output
+ * still buffered for the wire.
+ */
+void ssh_channel_drain_notify(ssh_session session, uint32_t buffered) {
+  ssh_channel first = session->channels;
+  ssh_channel channel, next;
+
+  if (session->drain_watchers == 0 || first == NULL || session->drain_firing) {
+    return;
+  }
+
+  session->drain_firing = 1;
+  channel = first;
+  do {
+    next = channel->next;
+    if (channel->drain_cb != NULL && buffered <= channel->drain_threshold) {
+      ssh_channel_drain_callback cb = channel->drain_cb;
+
+      /* disarm first so a rearm from the callback works */
+      channel->drain_cb = NULL;
+      session->drain_watchers--;
+      cb(channel, channel->drain_userdata);
+    }
+    channel = next;
+  } while (channel != first && session->drain_watchers > 0);
+  session->drain_firing = 0;
+}
+
 /**
  * @brief Blocking write on a channel.
  *
@@ -1318,6 +3523,27 @@ void ssh_channel_set_blocking(ssh_channel channel, int blocking) {
   channel->blocking = (blocking == 0 ? 0 : 1);
 }
 
+/**
+ * @brief Enable or disable the compression effort for a channel.
+ *
+ * Data written to a channel with compression disabled is still sent
+ * through the negotiated zlib stream, but as stored blocks which cost
+ * almost no CPU. Use this for channels carrying already-compressed
+ * data (tarballs, media files). Compression is enabled by default.
+ *
+ * This has no effect if compression was not negotiated for the session.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @param[in]  enable   A boolean to enable or disable compression.
+ */
+void ssh_channel_set_compression(ssh_channel channel, int enable) {
+  if(channel == NULL) {
+      return;
+  }
+  channel->compress_bypass = (enable == 0 ? 1 : 0);
+}
+
 /**
  * @internal
  *
@@ -1385,18 +3611,14 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_failure){
   return SSH_PACKET_USED;
 }
 
-static int channel_request(ssh_channel channel, const char *request,
+/** @internal
+ * @brief Build and send one SSH2_MSG_CHANNEL_REQUEST packet. The caller
+ * already validated the channel and request state.
+ */
+static int channel_request_emit(ssh_channel channel, const char *request,
     ssh_buffer buffer, int reply) {
   ssh_session session = channel->session;
   ssh_string req = NULL;
-  int rc = SSH_ERROR;
-
-  enter_function();
-  if(channel->request_state != SSH_CHANNEL_REQ_STATE_NONE){
-  	ssh_set_error(session,SSH_REQUEST_DENIED,"channel_request_* used in incorrect state");
-  	leave_function();
-  	return SSH_ERROR;
-  }
 
   req = ssh_string_from_char(request);
   if (req == NULL) {
@@ -1412,6 +3634,7 @@ static int channel_request(ssh_channel channel, const char *request,
     goto error;
   }
   ssh_string_free(req);
+  req = NULL;
 
   if (buffer != NULL) {
     if (buffer_add_data(session->out_buffer, buffer_get_rest(buffer),
@@ -1420,21 +3643,125 @@ static int channel_request(ssh_channel channel, const char *request,
       goto error;
     }
   }
-  channel->request_state = SSH_CHANNEL_REQ_STATE_PENDING;
+  channel->request_state = reply == 0 ?
+      SSH_CHANNEL_REQ_STATE_NONE : SSH_CHANNEL_REQ_STATE_PENDING;
   if (packet_send(session) == SSH_ERROR) {
+    channel->request_state = SSH_CHANNEL_REQ_STATE_NONE;
+    return SSH_ERROR;
+  }
+
+  ssh_log(session, SSH_LOG_PACKET,
+      "Sent a SSH_MSG_CHANNEL_REQUEST %s", request);
+  return SSH_OK;
+error:
+  buffer_reinit(session->out_buffer);
+  ssh_string_free(req);
+  return SSH_ERROR;
+}
+
+/** @internal
+ * @brief Send a channel request, or queue it behind a pending open.
+ *
+ * While the SSH_MSG_CHANNEL_OPEN confirmation is in flight the remote
+ * channel id is not known yet, so the request is held on the channel and
+ * emitted by the confirmation handler, in the same dispatch pass that
+ * processes the confirmation. Together with data queued early in
+ * out_queue this collapses the open, the request and the first data
+ * into a single round trip.
+ */
+static int channel_request_send(ssh_channel channel, const char *request,
+    ssh_buffer buffer, int reply) {
+  ssh_session session = channel->session;
+  int rc;
+
+  enter_function();
+  if(channel->request_state != SSH_CHANNEL_REQ_STATE_NONE){
+  	ssh_set_error(session,SSH_REQUEST_DENIED,"channel_request_* used in incorrect state");
+  	leave_function();
+  	return SSH_ERROR;
+  }
+
+  if (channel->open_pending) {
+    if (channel->early_request != NULL) {
+      ssh_set_error(session, SSH_REQUEST_DENIED,
+          "A channel request is already queued behind the open");
+      leave_function();
+      return SSH_ERROR;
+    }
+    channel->early_request = strdup(request);
+    if (channel->early_request == NULL) {
+      ssh_set_error_oom(session);
+      leave_function();
+      return SSH_ERROR;
+    }
+    if (buffer != NULL) {
+      channel->early_request_buf = ssh_buffer_new();
+      if (channel->early_request_buf == NULL ||
+          buffer_add_data(channel->early_request_buf,
+              buffer_get_rest(buffer), buffer_get_rest_len(buffer)) < 0) {
+        ssh_set_error_oom(session);
+        SAFE_FREE(channel->early_request);
+        ssh_buffer_free(channel->early_request_buf);
+        channel->early_request_buf = NULL;
+        leave_function();
+        return SSH_ERROR;
+      }
+    }
+    channel->early_request_reply = reply;
+    if (reply != 0) {
+      channel->request_state = SSH_CHANNEL_REQ_STATE_PENDING;
+    }
+    ssh_log(session, SSH_LOG_PACKET,
+        "Queued a SSH_MSG_CHANNEL_REQUEST %s behind the pending open",
+        request);
     leave_function();
-    return rc;
+    return SSH_OK;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
-      "Sent a SSH_MSG_CHANNEL_REQUEST %s", request);
-  if (reply == 0) {
-    channel->request_state = SSH_CHANNEL_REQ_STATE_NONE;
-    leave_function();
-    return SSH_OK;
+  rc = channel_request_emit(channel, request, buffer, reply);
+  leave_function();
+  return rc;
+}
+
+/** @internal
+ * @brief Emit the request held back behind a channel open, called from
+ * the open confirmation handler once the remote id is known.
+ */
+static int channel_early_request_flush(ssh_channel channel) {
+  char *request = channel->early_request;
+  ssh_buffer buffer = channel->early_request_buf;
+  int rc;
+
+  channel->early_request = NULL;
+  channel->early_request_buf = NULL;
+
+  rc = channel_request_emit(channel, request, buffer,
+      channel->early_request_reply);
+  if (rc != SSH_OK && channel->early_request_reply != 0) {
+    /* wake a waiter blocked on the queued request */
+    channel->request_state = SSH_CHANNEL_REQ_STATE_ERROR;
   }
+  SAFE_FREE(request);
+  ssh_buffer_free(buffer);
+
+  return rc;
+}
+
+/** @internal
+ * @brief Wait until the server answered a channel request sent with
+ * channel_request_send().
+ */
+static int channel_request_wait(ssh_channel channel, const char *request) {
+  ssh_session session = channel->session;
+  int rc = SSH_ERROR;
+
+  enter_function();
   while(channel->request_state == SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_handle_packets(session,-1);
+    if (ssh_handle_packets(session,-1) != SSH_OK) {
+      /* session error or deadline while the reply is pending */
+      leave_function();
+      return SSH_ERROR;
+    }
   }
   /* we received something */
   switch (channel->request_state){
@@ -1461,12 +3788,18 @@ static int channel_request(ssh_channel channel, const char *request,
   channel->request_state=SSH_CHANNEL_REQ_STATE_NONE;
   leave_function();
   return rc;
-error:
-  buffer_reinit(session->out_buffer);
-  ssh_string_free(req);
+}
 
-  leave_function();
-  return rc;
+static int channel_request(ssh_channel channel, const char *request,
+    ssh_buffer buffer, int reply) {
+  int rc;
+
+  rc = channel_request_send(channel, request, buffer, reply);
+  if (rc != SSH_OK || reply == 0) {
+    return rc;
+  }
+
+  return channel_request_wait(channel, request);
 }
 
 /**
@@ -1762,43 +4095,243 @@ error:
   return rc;
 }
 
+/**
+ * @brief Sends the "auth-agent-req@openssh.com" channel request over an
+ *        existing session channel.
+ *
+ * This will enable forwarding of the local SSH agent connection: the
+ * server may then open auth-agent channels back toward the client (one
+ * per agent conversation).
+ *
+ * The request carries no reply per the OpenSSH extension, so this does
+ * not wait for a round trip.
+ *
+ * @param[in]  channel  An existing session channel.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ *
+ * @see ssh_channel_open_auth_agent()
+ */
+int ssh_channel_request_auth_agent(ssh_channel channel) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  return channel_request(channel, "auth-agent-req@openssh.com", NULL, 0);
+}
+
+/* an event-driven listener: opens of one channel type are accepted as
+ * they arrive and parked in a FIFO, see ssh_channel_accept_subscribe() */
+struct ssh_accept_queue_struct {
+  int channeltype;
+  struct ssh_list *channels;
+  ssh_channel_accept_callback callback;
+  void *userdata;
+};
+
+static struct ssh_accept_queue_struct *channel_accept_queue_find(
+    ssh_session session, int channeltype) {
+  struct ssh_iterator *it;
+
+  if (session->accept_queues == NULL) {
+    return NULL;
+  }
+  for (it = ssh_list_get_iterator(session->accept_queues); it != NULL;
+       it = it->next) {
+    struct ssh_accept_queue_struct *queue =
+        (struct ssh_accept_queue_struct *) it->data;
+    if (queue->channeltype == channeltype) {
+      return queue;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Subscribe to incoming channel opens of one type.
+ *
+ * Incoming SSH_MSG_CHANNEL_OPEN requests of the given type are then
+ * accepted on arrival and put on a dedicated FIFO instead of the
+ * session's message list, so a server with many listeners matches each
+ * open in O(1) from the packet callback rather than scanning messages
+ * in a poll-sleep loop per listener.
+ *
+ * @param[in]  session     The session to listen on.
+ *
+ * @param[in]  channeltype A channel type from ssh_channel_type_e, e.g.
+ *                         SSH_CHANNEL_FORWARDED_TCPIP or SSH_CHANNEL_X11.
+ *
+ * @param[in]  cb          Called with each accepted channel while the
+ *                         session's packets are being handled. NULL to
+ *                         collect the channels with
+ *                         ssh_channel_accept_pop() instead.
+ *
+ * @param[in]  userdata    Passed to the callback.
+ *
+ * @return                 SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_channel_accept_subscribe(ssh_session session, int channeltype,
+    ssh_channel_accept_callback cb, void *userdata) {
+  struct ssh_accept_queue_struct *queue;
+
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  queue = channel_accept_queue_find(session, channeltype);
+  if (queue != NULL) {
+    queue->callback = cb;
+    queue->userdata = userdata;
+    return SSH_OK;
+  }
+
+  if (session->accept_queues == NULL) {
+    session->accept_queues = ssh_list_new();
+    if (session->accept_queues == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
+  queue = malloc(sizeof(struct ssh_accept_queue_struct));
+  if (queue == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(queue);
+  queue->channeltype = channeltype;
+  queue->callback = cb;
+  queue->userdata = userdata;
+  queue->channels = ssh_list_new();
+  if (queue->channels == NULL ||
+      ssh_list_append(session->accept_queues, queue) < 0) {
+    ssh_list_free(queue->channels);
+    SAFE_FREE(queue);
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Take the next channel a subscribed listener accepted.
+ *
+ * Does no I/O: drive the session with ssh_handle_packets() (or any
+ * blocking call) and pop until NULL.
+ *
+ * @param[in]  session     The session to pop from.
+ *
+ * @param[in]  channeltype The subscribed channel type.
+ *
+ * @return                 The oldest waiting channel, NULL if none.
+ *
+ * @see ssh_channel_accept_subscribe()
+ */
+ssh_channel ssh_channel_accept_pop(ssh_session session, int channeltype) {
+  struct ssh_accept_queue_struct *queue;
+
+  if (session == NULL) {
+    return NULL;
+  }
+  queue = channel_accept_queue_find(session, channeltype);
+  if (queue == NULL) {
+    return NULL;
+  }
+
+  return ssh_list_pop_head(ssh_channel, queue->channels);
+}
+
+/** @internal
+ * @brief Route a channel open to its listener's queue, if one listens.
+ *
+ * Called from ssh_message_queue() before the message list is touched.
+ *
+ * @return 1 when the message was consumed, 0 to queue it as usual.
+ */
+int channel_accept_queue_dispatch(ssh_session session, ssh_message msg) {
+  struct ssh_accept_queue_struct *queue;
+  ssh_channel channel;
+
+  if (ssh_message_type(msg) != SSH_REQUEST_CHANNEL_OPEN) {
+    return 0;
+  }
+  queue = channel_accept_queue_find(session, ssh_message_subtype(msg));
+  if (queue == NULL) {
+    return 0;
+  }
+
+  channel = ssh_message_channel_request_open_reply_accept(msg);
+  ssh_message_free(msg);
+  if (channel == NULL) {
+    return 1;
+  }
+  if (queue->callback != NULL) {
+    queue->callback(channel, queue->userdata);
+  } else {
+    ssh_list_append(queue->channels, channel);
+  }
+
+  return 1;
+}
+
+/** @internal
+ * @brief Release the accept queues of a session being freed.
+ */
+void channel_accept_queues_free(ssh_session session) {
+  struct ssh_accept_queue_struct *queue;
+
+  if (session->accept_queues == NULL) {
+    return;
+  }
+  while ((queue = ssh_list_pop_head(struct ssh_accept_queue_struct *,
+          session->accept_queues)) != NULL) {
+    /* the queued channels belong to the session and die with it */
+    ssh_list_free(queue->channels);
+    SAFE_FREE(queue);
+  }
+  ssh_list_free(session->accept_queues);
+  session->accept_queues = NULL;
+}
+
 static ssh_channel ssh_channel_accept(ssh_session session, int channeltype,
     int timeout_ms) {
-#ifndef _WIN32
-  static const struct timespec ts = {
-    .tv_sec = 0,
-    .tv_nsec = 50000000 /* 50ms */
-  };
-#endif
   ssh_message msg = NULL;
   ssh_channel channel = NULL;
-  struct ssh_iterator *iterator;
   int t;
 
+  if (channel_accept_queue_find(session, channeltype) != NULL) {
+    /* event-driven listener: block in poll, no sleep-and-scan */
+    for (t = timeout_ms; ; t -= 50) {
+      channel = ssh_channel_accept_pop(session, channeltype);
+      if (channel != NULL) {
+        return channel;
+      }
+      if (t <= 0) {
+        break;
+      }
+      ssh_handle_packets(session, t > 50 ? 50 : t);
+    }
+    ssh_set_error(session, SSH_NO_ERROR,
+        "No channel request of this type from server");
+    return NULL;
+  }
+
   for (t = timeout_ms; t >= 0; t -= 50)
   {
     ssh_handle_packets(session,50);
 
-    if (session->ssh_message_list) {
-      iterator = ssh_list_get_iterator(session->ssh_message_list);
-      while (iterator) {
-        msg = (ssh_message)iterator->data;
-        if (ssh_message_type(msg) == SSH_REQUEST_CHANNEL_OPEN &&
-            ssh_message_subtype(msg) == channeltype) {
-          ssh_list_remove(session->ssh_message_list, iterator);
-          channel = ssh_message_channel_request_open_reply_accept(msg);
-          ssh_message_free(msg);
-          return channel;
-        }
-        iterator = iterator->next;
-      }
+    /* the per-type count makes the empty case free */
+    if (session->msg_queue_typecount[SSH_REQUEST_CHANNEL_OPEN] == 0) {
+      continue;
     }
-    if(t>0){
-#ifdef _WIN32
-      Sleep(50); /* 50ms */
-#else
-      nanosleep(&ts, NULL);
-#endif
+    for (msg = session->msg_queue_head; msg != NULL; msg = msg->msg_next) {
+      if (ssh_message_type(msg) == SSH_REQUEST_CHANNEL_OPEN &&
+          ssh_message_subtype(msg) == channeltype) {
+        ssh_message_queue_unlink(session, msg);
+        channel = ssh_message_channel_request_open_reply_accept(msg);
+        ssh_message_free(msg);
+        return channel;
+      }
     }
   }
 
@@ -1826,7 +4359,28 @@ ssh_channel ssh_channel_accept_x11(ssh_channel channel, int timeout_ms) {
  * @brief Handle a SSH_REQUEST_SUCCESS packet normally sent after a global
  * request.
  */
+/**
+ * @internal
+ *
+ * @brief Find the oldest global request still waiting for its reply.
+ *
+ * Replies arrive in request order, so the first pending entry of the
+ * FIFO is the one the packet being handled answers.
+ */
+static struct ssh_global_req_struct *global_request_oldest(ssh_session session) {
+  struct ssh_global_req_struct *req;
+
+  for (req = session->global_reqs; req != NULL; req = req->next) {
+    if (req->state == SSH_CHANNEL_REQ_STATE_PENDING) {
+      return req;
+    }
+  }
+
+  return NULL;
+}
+
 SSH_PACKET_CALLBACK(ssh_request_success){
+  struct ssh_global_req_struct *req;
   (void)type;
   (void)user;
   (void)packet;
@@ -1834,11 +4388,12 @@ SSH_PACKET_CALLBACK(ssh_request_success){
 
   ssh_log(session, SSH_LOG_PACKET,
       "Received SSH_REQUEST_SUCCESS");
-  if(session->global_req_state != SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_log(session, SSH_LOG_RARE, "SSH_REQUEST_SUCCESS received in incorrect state %d",
-        session->global_req_state);
+  req = global_request_oldest(session);
+  if (req == NULL) {
+    ssh_log(session, SSH_LOG_RARE,
+        "SSH_REQUEST_SUCCESS received with no global request pending");
   } else {
-    session->global_req_state=SSH_CHANNEL_REQ_STATE_ACCEPTED;
+    req->state = SSH_CHANNEL_REQ_STATE_ACCEPTED;
   }
 
   leave_function();
@@ -1852,6 +4407,7 @@ SSH_PACKET_CALLBACK(ssh_request_success){
  * request.
  */
 SSH_PACKET_CALLBACK(ssh_request_denied){
+  struct ssh_global_req_struct *req;
   (void)type;
   (void)user;
   (void)packet;
@@ -1859,11 +4415,12 @@ SSH_PACKET_CALLBACK(ssh_request_denied){
 
   ssh_log(session, SSH_LOG_PACKET,
       "Received SSH_REQUEST_FAILURE");
-  if(session->global_req_state != SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_log(session, SSH_LOG_RARE, "SSH_REQUEST_DENIED received in incorrect state %d",
-        session->global_req_state);
+  req = global_request_oldest(session);
+  if (req == NULL) {
+    ssh_log(session, SSH_LOG_RARE,
+        "SSH_REQUEST_DENIED received with no global request pending");
   } else {
-    session->global_req_state=SSH_CHANNEL_REQ_STATE_DENIED;
+    req->state = SSH_CHANNEL_REQ_STATE_DENIED;
   }
 
   leave_function();
@@ -1887,83 +4444,188 @@ SSH_PACKET_CALLBACK(ssh_request_denied){
  *
  * @return              SSH_OK on success, SSH_ERROR if an error occured.
  */
-static int global_request(ssh_session session, const char *request,
+/**
+ * @internal
+ *
+ * @brief Frame and send a SSH_MSG_GLOBAL_REQUEST.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ */
+static int global_request_put(ssh_session session, const char *request,
     ssh_buffer buffer, int reply) {
   ssh_string req = NULL;
-  int rc = SSH_ERROR;
 
-  enter_function();
-  if(session->global_req_state != SSH_CHANNEL_REQ_STATE_NONE){
-    ssh_set_error(session,SSH_FATAL,"Invalid state in start of global_request()");
-    leave_function();
-    return rc;
-  }
   req = ssh_string_from_char(request);
   if (req == NULL) {
     ssh_set_error_oom(session);
-    goto error;
+    return SSH_ERROR;
   }
 
   if (buffer_add_u8(session->out_buffer, SSH2_MSG_GLOBAL_REQUEST) < 0 ||
       buffer_add_ssh_string(session->out_buffer, req) < 0 ||
       buffer_add_u8(session->out_buffer, reply == 0 ? 0 : 1) < 0) {
     ssh_set_error_oom(session);
-    goto error;
+    ssh_string_free(req);
+    return SSH_ERROR;
   }
   ssh_string_free(req);
-  req=NULL;
 
   if (buffer != NULL) {
     if (buffer_add_data(session->out_buffer, buffer_get_rest(buffer),
         buffer_get_rest_len(buffer)) < 0) {
       ssh_set_error_oom(session);
-      goto error;
+      return SSH_ERROR;
     }
   }
-  session->global_req_state = SSH_CHANNEL_REQ_STATE_PENDING;
   if (packet_send(session) == SSH_ERROR) {
-    leave_function();
-    return rc;
+    return SSH_ERROR;
   }
 
   ssh_log(session, SSH_LOG_PACKET,
       "Sent a SSH_MSG_GLOBAL_REQUEST %s", request);
-  if (reply == 0) {
-    session->global_req_state=SSH_CHANNEL_REQ_STATE_NONE;
-    leave_function();
-    return SSH_OK;
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Send a global request expecting a reply and queue its FIFO
+ * entry without waiting for the answer.
+ *
+ * Requests opened back to back stay in flight together; the in-order
+ * reply rule pairs each SUCCESS/FAILURE with its entry.
+ *
+ * @return              The queued entry, NULL on error.
+ */
+static struct ssh_global_req_struct *global_request_open(ssh_session session,
+    const char *request, ssh_buffer buffer) {
+  struct ssh_global_req_struct *req = NULL;
+
+  req = malloc(sizeof(struct ssh_global_req_struct));
+  if (req == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(req);
+  req->name = strdup(request);
+  if (req->name == NULL) {
+    ssh_set_error_oom(session);
+    SAFE_FREE(req);
+    return NULL;
+  }
+  req->state = SSH_CHANNEL_REQ_STATE_PENDING;
+
+  if (global_request_put(session, request, buffer, 1) != SSH_OK) {
+    SAFE_FREE(req->name);
+    SAFE_FREE(req);
+    return NULL;
+  }
+
+  if (session->global_reqs_tail != NULL) {
+    session->global_reqs_tail->next = req;
+  } else {
+    session->global_reqs = req;
   }
-  while(session->global_req_state == SSH_CHANNEL_REQ_STATE_PENDING){
-    rc=ssh_handle_packets(session,-1);
-    if(rc==SSH_ERROR){
-      session->global_req_state = SSH_CHANNEL_REQ_STATE_ERROR;
+  session->global_reqs_tail = req;
+
+  return req;
+}
+
+/**
+ * @internal
+ *
+ * @brief Wait for the reply of a queued global request, then unlink and
+ * free its entry.
+ *
+ * Replies of older entries are necessarily handled on the way.
+ *
+ * @return              SSH_OK when accepted, SSH_ERROR otherwise.
+ */
+static int global_request_wait(ssh_session session,
+    struct ssh_global_req_struct *req) {
+  struct ssh_global_req_struct **pp;
+  struct ssh_global_req_struct *prev = NULL;
+  int rc = SSH_ERROR;
+
+  while (req->state == SSH_CHANNEL_REQ_STATE_PENDING) {
+    if (ssh_handle_packets(session, -1) == SSH_ERROR) {
+      req->state = SSH_CHANNEL_REQ_STATE_ERROR;
       break;
     }
   }
-  switch(session->global_req_state){
+  switch (req->state) {
     case SSH_CHANNEL_REQ_STATE_ACCEPTED:
-      ssh_log(session, SSH_LOG_PROTOCOL, "Global request %s success",request);
-      rc=SSH_OK;
+      ssh_log(session, SSH_LOG_PROTOCOL, "Global request %s success",
+          req->name);
+      rc = SSH_OK;
       break;
     case SSH_CHANNEL_REQ_STATE_DENIED:
       ssh_log(session, SSH_LOG_PACKET,
-          "Global request %s failed", request);
+          "Global request %s failed", req->name);
       ssh_set_error(session, SSH_REQUEST_DENIED,
-          "Global request %s failed", request);
-      rc=SSH_ERROR;
+          "Global request %s failed", req->name);
+      rc = SSH_ERROR;
       break;
     case SSH_CHANNEL_REQ_STATE_ERROR:
     case SSH_CHANNEL_REQ_STATE_NONE:
     case SSH_CHANNEL_REQ_STATE_PENDING:
-      rc=SSH_ERROR;
+      rc = SSH_ERROR;
       break;
+  }
+
+  for (pp = &session->global_reqs; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == req) {
+      *pp = req->next;
+      if (session->global_reqs_tail == req) {
+        session->global_reqs_tail = prev;
+      }
+      break;
+    }
+    prev = *pp;
+  }
+  SAFE_FREE(req->name);
+  SAFE_FREE(req);
+
+  return rc;
+}
+
+/**
+ * @internal
+ *
+ * @brief Send a global request (needed for forward listening) and wait for the
+ * result.
+ *
+ * @param[in]  session  The SSH session handle.
+ *
+ * @param[in]  request  The type of request (defined in RFC).
+ *
+ * @param[in]  buffer   Additional data to put in packet.
+ *
+ * @param[in]  reply    Set if you expect a reply from server.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ */
+static int global_request(ssh_session session, const char *request,
+    ssh_buffer buffer, int reply) {
+  struct ssh_global_req_struct *req = NULL;
+  int rc;
+
+  enter_function();
+
+  if (reply == 0) {
+    rc = global_request_put(session, request, buffer, 0);
+    leave_function();
+    return rc;
+  }
 
+  req = global_request_open(session, request, buffer);
+  if (req == NULL) {
+    leave_function();
+    return SSH_ERROR;
   }
+  rc = global_request_wait(session, req);
 
-  leave_function();
-  return rc;
-error:
-  ssh_string_free(req);
   leave_function();
   return rc;
 }
@@ -2024,6 +4686,91 @@ error:
   return rc;
 }
 
+/**
+ * @brief Send a "tcpip-forward" global request without waiting for the
+ *        server's answer.
+ *
+ * Issue any number of these back to back and collect the answers with a
+ * single ssh_global_requests_wait() call: provisioning N remote
+ * forwards costs one round trip instead of N.
+ *
+ * @param[in]  session  The ssh session to send the request.
+ *
+ * @param[in]  address  The address to bind to on the server. Pass NULL to bind
+ *                      to all available addresses on all protocol families
+ *                      supported by the server.
+ *
+ * @param[in]  port     The port to bind to on the server. Unlike
+ *                      ssh_forward_listen() the port the server picked
+ *                      cannot be reported back, so pass an explicit
+ *                      port.
+ *
+ * @return              SSH_OK when the request was sent, SSH_ERROR if an
+ *                      error occured.
+ *
+ * @see ssh_global_requests_wait()
+ */
+int ssh_forward_listen_async(ssh_session session, const char *address, int port) {
+  ssh_buffer buffer = NULL;
+  ssh_string addr = NULL;
+  int rc = SSH_ERROR;
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  addr = ssh_string_from_char(address ? address : "");
+  if (addr == NULL) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  if (buffer_add_ssh_string(buffer, addr) < 0 ||
+      buffer_add_u32(buffer, htonl(port)) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  if (global_request_open(session, "tcpip-forward", buffer) != NULL) {
+    rc = SSH_OK;
+  }
+
+error:
+  ssh_buffer_free(buffer);
+  ssh_string_free(addr);
+  return rc;
+}
+
+/**
+ * @brief Wait for the answers of all global requests still in flight.
+ *
+ * This is the barrier matching ssh_forward_listen_async(): it blocks
+ * until the server has answered every queued request.
+ *
+ * @param[in]  session  The ssh session to use.
+ *
+ * @return              SSH_OK when every request was accepted, SSH_ERROR
+ *                      as soon as one was denied or an error occured.
+ *                      The session error is the one of the last failed
+ *                      request.
+ */
+int ssh_global_requests_wait(ssh_session session) {
+  int rc = SSH_OK;
+
+  enter_function();
+
+  while (session->global_reqs != NULL) {
+    if (global_request_wait(session, session->global_reqs) != SSH_OK) {
+      rc = SSH_ERROR;
+    }
+  }
+
+  leave_function();
+  return rc;
+}
+
 /**
  * @brief Accept an incoming TCP/IP forwarding channel.
  *
@@ -2214,6 +4961,89 @@ error:
   return rc;
 }
 
+/**
+ * @brief Send an exec request without waiting for the reply.
+ *
+ * This may be called right after the channel open was sent with
+ * ssh_channel_open_session() still unconfirmed (e.g. after an
+ * asynchronous open): the request is then queued behind the open and
+ * emitted the moment the confirmation arrives, and data written to the
+ * channel in the meantime follows right behind it. Opening a channel,
+ * starting a command and shipping its first input this way costs one
+ * round trip instead of three.
+ *
+ * Collect the server's reply with ssh_channel_request_wait() before
+ * issuing another request on the channel.
+ *
+ * @param[in]  channel  The channel to execute the command.
+ *
+ * @param[in]  cmd      The command to execute.
+ *
+ * @return              SSH_OK when the request was sent or queued,
+ *                      SSH_ERROR if an error occured.
+ *
+ * @see ssh_channel_request_exec()
+ * @see ssh_channel_request_wait()
+ */
+int ssh_channel_request_exec_async(ssh_channel channel, const char *cmd) {
+  ssh_buffer buffer = NULL;
+  ssh_string command = NULL;
+  int rc = SSH_ERROR;
+
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+  if(cmd == NULL) {
+      ssh_set_error_invalid(channel->session, __FUNCTION__);
+      return rc;
+  }
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(channel->session);
+    goto error;
+  }
+
+  command = ssh_string_from_char(cmd);
+  if (command == NULL) {
+    ssh_set_error_oom(channel->session);
+    goto error;
+  }
+
+  if (buffer_add_ssh_string(buffer, command) < 0) {
+    ssh_set_error_oom(channel->session);
+    goto error;
+  }
+
+  rc = channel_request_send(channel, "exec", buffer, 1);
+error:
+  ssh_buffer_free(buffer);
+  ssh_string_free(command);
+  return rc;
+}
+
+/**
+ * @brief Wait until the server answered a request sent asynchronously.
+ *
+ * @param[in]  channel  A channel with a request in flight.
+ *
+ * @return              SSH_OK when the request was accepted, SSH_ERROR
+ *                      if it was denied or an error occured.
+ *
+ * @see ssh_channel_request_exec_async()
+ */
+int ssh_channel_request_wait(ssh_channel channel) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (channel->request_state == SSH_CHANNEL_REQ_STATE_NONE) {
+    /* no reply outstanding */
+    return SSH_OK;
+  }
+
+  return channel_request_wait(channel, "(async)");
+}
+
 
 /**
  * @brief Send a signal to remote process (as described in RFC 4254, section 6.9).
@@ -2350,7 +5180,10 @@ int channel_read_buffer(ssh_channel channel, ssh_buffer buffer, uint32_t count,
         leave_function();
         return 0;
       }
-      ssh_handle_packets(channel->session, -1);
+      if ((r = ssh_handle_packets(channel->session, -1)) != SSH_OK) {
+        leave_function();
+        return r;
+      }
     } while (r == 0);
   }
   while(total < count){
@@ -2366,19 +5199,194 @@ int channel_read_buffer(ssh_channel channel, ssh_buffer buffer, uint32_t count,
     if(buffer_add_data(buffer,buffer_tmp,r) < 0){
       ssh_set_error_oom(session);
       leave_function();
-      return SSH_ERROR;
+      return SSH_ERROR;
+    }
+    total += r;
+  }
+  leave_function();
+  return total;
+}
+
+/* TODO FIXME Fix the delayed close thing */
+/* TODO FIXME Fix the blocking behaviours */
+
+/**
+ * @internal
+ *
+ * @brief Wait until a channel stream has buffered data, the remote end
+ * sent an EOF, or the timeout expires.
+ *
+ * When the session has a busy-poll window configured, the sleeping
+ * poll is preceded by a spin of nonblocking polls for up to that many
+ * microseconds: a poll() wakeup costs tens of microseconds of
+ * scheduling latency, which dominates the budget of sub-millisecond
+ * consumers. The condition is rechecked after every nonblocking poll
+ * so the spin ends the moment data lands in the buffer.
+ *
+ * @param[in]  timeout_ms Timeout handed to the sleeping poll, less the
+ *                        time spent spinning. -1 blocks indefinitely.
+ *
+ * @return              SSH_OK when woken up or the timeout ran out,
+ *                      SSH_ERROR on error.
+ */
+static int channel_wait_for_data(ssh_channel channel, ssh_buffer stdbuf,
+    int timeout_ms) {
+  ssh_session session = channel->session;
+
+  if (session->busy_poll_usec > 0) {
+    struct ssh_timestamp start;
+    struct ssh_timestamp now;
+    long spent = 0;
+
+    ssh_timestamp_init(&start);
+    while (spent < session->busy_poll_usec) {
+      if (ssh_handle_packets(session, 0) == SSH_ERROR) {
+        return SSH_ERROR;
+      }
+      if (buffer_get_rest_len(stdbuf) > 0 || channel->remote_eof) {
+        return SSH_OK;
+      }
+      ssh_timestamp_init(&now);
+      spent = (now.seconds - start.seconds) * 1000000L +
+          (now.useconds - start.useconds);
+    }
+    if (timeout_ms > 0) {
+      /* the spin consumed part of the budget */
+      timeout_ms -= (int) (spent / 1000);
+      if (timeout_ms <= 0) {
+        return SSH_OK;
+      }
+    }
+  }
+
+  return ssh_handle_packets(session, timeout_ms);
+}
+
+/**
+ * @brief Reads data from a channel.
+ *
+ * @param[in]  channel  The channel to read from.
+ *
+ * @param[in]  dest     The destination buffer which will get the data.
+ *
+ * @param[in]  count    The count of bytes to be read.
+ *
+ * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
+ *
+ * @return              The number of bytes read, 0 on end of file or SSH_ERROR
+ *                      on error.
+ *
+ * @warning This function may return less than count bytes of data, and won't
+ *          block until count bytes have been read.
+ * @warning The read function using a buffer has been renamed to
+ *          channel_read_buffer().
+ */
+int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_stderr) {
+  ssh_session session;
+  ssh_buffer stdbuf;
+  uint32_t len;
+
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+  if(dest == NULL) {
+      ssh_set_error_invalid(channel->session, __FUNCTION__);
+      return SSH_ERROR;
+  }
+
+  session = channel->session;
+  stdbuf = channel->stdout_buffer;
+  enter_function();
+
+  if (count == 0) {
+    leave_function();
+    return 0;
+  }
+
+  if (is_stderr) {
+    stdbuf=channel->stderr_buffer;
+  }
+
+  /*
+   * We may have problem if the window is too small to accept as much data
+   * as asked
+   */
+  ssh_log(session, SSH_LOG_PROTOCOL,
+      "Read (%d) buffered : %d bytes. Window: %d",
+      count,
+      buffer_get_rest_len(stdbuf),
+      channel->local_window);
+
+  if (count > buffer_get_rest_len(stdbuf) + channel->local_window) {
+    if (grow_window(session, channel, count - buffer_get_rest_len(stdbuf)) < 0) {
+      leave_function();
+      return -1;
+    }
+  }
+
+  /* block reading until at least one byte is read 
+  *  and ignore the trivial case count=0
+  */
+  while (buffer_get_rest_len(stdbuf) == 0 && count > 0) {
+    if (channel->remote_eof && buffer_get_rest_len(stdbuf) == 0) {
+      leave_function();
+      return 0;
+    }
+
+    if (channel->remote_eof) {
+      /* Return the resting bytes in buffer */
+      break;
+    }
+
+    if (buffer_get_rest_len(stdbuf) >= count) {
+      /* Stop reading when buffer is full enough */
+      break;
+    }
+
+    if (channel_wait_for_data(channel, stdbuf, -1) == SSH_ERROR) {
+      leave_function();
+      return SSH_ERROR;
+    }
+  }
+
+  len = buffer_get_rest_len(stdbuf);
+  /* Read count bytes if len is greater, everything otherwise */
+  len = (len > count ? count : len);
+  memcpy(dest, buffer_get_rest(stdbuf), len);
+  buffer_pass_bytes(stdbuf,len);
+  /* Authorize some buffering while userapp is busy */
+  if (channel->local_window < channel_window_target(channel) / 2) {
+    if (grow_window(session, channel, 0) < 0) {
+      leave_function();
+      return -1;
     }
-    total += r;
   }
+
   leave_function();
-  return total;
+  return len;
 }
 
-/* TODO FIXME Fix the delayed close thing */
-/* TODO FIXME Fix the blocking behaviours */
+/**
+ * @internal
+ * @brief Microseconds left until an absolute wall-clock deadline.
+ */
+static long channel_deadline_remaining(const struct timespec *deadline) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return (deadline->tv_sec - now.tv_sec) * 1000000L +
+      (deadline->tv_nsec / 1000 - now.tv_usec);
+}
 
 /**
- * @brief Reads data from a channel.
+ * @brief Read data from a channel, giving up at an absolute deadline.
+ *
+ * Behaves like ssh_channel_read() but never blocks past the given
+ * wall-clock (CLOCK_REALTIME) deadline. While the deadline is further
+ * away than the session busy-poll window the wait sleeps in poll();
+ * the final stretch is spent in nonblocking polls, so the deadline is
+ * honoured with microsecond rather than scheduler-tick granularity.
  *
  * @param[in]  channel  The channel to read from.
  *
@@ -2388,25 +5396,26 @@ int channel_read_buffer(ssh_channel channel, ssh_buffer buffer, uint32_t count,
  *
  * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
  *
- * @return              The number of bytes read, 0 on end of file or SSH_ERROR
- *                      on error.
+ * @param[in]  deadline Absolute point in time to give up at. A deadline
+ *                      in the past degrades to a nonblocking read.
  *
- * @warning This function may return less than count bytes of data, and won't
- *          block until count bytes have been read.
- * @warning The read function using a buffer has been renamed to
- *          channel_read_buffer().
+ * @return              The number of bytes read, 0 on end of file,
+ *                      SSH_AGAIN when the deadline passed with no data,
+ *                      SSH_ERROR on error.
  */
-int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_stderr) {
+int ssh_channel_read_deadline(ssh_channel channel, void *dest, uint32_t count,
+    int is_stderr, const struct timespec *deadline) {
   ssh_session session;
   ssh_buffer stdbuf;
   uint32_t len;
+  long remaining;
 
-  if(channel == NULL) {
-      return SSH_ERROR;
+  if (channel == NULL) {
+    return SSH_ERROR;
   }
-  if(dest == NULL) {
-      ssh_set_error_invalid(channel->session, __FUNCTION__);
-      return SSH_ERROR;
+  if (dest == NULL || deadline == NULL) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
   }
 
   session = channel->session;
@@ -2419,58 +5428,60 @@ int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_std
   }
 
   if (is_stderr) {
-    stdbuf=channel->stderr_buffer;
+    stdbuf = channel->stderr_buffer;
   }
 
-  /*
-   * We may have problem if the window is too small to accept as much data
-   * as asked
-   */
-  ssh_log(session, SSH_LOG_PROTOCOL,
-      "Read (%d) buffered : %d bytes. Window: %d",
-      count,
-      buffer_get_rest_len(stdbuf),
-      channel->local_window);
-
   if (count > buffer_get_rest_len(stdbuf) + channel->local_window) {
     if (grow_window(session, channel, count - buffer_get_rest_len(stdbuf)) < 0) {
       leave_function();
-      return -1;
+      return SSH_ERROR;
     }
   }
 
-  /* block reading until at least one byte is read 
-  *  and ignore the trivial case count=0
-  */
-  while (buffer_get_rest_len(stdbuf) == 0 && count > 0) {
-    if (channel->remote_eof && buffer_get_rest_len(stdbuf) == 0) {
+  while (buffer_get_rest_len(stdbuf) == 0) {
+    if (channel->remote_eof) {
       leave_function();
       return 0;
     }
 
-    if (channel->remote_eof) {
-      /* Return the resting bytes in buffer */
-      break;
+    remaining = channel_deadline_remaining(deadline);
+    if (remaining <= 0) {
+      /* one last nonblocking look for data already on the wire */
+      if (ssh_handle_packets(session, 0) == SSH_ERROR) {
+        leave_function();
+        return SSH_ERROR;
+      }
+      if (buffer_get_rest_len(stdbuf) > 0 || channel->remote_eof) {
+        continue;
+      }
+      leave_function();
+      return SSH_AGAIN;
     }
 
-    if (buffer_get_rest_len(stdbuf) >= count) {
-      /* Stop reading when buffer is full enough */
-      break;
+    if (remaining > session->busy_poll_usec + 1000) {
+      /* sleep up to the busy-poll window, rounding down so the
+       * wakeup lands inside the window rather than past the deadline */
+      if (ssh_handle_packets(session,
+            (int) ((remaining - session->busy_poll_usec) / 1000)) == SSH_ERROR) {
+        leave_function();
+        return SSH_ERROR;
+      }
+    } else {
+      if (ssh_handle_packets(session, 0) == SSH_ERROR) {
+        leave_function();
+        return SSH_ERROR;
+      }
     }
-
-    ssh_handle_packets(session,-1);
   }
 
   len = buffer_get_rest_len(stdbuf);
-  /* Read count bytes if len is greater, everything otherwise */
   len = (len > count ? count : len);
   memcpy(dest, buffer_get_rest(stdbuf), len);
-  buffer_pass_bytes(stdbuf,len);
-  /* Authorize some buffering while userapp is busy */
-  if (channel->local_window < WINDOWLIMIT) {
+  buffer_pass_bytes(stdbuf, len);
+  if (channel->local_window < channel_window_target(channel) / 2) {
     if (grow_window(session, channel, 0) < 0) {
       leave_function();
-      return -1;
+      return SSH_ERROR;
     }
   }
 
@@ -2478,6 +5489,141 @@ int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_std
   return len;
 }
 
+/**
+ * @brief Capture a channel's output through a callback, bounded.
+ *
+ * Runs the read loop every exec consumer was writing by hand: stdout
+ * and stderr fragments are handed to the sink straight out of the
+ * channel buffers, without the extra copy of ssh_channel_read() and
+ * without the grow-a-result-buffer dance. The receive window starts at
+ * its maximum, since exec output is typically one burst followed by
+ * EOF and the stepwise window auto-scaling would throttle it.
+ *
+ * @param[in]  channel  The channel to capture, typically right after
+ *                      ssh_channel_request_exec().
+ *
+ * @param[in]  sink     Callback receiving the fragments. Its return
+ *                      value is the number of bytes it consumed;
+ *                      unconsumed bytes are offered again, but a sink
+ *                      that consumes nothing aborts the capture. A
+ *                      negative return aborts as well.
+ *
+ * @param[in]  userdata Passed through to the sink.
+ *
+ * @param[in]  limit    Maximum total bytes to deliver, 0 for no bound.
+ *
+ * @return              SSH_OK once the remote end sent EOF and both
+ *                      streams are drained, SSH_ERROR on error, on
+ *                      abort from the sink, or when the limit was
+ *                      reached first.
+ */
+int ssh_channel_capture_output(ssh_channel channel,
+    ssh_channel_data_callback sink, void *userdata, uint64_t limit) {
+  ssh_session session;
+  uint64_t total = 0;
+  int is_stderr;
+  int rc;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (sink == NULL) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  session = channel->session;
+  enter_function();
+
+  if (channel->state == SSH_CHANNEL_STATE_OPEN) {
+    if (!channel->window_fixed && channel->window_target < WINDOWMAX) {
+      channel->window_target = WINDOWMAX;
+    }
+    if (grow_window(session, channel, 0) < 0) {
+      leave_function();
+      return SSH_ERROR;
+    }
+  }
+
+  while (1) {
+    uint32_t delivered = 0;
+    uint32_t pending = 0;
+
+    for (is_stderr = 0; is_stderr < 2; is_stderr++) {
+      ssh_buffer buf = is_stderr ? channel->stderr_buffer
+                                 : channel->stdout_buffer;
+      uint32_t len = buffer_get_rest_len(buf);
+
+      if (len == 0) {
+        continue;
+      }
+      if (limit > 0 && (uint64_t) len > limit - total) {
+        len = (uint32_t) (limit - total);
+      }
+      if (len > 0) {
+        rc = sink(session, channel, buffer_get_rest(buf), len, is_stderr,
+            userdata);
+        if (rc < 0) {
+          ssh_set_error(session, SSH_REQUEST_DENIED,
+              "Output capture aborted by the sink");
+          leave_function();
+          return SSH_ERROR;
+        }
+        if ((uint32_t) rc > len) {
+          rc = (int) len;
+        }
+        buffer_pass_bytes(buf, rc);
+        total += rc;
+        delivered += rc;
+      }
+      if (limit > 0 && total >= limit) {
+        ssh_set_error(session, SSH_REQUEST_DENIED,
+            "Output capture limit of %llu bytes reached",
+            (unsigned long long) limit);
+        leave_function();
+        return SSH_ERROR;
+      }
+      pending += buffer_get_rest_len(buf);
+    }
+
+    if (channel->remote_eof && pending == 0) {
+      break;
+    }
+    if (delivered > 0) {
+      /* the sink consumed buffered data, refill the window */
+      if (channel->state == SSH_CHANNEL_STATE_OPEN &&
+          channel->local_window < channel_window_target(channel) / 2) {
+        if (grow_window(session, channel, 0) < 0) {
+          leave_function();
+          return SSH_ERROR;
+        }
+      }
+      continue;
+    }
+    if (pending > 0) {
+      /* a sink that consumes nothing would spin here forever */
+      ssh_set_error(session, SSH_FATAL,
+          "Output capture sink made no progress");
+      leave_function();
+      return SSH_ERROR;
+    }
+    if (channel->state != SSH_CHANNEL_STATE_OPEN) {
+      ssh_set_error(session, SSH_FATAL,
+          "Channel closed while capturing output");
+      leave_function();
+      return SSH_ERROR;
+    }
+    if (channel_wait_for_data(channel, channel->stdout_buffer, -1) ==
+        SSH_ERROR) {
+      leave_function();
+      return SSH_ERROR;
+    }
+  }
+
+  leave_function();
+  return SSH_OK;
+}
+
 /**
  * @brief Do a nonblocking read on the channel.
  *
@@ -2499,6 +5645,123 @@ int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_std
  *
  * @see channel_is_eof()
  */
+/**
+ * @brief Get a pointer to the data available on a channel without copying.
+ *
+ * This is the zero-copy variant of ssh_channel_read(). It blocks until at
+ * least one byte of data is available, then hands out a pointer directly
+ * into the channel's internal buffer together with the number of readable
+ * bytes. The pointer stays valid until the next read or packet processing
+ * call on the session. Once (part of) the data has been consumed, it must
+ * be released with ssh_channel_read_release().
+ *
+ * @param[in]  channel  The channel to read from.
+ *
+ * @param[out] dest     A pointer set to the beginning of the available data.
+ *
+ * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
+ *
+ * @return              The number of bytes available at *dest, 0 on end of
+ *                      file or SSH_ERROR on error.
+ *
+ * @see ssh_channel_read_release()
+ */
+int ssh_channel_read_nocopy(ssh_channel channel, void **dest, int is_stderr) {
+  ssh_session session;
+  ssh_buffer stdbuf;
+
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+  if(dest == NULL) {
+      ssh_set_error_invalid(channel->session, __FUNCTION__);
+      return SSH_ERROR;
+  }
+
+  session = channel->session;
+  stdbuf = channel->stdout_buffer;
+  enter_function();
+
+  if (is_stderr) {
+    stdbuf = channel->stderr_buffer;
+  }
+
+  /* block until at least one byte has been read */
+  while (buffer_get_rest_len(stdbuf) == 0) {
+    int rc;
+
+    if (channel->remote_eof) {
+      leave_function();
+      return 0;
+    }
+    rc = ssh_handle_packets(session,-1);
+    if (rc != SSH_OK) {
+      leave_function();
+      return rc;
+    }
+  }
+
+  *dest = buffer_get_rest(stdbuf);
+
+  leave_function();
+  return buffer_get_rest_len(stdbuf);
+}
+
+/**
+ * @brief Release data borrowed with ssh_channel_read_nocopy().
+ *
+ * Marks count bytes as consumed in the channel buffer and reopens the
+ * local window if needed, exactly as a copying read of the same size
+ * would have done.
+ *
+ * @param[in]  channel  The channel the data was read from.
+ *
+ * @param[in]  count    The number of bytes consumed. It may be less than
+ *                      what ssh_channel_read_nocopy() returned; the rest
+ *                      stays available for the next read.
+ *
+ * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_channel_read_nocopy()
+ */
+int ssh_channel_read_release(ssh_channel channel, uint32_t count,
+    int is_stderr) {
+  ssh_session session;
+  ssh_buffer stdbuf;
+
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+
+  session = channel->session;
+  stdbuf = channel->stdout_buffer;
+  enter_function();
+
+  if (is_stderr) {
+    stdbuf = channel->stderr_buffer;
+  }
+
+  if (count > buffer_get_rest_len(stdbuf)) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    leave_function();
+    return SSH_ERROR;
+  }
+
+  buffer_pass_bytes(stdbuf, count);
+  /* Authorize some buffering while userapp is busy */
+  if (channel->local_window < channel_window_target(channel) / 2) {
+    if (grow_window(session, channel, 0) < 0) {
+      leave_function();
+      return SSH_ERROR;
+    }
+  }
+
+  leave_function();
+  return SSH_OK;
+}
+
 int ssh_channel_read_nonblocking(ssh_channel channel, void *dest, uint32_t count,
     int is_stderr) {
   ssh_session session;
@@ -2583,6 +5846,61 @@ int ssh_channel_poll(ssh_channel channel, int is_stderr){
   return buffer_get_rest_len(stdbuf);
 }
 
+/**
+ * @brief Count the bytes already buffered on a channel, without doing I/O.
+ *
+ * Unlike ssh_channel_poll() this never runs the packet machinery: it only
+ * looks at the channel's buffer, so a tight relay loop can call it per
+ * iteration for free and fall back to ssh_channel_pump() when it returns 0.
+ *
+ * @param[in]  channel   The channel to check.
+ *
+ * @param[in]  is_stderr Nonzero to check the stderr stream.
+ *
+ * @return              The number of bytes ready to read, 0 if none are
+ *                      buffered, SSH_EOF if the remote side sent an EOF,
+ *                      SSH_ERROR on invalid channel.
+ *
+ * @see ssh_channel_pump()
+ */
+int ssh_channel_poll_buffered(ssh_channel channel, int is_stderr) {
+  ssh_buffer stdbuf;
+  uint32_t len;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  stdbuf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
+  len = buffer_get_rest_len(stdbuf);
+  if (len == 0 && channel->remote_eof) {
+    return SSH_EOF;
+  }
+
+  return (int) len;
+}
+
+/**
+ * @brief Run one pass of the packet machinery for a channel's session.
+ *
+ * The explicit I/O half of ssh_channel_poll_buffered(): reads whatever the
+ * transport has pending and dispatches it, filling the channel buffers.
+ *
+ * @param[in]  channel  The channel whose session should do I/O.
+ *
+ * @param[in]  timeout  Milliseconds to wait for traffic, 0 to only handle
+ *                      what is already pending.
+ *
+ * @return              SSH_OK on success, SSH_ERROR otherwise.
+ */
+int ssh_channel_pump(ssh_channel channel, int timeout) {
+  if (channel == NULL || channel->session == NULL) {
+    return SSH_ERROR;
+  }
+
+  return ssh_handle_packets(channel->session, timeout);
+}
+
 /**
  * @brief Recover the session in which belongs a channel.
  *
@@ -2653,7 +5971,9 @@ static int channel_protocol_select(ssh_channel *rchans, ssh_channel *wchans,
     chan = rchans[i];
 
     while (ssh_channel_is_open(chan) && ssh_socket_data_available(chan->session->socket)) {
-      ssh_handle_packets(chan->session,-1);
+      if (ssh_handle_packets(chan->session,-1) != SSH_OK) {
+        break;
+      }
     }
 
     if ((chan->stdout_buffer && buffer_get_rest_len(chan->stdout_buffer) > 0) ||
@@ -36,6 +36,9 @@
 #include "libssh/socket.h"
 #include "libssh/session.h"
 #include "libssh/dh.h"
+#include "libssh/crypto.h"
+#include "libssh/ecdh.h"
+#include "libssh/messages.h"
 #include "libssh/threads.h"
 #include "libssh/misc.h"
 
@@ -44,6 +47,319 @@
             session->callbacks->connect_status_function(session->callbacks->userdata, status); \
     } while (0)
 
+/* The reconnect cache remembers, per thread and per "host:port", the kex
+ * methods negotiated by the last successful connection and the identity file
+ * which authenticated there. A reconnect to the same server then proposes
+ * the known-good algorithms first and tries the known-good identity first,
+ * instead of rediscovering both the expensive way. It is opt-in, see
+ * ssh_reconnect_cache_enable(). */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_RECONNECT_CACHE
+#endif
+
+#ifdef HAVE_RECONNECT_CACHE
+
+extern const char *default_methods[];
+
+struct ssh_reconnect_entry {
+  struct ssh_reconnect_entry *next;
+  char *hostport;
+  char *methods[10];  /* negotiated algorithms, indexed like KEX methods */
+  char *identity;     /* identity file that authenticated, or NULL */
+  int auth_methods;   /* SSH_AUTH_METHOD_* mask the server advertised, 0 if
+                         unknown */
+};
+
+static int reconnect_cache_enabled = 0;
+static __thread struct ssh_reconnect_entry *reconnect_cache_head;
+
+/* builds the "host:port" cache key for a session, caller frees */
+static char *reconnect_cache_key(ssh_session session) {
+  char *key = NULL;
+  size_t len;
+
+  if (session->host == NULL) {
+    return NULL;
+  }
+
+  len = strlen(session->host) + 16;
+  key = malloc(len);
+  if (key == NULL) {
+    return NULL;
+  }
+  snprintf(key, len, "%s:%u", session->host,
+      session->port ? session->port : 22);
+
+  return key;
+}
+
+static struct ssh_reconnect_entry *reconnect_cache_find(const char *hostport) {
+  struct ssh_reconnect_entry *entry;
+
+  for (entry = reconnect_cache_head; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->hostport, hostport) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static void reconnect_entry_free(struct ssh_reconnect_entry *entry) {
+  int i;
+
+  for (i = 0; i < 10; i++) {
+    SAFE_FREE(entry->methods[i]);
+  }
+  SAFE_FREE(entry->identity);
+  SAFE_FREE(entry->hostport);
+  SAFE_FREE(entry);
+}
+
+/** @internal
+ * @brief Records the kex methods negotiated by this session so the next
+ * connection to the same server can propose them first. Called once the new
+ * keys are in effect.
+ */
+void ssh_reconnect_cache_store(ssh_session session) {
+  struct ssh_reconnect_entry *entry;
+  char *hostport;
+  int i;
+
+  if (!reconnect_cache_enabled || session->client_kex.methods == NULL) {
+    return;
+  }
+
+  hostport = reconnect_cache_key(session);
+  if (hostport == NULL) {
+    return;
+  }
+
+  entry = reconnect_cache_find(hostport);
+  if (entry == NULL) {
+    entry = malloc(sizeof(struct ssh_reconnect_entry));
+    if (entry == NULL) {
+      SAFE_FREE(hostport);
+      return;
+    }
+    ZERO_STRUCTP(entry);
+    entry->hostport = hostport;
+    entry->next = reconnect_cache_head;
+    reconnect_cache_head = entry;
+  } else {
+    SAFE_FREE(hostport);
+  }
+
+  for (i = 0; i < 10; i++) {
+    SAFE_FREE(entry->methods[i]);
+    if (session->client_kex.methods[i]) {
+      entry->methods[i] = strdup(session->client_kex.methods[i]);
+    }
+  }
+}
+
+/** @internal
+ * @brief Remembers which identity file authenticated against this server.
+ */
+void ssh_reconnect_cache_set_identity(ssh_session session, const char *file) {
+  struct ssh_reconnect_entry *entry;
+  char *hostport;
+
+  if (!reconnect_cache_enabled || file == NULL) {
+    return;
+  }
+
+  hostport = reconnect_cache_key(session);
+  if (hostport == NULL) {
+    return;
+  }
+  entry = reconnect_cache_find(hostport);
+  SAFE_FREE(hostport);
+  if (entry == NULL) {
+    return;
+  }
+
+  SAFE_FREE(entry->identity);
+  entry->identity = strdup(file);
+}
+
+/** @internal
+ * @brief Remembers the authentication methods the server advertised in its
+ * last SSH_MSG_USERAUTH_FAILURE, so the next connection can skip probing.
+ */
+void ssh_reconnect_cache_set_auth_methods(ssh_session session, int methods) {
+  struct ssh_reconnect_entry *entry;
+  char *hostport;
+
+  if (!reconnect_cache_enabled || methods == 0) {
+    return;
+  }
+
+  hostport = reconnect_cache_key(session);
+  if (hostport == NULL) {
+    return;
+  }
+  entry = reconnect_cache_find(hostport);
+  SAFE_FREE(hostport);
+  if (entry == NULL) {
+    return;
+  }
+
+  entry->auth_methods = methods;
+}
+
+/** @internal
+ * @brief Returns the SSH_AUTH_METHOD_* mask this server advertised last
+ * time, or 0 if it is not known.
+ */
+int ssh_reconnect_cache_get_auth_methods(ssh_session session) {
+  struct ssh_reconnect_entry *entry;
+  char *hostport;
+
+  if (!reconnect_cache_enabled) {
+    return 0;
+  }
+
+  hostport = reconnect_cache_key(session);
+  if (hostport == NULL) {
+    return 0;
+  }
+  entry = reconnect_cache_find(hostport);
+  SAFE_FREE(hostport);
+
+  return entry ? entry->auth_methods : 0;
+}
+
+/** @internal
+ * @brief Returns the identity file which authenticated against this server
+ * last time, or NULL. The string belongs to the cache.
+ */
+const char *ssh_reconnect_cache_get_identity(ssh_session session) {
+  struct ssh_reconnect_entry *entry;
+  char *hostport;
+
+  if (!reconnect_cache_enabled) {
+    return NULL;
+  }
+
+  hostport = reconnect_cache_key(session);
+  if (hostport == NULL) {
+    return NULL;
+  }
+  entry = reconnect_cache_find(hostport);
+  SAFE_FREE(hostport);
+
+  return entry ? entry->identity : NULL;
+}
+
+/* Proposes the algorithms of the last connection first. Only the method
+ * slots the application left alone are touched, and the default list is
+ * kept as a fallback, so a reconfigured server still negotiates fine. */
+static void reconnect_cache_seed_methods(ssh_session session) {
+  struct ssh_reconnect_entry *entry;
+  char *hostport;
+  char *wanted;
+  size_t len;
+  int i;
+
+  if (!reconnect_cache_enabled) {
+    return;
+  }
+
+  hostport = reconnect_cache_key(session);
+  if (hostport == NULL) {
+    return;
+  }
+  entry = reconnect_cache_find(hostport);
+  SAFE_FREE(hostport);
+  if (entry == NULL) {
+    return;
+  }
+
+  for (i = 0; i < SSH_LANG_C_S; i++) {
+    if (session->wanted_methods[i] != NULL || entry->methods[i] == NULL ||
+        entry->methods[i][0] == '\0') {
+      continue;
+    }
+    len = strlen(entry->methods[i]) + strlen(default_methods[i]) + 2;
+    wanted = malloc(len);
+    if (wanted == NULL) {
+      return;
+    }
+    snprintf(wanted, len, "%s,%s", entry->methods[i], default_methods[i]);
+    session->wanted_methods[i] = wanted;
+  }
+}
+
+/** @internal
+ * @brief Frees the reconnect cache of the calling thread.
+ */
+void ssh_reconnect_cache_flush(void) {
+  struct ssh_reconnect_entry *entry;
+
+  while (reconnect_cache_head != NULL) {
+    entry = reconnect_cache_head;
+    reconnect_cache_head = entry->next;
+    reconnect_entry_free(entry);
+  }
+}
+
+#else /* HAVE_RECONNECT_CACHE */
+
+void ssh_reconnect_cache_store(ssh_session session) {
+  (void)session;
+}
+
+void ssh_reconnect_cache_set_identity(ssh_session session, const char *file) {
+  (void)session;
+  (void)file;
+}
+
+const char *ssh_reconnect_cache_get_identity(ssh_session session) {
+  (void)session;
+  return NULL;
+}
+
+void ssh_reconnect_cache_set_auth_methods(ssh_session session, int methods) {
+  (void)session;
+  (void)methods;
+}
+
+int ssh_reconnect_cache_get_auth_methods(ssh_session session) {
+  (void)session;
+  return 0;
+}
+
+void ssh_reconnect_cache_flush(void) {
+}
+
+#endif /* HAVE_RECONNECT_CACHE */
+
+/**
+ * @brief Enable or disable the reconnect cache.
+ *
+ * When enabled, each thread remembers per server which algorithms were
+ * negotiated and which identity file authenticated, and reconnections to
+ * the same server reuse that knowledge: the known-good algorithms are
+ * proposed first and the known-good identity is tried before the others,
+ * saving one userauth round trip per previously refused key.
+ *
+ * The cache only keeps names, never keys or other secrets. It is disabled
+ * by default.
+ *
+ * @param[in] enable    Non zero to enable the cache, 0 to disable it.
+ */
+void ssh_reconnect_cache_enable(int enable) {
+#ifdef HAVE_RECONNECT_CACHE
+  reconnect_cache_enabled = enable;
+  if (!enable) {
+    ssh_reconnect_cache_flush();
+  }
+#else
+  (void)enable;
+#endif
+}
+
 /**
  * @internal
  * @brief Callback to be called when the socket is connected or had a
@@ -62,9 +378,19 @@ static void socket_callback_connected(int code, int errno_code, void *user){
 		return;
 	}
 	ssh_log(session,SSH_LOG_RARE,"Socket connection callback: %d (%d)",code, errno_code);
-	if(code == SSH_SOCKET_CONNECTED_OK)
+	if(code == SSH_SOCKET_CONNECTED_OK){
 		session->session_state=SSH_SESSION_STATE_SOCKET_CONNECTED;
-	else {
+		/* When SSH-1 fallback is excluded, the banner we send does not
+		 * depend on which version the server announces, so send it
+		 * without waiting for the server's banner. Both banners then
+		 * cross on the wire, saving a round trip before key exchange. */
+#ifdef WITH_SSH1
+		if (!session->ssh1)
+			ssh_send_banner(session, 0);
+#else
+		ssh_send_banner(session, 0);
+#endif
+	} else {
 		session->session_state=SSH_SESSION_STATE_ERROR;
 		ssh_set_error(session,SSH_FATAL,"%s",strerror(errno_code));
 	}
@@ -137,16 +463,29 @@ static int callback_receive_banner(const void *data, size_t len, void *user) {
  * @return 0 on success, < 0 on error.
  */
 int ssh_send_banner(ssh_session session, int server) {
+  /* the wire image of the default banners, newline included, is stamped
+   * out at compile time; connecting only has to write it */
+  static const char banner1_line[] = CLIENTBANNER1 "\n";
+  static const char banner2_line[] = CLIENTBANNER2 "\n";
   const char *banner = NULL;
+  const char *line = NULL;
   char buffer[128] = {0};
   int err=SSH_ERROR;
 
   enter_function();
 
-  banner = session->version == 1 ? CLIENTBANNER1 : CLIENTBANNER2;
+  if (session->version == 1) {
+    banner = CLIENTBANNER1;
+    line = banner1_line;
+  } else {
+    banner = CLIENTBANNER2;
+    line = banner2_line;
+  }
 
   if (session->xbanner) {
     banner = session->xbanner;
+    snprintf(buffer, 128, "%s\n", banner);
+    line = buffer;
   }
 
   if (server) {
@@ -161,14 +500,12 @@ int ssh_send_banner(ssh_session session, int server) {
     }
   }
 
-  snprintf(buffer, 128, "%s\n", banner);
-
-  if (ssh_socket_write(session->socket, buffer, strlen(buffer)) == SSH_ERROR) {
+  if (ssh_socket_write(session->socket, line, strlen(line)) == SSH_ERROR) {
     goto end;
   }
 #ifdef WITH_PCAP
   if(session->pcap_ctx)
-  	ssh_pcap_context_write(session->pcap_ctx,SSH_PCAP_DIR_OUT,buffer,strlen(buffer),strlen(buffer));
+  	ssh_pcap_context_write(session->pcap_ctx,SSH_PCAP_DIR_OUT,(void *)line,strlen(line),strlen(line));
 #endif
   err=SSH_OK;
 end:
@@ -192,6 +529,16 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
     	goto error;
   }
 
+#ifdef HAVE_ECC
+  if (session->next_crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+    if (ssh_client_ecdh_reply(session, packet) != SSH_OK) {
+      goto error;
+    }
+    session->dh_handshake_state = DH_STATE_NEWKEYS_SENT;
+    return SSH_PACKET_USED;
+  }
+#endif
+
   pubkey = buffer_get_ssh_string(packet);
   if (pubkey == NULL){
     ssh_set_error(session,SSH_FATAL, "No public key in packet");
@@ -208,7 +555,7 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
     ssh_set_error(session, SSH_FATAL, "Cannot import f number");
     goto error;
   }
-  ssh_string_burn(f);
+  /* f is the server's public DH value, nothing to hide */
   ssh_string_free(f);
   f=NULL;
   signature = buffer_get_ssh_string(packet);
@@ -223,6 +570,18 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
     goto error;
   }
 
+  /* During a rekey the new keys can be derived right now: RFC 4253
+   * activates each direction at its own NEWKEYS boundary, so the outbound
+   * direction may switch as soon as our NEWKEYS is on the wire instead of
+   * stalling until the server's arrives. */
+  if (session->rekeying) {
+    if (make_sessionid(session) != SSH_OK ||
+        crypt_set_algorithms(session) != 0 ||
+        generate_session_keys(session) < 0) {
+      goto error;
+    }
+  }
+
   /* Send the MSG_NEWKEYS */
   if (buffer_add_u8(session->out_buffer, SSH2_MSG_NEWKEYS) < 0) {
     goto error;
@@ -232,6 +591,13 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
   ssh_log(session, SSH_LOG_PROTOCOL, "SSH_MSG_NEWKEYS sent");
 
   session->dh_handshake_state = DH_STATE_NEWKEYS_SENT;
+  if (session->rekeying && session->next_crypto->out_cipher != NULL) {
+    session->out_crypto = session->next_crypto;
+    ssh_log(session, SSH_LOG_PROTOCOL,
+        "Outbound direction switched to the new keys");
+    /* writes queued since KEXINIT may go out under the new keys */
+    channel_sched_flush(session);
+  }
   return SSH_PACKET_USED;
 error:
   session->session_state=SSH_SESSION_STATE_ERROR;
@@ -255,22 +621,25 @@ SSH_PACKET_CALLBACK(ssh_packet_newkeys){
     /* server things are done in server.c */
     session->dh_handshake_state=DH_STATE_FINISHED;
   } else {
-    /* client */
-    rc = make_sessionid(session);
-    if (rc != SSH_OK) {
-      goto error;
-    }
+    /* client; with early outbound activation the keys were already
+     * derived when our own NEWKEYS went out */
+    if (session->next_crypto->out_cipher == NULL) {
+      rc = make_sessionid(session);
+      if (rc != SSH_OK) {
+        goto error;
+      }
 
-    /*
-     * Set the cryptographic functions for the next crypto
-     * (it is needed for generate_session_keys for key lengths)
-     */
-    if (crypt_set_algorithms(session)) {
-      goto error;
-    }
+      /*
+       * Set the cryptographic functions for the next crypto
+       * (it is needed for generate_session_keys for key lengths)
+       */
+      if (crypt_set_algorithms(session)) {
+        goto error;
+      }
 
-    if (generate_session_keys(session) < 0) {
-      goto error;
+      if (generate_session_keys(session) < 0) {
+        goto error;
+      }
     }
 
     /* Verify the host's signature. FIXME do it sooner */
@@ -281,7 +650,6 @@ SSH_PACKET_CALLBACK(ssh_packet_newkeys){
     }
 
     /* forget it for now ... */
-    ssh_string_burn(signature);
     ssh_string_free(signature);
     signature=NULL;
     /*
@@ -295,14 +663,35 @@ SSH_PACKET_CALLBACK(ssh_packet_newkeys){
 
     /* FIXME later, include a function to change keys */
     session->current_crypto = session->next_crypto;
+    session->out_crypto = session->current_crypto;
 
     session->next_crypto = crypto_new();
     if (session->next_crypto == NULL) {
       ssh_set_error_oom(session);
       goto error;
     }
+
+    ssh_reconnect_cache_store(session);
+  }
+  if (session->stats_in_kex) {
+    session->stats.kex_duration_ms +=
+        ssh_timestamp_elapsed_ms(&session->stats_kex_start);
+    session->stats_in_kex = 0;
   }
   session->dh_handshake_state = DH_STATE_FINISHED;
+  /* restart the rekey accounting from the fresh keys */
+  session->rekey_basis_bytes = session->stats.bytes_encrypted +
+      session->stats.bytes_decrypted;
+  ssh_timestamp_init(&session->rekey_since);
+  if (session->rekeying) {
+    session->rekeying = 0;
+    session->rekey_sent_kexinit = 0;
+    session->session_state = session->rekey_saved_state;
+    ssh_log(session, SSH_LOG_PROTOCOL, "Rekeying done");
+    /* writes queued while the key exchange was in flight */
+    channel_sched_flush(session);
+	  return SSH_PACKET_USED;
+  }
   session->ssh_connection_callback(session);
 	return SSH_PACKET_USED;
 error:
@@ -327,6 +716,24 @@ static int dh_handshake(ssh_session session) {
 
   switch (session->dh_handshake_state) {
     case DH_STATE_INIT:
+      ssh_timestamp_init(&session->stats_kex_start);
+      session->stats_in_kex = 1;
+      if (ssh_kex_select_kex_type(session,
+            session->client_kex.methods[SSH_KEX]) != SSH_OK) {
+        goto error;
+      }
+
+#ifdef HAVE_ECC
+      if (session->next_crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+        if (ssh_client_ecdh_init(session) != SSH_OK) {
+          goto error;
+        }
+        session->dh_handshake_state = DH_STATE_INIT_SENT;
+        leave_function();
+        return SSH_AGAIN;
+      }
+#endif
+
       if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEXDH_INIT) < 0) {
         goto error;
       }
@@ -346,7 +753,7 @@ static int dh_handshake(ssh_session session) {
       if (buffer_add_ssh_string(session->out_buffer, e) < 0) {
         goto error;
       }
-      ssh_string_burn(e);
+      /* e is our public DH value, nothing to hide */
       ssh_string_free(e);
       e=NULL;
 
@@ -376,15 +783,12 @@ static int dh_handshake(ssh_session session) {
   return SSH_AGAIN;
 error:
   if(e != NULL){
-    ssh_string_burn(e);
     ssh_string_free(e);
   }
   if(f != NULL){
-    ssh_string_burn(f);
     ssh_string_free(f);
   }
   if(signature != NULL){
-    ssh_string_burn(signature);
     ssh_string_free(signature);
   }
 
@@ -392,6 +796,72 @@ error:
   return rc;
 }
 
+/** @internal
+ * @brief decides whether the configured rekey thresholds are reached
+ */
+static int ssh_client_rekey_due(ssh_session session) {
+  if (session->rekeying || session->server || session->version != 2 ||
+      session->session_state != SSH_SESSION_STATE_AUTHENTICATED ||
+      session->current_crypto == NULL ||
+      session->dh_handshake_state != DH_STATE_FINISHED) {
+    return 0;
+  }
+
+  if (session->rekey_limit_bytes > 0 &&
+      session->stats.bytes_encrypted + session->stats.bytes_decrypted -
+      session->rekey_basis_bytes >= session->rekey_limit_bytes) {
+    return 1;
+  }
+  if (session->rekey_limit_seconds > 0 &&
+      (uint64_t) ssh_timestamp_elapsed_ms(&session->rekey_since) >=
+      session->rekey_limit_seconds * 1000) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/** @internal
+ * @brief initiates a key renegotiation when a configured threshold has
+ * been crossed
+ *
+ * Called from the packet layer between two packets, where the output
+ * buffer is free. The KEXINIT proposes the methods negotiated by the
+ * initial exchange, so the outcome is known and the server's reply
+ * drives the usual DH state machine. Channel data queued while the
+ * exchange is in flight is held back by the output scheduler and
+ * flushed at NEWKEYS; the DH secret comes from the precomputed pool,
+ * so the stall is essentially one round trip.
+ */
+void ssh_client_rekey_check(ssh_session session) {
+  if (ssh_client_rekey_due(session) == 0) {
+    return;
+  }
+  enter_function();
+
+  ssh_log(session, SSH_LOG_PROTOCOL,
+      "Rekeying after %llu bytes and %d ms",
+      (unsigned long long) (session->stats.bytes_encrypted +
+        session->stats.bytes_decrypted - session->rekey_basis_bytes),
+      ssh_timestamp_elapsed_ms(&session->rekey_since));
+
+  session->rekeying = 1;
+  session->rekey_saved_state = session->session_state;
+  session->session_state = SSH_SESSION_STATE_INITIAL_KEX;
+  session->dh_handshake_state = DH_STATE_INIT;
+  /* the server's KEXINIT refills this list */
+  kex_methods_free(&session->server_kex);
+
+  if (ssh_send_kex(session, 0) < 0) {
+    session->session_state = SSH_SESSION_STATE_ERROR;
+    leave_function();
+    return;
+  }
+  session->rekey_sent_kexinit = 1;
+
+  leave_function();
+}
+
 /**
  * @internal
  * @brief handles a SSH_SERVICE_ACCEPT packet
@@ -538,7 +1008,10 @@ static void ssh_client_connection_callback(ssh_session session){
 #endif
 		  ssh_packet_set_default_callbacks(session);
 		  session->session_state=SSH_SESSION_STATE_INITIAL_KEX;
-		  ssh_send_banner(session, 0);
+		  /* may already have been sent when the socket connected */
+		  if (session->clientbanner == NULL) {
+		    ssh_send_banner(session, 0);
+		  }
 		  set_status(session, 0.5f);
 		  break;
 		case SSH_SESSION_STATE_INITIAL_KEX:
@@ -554,6 +1027,23 @@ static void ssh_client_connection_callback(ssh_session session){
 #endif
 			break;
 		case SSH_SESSION_STATE_KEXINIT_RECEIVED:
+			if (session->rekeying) {
+				/* the methods were negotiated by the initial exchange, our
+				 * KEXINIT only proposes them again (or already did when we
+				 * initiated the rekey ourselves) */
+				ssh_list_kex(session, &session->server_kex);
+				if (session->rekey_sent_kexinit == 0) {
+					if (ssh_send_kex(session, 0) < 0) {
+						goto error;
+					}
+					session->rekey_sent_kexinit = 1;
+				}
+				session->session_state=SSH_SESSION_STATE_DH;
+				if (dh_handshake(session) == SSH_ERROR) {
+					goto error;
+				}
+				break;
+			}
 			set_status(session,0.6f);
 			ssh_list_kex(session, &session->server_kex);
 			if (set_kex(session) < 0) {
@@ -572,6 +1062,11 @@ static void ssh_client_connection_callback(ssh_session session){
 				set_status(session,1.0f);
 				session->connected = 1;
 				session->session_state=SSH_SESSION_STATE_AUTHENTICATING;
+				if (session->deferred_hostkey) {
+					/* get the userauth service round trip on the wire while
+					 * the application runs its known_hosts lookup */
+					ssh_service_request(session, "ssh-userauth");
+				}
 			}
 			break;
 		case SSH_SESSION_STATE_AUTHENTICATING:
@@ -643,7 +1138,12 @@ int ssh_connect(ssh_session session) {
     leave_function();
     return SSH_ERROR;
   }
-  if (session->fd == SSH_INVALID_SOCKET && session->host == NULL && session->ProxyCommand == NULL) {
+#ifdef HAVE_RECONNECT_CACHE
+  reconnect_cache_seed_methods(session);
+#endif
+  if (session->fd == SSH_INVALID_SOCKET &&
+      !ssh_socket_is_loopback(session->socket) &&
+      session->host == NULL && session->ProxyCommand == NULL) {
     ssh_set_error(session, SSH_FATAL, "Hostname required");
     leave_function();
     return SSH_ERROR;
@@ -663,7 +1163,12 @@ int ssh_connect(ssh_session session) {
   session->socket_callbacks.data=callback_receive_banner;
   session->socket_callbacks.exception=ssh_socket_exception_callback;
   session->socket_callbacks.userdata=session;
-  if (session->fd != SSH_INVALID_SOCKET) {
+  if (ssh_socket_is_loopback(session->socket)) {
+    /* transport wired by ssh_bind_accept_loopback(); already connected,
+     * just arm the poll machinery and send our banner */
+    ssh_socket_loopback_kick(session->socket);
+    ret=SSH_OK;
+  } else if (session->fd != SSH_INVALID_SOCKET) {
     ssh_socket_set_fd(session->socket, session->fd);
     ret=SSH_OK;
 #ifndef _WIN32
@@ -791,6 +1296,8 @@ error:
   }
   session->fd = SSH_INVALID_SOCKET;
   session->session_state=SSH_SESSION_STATE_DISCONNECTED;
+  /* alive is 0 by now, so the frees below do not emit a CLOSE per
+   * channel: the DISCONNECT above already tore everything down at once */
   while (session->channels) {
     ssh_channel_free(session->channels);
   }
@@ -798,6 +1305,7 @@ error:
     crypto_free(session->current_crypto);
     session->current_crypto=NULL;
   }
+  session->out_crypto = NULL;
   if(session->in_buffer)
     buffer_reinit(session->in_buffer);
   if(session->out_buffer)
@@ -822,14 +1330,12 @@ error:
   }
   SAFE_FREE(session->client_kex.methods);
   SAFE_FREE(session->server_kex.methods);
-  if(session->ssh_message_list){
+  {
     ssh_message msg;
-    while((msg=ssh_list_pop_head(ssh_message ,session->ssh_message_list))
-        != NULL){
+    while((msg=ssh_message_pop_head(session)) != NULL){
       ssh_message_free(msg);
     }
-    ssh_list_free(session->ssh_message_list);
-    session->ssh_message_list=NULL;
+    session->msg_queue_enabled=0;
   }
 
   if (session->packet_callbacks){
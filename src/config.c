@@ -24,6 +24,8 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "libssh/priv.h"
 #include "libssh/session.h"
@@ -66,6 +68,41 @@ static struct ssh_config_keyword_table_s ssh_config_keyword_table[] = {
   { NULL, SOC_UNSUPPORTED }
 };
 
+/* One option line inside a Host block, with the keyword already decoded. */
+struct ssh_config_directive {
+  struct ssh_config_directive *next;
+  enum ssh_config_opcode_e opcode;
+  char *args; /* rest of the line; the keyword itself for unsupported ones */
+  unsigned int line;
+};
+
+/* A Host block: the patterns of its Host line and the options below it. */
+struct ssh_config_block {
+  struct ssh_config_block *next;
+  char **patterns;
+  int npatterns;
+  int match_all; /* leading block, before the first Host line */
+  struct ssh_config_directive *directives;
+  struct ssh_config_directive *directives_tail;
+};
+
+/*
+ * A parsed configuration file. Tokenizing a large config for every
+ * session is a measurable share of session setup, so the result is kept
+ * per path and revalidated against the file's mtime and size; sessions
+ * only walk the blocks matching their host.
+ */
+struct ssh_config_cache {
+  struct ssh_config_cache *next;
+  char *path;
+  time_t mtime;
+  off_t size;
+  struct ssh_config_block *blocks;
+  struct ssh_config_block *blocks_tail;
+};
+
+static struct ssh_config_cache *ssh_config_caches;
+
 static enum ssh_config_opcode_e ssh_config_get_opcode(char *keyword) {
   int i;
 
@@ -155,15 +192,65 @@ static int ssh_config_get_yesno(char **str, int notfound) {
   return notfound;
 }
 
-static int ssh_config_parse_line(ssh_session session, const char *line,
-    unsigned int count, int *parsing) {
+static void ssh_config_block_free(struct ssh_config_block *block) {
+  struct ssh_config_directive *dir;
+  int i;
+
+  while (block->directives != NULL) {
+    dir = block->directives;
+    block->directives = dir->next;
+    SAFE_FREE(dir->args);
+    SAFE_FREE(dir);
+  }
+  for (i = 0; i < block->npatterns; i++) {
+    SAFE_FREE(block->patterns[i]);
+  }
+  SAFE_FREE(block->patterns);
+  SAFE_FREE(block);
+}
+
+static void ssh_config_cache_clear(struct ssh_config_cache *cache) {
+  struct ssh_config_block *block;
+
+  while (cache->blocks != NULL) {
+    block = cache->blocks;
+    cache->blocks = block->next;
+    ssh_config_block_free(block);
+  }
+  cache->blocks_tail = NULL;
+}
+
+static struct ssh_config_block *ssh_config_cache_add_block(
+    struct ssh_config_cache *cache) {
+  struct ssh_config_block *block;
+
+  block = malloc(sizeof(struct ssh_config_block));
+  if (block == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(block);
+
+  if (cache->blocks_tail == NULL) {
+    cache->blocks = block;
+  } else {
+    cache->blocks_tail->next = block;
+  }
+  cache->blocks_tail = block;
+
+  return block;
+}
+
+/* Tokenize one line into the cache. Returns 0 on success, -1 on error. */
+static int ssh_config_cache_add_line(ssh_session session,
+    struct ssh_config_cache *cache, const char *line, unsigned int count) {
+  struct ssh_config_block *block;
+  struct ssh_config_directive *dir;
   enum ssh_config_opcode_e opcode;
   const char *p;
   char *s, *x;
   char *keyword;
-  char *lowerhost;
+  char **patterns;
   size_t len;
-  int i;
 
   x = s = strdup(line);
   if (s == NULL) {
@@ -188,28 +275,99 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
 
   opcode = ssh_config_get_opcode(keyword);
 
-  switch (opcode) {
-    case SOC_HOST:
-      *parsing = 0;
-      lowerhost = (session->host) ? ssh_lowercase(session->host) : NULL;
-      for (p = ssh_config_get_str(&s, NULL); p && *p;
-          p = ssh_config_get_str(&s, NULL)) {
-        if (match_hostname(lowerhost, p, strlen(p))) {
-          *parsing = 1;
-        }
+  if (opcode == SOC_HOST) {
+    block = ssh_config_cache_add_block(cache);
+    if (block == NULL) {
+      goto oom;
+    }
+    for (p = ssh_config_get_str(&s, NULL); p && *p;
+        p = ssh_config_get_str(&s, NULL)) {
+      patterns = realloc(block->patterns,
+          (block->npatterns + 1) * sizeof(char *));
+      if (patterns == NULL) {
+        goto oom;
       }
-      SAFE_FREE(lowerhost);
-      break;
+      block->patterns = patterns;
+      block->patterns[block->npatterns] = strdup(p);
+      if (block->patterns[block->npatterns] == NULL) {
+        goto oom;
+      }
+      block->npatterns++;
+    }
+    SAFE_FREE(x);
+    return 0;
+  }
+
+  /* options above the first Host line apply to every host */
+  block = cache->blocks_tail;
+  if (block == NULL) {
+    block = ssh_config_cache_add_block(cache);
+    if (block == NULL) {
+      goto oom;
+    }
+    block->match_all = 1;
+  }
+
+  dir = malloc(sizeof(struct ssh_config_directive));
+  if (dir == NULL) {
+    goto oom;
+  }
+  ZERO_STRUCTP(dir);
+  dir->opcode = opcode;
+  dir->line = count;
+  /* keep the keyword of unsupported options so they can be logged */
+  dir->args = strdup(opcode == SOC_UNSUPPORTED ? keyword : s);
+  if (dir->args == NULL) {
+    SAFE_FREE(dir);
+    goto oom;
+  }
+
+  if (block->directives_tail == NULL) {
+    block->directives = dir;
+  } else {
+    block->directives_tail->next = dir;
+  }
+  block->directives_tail = dir;
+
+  SAFE_FREE(x);
+  return 0;
+oom:
+  SAFE_FREE(x);
+  ssh_set_error_oom(session);
+  return -1;
+}
+
+/* Apply one cached directive to a session. */
+static int ssh_config_execute_directive(ssh_session session,
+    struct ssh_config_directive *dir) {
+  const char *p;
+  char *s, *x;
+  int i;
+
+  if (dir->opcode == SOC_UNSUPPORTED) {
+    ssh_log(session, SSH_LOG_RARE, "Unsupported option: %s, line: %d\n",
+            dir->args, dir->line);
+    return 0;
+  }
+
+  /* the tokenizer writes into the string, work on a copy */
+  x = s = strdup(dir->args);
+  if (s == NULL) {
+    ssh_set_error_oom(session);
+    return -1;
+  }
+
+  switch (dir->opcode) {
     case SOC_HOSTNAME:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_HOST, p);
       }
       break;
     case SOC_PORT:
       if (session->port == 22) {
           p = ssh_config_get_str(&s, NULL);
-          if (p && *parsing) {
+          if (p) {
               ssh_options_set(session, SSH_OPTIONS_PORT_STR, p);
           }
       }
@@ -217,27 +375,27 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
     case SOC_USERNAME:
       if (session->username == NULL) {
           p = ssh_config_get_str(&s, NULL);
-          if (p && *parsing) {
+          if (p) {
             ssh_options_set(session, SSH_OPTIONS_USER, p);
          }
       }
       break;
     case SOC_IDENTITY:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_ADD_IDENTITY, p);
       }
       break;
     case SOC_CIPHERS:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, p);
         ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, p);
       }
       break;
     case SOC_COMPRESSION:
       i = ssh_config_get_yesno(&s, -1);
-      if (i >= 0 && *parsing) {
+      if (i >= 0) {
         if (i) {
           ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
         } else {
@@ -247,7 +405,7 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
       break;
     case SOC_PROTOCOL:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         char *a, *b;
         b = strdup(p);
         if (b == NULL) {
@@ -278,35 +436,31 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
       break;
     case SOC_TIMEOUT:
       i = ssh_config_get_int(&s, -1);
-      if (i >= 0 && *parsing) {
+      if (i >= 0) {
         ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &i);
       }
       break;
     case SOC_STRICTHOSTKEYCHECK:
       i = ssh_config_get_yesno(&s, -1);
-      if (i >= 0 && *parsing) {
+      if (i >= 0) {
         ssh_options_set(session, SSH_OPTIONS_STRICTHOSTKEYCHECK, &i);
       }
       break;
     case SOC_KNOWNHOSTS:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, p);
       }
       break;
     case SOC_PROXYCOMMAND:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_PROXYCOMMAND, p);
       }
       break;
-    case SOC_UNSUPPORTED:
-      ssh_log(session, SSH_LOG_RARE, "Unsupported option: %s, line: %d\n",
-              keyword, count);
-      break;
     default:
       ssh_set_error(session, SSH_FATAL, "ERROR - unimplemented opcode: %d\n",
-              opcode);
+              dir->opcode);
       SAFE_FREE(x);
       return -1;
       break;
@@ -316,28 +470,116 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
   return 0;
 }
 
-/* ssh_config_parse_file */
-int ssh_config_parse_file(ssh_session session, const char *filename) {
+static int ssh_config_block_matches(struct ssh_config_block *block,
+    const char *lowerhost) {
+  int i;
+
+  if (block->match_all) {
+    return 1;
+  }
+  for (i = 0; i < block->npatterns; i++) {
+    if (match_hostname(lowerhost, block->patterns[i],
+          strlen(block->patterns[i]))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Find or (re)build the cache entry for a config file. */
+static struct ssh_config_cache *ssh_config_cache_get(ssh_session session,
+    const char *filename, struct stat *sb) {
+  struct ssh_config_cache *cache;
   char line[1024] = {0};
   unsigned int count = 0;
   FILE *f;
-  int parsing;
+
+  for (cache = ssh_config_caches; cache != NULL; cache = cache->next) {
+    if (strcmp(cache->path, filename) == 0) {
+      break;
+    }
+  }
+
+  if (cache != NULL &&
+      cache->mtime == sb->st_mtime && cache->size == sb->st_size) {
+    return cache;
+  }
+
+  if (cache == NULL) {
+    cache = malloc(sizeof(struct ssh_config_cache));
+    if (cache == NULL) {
+      ssh_set_error_oom(session);
+      return NULL;
+    }
+    ZERO_STRUCTP(cache);
+    cache->path = strdup(filename);
+    if (cache->path == NULL) {
+      SAFE_FREE(cache);
+      ssh_set_error_oom(session);
+      return NULL;
+    }
+    cache->next = ssh_config_caches;
+    ssh_config_caches = cache;
+  } else {
+    /* the file changed, parse it again */
+    ssh_config_cache_clear(cache);
+  }
+  cache->mtime = 0;
 
   if ((f = fopen(filename, "r")) == NULL) {
-    return 0;
+    /* unreadable files have always been treated as empty */
+    return cache;
   }
 
   ssh_log(session, SSH_LOG_RARE, "Reading configuration data from %s", filename);
 
-  parsing = 1;
   while (fgets(line, sizeof(line), f)) {
     count++;
-    if (ssh_config_parse_line(session, line, count, &parsing) < 0) {
+    if (ssh_config_cache_add_line(session, cache, line, count) < 0) {
+      ssh_config_cache_clear(cache);
       fclose(f);
-      return -1;
+      return NULL;
     }
   }
 
   fclose(f);
+  cache->mtime = sb->st_mtime;
+  cache->size = sb->st_size;
+
+  return cache;
+}
+
+/* ssh_config_parse_file */
+int ssh_config_parse_file(ssh_session session, const char *filename) {
+  struct ssh_config_cache *cache;
+  struct ssh_config_block *block;
+  struct ssh_config_directive *dir;
+  char *lowerhost;
+  struct stat sb;
+
+  if (stat(filename, &sb) < 0) {
+    return 0;
+  }
+
+  cache = ssh_config_cache_get(session, filename, &sb);
+  if (cache == NULL) {
+    return -1;
+  }
+
+  for (block = cache->blocks; block != NULL; block = block->next) {
+    lowerhost = (session->host) ? ssh_lowercase(session->host) : NULL;
+    if (!ssh_config_block_matches(block, lowerhost)) {
+      SAFE_FREE(lowerhost);
+      continue;
+    }
+    SAFE_FREE(lowerhost);
+    for (dir = block->directives; dir != NULL; dir = dir->next) {
+      if (ssh_config_execute_directive(session, dir) < 0) {
+        return -1;
+      }
+    }
+  }
+
   return 0;
 }
@@ -124,10 +124,188 @@ static int ssh_connect_socket_close(socket_t s){
 }
 
 
+/* The resolver cache remembers the numeric address a hostname last
+ * resolved to, and recent resolution failures. getaddrinfo() blocks the
+ * calling thread for up to several seconds when the resolver is slow,
+ * which stalls every session multiplexed on the same poll context, and a
+ * connection storm multiplies that load by the number of sessions. A
+ * positive hit substitutes the remembered address and resolves through
+ * the AI_NUMERICHOST fast path without touching DNS at all; a negative
+ * hit returns the remembered getaddrinfo() error immediately. The
+ * resolver API exposes no record TTLs, so entries expire after fixed
+ * delays, configurable with ssh_resolver_cache_set_ttl(). The cache is
+ * shared by all threads of the process when pthreads are available and
+ * per-thread otherwise. */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_RESOLVER_CACHE
+#endif
+
+#ifdef HAVE_RESOLVER_CACHE
+
+#define RESOLVER_CACHE_SIZE 64
+#define RESOLVER_CACHE_TTL_SECONDS 60
+#define RESOLVER_CACHE_NEG_TTL_SECONDS 5
+
+#ifndef NI_MAXHOST
+#define NI_MAXHOST 1025
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+static pthread_mutex_t resolver_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define RESOLVER_CACHE_THREAD
+#define resolver_cache_lock() pthread_mutex_lock(&resolver_cache_mutex)
+#define resolver_cache_unlock() pthread_mutex_unlock(&resolver_cache_mutex)
+#else
+#define RESOLVER_CACHE_THREAD __thread
+#define resolver_cache_lock() do { } while(0)
+#define resolver_cache_unlock() do { } while(0)
+#endif
+
+struct resolver_cache_entry {
+  char *host;
+  char addr[NI_MAXHOST];
+  int gai_error; /* 0 for a positive entry */
+  long expires;
+};
+
+static RESOLVER_CACHE_THREAD
+    struct resolver_cache_entry resolver_cache[RESOLVER_CACHE_SIZE];
+static RESOLVER_CACHE_THREAD int resolver_cache_clock;
+
+static int resolver_cache_ttl = RESOLVER_CACHE_TTL_SECONDS;
+static int resolver_cache_neg_ttl = RESOLVER_CACHE_NEG_TTL_SECONDS;
+
+/* Returns 1 and fills addr on a positive hit, the remembered nonzero
+ * getaddrinfo() error on a negative hit, 0 on a miss. */
+static int resolver_cache_lookup(const char *host, char *addr, size_t len) {
+  struct ssh_timestamp now;
+  int rc = 0;
+  int i;
+
+  ssh_timestamp_init(&now);
+  resolver_cache_lock();
+  for (i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+    if (resolver_cache[i].host != NULL &&
+        strcmp(resolver_cache[i].host, host) == 0) {
+      if (now.seconds < resolver_cache[i].expires) {
+        if (resolver_cache[i].gai_error != 0) {
+          rc = resolver_cache[i].gai_error;
+        } else {
+          snprintf(addr, len, "%s", resolver_cache[i].addr);
+          rc = 1;
+        }
+      } else {
+        /* stale, resolve again */
+        SAFE_FREE(resolver_cache[i].host);
+      }
+      break;
+    }
+  }
+  resolver_cache_unlock();
+
+  return rc;
+}
+
+static void resolver_cache_store(const char *host, const struct addrinfo *ai,
+    int gai_error) {
+  struct resolver_cache_entry *entry;
+  char addr[NI_MAXHOST];
+  struct ssh_timestamp now;
+  int ttl;
+  int i;
+
+  if (gai_error == 0) {
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, addr, sizeof(addr),
+                    NULL, 0, NI_NUMERICHOST) != 0) {
+      return;
+    }
+    ttl = resolver_cache_ttl;
+  } else {
+    ttl = resolver_cache_neg_ttl;
+  }
+  if (ttl <= 0) {
+    return;
+  }
+
+  resolver_cache_lock();
+  for (i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+    if (resolver_cache[i].host == NULL ||
+        strcmp(resolver_cache[i].host, host) == 0) {
+      break;
+    }
+  }
+  if (i < RESOLVER_CACHE_SIZE) {
+    entry = &resolver_cache[i];
+  } else {
+    /* all slots taken, overwrite them round robin */
+    entry = &resolver_cache[resolver_cache_clock];
+    resolver_cache_clock = (resolver_cache_clock + 1) % RESOLVER_CACHE_SIZE;
+  }
+
+  SAFE_FREE(entry->host);
+  entry->host = strdup(host);
+  if (entry->host == NULL) {
+    resolver_cache_unlock();
+    return;
+  }
+  if (gai_error == 0) {
+    snprintf(entry->addr, sizeof(entry->addr), "%s", addr);
+  }
+  entry->gai_error = gai_error;
+  ssh_timestamp_init(&now);
+  entry->expires = now.seconds + ttl;
+  resolver_cache_unlock();
+}
+
+#endif /* HAVE_RESOLVER_CACHE */
+
+/**
+ * @brief Configure the lifetime of resolver cache entries.
+ *
+ * libssh remembers successful and failed hostname resolutions for a few
+ * seconds to keep connection storms from hammering the resolver. The
+ * resolver API does not expose record TTLs, so the lifetimes are fixed
+ * delays.
+ *
+ * @param[in]  positive_seconds  Lifetime of successful resolutions,
+ *                               <= 0 to disable caching them.
+ *
+ * @param[in]  negative_seconds  Lifetime of failed resolutions,
+ *                               <= 0 to disable caching them.
+ */
+void ssh_resolver_cache_set_ttl(int positive_seconds, int negative_seconds) {
+#ifdef HAVE_RESOLVER_CACHE
+  resolver_cache_ttl = positive_seconds;
+  resolver_cache_neg_ttl = negative_seconds;
+#else
+  (void) positive_seconds;
+  (void) negative_seconds;
+#endif
+}
+
+/** @internal
+ *
+ * @brief Release the resolver cache entries.
+ */
+void ssh_resolver_cache_flush(void) {
+#ifdef HAVE_RESOLVER_CACHE
+  int i;
+
+  resolver_cache_lock();
+  for (i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+    SAFE_FREE(resolver_cache[i].host);
+  }
+  resolver_cache_unlock();
+#endif
+}
+
 static int getai(ssh_session session, const char *host, int port, struct addrinfo **ai) {
   const char *service = NULL;
   struct addrinfo hints;
   char s_port[10];
+  int numeric;
+  int rc;
 
   ZERO_STRUCT(hints);
 
@@ -145,13 +323,44 @@ static int getai(ssh_session session, const char *host, int port, struct addrinf
 #endif
   }
 
-  if (ssh_is_ipaddr(host)) {
+  numeric = ssh_is_ipaddr(host);
+  if (numeric) {
     /* this is an IP address */
     ssh_log(session,SSH_LOG_PACKET,"host %s matches an IP address",host);
     hints.ai_flags |= AI_NUMERICHOST;
   }
+#ifdef HAVE_RESOLVER_CACHE
+  else if (port != 0) {
+    char cached[NI_MAXHOST];
+    int hit = resolver_cache_lookup(host, cached, sizeof(cached));
+
+    if (hit == 1) {
+      ssh_log(session, SSH_LOG_PACKET,
+          "host %s found in the resolver cache (%s)", host, cached);
+      hints.ai_flags |= AI_NUMERICHOST;
+      return getaddrinfo(cached, service, &hints, ai);
+    }
+    if (hit != 0) {
+      ssh_log(session, SSH_LOG_PACKET,
+          "host %s negatively cached in the resolver cache", host);
+      return hit;
+    }
+  }
+#endif
 
-  return getaddrinfo(host, service, &hints, ai);
+  rc = getaddrinfo(host, service, &hints, ai);
+#ifdef HAVE_RESOLVER_CACHE
+  if (!numeric && port != 0) {
+    if (rc == 0) {
+      resolver_cache_store(host, *ai, 0);
+    } else if (rc != EAI_AGAIN && rc != EAI_MEMORY && rc != EAI_SYSTEM) {
+      /* only remember real answers, not transient resolver trouble */
+      resolver_cache_store(host, NULL, rc);
+    }
+  }
+#endif
+
+  return rc;
 }
 
 static int ssh_connect_ai_timeout(ssh_session session, const char *host,
@@ -315,6 +524,81 @@ socket_t ssh_connect_host(ssh_session session, const char *host,
   return s;
 }
 
+/**
+ * @internal
+ *
+ * @brief Resolve a host into a list of addresses suitable for connecting.
+ *
+ * @returns 0 on success, a getaddrinfo() error code otherwise. The list
+ *          must be released with freeaddrinfo().
+ */
+int ssh_connect_ai(ssh_session session, const char *host, int port,
+    struct addrinfo **ai) {
+  return getai(session, host, port, ai);
+}
+
+/**
+ * @internal
+ *
+ * @brief Launches a nonblocking connect to a single resolved address,
+ * optionally bound to bind_addr.
+ *
+ * @returns A file descriptor with a connection in progress,
+ *          SSH_INVALID_SOCKET on error.
+ */
+socket_t ssh_connect_ai_nonblocking(ssh_session session, struct addrinfo *itr,
+    const char *bind_addr) {
+  socket_t s;
+  int rc;
+
+  s = socket(itr->ai_family, itr->ai_socktype, itr->ai_protocol);
+  if (s < 0) {
+    ssh_set_error(session, SSH_FATAL,
+        "Socket create failed: %s", strerror(errno));
+    return SSH_INVALID_SOCKET;
+  }
+
+  if (bind_addr) {
+    struct addrinfo *bind_ai;
+    struct addrinfo *bind_itr;
+
+    ssh_log(session, SSH_LOG_PACKET, "Resolving %s\n", bind_addr);
+
+    rc = getai(session, bind_addr, 0, &bind_ai);
+    if (rc != 0) {
+      ssh_set_error(session, SSH_FATAL,
+          "Failed to resolve bind address %s (%s)",
+          bind_addr,
+          gai_strerror(rc));
+      ssh_connect_socket_close(s);
+      return SSH_INVALID_SOCKET;
+    }
+
+    for (bind_itr = bind_ai; bind_itr != NULL; bind_itr = bind_itr->ai_next) {
+      if (bind(s, bind_itr->ai_addr, bind_itr->ai_addrlen) < 0) {
+        ssh_set_error(session, SSH_FATAL,
+            "Binding local address: %s", strerror(errno));
+        continue;
+      } else {
+        break;
+      }
+    }
+    freeaddrinfo(bind_ai);
+
+    /* Cannot bind to any local addresses */
+    if (bind_itr == NULL) {
+      ssh_connect_socket_close(s);
+      return SSH_INVALID_SOCKET;
+    }
+  }
+
+  ssh_sock_set_nonblocking(s);
+
+  connect(s, itr->ai_addr, itr->ai_addrlen);
+
+  return s;
+}
+
 /**
  * @internal
  *
@@ -342,53 +626,10 @@ socket_t ssh_connect_host_nonblocking(ssh_session session, const char *host,
   }
 
   for (itr = ai; itr != NULL; itr = itr->ai_next){
-    /* create socket */
-    s = socket(itr->ai_family, itr->ai_socktype, itr->ai_protocol);
-    if (s < 0) {
-      ssh_set_error(session, SSH_FATAL,
-          "Socket create failed: %s", strerror(errno));
-      continue;
-    }
-
-    if (bind_addr) {
-      struct addrinfo *bind_ai;
-      struct addrinfo *bind_itr;
-
-      ssh_log(session, SSH_LOG_PACKET, "Resolving %s\n", bind_addr);
-
-      rc = getai(session,bind_addr, 0, &bind_ai);
-      if (rc != 0) {
-        ssh_set_error(session, SSH_FATAL,
-            "Failed to resolve bind address %s (%s)",
-            bind_addr,
-            gai_strerror(rc));
-        close(s);
-        s=-1;
-        break;
-      }
-
-      for (bind_itr = bind_ai; bind_itr != NULL; bind_itr = bind_itr->ai_next) {
-        if (bind(s, bind_itr->ai_addr, bind_itr->ai_addrlen) < 0) {
-          ssh_set_error(session, SSH_FATAL,
-              "Binding local address: %s", strerror(errno));
-          continue;
-        } else {
-          break;
-        }
-      }
-      freeaddrinfo(bind_ai);
-
-      /* Cannot bind to any local addresses */
-      if (bind_itr == NULL) {
-        ssh_connect_socket_close(s);
-        s = -1;
-        continue;
-      }
+    s = ssh_connect_ai_nonblocking(session, itr, bind_addr);
+    if (s != SSH_INVALID_SOCKET) {
+      break;
     }
-    ssh_sock_set_nonblocking(s);
-
-    connect(s, itr->ai_addr, itr->ai_addrlen);
-    break;
   }
 
   freeaddrinfo(ai);
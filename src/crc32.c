@@ -78,8 +78,52 @@ static uint32_t crc_table[] = {
   0x2d02ef8dUL
 };
 
+/*
+ * Derived tables for slicing-by-4: crc_slice[n][i] advances the crc of
+ * byte i by n+1 further zero bytes, letting the loop below consume four
+ * input bytes per step with one table lookup each. Built once from
+ * crc_table, the writes are idempotent so a racy first call is harmless.
+ */
+static uint32_t crc_slice[3][256];
+static int crc_slice_ready;
+
+static void crc_slice_init(void) {
+  uint32_t c;
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    c = crc_table[i];
+    c = crc_table[c & 0xff] ^ (c >> 8);
+    crc_slice[0][i] = c;
+    c = crc_table[c & 0xff] ^ (c >> 8);
+    crc_slice[1][i] = c;
+    c = crc_table[c & 0xff] ^ (c >> 8);
+    crc_slice[2][i] = c;
+  }
+  crc_slice_ready = 1;
+}
+
 uint32_t ssh_crc32(const char *buf, uint32_t len) {
   uint32_t ret = 0;
+  uint32_t word;
+
+  if (!crc_slice_ready) {
+    crc_slice_init();
+  }
+
+  while (len >= 4) {
+    word = (uint32_t) (unsigned char) buf[0] |
+           ((uint32_t) (unsigned char) buf[1] << 8) |
+           ((uint32_t) (unsigned char) buf[2] << 16) |
+           ((uint32_t) (unsigned char) buf[3] << 24);
+    ret ^= word;
+    ret = crc_slice[2][ret & 0xff] ^
+          crc_slice[1][(ret >> 8) & 0xff] ^
+          crc_slice[0][(ret >> 16) & 0xff] ^
+          crc_table[(ret >> 24) & 0xff];
+    len -= 4;
+    buf += 4;
+  }
   while(len > 0) {
     ret = crc_table[(ret ^ *buf) & 0xff] ^ (ret >> 8);
     --len;
@@ -26,6 +26,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #ifndef _WIN32
 #include <arpa/inet.h>
 #endif
@@ -42,6 +46,206 @@
 #include "libssh/crypto.h"
 #include "libssh/buffer.h"
 
+/** @internal
+ * @brief returns the per-session crypt scratch buffer, growing it if the
+ * packet is larger than anything seen before.
+ */
+static void *crypt_scratch_get(ssh_session session, uint32_t len) {
+  struct ssh_crypto_struct *crypto = session->current_crypto;
+  unsigned char *buf;
+
+  if (crypto->crypt_scratch_len >= len) {
+    return crypto->crypt_scratch;
+  }
+  buf = realloc(crypto->crypt_scratch, len);
+  if (buf == NULL) {
+    return NULL;
+  }
+  crypto->crypt_scratch = buf;
+  crypto->crypt_scratch_len = len;
+
+  return buf;
+}
+
+#ifdef HAVE_PTHREAD
+
+/* below this packet size the thread handoff costs more than the MAC;
+ * with the SHA extensions the MAC is several times cheaper per byte, so
+ * the break-even moves up accordingly */
+#define CRYPT_OFFLOAD_MIN_LEN 2048
+#define CRYPT_OFFLOAD_MIN_LEN_SHANI 8192
+
+static uint32_t crypt_offload_min_len(void) {
+  return ssh_digest_accel() ? CRYPT_OFFLOAD_MIN_LEN_SHANI
+                            : CRYPT_OFFLOAD_MIN_LEN;
+}
+
+/** @internal
+ * @brief State of the per-session crypto offload worker.
+ *
+ * packet_encrypt() hands the MAC pass over the plaintext to this thread
+ * and runs the cipher pass itself, overlapping the two expensive
+ * operations of the send path on two cores. At most one job is in
+ * flight; the job fields are owned by the worker while busy is set.
+ */
+struct ssh_crypt_worker_struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  HMACCTX ctx;
+  uint32_t seq;
+  unsigned char *data;
+  uint32_t len;
+  unsigned char *mac;
+  unsigned int *maclen;
+  int busy;
+  int stop;
+};
+
+static void *crypt_worker_loop(void *arg) {
+  struct ssh_crypt_worker_struct *worker = arg;
+
+  pthread_mutex_lock(&worker->lock);
+  for (;;) {
+    while (!worker->busy && !worker->stop) {
+      pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    if (worker->stop) {
+      break;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    hmac_update(worker->ctx, (unsigned char *) &worker->seq,
+        sizeof(uint32_t));
+    hmac_update(worker->ctx, worker->data, worker->len);
+    hmac_final_reset(worker->ctx, worker->mac, worker->maclen);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->busy = 0;
+    pthread_cond_signal(&worker->cond);
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return NULL;
+}
+
+static int crypt_worker_start(ssh_session session) {
+  struct ssh_crypt_worker_struct *worker;
+
+  if (session->crypt_worker != NULL) {
+    return SSH_OK;
+  }
+
+  worker = malloc(sizeof(struct ssh_crypt_worker_struct));
+  if (worker == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(worker);
+  pthread_mutex_init(&worker->lock, NULL);
+  pthread_cond_init(&worker->cond, NULL);
+
+  if (pthread_create(&worker->thread, NULL, crypt_worker_loop, worker) != 0) {
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->cond);
+    SAFE_FREE(worker);
+    ssh_set_error(session, SSH_FATAL,
+        "Failed to start the crypto offload worker");
+    return SSH_ERROR;
+  }
+  session->crypt_worker = worker;
+
+  return SSH_OK;
+}
+
+static void crypt_worker_submit(struct ssh_crypt_worker_struct *worker,
+    HMACCTX ctx, uint32_t seq, void *data, uint32_t len, unsigned char *mac,
+    unsigned int *maclen) {
+  pthread_mutex_lock(&worker->lock);
+  worker->ctx = ctx;
+  worker->seq = seq;
+  worker->data = data;
+  worker->len = len;
+  worker->mac = mac;
+  worker->maclen = maclen;
+  worker->busy = 1;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+static void crypt_worker_join(struct ssh_crypt_worker_struct *worker) {
+  pthread_mutex_lock(&worker->lock);
+  while (worker->busy) {
+    pthread_cond_wait(&worker->cond, &worker->lock);
+  }
+  pthread_mutex_unlock(&worker->lock);
+}
+
+#endif /* HAVE_PTHREAD */
+
+/** @internal
+ * @brief Stop and free the crypto offload worker of a session, if any.
+ */
+void ssh_crypt_worker_stop(ssh_session session) {
+#ifdef HAVE_PTHREAD
+  struct ssh_crypt_worker_struct *worker = session->crypt_worker;
+
+  if (worker == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&worker->lock);
+  worker->stop = 1;
+  pthread_cond_broadcast(&worker->cond);
+  pthread_mutex_unlock(&worker->lock);
+  pthread_join(worker->thread, NULL);
+  pthread_mutex_destroy(&worker->lock);
+  pthread_cond_destroy(&worker->cond);
+  SAFE_FREE(session->crypt_worker);
+#else
+  (void) session;
+#endif
+}
+
+/**
+ * @brief Enable or disable the crypto offload worker of a session.
+ *
+ * When enabled, the MAC of large outgoing packets is computed on a
+ * dedicated thread while the session thread runs the cipher, so the
+ * crypto of one session can use two cores instead of one. The worker
+ * is transparent: no callback or locking is required from the
+ * application.
+ *
+ * @param[in]  session  The ssh session.
+ *
+ * @param[in]  enable   Non-zero to start the worker, 0 to stop it.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the worker could
+ *                      not be started or libssh was built without
+ *                      thread support.
+ */
+int ssh_session_set_crypto_offload(ssh_session session, int enable) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+
+#ifdef HAVE_PTHREAD
+  if (enable) {
+    return crypt_worker_start(session);
+  }
+  ssh_crypt_worker_stop(session);
+
+  return SSH_OK;
+#else
+  if (enable) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "libssh was built without thread support");
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+#endif
+}
+
 uint32_t packet_decrypt_len(ssh_session session, char *crypted){
   uint32_t decrypted;
 
@@ -60,39 +264,68 @@ uint32_t packet_decrypt_len(ssh_session session, char *crypted){
   return ntohl(decrypted);
 }
 
-int packet_decrypt(ssh_session session, void *data,uint32_t len) {
+/* Decrypt len bytes of src into dst, which must not overlap. Writing to a
+ * caller-chosen destination lets the receive path fuse the cipher pass with
+ * the copy into its target buffer. */
+int packet_decrypt_to(ssh_session session, void *dst, const void *src,
+    uint32_t len) {
   struct crypto_struct *crypto = session->current_crypto->in_cipher;
-  char *out = NULL;
+
   if(len % session->current_crypto->in_cipher->blocksize != 0){
     ssh_set_error(session, SSH_FATAL, "Cryptographic functions must be set on at least one blocksize (received %d)",len);
     return SSH_ERROR;
   }
-  out = malloc(len);
-  if (out == NULL) {
-    return -1;
-  }
 
   ssh_log(session,SSH_LOG_PACKET, "Decrypting %d bytes", len);
 
 #ifdef HAVE_LIBGCRYPT
   if (crypto->set_decrypt_key(crypto, session->current_crypto->decryptkey,
         session->current_crypto->decryptIV) < 0) {
-    SAFE_FREE(out);
     return -1;
   }
-  crypto->cbc_decrypt(crypto,data,out,len);
+  crypto->cbc_decrypt(crypto,(void *)src,dst,len);
 #elif defined HAVE_LIBCRYPTO
   if (crypto->set_decrypt_key(crypto, session->current_crypto->decryptkey) < 0) {
-    SAFE_FREE(out);
     return -1;
   }
-  crypto->cbc_decrypt(crypto,data,out,len,session->current_crypto->decryptIV);
+  crypto->cbc_decrypt(crypto,(void *)src,dst,len,session->current_crypto->decryptIV);
 #endif
 
+  session->stats.bytes_decrypted += len;
+
+  return 0;
+}
+
+/** @internal
+ * @brief Decrypt a packet fragment into the crypt scratch buffer and
+ * return it, for packets that get verified and dropped without ever
+ * being materialized in in_buffer.
+ */
+void *packet_decrypt_scratch(ssh_session session, const void *src,
+    uint32_t len) {
+  char *out = crypt_scratch_get(session, len);
+
+  if (out == NULL) {
+    return NULL;
+  }
+  if (packet_decrypt_to(session, out, src, len) < 0) {
+    return NULL;
+  }
+
+  return out;
+}
+
+int packet_decrypt(ssh_session session, void *data,uint32_t len) {
+  char *out = crypt_scratch_get(session, len);
+
+  if (out == NULL) {
+    return -1;
+  }
+  if (packet_decrypt_to(session, out, data, len) < 0) {
+    return -1;
+  }
   memcpy(data,out,len);
-  memset(out,0,len);
 
-  SAFE_FREE(out);
   return 0;
 }
 
@@ -102,70 +335,90 @@ unsigned char *packet_encrypt(ssh_session session, void *data, uint32_t len) {
   char *out = NULL;
   unsigned int finallen;
   uint32_t seq;
+  int offloaded = 0;
 
-  if (!session->current_crypto) {
+  if (!session->out_crypto) {
     return NULL; /* nothing to do here */
   }
-  if(len % session->current_crypto->in_cipher->blocksize != 0){
+  if(len % session->out_crypto->in_cipher->blocksize != 0){
       ssh_set_error(session, SSH_FATAL, "Cryptographic functions must be set on at least one blocksize (received %d)",len);
       return NULL;
   }
-  out = malloc(len);
+  out = crypt_scratch_get(session, len);
   if (out == NULL) {
     return NULL;
   }
 
   seq = ntohl(session->send_seq);
-  crypto = session->current_crypto->out_cipher;
+  crypto = session->out_crypto->out_cipher;
 
   ssh_log(session, SSH_LOG_PACKET, 
       "Encrypting packet with seq num: %d, len: %d",
       session->send_seq,len);
 
 #ifdef HAVE_LIBGCRYPT
-  if (crypto->set_encrypt_key(crypto, session->current_crypto->encryptkey,
-      session->current_crypto->encryptIV) < 0) {
-    SAFE_FREE(out);
+  if (crypto->set_encrypt_key(crypto, session->out_crypto->encryptkey,
+      session->out_crypto->encryptIV) < 0) {
     return NULL;
   }
 #elif defined HAVE_LIBCRYPTO
-  if (crypto->set_encrypt_key(crypto, session->current_crypto->encryptkey) < 0) {
-    SAFE_FREE(out);
+  if (crypto->set_encrypt_key(crypto, session->out_crypto->encryptkey) < 0) {
     return NULL;
   }
 #endif
 
   if (session->version == 2) {
-    ctx = hmac_init(session->current_crypto->encryptMAC,20,HMAC_SHA1);
+    /* the context is keyed once per key exchange and reset per packet */
+    ctx = session->out_crypto->encrypt_mac_ctx;
     if (ctx == NULL) {
-      SAFE_FREE(out);
-      return NULL;
+      ctx = hmac_init(session->out_crypto->encryptMAC,20,HMAC_SHA1);
+      if (ctx == NULL) {
+        return NULL;
+      }
+      session->out_crypto->encrypt_mac_ctx = ctx;
     }
-    hmac_update(ctx,(unsigned char *)&seq,sizeof(uint32_t));
-    hmac_update(ctx,data,len);
-    hmac_final(ctx,session->current_crypto->hmacbuf,&finallen);
-#ifdef DEBUG_CRYPTO
-    ssh_print_hexa("mac: ",data,len);
-    if (finallen != 20) {
-      printf("Final len is %d\n",finallen);
+#ifdef HAVE_PTHREAD
+    if (session->crypt_worker != NULL && len >= crypt_offload_min_len()) {
+      /* the worker reads the plaintext concurrently with the cipher
+       * below; both only read, data is overwritten after the join */
+      crypt_worker_submit(session->crypt_worker, ctx, seq, data, len,
+          session->out_crypto->hmacbuf, &finallen);
+      offloaded = 1;
     }
-    ssh_print_hexa("Packet hmac", session->current_crypto->hmacbuf, 20);
 #endif
+    if (!offloaded) {
+      hmac_update(ctx,(unsigned char *)&seq,sizeof(uint32_t));
+      hmac_update(ctx,data,len);
+      hmac_final_reset(ctx,session->out_crypto->hmacbuf,&finallen);
+#ifdef DEBUG_CRYPTO
+      ssh_print_hexa("mac: ",data,len);
+      if (finallen != 20) {
+        printf("Final len is %d\n",finallen);
+      }
+      ssh_print_hexa("Packet hmac", session->out_crypto->hmacbuf, 20);
+#endif
+    }
   }
 
 #ifdef HAVE_LIBGCRYPT
   crypto->cbc_encrypt(crypto, data, out, len);
 #elif defined HAVE_LIBCRYPTO
   crypto->cbc_encrypt(crypto, data, out, len,
-      session->current_crypto->encryptIV);
+      session->out_crypto->encryptIV);
+#endif
+
+#ifdef HAVE_PTHREAD
+  if (offloaded) {
+    crypt_worker_join(session->crypt_worker);
+  }
 #endif
 
   memcpy(data, out, len);
-  memset(out, 0, len);
-  SAFE_FREE(out);
+
+  session->stats.bytes_encrypted += len;
 
   if (session->version == 2) {
-    return session->current_crypto->hmacbuf;
+    return session->out_crypto->hmacbuf;
   }
 
   return NULL;
@@ -183,23 +436,36 @@ unsigned char *packet_encrypt(ssh_session session, void *data, uint32_t len) {
  * @return              0 if hmac and mac are equal, < 0 if not or an error
  *                      occurred.
  */
-int packet_hmac_verify(ssh_session session, ssh_buffer buffer,
-    unsigned char *mac) {
+/** @internal
+ * @brief packet_hmac_verify() over a packet split in two fragments, so
+ * the early-discard path can verify first block + scratch remainder
+ * without gluing them together first. data2 may be NULL when len2 is 0.
+ */
+int packet_hmac_verify2(ssh_session session, const void *data1, uint32_t len1,
+    const void *data2, uint32_t len2, unsigned char *mac) {
   unsigned char hmacbuf[EVP_MAX_MD_SIZE] = {0};
   HMACCTX ctx;
   unsigned int len;
   uint32_t seq;
 
-  ctx = hmac_init(session->current_crypto->decryptMAC, 20, HMAC_SHA1);
+  /* the context is keyed once per key exchange and reset per packet */
+  ctx = session->current_crypto->decrypt_mac_ctx;
   if (ctx == NULL) {
-    return -1;
+    ctx = hmac_init(session->current_crypto->decryptMAC, 20, HMAC_SHA1);
+    if (ctx == NULL) {
+      return -1;
+    }
+    session->current_crypto->decrypt_mac_ctx = ctx;
   }
 
   seq = htonl(session->recv_seq);
 
   hmac_update(ctx, (unsigned char *) &seq, sizeof(uint32_t));
-  hmac_update(ctx, buffer_get_rest(buffer), buffer_get_rest_len(buffer));
-  hmac_final(ctx, hmacbuf, &len);
+  hmac_update(ctx, data1, len1);
+  if (len2 > 0) {
+    hmac_update(ctx, data2, len2);
+  }
+  hmac_final_reset(ctx, hmacbuf, &len);
 
 #ifdef DEBUG_CRYPTO
   ssh_print_hexa("received mac",mac,len);
@@ -213,4 +479,10 @@ int packet_hmac_verify(ssh_session session, ssh_buffer buffer,
   return -1;
 }
 
+int packet_hmac_verify(ssh_session session, ssh_buffer buffer,
+    unsigned char *mac) {
+  return packet_hmac_verify2(session, buffer_get_rest(buffer),
+      buffer_get_rest_len(buffer), NULL, 0, mac);
+}
+
 /* vim: set ts=2 sw=2 et cindent: */
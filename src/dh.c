@@ -82,8 +82,94 @@ static unsigned long g_int = 2 ;	/* G is defined as 2 by the ssh2 standards */
 static bignum g;
 static bignum p;
 static int ssh_crypto_initialized;
+static int ssh_crypto_backend_initialized;
 
-int ssh_get_random(void *where, int len, int strong){
+/*
+ * Precomputed client keypair. The modular exponentiation for e = g^x mod p
+ * is the big CPU cost of a client key exchange and used to run at connect
+ * time. ssh_dh_precompute() computes one (x, e) pair ahead of time - it is
+ * called when a client session is released, so reconnect storms pay the
+ * modexp after tearing down the previous connection instead of while
+ * establishing the next one. dh_generate_x() pops the pair when available.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_DH_PRECOMPUTE
+#endif
+
+#ifdef HAVE_DH_PRECOMPUTE
+static __thread bignum dh_precomputed_x;
+static __thread bignum dh_precomputed_e;
+#endif
+
+/** @internal
+ * @brief Computes a (x, e) keypair for a later client key exchange on the
+ * same thread. Does nothing when a pair is already waiting.
+ */
+void ssh_dh_precompute(void) {
+#ifdef HAVE_DH_PRECOMPUTE
+  bignum x;
+  bignum e;
+#ifdef HAVE_LIBCRYPTO
+  bignum_CTX ctx;
+#endif
+
+  if (ssh_crypto_initialized == 0 || dh_precomputed_x != NULL) {
+    return;
+  }
+
+  x = bignum_new();
+  if (x == NULL) {
+    return;
+  }
+  e = bignum_new();
+  if (e == NULL) {
+    bignum_free(x);
+    return;
+  }
+
+#ifdef HAVE_LIBGCRYPT
+  bignum_rand(x, 128);
+  bignum_mod_exp(e, g, x, p);
+#elif defined HAVE_LIBCRYPTO
+  ctx = bignum_ctx_new();
+  if (ctx == NULL) {
+    bignum_free(x);
+    bignum_free(e);
+    return;
+  }
+  bignum_rand(x, 128, 0, -1);
+  bignum_mod_exp(e, g, x, p, ctx);
+  bignum_ctx_free(ctx);
+#endif
+
+  dh_precomputed_x = x;
+  dh_precomputed_e = e;
+#endif
+}
+
+/** @internal
+ * @brief Releases the precomputed keypair of the calling thread.
+ */
+void ssh_dh_precompute_flush(void) {
+#ifdef HAVE_DH_PRECOMPUTE
+  if (dh_precomputed_x != NULL) {
+    bignum_free(dh_precomputed_x);
+    dh_precomputed_x = NULL;
+  }
+  if (dh_precomputed_e != NULL) {
+    bignum_free(dh_precomputed_e);
+    dh_precomputed_e = NULL;
+  }
+#endif
+}
+
+static int ssh_get_random_direct(void *where, int len, int strong){
+  /* RNG is the first backend service short-lived processes touch; make
+   * sure the backend globals exist without paying for the DH constants
+   * or the cipher tables (see ssh_crypto_init()) */
+  if (ssh_crypto_backend_init() < 0) {
+    return 0;
+  }
 
 #ifdef HAVE_LIBGCRYPT
   /* variable not used in gcrypt */
@@ -105,19 +191,95 @@ int ssh_get_random(void *where, int len, int strong){
 }
 
 /*
- * This inits the values g and p which are used for DH key agreement
- * FIXME: Make the function thread safe by adding a semaphore or mutex.
+ * Weak randomness (padding, cookies) is requested a few bytes at a time
+ * but every request takes the backend's global RNG lock, which contends
+ * under threaded load. Each thread keeps a buffer filled by one backend
+ * call and serves small weak requests from it with a memcpy; bytes are
+ * erased as they are handed out so the buffer never holds output that
+ * was already used. Strong requests (key material) always go straight
+ * to the backend.
  */
-int ssh_crypto_init(void) {
-  if (ssh_crypto_initialized == 0) {
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_RANDOM_BUFFER
+#endif
+
+#ifdef HAVE_RANDOM_BUFFER
+#define RANDOM_BUFFER_SIZE 4096
+static __thread unsigned char random_buffer[RANDOM_BUFFER_SIZE];
+static __thread int random_buffer_left;
+#endif
+
+int ssh_get_random(void *where, int len, int strong){
+#ifdef HAVE_RANDOM_BUFFER
+  if (!strong && len > 0 && len <= RANDOM_BUFFER_SIZE / 4) {
+    if (random_buffer_left < len) {
+      if (ssh_get_random_direct(random_buffer, RANDOM_BUFFER_SIZE, 0) != 1) {
+        return ssh_get_random_direct(where, len, strong);
+      }
+      random_buffer_left = RANDOM_BUFFER_SIZE;
+    }
+    random_buffer_left -= len;
+    memcpy(where, random_buffer + random_buffer_left, len);
+    ssh_burn(random_buffer + random_buffer_left, len);
+
+    return 1;
+  }
+#endif
+
+  return ssh_get_random_direct(where, len, strong);
+}
+
+/** @internal
+ * @brief Brings up the crypto backend globals (secure memory, hardware
+ * feature selection) without the DH constants or the cipher tables.
+ *
+ * This is the part of ssh_crypto_init() that random number generation
+ * depends on; it is split out so that ssh_init_minimal() users pay for
+ * it on first random need instead of at startup. Idempotent.
+ */
+int ssh_crypto_backend_init(void) {
+  if (ssh_crypto_backend_initialized == 0) {
 #ifdef HAVE_LIBGCRYPT
+    if (getenv("SSH_FORCE_SOFT_CRYPTO") != NULL) {
+      /* benchmarking aid: pin the backend to its generic code, see
+       * ssh_get_cpu_features() */
+#ifdef GCRYCTL_DISABLE_HWF
+      gcry_control(GCRYCTL_DISABLE_HWF, "intel-aesni", NULL);
+      gcry_control(GCRYCTL_DISABLE_HWF, "intel-pclmul", NULL);
+      gcry_control(GCRYCTL_DISABLE_HWF, "intel-avx2", NULL);
+      gcry_control(GCRYCTL_DISABLE_HWF, "intel-shaext", NULL);
+      gcry_control(GCRYCTL_DISABLE_HWF, "arm-neon", NULL);
+#endif
+    }
     gcry_check_version(NULL);
     if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P,0)) {
       gcry_control(GCRYCTL_INIT_SECMEM, 4096);
       gcry_control(GCRYCTL_INITIALIZATION_FINISHED,0);
     }
+#elif defined HAVE_LIBCRYPTO
+    if (getenv("SSH_FORCE_SOFT_CRYPTO") != NULL) {
+      /* the mask OpenSSL documents for switching off AES-NI and
+       * PCLMUL, applied before the cipher tables are set up */
+      setenv("OPENSSL_ia32cap", "~0x200000200000000", 0);
+    }
 #endif
 
+    ssh_crypto_backend_initialized = 1;
+  }
+
+  return 0;
+}
+
+/*
+ * This inits the values g and p which are used for DH key agreement
+ * FIXME: Make the function thread safe by adding a semaphore or mutex.
+ */
+int ssh_crypto_init(void) {
+  if (ssh_crypto_initialized == 0) {
+    if (ssh_crypto_backend_init() < 0) {
+      return -1;
+    }
+
     g = bignum_new();
     if (g == NULL) {
       return -1;
@@ -140,7 +302,6 @@ int ssh_crypto_init(void) {
     }
     bignum_bin2bn(p_value, P_LEN, p);
     OpenSSL_add_all_algorithms();
-
 #endif
 
     ssh_crypto_initialized = 1;
@@ -155,14 +316,18 @@ void ssh_crypto_finalize(void) {
     g = NULL;
     bignum_free(p);
     p = NULL;
-#ifdef HAVE_LIBGCRYPT
-    gcry_control(GCRYCTL_TERM_SECMEM);
-#elif defined HAVE_LIBCRYPTO
+#ifdef HAVE_LIBCRYPTO
     EVP_cleanup();
     CRYPTO_cleanup_all_ex_data();
 #endif
     ssh_crypto_initialized=0;
   }
+  if (ssh_crypto_backend_initialized) {
+#ifdef HAVE_LIBGCRYPT
+    gcry_control(GCRYCTL_TERM_SECMEM);
+#endif
+    ssh_crypto_backend_initialized = 0;
+  }
 }
 
 /* prints the bignum on stderr */
@@ -190,7 +355,9 @@ void ssh_print_bignum(const char *which, bignum num) {
  * @return              The hex string or NULL on error.
  */
 char *ssh_get_hexa(const unsigned char *what, size_t len) {
+  static const char tab[] = "0123456789abcdef";
   char *hexa = NULL;
+  char *out;
   size_t i;
 
   hexa = malloc(len * 3 + 1);
@@ -198,15 +365,18 @@ char *ssh_get_hexa(const unsigned char *what, size_t len) {
     return NULL;
   }
 
-  ZERO_STRUCTP(hexa);
-
+  /* two table lookups per byte; the snprintf/strcat version this
+   * replaces was quadratic on top of the per-byte formatting cost */
+  out = hexa;
   for (i = 0; i < len; i++) {
-    char hex[4];
-    snprintf(hex, sizeof(hex), "%02x:", what[i]);
-    strcat(hexa, hex);
+    *out++ = tab[what[i] >> 4];
+    *out++ = tab[what[i] & 0x0f];
+    *out++ = ':';
   }
-
-  hexa[(len * 3) - 1] = '\0';
+  if (len > 0) {
+    out--;
+  }
+  *out = '\0';
 
   return hexa;
 }
@@ -232,6 +402,22 @@ void ssh_print_hexa(const char *descr, const unsigned char *what, size_t len) {
 }
 
 int dh_generate_x(ssh_session session) {
+  /* first key exchange step on the client; catches up on the crypto
+   * initialization an ssh_init_minimal() caller skipped */
+  if (ssh_crypto_init() < 0) {
+    return -1;
+  }
+#ifdef HAVE_DH_PRECOMPUTE
+  if (dh_precomputed_x != NULL) {
+    /* adopt the pair prepared by ssh_dh_precompute(), dh_generate_e()
+     * then has nothing left to do */
+    session->next_crypto->x = dh_precomputed_x;
+    session->next_crypto->e = dh_precomputed_e;
+    dh_precomputed_x = NULL;
+    dh_precomputed_e = NULL;
+    return 0;
+  }
+#endif
   session->next_crypto->x = bignum_new();
   if (session->next_crypto->x == NULL) {
     return -1;
@@ -253,7 +439,11 @@ int dh_generate_x(ssh_session session) {
 
 /* used by server */
 int dh_generate_y(ssh_session session) {
-    session->next_crypto->y = bignum_new();
+  if (ssh_crypto_init() < 0) {
+    return -1;
+  }
+
+  session->next_crypto->y = bignum_new();
   if (session->next_crypto->y == NULL) {
     return -1;
   }
@@ -275,7 +465,18 @@ int dh_generate_y(ssh_session session) {
 /* used by server */
 int dh_generate_e(ssh_session session) {
 #ifdef HAVE_LIBCRYPTO
-  bignum_CTX ctx = bignum_ctx_new();
+  bignum_CTX ctx;
+#endif
+
+#ifdef HAVE_DH_PRECOMPUTE
+  if (session->next_crypto->e != NULL) {
+    /* already popped together with x from the precomputed pair */
+    return 0;
+  }
+#endif
+
+#ifdef HAVE_LIBCRYPTO
+  ctx = bignum_ctx_new();
   if (ctx == NULL) {
     return -1;
   }
@@ -354,12 +555,10 @@ ssh_string make_bignum_string(bignum num) {
 #ifdef DEBUG_CRYPTO
   fprintf(stderr, "%d bits, %d bytes, %d padding\n", bits, len, pad);
 #endif /* DEBUG_CRYPTO */
-/* TODO: fix that crap !! */
-  ptr = malloc(4 + len + pad);
+  ptr = ssh_string_new(len + pad);
   if (ptr == NULL) {
     return NULL;
   }
-  ptr->size = htonl(len + pad);
   if (pad) {
     ptr->string[0] = 0;
   }
@@ -489,7 +688,6 @@ static void sha_add(ssh_string str,SHACTX ctx){
 */
 
 int make_sessionid(ssh_session session) {
-  SHACTX ctx;
   ssh_string num = NULL;
   ssh_string str = NULL;
   ssh_buffer server_hash = NULL;
@@ -500,11 +698,6 @@ int make_sessionid(ssh_session session) {
 
   enter_function();
 
-  ctx = sha1_init();
-  if (ctx == NULL) {
-    return rc;
-  }
-
   buf = ssh_buffer_new();
   if (buf == NULL) {
     return rc;
@@ -573,28 +766,49 @@ int make_sessionid(ssh_session session) {
     goto error;
   }
 
-  num = make_bignum_string(session->next_crypto->e);
-  if (num == NULL) {
-    goto error;
-  }
+#ifdef HAVE_ECC
+  if (session->next_crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+    /* ECDH hashes Q_C and Q_S where the classic DH hashes e and f */
+    if (session->next_crypto->ecdh_client_pubkey == NULL ||
+        session->next_crypto->ecdh_server_pubkey == NULL) {
+      goto error;
+    }
+    if (buffer_add_ssh_string(buf,
+          session->next_crypto->ecdh_client_pubkey) < 0) {
+      goto error;
+    }
+    if (buffer_add_ssh_string(buf,
+          session->next_crypto->ecdh_server_pubkey) < 0) {
+      goto error;
+    }
+  } else
+#endif
+  {
+    num = make_bignum_string(session->next_crypto->e);
+    if (num == NULL) {
+      goto error;
+    }
 
-  len = ssh_string_len(num) + 4;
-  if (buffer_add_data(buf, num, len) < 0) {
-    goto error;
-  }
+    len = ssh_string_len(num) + 4;
+    if (buffer_add_data(buf, num, len) < 0) {
+      goto error;
+    }
 
-  ssh_string_free(num);
-  num = make_bignum_string(session->next_crypto->f);
-  if (num == NULL) {
-    goto error;
-  }
+    ssh_string_free(num);
+    num = make_bignum_string(session->next_crypto->f);
+    if (num == NULL) {
+      goto error;
+    }
 
-  len = ssh_string_len(num) + 4;
-  if (buffer_add_data(buf, num, len) < 0) {
-    goto error;
+    len = ssh_string_len(num) + 4;
+    if (buffer_add_data(buf, num, len) < 0) {
+      goto error;
+    }
+
+    ssh_string_free(num);
+    num = NULL;
   }
 
-  ssh_string_free(num);
   num = make_bignum_string(session->next_crypto->k);
   if (num == NULL) {
     goto error;
@@ -609,14 +823,41 @@ int make_sessionid(ssh_session session) {
   ssh_print_hexa("hash buffer", ssh_buffer_get_begin(buf), ssh_buffer_get_len(buf));
 #endif
 
-  sha1_update(ctx, buffer_get_rest(buf), buffer_get_rest_len(buf));
-  sha1_final(session->next_crypto->session_id, ctx);
+#ifdef HAVE_ECC
+  if (session->next_crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+    SHA256CTX ctx = sha256_init();
+    if (ctx == NULL) {
+      goto error;
+    }
+    session->next_crypto->digest_len = SHA256_DIGEST_LEN;
+    sha256_update(ctx, buffer_get_rest(buf), buffer_get_rest_len(buf));
+    sha256_final(session->next_crypto->session_id, ctx);
+  } else
+#endif
+  {
+    SHACTX ctx = sha1_init();
+    if (ctx == NULL) {
+      goto error;
+    }
+    session->next_crypto->digest_len = SHA_DIGEST_LEN;
+    sha1_update(ctx, buffer_get_rest(buf), buffer_get_rest_len(buf));
+    sha1_final(session->next_crypto->session_id, ctx);
+  }
 
 #ifdef DEBUG_CRYPTO
   printf("Session hash: ");
-  ssh_print_hexa("session id", session->next_crypto->session_id, SHA_DIGEST_LEN);
+  ssh_print_hexa("session id", session->next_crypto->session_id,
+      session->next_crypto->digest_len);
 #endif
 
+  if (session->first_session_id_len == 0) {
+    /* the first exchange hash stays the session identifier for the
+     * whole connection, later rekeys derive their keys from it */
+    memcpy(session->first_session_id, session->next_crypto->session_id,
+        session->next_crypto->digest_len);
+    session->first_session_id_len = session->next_crypto->digest_len;
+  }
+
   rc = SSH_OK;
 error:
   ssh_buffer_free(buf);
@@ -680,29 +921,86 @@ int hashbufin_add_cookie(ssh_session session, unsigned char *cookie) {
   return 0;
 }
 
+/* the hash input is K || H || letter || session_id (RFC 4253 section
+ * 7.2); H is the exchange hash of this key exchange while session_id
+ * is the exchange hash of the first one, they differ after a rekey */
 static int generate_one_key(ssh_string k,
-    unsigned char session_id[SHA_DIGEST_LEN],
-    unsigned char output[SHA_DIGEST_LEN],
-    char letter) {
-  SHACTX ctx = NULL;
+    struct ssh_crypto_struct *crypto,
+    unsigned char *output,
+    char letter,
+    const unsigned char *session_id,
+    uint32_t session_id_len) {
+#ifdef HAVE_ECC
+  if (crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+    SHA256CTX ctx = sha256_init();
+    if (ctx == NULL) {
+      return -1;
+    }
 
-  ctx = sha1_init();
-  if (ctx == NULL) {
-    return -1;
+    sha256_update(ctx, k, ssh_string_len(k) + 4);
+    sha256_update(ctx, crypto->session_id, crypto->digest_len);
+    sha256_update(ctx, &letter, 1);
+    sha256_update(ctx, session_id, session_id_len);
+    sha256_final(output, ctx);
+
+    return 0;
   }
+#endif
+  {
+    SHACTX ctx = sha1_init();
+    if (ctx == NULL) {
+      return -1;
+    }
 
-  sha1_update(ctx, k, ssh_string_len(k) + 4);
-  sha1_update(ctx, session_id, SHA_DIGEST_LEN);
-  sha1_update(ctx, &letter, 1);
-  sha1_update(ctx, session_id, SHA_DIGEST_LEN);
-  sha1_final(output, ctx);
+    sha1_update(ctx, k, ssh_string_len(k) + 4);
+    sha1_update(ctx, crypto->session_id, crypto->digest_len);
+    sha1_update(ctx, &letter, 1);
+    sha1_update(ctx, session_id, session_id_len);
+    sha1_final(output, ctx);
+  }
+
+  return 0;
+}
+
+/* extends a cipher key that needs more bytes than one digest provides */
+static int generate_key_extension(ssh_string k,
+    struct ssh_crypto_struct *crypto,
+    unsigned char *key) {
+#ifdef HAVE_ECC
+  if (crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+    SHA256CTX ctx = sha256_init();
+    if (ctx == NULL) {
+      return -1;
+    }
+
+    sha256_update(ctx, k, ssh_string_len(k) + 4);
+    sha256_update(ctx, crypto->session_id, crypto->digest_len);
+    sha256_update(ctx, key, crypto->digest_len);
+    sha256_final(key + crypto->digest_len, ctx);
+
+    return 0;
+  }
+#endif
+  {
+    SHACTX ctx = sha1_init();
+    if (ctx == NULL) {
+      return -1;
+    }
+
+    sha1_update(ctx, k, ssh_string_len(k) + 4);
+    sha1_update(ctx, crypto->session_id, crypto->digest_len);
+    sha1_update(ctx, key, crypto->digest_len);
+    sha1_final(key + crypto->digest_len, ctx);
+  }
 
   return 0;
 }
 
 int generate_session_keys(ssh_session session) {
   ssh_string k_string = NULL;
-  SHACTX ctx = NULL;
+  struct ssh_crypto_struct *crypto = session->next_crypto;
+  const unsigned char *sid = session->first_session_id;
+  uint32_t sid_len = session->first_session_id_len;
   int rc = -1;
 
   enter_function();
@@ -714,80 +1012,61 @@ int generate_session_keys(ssh_session session) {
 
   /* IV */
   if (session->client) {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->encryptIV, 'A') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->encryptIV, 'A', sid, sid_len) < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->decryptIV, 'B') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->decryptIV, 'B', sid, sid_len) < 0) {
       goto error;
     }
   } else {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->decryptIV, 'A') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->decryptIV, 'A', sid, sid_len) < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->encryptIV, 'B') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->encryptIV, 'B', sid, sid_len) < 0) {
       goto error;
     }
   }
   if (session->client) {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->encryptkey, 'C') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->encryptkey, 'C', sid, sid_len) < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->decryptkey, 'D') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->decryptkey, 'D', sid, sid_len) < 0) {
       goto error;
     }
   } else {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->decryptkey, 'C') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->decryptkey, 'C', sid, sid_len) < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->encryptkey, 'D') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->encryptkey, 'D', sid, sid_len) < 0) {
       goto error;
     }
   }
 
-  /* some ciphers need more than 20 bytes of input key */
+  /* some ciphers need more than one digest of input key */
   /* XXX verify it's ok for server implementation */
-  if (session->next_crypto->out_cipher->keysize > SHA_DIGEST_LEN * 8) {
-    ctx = sha1_init();
-    if (ctx == NULL) {
+  if (crypto->out_cipher->keysize > crypto->digest_len * 8) {
+    if (generate_key_extension(k_string, crypto, crypto->encryptkey) < 0) {
       goto error;
     }
-    sha1_update(ctx, k_string, ssh_string_len(k_string) + 4);
-    sha1_update(ctx, session->next_crypto->session_id, SHA_DIGEST_LEN);
-    sha1_update(ctx, session->next_crypto->encryptkey, SHA_DIGEST_LEN);
-    sha1_final(session->next_crypto->encryptkey + SHA_DIGEST_LEN, ctx);
   }
 
-  if (session->next_crypto->in_cipher->keysize > SHA_DIGEST_LEN * 8) {
-    ctx = sha1_init();
-    sha1_update(ctx, k_string, ssh_string_len(k_string) + 4);
-    sha1_update(ctx, session->next_crypto->session_id, SHA_DIGEST_LEN);
-    sha1_update(ctx, session->next_crypto->decryptkey, SHA_DIGEST_LEN);
-    sha1_final(session->next_crypto->decryptkey + SHA_DIGEST_LEN, ctx);
+  if (crypto->in_cipher->keysize > crypto->digest_len * 8) {
+    if (generate_key_extension(k_string, crypto, crypto->decryptkey) < 0) {
+      goto error;
+    }
   }
   if(session->client) {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->encryptMAC, 'E') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->encryptMAC, 'E', sid, sid_len) < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->decryptMAC, 'F') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->decryptMAC, 'F', sid, sid_len) < 0) {
       goto error;
     }
   } else {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->decryptMAC, 'E') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->decryptMAC, 'E', sid, sid_len) < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
-          session->next_crypto->encryptMAC, 'F') < 0) {
+    if (generate_one_key(k_string, crypto, crypto->encryptMAC, 'F', sid, sid_len) < 0) {
       goto error;
     }
   }
@@ -835,6 +1114,7 @@ error:
  * @see ssh_print_hexa()
  */
 int ssh_get_pubkey_hash(ssh_session session, unsigned char **hash) {
+  struct ssh_crypto_struct *crypto;
   ssh_string pubkey;
   MD5CTX ctx;
   unsigned char *h;
@@ -843,27 +1123,34 @@ int ssh_get_pubkey_hash(ssh_session session, unsigned char **hash) {
     return SSH_ERROR;
   }
   *hash = NULL;
-  if (session->current_crypto == NULL ||
-      session->current_crypto->server_pubkey == NULL){
+  crypto = session->current_crypto;
+  if (crypto == NULL || crypto->server_pubkey == NULL){
     ssh_set_error(session,SSH_FATAL,"No current cryptographic context");
     return SSH_ERROR;
   }
 
-  h = malloc(sizeof(unsigned char *) * MD5_DIGEST_LEN);
+  h = malloc(MD5_DIGEST_LEN);
   if (h == NULL) {
     return SSH_ERROR;
   }
 
-  ctx = md5_init();
-  if (ctx == NULL) {
-    SAFE_FREE(h);
-    return SSH_ERROR;
-  }
+  /* the digest only depends on the key blob, which is fixed for the
+   * lifetime of the crypto context; callers fingerprinting every
+   * connection for audit logs hit the cached copy */
+  if (!crypto->server_pubkey_hash_valid) {
+    ctx = md5_init();
+    if (ctx == NULL) {
+      SAFE_FREE(h);
+      return SSH_ERROR;
+    }
 
-  pubkey = session->current_crypto->server_pubkey;
+    pubkey = crypto->server_pubkey;
 
-  md5_update(ctx, pubkey->string, ssh_string_len(pubkey));
-  md5_final(h, ctx);
+    md5_update(ctx, pubkey->string, ssh_string_len(pubkey));
+    md5_final(crypto->server_pubkey_hash, ctx);
+    crypto->server_pubkey_hash_valid = 1;
+  }
+  memcpy(h, crypto->server_pubkey_hash, MD5_DIGEST_LEN);
 
   *hash = h;
 
@@ -1004,6 +1291,27 @@ int sig_verify(ssh_session session, ssh_public_key pubkey,
 #endif
       ssh_set_error(session, SSH_FATAL, "Invalid RSA signature");
       return -1;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      {
+        unsigned char ehash[SHA256_DIGEST_LEN] = {0};
+
+        /* ecdsa-sha2-nistp256 hashes the signed data with SHA-256 */
+        sha256(digest, size, ehash);
+        valid = ECDSA_do_verify(ehash, SHA256_DIGEST_LEN,
+            signature->ecdsa_sign, pubkey->ecdsa_pub);
+        if (valid == 1) {
+          return 0;
+        }
+        if (valid == -1) {
+          ssh_set_error(session, SSH_FATAL,
+              "ECDSA error: %s", ERR_error_string(ERR_get_error(), NULL));
+          return -1;
+        }
+      }
+      ssh_set_error(session, SSH_FATAL, "Invalid ECDSA signature");
+      return -1;
+#endif
     default:
       ssh_set_error(session, SSH_FATAL, "Unknown public key type");
       return -1;
@@ -1048,7 +1356,8 @@ int signature_verify(ssh_session session, ssh_string signature) {
       "Going to verify a %s type signature", pubkey->type_c);
 
   err = sig_verify(session,pubkey,sign,
-                            session->next_crypto->session_id,SHA_DIGEST_LEN);
+                            session->next_crypto->session_id,
+                            session->next_crypto->digest_len);
   signature_free(sign);
   session->next_crypto->server_pubkey_type = pubkey->type_c;
   publickey_free(pubkey);
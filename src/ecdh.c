@@ -0,0 +1,368 @@
+/*
+ * ecdh.c - Elliptic curve diffie-hellman key exchange
+ *
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2011 by Aris Adamantiadis
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "libssh/priv.h"
+#include "libssh/ssh2.h"
+#include "libssh/buffer.h"
+#include "libssh/channels.h"
+#include "libssh/crypto.h"
+#include "libssh/dh.h"
+#include "libssh/ecdh.h"
+#include "libssh/keys.h"
+#include "libssh/packet.h"
+#include "libssh/session.h"
+#include "libssh/string.h"
+
+#ifdef HAVE_ECC
+
+#include <openssl/ecdh.h>
+#include <openssl/objects.h>
+
+/* only ecdh-sha2-nistp256 is negotiated for now */
+#define ECDH_NID NID_X9_62_prime256v1
+
+/* exports an EC public point in the uncompressed octet format the SSH
+ * protocol requires */
+static ssh_string ecdh_pubkey_to_string(const EC_KEY *key) {
+  const EC_GROUP *group = EC_KEY_get0_group(key);
+  const EC_POINT *point = EC_KEY_get0_public_key(key);
+  ssh_string pubkey = NULL;
+  size_t len;
+
+  len = EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+      NULL, 0, NULL);
+  if (len == 0) {
+    return NULL;
+  }
+
+  pubkey = ssh_string_new(len);
+  if (pubkey == NULL) {
+    return NULL;
+  }
+
+  if (EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+        ssh_string_data(pubkey), len, NULL) != len) {
+    ssh_string_free(pubkey);
+    return NULL;
+  }
+
+  return pubkey;
+}
+
+/* computes the shared secret from our private key and the peer public
+ * point, and stores it as the usual mpint k */
+static int ecdh_build_k(ssh_session session) {
+  const EC_GROUP *group;
+  EC_POINT *peer = NULL;
+  ssh_string peer_pubkey = NULL;
+  unsigned char *secret = NULL;
+  int len;
+  int rc = -1;
+
+  if (session->next_crypto->ecdh_privkey == NULL) {
+    return -1;
+  }
+  group = EC_KEY_get0_group(session->next_crypto->ecdh_privkey);
+
+  if (session->client) {
+    peer_pubkey = session->next_crypto->ecdh_server_pubkey;
+  } else {
+    peer_pubkey = session->next_crypto->ecdh_client_pubkey;
+  }
+  if (peer_pubkey == NULL) {
+    return -1;
+  }
+
+  peer = EC_POINT_new(group);
+  if (peer == NULL) {
+    return -1;
+  }
+
+  if (EC_POINT_oct2point(group, peer, ssh_string_data(peer_pubkey),
+        ssh_string_len(peer_pubkey), NULL) != 1) {
+    goto error;
+  }
+
+  len = (EC_GROUP_get_degree(group) + 7) / 8;
+  secret = malloc(len);
+  if (secret == NULL) {
+    goto error;
+  }
+
+  if (ECDH_compute_key(secret, len, peer,
+        session->next_crypto->ecdh_privkey, NULL) != len) {
+    goto error;
+  }
+
+  session->next_crypto->k = BN_bin2bn(secret, len, NULL);
+  if (session->next_crypto->k == NULL) {
+    goto error;
+  }
+
+#ifdef DEBUG_CRYPTO
+  ssh_print_bignum("Shared secret key", session->next_crypto->k);
+#endif
+
+  rc = 0;
+error:
+  if (secret != NULL) {
+    memset(secret, 0, len);
+    SAFE_FREE(secret);
+  }
+  EC_POINT_clear_free(peer);
+  EC_KEY_free(session->next_crypto->ecdh_privkey);
+  session->next_crypto->ecdh_privkey = NULL;
+
+  return rc;
+}
+
+/** @internal
+ * @brief Starts the ecdh-sha2-nistp256 key exchange: generates the client
+ * keypair and sends SSH_MSG_KEX_ECDH_INIT with the client public point.
+ */
+int ssh_client_ecdh_init(ssh_session session) {
+  EC_KEY *key = NULL;
+  ssh_string client_pubkey = NULL;
+  int rc;
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEX_ECDH_INIT) < 0) {
+    return SSH_ERROR;
+  }
+
+  key = EC_KEY_new_by_curve_name(ECDH_NID);
+  if (key == NULL) {
+    return SSH_ERROR;
+  }
+  if (EC_KEY_generate_key(key) != 1) {
+    EC_KEY_free(key);
+    return SSH_ERROR;
+  }
+
+  client_pubkey = ecdh_pubkey_to_string(key);
+  if (client_pubkey == NULL) {
+    EC_KEY_free(key);
+    return SSH_ERROR;
+  }
+
+  if (buffer_add_ssh_string(session->out_buffer, client_pubkey) < 0) {
+    EC_KEY_free(key);
+    ssh_string_free(client_pubkey);
+    return SSH_ERROR;
+  }
+
+  session->next_crypto->ecdh_privkey = key;
+  session->next_crypto->ecdh_client_pubkey = client_pubkey;
+
+  rc = packet_send(session);
+
+  return rc;
+}
+
+/** @internal
+ * @brief Handles a SSH_MSG_KEX_ECDH_REPLY on the client side: imports the
+ * server public point, computes the shared secret and sends
+ * SSH_MSG_NEWKEYS.
+ */
+int ssh_client_ecdh_reply(ssh_session session, ssh_buffer packet) {
+  ssh_string hostkey = NULL;
+  ssh_string q_s = NULL;
+  ssh_string signature = NULL;
+
+  hostkey = buffer_get_ssh_string(packet);
+  if (hostkey == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No public key in packet");
+    return SSH_ERROR;
+  }
+  dh_import_pubkey(session, hostkey);
+
+  q_s = buffer_get_ssh_string(packet);
+  if (q_s == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No Q_S ECC point in packet");
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_server_pubkey = q_s;
+
+  signature = buffer_get_ssh_string(packet);
+  if (signature == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No signature in packet");
+    return SSH_ERROR;
+  }
+  session->dh_server_signature = signature;
+
+  if (ecdh_build_k(session) < 0) {
+    ssh_set_error(session, SSH_FATAL, "Cannot build k number");
+    return SSH_ERROR;
+  }
+
+  /* during a rekey the keys are derived now so the outbound direction can
+   * switch right behind our NEWKEYS, see ssh_packet_dh_reply() */
+  if (session->rekeying) {
+    if (make_sessionid(session) != SSH_OK ||
+        crypt_set_algorithms(session) != 0 ||
+        generate_session_keys(session) < 0) {
+      return SSH_ERROR;
+    }
+  }
+
+  /* Send the MSG_NEWKEYS */
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_NEWKEYS) < 0) {
+    return SSH_ERROR;
+  }
+
+  if (packet_send(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  ssh_log(session, SSH_LOG_PROTOCOL, "SSH_MSG_NEWKEYS sent");
+
+  if (session->rekeying && session->next_crypto->out_cipher != NULL) {
+    session->out_crypto = session->next_crypto;
+    ssh_log(session, SSH_LOG_PROTOCOL,
+        "Outbound direction switched to the new keys");
+    channel_sched_flush(session);
+  }
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief Handles a SSH_MSG_KEX_ECDH_INIT on the server side: imports the
+ * client public point, computes the shared secret, signs the session id and
+ * sends SSH_MSG_KEX_ECDH_REPLY followed by SSH_MSG_NEWKEYS.
+ */
+int ssh_server_ecdh_init(ssh_session session, ssh_buffer packet) {
+  EC_KEY *key = NULL;
+  ssh_string q_c = NULL;
+  ssh_string q_s = NULL;
+  ssh_string pubkey = NULL;
+  ssh_string sign = NULL;
+  ssh_public_key pub = NULL;
+  ssh_private_key prv = NULL;
+
+  q_c = buffer_get_ssh_string(packet);
+  if (q_c == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No Q_C ECC point in packet");
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_client_pubkey = q_c;
+
+  key = EC_KEY_new_by_curve_name(ECDH_NID);
+  if (key == NULL) {
+    return SSH_ERROR;
+  }
+  if (EC_KEY_generate_key(key) != 1) {
+    EC_KEY_free(key);
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_privkey = key;
+
+  q_s = ecdh_pubkey_to_string(key);
+  if (q_s == NULL) {
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_server_pubkey = q_s;
+
+  switch(session->hostkeys) {
+    case SSH_KEYTYPE_DSS:
+      prv = session->dsa_key;
+      break;
+    case SSH_KEYTYPE_RSA:
+      prv = session->rsa_key;
+      break;
+    default:
+      prv = NULL;
+  }
+
+  pub = publickey_from_privatekey(prv);
+  if (pub == NULL) {
+    ssh_set_error(session, SSH_FATAL,
+        "Could not get the public key from the private key");
+    return SSH_ERROR;
+  }
+  pubkey = publickey_to_string(pub);
+  publickey_free(pub);
+  if (pubkey == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Not enough space");
+    return SSH_ERROR;
+  }
+  dh_import_pubkey(session, pubkey);
+
+  if (ecdh_build_k(session) < 0) {
+    ssh_set_error(session, SSH_FATAL, "Cannot build k number");
+    return SSH_ERROR;
+  }
+
+  if (make_sessionid(session) != SSH_OK) {
+    ssh_set_error(session, SSH_FATAL, "Could not create a session id");
+    return SSH_ERROR;
+  }
+
+  sign = ssh_sign_session_id(session, prv);
+  if (sign == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Could not sign the session id");
+    return SSH_ERROR;
+  }
+
+  /* Free private keys as they should not be readable after this point */
+  if (session->rsa_key) {
+    privatekey_free(session->rsa_key);
+    session->rsa_key = NULL;
+  }
+  if (session->dsa_key) {
+    privatekey_free(session->dsa_key);
+    session->dsa_key = NULL;
+  }
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEX_ECDH_REPLY) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, pubkey) < 0 ||
+      buffer_add_ssh_string(session->out_buffer,
+        session->next_crypto->ecdh_server_pubkey) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, sign) < 0) {
+    ssh_set_error(session, SSH_FATAL, "Not enough space");
+    buffer_reinit(session->out_buffer);
+    ssh_string_free(sign);
+    return SSH_ERROR;
+  }
+  ssh_string_free(sign);
+  if (packet_send(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_NEWKEYS) < 0) {
+    buffer_reinit(session->out_buffer);
+    return SSH_ERROR;
+  }
+
+  if (packet_send(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  ssh_log(session, SSH_LOG_PACKET, "SSH_MSG_NEWKEYS sent");
+  session->dh_handshake_state = DH_STATE_NEWKEYS_SENT;
+
+  return SSH_OK;
+}
+
+#endif /* HAVE_ECC */
+
+/* vim: set ts=2 sw=2 et cindent: */
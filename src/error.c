@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include "libssh/priv.h"
+#include "libssh/session.h"
 
 /**
  * @defgroup libssh_error The SSH error functions.
@@ -34,6 +35,91 @@
  * @{
  */
 
+/*
+ * Error fidelity across threads.
+ *
+ * The error struct lives at the head of the session (or bind) object
+ * and is written with no synchronization, so two threads failing on
+ * different channels of one session used to clobber each other's
+ * message. Each thread therefore also keeps its own copy of the last
+ * errors it raised, in a small fixed stack of slots keyed by the
+ * object: the setters write the shared struct (kept for cross-thread
+ * readers) and the calling thread's slot, the getters prefer the slot.
+ * There is no locking anywhere on the path. Like errno, a slot is only
+ * meaningful right after a failing call on the same thread.
+ *
+ * Two guards keep the slots honest. Each object carries a generation
+ * stamped by ssh_error_init(), recorded in the slot and compared by the
+ * getters, so a new object malloc'd at a freed one's address does not
+ * inherit stale slots. And each setter bumps a sequence number in the
+ * shared struct, mirrored into the slot; a getter only trusts its slot
+ * while the sequence still matches, so an error set by another thread
+ * afterwards is never shadowed by an older local one.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_ERROR_TLS 1
+#define ERROR_TLS_SLOTS 4
+
+struct ssh_error_slot {
+    const void *owner;
+    uint32_t gen;   /* owner's error_gen when the slot was filled */
+    uint32_t seq;   /* owner's error_seq this slot mirrors */
+    int error_code;
+    const char *error_str;
+    char error_buffer[ERROR_BUFFERLEN];
+};
+
+static __thread struct ssh_error_slot error_slots[ERROR_TLS_SLOTS];
+static __thread unsigned int error_slot_next;
+
+static struct ssh_error_slot *error_slot_find(const struct error_struct *err) {
+  int i;
+
+  for (i = 0; i < ERROR_TLS_SLOTS; i++) {
+    if (error_slots[i].owner == err && error_slots[i].gen == err->error_gen) {
+      return &error_slots[i];
+    }
+  }
+
+  return NULL;
+}
+
+static struct ssh_error_slot *error_slot_take(const struct error_struct *err) {
+  struct ssh_error_slot *slot = error_slot_find(err);
+
+  if (slot == NULL) {
+    /* round-robin replacement; a thread juggling more objects than
+     * slots merely falls back to the shared struct for the oldest */
+    slot = &error_slots[error_slot_next++ % ERROR_TLS_SLOTS];
+    slot->owner = err;
+    slot->gen = err->error_gen;
+  }
+
+  return slot;
+}
+#endif /* HAVE_ERROR_TLS */
+
+/**
+ * @internal
+ *
+ * @brief Stamp a fresh error struct with a process-unique generation.
+ *
+ * Called from the object constructors (ssh_new(), ssh_bind_new()); the
+ * generation tells the per-thread error slots of a recycled allocation
+ * apart from those of its predecessor at the same address.
+ *
+ * @param  err         The error struct to initialize.
+ */
+void ssh_error_init(struct error_struct *err) {
+  static uint32_t gen_counter;
+
+#if defined(__GNUC__)
+  err->error_gen = __sync_add_and_fetch(&gen_counter, 1);
+#else
+  err->error_gen = ++gen_counter;
+#endif
+}
+
 /**
  * @internal
  *
@@ -50,11 +136,37 @@
 void ssh_set_error(void *error, int code, const char *descr, ...) {
   struct error_struct *err = error;
   va_list va;
-  va_start(va, descr);
-  vsnprintf(err->error_buffer, ERROR_BUFFERLEN, descr, va);
-  va_end(va);
+
+  /*
+   * Nonblocking SSH_AGAIN paths raise errors on every retry, so plain
+   * messages - every caller passes a string literal - skip vsnprintf
+   * and are rendered lazily by ssh_get_error().
+   */
+  if (strchr(descr, '%') == NULL) {
+    err->error_str = descr;
+  } else {
+    err->error_str = NULL;
+    va_start(va, descr);
+    vsnprintf(err->error_buffer, ERROR_BUFFERLEN, descr, va);
+    va_end(va);
+  }
   err->error_code = code;
-  ssh_log(error,SSH_LOG_RARE,"Error : %s",err->error_buffer);
+  err->error_seq++;
+#ifdef HAVE_ERROR_TLS
+  {
+    struct ssh_error_slot *slot = error_slot_take(err);
+
+    slot->seq = err->error_seq;
+    slot->error_code = code;
+    slot->error_str = err->error_str;
+    if (slot->error_str == NULL) {
+      memcpy(slot->error_buffer, err->error_buffer,
+          sizeof(slot->error_buffer));
+    }
+  }
+#endif
+  ssh_log(error,SSH_LOG_RARE,"Error : %s",
+      err->error_str != NULL ? err->error_str : err->error_buffer);
 }
 
 /**
@@ -68,8 +180,18 @@ void ssh_set_error(void *error, int code, const char *descr, ...) {
 void ssh_set_error_oom(void *error) {
   struct error_struct *err = error;
 
-  strcpy(err->error_buffer, "Out of memory");
+  err->error_str = "Out of memory";
   err->error_code = SSH_FATAL;
+  err->error_seq++;
+#ifdef HAVE_ERROR_TLS
+  {
+    struct ssh_error_slot *slot = error_slot_take(err);
+
+    slot->seq = err->error_seq;
+    slot->error_code = SSH_FATAL;
+    slot->error_str = err->error_str;
+  }
+#endif
 }
 
 /**
@@ -96,6 +218,26 @@ void ssh_set_error_invalid(void *error, const char *function) {
 const char *ssh_get_error(void *error) {
   struct error_struct *err = error;
 
+#ifdef HAVE_ERROR_TLS
+  struct ssh_error_slot *slot = error_slot_find(err);
+
+  /* only trust the slot while it mirrors the latest write; a newer
+   * error raised by another thread takes precedence over our copy */
+  if (slot != NULL && slot->seq == err->error_seq) {
+    if (slot->error_str != NULL) {
+      snprintf(slot->error_buffer, ERROR_BUFFERLEN, "%s", slot->error_str);
+      slot->error_str = NULL;
+    }
+    return slot->error_buffer;
+  }
+#endif
+
+  if (err->error_str != NULL) {
+    /* render the deferred message now */
+    snprintf(err->error_buffer, ERROR_BUFFERLEN, "%s", err->error_str);
+    err->error_str = NULL;
+  }
+
   return err->error_buffer;
 }
 
@@ -116,6 +258,14 @@ const char *ssh_get_error(void *error) {
 int ssh_get_error_code(void *error) {
   struct error_struct *err = error;
 
+#ifdef HAVE_ERROR_TLS
+  struct ssh_error_slot *slot = error_slot_find(err);
+
+  if (slot != NULL && slot->seq == err->error_seq) {
+    return slot->error_code;
+  }
+#endif
+
   return err->error_code;
 }
 
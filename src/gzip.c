@@ -35,6 +35,57 @@
 
 #define BLOCKSIZE 4092
 
+/* payloads smaller than this always get the configured level, sampling
+ * them is not worth it */
+#define ENTROPY_MIN_LEN 512
+/* how much of a payload is sampled for the entropy estimate */
+#define ENTROPY_SAMPLE_LEN 2048
+
+static int floor_log2(unsigned long x) {
+  int r = 0;
+
+  while (x >>= 1) {
+    r++;
+  }
+
+  return r;
+}
+
+/*
+ * Cheap estimate of whether a payload would shrink under deflate. Computes
+ * the byte histogram of a sample and approximates the Shannon entropy with
+ * integer log2. Already-compressed or encrypted data comes out near 8
+ * bits/byte; anything estimated above 7.5 is not worth deflating.
+ */
+static int payload_is_incompressible(const unsigned char *data,
+    unsigned long len) {
+  unsigned long histogram[256] = {0};
+  unsigned long bits = 0;
+  unsigned long i;
+  int log2len;
+
+  if (len < ENTROPY_MIN_LEN) {
+    return 0;
+  }
+  if (len > ENTROPY_SAMPLE_LEN) {
+    len = ENTROPY_SAMPLE_LEN;
+  }
+
+  for (i = 0; i < len; i++) {
+    histogram[data[i]]++;
+  }
+
+  log2len = floor_log2(len);
+  for (i = 0; i < 256; i++) {
+    if (histogram[i] > 0) {
+      bits += histogram[i] * (log2len - floor_log2(histogram[i]));
+    }
+  }
+
+  /* bits/byte > 7.5 */
+  return bits * 2 > len * 15;
+}
+
 static z_stream *initcompress(ssh_session session, int level) {
   z_stream *stream = NULL;
   int status;
@@ -57,7 +108,7 @@ static z_stream *initcompress(ssh_session session, int level) {
 }
 
 static ssh_buffer gzip_compress(ssh_session session,ssh_buffer source,int level){
-  z_stream *zout = session->current_crypto->compress_out_ctx;
+  z_stream *zout = session->out_crypto->compress_out_ctx;
   void *in_ptr = buffer_get_rest(source);
   unsigned long in_size = buffer_get_rest_len(source);
   ssh_buffer dest = NULL;
@@ -66,14 +117,39 @@ static ssh_buffer gzip_compress(ssh_session session,ssh_buffer source,int level)
   int status;
 
   if(zout == NULL) {
-    zout = session->current_crypto->compress_out_ctx = initcompress(session, level);
+    zout = session->out_crypto->compress_out_ctx = initcompress(session, level);
     if (zout == NULL) {
       return NULL;
     }
+    session->out_crypto->compress_out_level = level;
   }
 
-  dest = ssh_buffer_new();
-  if (dest == NULL) {
+  /*
+   * Incompressible payloads are emitted as stored deflate blocks (a few
+   * bytes of overhead) instead of burning CPU on them. Each packet ends at
+   * a flush point, so the level may be switched between packets without
+   * breaking the stream for the peer.
+   */
+  if (session->compress_hint ||
+      payload_is_incompressible(in_ptr, in_size)) {
+    level = Z_NO_COMPRESSION;
+  }
+  if (level != session->out_crypto->compress_out_level &&
+      deflateParams(zout, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+    session->out_crypto->compress_out_level = level;
+  }
+
+  /* The scratch buffer is kept across packets to avoid an allocation and
+   * free per packet. It is owned by the crypto structure, callers must not
+   * free it. */
+  if (session->out_crypto->compress_scratch == NULL) {
+    session->out_crypto->compress_scratch = ssh_buffer_new();
+    if (session->out_crypto->compress_scratch == NULL) {
+      return NULL;
+    }
+  }
+  dest = session->out_crypto->compress_scratch;
+  if (buffer_reinit(dest) < 0) {
     return NULL;
   }
 
@@ -84,14 +160,12 @@ static ssh_buffer gzip_compress(ssh_session session,ssh_buffer source,int level)
     zout->avail_out = BLOCKSIZE;
     status = deflate(zout, Z_PARTIAL_FLUSH);
     if (status != Z_OK) {
-      ssh_buffer_free(dest);
       ssh_set_error(session, SSH_FATAL,
           "status %d deflating zlib packet", status);
       return NULL;
     }
     len = BLOCKSIZE - zout->avail_out;
     if (buffer_add_data(dest, out_buf, len) < 0) {
-      ssh_buffer_free(dest);
       return NULL;
     }
     zout->next_out = out_buf;
@@ -107,18 +181,16 @@ int compress_buffer(ssh_session session, ssh_buffer buf) {
   if (dest == NULL) {
     return -1;
   }
+  session->stats.compressed_out += buffer_get_rest_len(dest);
 
   if (buffer_reinit(buf) < 0) {
-    ssh_buffer_free(dest);
     return -1;
   }
 
   if (buffer_add_data(buf, buffer_get_rest(dest), buffer_get_rest_len(dest)) < 0) {
-    ssh_buffer_free(dest);
     return -1;
   }
 
-  ssh_buffer_free(dest);
   return 0;
 }
 
@@ -149,7 +221,7 @@ static ssh_buffer gzip_decompress(ssh_session session, ssh_buffer source, size_t
   z_stream *zin = session->current_crypto->compress_in_ctx;
   void *in_ptr = buffer_get_rest(source);
   unsigned long in_size = buffer_get_rest_len(source);
-  unsigned char out_buf[BLOCKSIZE] = {0};
+  unsigned char *out;
   ssh_buffer dest = NULL;
   unsigned long len;
   int status;
@@ -161,36 +233,46 @@ static ssh_buffer gzip_decompress(ssh_session session, ssh_buffer source, size_t
     }
   }
 
-  dest = ssh_buffer_new();
-  if (dest == NULL) {
+  /* reused across packets, owned by the crypto structure */
+  if (session->current_crypto->compress_scratch == NULL) {
+    session->current_crypto->compress_scratch = ssh_buffer_new();
+    if (session->current_crypto->compress_scratch == NULL) {
+      return NULL;
+    }
+  }
+  dest = session->current_crypto->compress_scratch;
+  if (buffer_reinit(dest) < 0) {
     return NULL;
   }
 
-  zin->next_out = out_buf;
   zin->next_in = in_ptr;
   zin->avail_in = in_size;
 
+  /* inflate straight into the buffer's tail one window at a time; the
+   * output bound is enforced as the stream grows rather than by
+   * preallocating maxlen, and no intermediate copy is made */
   do {
+    out = ssh_buffer_reserve_data(dest, BLOCKSIZE);
+    if (out == NULL) {
+      return NULL;
+    }
+    zin->next_out = out;
     zin->avail_out = BLOCKSIZE;
     status = inflate(zin, Z_PARTIAL_FLUSH);
     if (status != Z_OK) {
       ssh_set_error(session, SSH_FATAL,
           "status %d inflating zlib packet", status);
-      ssh_buffer_free(dest);
       return NULL;
     }
 
     len = BLOCKSIZE - zin->avail_out;
-    if (buffer_add_data(dest,out_buf,len) < 0) {
-      ssh_buffer_free(dest);
+    if (ssh_buffer_commit_data(dest, len) < 0) {
       return NULL;
     }
     if (buffer_get_rest_len(dest) > maxlen){
       /* Size of packet exceeded, avoid a denial of service attack */
-      ssh_buffer_free(dest);
       return NULL;
     }
-    zin->next_out = out_buf;
   } while (zin->avail_out == 0);
 
   return dest;
@@ -198,23 +280,19 @@ static ssh_buffer gzip_decompress(ssh_session session, ssh_buffer source, size_t
 
 int decompress_buffer(ssh_session session,ssh_buffer buf, size_t maxlen){
   ssh_buffer dest = NULL;
+  uint32_t compressedlen = buffer_get_rest_len(buf);
 
   dest = gzip_decompress(session,buf, maxlen);
   if (dest == NULL) {
     return -1;
   }
+  session->stats.compressed_in += compressedlen;
 
-  if (buffer_reinit(buf) < 0) {
-    ssh_buffer_free(dest);
-    return -1;
-  }
-
-  if (buffer_add_data(buf, buffer_get_rest(dest), buffer_get_rest_len(dest)) < 0) {
-    ssh_buffer_free(dest);
-    return -1;
-  }
+  /* hand the inflated bytes to the packet layer by exchanging the
+   * buffer guts instead of copying them over; the storage that held
+   * the compressed packet becomes the next packet's scratch */
+  buffer_swap(buf, dest);
 
-  ssh_buffer_free(dest);
   return 0;
 }
 
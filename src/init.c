@@ -23,15 +23,27 @@
 
 #include "config.h"
 #include "libssh/priv.h"
+#include "libssh/buffer.h"
 #include "libssh/socket.h"
 #include "libssh/dh.h"
 #include "libssh/poll.h"
+#include "libssh/string.h"
 #include "libssh/threads.h"
+#include "libssh/agent.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
 #endif
 
+#include <stdlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+#if defined(__linux__) && (defined(__arm__) || defined(__aarch64__))
+#include <sys/auxv.h>
+#endif
+
 /**
  * @defgroup libssh The libssh API
  *
@@ -51,6 +63,7 @@
  * @returns             0 on success, -1 if an error occured.
  */
 int ssh_init(void) {
+  ssh_get_cpu_features();
   if(ssh_threads_init())
     return -1;
   if(ssh_crypto_init())
@@ -60,6 +73,119 @@ int ssh_init(void) {
   return 0;
 }
 
+/**
+ * @brief Initialize the library without the cryptographic backend.
+ *
+ * ssh_init() brings up the whole crypto backend (secure memory pools,
+ * cipher tables, the Diffie-Hellman constants) even when the process
+ * never opens a session, which dominates startup of short-lived tools
+ * that only parse keys or known_hosts files. This variant skips the
+ * crypto initialization entirely; the backend catches up by itself on
+ * first use - random number generation initializes the backend globals,
+ * the first key exchange initializes the rest.
+ *
+ * Like ssh_init() it should be called once, in the main thread, before
+ * any other threads use the library: the deferred crypto setup is not
+ * protected against concurrent first use.
+ *
+ * @returns             0 on success, -1 if an error occured.
+ *
+ * @see ssh_init()
+ */
+int ssh_init_minimal(void) {
+  ssh_get_cpu_features();
+  if(ssh_threads_init())
+    return -1;
+  if(ssh_socket_init())
+    return -1;
+  return 0;
+}
+
+static uint32_t ssh_cpu_features;
+static int ssh_cpu_features_detected;
+
+static uint32_t ssh_cpu_detect(void) {
+  uint32_t features = 0;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    if (ecx & bit_AES) {
+      features |= SSH_CPU_AESNI;
+    }
+    if (ecx & bit_PCLMUL) {
+      features |= SSH_CPU_PCLMUL;
+    }
+  }
+  if (__get_cpuid_max(0, NULL) >= 7) {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (ebx & (1u << 5)) {
+      features |= SSH_CPU_AVX2;
+    }
+    if (ebx & (1u << 29)) {
+      features |= SSH_CPU_SHA;
+    }
+  }
+#endif
+#if defined(__linux__) && defined(__arm__)
+  {
+    unsigned long hwcap = getauxval(AT_HWCAP);
+#ifdef HWCAP_NEON
+    if (hwcap & HWCAP_NEON) {
+      features |= SSH_CPU_NEON;
+    }
+#else
+    (void) hwcap;
+#endif
+  }
+#endif
+#if defined(__linux__) && defined(__aarch64__)
+  {
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+#ifdef HWCAP_ASIMD
+    if (hwcap & HWCAP_ASIMD) {
+      features |= SSH_CPU_NEON;
+    }
+#endif
+#ifdef HWCAP_SHA2
+    if (hwcap & HWCAP_SHA2) {
+      features |= SSH_CPU_SHA;
+    }
+#endif
+    (void) hwcap;
+  }
+#endif
+
+  return features;
+}
+
+/**
+ * @brief Report the CPU crypto capabilities the library runs on.
+ *
+ * Whether the crypto backend uses its accelerated AES/GCM/SHA code used
+ * to depend invisibly on how it was built; this makes the hardware side
+ * of that decision observable. The SSH_FORCE_SOFT_CRYPTO environment
+ * variable reports no capabilities (and makes ssh_init() tell the
+ * backend to stay on its generic code), which pins benchmarks to the
+ * software paths.
+ *
+ * @return A bitmask of SSH_CPU_* capability flags detected at runtime,
+ *         0 when none apply or SSH_FORCE_SOFT_CRYPTO is set.
+ */
+uint32_t ssh_get_cpu_features(void) {
+  if (!ssh_cpu_features_detected) {
+    ssh_cpu_features = ssh_cpu_detect();
+    ssh_cpu_features_detected = 1;
+  }
+  if (getenv("SSH_FORCE_SOFT_CRYPTO") != NULL) {
+    return 0;
+  }
+
+  return ssh_cpu_features;
+}
+
 
 /**
  * @brief Finalize and cleanup all libssh and cryptographic data structures.
@@ -71,8 +197,21 @@ int ssh_init(void) {
    @returns 0 otherwise
  */
 int ssh_finalize(void) {
+  ssh_dh_precompute_flush();
   ssh_crypto_finalize();
   ssh_socket_cleanup();
+  buffer_pool_cleanup();
+  ssh_knownhosts_cache_flush();
+  ssh_privatekey_cache_flush();
+  ssh_pubkey_cache_flush();
+  ssh_reconnect_cache_flush();
+  ssh_string_freelist_flush();
+  ssh_resolver_cache_flush();
+  ssh_kex_cache_flush();
+#ifndef _WIN32
+  ssh_agent_cache_flush();
+  ssh_benchmark_cipher_flush();
+#endif
   /* It is important to finalize threading after CRYPTO because
    * it still depends on it */
   ssh_threads_finalize();
@@ -38,6 +38,7 @@
 #include "libssh/packet.h"
 #include "libssh/session.h"
 #include "libssh/wrapper.h"
+#include "libssh/crypto.h"
 #include "libssh/keys.h"
 #include "libssh/dh.h"
 #include "libssh/kex.h"
@@ -72,9 +73,33 @@
 #define ZLIB "none"
 #endif
 
+#ifdef HAVE_ECC
+#define ECDH "ecdh-sha2-nistp256,"
+#define ECDSA "ecdsa-sha2-nistp256,"
+#else
+#define ECDH ""
+#define ECDSA ""
+#endif
+
+/* the same cipher set as AES but ordered fastest first: the smaller key
+ * schedule wins and CTR mode parallelizes better than CBC */
+#ifdef HAVE_LIBGCRYPT
+#define AES_FAST "aes128-ctr,aes192-ctr,aes256-ctr,aes128-cbc,aes192-cbc,aes256-cbc,"
+#elif defined HAVE_LIBCRYPTO
+#ifdef HAVE_OPENSSL_AES_H
+#ifdef BROKEN_AES_CTR
+#define AES_FAST "aes128-cbc,aes192-cbc,aes256-cbc,"
+#else
+#define AES_FAST "aes128-ctr,aes192-ctr,aes256-ctr,aes128-cbc,aes192-cbc,aes256-cbc,"
+#endif /* BROKEN_AES_CTR */
+#else
+#define AES_FAST ""
+#endif
+#endif
+
 const char *default_methods[] = {
-  "diffie-hellman-group1-sha1",
-  "ssh-rsa,ssh-dss",
+  ECDH "diffie-hellman-group1-sha1",
+  ECDSA "ssh-rsa,ssh-dss",
   AES BLOWFISH DES,
   AES BLOWFISH DES,
   "hmac-sha1",
@@ -87,8 +112,8 @@ const char *default_methods[] = {
 };
 
 const char *supported_methods[] = {
-  "diffie-hellman-group1-sha1",
-  "ssh-rsa,ssh-dss",
+  ECDH "diffie-hellman-group1-sha1",
+  ECDSA "ssh-rsa,ssh-dss",
   AES BLOWFISH DES,
   AES BLOWFISH DES,
   "hmac-sha1",
@@ -100,6 +125,49 @@ const char *supported_methods[] = {
   NULL
 };
 
+/** @internal
+ * @brief cipher preference of a negotiation profile, NULL to keep the
+ * built-in default order
+ *
+ * @see SSH_OPTIONS_PROFILE
+ */
+const char *ssh_profile_ciphers(int profile) {
+  switch (profile) {
+  case SSH_PROFILE_THROUGHPUT:
+    /* fastest first; the micro-benchmark refines this per host */
+    return AES_FAST BLOWFISH DES;
+  case SSH_PROFILE_LOWLAT:
+    /* smallest per-packet cost, aes128 has the cheapest key schedule */
+    return AES_FAST BLOWFISH DES;
+  case SSH_PROFILE_COMPAT:
+    /* the historical order, widest interoperability */
+    return AES BLOWFISH DES;
+  case SSH_PROFILE_BENCHMARK:
+    return ssh_benchmark_cipher_order();
+  default:
+    return NULL;
+  }
+}
+
+/** @internal
+ * @brief compression preference of a negotiation profile, NULL to keep
+ * the default
+ */
+const char *ssh_profile_compression(int profile) {
+  switch (profile) {
+  case SSH_PROFILE_THROUGHPUT:
+  case SSH_PROFILE_LOWLAT:
+  case SSH_PROFILE_BENCHMARK:
+    /* zlib costs more cpu than it saves on a fast link and adds
+     * buffering delay */
+    return "none";
+  case SSH_PROFILE_COMPAT:
+    return ZLIB;
+  default:
+    return NULL;
+  }
+}
+
 /* descriptions of the key exchange packet */
 const char *ssh_kex_nums[] = {
   "kex algos",
@@ -205,15 +273,105 @@ char **space_tokenize(const char *chain){
 /* and a list of preferred objects (preferred_d) */
 /* it will return a strduped pointer on the first preferred object found in the available objects list */
 
-char *ssh_find_matching(const char *available_d, const char *preferred_d){
+/* Interned algorithm names: every name in supported_methods[] gets a
+ * small integer id so that list intersection compares ids instead of
+ * re-tokenizing and strcmp-ing heap copies on every negotiation. The
+ * table is built on the first negotiation; like ssh_crypto_init() this
+ * is not protected against concurrent first use. */
+#define KEX_ALGO_INTERN_MAX 32
+#define KEX_LIST_TOKENS_MAX 32
+
+struct ssh_algo_name_struct {
+  const char *name;
+  size_t len;
+};
+
+struct ssh_algo_token_struct {
+  const char *name;
+  size_t len;
+  int id;
+};
+
+static struct ssh_algo_name_struct algo_intern_table[KEX_ALGO_INTERN_MAX];
+static int algo_intern_count;
+
+/* id of a name in the intern table, 1-based; 0 for unknown names */
+static int kex_algo_intern(const char *name, size_t len) {
+  int i;
+
+  for (i = 0; i < algo_intern_count; i++) {
+    if (algo_intern_table[i].len == len &&
+        memcmp(algo_intern_table[i].name, name, len) == 0) {
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+static void kex_algo_intern_init(void) {
+  const char *p;
+  const char *sep;
+  size_t len;
+  int i;
+
+  if (algo_intern_count != 0) {
+    return;
+  }
+  for (i = 0; supported_methods[i] != NULL; i++) {
+    p = supported_methods[i];
+    while (*p != '\0') {
+      sep = strchr(p, ',');
+      len = sep != NULL ? (size_t) (sep - p) : strlen(p);
+      if (len > 0 && kex_algo_intern(p, len) == 0 &&
+          algo_intern_count < KEX_ALGO_INTERN_MAX) {
+        algo_intern_table[algo_intern_count].name = p;
+        algo_intern_table[algo_intern_count].len = len;
+        algo_intern_count++;
+      }
+      if (sep == NULL) {
+        break;
+      }
+      p = sep + 1;
+    }
+  }
+}
+
+/** @internal
+ * @brief splits a comma list into interned tokens, without copying
+ *
+ * @return The token count, -1 when the list does not fit in max tokens.
+ */
+static int kex_list_parse(const char *list,
+    struct ssh_algo_token_struct *tok, int max) {
+  const char *p = list;
+  const char *sep;
+  int n = 0;
+
+  for (;;) {
+    if (n == max) {
+      return -1;
+    }
+    sep = strchr(p, ',');
+    tok[n].name = p;
+    tok[n].len = sep != NULL ? (size_t) (sep - p) : strlen(p);
+    tok[n].id = kex_algo_intern(tok[n].name, tok[n].len);
+    n++;
+    if (sep == NULL) {
+      return n;
+    }
+    p = sep + 1;
+  }
+}
+
+/* the historical allocating implementation, kept for lists longer than
+ * the fixed token arrays */
+static char *ssh_find_matching_alloc(const char *available_d,
+    const char *preferred_d){
     char ** tok_available, **tok_preferred;
     int i_avail, i_pref;
     char *ret;
 
-    if ((available_d == NULL) || (preferred_d == NULL)) {
-      return NULL; /* don't deal with null args */
-    }
-
     tok_available = tokenize(available_d);
     if (tok_available == NULL) {
       return NULL;
@@ -247,6 +405,90 @@ char *ssh_find_matching(const char *available_d, const char *preferred_d){
     return NULL;
 }
 
+char *ssh_find_matching(const char *available_d, const char *preferred_d){
+    struct ssh_algo_token_struct avail[KEX_LIST_TOKENS_MAX];
+    struct ssh_algo_token_struct pref[KEX_LIST_TOKENS_MAX];
+    int n_avail, n_pref;
+    int i_avail, i_pref;
+    char *ret;
+
+    if ((available_d == NULL) || (preferred_d == NULL)) {
+      return NULL; /* don't deal with null args */
+    }
+
+    kex_algo_intern_init();
+    n_avail = kex_list_parse(available_d, avail, KEX_LIST_TOKENS_MAX);
+    n_pref = kex_list_parse(preferred_d, pref, KEX_LIST_TOKENS_MAX);
+    if (n_avail < 0 || n_pref < 0) {
+      return ssh_find_matching_alloc(available_d, preferred_d);
+    }
+
+    for (i_pref = 0; i_pref < n_pref; i_pref++) {
+      for (i_avail = 0; i_avail < n_avail; i_avail++) {
+        if (pref[i_pref].id != 0 || avail[i_avail].id != 0) {
+          /* at least one side is interned: the ids decide. An unknown
+           * name can never equal an interned one, interning would have
+           * found it. */
+          if (pref[i_pref].id != avail[i_avail].id) {
+            continue;
+          }
+        } else if (pref[i_pref].len != avail[i_avail].len ||
+            memcmp(pref[i_pref].name, avail[i_avail].name,
+              pref[i_pref].len) != 0) {
+          continue;
+        }
+        ret = malloc(pref[i_pref].len + 1);
+        if (ret == NULL) {
+          return NULL;
+        }
+        memcpy(ret, pref[i_pref].name, pref[i_pref].len);
+        ret[pref[i_pref].len] = '\0';
+
+        return ret;
+      }
+    }
+
+    return NULL;
+}
+
+/* records in next_crypto which key exchange method has been negotiated,
+ * so the handshake code knows which state machine and hash to use */
+int ssh_kex_select_kex_type(ssh_session session, const char *name){
+    if (name == NULL) {
+      ssh_set_error(session, SSH_FATAL, "No key exchange method negotiated");
+      return SSH_ERROR;
+    }
+    if (strcmp(name, "diffie-hellman-group1-sha1") == 0) {
+      session->next_crypto->kex_type = SSH_KEX_DH_GROUP1_SHA1;
+      return SSH_OK;
+    }
+#ifdef HAVE_ECC
+    if (strcmp(name, "ecdh-sha2-nistp256") == 0) {
+      session->next_crypto->kex_type = SSH_KEX_ECDH_SHA2_NISTP256;
+      return SSH_OK;
+    }
+#endif
+    ssh_set_error(session, SSH_FATAL,
+        "Unknown key exchange method \"%s\"", name);
+    return SSH_ERROR;
+}
+
+/** @internal
+ * @brief release the method lists of a previous key exchange so a rekey
+ * can store fresh ones without leaking
+ */
+void kex_methods_free(KEX *kex) {
+  int i;
+
+  if (kex->methods == NULL) {
+    return;
+  }
+  for (i = 0; i < 10; i++) {
+    SAFE_FREE(kex->methods[i]);
+  }
+  SAFE_FREE(kex->methods);
+}
+
 SSH_PACKET_CALLBACK(ssh_packet_kexinit){
 	int server_kex=session->server;
   ssh_string str = NULL;
@@ -258,8 +500,24 @@ SSH_PACKET_CALLBACK(ssh_packet_kexinit){
   (void)user;
   memset(strings, 0, sizeof(strings));
   if(session->session_state != SSH_SESSION_STATE_INITIAL_KEX){
-  	ssh_set_error(session,SSH_FATAL,"SSH_KEXINIT received in wrong state");
-  	goto error;
+  	if (!session->server && session->rekeying == 0 &&
+  	    session->current_crypto != NULL &&
+  	    session->dh_handshake_state == DH_STATE_FINISHED &&
+  	    (session->session_state == SSH_SESSION_STATE_AUTHENTICATING ||
+  	     session->session_state == SSH_SESSION_STATE_AUTHENTICATED)) {
+  		/* the server asks for a rekey; answer with our KEXINIT and run
+  		 * the key exchange again, see ssh_client_rekey_check() */
+  		ssh_log(session, SSH_LOG_PROTOCOL, "Server-initiated rekey");
+  		session->rekeying = 1;
+  		session->rekey_sent_kexinit = 0;
+  		session->rekey_saved_state = session->session_state;
+  		session->session_state = SSH_SESSION_STATE_INITIAL_KEX;
+  		session->dh_handshake_state = DH_STATE_INIT;
+  		kex_methods_free(&session->server_kex);
+  	} else {
+  		ssh_set_error(session,SSH_FATAL,"SSH_KEXINIT received in wrong state");
+  		goto error;
+  	}
   }
   if (server_kex) {
       if (buffer_get_data(packet,session->client_kex.cookie,16) != 16) {
@@ -357,6 +615,135 @@ void ssh_list_kex(ssh_session session, KEX *kex) {
   }
 }
 
+/* The negotiation cache remembers, per host endpoint, the method lists a
+ * previous connection settled on. The same sshd proposes the same lists,
+ * so on reconnect the remembered outcome only has to be revalidated with
+ * one membership test per slot instead of re-running the full
+ * wanted-list intersection of set_kex(). Entries are checked against
+ * both the server offer and the configured preferences every time, so a
+ * changed server or changed options simply fall back to the slow path. */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_KEX_CACHE
+#endif
+
+#ifdef HAVE_KEX_CACHE
+
+#define KEX_CACHE_SIZE 16
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+static pthread_mutex_t kex_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define KEX_CACHE_THREAD
+#define kex_cache_lock() pthread_mutex_lock(&kex_cache_mutex)
+#define kex_cache_unlock() pthread_mutex_unlock(&kex_cache_mutex)
+#else
+#define KEX_CACHE_THREAD __thread
+#define kex_cache_lock() do { } while(0)
+#define kex_cache_unlock() do { } while(0)
+#endif
+
+struct ssh_kex_cache_entry {
+  char *host;
+  unsigned int port;
+  char *methods[10];
+};
+
+static KEX_CACHE_THREAD struct ssh_kex_cache_entry kex_cache[KEX_CACHE_SIZE];
+static KEX_CACHE_THREAD int kex_cache_clock;
+
+/* Copies the remembered outcome into methods[], returns 1 on a hit. */
+static int kex_cache_lookup(const char *host, unsigned int port,
+    char *methods[10]) {
+  int rc = 0;
+  int i, j;
+
+  kex_cache_lock();
+  for (i = 0; i < KEX_CACHE_SIZE; i++) {
+    if (kex_cache[i].host != NULL && kex_cache[i].port == port &&
+        strcmp(kex_cache[i].host, host) == 0) {
+      rc = 1;
+      for (j = 0; j < 10; j++) {
+        methods[j] = strdup(kex_cache[i].methods[j]);
+        if (methods[j] == NULL) {
+          while (j-- > 0) {
+            SAFE_FREE(methods[j]);
+          }
+          rc = 0;
+          break;
+        }
+      }
+      break;
+    }
+  }
+  kex_cache_unlock();
+
+  return rc;
+}
+
+static void kex_cache_entry_clear(struct ssh_kex_cache_entry *entry) {
+  int j;
+
+  SAFE_FREE(entry->host);
+  for (j = 0; j < 10; j++) {
+    SAFE_FREE(entry->methods[j]);
+  }
+}
+
+static void kex_cache_store(const char *host, unsigned int port,
+    char **methods) {
+  struct ssh_kex_cache_entry *entry = NULL;
+  int i, j;
+
+  kex_cache_lock();
+  for (i = 0; i < KEX_CACHE_SIZE; i++) {
+    if (kex_cache[i].host == NULL ||
+        (kex_cache[i].port == port &&
+         strcmp(kex_cache[i].host, host) == 0)) {
+      entry = &kex_cache[i];
+      break;
+    }
+  }
+  if (entry == NULL) {
+    /* all slots taken, overwrite them round robin */
+    entry = &kex_cache[kex_cache_clock];
+    kex_cache_clock = (kex_cache_clock + 1) % KEX_CACHE_SIZE;
+  }
+
+  kex_cache_entry_clear(entry);
+  entry->host = strdup(host);
+  if (entry->host == NULL) {
+    kex_cache_unlock();
+    return;
+  }
+  entry->port = port;
+  for (j = 0; j < 10; j++) {
+    entry->methods[j] = strdup(methods[j]);
+    if (entry->methods[j] == NULL) {
+      kex_cache_entry_clear(entry);
+      break;
+    }
+  }
+  kex_cache_unlock();
+}
+
+#endif /* HAVE_KEX_CACHE */
+
+/** @internal
+ *
+ * @brief Release the negotiation cache entries.
+ */
+void ssh_kex_cache_flush(void) {
+#ifdef HAVE_KEX_CACHE
+  int i;
+
+  kex_cache_lock();
+  for (i = 0; i < KEX_CACHE_SIZE; i++) {
+    kex_cache_entry_clear(&kex_cache[i]);
+  }
+  kex_cache_unlock();
+#endif
+}
+
 /* set_kex basicaly look at the option structure of the session and set the output kex message */
 /* it must be aware of the server kex message */
 /* it can fail if option is null, not any user specified kex method matches the server one, if not any default kex matches */
@@ -367,6 +754,10 @@ int set_kex(ssh_session session){
     int i;
     const char *wanted;
     enter_function();
+    /* the lists about to be chosen invalidate a previously serialized
+     * KEXINIT body, ssh_send_kex() rebuilds it */
+    ssh_buffer_free(session->kexinit_methods_cache);
+    session->kexinit_methods_cache = NULL;
     ssh_get_random(client->cookie,16,0);
     client->methods=malloc(10 * sizeof(char **));
     if (client->methods == NULL) {
@@ -375,6 +766,49 @@ int set_kex(ssh_session session){
       return -1;
     }
     memset(client->methods,0,10*sizeof(char **));
+#ifdef HAVE_KEX_CACHE
+    if (session->host != NULL &&
+        kex_cache_lookup(session->host, session->port, client->methods)) {
+      int hit = 1;
+
+      for (i = 0; i < 10 && hit; i++) {
+        char *m;
+
+        if (client->methods[i][0] == '\0') {
+          /* empty slots (languages) need no validation */
+          continue;
+        }
+        /* the remembered choice must still be offered by the server and
+         * still allowed by the configured preferences */
+        m = ssh_find_matching(server->methods[i], client->methods[i]);
+        if (m == NULL) {
+          hit = 0;
+          break;
+        }
+        SAFE_FREE(m);
+        wanted = session->wanted_methods[i];
+        if (wanted == NULL) {
+          wanted = default_methods[i];
+        }
+        m = ssh_find_matching(wanted, client->methods[i]);
+        if (m == NULL) {
+          hit = 0;
+          break;
+        }
+        SAFE_FREE(m);
+      }
+      if (hit) {
+        ssh_log(session, SSH_LOG_PROTOCOL,
+            "Reusing the cached kex negotiation for %s:%u",
+            session->host, session->port);
+        leave_function();
+        return 0;
+      }
+      for (i = 0; i < 10; i++) {
+        SAFE_FREE(client->methods[i]);
+      }
+    }
+#endif
     for (i=0;i<10;i++){
         if(!(wanted=session->wanted_methods[i]))
             wanted=default_methods[i];
@@ -394,6 +828,11 @@ int set_kex(ssh_session session){
           }
         }
     }
+#ifdef HAVE_KEX_CACHE
+    if (session->host != NULL) {
+      kex_cache_store(session->host, session->port, client->methods);
+    }
+#endif
     leave_function();
     return 0;
 }
@@ -419,19 +858,32 @@ int ssh_send_kex(ssh_session session, int server_kex) {
 
   ssh_list_kex(session, kex);
 
-  for (i = 0; i < 10; i++) {
-    str = ssh_string_from_char(kex->methods[i]);
-    if (str == NULL) {
-      goto error;
-    }
+  if (session->kexinit_methods_cache == NULL) {
+    /* serialize the name lists once per session; a server session
+     * inherits the buffer from its ssh_bind, a client builds it on the
+     * first KEXINIT and rekeys resend the same lists */
+    ssh_buffer cache = ssh_buffer_new();
 
-    if (buffer_add_ssh_string(session->out_hashbuf, str) < 0) {
+    if (cache == NULL) {
       goto error;
     }
-    if (buffer_add_ssh_string(session->out_buffer, str) < 0) {
-      goto error;
+    for (i = 0; i < 10; i++) {
+      if (ssh_buffer_pack(cache, "s", kex->methods[i]) != SSH_OK) {
+        ssh_buffer_free(cache);
+        goto error;
+      }
     }
-    ssh_string_free(str);
+    session->kexinit_methods_cache = cache;
+  }
+  if (buffer_add_data(session->out_hashbuf,
+        buffer_get_rest(session->kexinit_methods_cache),
+        buffer_get_rest_len(session->kexinit_methods_cache)) < 0) {
+    goto error;
+  }
+  if (buffer_add_data(session->out_buffer,
+        buffer_get_rest(session->kexinit_methods_cache),
+        buffer_get_rest_len(session->kexinit_methods_cache)) < 0) {
+    goto error;
   }
 
   if (buffer_add_u8(session->out_buffer, 0) < 0) {
@@ -522,6 +974,7 @@ static int build_session_id1(ssh_session session, ssh_string servern,
   md5_update(md5,ssh_string_data(servern),ssh_string_len(servern));
   md5_update(md5,session->server_kex.cookie,8);
   md5_final(session->next_crypto->session_id,md5);
+  session->next_crypto->digest_len = MD5_DIGEST_LEN;
 #ifdef DEBUG_CRYPTO
   ssh_print_hexa("session_id",session->next_crypto->session_id,MD5_DIGEST_LEN);
 #endif
@@ -787,6 +1240,7 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
    }
 
    session->current_crypto = session->next_crypto;
+   session->out_crypto = session->current_crypto;
    session->next_crypto = NULL;
    goto end;
 error:
@@ -814,14 +1268,16 @@ int ssh_get_kex1(ssh_session session) {
   ssh_log(session, SSH_LOG_PROTOCOL, "Waiting for a SSH_SMSG_PUBLIC_KEY");
   /* Here the callback is called */
   while(session->session_state==SSH_SESSION_STATE_INITIAL_KEX){
-    ssh_handle_packets(session,-1);
+    if (ssh_handle_packets(session,-1) != SSH_OK)
+      goto error;
   }
   if(session->session_state==SSH_SESSION_STATE_ERROR)
     goto error;
   ssh_log(session, SSH_LOG_PROTOCOL, "Waiting for a SSH_SMSG_SUCCESS");
   /* Waiting for SSH_SMSG_SUCCESS */
   while(session->session_state==SSH_SESSION_STATE_KEXINIT_RECEIVED){
-    ssh_handle_packets(session,-1);
+    if (ssh_handle_packets(session,-1) != SSH_OK)
+      goto error;
   }
   if(session->session_state==SSH_SESSION_STATE_ERROR)
       goto error;
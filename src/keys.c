@@ -28,6 +28,9 @@
 #include <openssl/rsa.h>
 #endif
 #include "libssh/priv.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "libssh/ssh2.h"
 #include "libssh/server.h"
 #include "libssh/buffer.h"
@@ -53,6 +56,8 @@ const char *ssh_type_to_char(int type) {
       return "ssh-rsa";
     case SSH_KEYTYPE_RSA1:
       return "ssh-rsa1";
+    case SSH_KEYTYPE_ECDSA:
+      return "ecdsa-sha2-nistp256";
     default:
       return NULL;
   }
@@ -71,6 +76,8 @@ int ssh_type_from_name(const char *name) {
     return SSH_KEYTYPE_RSA;
   } else if (strcmp(name, "ssh-dss") == 0) {
     return SSH_KEYTYPE_DSS;
+  } else if (strcmp(name, "ecdsa-sha2-nistp256") == 0) {
+    return SSH_KEYTYPE_ECDSA;
   }
 
   return -1;
@@ -91,6 +98,7 @@ ssh_public_key publickey_make_dss(ssh_session session, ssh_buffer buffer) {
 
   key->type = SSH_KEYTYPE_DSS;
   key->type_c = ssh_type_to_char(key->type);
+  key->refcount = 0;
 
   p = buffer_get_ssh_string(buffer);
   q = buffer_get_ssh_string(buffer);
@@ -176,6 +184,7 @@ ssh_public_key publickey_make_rsa(ssh_session session, ssh_buffer buffer,
 
   key->type = type;
   key->type_c = ssh_type_to_char(key->type);
+  key->refcount = 0;
 
   e = buffer_get_ssh_string(buffer);
   n = buffer_get_ssh_string(buffer);
@@ -229,11 +238,94 @@ error:
   return NULL;
 }
 
+#ifdef HAVE_ECC
+/* RFC 5656 wire format: after the key type string come the curve name
+ * and the public point in uncompressed octet form. Only the mandatory
+ * nistp256 curve is supported. */
+ssh_public_key publickey_make_ecdsa(ssh_session session, ssh_buffer buffer) {
+  ssh_string curve = NULL;
+  ssh_string q = NULL;
+  ssh_public_key key = NULL;
+  const EC_GROUP *group = NULL;
+  EC_POINT *point = NULL;
+
+  key = malloc(sizeof(struct ssh_public_key_struct));
+  if (key == NULL) {
+    ssh_buffer_free(buffer);
+    return NULL;
+  }
+
+  key->type = SSH_KEYTYPE_ECDSA;
+  key->type_c = ssh_type_to_char(key->type);
+  key->refcount = 0;
+  key->ecdsa_pub = NULL;
+
+  curve = buffer_get_ssh_string(buffer);
+  q = buffer_get_ssh_string(buffer);
+
+  ssh_buffer_free(buffer); /* we don't need it anymore */
+
+  if (curve == NULL || q == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Invalid ECDSA public key");
+    goto error;
+  }
+
+  if (ssh_string_len(curve) != 8 ||
+      memcmp(ssh_string_data(curve), "nistp256", 8) != 0) {
+    ssh_set_error(session, SSH_FATAL, "Unsupported ECDSA curve");
+    goto error;
+  }
+
+  key->ecdsa_pub = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (key->ecdsa_pub == NULL) {
+    goto error;
+  }
+
+  group = EC_KEY_get0_group(key->ecdsa_pub);
+  point = EC_POINT_new(group);
+  if (point == NULL) {
+    goto error;
+  }
+  if (EC_POINT_oct2point(group, point, ssh_string_data(q),
+        ssh_string_len(q), NULL) != 1 ||
+      EC_KEY_set_public_key(key->ecdsa_pub, point) != 1) {
+    ssh_set_error(session, SSH_FATAL, "Invalid ECDSA public point");
+    goto error;
+  }
+  EC_POINT_free(point);
+
+  ssh_string_burn(curve);
+  ssh_string_free(curve);
+  ssh_string_burn(q);
+  ssh_string_free(q);
+
+  return key;
+error:
+  EC_POINT_free(point);
+  ssh_string_burn(curve);
+  ssh_string_free(curve);
+  ssh_string_burn(q);
+  ssh_string_free(q);
+  publickey_free(key);
+
+  return NULL;
+}
+#endif /* HAVE_ECC */
+
 void publickey_free(ssh_public_key key) {
   if (key == NULL) {
     return;
   }
 
+  /* keys shared with the pubkey cache die with their last reference;
+   * a refcount of 0 means a single unmanaged owner */
+  if (key->refcount > 0) {
+    key->refcount--;
+    if (key->refcount > 0) {
+      return;
+    }
+  }
+
   switch(key->type) {
     case SSH_KEYTYPE_DSS:
 #ifdef HAVE_LIBGCRYPT
@@ -250,17 +342,106 @@ void publickey_free(ssh_public_key key) {
       RSA_free(key->rsa_pub);
 #endif
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      EC_KEY_free(key->ecdsa_pub);
+      break;
+#endif
     default:
       break;
   }
   SAFE_FREE(key);
 }
 
+/*
+ * Per-thread cache of parsed peer public keys.
+ *
+ * A server's host key blob is byte-identical from one connection to the
+ * next, but publickey_from_string() re-ran the full wire-format parse
+ * and backend bignum setup on every connect. Parsed keys are kept per
+ * thread, like the keyfile cache, keyed by a SHA1 of the blob so the
+ * lookup does not have to hold on to the blobs themselves. Entries are
+ * refcounted; the cache owns one reference and recycles the oldest slot
+ * when full.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_PUBKEY_CACHE
+#endif
+
+#ifdef HAVE_PUBKEY_CACHE
+
+#define PUBKEY_CACHE_SIZE 16
+
+struct ssh_pubkey_cache_entry {
+  unsigned char digest[SHA_DIGEST_LEN];
+  ssh_public_key key; /* NULL for empty slots; the cache owns one reference */
+};
+
+static __thread struct ssh_pubkey_cache_entry pubkey_cache[PUBKEY_CACHE_SIZE];
+static __thread int pubkey_cache_next;
+
+static ssh_public_key pubkey_cache_get(const unsigned char *digest) {
+  int i;
+
+  for (i = 0; i < PUBKEY_CACHE_SIZE; i++) {
+    if (pubkey_cache[i].key != NULL &&
+        memcmp(pubkey_cache[i].digest, digest, SHA_DIGEST_LEN) == 0) {
+      pubkey_cache[i].key->refcount++;
+      return pubkey_cache[i].key;
+    }
+  }
+
+  return NULL;
+}
+
+static void pubkey_cache_put(const unsigned char *digest, ssh_public_key key) {
+  struct ssh_pubkey_cache_entry *slot;
+
+  slot = &pubkey_cache[pubkey_cache_next];
+  pubkey_cache_next = (pubkey_cache_next + 1) % PUBKEY_CACHE_SIZE;
+  if (slot->key != NULL) {
+    publickey_free(slot->key);
+  }
+  memcpy(slot->digest, digest, SHA_DIGEST_LEN);
+  slot->key = key;
+  /* one reference for the cache on top of the caller's */
+  key->refcount = 2;
+}
+
+#endif /* HAVE_PUBKEY_CACHE */
+
+/** @internal
+ * @brief Release the parsed public key cache of the calling thread.
+ */
+void ssh_pubkey_cache_flush(void) {
+#ifdef HAVE_PUBKEY_CACHE
+  int i;
+
+  for (i = 0; i < PUBKEY_CACHE_SIZE; i++) {
+    if (pubkey_cache[i].key != NULL) {
+      publickey_free(pubkey_cache[i].key);
+      pubkey_cache[i].key = NULL;
+    }
+  }
+  pubkey_cache_next = 0;
+#endif
+}
+
 ssh_public_key publickey_from_string(ssh_session session, ssh_string pubkey_s) {
   ssh_buffer tmpbuf = NULL;
   ssh_string type_s = NULL;
   char *type_c = NULL;
+  ssh_public_key key = NULL;
   int type;
+#ifdef HAVE_PUBKEY_CACHE
+  unsigned char digest[SHA_DIGEST_LEN];
+
+  sha1(ssh_string_data(pubkey_s), ssh_string_len(pubkey_s), digest);
+  key = pubkey_cache_get(digest);
+  if (key != NULL) {
+    return key;
+  }
+#endif
 
   tmpbuf = ssh_buffer_new();
   if (tmpbuf == NULL) {
@@ -288,14 +469,30 @@ ssh_public_key publickey_from_string(ssh_session session, ssh_string pubkey_s) {
 
   switch (type) {
     case SSH_KEYTYPE_DSS:
-      return publickey_make_dss(session, tmpbuf);
+      key = publickey_make_dss(session, tmpbuf);
+      break;
     case SSH_KEYTYPE_RSA:
     case SSH_KEYTYPE_RSA1:
-      return publickey_make_rsa(session, tmpbuf, type);
+      key = publickey_make_rsa(session, tmpbuf, type);
+      break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      key = publickey_make_ecdsa(session, tmpbuf);
+      break;
+#endif
+    default:
+      ssh_set_error(session, SSH_FATAL, "Unknown public key protocol %s",
+          ssh_type_to_char(type));
+      goto error;
   }
 
-  ssh_set_error(session, SSH_FATAL, "Unknown public key protocol %s",
-      ssh_type_to_char(type));
+#ifdef HAVE_PUBKEY_CACHE
+  if (key != NULL) {
+    pubkey_cache_put(digest, key);
+  }
+#endif
+
+  return key;
 
 error:
   ssh_buffer_free(tmpbuf);
@@ -466,6 +663,16 @@ ssh_public_key publickey_from_privatekey(ssh_private_key prv) {
       }
 #endif
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      /* an EC_KEY carries group and public point together, the private
+       * scalar of the copy is simply never used */
+      key->ecdsa_pub = EC_KEY_dup(prv->ecdsa_priv);
+      if (key->ecdsa_pub == NULL) {
+        goto error;
+      }
+      break;
+#endif
     default:
     	publickey_free(key);
     	return NULL;
@@ -671,6 +878,51 @@ error:
 }
 #endif
 
+#ifdef HAVE_ECC
+static int ecdsa_public_to_string(const EC_KEY *key, ssh_buffer buffer) {
+  const EC_GROUP *group = EC_KEY_get0_group(key);
+  const EC_POINT *point = EC_KEY_get0_public_key(key);
+  ssh_string curve = NULL;
+  ssh_string q = NULL;
+  size_t len;
+  int rc = -1;
+
+  curve = ssh_string_from_char("nistp256");
+  if (curve == NULL) {
+    goto error;
+  }
+
+  len = EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+      NULL, 0, NULL);
+  if (len == 0) {
+    goto error;
+  }
+  q = ssh_string_new(len);
+  if (q == NULL) {
+    goto error;
+  }
+  if (EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+        ssh_string_data(q), len, NULL) != len) {
+    goto error;
+  }
+
+  if (buffer_add_ssh_string(buffer, curve) < 0) {
+    goto error;
+  }
+  if (buffer_add_ssh_string(buffer, q) < 0) {
+    goto error;
+  }
+
+  rc = 0;
+error:
+  ssh_string_free(curve);
+  ssh_string_burn(q);
+  ssh_string_free(q);
+
+  return rc;
+}
+#endif /* HAVE_ECC */
+
 /**
  * @brief Convert a public_key object into a a SSH string.
  *
@@ -712,6 +964,13 @@ ssh_string publickey_to_string(ssh_public_key key) {
         goto error;
       }
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      if (ecdsa_public_to_string(key->ecdsa_pub, buf) < 0) {
+        goto error;
+      }
+      break;
+#endif
   }
 
   ret = ssh_string_new(buffer_get_rest_len(buf));
@@ -859,6 +1118,49 @@ ssh_string signature_to_string(SIGNATURE *sign) {
       }
 #endif
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      /* RFC 5656: the signature blob is itself a string holding
+       * mpint r and mpint s */
+      {
+        ssh_buffer rsbuf = ssh_buffer_new();
+
+        if (rsbuf == NULL) {
+          ssh_buffer_free(tmpbuf);
+          return NULL;
+        }
+        r = make_bignum_string(sign->ecdsa_sign->r);
+        s = make_bignum_string(sign->ecdsa_sign->s);
+        if (r == NULL || s == NULL ||
+            buffer_add_ssh_string(rsbuf, r) < 0 ||
+            buffer_add_ssh_string(rsbuf, s) < 0) {
+          ssh_string_free(r);
+          ssh_string_free(s);
+          ssh_buffer_free(rsbuf);
+          ssh_buffer_free(tmpbuf);
+          return NULL;
+        }
+        ssh_string_free(r);
+        ssh_string_free(s);
+
+        rs = ssh_string_new(buffer_get_rest_len(rsbuf));
+        if (rs == NULL) {
+          ssh_buffer_free(rsbuf);
+          ssh_buffer_free(tmpbuf);
+          return NULL;
+        }
+        ssh_string_fill(rs, buffer_get_rest(rsbuf), buffer_get_rest_len(rsbuf));
+        ssh_buffer_free(rsbuf);
+
+        rc = buffer_add_ssh_string(tmpbuf, rs);
+        ssh_string_free(rs);
+        if (rc < 0) {
+          ssh_buffer_free(tmpbuf);
+          return NULL;
+        }
+      }
+      break;
+#endif /* HAVE_ECC */
   }
 
   str = ssh_string_new(buffer_get_rest_len(tmpbuf));
@@ -1052,6 +1354,63 @@ SIGNATURE *signature_from_string(ssh_session session, ssh_string signature,
 #endif
 
       return sign;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+    {
+      ECDSA_SIG *esig = NULL;
+      ssh_buffer rsb = NULL;
+
+      rs = buffer_get_ssh_string(tmpbuf);
+      ssh_buffer_free(tmpbuf);
+      if (rs == NULL) {
+        signature_free(sign);
+        return NULL;
+      }
+
+      /* the blob itself holds mpint r followed by mpint s */
+      rsb = ssh_buffer_new();
+      if (rsb == NULL ||
+          buffer_add_data(rsb, ssh_string_data(rs), ssh_string_len(rs)) < 0) {
+        ssh_buffer_free(rsb);
+        ssh_string_free(rs);
+        signature_free(sign);
+        return NULL;
+      }
+      ssh_string_free(rs);
+
+      r = buffer_get_ssh_string(rsb);
+      s = buffer_get_ssh_string(rsb);
+      ssh_buffer_free(rsb);
+      if (r == NULL || s == NULL) {
+        ssh_string_free(r);
+        ssh_string_free(s);
+        signature_free(sign);
+        return NULL;
+      }
+
+      esig = ECDSA_SIG_new();
+      if (esig == NULL) {
+        ssh_string_free(r);
+        ssh_string_free(s);
+        signature_free(sign);
+        return NULL;
+      }
+      esig->r = make_string_bn(r);
+      esig->s = make_string_bn(s);
+      ssh_string_free(r);
+      ssh_string_free(s);
+      if (esig->r == NULL || esig->s == NULL) {
+        ECDSA_SIG_free(esig);
+        signature_free(sign);
+        return NULL;
+      }
+
+      sign->type = SSH_KEYTYPE_ECDSA;
+      sign->ecdsa_sign = esig;
+
+      return sign;
+    }
+#endif /* HAVE_ECC */
     default:
       return NULL;
   }
@@ -1080,6 +1439,11 @@ void signature_free(SIGNATURE *sign) {
       SAFE_FREE(sign->rsa_sign);
 #endif
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      ECDSA_SIG_free(sign->ecdsa_sign);
+      break;
+#endif
     default:
       /* FIXME Passing NULL segfaults */
 #if 0
@@ -1140,11 +1504,11 @@ ssh_string ssh_do_sign_with_agent(ssh_session session,
   }
 
   /* prepend session identifier */
-  session_id = ssh_string_new(SHA_DIGEST_LEN);
+  session_id = ssh_string_new(crypto->digest_len);
   if (session_id == NULL) {
     return NULL;
   }
-  ssh_string_fill(session_id, crypto->session_id, SHA_DIGEST_LEN);
+  ssh_string_fill(session_id, crypto->session_id, crypto->digest_len);
 
   sigbuf = ssh_buffer_new();
   if (sigbuf == NULL) {
@@ -1207,13 +1571,13 @@ ssh_buffer ssh_userauth_build_digest(ssh_session session, ssh_message msg, char
   if (buffer == NULL) {
     goto error;
   }
-  session_id = ssh_string_new(SHA_DIGEST_LEN);
+  session_id = ssh_string_new(crypto->digest_len);
   if (session_id == NULL) {
     ssh_buffer_free(buffer);
     buffer = NULL;
     goto error;
   }
-  ssh_string_fill(session_id, crypto->session_id, SHA_DIGEST_LEN);
+  ssh_string_fill(session_id, crypto->session_id, crypto->digest_len);
 
   if(buffer_add_ssh_string(buffer, session_id) < 0 ||
      buffer_add_u8(buffer, type) < 0 ||
@@ -1241,29 +1605,53 @@ error:
 /*
  * This function signs the session id (known as H) as a string then
  * the content of sigbuf */
-ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
-    ssh_private_key privatekey) {
+/** @internal
+ * @brief computes the hash a publickey authentication signature covers:
+ * the session id as an SSH string followed by the userauth request
+ *
+ * The digest depends on the key type: SHA-256 for ecdsa-sha2-nistp256,
+ * SHA-1 for everything else. It lands at hash + 1, the leading byte
+ * stays 0 for the libgcrypt DSA convention.
+ */
+static int ssh_sign_session_hash(ssh_session session, ssh_buffer sigbuf,
+    unsigned char *hash, int keytype) {
   struct ssh_crypto_struct *crypto = session->current_crypto ? session->current_crypto :
     session->next_crypto;
-  unsigned char hash[SHA_DIGEST_LEN + 1] = {0};
   ssh_string session_str = NULL;
-  ssh_string signature = NULL;
-  SIGNATURE *sign = NULL;
   SHACTX ctx = NULL;
-#ifdef HAVE_LIBGCRYPT
-  gcry_sexp_t gcryhash;
+#ifdef HAVE_ECC
+  SHA256CTX ctx256 = NULL;
 #endif
 
-  session_str = ssh_string_new(SHA_DIGEST_LEN);
+  session_str = ssh_string_new(crypto->digest_len);
   if (session_str == NULL) {
-    return NULL;
+    return SSH_ERROR;
   }
-  ssh_string_fill(session_str, crypto->session_id, SHA_DIGEST_LEN);
+  ssh_string_fill(session_str, crypto->session_id, crypto->digest_len);
+
+#ifdef HAVE_ECC
+  if (keytype == SSH_KEYTYPE_ECDSA) {
+    ctx256 = sha256_init();
+    if (ctx256 == NULL) {
+      ssh_string_free(session_str);
+      return SSH_ERROR;
+    }
+    sha256_update(ctx256, session_str, ssh_string_len(session_str) + 4);
+    ssh_string_free(session_str);
+    sha256_update(ctx256, buffer_get_rest(sigbuf), buffer_get_rest_len(sigbuf));
+    sha256_final(hash + 1, ctx256);
+    hash[0] = 0;
+
+    return SSH_OK;
+  }
+#else
+  (void) keytype;
+#endif
 
   ctx = sha1_init();
   if (ctx == NULL) {
     ssh_string_free(session_str);
-    return NULL;
+    return SSH_ERROR;
   }
 
   sha1_update(ctx, session_str, ssh_string_len(session_str) + 4);
@@ -1272,6 +1660,24 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
   sha1_final(hash + 1,ctx);
   hash[0] = 0;
 
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief signs an already computed hash with a private key
+ *
+ * This is the expensive modular exponentiation half of ssh_do_sign();
+ * the signature worker runs it off the session thread, so session may
+ * be NULL and error reporting is left to the caller in that case.
+ */
+static ssh_string ssh_sign_hash(ssh_session session, unsigned char *hash,
+    ssh_private_key privatekey) {
+  ssh_string signature = NULL;
+  SIGNATURE *sign = NULL;
+#ifdef HAVE_LIBGCRYPT
+  gcry_sexp_t gcryhash;
+#endif
+
 #ifdef DEBUG_CRYPTO
   ssh_print_hexa("Hash being signed with dsa", hash + 1, SHA_DIGEST_LEN);
 #endif
@@ -1286,7 +1692,9 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
 #ifdef HAVE_LIBGCRYPT
       if (gcry_sexp_build(&gcryhash, NULL, "%b", SHA_DIGEST_LEN + 1, hash) ||
           gcry_pk_sign(&sign->dsa_sign, gcryhash, privatekey->dsa_priv)) {
-        ssh_set_error(session, SSH_FATAL, "Signing: libcrypt error");
+        if (session != NULL) {
+          ssh_set_error(session, SSH_FATAL, "Signing: libcrypt error");
+        }
         gcry_sexp_release(gcryhash);
         signature_free(sign);
         return NULL;
@@ -1295,7 +1703,9 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
       sign->dsa_sign = DSA_do_sign(hash + 1, SHA_DIGEST_LEN,
           privatekey->dsa_priv);
       if (sign->dsa_sign == NULL) {
-        ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        if (session != NULL) {
+          ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        }
         signature_free(sign);
         return NULL;
       }
@@ -1311,7 +1721,9 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
       if (gcry_sexp_build(&gcryhash, NULL, "(data(flags pkcs1)(hash sha1 %b))",
             SHA_DIGEST_LEN, hash + 1) ||
           gcry_pk_sign(&sign->rsa_sign, gcryhash, privatekey->rsa_priv)) {
-        ssh_set_error(session, SSH_FATAL, "Signing: libcrypt error");
+        if (session != NULL) {
+          ssh_set_error(session, SSH_FATAL, "Signing: libcrypt error");
+        }
         gcry_sexp_release(gcryhash);
         signature_free(sign);
         return NULL;
@@ -1320,13 +1732,30 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
       sign->rsa_sign = RSA_do_sign(hash + 1, SHA_DIGEST_LEN,
           privatekey->rsa_priv);
       if (sign->rsa_sign == NULL) {
-        ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        if (session != NULL) {
+          ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        }
         signature_free(sign);
         return NULL;
       }
 #endif
       sign->dsa_sign = NULL;
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      sign->ecdsa_sign = ECDSA_do_sign(hash + 1, SHA256_DIGEST_LEN,
+          privatekey->ecdsa_priv);
+      if (sign->ecdsa_sign == NULL) {
+        if (session != NULL) {
+          ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        }
+        signature_free(sign);
+        return NULL;
+      }
+      sign->dsa_sign = NULL;
+      sign->rsa_sign = NULL;
+      break;
+#endif
     default:
       signature_free(sign);
       return NULL;
@@ -1343,6 +1772,187 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
   return signature;
 }
 
+ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
+    ssh_private_key privatekey) {
+  unsigned char hash[SHA256_DIGEST_LEN + 1] = {0};
+
+  if (ssh_sign_session_hash(session, sigbuf, hash, privatekey->type) != SSH_OK) {
+    return NULL;
+  }
+
+  return ssh_sign_hash(session, hash, privatekey);
+}
+
+#ifdef HAVE_PTHREAD
+
+/* an asynchronous signature computation, see ssh_userauth_pubkey(). The
+ * hash is computed on the session thread, only the private key
+ * operation runs on the worker. */
+struct ssh_sign_job_struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  unsigned char hash[SHA256_DIGEST_LEN + 1];
+  ssh_private_key key;
+  ssh_string sign;
+  int done;
+};
+
+static void *ssh_sign_job_thread(void *arg) {
+  struct ssh_sign_job_struct *job = arg;
+  ssh_string sign;
+
+  sign = ssh_sign_hash(NULL, job->hash, job->key);
+
+  pthread_mutex_lock(&job->mutex);
+  job->sign = sign;
+  job->done = 1;
+  pthread_mutex_unlock(&job->mutex);
+
+  return NULL;
+}
+
+/** @internal
+ * @brief kicks off a signature computation on a worker thread
+ *
+ * @return SSH_AGAIN when the worker took the job, SSH_OK when no worker
+ * could be started and the caller must sign synchronously, SSH_ERROR on
+ * invalid use.
+ */
+int ssh_sign_job_start(ssh_session session, ssh_buffer sigbuf,
+    ssh_private_key privatekey) {
+  struct ssh_sign_job_struct *job;
+
+  if (session->sign_job != NULL) {
+    return SSH_ERROR;
+  }
+
+  job = malloc(sizeof(struct ssh_sign_job_struct));
+  if (job == NULL) {
+    return SSH_OK;
+  }
+  ZERO_STRUCTP(job);
+  job->key = privatekey;
+
+  if (ssh_sign_session_hash(session, sigbuf, job->hash,
+        privatekey->type) != SSH_OK) {
+    SAFE_FREE(job);
+    return SSH_OK;
+  }
+
+  if (pthread_mutex_init(&job->mutex, NULL) != 0) {
+    SAFE_FREE(job);
+    return SSH_OK;
+  }
+  if (pthread_create(&job->thread, NULL, ssh_sign_job_thread, job) != 0) {
+    pthread_mutex_destroy(&job->mutex);
+    SAFE_FREE(job);
+    return SSH_OK;
+  }
+
+  session->sign_job = job;
+
+  return SSH_AGAIN;
+}
+
+/** @internal
+ * @brief 1 if a signature job is in flight on the session
+ */
+int ssh_sign_job_pending(ssh_session session) {
+  return session->sign_job != NULL;
+}
+
+/** @internal
+ * @brief 1 once the worker delivered the signature
+ */
+int ssh_sign_job_done(ssh_session session) {
+  struct ssh_sign_job_struct *job = session->sign_job;
+  int done;
+
+  if (job == NULL) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&job->mutex);
+  done = job->done;
+  pthread_mutex_unlock(&job->mutex);
+
+  return done;
+}
+
+/** @internal
+ * @brief collects the finished job and returns the signature
+ *
+ * Joins the worker, so call it only once ssh_sign_job_done() says so
+ * (or when tearing the session down). Returns NULL and sets the error
+ * when the crypto library failed.
+ */
+ssh_string ssh_sign_job_finish(ssh_session session) {
+  struct ssh_sign_job_struct *job = session->sign_job;
+  ssh_string sign;
+
+  if (job == NULL) {
+    return NULL;
+  }
+  session->sign_job = NULL;
+
+  pthread_join(job->thread, NULL);
+  pthread_mutex_destroy(&job->mutex);
+  sign = job->sign;
+  SAFE_FREE(job);
+
+  if (sign == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Signature generation failed");
+  }
+
+  return sign;
+}
+
+/** @internal
+ * @brief discards an in-flight signature job, for session teardown
+ */
+void ssh_sign_job_abort(ssh_session session) {
+  ssh_string sign;
+
+  if (session->sign_job == NULL) {
+    return;
+  }
+
+  sign = ssh_sign_job_finish(session);
+  ssh_string_free(sign);
+}
+
+#else /* HAVE_PTHREAD */
+
+int ssh_sign_job_start(ssh_session session, ssh_buffer sigbuf,
+    ssh_private_key privatekey) {
+  (void)session;
+  (void)sigbuf;
+  (void)privatekey;
+  /* no worker available, the caller signs synchronously */
+  return SSH_OK;
+}
+
+int ssh_sign_job_pending(ssh_session session) {
+  (void)session;
+  return 0;
+}
+
+int ssh_sign_job_done(ssh_session session) {
+  (void)session;
+  return 1;
+}
+
+ssh_string ssh_sign_job_finish(ssh_session session) {
+  (void)session;
+  return NULL;
+}
+
+void ssh_sign_job_abort(ssh_session session) {
+  (void)session;
+}
+
+#endif /* HAVE_PTHREAD */
+
 ssh_string ssh_encrypt_rsa1(ssh_session session, ssh_string data, ssh_public_key key) {
   ssh_string str = NULL;
   size_t len = ssh_string_len(data);
@@ -1412,7 +2022,7 @@ ssh_string ssh_encrypt_rsa1(ssh_session session, ssh_string data, ssh_public_key
 ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey) {
 	struct ssh_crypto_struct *crypto=session->current_crypto ? session->current_crypto :
     session->next_crypto;
-  unsigned char hash[SHA_DIGEST_LEN + 1] = {0};
+  unsigned char hash[SHA256_DIGEST_LEN + 1] = {0};
   ssh_string signature = NULL;
   SIGNATURE *sign = NULL;
   SHACTX ctx = NULL;
@@ -1420,13 +2030,28 @@ ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey)
   gcry_sexp_t data_sexp;
 #endif
 
-  ctx = sha1_init();
-  if (ctx == NULL) {
-    return NULL;
+#ifdef HAVE_ECC
+  /* ecdsa-sha2-nistp256 signs the SHA-256 of the exchange hash */
+  if (privatekey->type == SSH_KEYTYPE_ECDSA) {
+    SHA256CTX ctx256 = sha256_init();
+
+    if (ctx256 == NULL) {
+      return NULL;
+    }
+    sha256_update(ctx256, crypto->session_id, crypto->digest_len);
+    sha256_final(hash + 1, ctx256);
+    hash[0] = 0;
+  } else
+#endif
+  {
+    ctx = sha1_init();
+    if (ctx == NULL) {
+      return NULL;
+    }
+    sha1_update(ctx,crypto->session_id,crypto->digest_len);
+    sha1_final(hash + 1,ctx);
+    hash[0] = 0;
   }
-  sha1_update(ctx,crypto->session_id,SHA_DIGEST_LEN);
-  sha1_final(hash + 1,ctx);
-  hash[0] = 0;
 
 #ifdef DEBUG_CRYPTO
   ssh_print_hexa("Hash being signed with dsa",hash+1,SHA_DIGEST_LEN);
@@ -1485,6 +2110,19 @@ ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey)
 #endif
       sign->dsa_sign = NULL;
       break;
+#ifdef HAVE_ECC
+    case SSH_KEYTYPE_ECDSA:
+      sign->ecdsa_sign = ECDSA_do_sign(hash + 1, SHA256_DIGEST_LEN,
+          privatekey->ecdsa_priv);
+      if (sign->ecdsa_sign == NULL) {
+        ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        signature_free(sign);
+        return NULL;
+      }
+      sign->dsa_sign = NULL;
+      sign->rsa_sign = NULL;
+      break;
+#endif
     default:
       signature_free(sign);
       return NULL;
@@ -27,6 +27,10 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "libssh/priv.h"
 #include "libssh/session.h"
@@ -232,14 +236,12 @@ static int check_public_key(ssh_session session, char **tokens) {
       /* tmpstring = make_bignum_string(tmpbn); */
       /* do it manually instead */
       len = bignum_num_bytes(tmpbn);
-      tmpstring = malloc(4 + len);
+      tmpstring = ssh_string_new(len);
       if (tmpstring == NULL) {
         ssh_buffer_free(pubkey_buffer);
         bignum_free(tmpbn);
         return -1;
       }
-      /* TODO: fix the hardcoding */
-      tmpstring->size = htonl(len);
 #ifdef HAVE_LIBGCRYPT
       bignum_bn2bin(tmpbn, len, tmpstring->string);
 #elif defined HAVE_LIBCRYPTO
@@ -374,6 +376,555 @@ static int match_hashed_host(ssh_session session, const char *host,
   return match;
 }
 
+/*
+ * In-memory index of a known_hosts file.
+ *
+ * The file is parsed once and kept as a hash table keyed by the host
+ * pattern, so that ssh_is_server_known() does not have to re-open and
+ * re-tokenize the whole file for every new session. Hashed and wildcard
+ * entries cannot be keyed and stay on a linear scan list. The cache is
+ * invalidated when the file's mtime or size changes and is kept per
+ * thread, like the buffer pool, to avoid locking.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define HAVE_KNOWNHOSTS_CACHE 1
+
+#define KNOWNHOSTS_BUCKETS 1024
+
+struct ssh_kh_entry {
+  struct ssh_kh_entry *next;
+  char **tokens;
+  const char *type;
+  char *key;    /* lowercased host pattern, NULL for scan-list entries */
+};
+
+struct ssh_kh_cache {
+  char *filename;
+  time_t mtime;
+  off_t size;
+  struct ssh_kh_entry *buckets[KNOWNHOSTS_BUCKETS];
+  struct ssh_kh_entry *scan;   /* hashed and wildcard entries */
+};
+
+static __thread struct ssh_kh_cache *kh_cache;
+
+static unsigned int kh_hash_raw(const char *s) {
+  unsigned int h = 5381;
+
+  while (*s) {
+    h = h * 33 + (unsigned char)*s++;
+  }
+
+  return h;
+}
+
+static unsigned int kh_hash(const char *s) {
+  return kh_hash_raw(s) % KNOWNHOSTS_BUCKETS;
+}
+
+static void kh_entry_list_free(struct ssh_kh_entry *e) {
+  while (e != NULL) {
+    struct ssh_kh_entry *next = e->next;
+
+    tokens_free(e->tokens);
+    SAFE_FREE(e->key);
+    SAFE_FREE(e);
+    e = next;
+  }
+}
+
+/*
+ * Compiled companion file for a known_hosts file, stored next to it as
+ * "<file>.bin". It holds the keyable entries as a hash table of raw
+ * (base64-decoded) key blobs, so a cold start against a huge host
+ * database is one mmap() and one bucket walk instead of tokenizing and
+ * decoding every line. The companion records the mtime and size of the
+ * text file it was compiled from and is rewritten, best effort, whenever
+ * the in-memory index is rebuilt. Entries the table cannot represent
+ * (hashed, wildcard, negated or rsa1 lines) set the UNKEYED flag; a
+ * lookup that does not end in KNOWN_OK then falls back to the full scan.
+ * The format is native-endian: the file is a per-machine cache, never
+ * exchanged.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define KH_BIN_MAGIC "SSHkhb1"
+#define KH_BIN_BUCKETS 4096
+#define KH_BIN_UNKEYED 1
+
+struct kh_bin_header {
+  char magic[8];
+  uint32_t buckets;
+  uint32_t flags;
+  uint32_t entries;
+  uint32_t reserved;
+  uint64_t src_mtime;
+  uint64_t src_size;
+};
+
+/* each entry: uint32_t next, host_len, type_len, blob_len, then
+ * "host\0type\0blob" padded to a 4 byte boundary; offsets are from the
+ * start of the file, 0 terminates a chain */
+#define KH_BIN_ENTRY_FIXED (4 * sizeof(uint32_t))
+
+struct ssh_kh_bin {
+  char *path;          /* companion file path */
+  unsigned char *map;
+  size_t len;
+};
+
+static __thread struct ssh_kh_bin kh_bin;
+
+static void kh_bin_close(void) {
+  if (kh_bin.map != NULL) {
+    munmap(kh_bin.map, kh_bin.len);
+    kh_bin.map = NULL;
+    kh_bin.len = 0;
+  }
+  SAFE_FREE(kh_bin.path);
+}
+
+static char *kh_bin_path(const char *filename) {
+  size_t len = strlen(filename) + 5;
+  char *path = malloc(len);
+
+  if (path != NULL) {
+    snprintf(path, len, "%s.bin", filename);
+  }
+
+  return path;
+}
+
+/** @internal
+ * @brief Maps the companion of a known_hosts file, reusing the mapping of
+ * the previous call when possible. Returns NULL if there is none or it
+ * was compiled from another version of the text file.
+ */
+static const struct kh_bin_header *kh_bin_get(const char *filename,
+    const struct stat *sb) {
+  const struct kh_bin_header *h;
+  char *path;
+  void *map;
+  struct stat bsb;
+  int fd;
+
+  path = kh_bin_path(filename);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  if (kh_bin.map == NULL || kh_bin.path == NULL ||
+      strcmp(kh_bin.path, path) != 0) {
+    kh_bin_close();
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      SAFE_FREE(path);
+      return NULL;
+    }
+    if (fstat(fd, &bsb) < 0 ||
+        (size_t)bsb.st_size < sizeof(struct kh_bin_header)) {
+      close(fd);
+      SAFE_FREE(path);
+      return NULL;
+    }
+    map = mmap(NULL, bsb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      SAFE_FREE(path);
+      return NULL;
+    }
+    kh_bin.map = map;
+    kh_bin.len = bsb.st_size;
+    kh_bin.path = path;
+  } else {
+    SAFE_FREE(path);
+  }
+
+  h = (const struct kh_bin_header *)kh_bin.map;
+  if (memcmp(h->magic, KH_BIN_MAGIC, sizeof(h->magic)) != 0 ||
+      h->buckets == 0 ||
+      kh_bin.len < sizeof(*h) + h->buckets * sizeof(uint32_t) ||
+      h->src_mtime != (uint64_t)sb->st_mtime ||
+      h->src_size != (uint64_t)sb->st_size) {
+    /* stale or damaged; the next index rebuild replaces it */
+    kh_bin_close();
+    return NULL;
+  }
+
+  return h;
+}
+
+/** @internal
+ * @brief Walks the companion chain of one lookup key, updating the
+ * verdict like kh_check_entry(). Returns 1 when the lookup is settled.
+ */
+static int kh_bin_match(ssh_session session, const struct kh_bin_header *h,
+    const char *key, int *ret) {
+  ssh_string pubkey = session->current_crypto->server_pubkey;
+  const uint32_t *table =
+      (const uint32_t *)(kh_bin.map + sizeof(struct kh_bin_header));
+  uint32_t off = table[kh_hash_raw(key) % h->buckets];
+  size_t keylen = strlen(key);
+
+  while (off != 0) {
+    uint32_t fields[4]; /* next, host_len, type_len, blob_len */
+    const char *host, *type;
+    const unsigned char *blob;
+
+    if (off + KH_BIN_ENTRY_FIXED > kh_bin.len) {
+      break; /* corrupt chain, give up on the companion */
+    }
+    memcpy(fields, kh_bin.map + off, sizeof(fields));
+    if (off + KH_BIN_ENTRY_FIXED + fields[1] + fields[2] + fields[3] + 2 >
+        kh_bin.len) {
+      break;
+    }
+    host = (const char *)kh_bin.map + off + KH_BIN_ENTRY_FIXED;
+    type = host + fields[1] + 1;
+    blob = (const unsigned char *)type + fields[2] + 1;
+
+    if (fields[1] == keylen && memcmp(host, key, keylen) == 0) {
+      if (strcmp(session->current_crypto->server_pubkey_type, type) != 0) {
+        if (*ret != SSH_SERVER_KNOWN_CHANGED) {
+          *ret = SSH_SERVER_FOUND_OTHER;
+        }
+      } else if (fields[3] == ssh_string_len(pubkey) &&
+          memcmp(blob, ssh_string_data(pubkey), fields[3]) == 0) {
+        *ret = SSH_SERVER_KNOWN_OK;
+        return 1;
+      } else {
+        *ret = SSH_SERVER_KNOWN_CHANGED;
+      }
+    }
+    off = fields[0];
+  }
+
+  return 0;
+}
+
+/** @internal
+ * @brief ssh_is_server_known() served from the compiled companion.
+ * Returns 1 if *ret is the final verdict, 0 if the caller must fall back
+ * to the text file (no usable companion, or the companion cannot rule
+ * out a match on a hashed/wildcard line).
+ */
+static int kh_bin_is_server_known(ssh_session session, const char *filename,
+    const char *host, const char *hostport, int *ret) {
+  const struct kh_bin_header *h;
+  struct stat sb;
+
+  if (stat(filename, &sb) < 0) {
+    return 0;
+  }
+  h = kh_bin_get(filename, &sb);
+  if (h == NULL) {
+    return 0;
+  }
+  if (kh_bin_match(session, h, host, ret) ||
+      kh_bin_match(session, h, hostport, ret)) {
+    return 1;
+  }
+
+  return (h->flags & KH_BIN_UNKEYED) ? 0 : 1;
+}
+
+/** @internal
+ * @brief Compiles the freshly built in-memory index into the companion
+ * file, atomically via a temporary. Best effort: read-only directories
+ * or allocation failures just leave the text file authoritative.
+ */
+static void kh_bin_write(const char *filename, const struct stat *sb,
+    const struct ssh_kh_cache *cache) {
+  uint32_t heads[KH_BIN_BUCKETS];
+  struct kh_bin_header hdr;
+  unsigned char *body = NULL;
+  size_t body_len = 0, body_cap = 0, header_len;
+  uint32_t flags = 0, count = 0;
+  char *path = NULL, *tmp = NULL;
+  FILE *f = NULL;
+  size_t len;
+  int i;
+
+  if (kh_bin_get(filename, sb) != NULL) {
+    return; /* companion is already current */
+  }
+
+  header_len = sizeof(hdr) + sizeof(heads);
+  memset(heads, 0, sizeof(heads));
+  if (cache->scan != NULL) {
+    flags |= KH_BIN_UNKEYED;
+  }
+
+  for (i = 0; i < KNOWNHOSTS_BUCKETS; i++) {
+    struct ssh_kh_entry *e;
+
+    for (e = cache->buckets[i]; e != NULL; e = e->next) {
+      ssh_buffer blob;
+      uint32_t fields[4];
+      size_t need, hlen, tlen, blen;
+      unsigned int b;
+
+      if (alldigits(e->tokens[1])) {
+        /* rsa1 line; representable only in text form */
+        flags |= KH_BIN_UNKEYED;
+        continue;
+      }
+      blob = base64_to_bin(e->tokens[2]);
+      if (blob == NULL) {
+        flags |= KH_BIN_UNKEYED;
+        continue;
+      }
+      hlen = strlen(e->key);
+      tlen = strlen(e->type);
+      blen = buffer_get_rest_len(blob);
+      need = KH_BIN_ENTRY_FIXED + ((hlen + tlen + blen + 2 + 3) & ~(size_t)3);
+      if (body_len + need > body_cap) {
+        unsigned char *grown;
+
+        body_cap = body_cap ? body_cap * 2 : 65536;
+        while (body_len + need > body_cap) {
+          body_cap *= 2;
+        }
+        grown = realloc(body, body_cap);
+        if (grown == NULL) {
+          ssh_buffer_free(blob);
+          goto out;
+        }
+        body = grown;
+      }
+      b = kh_hash_raw(e->key) % KH_BIN_BUCKETS;
+      fields[0] = heads[b];
+      fields[1] = hlen;
+      fields[2] = tlen;
+      fields[3] = blen;
+      heads[b] = header_len + body_len;
+      memset(body + body_len, 0, need);
+      memcpy(body + body_len, fields, sizeof(fields));
+      memcpy(body + body_len + KH_BIN_ENTRY_FIXED, e->key, hlen);
+      memcpy(body + body_len + KH_BIN_ENTRY_FIXED + hlen + 1, e->type, tlen);
+      memcpy(body + body_len + KH_BIN_ENTRY_FIXED + hlen + 1 + tlen + 1,
+          buffer_get_rest(blob), blen);
+      body_len += need;
+      count++;
+      ssh_buffer_free(blob);
+    }
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, KH_BIN_MAGIC, sizeof(hdr.magic));
+  hdr.buckets = KH_BIN_BUCKETS;
+  hdr.flags = flags;
+  hdr.entries = count;
+  hdr.src_mtime = (uint64_t)sb->st_mtime;
+  hdr.src_size = (uint64_t)sb->st_size;
+
+  path = kh_bin_path(filename);
+  if (path == NULL) {
+    goto out;
+  }
+  len = strlen(path) + 5;
+  tmp = malloc(len);
+  if (tmp == NULL) {
+    goto out;
+  }
+  snprintf(tmp, len, "%s.tmp", path);
+
+  f = fopen(tmp, "wb");
+  if (f == NULL) {
+    goto out;
+  }
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(heads, sizeof(heads), 1, f) != 1 ||
+      (body_len > 0 && fwrite(body, body_len, 1, f) != 1)) {
+    fclose(f);
+    f = NULL;
+    unlink(tmp);
+    goto out;
+  }
+  if (fclose(f) != 0) {
+    f = NULL;
+    unlink(tmp);
+    goto out;
+  }
+  f = NULL;
+  if (rename(tmp, path) < 0) {
+    unlink(tmp);
+  }
+
+out:
+  SAFE_FREE(body);
+  SAFE_FREE(path);
+  SAFE_FREE(tmp);
+}
+
+/** @internal
+ * @brief Release the known_hosts cache of the calling thread.
+ */
+void ssh_knownhosts_cache_flush(void) {
+  int i;
+
+  kh_bin_close();
+  if (kh_cache == NULL) {
+    return;
+  }
+  for (i = 0; i < KNOWNHOSTS_BUCKETS; i++) {
+    kh_entry_list_free(kh_cache->buckets[i]);
+  }
+  kh_entry_list_free(kh_cache->scan);
+  SAFE_FREE(kh_cache->filename);
+  SAFE_FREE(kh_cache);
+}
+
+/** @internal
+ * @brief Return the cache for a known_hosts file, (re)building it if the
+ * file changed. NULL means the caller should fall back to scanning the
+ * file directly.
+ */
+static struct ssh_kh_cache *kh_cache_get(ssh_session session,
+    const char *filename) {
+  struct stat sb;
+  FILE *file = NULL;
+  char **tokens;
+  const char *type;
+
+  if (stat(filename, &sb) < 0) {
+    return NULL;
+  }
+  if (kh_cache != NULL &&
+      strcmp(kh_cache->filename, filename) == 0 &&
+      kh_cache->mtime == sb.st_mtime &&
+      kh_cache->size == sb.st_size) {
+    return kh_cache;
+  }
+
+  ssh_knownhosts_cache_flush();
+  kh_cache = malloc(sizeof(struct ssh_kh_cache));
+  if (kh_cache == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(kh_cache);
+  kh_cache->filename = strdup(filename);
+  if (kh_cache->filename == NULL) {
+    SAFE_FREE(kh_cache);
+    return NULL;
+  }
+  kh_cache->mtime = sb.st_mtime;
+  kh_cache->size = sb.st_size;
+
+  while ((tokens = ssh_get_knownhost_line(session, &file,
+          filename, &type)) != NULL) {
+    struct ssh_kh_entry *e;
+
+    e = malloc(sizeof(struct ssh_kh_entry));
+    if (e == NULL) {
+      tokens_free(tokens);
+      if (file != NULL) {
+        fclose(file);
+      }
+      ssh_knownhosts_cache_flush();
+      return NULL;
+    }
+    ZERO_STRUCTP(e);
+    e->tokens = tokens;
+    e->type = type;
+    /* hashed, wildcard and negated patterns cannot be keyed */
+    if (strpbrk(tokens[0], "|*?!,") == NULL) {
+      e->key = ssh_lowercase(tokens[0]);
+    }
+    if (e->key != NULL) {
+      unsigned int h = kh_hash(e->key);
+
+      e->next = kh_cache->buckets[h];
+      kh_cache->buckets[h] = e;
+    } else {
+      e->next = kh_cache->scan;
+      kh_cache->scan = e;
+    }
+  }
+
+  /* compile the index to disk so the next process skips the parse */
+  kh_bin_write(filename, &sb, kh_cache);
+
+  return kh_cache;
+}
+
+/** @internal
+ * @brief Evaluate one matching entry, updating the lookup state the same
+ * way the file scanning loop does. Returns 1 when scanning can stop.
+ */
+static int kh_check_entry(ssh_session session, struct ssh_kh_entry *e,
+    int *ret) {
+  int match;
+
+  if (strcmp(session->current_crypto->server_pubkey_type, e->type) != 0) {
+    /* Different type. We don't override the known_changed error which is
+     * more important */
+    if (*ret != SSH_SERVER_KNOWN_CHANGED) {
+      *ret = SSH_SERVER_FOUND_OTHER;
+    }
+    return 0;
+  }
+
+  match = check_public_key(session, e->tokens);
+  if (match < 0) {
+    *ret = SSH_SERVER_ERROR;
+    return 1;
+  } else if (match == 1) {
+    *ret = SSH_SERVER_KNOWN_OK;
+    return 1;
+  }
+  /* We override the status with the wrong key state */
+  *ret = SSH_SERVER_KNOWN_CHANGED;
+  return 0;
+}
+
+/** @internal
+ * @brief ssh_is_server_known() served from the in-memory index.
+ */
+static int ssh_is_server_known_cached(ssh_session session,
+    struct ssh_kh_cache *cache, const char *host, const char *hostport) {
+  struct ssh_kh_entry *e;
+  int ret = SSH_SERVER_NOT_KNOWN;
+  int match;
+
+  for (e = cache->buckets[kh_hash(host)]; e != NULL; e = e->next) {
+    if (strcmp(e->key, host) == 0 && kh_check_entry(session, e, &ret)) {
+      return ret;
+    }
+  }
+  for (e = cache->buckets[kh_hash(hostport)]; e != NULL; e = e->next) {
+    if (strcmp(e->key, hostport) == 0 && kh_check_entry(session, e, &ret)) {
+      return ret;
+    }
+  }
+  for (e = cache->scan; e != NULL; e = e->next) {
+    match = match_hashed_host(session, host, e->tokens[0]);
+    if (match == 0) {
+      match = match_hostname(hostport, e->tokens[0], strlen(e->tokens[0]));
+    }
+    if (match == 0) {
+      match = match_hostname(host, e->tokens[0], strlen(e->tokens[0]));
+    }
+    if (match == 0) {
+      match = match_hashed_host(session, hostport, e->tokens[0]);
+    }
+    if (match && kh_check_entry(session, e, &ret)) {
+      return ret;
+    }
+  }
+
+  return ret;
+}
+#else /* no thread local storage, no cache */
+
+void ssh_knownhosts_cache_flush(void) {
+    return;
+}
+#endif
+
 /* How it's working :
  * 1- we open the known host file and bitch if it doesn't exist
  * 2- we need to examine each line of the file, until going on state SSH_SERVER_KNOWN_OK:
@@ -453,6 +1004,23 @@ int ssh_is_server_known(ssh_session session) {
     return SSH_SERVER_ERROR;
   }
 
+#ifdef HAVE_KNOWNHOSTS_CACHE
+  /* the compiled companion answers without parsing the text file */
+  if (kh_bin_is_server_known(session, session->knownhosts, host, hostport,
+        &ret)) {
+    goto out;
+  }
+  ret = SSH_SERVER_NOT_KNOWN;
+  {
+    struct ssh_kh_cache *cache = kh_cache_get(session, session->knownhosts);
+
+    if (cache != NULL) {
+      ret = ssh_is_server_known_cached(session, cache, host, hostport);
+      goto out;
+    }
+  }
+#endif
+
   do {
     tokens = ssh_get_knownhost_line(session, &file,
         session->knownhosts, &type);
@@ -500,6 +1068,9 @@ int ssh_is_server_known(ssh_session session) {
     }
   } while (1);
 
+#ifdef HAVE_KNOWNHOSTS_CACHE
+out:
+#endif
   if ( (ret == SSH_SERVER_NOT_KNOWN) && (session->StrictHostKeyChecking == 0) ) {
     ssh_write_knownhost(session);
     ret = SSH_SERVER_KNOWN_OK;
@@ -511,6 +1082,11 @@ int ssh_is_server_known(ssh_session session) {
     fclose(file);
   }
 
+  if (ret == SSH_SERVER_KNOWN_OK) {
+    /* unblocks channel opens on deferred-hostkey sessions */
+    session->hostkey_verified = 1;
+  }
+
   /* Return the current state at end of file */
   leave_function();
   return ret;
@@ -37,6 +37,7 @@
 #include <openssl/dsa.h>
 #include <openssl/rsa.h>
 #include <openssl/hmac.h>
+#include <openssl/evp.h>
 #include <openssl/opensslv.h>
 #ifdef HAVE_OPENSSL_AES_H
 #define HAS_AES
@@ -89,6 +90,29 @@ void sha1(unsigned char *digest, int len, unsigned char *hash) {
   SHA1(digest, len, hash);
 }
 
+SHA256CTX sha256_init(void) {
+  SHA256CTX c = malloc(sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  SHA256_Init(c);
+
+  return c;
+}
+
+void sha256_update(SHA256CTX c, const void *data, unsigned long len) {
+  SHA256_Update(c,data,len);
+}
+
+void sha256_final(unsigned char *md, SHA256CTX c) {
+  SHA256_Final(md, c);
+  SAFE_FREE(c);
+}
+
+void sha256(unsigned char *digest, int len, unsigned char *hash) {
+  SHA256(digest, len, hash);
+}
+
 MD5CTX md5_init(void) {
   MD5CTX c = malloc(sizeof(*c));
   if (c == NULL) {
@@ -152,6 +176,30 @@ void hmac_final(HMACCTX ctx, unsigned char *hashmacbuf, unsigned int *len) {
   SAFE_FREE(ctx);
 }
 
+/* produce the MAC and reset the context for the next message, keeping the
+ * key schedule */
+void hmac_final_reset(HMACCTX ctx, unsigned char *hashmacbuf,
+    unsigned int *len) {
+  HMAC_Final(ctx, hashmacbuf, len);
+#ifndef OLD_CRYPTO
+  HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+#else
+  HMAC_Init(ctx, NULL, 0, NULL);
+#endif
+}
+
+void hmac_free(HMACCTX ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+#ifndef OLD_CRYPTO
+  HMAC_CTX_cleanup(ctx);
+#else
+  HMAC_cleanup(ctx);
+#endif
+  SAFE_FREE(ctx);
+}
+
 #ifdef HAS_BLOWFISH
 /* the wrapper functions for blowfish */
 static int blowfish_set_key(struct crypto_struct *cipher, void *key){
@@ -177,6 +225,98 @@ static void blowfish_decrypt(struct crypto_struct *cipher, void *in,
 #endif /* HAS_BLOWFISH */
 
 #ifdef HAS_AES
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10001000L)
+/* EVP_aes_*_ctr() appeared in 1.0.1; going through EVP also makes libcrypto
+ * pick its AES-NI code paths, which the low-level AES_* functions never do.
+ */
+#define HAVE_OPENSSL_EVP_AES
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_AES
+
+struct ssh_aes_key_struct {
+  EVP_CIPHER_CTX *ctx;
+  unsigned char key[32]; /* big enough for aes256 */
+};
+
+static const EVP_CIPHER *aes_get_evp(struct crypto_struct *cipher) {
+  int ctr = strstr(cipher->name, "-ctr") != NULL;
+
+  switch (cipher->keysize) {
+    case 128:
+      return ctr ? EVP_aes_128_ctr() : EVP_aes_128_cbc();
+    case 192:
+      return ctr ? EVP_aes_192_ctr() : EVP_aes_192_cbc();
+    case 256:
+      return ctr ? EVP_aes_256_ctr() : EVP_aes_256_cbc();
+  }
+
+  return NULL;
+}
+
+/* the EVP context is created lazily at the first encryption call, because
+ * the IV is not known yet when the key is set */
+static int aes_set_key(struct crypto_struct *cipher, void *key) {
+  struct ssh_aes_key_struct *aes;
+
+  if (cipher->key == NULL) {
+    if (alloc_key(cipher) < 0) {
+      return -1;
+    }
+    aes = cipher->key;
+    aes->ctx = NULL;
+    memcpy(aes->key, key, cipher->keysize / 8);
+  }
+
+  return 0;
+}
+
+static void aes_evp_crypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, void *IV, int enc) {
+  struct ssh_aes_key_struct *aes = cipher->key;
+  int outlen = 0;
+
+  if (aes->ctx == NULL) {
+    aes->ctx = EVP_CIPHER_CTX_new();
+    if (aes->ctx == NULL) {
+      return;
+    }
+    EVP_CipherInit_ex(aes->ctx, aes_get_evp(cipher), NULL, aes->key, IV, enc);
+    EVP_CIPHER_CTX_set_padding(aes->ctx, 0);
+  }
+  EVP_CipherUpdate(aes->ctx, out, &outlen, in, len);
+}
+
+static void aes_encrypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, void *IV) {
+  aes_evp_crypt(cipher, in, out, len, IV, 1);
+}
+
+static void aes_decrypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, void *IV) {
+  aes_evp_crypt(cipher, in, out, len, IV, 0);
+}
+
+static void aes_cleanup(struct crypto_struct *cipher) {
+  struct ssh_aes_key_struct *aes = cipher->key;
+
+  if (aes != NULL && aes->ctx != NULL) {
+    EVP_CIPHER_CTX_free(aes->ctx);
+    aes->ctx = NULL;
+  }
+}
+
+#ifndef BROKEN_AES_CTR
+/* CTR encryption and decryption are the same operation */
+static void aes_ctr128_encrypt(struct crypto_struct *cipher, void *in,
+    void *out, unsigned long len, void *IV) {
+  aes_evp_crypt(cipher, in, out, len, IV, 1);
+}
+#endif /* BROKEN_AES_CTR */
+
+#else /* HAVE_OPENSSL_EVP_AES */
+
 static int aes_set_encrypt_key(struct crypto_struct *cipher, void *key) {
   if (cipher->key == NULL) {
     if (alloc_key(cipher) < 0) {
@@ -237,6 +377,21 @@ static void aes_ctr128_encrypt(struct crypto_struct *cipher, void *in, void *out
   AES_ctr128_encrypt(in, out, len, cipher->key, IV, tmp_buffer, &num);
 }
 #endif /* BROKEN_AES_CTR */
+
+#endif /* HAVE_OPENSSL_EVP_AES */
+
+#ifdef HAVE_OPENSSL_EVP_AES
+#define AES_KEYLEN          sizeof(struct ssh_aes_key_struct)
+#define AES_SET_ENCRYPT_KEY aes_set_key
+#define AES_SET_DECRYPT_KEY aes_set_key
+#define AES_CLEANUP         aes_cleanup
+#else
+#define AES_KEYLEN          sizeof(AES_KEY)
+#define AES_SET_ENCRYPT_KEY aes_set_encrypt_key
+#define AES_SET_DECRYPT_KEY aes_set_decrypt_key
+#define AES_CLEANUP         NULL
+#endif
+
 #endif /* HAS_AES */
 
 #ifdef HAS_DES
@@ -324,7 +479,8 @@ static struct crypto_struct ssh_ciphertab[] = {
     blowfish_set_key,
     blowfish_set_key,
     blowfish_encrypt,
-    blowfish_decrypt
+    blowfish_decrypt,
+    NULL
   },
 #endif /* HAS_BLOWFISH */
 #ifdef HAS_AES
@@ -332,69 +488,75 @@ static struct crypto_struct ssh_ciphertab[] = {
   {
     "aes128-ctr",
     16,
-    sizeof(AES_KEY),
+    AES_KEYLEN,
     NULL,
     128,
-    aes_set_encrypt_key,
-    aes_set_encrypt_key,
+    AES_SET_ENCRYPT_KEY,
+    AES_SET_ENCRYPT_KEY,
+    aes_ctr128_encrypt,
     aes_ctr128_encrypt,
-    aes_ctr128_encrypt
+    AES_CLEANUP
   },
   {
     "aes192-ctr",
     16,
-    sizeof(AES_KEY),
+    AES_KEYLEN,
     NULL,
     192,
-    aes_set_encrypt_key,
-    aes_set_encrypt_key,
+    AES_SET_ENCRYPT_KEY,
+    AES_SET_ENCRYPT_KEY,
     aes_ctr128_encrypt,
-    aes_ctr128_encrypt
+    aes_ctr128_encrypt,
+    AES_CLEANUP
   },
   {
     "aes256-ctr",
     16,
-    sizeof(AES_KEY),
+    AES_KEYLEN,
     NULL,
     256,
-    aes_set_encrypt_key,
-    aes_set_encrypt_key,
+    AES_SET_ENCRYPT_KEY,
+    AES_SET_ENCRYPT_KEY,
+    aes_ctr128_encrypt,
     aes_ctr128_encrypt,
-    aes_ctr128_encrypt
+    AES_CLEANUP
   },
 #endif /* BROKEN_AES_CTR */
   {
     "aes128-cbc",
     16,
-    sizeof(AES_KEY),
+    AES_KEYLEN,
     NULL,
     128,
-    aes_set_encrypt_key,
-    aes_set_decrypt_key,
+    AES_SET_ENCRYPT_KEY,
+    AES_SET_DECRYPT_KEY,
     aes_encrypt,
-    aes_decrypt
+    aes_decrypt,
+    AES_CLEANUP
   },
   {
     "aes192-cbc",
     16,
-    sizeof(AES_KEY),
+    AES_KEYLEN,
     NULL,
     192,
-    aes_set_encrypt_key,
-    aes_set_decrypt_key,
+    AES_SET_ENCRYPT_KEY,
+    AES_SET_DECRYPT_KEY,
     aes_encrypt,
-    aes_decrypt
+    aes_decrypt,
+    AES_CLEANUP
   },
   {
     "aes256-cbc",
     16,
-    sizeof(AES_KEY),
+    AES_KEYLEN,
     NULL,
     256,
-    aes_set_encrypt_key,
-    aes_set_decrypt_key,
+    AES_SET_ENCRYPT_KEY,
+    AES_SET_DECRYPT_KEY,
     aes_encrypt,
-    aes_decrypt
+    aes_decrypt,
+    AES_CLEANUP
   },
 #endif /* HAS_AES */
 #ifdef HAS_DES
@@ -407,7 +569,8 @@ static struct crypto_struct ssh_ciphertab[] = {
     des3_set_key,
     des3_set_key,
     des3_encrypt,
-    des3_decrypt
+    des3_decrypt,
+    NULL
   },
   {
     "3des-cbc-ssh1",
@@ -418,7 +581,8 @@ static struct crypto_struct ssh_ciphertab[] = {
     des3_set_key,
     des3_set_key,
     des3_1_encrypt,
-    des3_1_decrypt
+    des3_1_decrypt,
+    NULL
   },
 #endif /* HAS_DES */
   {
@@ -430,6 +594,7 @@ static struct crypto_struct ssh_ciphertab[] = {
     NULL,
     NULL,
     NULL,
+    NULL,
     NULL
   }
 };
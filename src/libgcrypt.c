@@ -62,6 +62,27 @@ void sha1(unsigned char *digest, int len, unsigned char *hash) {
   gcry_md_hash_buffer(GCRY_MD_SHA1, hash, digest, len);
 }
 
+SHA256CTX sha256_init(void) {
+  SHA256CTX ctx = NULL;
+  gcry_md_open(&ctx, GCRY_MD_SHA256, 0);
+
+  return ctx;
+}
+
+void sha256_update(SHA256CTX c, const void *data, unsigned long len) {
+  gcry_md_write(c, data, len);
+}
+
+void sha256_final(unsigned char *md, SHA256CTX c) {
+  gcry_md_final(c);
+  memcpy(md, gcry_md_read(c, 0), SHA256_DIGEST_LEN);
+  gcry_md_close(c);
+}
+
+void sha256(unsigned char *digest, int len, unsigned char *hash) {
+  gcry_md_hash_buffer(GCRY_MD_SHA256, hash, digest, len);
+}
+
 MD5CTX md5_init(void) {
   MD5CTX c = NULL;
   gcry_md_open(&c, GCRY_MD_MD5, 0);
@@ -108,6 +129,20 @@ void hmac_final(HMACCTX c, unsigned char *hashmacbuf, unsigned int *len) {
   gcry_md_close(c);
 }
 
+/* produce the MAC and reset the context for the next message, keeping the
+ * key schedule */
+void hmac_final_reset(HMACCTX c, unsigned char *hashmacbuf, unsigned int *len) {
+  *len = gcry_md_get_algo_dlen(gcry_md_get_algo(c));
+  memcpy(hashmacbuf, gcry_md_read(c, 0), *len);
+  gcry_md_reset(c);
+}
+
+void hmac_free(HMACCTX c) {
+  if (c != NULL) {
+    gcry_md_close(c);
+  }
+}
+
 /* the wrapper functions for blowfish */
 static int blowfish_set_key(struct crypto_struct *cipher, void *key, void *IV){
   if (cipher->key == NULL) {
@@ -28,6 +28,9 @@
 #include "libssh/priv.h"
 #include "libssh/session.h"
 
+/* this file defines the real function the priv.h wrapper macro calls */
+#undef ssh_log
+
 /**
  * @defgroup libssh_log The SSH logging functions.
  * @ingroup libssh
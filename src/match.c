@@ -36,93 +36,108 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include "libssh/priv.h"
 
 /*
- * Returns true if the given string matches the pattern (which may contain ?
+ * Returns true if the given string matches the glob (which may contain ?
  * and * as wildcards), and zero if it does not match.
+ *
+ * Iterative: a '*' remembers its position and the matcher resumes from
+ * it when the tail fails, so matching is a linear scan with single-star
+ * backtracking instead of a recursive walk per wildcard.
  */
-static int match_pattern(const char *s, const char *pattern) {
-  for (;;) {
-    /* If at end of pattern, accept if also at end of string. */
-    if (!*pattern) {
-      return !*s;
-    }
+static int match_glob(const char *s, const char *glob) {
+  const char *star = NULL;
+  const char *star_s = NULL;
 
-    if (*pattern == '*') {
-      /* Skip the asterisk. */
-      pattern++;
-
-      /* If at end of pattern, accept immediately. */
-      if (!*pattern)
-        return 1;
-
-      /* If next character in pattern is known, optimize. */
-      if (*pattern != '?' && *pattern != '*') {
-        /*
-         * Look instances of the next character in
-         * pattern, and try to match starting from
-         * those.
-         */
-        for (; *s; s++)
-          if (*s == *pattern && match_pattern(s + 1, pattern + 1)) {
-            return 1;
-          }
-        /* Failed. */
-        return 0;
-      }
-      /*
-       * Move ahead one character at a time and try to
-       * match at each position.
-       */
-      for (; *s; s++) {
-        if (match_pattern(s, pattern)) {
-          return 1;
-        }
-      }
-      /* Failed. */
-      return 0;
-    }
-    /*
-     * There must be at least one more character in the string.
-     * If we are at the end, fail.
-     */
-    if (!*s) {
-      return 0;
-    }
-
-    /* Check if the next character of the string is acceptable. */
-    if (*pattern != '?' && *pattern != *s) {
+  while (*s) {
+    if (*glob == '*') {
+      star = glob++;
+      star_s = s;
+    } else if (*glob == '?' || *glob == *s) {
+      glob++;
+      s++;
+    } else if (star != NULL) {
+      /* mismatch after a star: let the star eat one more character */
+      glob = star + 1;
+      s = ++star_s;
+    } else {
       return 0;
     }
+  }
 
-    /* Move to the next character, both in string and in pattern. */
-    s++;
-    pattern++;
+  /* Trailing stars match the empty tail. */
+  while (*glob == '*') {
+    glob++;
   }
 
-  /* NOTREACHED */
+  return !*glob;
 }
 
+/* A compiled pattern list: its subpatterns, split and normalized once. */
+struct ssh_match_sub {
+  char *glob;
+  int negated;
+};
+
+struct ssh_match_program {
+  struct ssh_match_program *next;
+  char *pattern; /* cache key, together with len and dolower */
+  unsigned int len;
+  int dolower;
+  struct ssh_match_sub *subs;
+  int nsubs;
+};
+
 /*
- * Tries to match the string against the comma-separated sequence of subpatterns
- * (each possibly preceded by ! to indicate negation).
- * Returns -1 if negation matches, 1 if there is a positive match, 0 if there is
- * no match at all.
+ * Splitting and lowercasing the comma list happens per subpattern on
+ * every call otherwise, and config evaluation runs the same few
+ * patterns against every session's host. Keep the most recent compiled
+ * patterns in a move-to-front list.
  */
-static int match_pattern_list(const char *string, const char *pattern,
+#define MATCH_CACHE_MAX 64
+static struct ssh_match_program *match_cache;
+static int match_cache_entries;
+
+static void match_program_free(struct ssh_match_program *prog) {
+  int i;
+
+  for (i = 0; i < prog->nsubs; i++) {
+    SAFE_FREE(prog->subs[i].glob);
+  }
+  SAFE_FREE(prog->subs);
+  SAFE_FREE(prog->pattern);
+  SAFE_FREE(prog);
+}
+
+static struct ssh_match_program *match_compile(const char *pattern,
     unsigned int len, int dolower) {
-  char sub[1024];
+  struct ssh_match_program *prog;
+  struct ssh_match_sub *subs;
+  char *glob;
+  unsigned int i, subi, start;
   int negated;
-  int got_positive;
-  unsigned int i, subi;
 
-  got_positive = 0;
+  prog = malloc(sizeof(struct ssh_match_program));
+  if (prog == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(prog);
+  prog->pattern = malloc(len + 1);
+  if (prog->pattern == NULL) {
+    match_program_free(prog);
+    return NULL;
+  }
+  memcpy(prog->pattern, pattern, len);
+  prog->pattern[len] = '\0';
+  prog->len = len;
+  prog->dolower = dolower;
+
   for (i = 0; i < len;) {
-    /* Check if the subpattern is negated. */
     if (pattern[i] == '!') {
       negated = 1;
       i++;
@@ -130,33 +145,109 @@ static int match_pattern_list(const char *string, const char *pattern,
       negated = 0;
     }
 
-    /*
-     * Extract the subpattern up to a comma or end.  Convert the
-     * subpattern to lowercase.
-     */
-    for (subi = 0;
-        i < len && subi < sizeof(sub) - 1 && pattern[i] != ',';
-        subi++, i++) {
-      sub[subi] = dolower && isupper(pattern[i]) ?
-        (char)tolower(pattern[i]) : pattern[i];
+    start = i;
+    while (i < len && pattern[i] != ',') {
+      i++;
     }
 
-    /* If subpattern too long, return failure (no match). */
-    if (subi >= sizeof(sub) - 1) {
-      return 0;
+    glob = malloc(i - start + 1);
+    if (glob == NULL) {
+      match_program_free(prog);
+      return NULL;
+    }
+    /* Lowercase on request and collapse runs of '*' while copying. */
+    for (subi = 0; start < i; start++) {
+      char c = dolower && isupper(pattern[start]) ?
+        (char)tolower(pattern[start]) : pattern[start];
+      if (c == '*' && subi > 0 && glob[subi - 1] == '*') {
+        continue;
+      }
+      glob[subi++] = c;
+    }
+    glob[subi] = '\0';
+
+    subs = realloc(prog->subs, (prog->nsubs + 1) * sizeof(struct ssh_match_sub));
+    if (subs == NULL) {
+      SAFE_FREE(glob);
+      match_program_free(prog);
+      return NULL;
     }
+    prog->subs = subs;
+    prog->subs[prog->nsubs].glob = glob;
+    prog->subs[prog->nsubs].negated = negated;
+    prog->nsubs++;
 
-    /* If the subpattern was terminated by a comma, skip the comma. */
     if (i < len && pattern[i] == ',') {
       i++;
     }
+  }
+
+  return prog;
+}
+
+static struct ssh_match_program *match_cache_get(const char *pattern,
+    unsigned int len, int dolower) {
+  struct ssh_match_program *prog;
+  struct ssh_match_program **prev = &match_cache;
+
+  for (prog = match_cache; prog != NULL; prog = prog->next) {
+    if (prog->len == len && prog->dolower == dolower &&
+        memcmp(prog->pattern, pattern, len) == 0) {
+      /* move to front so hot patterns stay cached */
+      *prev = prog->next;
+      prog->next = match_cache;
+      match_cache = prog;
+      return prog;
+    }
+    prev = &prog->next;
+  }
+
+  prog = match_compile(pattern, len, dolower);
+  if (prog == NULL) {
+    return NULL;
+  }
+  prog->next = match_cache;
+  match_cache = prog;
+
+  if (match_cache_entries < MATCH_CACHE_MAX) {
+    match_cache_entries++;
+  } else {
+    /* evict the coldest entry */
+    prev = &match_cache;
+    while ((*prev)->next != NULL) {
+      prev = &(*prev)->next;
+    }
+    match_program_free(*prev);
+    *prev = NULL;
+  }
+
+  return prog;
+}
 
-    /* Null-terminate the subpattern. */
-    sub[subi] = '\0';
+/*
+ * Tries to match the string against the comma-separated sequence of subpatterns
+ * (each possibly preceded by ! to indicate negation).
+ * Returns -1 if negation matches, 1 if there is a positive match, 0 if there is
+ * no match at all.
+ */
+static int match_pattern_list(const char *string, const char *pattern,
+    unsigned int len, int dolower) {
+  struct ssh_match_program *prog;
+  int got_positive = 0;
+  int i;
+
+  if (string == NULL) {
+    string = "";
+  }
+
+  prog = match_cache_get(pattern, len, dolower);
+  if (prog == NULL) {
+    return 0;
+  }
 
-    /* Try to match the subpattern against the string. */
-    if (match_pattern(string, sub)) {
-      if (negated) {
+  for (i = 0; i < prog->nsubs; i++) {
+    if (match_glob(string, prog->subs[i].glob)) {
+      if (prog->subs[i].negated) {
         return -1;        /* Negative */
       } else {
         got_positive = 1; /* Positive */
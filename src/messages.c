@@ -127,14 +127,72 @@ static int ssh_execute_message_callback(ssh_session session, ssh_message msg) {
  */
 void ssh_message_queue(ssh_session session, ssh_message message){
     if(message) {
-        if(session->ssh_message_list == NULL) {
+        if (channel_accept_queue_dispatch(session, message)) {
+            return;
+        }
+        if(!session->msg_queue_enabled) {
             if(session->ssh_message_callback != NULL) {
                 ssh_execute_message_callback(session, message);
                 return;
             }
-            session->ssh_message_list = ssh_list_new();
+            session->msg_queue_enabled = 1;
+        }
+        if (session->msg_queue_limit != 0 &&
+            session->msg_queue_depth >= session->msg_queue_limit) {
+            /* queue full: refusing the request outright is the cheapest
+             * outcome for both sides, see ssh_set_message_queue_limit() */
+            ssh_log(session, SSH_LOG_PROTOCOL,
+                "Message queue full (%u), rejecting request type %d",
+                session->msg_queue_limit, message->type);
+            ssh_message_reply_default(message);
+            ssh_message_free(message);
+            return;
+        }
+        message->msg_prev = session->msg_queue_tail;
+        message->msg_next = NULL;
+        if (session->msg_queue_tail != NULL) {
+            session->msg_queue_tail->msg_next = message;
+        } else {
+            session->msg_queue_head = message;
+        }
+        session->msg_queue_tail = message;
+        session->msg_queue_depth++;
+        if (message->type >= SSH_REQUEST_AUTH &&
+            message->type <= SSH_REQUEST_GLOBAL) {
+            session->msg_queue_typecount[message->type]++;
         }
-        ssh_list_append(session->ssh_message_list, message);
+    }
+}
+
+/**
+ * @internal
+ *
+ * @brief Unlink a message from the delayed message queue of a session.
+ *
+ * @param[in]  session  The SSH session owning the queue.
+ *
+ * @param[in]  message  The queued message to unlink.
+ */
+void ssh_message_queue_unlink(ssh_session session, ssh_message message) {
+    if (message->msg_prev != NULL) {
+        message->msg_prev->msg_next = message->msg_next;
+    } else {
+        session->msg_queue_head = message->msg_next;
+    }
+    if (message->msg_next != NULL) {
+        message->msg_next->msg_prev = message->msg_prev;
+    } else {
+        session->msg_queue_tail = message->msg_prev;
+    }
+    message->msg_prev = NULL;
+    message->msg_next = NULL;
+    if (session->msg_queue_depth > 0) {
+        session->msg_queue_depth--;
+    }
+    if (message->type >= SSH_REQUEST_AUTH &&
+        message->type <= SSH_REQUEST_GLOBAL &&
+        session->msg_queue_typecount[message->type] > 0) {
+        session->msg_queue_typecount[message->type]--;
     }
 }
 
@@ -148,14 +206,10 @@ void ssh_message_queue(ssh_session session, ssh_message message){
  * @returns             The head message or NULL if it doesn't exist.
  */
 ssh_message ssh_message_pop_head(ssh_session session){
-  ssh_message msg=NULL;
-  struct ssh_iterator *i;
-  if(session->ssh_message_list == NULL)
-    return NULL;
-  i=ssh_list_get_iterator(session->ssh_message_list);
-  if(i != NULL){
-    msg=ssh_iterator_value(ssh_message,i);
-    ssh_list_remove(session->ssh_message_list,i);
+  ssh_message msg = session->msg_queue_head;
+
+  if (msg != NULL) {
+    ssh_message_queue_unlink(session, msg);
   }
   return msg;
 }
@@ -179,20 +233,41 @@ ssh_message ssh_message_get(ssh_session session) {
       leave_function();
       return msg;
   }
-  if(session->ssh_message_list == NULL) {
-      session->ssh_message_list = ssh_list_new();
-  }
+  session->msg_queue_enabled = 1;
   do {
-    if (ssh_handle_packets(session,-1) == SSH_ERROR) {
+    if (ssh_handle_packets(session,-1) != SSH_OK) {
       leave_function();
       return NULL;
     }
-    msg=ssh_list_pop_head(ssh_message, session->ssh_message_list);
+    msg=ssh_message_pop_head(session);
   } while(msg==NULL);
   leave_function();
   return msg;
 }
 
+/**
+ * @brief Cap the queue of messages awaiting ssh_message_get().
+ *
+ * A client spamming requests otherwise grows the queue without bound.
+ * Once the cap is reached, further requests are answered with the
+ * default refusal instead of being queued. The current depth is
+ * reported by ssh_get_stats().
+ *
+ * @param[in]  session  The SSH session to configure.
+ *
+ * @param[in]  limit    Maximum queued messages, 0 for no limit.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_message_queue_limit(ssh_session session, uint32_t limit) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  session->msg_queue_limit = limit;
+
+  return SSH_OK;
+}
+
 /**
  * @brief Get the type of the message.
  *
@@ -801,6 +876,12 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open){
     goto end;
   }
 
+  if (strcmp(type_c,"auth-agent@openssh.com") == 0) {
+    msg->channel_request_open.type = SSH_CHANNEL_AUTH_AGENT;
+    SAFE_FREE(type_c);
+    goto end;
+  }
+
   msg->channel_request_open.type = SSH_CHANNEL_UNKNOWN;
   goto end;
 
@@ -836,6 +917,7 @@ ssh_channel ssh_message_channel_request_open_reply_accept(ssh_message msg) {
   }
 
   chan->local_channel = ssh_channel_new_id(session);
+  ssh_channel_table_register(session, chan);
   chan->local_maxpacket = 35000;
   chan->local_window = 32000;
   chan->remote_channel = msg->channel_request_open.sender;
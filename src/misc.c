@@ -860,13 +860,24 @@ int ssh_analyze_banner(ssh_session session, int server, int *ssh1, int *ssh2) {
   return 0;
 }
 
-/* try the Monotonic clock if possible for perfs reasons */
-#ifdef _POSIX_MONOTONIC_CLOCK
+/* try the Monotonic clock if possible for perfs reasons; the coarse
+ * variant is enough for millisecond timeouts and stays cheap on guests
+ * whose fine-grained clock leaves the vDSO for a real syscall */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define CLOCK CLOCK_MONOTONIC_COARSE
+#elif defined(_POSIX_MONOTONIC_CLOCK)
 #define CLOCK CLOCK_MONOTONIC
 #else
 #define CLOCK CLOCK_REALTIME
 #endif
 
+/* a "now" refreshed once per event loop turn by ssh_poll_ctx_dopoll(),
+ * so the timeout arithmetic of a wait iteration is a subtraction
+ * instead of a clock read. Shared by every session; concurrent loops
+ * just refresh it more often. */
+static struct ssh_timestamp ssh_cached_now;
+static int ssh_cached_now_valid;
+
 /**
  * @internal
  * @brief initializes a timestamp to the current time
@@ -885,6 +896,28 @@ void ssh_timestamp_init(struct ssh_timestamp *ts){
   ts->seconds = tp.tv_sec;
 }
 
+/**
+ * @internal
+ * @brief refreshes the cached "now" used by the timeout helpers
+ *
+ * Called by the event loop once per turn, right around the poll call.
+ */
+void ssh_timestamp_cache_refresh(void) {
+  ssh_timestamp_init(&ssh_cached_now);
+  ssh_cached_now_valid = 1;
+}
+
+/* the timeout helpers start from the cached now when there is one; a
+ * negative difference downstream flags a timestamp younger than the
+ * cache and triggers a real clock read */
+static void ssh_timestamp_now(struct ssh_timestamp *now) {
+  if (ssh_cached_now_valid) {
+    *now = ssh_cached_now;
+  } else {
+    ssh_timestamp_init(now);
+  }
+}
+
 #undef CLOCK
 
 /**
@@ -908,6 +941,27 @@ static int ssh_timestamp_difference(struct ssh_timestamp *old,
   return msecs;
 }
 
+/**
+ * @internal
+ * @brief gets the number of milliseconds elapsed since a timestamp
+ * @param[in] ts pointer to an existing timestamp
+ * @returns elapsed time in milliseconds
+ */
+int ssh_timestamp_elapsed_ms(struct ssh_timestamp *ts) {
+  struct ssh_timestamp now;
+  int ms;
+
+  ssh_timestamp_now(&now);
+  ms = ssh_timestamp_difference(ts, &now);
+  if (ms < 0) {
+    /* ts is younger than the cached now, ask the clock */
+    ssh_timestamp_init(&now);
+    ms = ssh_timestamp_difference(ts, &now);
+  }
+
+  return ms;
+}
+
 /**
  * @internal
  * @brief Checks if a timeout is elapsed, in function of a previous
@@ -919,19 +973,60 @@ static int ssh_timestamp_difference(struct ssh_timestamp *old,
  *          0 otherwise
  */
 int ssh_timeout_elapsed(struct ssh_timestamp *ts, int timeout) {
-  struct ssh_timestamp now;
   if(timeout < 0)
     return 0; // -1 means infinite timeout
   if(timeout == 0)
     return 1; // 0 means no timeout
-  ssh_timestamp_init(&now);
 
-  if(ssh_timestamp_difference(ts,&now) >= timeout)
+  if(ssh_timestamp_elapsed_ms(ts) >= timeout)
     return 1;
   else
     return 0;
 }
 
+/* a rate sample is folded into the average at most this often, so the
+ * estimator costs one addition per event between samples */
+#define SSH_RATE_EST_INTERVAL_MS 100
+
+/**
+ * @internal
+ * @brief Feed bytes into an EWMA bytes-per-second estimator.
+ *
+ * Accumulates until SSH_RATE_EST_INTERVAL_MS passed, then folds the
+ * sample in with a gain of 1/8, the way TCP smooths its RTT. The
+ * estimate starts at the first full sample.
+ *
+ * @param[in,out] ewma   The smoothed rate in bytes per second.
+ * @param[in,out] acc    Bytes accumulated since the last sample.
+ * @param[in,out] since  When the current sample started.
+ * @param[in]     bytes  Bytes to account, may be 0 to just age the rate.
+ */
+void ssh_rate_est_update(uint32_t *ewma, uint32_t *acc,
+    struct ssh_timestamp *since, uint32_t bytes) {
+  uint32_t inst;
+  int elapsed;
+
+  if (since->seconds == 0 && since->useconds == 0) {
+    ssh_timestamp_init(since);
+    *acc = bytes;
+    return;
+  }
+  *acc += bytes;
+
+  elapsed = ssh_timestamp_elapsed_ms(since);
+  if (elapsed < SSH_RATE_EST_INTERVAL_MS) {
+    return;
+  }
+  inst = (uint32_t) ((uint64_t) *acc * 1000 / (uint32_t) elapsed);
+  if (*ewma == 0) {
+    *ewma = inst;
+  } else {
+    *ewma += ((int64_t) inst - (int64_t) *ewma) / 8;
+  }
+  *acc = 0;
+  ssh_timestamp_init(since);
+}
+
 /**
  * @brief updates a timeout value so it reflects the remaining time
  * @param[in] ts pointer to an existing timestamp
@@ -940,19 +1035,51 @@ int ssh_timeout_elapsed(struct ssh_timestamp *ts, int timeout) {
  * @returns   remaining time in milliseconds, 0 if elapsed, -1 if never.
  */
 int ssh_timeout_update(struct ssh_timestamp *ts, int timeout){
-  struct ssh_timestamp now;
   int ms, ret;
   if(timeout == 0)
     return 0;
   if(timeout==-1)
     return -1;
-  ssh_timestamp_init(&now);
-  ms = ssh_timestamp_difference(ts,&now);
+  ms = ssh_timestamp_elapsed_ms(ts);
   if(ms < 0)
     ms = 0;
   ret = timeout - ms;
   return ret >= 0 ? ret: 0;
 }
+
+/**
+ * @internal
+ *
+ * @brief Overwrite memory holding secrets in a way the compiler cannot
+ * optimize out.
+ *
+ * A plain memset() right before a free() is dead code as far as the
+ * optimizer is concerned and may silently disappear. Use this for key
+ * material and passphrases; public data doesn't need it.
+ *
+ * @param[in] data      Start of the area to wipe.
+ *
+ * @param[in] len       Number of bytes to wipe.
+ */
+void ssh_burn(void *data, size_t len) {
+  if (data == NULL || len == 0) {
+    return;
+  }
+
+#if defined(__GNUC__)
+  memset(data, 0, len);
+  /* pretend the cleared bytes are read so the memset stays */
+  __asm__ __volatile__("" : : "r"(data) : "memory");
+#else
+  {
+    volatile unsigned char *p = data;
+
+    while (len-- > 0) {
+      *p++ = 0;
+    }
+  }
+#endif
+}
 /** @} */
 
 /* vim: set ts=4 sw=4 et cindent: */
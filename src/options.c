@@ -35,6 +35,8 @@
 #include "libssh/priv.h"
 #include "libssh/session.h"
 #include "libssh/misc.h"
+#include "libssh/buffer.h"
+#include "libssh/socket.h"
 #ifdef WITH_SERVER
 #include "libssh/server.h"
 #include "libssh/bind.h"
@@ -150,6 +152,272 @@ int ssh_options_copy(ssh_session src, ssh_session *dest) {
   return 0;
 }
 
+/* An immutable, refcounted snapshot of a session's string options. All
+ * strings live in one arena, so a session borrowing them can tell its
+ * own allocations from the shared ones by address alone; setting an
+ * option on such a session simply replaces the borrowed pointer with an
+ * owned copy (copy on write). */
+struct ssh_options_snapshot_struct {
+  int refcount;
+  char *arena;
+  size_t arena_len;
+  char *username;
+  char *host;
+  char *bindaddr;
+  char *sshdir;
+  char *knownhosts;
+  char *ProxyCommand;
+  char *wanted_methods[10];
+  char **identities;
+  int n_identities;
+  unsigned int port;
+  ssh_callbacks callbacks;
+  long timeout;
+  long timeout_usec;
+  int ssh2;
+  int ssh1;
+  int log_verbosity;
+  int compressionlevel;
+};
+
+static int ssh_options_ptr_shared(ssh_session session, const char *ptr) {
+  struct ssh_options_snapshot_struct *snap = session->opts_snapshot;
+
+  return snap != NULL && snap->arena != NULL &&
+      ptr >= snap->arena && ptr < snap->arena + snap->arena_len;
+}
+
+/** @internal
+ * @brief frees an option string unless the session borrows it from its
+ * shared snapshot; the field is NULLed either way.
+ */
+void ssh_options_field_free(ssh_session session, char **field) {
+  if (*field != NULL && !ssh_options_ptr_shared(session, *field)) {
+    SAFE_FREE(*field);
+  }
+  *field = NULL;
+}
+
+static char *ssh_options_arena_put(char **cursor, const char *str) {
+  char *dst;
+
+  if (str == NULL) {
+    return NULL;
+  }
+  dst = *cursor;
+  strcpy(dst, str);
+  *cursor += strlen(str) + 1;
+
+  return dst;
+}
+
+/**
+ * @brief Freeze the current options of a session into a shared snapshot.
+ *
+ * Creating many near-identical sessions with ssh_options_copy()
+ * re-allocates every string per session. A snapshot strdups them once,
+ * into a single arena, and any number of sessions then share them by
+ * pointer through ssh_options_apply_snapshot() - including the resolved
+ * algorithm preference lists the key exchange reads. The snapshot is
+ * immutable and refcounted; it may be applied from several threads.
+ *
+ * @param[in]  session  The configured session to freeze.
+ *
+ * @return              The snapshot, NULL on error. Release it with
+ *                      ssh_options_snapshot_free().
+ */
+ssh_options_snapshot ssh_options_freeze(ssh_session session) {
+  ssh_options_snapshot snap;
+  struct ssh_iterator *it;
+  size_t needed = 0;
+  char *cursor;
+  int n;
+  int i;
+
+  if (session == NULL) {
+    return NULL;
+  }
+
+#define OPT_STR_SIZE(f) do { if ((f) != NULL) needed += strlen(f) + 1; } while(0)
+  OPT_STR_SIZE(session->username);
+  OPT_STR_SIZE(session->host);
+  OPT_STR_SIZE(session->bindaddr);
+  OPT_STR_SIZE(session->sshdir);
+  OPT_STR_SIZE(session->knownhosts);
+  OPT_STR_SIZE(session->ProxyCommand);
+  for (i = 0; i < 10; i++) {
+    OPT_STR_SIZE(session->wanted_methods[i]);
+  }
+  n = 0;
+  for (it = ssh_list_get_iterator(session->identity); it != NULL;
+       it = it->next) {
+    OPT_STR_SIZE((const char *) it->data);
+    n++;
+  }
+#undef OPT_STR_SIZE
+
+  snap = malloc(sizeof(struct ssh_options_snapshot_struct));
+  if (snap == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(snap);
+  snap->refcount = 1;
+  if (needed > 0) {
+    snap->arena = malloc(needed);
+    if (snap->arena == NULL) {
+      SAFE_FREE(snap);
+      ssh_set_error_oom(session);
+      return NULL;
+    }
+  }
+  snap->arena_len = needed;
+  if (n > 0) {
+    snap->identities = malloc(n * sizeof(char *));
+    if (snap->identities == NULL) {
+      SAFE_FREE(snap->arena);
+      SAFE_FREE(snap);
+      ssh_set_error_oom(session);
+      return NULL;
+    }
+  }
+
+  cursor = snap->arena;
+  snap->username = ssh_options_arena_put(&cursor, session->username);
+  snap->host = ssh_options_arena_put(&cursor, session->host);
+  snap->bindaddr = ssh_options_arena_put(&cursor, session->bindaddr);
+  snap->sshdir = ssh_options_arena_put(&cursor, session->sshdir);
+  snap->knownhosts = ssh_options_arena_put(&cursor, session->knownhosts);
+  snap->ProxyCommand = ssh_options_arena_put(&cursor, session->ProxyCommand);
+  for (i = 0; i < 10; i++) {
+    snap->wanted_methods[i] =
+        ssh_options_arena_put(&cursor, session->wanted_methods[i]);
+  }
+  for (it = ssh_list_get_iterator(session->identity); it != NULL;
+       it = it->next) {
+    snap->identities[snap->n_identities++] =
+        ssh_options_arena_put(&cursor, (const char *) it->data);
+  }
+
+  snap->port = session->port;
+  snap->callbacks = session->callbacks;
+  snap->timeout = session->timeout;
+  snap->timeout_usec = session->timeout_usec;
+  snap->ssh2 = session->ssh2;
+  snap->ssh1 = session->ssh1;
+  snap->log_verbosity = session->log_verbosity;
+  snap->compressionlevel = session->compressionlevel;
+
+  return snap;
+}
+
+/**
+ * @brief Configure a session from a frozen options snapshot.
+ *
+ * The session's string options become pointers into the snapshot: no
+ * allocation, no config re-parsing. Options set afterwards replace the
+ * borrowed pointer with an owned copy, so per-session overrides (a
+ * different host, say) work as usual. The session keeps a reference on
+ * the snapshot until it is freed.
+ *
+ * @param[in]  session  The session to configure.
+ *
+ * @param[in]  snapshot The snapshot from ssh_options_freeze().
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_options_apply_snapshot(ssh_session session,
+    ssh_options_snapshot snapshot) {
+  struct ssh_options_snapshot_struct *old;
+  struct ssh_list *identity = NULL;
+  int i;
+
+  if (session == NULL || snapshot == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (snapshot->n_identities > 0) {
+    identity = ssh_list_new();
+    if (identity == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    for (i = 0; i < snapshot->n_identities; i++) {
+      if (ssh_list_append(identity, snapshot->identities[i]) < 0) {
+        ssh_list_free(identity);
+        ssh_set_error_oom(session);
+        return SSH_ERROR;
+      }
+    }
+  }
+
+  ssh_options_field_free(session, &session->username);
+  ssh_options_field_free(session, &session->host);
+  ssh_options_field_free(session, &session->bindaddr);
+  ssh_options_field_free(session, &session->sshdir);
+  ssh_options_field_free(session, &session->knownhosts);
+  ssh_options_field_free(session, &session->ProxyCommand);
+  for (i = 0; i < 10; i++) {
+    ssh_options_field_free(session, &session->wanted_methods[i]);
+  }
+  if (session->identity != NULL) {
+    char *id;
+
+    while ((id = ssh_list_pop_head(char *, session->identity)) != NULL) {
+      ssh_options_field_free(session, &id);
+    }
+    ssh_list_free(session->identity);
+  }
+
+  old = session->opts_snapshot;
+  session->opts_snapshot = snapshot;
+  ssh_refcount_inc(&snapshot->refcount);
+
+  session->username = snapshot->username;
+  session->host = snapshot->host;
+  session->bindaddr = snapshot->bindaddr;
+  session->sshdir = snapshot->sshdir;
+  session->knownhosts = snapshot->knownhosts;
+  session->ProxyCommand = snapshot->ProxyCommand;
+  for (i = 0; i < 10; i++) {
+    session->wanted_methods[i] = snapshot->wanted_methods[i];
+  }
+  session->identity = identity;
+
+  session->port = snapshot->port;
+  session->callbacks = snapshot->callbacks;
+  session->timeout = snapshot->timeout;
+  session->timeout_usec = snapshot->timeout_usec;
+  session->ssh2 = snapshot->ssh2;
+  session->ssh1 = snapshot->ssh1;
+  session->log_verbosity = snapshot->log_verbosity;
+  session->compressionlevel = snapshot->compressionlevel;
+
+  ssh_options_snapshot_free(old);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Release a reference on an options snapshot.
+ *
+ * The memory goes away with the last reference; sessions configured
+ * from the snapshot hold their own.
+ *
+ * @param[in]  snapshot The snapshot to release.
+ */
+void ssh_options_snapshot_free(ssh_options_snapshot snapshot) {
+  if (snapshot == NULL) {
+    return;
+  }
+  if (ssh_refcount_dec(&snapshot->refcount) > 0) {
+    return;
+  }
+  SAFE_FREE(snapshot->identities);
+  SAFE_FREE(snapshot->arena);
+  SAFE_FREE(snapshot);
+}
+
 int ssh_options_set_algo(ssh_session session, int algo,
     const char *list) {
   if (!verify_existing_algo(algo, list)) {
@@ -159,7 +427,7 @@ int ssh_options_set_algo(ssh_session session, int algo,
     return -1;
   }
 
-  SAFE_FREE(session->wanted_methods[algo]);
+  ssh_options_field_free(session, &session->wanted_methods[algo]);
   session->wanted_methods[algo] = strdup(list);
   if (session->wanted_methods[algo] == NULL) {
     ssh_set_error_oom(session);
@@ -339,6 +607,79 @@ int ssh_options_set_algo(ssh_session session, int algo,
  *                Set the command to be executed in order to connect to
  *                server (const char *).
  *
+ *              - SSH_OPTIONS_REKEY_DATA:
+ *                Set the amount of transferred data after which the
+ *                session keys are renegotiated (uint64_t, bytes in both
+ *                directions together, 0 = no data-based rekeying).
+ *
+ *              - SSH_OPTIONS_REKEY_TIME:
+ *                Set the time after which the session keys are
+ *                renegotiated (long, seconds, 0 = no time-based
+ *                rekeying).
+ *
+ *              - SSH_OPTIONS_PROFILE:
+ *                Pick an algorithm negotiation profile (int, enum
+ *                ssh_profile_e). SSH_PROFILE_THROUGHPUT and
+ *                SSH_PROFILE_LOWLAT prefer the fastest ciphers and
+ *                disable compression, SSH_PROFILE_COMPAT offers the
+ *                widest algorithm set, SSH_PROFILE_BENCHMARK measures
+ *                the ciphers on the running host once and negotiates
+ *                the fastest. SSH_PROFILE_DEFAULT restores the
+ *                built-in preferences.
+ *
+ *              - SSH_OPTIONS_TCP_NODELAY:
+ *                Enable or disable TCP_NODELAY on the connection
+ *                (int, 0 or 1, enabled by default, -1 leaves the
+ *                kernel default).
+ *
+ *              - SSH_OPTIONS_TCP_KEEPALIVE:
+ *                Enable or disable TCP keepalive probes on the
+ *                connection (int, 0 or 1, -1 leaves the kernel
+ *                default).
+ *
+ *              - SSH_OPTIONS_TCP_QUICKACK:
+ *                Enable or disable TCP_QUICKACK on the connection
+ *                where the platform supports it (int, 0 or 1, -1
+ *                leaves the kernel default).
+ *
+ *              - SSH_OPTIONS_TCP_SNDBUF:
+ *                Set the kernel send buffer size of the connection
+ *                (int, bytes, 0 leaves the kernel default).
+ *
+ *              - SSH_OPTIONS_TCP_RCVBUF:
+ *                Set the kernel receive buffer size of the connection
+ *                (int, bytes, 0 leaves the kernel default).
+ *
+ *              - SSH_OPTIONS_IP_TOS:
+ *                Set the IP TOS/DSCP marking of the connection (int,
+ *                the TOS byte, -1 leaves the kernel default), so the
+ *                network can prioritize interactive connections over
+ *                bulk ones.
+ *
+ *              - SSH_OPTIONS_TCP_MSS_ALIGN:
+ *                Size channel data packets so that each SSH packet
+ *                fills an integral number of TCP segments, using the
+ *                TCP_MAXSEG of the connection (int, 0 or 1, off by
+ *                default). Avoids packets whose tail travels in a
+ *                nearly empty segment and is delivered late.
+ *
+ *              - SSH_OPTIONS_DEFERRED_HOSTKEY:
+ *                Overlap the known_hosts lookup with the start of
+ *                authentication (int, 0 is the default serialized
+ *                behaviour). The userauth service request is sent as
+ *                soon as the key exchange completes, so its round trip
+ *                runs while the application calls
+ *                ssh_is_server_known(); opening a channel before the
+ *                lookup answered SSH_SERVER_KNOWN_OK fails.
+ *
+ *              - SSH_OPTIONS_KEEPALIVE_INTERVAL:
+ *                Send a keepalive (SSH2_MSG_IGNORE) when the session
+ *                was idle for this many seconds (int, 0 disables).
+ *                Sessions sharing a poll context share one timer: a
+ *                single tick serves every due session, so large
+ *                numbers of idle sessions need no per-session timer
+ *                in the application.
+ *
  * @param  value The value to set. This is a generic pointer and the
  *               datatype which is used should be set according to the
  *               type set.
@@ -364,7 +705,7 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
       }
       p = strchr(q, '@');
 
-      SAFE_FREE(session->host);
+      ssh_options_field_free(session, &session->host);
 
       if (p) {
         *p = '\0';
@@ -375,7 +716,7 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
           return -1;
         }
 
-        SAFE_FREE(session->username);
+        ssh_options_field_free(session, &session->username);
         session->username = strdup(q);
         SAFE_FREE(q);
         if (session->username == NULL) {
@@ -431,11 +772,11 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
       if (q == NULL) {
           return -1;
       }
-      SAFE_FREE(session->bindaddr);
+      ssh_options_field_free(session, &session->bindaddr);
       session->bindaddr = q;
       break;
     case SSH_OPTIONS_USER:
-      SAFE_FREE(session->username);
+      ssh_options_field_free(session, &session->username);
       if (value == NULL) { /* set default username */
         q = ssh_get_local_username(session);
         if (q == NULL) {
@@ -452,14 +793,14 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
       break;
     case SSH_OPTIONS_SSH_DIR:
       if (value == NULL) {
-        SAFE_FREE(session->sshdir);
+        ssh_options_field_free(session, &session->sshdir);
 
         session->sshdir = ssh_path_expand_tilde("~/.ssh");
         if (session->sshdir == NULL) {
           return -1;
         }
       } else {
-        SAFE_FREE(session->sshdir);
+        ssh_options_field_free(session, &session->sshdir);
         session->sshdir = ssh_path_expand_tilde(value);
         if (session->sshdir == NULL) {
           return -1;
@@ -483,7 +824,7 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
       break;
     case SSH_OPTIONS_KNOWNHOSTS:
       if (value == NULL) {
-        SAFE_FREE(session->knownhosts);
+        ssh_options_field_free(session, &session->knownhosts);
         if (session->sshdir == NULL) {
             return -1;
         }
@@ -492,7 +833,7 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
           return -1;
         }
       } else {
-        SAFE_FREE(session->knownhosts);
+        ssh_options_field_free(session, &session->knownhosts);
         session->knownhosts = strdup(value);
         if (session->knownhosts == NULL) {
           return -1;
@@ -649,12 +990,140 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
         session->StrictHostKeyChecking = *(int*)value;
       }
       break;
+    case SSH_OPTIONS_REKEY_DATA:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        uint64_t *x = (uint64_t *) value;
+
+        session->rekey_limit_bytes = *x;
+      }
+      break;
+    case SSH_OPTIONS_REKEY_TIME:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        long *x = (long *) value;
+
+        session->rekey_limit_seconds = *x;
+      }
+      break;
+    case SSH_OPTIONS_PROFILE:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        int *x = (int *) value;
+        const char *ciphers;
+        const char *comp;
+
+        if (*x == SSH_PROFILE_DEFAULT) {
+          ssh_options_field_free(session, &session->wanted_methods[SSH_CRYPT_C_S]);
+          ssh_options_field_free(session, &session->wanted_methods[SSH_CRYPT_S_C]);
+          ssh_options_field_free(session, &session->wanted_methods[SSH_COMP_C_S]);
+          ssh_options_field_free(session, &session->wanted_methods[SSH_COMP_S_C]);
+          break;
+        }
+        ciphers = ssh_profile_ciphers(*x);
+        comp = ssh_profile_compression(*x);
+        if (ciphers == NULL || comp == NULL) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        }
+        if (ssh_options_set_algo(session, SSH_CRYPT_C_S, ciphers) < 0 ||
+            ssh_options_set_algo(session, SSH_CRYPT_S_C, ciphers) < 0 ||
+            ssh_options_set_algo(session, SSH_COMP_C_S, comp) < 0 ||
+            ssh_options_set_algo(session, SSH_COMP_S_C, comp) < 0) {
+          return -1;
+        }
+      }
+      break;
+    case SSH_OPTIONS_TCP_NODELAY:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->tcp_nodelay = *(int *) value;
+        ssh_socket_set_tcp_options(session->socket);
+      }
+      break;
+    case SSH_OPTIONS_TCP_KEEPALIVE:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->tcp_keepalive = *(int *) value;
+        ssh_socket_set_tcp_options(session->socket);
+      }
+      break;
+    case SSH_OPTIONS_TCP_QUICKACK:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->tcp_quickack = *(int *) value;
+        ssh_socket_set_tcp_options(session->socket);
+      }
+      break;
+    case SSH_OPTIONS_TCP_SNDBUF:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->tcp_sndbuf = *(int *) value;
+        ssh_socket_set_tcp_options(session->socket);
+      }
+      break;
+    case SSH_OPTIONS_IP_TOS:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->ip_tos = *(int *) value;
+        ssh_socket_set_tcp_options(session->socket);
+      }
+      break;
+    case SSH_OPTIONS_TCP_MSS_ALIGN:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->tcp_mss_align = *(int *) value;
+      }
+      break;
+    case SSH_OPTIONS_TCP_RCVBUF:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->tcp_rcvbuf = *(int *) value;
+        ssh_socket_set_tcp_options(session->socket);
+      }
+      break;
+    case SSH_OPTIONS_DEFERRED_HOSTKEY:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->deferred_hostkey = *(int *) value;
+      }
+      break;
+    case SSH_OPTIONS_KEEPALIVE_INTERVAL:
+      if (value == NULL || *(int *) value < 0) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->keepalive_interval = *(int *) value;
+      }
+      break;
     case SSH_OPTIONS_PROXYCOMMAND:
       if (value == NULL) {
         ssh_set_error_invalid(session, __FUNCTION__);
         return -1;
       } else {
-        SAFE_FREE(session->ProxyCommand);
+        ssh_options_field_free(session, &session->ProxyCommand);
         q = strdup(value);
         if (q == NULL) {
             return -1;
@@ -950,7 +1419,7 @@ int ssh_options_apply(ssh_session session) {
     if (tmp == NULL) {
         return -1;
     }
-    free(session->knownhosts);
+    ssh_options_field_free(session, &session->knownhosts);
     session->knownhosts = tmp;
 
     if (session->ProxyCommand != NULL) {
@@ -958,7 +1427,7 @@ int ssh_options_apply(ssh_session session) {
         if (tmp == NULL) {
             return -1;
         }
-        free(session->ProxyCommand);
+        ssh_options_field_free(session, &session->ProxyCommand);
         session->ProxyCommand = tmp;
     }
 
@@ -970,7 +1439,7 @@ int ssh_options_apply(ssh_session session) {
         if (tmp == NULL) {
             return -1;
         }
-        free(id);
+        ssh_options_field_free(session, &id);
         it->data = tmp;
     }
 
@@ -999,6 +1468,9 @@ static int ssh_bind_options_set_algo(ssh_bind sshbind, int algo,
     ssh_set_error_oom(sshbind);
     return -1;
   }
+  /* the serialized KEXINIT is rebuilt at the next accept */
+  ssh_buffer_free(sshbind->kexinit_cache);
+  sshbind->kexinit_cache = NULL;
 
   return 0;
 }
@@ -1052,6 +1524,12 @@ static int ssh_bind_options_set_algo(ssh_bind sshbind, int algo,
  *                      SSH_BIND_OPTIONS_BANNER:
  *                        Set the server banner sent to clients (string).
  *
+ *                      SSH_BIND_OPTIONS_REUSEPORT:
+ *                        Allow several server processes to listen on the
+ *                        same port; the kernel balances the incoming
+ *                        connections between them (int, 0 = disabled).
+ *                        Must be set before ssh_bind_listen().
+ *
  * @param  value        The value to set. This is a generic pointer and the
  *                      datatype which is used should be set according to the
  *                      type set.
@@ -1155,6 +1633,11 @@ int ssh_bind_options_set(ssh_bind sshbind, enum ssh_bind_options_e type,
           ssh_set_error_oom(sshbind);
           return -1;
         }
+        /* drop the cached parsed key, the file is re-read at accept */
+        privatekey_free(sshbind->dsa);
+        sshbind->dsa = NULL;
+        ssh_buffer_free(sshbind->kexinit_cache);
+        sshbind->kexinit_cache = NULL;
       }
       break;
     case SSH_BIND_OPTIONS_RSAKEY:
@@ -1168,6 +1651,36 @@ int ssh_bind_options_set(ssh_bind sshbind, enum ssh_bind_options_e type,
           ssh_set_error_oom(sshbind);
           return -1;
         }
+        privatekey_free(sshbind->rsa);
+        sshbind->rsa = NULL;
+        ssh_buffer_free(sshbind->kexinit_cache);
+        sshbind->kexinit_cache = NULL;
+      }
+      break;
+    case SSH_BIND_OPTIONS_ECDSAKEY:
+      if (value == NULL) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      } else {
+        SAFE_FREE(sshbind->ecdsakey);
+        sshbind->ecdsakey = strdup(value);
+        if (sshbind->ecdsakey == NULL) {
+          ssh_set_error_oom(sshbind);
+          return -1;
+        }
+        privatekey_free(sshbind->ecdsa);
+        sshbind->ecdsa = NULL;
+        ssh_buffer_free(sshbind->kexinit_cache);
+        sshbind->kexinit_cache = NULL;
+      }
+      break;
+    case SSH_BIND_OPTIONS_REUSEPORT:
+      if (value == NULL) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      } else {
+        int *x = (int *) value;
+        sshbind->reuseport = *x;
       }
       break;
     case SSH_BIND_OPTIONS_BANNER:
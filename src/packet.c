@@ -109,6 +109,43 @@ ssh_packet_callback default_packet_handlers[]= {
 /* XXX include selected mac size */
 static int macsize=SHA_DIGEST_LEN;
 
+static void ssh_packet_dispatch_rebuild(ssh_session session);
+
+/** @internal
+ * @brief Decide from the first decrypted block whether a packet is
+ * chaff that can be MAC-verified and dropped without ever being
+ * materialized in in_buffer or dispatched.
+ *
+ * Only packet types whose stock handlers discard the payload anyway
+ * (SSH_MSG_IGNORE, SSH_MSG_UNIMPLEMENTED, SSH_MSG_DEBUG) qualify, and
+ * only while nothing overrides them: inbound compression hides the
+ * type byte, and a custom hook or handler on the type must keep seeing
+ * the payload.
+ */
+static int ssh_packet_is_discardable(ssh_session session, uint8_t type) {
+  if (type != SSH2_MSG_IGNORE && type != SSH2_MSG_UNIMPLEMENTED &&
+      type != SSH2_MSG_DEBUG) {
+    return 0;
+  }
+  if (session->current_crypto == NULL ||
+      session->current_crypto->do_compress_in) {
+    return 0;
+  }
+  if (session->packet_callbacks == NULL) {
+    return 0;
+  }
+  if (!session->packet_dispatch_valid) {
+    ssh_packet_dispatch_rebuild(session);
+  }
+  if (session->packet_hooks[type] != NULL ||
+      session->packet_dispatch[type].chained ||
+      session->packet_dispatch[type].cb != default_packet_handlers[type - 1]) {
+    return 0;
+  }
+
+  return 1;
+}
+
 /* in nonblocking mode, socket_read will read as much as it can, and return */
 /* SSH_OK if it has read at least len bytes, otherwise, SSH_AGAIN. */
 /* in blocking mode, it will read at least len bytes and will block until it's ok. */
@@ -123,26 +160,33 @@ static int macsize=SHA_DIGEST_LEN;
  */
 int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user){
   ssh_session session=(ssh_session) user;
-  unsigned int blocksize = (session->current_crypto ?
-      session->current_crypto->in_cipher->blocksize : 8);
-  int current_macsize = session->current_crypto ? macsize : 0;
+  unsigned int blocksize;
+  int current_macsize;
   unsigned char mac[30] = {0};
   char buffer[16] = {0};
   void *packet=NULL;
+  void *dst=NULL;
   int to_be_read;
-  int rc;
   uint32_t len;
   uint8_t padding;
   size_t processed=0; /* number of byte processed from the callback */
 
   enter_function();
 
+next_packet:
+  /* the cipher may have changed at NEWKEYS, recompute per packet */
+  blocksize = (session->current_crypto ?
+      session->current_crypto->in_cipher->blocksize : 8);
+  current_macsize = session->current_crypto ? macsize : 0;
+
   switch(session->packet_state) {
     case PACKET_STATE_INIT:
-    	if(receivedlen < blocksize){
+    	if(receivedlen - processed < blocksize){
     		/* We didn't receive enough data to read at least one block size, give up */
+    		ssh_socket_set_read_hint(session->socket,
+    		    blocksize - (receivedlen - processed));
     		leave_function();
-    		return 0;
+    		return processed;
     	}
       memset(&session->in_packet, 0, sizeof(PACKET));
 
@@ -157,7 +201,7 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
         }
       }
 
-      memcpy(buffer,data,blocksize);
+      memcpy(buffer,(unsigned char *)data + processed,blocksize);
       processed += blocksize;
       len = packet_decrypt_len(session, buffer);
 
@@ -171,6 +215,10 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
         goto error;
       }
 
+      /* hint the expected packet size so in_buffer keeps its capacity
+       * across the per-packet reinit */
+      ssh_buffer_reserve(session->in_buffer, len + sizeof(uint32_t));
+
       to_be_read = len - blocksize + sizeof(uint32_t);
       if (to_be_read < 0) {
         /* remote sshd sends invalid sizes? */
@@ -179,6 +227,11 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
         goto error;
       }
 
+      /* the type byte sits right after the padding byte in the block
+       * just decrypted; flag chaff for the early-discard path below */
+      session->in_packet.discard =
+          ssh_packet_is_discardable(session, (uint8_t) buffer[5]);
+
       /* saves the status of the current operations */
       session->in_packet.len = len;
       session->packet_state = PACKET_STATE_SIZEREAD;
@@ -188,7 +241,12 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
       /* if to_be_read is zero, the whole packet was blocksize bytes. */
       if (to_be_read != 0) {
         if(receivedlen - processed < (unsigned int)to_be_read){
-        	/* give up, not enough data in buffer */
+        	/* give up, not enough data in buffer; tell the socket how
+        	 * much of this packet is still missing so the next recv()
+        	 * fetches it in one call */
+        	ssh_socket_set_read_hint(session->socket,
+        	    to_be_read - (receivedlen - processed));
+        	leave_function();
         	return processed;
         }
 
@@ -197,7 +255,61 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
 
         ssh_log(session,SSH_LOG_PACKET,"Read a %d bytes packet",len);
 
-        if (buffer_add_data(session->in_buffer, packet,
+        if (session->in_packet.discard) {
+          /*
+           * early-discard fast path: decrypt into the crypt scratch
+           * buffer, check the MAC over first block + remainder and
+           * drop the packet without materializing or dispatching it
+           */
+          uint32_t restlen = to_be_read - current_macsize;
+          void *rest = NULL;
+
+          if (restlen > 0) {
+            rest = packet_decrypt_scratch(session, packet, restlen);
+            if (rest == NULL) {
+              ssh_set_error(session, SSH_FATAL, "Decrypt error");
+              goto error;
+            }
+          }
+          memcpy(mac, (unsigned char *)packet + restlen, macsize);
+          if (packet_hmac_verify2(session,
+                buffer_get_rest(session->in_buffer),
+                buffer_get_rest_len(session->in_buffer),
+                rest, restlen, mac) < 0) {
+            ssh_set_error(session, SSH_FATAL, "HMAC error");
+            goto error;
+          }
+          processed += to_be_read;
+          session->recv_seq++;
+          session->stats.packets_in++;
+          ssh_log(session, SSH_LOG_PACKET,
+              "Dropped an ignorable %d bytes packet before dispatch", len);
+          session->packet_state = PACKET_STATE_INIT;
+          ssh_client_rekey_check(session);
+          if (processed < receivedlen) {
+            goto next_packet;
+          }
+          leave_function();
+          return processed;
+        }
+
+        if (session->current_crypto) {
+          /*
+           * decrypt the rest of the packet (blocksize bytes already
+           * have been decrypted) straight from the socket buffer into
+           * in_buffer, fusing the cipher pass with the copy
+           */
+          dst = buffer_allocate(session->in_buffer,
+              to_be_read - current_macsize);
+          if (dst == NULL) {
+            goto error;
+          }
+          if (packet_decrypt_to(session, dst, packet,
+                to_be_read - current_macsize) < 0) {
+            ssh_set_error(session, SSH_FATAL, "Decrypt error");
+            goto error;
+          }
+        } else if (buffer_add_data(session->in_buffer, packet,
               to_be_read - current_macsize) < 0) {
           goto error;
         }
@@ -205,16 +317,6 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
       }
 
       if (session->current_crypto) {
-        /*
-         * decrypt the rest of the packet (blocksize bytes already
-         * have been decrypted)
-         */
-        if (packet_decrypt(session,
-              ((uint8_t*)buffer_get_rest(session->in_buffer) + blocksize),
-              buffer_get_rest_len(session->in_buffer) - blocksize) < 0) {
-          ssh_set_error(session, SSH_FATAL, "Decrypt error");
-          goto error;
-        }
         /* copy the last part from the incoming buffer */
         memcpy(mac,(unsigned char *)packet + to_be_read - current_macsize, macsize);
 
@@ -263,19 +365,22 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
       }
 #endif
       session->recv_seq++;
+      session->stats.packets_in++;
+      ssh_rate_est_update(&session->rate_est_in, &session->rate_est_in_acc,
+          &session->rate_est_in_ts, buffer_get_rest_len(session->in_buffer));
       /* We don't want to rewrite a new packet while still executing the packet callbacks */
       session->packet_state = PACKET_STATE_PROCESSING;
       ssh_packet_parse_type(session);
       /* execute callbacks */
       ssh_packet_process(session, session->in_packet.type);
       session->packet_state = PACKET_STATE_INIT;
+      ssh_client_rekey_check(session);
       if(processed < receivedlen){
-      	/* Handle a potential packet left in socket buffer */
+      	/* Drain any complete packet left in the socket buffer before
+      	 * returning to the poll loop */
       	ssh_log(session,SSH_LOG_PACKET,"Processing %" PRIdS " bytes left in socket buffer",
       			receivedlen-processed);
-      	rc = ssh_packet_socket_callback((char *)data + processed,
-      			receivedlen - processed,user);
-      	processed += rc;
+      	goto next_packet;
       }
       leave_function();
       return processed;
@@ -310,6 +415,59 @@ void ssh_packet_set_callbacks(ssh_session session, ssh_packet_callbacks callback
 		session->packet_callbacks = ssh_list_new();
 	}
   ssh_list_append(session->packet_callbacks, callbacks);
+  /* recompiled on the next packet */
+  session->packet_dispatch_valid = 0;
+}
+
+/** @internal
+ * @brief compiles the registered callback ranges into the flat per-type
+ * dispatch table.
+ *
+ * A type handled by exactly one callback struct (all of them, in
+ * practice) dispatches as a single indexed call; a type covered by
+ * several keeps the chained walk of ssh_packet_process() to preserve
+ * the try-next-on-SSH_PACKET_NOT_USED semantics.
+ */
+static void ssh_packet_dispatch_rebuild(ssh_session session) {
+  struct ssh_iterator *i;
+  ssh_packet_callbacks cb;
+  int type;
+
+  memset(session->packet_dispatch, 0, sizeof(session->packet_dispatch));
+
+  for (i = ssh_list_get_iterator(session->packet_callbacks); i != NULL;
+       i = i->next) {
+    cb = ssh_iterator_value(ssh_packet_callbacks, i);
+    if (cb == NULL) {
+      continue;
+    }
+    for (type = cb->start; type < cb->start + cb->n_callbacks; type++) {
+      if (cb->callbacks[type - cb->start] == NULL) {
+        continue;
+      }
+      if (session->packet_dispatch[type].cb == NULL) {
+        session->packet_dispatch[type].cb = cb->callbacks[type - cb->start];
+        session->packet_dispatch[type].user = cb->user;
+      } else {
+        session->packet_dispatch[type].chained = 1;
+      }
+    }
+  }
+  session->packet_dispatch_valid = 1;
+}
+
+/**
+ * @brief Hook the handling of one packet type, see callbacks.h.
+ */
+int ssh_packet_set_hook(ssh_session session, uint8_t type,
+    ssh_packet_callback cb, void *userdata) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  session->packet_hooks[type] = cb;
+  session->packet_hooks_user[type] = userdata;
+
+  return SSH_OK;
 }
 
 /** @internal
@@ -322,6 +480,8 @@ void ssh_packet_set_default_callbacks(ssh_session session){
     return;
   }
 #endif
+	session->packet_send_fn = packet_send2;
+	session->channel_write_fn = channel_write2;
 	session->default_packet_callbacks.start=1;
 	session->default_packet_callbacks.n_callbacks=sizeof(default_packet_handlers)/sizeof(ssh_packet_callback);
 	session->default_packet_callbacks.user=session;
@@ -343,6 +503,23 @@ void ssh_packet_process(ssh_session session, uint8_t type){
 		ssh_log(session,SSH_LOG_RARE,"Packet callback is not initialized !");
 		goto error;
 	}
+	if(!session->packet_dispatch_valid){
+		ssh_packet_dispatch_rebuild(session);
+	}
+	if(session->packet_hooks[type] != NULL){
+		r=session->packet_hooks[type](session,type,session->in_buffer,
+				session->packet_hooks_user[type]);
+		if(r==SSH_PACKET_USED)
+			goto done;
+	}
+	if(!session->packet_dispatch[type].chained){
+		/* the common case: one handler, one indexed call */
+		if(session->packet_dispatch[type].cb != NULL){
+			r=session->packet_dispatch[type].cb(session,type,session->in_buffer,
+					session->packet_dispatch[type].user);
+		}
+		goto done;
+	}
 	i=ssh_list_get_iterator(session->packet_callbacks);
 	while(i != NULL){
 		cb=ssh_iterator_value(ssh_packet_callbacks,i);
@@ -359,6 +536,7 @@ void ssh_packet_process(ssh_session session, uint8_t type){
 		if(r==SSH_PACKET_USED)
 			break;
 	}
+done:
 	if(r==SSH_PACKET_NOT_USED){
 		ssh_log(session,SSH_LOG_RARE,"Couldn't do anything with packet type %d",type);
 		ssh_packet_send_unimplemented(session, session->recv_seq-1);
@@ -441,9 +619,23 @@ static int ssh_packet_write(ssh_session session) {
   return rc;
 }
 
-static int packet_send2(ssh_session session) {
-  unsigned int blocksize = (session->current_crypto ?
-      session->current_crypto->out_cipher->blocksize : 8);
+/* Padding bytes are drawn from a batch refilled with one RNG call per
+ * kilobyte instead of calling ssh_get_random() per packet: interactive
+ * sessions are mostly tiny control packets (window adjusts, keepalives)
+ * whose cost was dominated by that call. */
+static void packet_random_padding(ssh_session session, char *dst,
+    uint8_t len) {
+  if (session->pad_pool_left < len) {
+    ssh_get_random(session->pad_pool, sizeof(session->pad_pool), 0);
+    session->pad_pool_left = sizeof(session->pad_pool);
+  }
+  session->pad_pool_left -= len;
+  memcpy(dst, session->pad_pool + session->pad_pool_left, len);
+}
+
+int packet_send2(ssh_session session) {
+  unsigned int blocksize = (session->out_crypto ?
+      session->out_crypto->out_cipher->blocksize : 8);
   uint32_t currentlen = buffer_get_rest_len(session->out_buffer);
   unsigned char *hmac = NULL;
   char padstring[32] = {0};
@@ -457,7 +649,7 @@ static int packet_send2(ssh_session session) {
       "Writing on the wire a packet having %u bytes before", currentlen);
 
 #if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
-  if (session->current_crypto && session->current_crypto->do_compress_out) {
+  if (session->out_crypto && session->out_crypto->do_compress_out) {
     ssh_log(session, SSH_LOG_PACKET, "Compressing out_buffer ...");
     if (compress_buffer(session,session->out_buffer) < 0) {
       goto error;
@@ -470,9 +662,10 @@ static int packet_send2(ssh_session session) {
     padding += blocksize;
   }
 
-  if (session->current_crypto) {
-    ssh_get_random(padstring, padding, 0);
+  if (session->out_crypto) {
+    packet_random_padding(session, padstring, padding);
   } else {
+    /* unencrypted packets take the precomputed all-zero template */
     memset(padstring,0,padding);
   }
 
@@ -500,13 +693,22 @@ static int packet_send2(ssh_session session) {
   hmac = packet_encrypt(session, buffer_get_rest(session->out_buffer),
       buffer_get_rest_len(session->out_buffer));
   if (hmac) {
-    if (buffer_add_data(session->out_buffer, hmac, 20) < 0) {
-      goto error;
-    }
+    /* Hand the encrypted packet and its MAC to the socket layer as two
+     * segments instead of copying the MAC into out_buffer first. */
+    struct ssh_iovec_struct iov[2];
+
+    iov[0].data = buffer_get_rest(session->out_buffer);
+    iov[0].len = buffer_get_rest_len(session->out_buffer);
+    iov[1].data = hmac;
+    iov[1].len = 20;
+    rc = ssh_socket_write_iov(session->socket, iov, 2);
+  } else {
+    rc = ssh_packet_write(session);
   }
-
-  rc = ssh_packet_write(session);
   session->send_seq++;
+  session->stats.packets_out++;
+  ssh_rate_est_update(&session->rate_est_out, &session->rate_est_out_acc,
+      &session->rate_est_out_ts, ntohl(finallen));
 
   if (buffer_reinit(session->out_buffer) < 0) {
     rc = SSH_ERROR;
@@ -519,11 +721,36 @@ error:
 
 int packet_send(ssh_session session) {
 #ifdef WITH_SSH1
-  if (session->version == 1) {
-    return packet_send1(session);
-  }
-#endif
+  /* dispatched through the pointer installed at version detection, so
+   * the SSH-2 path carries no SSH-1 version test even when SSH-1
+   * support is compiled in */
+  return session->packet_send_fn(session);
+#else
   return packet_send2(session);
+#endif
+}
+
+/** @internal
+ * @brief Sends a keepalive probe, an SSH2_MSG_IGNORE with an empty
+ * payload. The peer must discard it silently; builds straight into the
+ * session's output buffer so no allocation happens.
+ *
+ * @param session       The session to probe.
+ *
+ * @return              SSH_OK on success, SSH_ERROR otherwise.
+ */
+int ssh_send_keepalive(ssh_session session) {
+  if (session->version != 2) {
+    return SSH_OK;
+  }
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_IGNORE) < 0 ||
+      buffer_add_u32(session->out_buffer, 0) < 0) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+  return packet_send(session);
 }
 
 
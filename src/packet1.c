@@ -31,6 +31,7 @@
 #include "libssh/buffer.h"
 #include "libssh/socket.h"
 #include "libssh/kex.h"
+#include "libssh/channels.h"
 
 #ifdef WITH_SSH1
 
@@ -78,6 +79,8 @@ ssh_packet_callback default_packet_handlers1[]= {
  * @brief sets the default packet handlers
  */
 void ssh_packet_set_default_callbacks1(ssh_session session){
+  session->packet_send_fn = packet_send1;
+  session->channel_write_fn = channel_write1_common;
   session->default_packet_callbacks.start=0;
   session->default_packet_callbacks.n_callbacks=sizeof(default_packet_handlers1)/sizeof(ssh_packet_callback);
   session->default_packet_callbacks.user=session;
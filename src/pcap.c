@@ -35,6 +35,7 @@
 
 #include "libssh/libssh.h"
 #include "libssh/pcap.h"
+#include "libssh/ssh2.h"
 #include "libssh/session.h"
 #include "libssh/buffer.h"
 #include "libssh/socket.h"
@@ -117,8 +118,20 @@ struct ssh_pcap_context_struct {
 struct ssh_pcap_file_struct {
 	FILE *output;
 	uint16_t ipsequence;
+	/* captured records are batched here and written out in large chunks,
+	 * so tracing costs memory instead of disk round trips on the packet
+	 * path. Flushed when it exceeds PCAP_BUFFER_THRESHOLD and on close. */
+	ssh_buffer write_buffer;
+	/* capture bounding for always-on tracing, see
+	 * ssh_pcap_file_set_snaplen() and friends. All default to full take. */
+	uint32_t snaplen;       /* truncate captured bytes, 0 = no limit */
+	int control_only;       /* drop channel data records entirely */
+	uint32_t sample_rate;   /* keep ~1 of N channel data records, <2 = all */
+	uint32_t sample_state;  /* cheap PRNG state for the sampling */
 };
 
+#define PCAP_BUFFER_THRESHOLD (256 * 1024)
+
 /**
  * @brief create a new ssh_pcap_file object
  */
@@ -134,20 +147,104 @@ ssh_pcap_file ssh_pcap_file_new(){
     return pcap;
 }
 
+/** @brief truncates every captured record to snaplen bytes of SSH data,
+ * like the pcap snaplen. The record keeps its original length field so
+ * tools show how much was cut.
+ * @param pcap the pcap file
+ * @param snaplen bytes to keep per record, 0 to capture in full.
+ */
+void ssh_pcap_file_set_snaplen(ssh_pcap_file pcap, uint32_t snaplen){
+	if(pcap == NULL)
+		return;
+	pcap->snaplen=snaplen;
+}
+
+/** @brief restricts the capture to control packets, dropping the
+ * channel data and extended data records that carry the bulk bytes.
+ * @param pcap the pcap file
+ * @param control_only nonzero to drop channel data records.
+ */
+void ssh_pcap_file_set_control_only(ssh_pcap_file pcap, int control_only){
+	if(pcap == NULL)
+		return;
+	pcap->control_only=control_only;
+}
+
+/** @brief samples the channel data records instead of capturing them
+ * all; control packets are rare and always kept. Combined with a small
+ * snaplen this makes an always-on production capture affordable, e.g.
+ * rate 100 and snaplen 64 for a 1% header-only take.
+ * @param pcap the pcap file
+ * @param rate keep about one of every rate data records, 0 or 1 for all.
+ */
+void ssh_pcap_file_set_sampling(ssh_pcap_file pcap, uint32_t rate){
+	if(pcap == NULL)
+		return;
+	pcap->sample_rate=rate;
+}
+
+/** @internal
+ * @brief decides whether the sampler drops this data record
+ */
+static int ssh_pcap_sample_skip(ssh_pcap_file pcap){
+	/* any cheap generator does, the traffic is not adversarial */
+	pcap->sample_state = pcap->sample_state * 1103515245u + 12345u;
+	return ((pcap->sample_state >> 16) % pcap->sample_rate) != 0;
+}
+
+/** @internal
+ * @brief message type of a framed SSH packet, 0 when the data is not a
+ * framed packet (e.g. a banner line)
+ */
+static uint8_t ssh_pcap_packet_type(const unsigned char *data, uint32_t len){
+	uint32_t wire;
+	if(len < 6)
+		return 0;
+	memcpy(&wire, data, sizeof(uint32_t));
+	if(ntohl(wire) != len - sizeof(uint32_t))
+		return 0;
+	return data[5];
+}
+
+/** @internal
+ * @brief writes out the batched records of a pcap file
+ */
+static int ssh_pcap_file_flush(ssh_pcap_file pcap){
+	uint32_t len;
+	if(pcap == NULL || pcap->output==NULL)
+		return SSH_ERROR;
+	if(pcap->write_buffer==NULL)
+		return SSH_OK;
+	len=buffer_get_rest_len(pcap->write_buffer);
+	if(len > 0){
+		if(fwrite(buffer_get_rest(pcap->write_buffer),len,1,pcap->output)<1)
+			return SSH_ERROR;
+		buffer_reinit(pcap->write_buffer);
+	}
+	return SSH_OK;
+}
+
 /** @internal
- * @brief writes a packet on file
+ * @brief appends a packet to the batch buffer of the file
  */
 static int ssh_pcap_file_write(ssh_pcap_file pcap, ssh_buffer packet){
-	int err;
 	uint32_t len;
 	if(pcap == NULL || pcap->output==NULL)
 		return SSH_ERROR;
 	len=buffer_get_rest_len(packet);
-	err=fwrite(buffer_get_rest(packet),len,1,pcap->output);
-	if(err<0)
-		return SSH_ERROR;
-	else
+	if(pcap->write_buffer==NULL)
+		pcap->write_buffer=ssh_buffer_new();
+	if(pcap->write_buffer==NULL){
+		/* no memory for batching, write through */
+		if(fwrite(buffer_get_rest(packet),len,1,pcap->output)<1)
+			return SSH_ERROR;
 		return SSH_OK;
+	}
+	if(buffer_add_data(pcap->write_buffer,buffer_get_rest(packet),len)<0)
+		return SSH_ERROR;
+	if(buffer_get_rest_len(pcap->write_buffer) >= PCAP_BUFFER_THRESHOLD)
+		return ssh_pcap_file_flush(pcap);
+	return SSH_OK;
 }
 
 /** @internal
@@ -180,6 +277,7 @@ int ssh_pcap_file_open(ssh_pcap_file pcap, const char *filename){
 	if(pcap == NULL)
 		return SSH_ERROR;
 	if(pcap->output){
+		ssh_pcap_file_flush(pcap);
 		fclose(pcap->output);
 		pcap->output=NULL;
 	}
@@ -209,12 +307,15 @@ int ssh_pcap_file_close(ssh_pcap_file pcap){
 	int err;
 	if(pcap ==NULL || pcap->output==NULL)
 		return SSH_ERROR;
-	err=fclose(pcap->output);
+	err=ssh_pcap_file_flush(pcap);
+	if(pcap->write_buffer){
+		ssh_buffer_free(pcap->write_buffer);
+		pcap->write_buffer=NULL;
+	}
+	if(fclose(pcap->output) != 0)
+		err=SSH_ERROR;
 	pcap->output=NULL;
-	if(err != 0)
-		return SSH_ERROR;
-	else
-		return SSH_OK;
+	return err;
 }
 
 void ssh_pcap_file_free(ssh_pcap_file pcap){
@@ -308,6 +409,24 @@ int ssh_pcap_context_write(ssh_pcap_context ctx,enum ssh_pcap_direction directio
 	if(ctx->connected==0)
 		if(ssh_pcap_context_connect(ctx)==SSH_ERROR)
 			return SSH_ERROR;
+	if(ctx->file->control_only || ctx->file->sample_rate > 1){
+		uint8_t ptype=ssh_pcap_packet_type(data, len);
+		if(ptype==SSH2_MSG_CHANNEL_DATA ||
+		   ptype==SSH2_MSG_CHANNEL_EXTENDED_DATA){
+			if(ctx->file->control_only ||
+			   (ctx->file->sample_rate > 1 && ssh_pcap_sample_skip(ctx->file))){
+				/* still advance the TCP sequence numbers so the kept
+				 * records read as a capture with drops, not overlaps */
+				if(direction==SSH_PCAP_DIR_OUT)
+					ctx->outsequence+=origlen;
+				else
+					ctx->insequence+=origlen;
+				return SSH_OK;
+			}
+		}
+	}
+	if(ctx->file->snaplen > 0 && len > ctx->file->snaplen)
+		len=ctx->file->snaplen;
 	ip=ssh_buffer_new();
 	if(ip==NULL){
 		ssh_set_error_oom(ctx->session);
@@ -422,6 +541,21 @@ int ssh_pcap_file_open(ssh_pcap_file pcap, const char *filename){
 	return SSH_ERROR;
 }
 
+void ssh_pcap_file_set_snaplen(ssh_pcap_file pcap, uint32_t snaplen){
+	(void) pcap;
+	(void) snaplen;
+}
+
+void ssh_pcap_file_set_control_only(ssh_pcap_file pcap, int control_only){
+	(void) pcap;
+	(void) control_only;
+}
+
+void ssh_pcap_file_set_sampling(ssh_pcap_file pcap, uint32_t rate){
+	(void) pcap;
+	(void) rate;
+}
+
 int ssh_set_pcap_file(ssh_session session, ssh_pcap_file pcapfile){
 	(void) pcapfile;
 	ssh_set_error(session,SSH_REQUEST_DENIED,"Pcap support not compiled in");
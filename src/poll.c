@@ -25,18 +25,26 @@
  * vim: ts=2 sw=2 et cindent
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sched_setaffinity() */
+#endif
+
 #include "config.h"
 
 #include <errno.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
 #include "libssh/priv.h"
 #include "libssh/libssh.h"
 #include "libssh/poll.h"
 #include "libssh/socket.h"
 #include "libssh/session.h"
+#include "libssh/buffer.h"
+#include "libssh/misc.h"
 #ifdef WITH_SERVER
 #include "libssh/server.h"
-#include "libssh/misc.h"
 #endif
 
 
@@ -72,14 +80,145 @@ struct ssh_poll_handle_struct {
   void *cb_data;
 };
 
+/*
+ * Per-slot dispatch state, kept in a contiguous slab parallel to the
+ * pollfds array. The callback and its cookie are mirrored from the handle
+ * on attach (and on ssh_poll_set_callback()), so the dispatch loop walks
+ * two dense arrays instead of chasing a heap pointer per ready fd.
+ */
+struct ssh_poll_slot {
+  ssh_poll_handle p;
+  ssh_poll_callback cb;
+  void *cb_data;
+};
+
+/*
+ * Hashed timer wheel attached to a poll context. Arming and cancelling a
+ * timer is O(1): timers hash into a slot by deadline and slots only get
+ * walked when their tick comes around, so many armed timeouts don't force
+ * short poll timeouts or needless wakeups.
+ */
+#define SSH_TIMER_WHEEL_SLOTS 256
+#define SSH_TIMER_WHEEL_TICK_MS 64
+
+struct ssh_poll_timer_struct {
+  struct ssh_poll_timer_struct *prev;
+  struct ssh_poll_timer_struct *next;
+  ssh_poll_ctx ctx;
+  uint64_t deadline; /* absolute milliseconds */
+  ssh_poll_timer_callback cb;
+  void *cb_data;
+};
+
 struct ssh_poll_ctx_struct {
-  ssh_poll_handle *pollptrs;
+  struct ssh_poll_slot *slots;
   ssh_pollfd_t *pollfds;
   size_t polls_allocated;
   size_t polls_used;
   size_t chunk_size;
+  /* timer wheel, see ssh_poll_timer_arm() */
+  struct ssh_poll_timer_struct *timer_wheel[SSH_TIMER_WHEEL_SLOTS];
+  size_t timers_armed;
+  uint64_t timer_last_tick; /* last wheel tick already fired */
+  /* sessions with a keepalive interval, see ssh_keepalive_attach() */
+  ssh_session keepalive_sessions;
+  ssh_poll_timer keepalive_timer;
+  uint64_t wakeups; /* returns from the poll syscall, see ssh_get_stats() */
+  /* busy-poll budget, see ssh_poll_ctx_set_spin() */
+  int spin_budget;
+  int spin_credit;
+#ifdef HAVE_SYS_EPOLL_H
+  /* epoll descriptor, or SSH_INVALID_SOCKET when the context runs on the
+   * portable poll() path */
+  int epfd;
+#endif
 };
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define SSH_EPOLL_MAX_EVENTS 64
+
+static uint32_t ssh_poll_events_to_epoll(short events) {
+  uint32_t ev = 0;
+
+  if (events & POLLIN) {
+    ev |= EPOLLIN;
+  }
+  if (events & POLLOUT) {
+    ev |= EPOLLOUT;
+  }
+  if (events & POLLPRI) {
+    ev |= EPOLLPRI;
+  }
+
+  return ev;
+}
+
+static short ssh_epoll_events_to_poll(uint32_t ev) {
+  short events = 0;
+
+  if (ev & EPOLLIN) {
+    events |= POLLIN;
+  }
+  if (ev & EPOLLOUT) {
+    events |= POLLOUT;
+  }
+  if (ev & EPOLLPRI) {
+    events |= POLLPRI;
+  }
+  if (ev & EPOLLERR) {
+    events |= POLLERR;
+  }
+  if (ev & EPOLLHUP) {
+    events |= POLLHUP;
+  }
+
+  return events;
+}
+
+/* Register or update a handle in the epoll set. If the kernel refuses the
+ * fd (e.g. a regular file), the whole context silently falls back to the
+ * poll() path, which handles every fd type. */
+static void ssh_poll_ctx_epoll_update(ssh_poll_ctx ctx, ssh_poll_handle p,
+    int op) {
+  struct epoll_event ev;
+  socket_t fd = ctx->pollfds[p->x.idx].fd;
+  int rc;
+
+  if (ctx->epfd == SSH_INVALID_SOCKET || fd == SSH_INVALID_SOCKET) {
+    return;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ssh_poll_events_to_epoll(ctx->pollfds[p->x.idx].events);
+  ev.data.ptr = p;
+
+  rc = epoll_ctl(ctx->epfd, op, fd, &ev);
+  if (rc < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+    rc = epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+  if (rc < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+    rc = epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  if (rc < 0 && op != EPOLL_CTL_DEL) {
+    close(ctx->epfd);
+    ctx->epfd = SSH_INVALID_SOCKET;
+  }
+}
+
+static void ssh_poll_ctx_epoll_remove(ssh_poll_ctx ctx, socket_t fd) {
+  struct epoll_event ev;
+
+  if (ctx->epfd == SSH_INVALID_SOCKET || fd == SSH_INVALID_SOCKET) {
+    return;
+  }
+  memset(&ev, 0, sizeof(ev));
+  epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 #ifdef HAVE_POLL
 #include <poll.h>
 
@@ -337,6 +476,9 @@ void ssh_poll_set_events(ssh_poll_handle p, short events) {
   p->events = events;
   if (p->ctx != NULL) {
     p->ctx->pollfds[p->x.idx].events = events;
+#ifdef HAVE_SYS_EPOLL_H
+    ssh_poll_ctx_epoll_update(p->ctx, p, EPOLL_CTL_MOD);
+#endif
   }
 }
 
@@ -349,7 +491,13 @@ void ssh_poll_set_events(ssh_poll_handle p, short events) {
  */
 void ssh_poll_set_fd(ssh_poll_handle p, socket_t fd) {
   if (p->ctx != NULL) {
+#ifdef HAVE_SYS_EPOLL_H
+    ssh_poll_ctx_epoll_remove(p->ctx, p->ctx->pollfds[p->x.idx].fd);
+#endif
     p->ctx->pollfds[p->x.idx].fd = fd;
+#ifdef HAVE_SYS_EPOLL_H
+    ssh_poll_ctx_epoll_update(p->ctx, p, EPOLL_CTL_ADD);
+#endif
   } else {
   	p->x.fd = fd;
   }
@@ -404,6 +552,10 @@ void ssh_poll_set_callback(ssh_poll_handle p, ssh_poll_callback cb, void *userda
   if (cb != NULL) {
     p->cb = cb;
     p->cb_data = userdata;
+    if (p->ctx != NULL) {
+      p->ctx->slots[p->x.idx].cb = cb;
+      p->ctx->slots[p->x.idx].cb_data = userdata;
+    }
   }
 }
 
@@ -433,21 +585,291 @@ ssh_poll_ctx ssh_poll_ctx_new(size_t chunk_size) {
 
     ctx->chunk_size = chunk_size;
 
+#ifdef HAVE_SYS_EPOLL_H
+    ctx->epfd = epoll_create(SSH_POLL_CTX_CHUNK);
+    if (ctx->epfd < 0) {
+        ctx->epfd = SSH_INVALID_SOCKET;
+    }
+#endif
+
     return ctx;
 }
 
+static uint64_t ssh_timer_now_ms(void) {
+  struct ssh_timestamp ts;
+
+  ssh_timestamp_init(&ts);
+
+  return (uint64_t) ts.seconds * 1000 + ts.useconds / 1000;
+}
+
+static size_t ssh_timer_slot(uint64_t deadline) {
+  return (size_t) (deadline / SSH_TIMER_WHEEL_TICK_MS) %
+      SSH_TIMER_WHEEL_SLOTS;
+}
+
+/**
+ * @internal
+ *
+ * @brief Arm a one-shot timer on a poll context.
+ *
+ * The callback fires from ssh_poll_ctx_dopoll() once the deadline has
+ * passed; the timer is freed after firing. Arming is O(1).
+ *
+ * @param ctx           The poll context to attach the timer to.
+ * @param timeout_ms    Delay before the callback fires, in milliseconds.
+ * @param cb            Function to call on expiry.
+ * @param userdata      Userdata passed to the callback.
+ *
+ * @return              The timer handle (valid until it fires or is
+ *                      cancelled), NULL on error.
+ */
+ssh_poll_timer ssh_poll_timer_arm(ssh_poll_ctx ctx, int timeout_ms,
+    ssh_poll_timer_callback cb, void *userdata) {
+  struct ssh_poll_timer_struct *timer;
+  size_t slot;
+
+  if (ctx == NULL || cb == NULL || timeout_ms < 0) {
+    return NULL;
+  }
+
+  timer = malloc(sizeof(struct ssh_poll_timer_struct));
+  if (timer == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(timer);
+
+  timer->ctx = ctx;
+  timer->deadline = ssh_timer_now_ms() + timeout_ms;
+  timer->cb = cb;
+  timer->cb_data = userdata;
+
+  slot = ssh_timer_slot(timer->deadline);
+  timer->next = ctx->timer_wheel[slot];
+  if (timer->next != NULL) {
+    timer->next->prev = timer;
+  }
+  ctx->timer_wheel[slot] = timer;
+  ctx->timers_armed++;
+
+  return timer;
+}
+
+/**
+ * @internal
+ *
+ * @brief Cancel an armed timer. O(1), the callback will not fire.
+ *
+ * @param timer         Timer returned by ssh_poll_timer_arm().
+ */
+void ssh_poll_timer_cancel(ssh_poll_timer timer) {
+  if (timer == NULL) {
+    return;
+  }
+
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    timer->ctx->timer_wheel[ssh_timer_slot(timer->deadline)] = timer->next;
+  }
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+  timer->ctx->timers_armed--;
+  SAFE_FREE(timer);
+}
+
+/* keepalive scheduler granularity; intervals are in whole seconds */
+#define SSH_KEEPALIVE_TICK_MS 1000
+
+/* One tick for every keepalive session of the context: a single timer
+ * walks the intrusive list and emits a keepalive on each session whose
+ * interval elapsed, instead of one timer event per session. */
+static void ssh_keepalive_tick(void *userdata) {
+  ssh_poll_ctx ctx = userdata;
+  ssh_session session;
+  uint64_t now = ssh_timer_now_ms();
+
+  ctx->keepalive_timer = NULL;
+
+  for (session = ctx->keepalive_sessions;
+       session != NULL;
+       session = session->keepalive_next) {
+    if (now - session->keepalive_last_ms <
+        (uint64_t) session->keepalive_interval * 1000) {
+      continue;
+    }
+    session->keepalive_last_ms = now;
+    if (ssh_is_connected(session)) {
+      ssh_send_keepalive(session);
+    }
+  }
+
+  if (ctx->keepalive_sessions != NULL) {
+    ctx->keepalive_timer = ssh_poll_timer_arm(ctx, SSH_KEEPALIVE_TICK_MS,
+        ssh_keepalive_tick, ctx);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Put a session under the keepalive scheduler of a poll context.
+ *
+ * Called wherever a session binds to a context; a session with no
+ * keepalive interval is detached instead, so flipping the option off
+ * takes effect on the next poll.
+ *
+ * @param ctx           The poll context the session is polled on.
+ * @param session       The session to schedule.
+ */
+void ssh_keepalive_attach(ssh_poll_ctx ctx, ssh_session session) {
+  if (ctx == NULL || session == NULL) {
+    return;
+  }
+  if (session->keepalive_interval <= 0) {
+    ssh_keepalive_detach(session);
+    return;
+  }
+  if (session->keepalive_ctx == ctx) {
+    return;
+  }
+  ssh_keepalive_detach(session);
+
+  session->keepalive_ctx = ctx;
+  session->keepalive_last_ms = ssh_timer_now_ms();
+  session->keepalive_prev = NULL;
+  session->keepalive_next = ctx->keepalive_sessions;
+  if (session->keepalive_next != NULL) {
+    session->keepalive_next->keepalive_prev = session;
+  }
+  ctx->keepalive_sessions = session;
+
+  if (ctx->keepalive_timer == NULL) {
+    ctx->keepalive_timer = ssh_poll_timer_arm(ctx, SSH_KEEPALIVE_TICK_MS,
+        ssh_keepalive_tick, ctx);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Take a session off its keepalive scheduler, if it is on one.
+ *
+ * @param session       The session to unschedule.
+ */
+void ssh_keepalive_detach(ssh_session session) {
+  ssh_poll_ctx ctx;
+
+  if (session == NULL || session->keepalive_ctx == NULL) {
+    return;
+  }
+  ctx = session->keepalive_ctx;
+
+  if (session->keepalive_prev != NULL) {
+    session->keepalive_prev->keepalive_next = session->keepalive_next;
+  } else {
+    ctx->keepalive_sessions = session->keepalive_next;
+  }
+  if (session->keepalive_next != NULL) {
+    session->keepalive_next->keepalive_prev = session->keepalive_prev;
+  }
+  session->keepalive_prev = NULL;
+  session->keepalive_next = NULL;
+  session->keepalive_ctx = NULL;
+
+  if (ctx->keepalive_sessions == NULL && ctx->keepalive_timer != NULL) {
+    ssh_poll_timer_cancel(ctx->keepalive_timer);
+    ctx->keepalive_timer = NULL;
+  }
+}
+
+/* Smallest delay in ms until an armed timer expires, -1 if none. Only
+ * called when timers are armed, so the slot scan is bounded by the armed
+ * count. */
+static int ssh_timer_next_delta(ssh_poll_ctx ctx, uint64_t now) {
+  struct ssh_poll_timer_struct *timer;
+  uint64_t best = 0;
+  int found = 0;
+  size_t i;
+
+  for (i = 0; i < SSH_TIMER_WHEEL_SLOTS; i++) {
+    for (timer = ctx->timer_wheel[i]; timer != NULL; timer = timer->next) {
+      if (!found || timer->deadline < best) {
+        best = timer->deadline;
+        found = 1;
+      }
+    }
+  }
+  if (!found) {
+    return -1;
+  }
+  if (best <= now) {
+    return 0;
+  }
+
+  return (int) (best - now);
+}
+
+/* Fire every timer whose deadline has passed. Walks only the wheel slots
+ * whose tick came around since the last call. */
+static void ssh_timer_fire(ssh_poll_ctx ctx) {
+  struct ssh_poll_timer_struct *timer;
+  uint64_t now;
+  uint64_t tick;
+  uint64_t last;
+  size_t span;
+
+  if (ctx->timers_armed == 0) {
+    return;
+  }
+
+  now = ssh_timer_now_ms();
+  tick = now / SSH_TIMER_WHEEL_TICK_MS;
+  last = ctx->timer_last_tick;
+  ctx->timer_last_tick = tick;
+
+  span = (size_t) (tick - last);
+  if (span > SSH_TIMER_WHEEL_SLOTS) {
+    span = SSH_TIMER_WHEEL_SLOTS;
+  }
+
+  /* walk slots (last, tick], they cover every deadline <= now */
+  for (; span > 0; span--, tick--) {
+restart_slot:
+    for (timer = ctx->timer_wheel[tick % SSH_TIMER_WHEEL_SLOTS];
+        timer != NULL; timer = timer->next) {
+      if (timer->deadline <= now) {
+        ssh_poll_timer_callback cb = timer->cb;
+        void *cb_data = timer->cb_data;
+
+        ssh_poll_timer_cancel(timer);
+        cb(cb_data);
+        /* the callback may have armed or cancelled other timers in this
+         * slot, restart its walk; fired timers are gone so this makes
+         * progress */
+        goto restart_slot;
+      }
+    }
+  }
+}
+
 /**
  * @brief  Free a poll context.
  *
  * @param  ctx          Pointer to an already allocated poll context.
  */
 void ssh_poll_ctx_free(ssh_poll_ctx ctx) {
+  while (ctx->keepalive_sessions != NULL) {
+    ssh_keepalive_detach(ctx->keepalive_sessions);
+  }
+
   if (ctx->polls_allocated > 0) {
     register size_t i, used;
 
     used = ctx->polls_used;
     for (i = 0; i < used; ) {
-      ssh_poll_handle p = ctx->pollptrs[i];
+      ssh_poll_handle p = ctx->slots[i].p;
       socket_t fd = ctx->pollfds[i].fd;
 
       /* force poll object removal */
@@ -463,29 +885,45 @@ void ssh_poll_ctx_free(ssh_poll_ctx ctx) {
       }
     }
 
-    SAFE_FREE(ctx->pollptrs);
+    SAFE_FREE(ctx->slots);
     SAFE_FREE(ctx->pollfds);
   }
 
+  if (ctx->timers_armed > 0) {
+    size_t i;
+
+    for (i = 0; i < SSH_TIMER_WHEEL_SLOTS; i++) {
+      while (ctx->timer_wheel[i] != NULL) {
+        ssh_poll_timer_cancel(ctx->timer_wheel[i]);
+      }
+    }
+  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  if (ctx->epfd != SSH_INVALID_SOCKET) {
+    close(ctx->epfd);
+  }
+#endif
+
   SAFE_FREE(ctx);
 }
 
 static int ssh_poll_ctx_resize(ssh_poll_ctx ctx, size_t new_size) {
-  ssh_poll_handle *pollptrs;
+  struct ssh_poll_slot *slots;
   ssh_pollfd_t *pollfds;
 
-  pollptrs = realloc(ctx->pollptrs, sizeof(ssh_poll_handle *) * new_size);
-  if (pollptrs == NULL) {
+  slots = realloc(ctx->slots, sizeof(struct ssh_poll_slot) * new_size);
+  if (slots == NULL) {
     return -1;
   }
 
   pollfds = realloc(ctx->pollfds, sizeof(ssh_pollfd_t) * new_size);
   if (pollfds == NULL) {
-    ctx->pollptrs = realloc(pollptrs, sizeof(ssh_poll_handle *) * ctx->polls_allocated);
+    ctx->slots = realloc(slots, sizeof(struct ssh_poll_slot) * ctx->polls_allocated);
     return -1;
   }
 
-  ctx->pollptrs = pollptrs;
+  ctx->slots = slots;
   ctx->pollfds = pollfds;
   ctx->polls_allocated = new_size;
 
@@ -515,12 +953,18 @@ int ssh_poll_ctx_add(ssh_poll_ctx ctx, ssh_poll_handle p) {
 
   fd = p->x.fd;
   p->x.idx = ctx->polls_used++;
-  ctx->pollptrs[p->x.idx] = p;
+  ctx->slots[p->x.idx].p = p;
+  ctx->slots[p->x.idx].cb = p->cb;
+  ctx->slots[p->x.idx].cb_data = p->cb_data;
   ctx->pollfds[p->x.idx].fd = fd;
   ctx->pollfds[p->x.idx].events = p->events;
   ctx->pollfds[p->x.idx].revents = 0;
   p->ctx = ctx;
 
+#ifdef HAVE_SYS_EPOLL_H
+  ssh_poll_ctx_epoll_update(ctx, p, EPOLL_CTL_ADD);
+#endif
+
   return 0;
 }
 
@@ -544,6 +988,12 @@ int ssh_poll_ctx_add_socket (ssh_poll_ctx ctx, ssh_socket s) {
   p_out=ssh_socket_get_poll_handle_out(s);
   if(p_in != p_out)
     ret = ssh_poll_ctx_add(ctx,p_out);
+  if(ret != 0)
+    return ret;
+  /* a connect may be racing a secondary attempt, watch it too */
+  p_out=ssh_socket_get_race_poll(s);
+  if(p_out != NULL && ssh_poll_get_ctx(p_out) == NULL)
+    ret = ssh_poll_ctx_add(ctx,p_out);
   return ret;
 }
 
@@ -558,6 +1008,9 @@ void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
   size_t i;
 
   i = p->x.idx;
+#ifdef HAVE_SYS_EPOLL_H
+  ssh_poll_ctx_epoll_remove(ctx, ctx->pollfds[i].fd);
+#endif
   p->x.fd = ctx->pollfds[i].fd;
   p->ctx = NULL;
 
@@ -566,8 +1019,8 @@ void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
   /* fill the empty poll slot with the last one */
   if (ctx->polls_used > 0 && ctx->polls_used != i) {
     ctx->pollfds[i] = ctx->pollfds[ctx->polls_used];
-    ctx->pollptrs[i] = ctx->pollptrs[ctx->polls_used];
-    ctx->pollptrs[i]->x.idx = i;
+    ctx->slots[i] = ctx->slots[ctx->polls_used];
+    ctx->slots[i].p->x.idx = i;
   }
 
   /* this will always leave at least chunk_size polls allocated */
@@ -592,36 +1045,40 @@ void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
  *          SSH_AGAIN   Timeout occured
  */
 
-int ssh_poll_ctx_dopoll(ssh_poll_ctx ctx, int timeout) {
-  int rc;
-  int i, used;
+/**
+ * @internal
+ * @brief Dispatch the ready handles marked in ctx->pollfds[].revents.
+ *
+ * Callbacks may add or remove handles from the context; the loop restarts
+ * when an entry disappears under it.
+ */
+static int ssh_poll_ctx_dispatch(ssh_poll_ctx ctx, int rc) {
+  size_t i;
   ssh_poll_handle p;
   socket_t fd;
   int revents;
 
-  if (!ctx->polls_used)
-    return 0;
-
-  rc = ssh_poll(ctx->pollfds, ctx->polls_used, timeout);
-  if(rc < 0)
-    return SSH_ERROR;
-  if (rc == 0)
-    return SSH_AGAIN;
-  used = ctx->polls_used;
-  for (i = 0; i < used && rc > 0; ) {
+  for (i = 0; i < ctx->polls_used && rc > 0; ) {
     if (!ctx->pollfds[i].revents) {
       i++;
     } else {
-      p = ctx->pollptrs[i];
+      p = ctx->slots[i].p;
       fd = ctx->pollfds[i].fd;
       revents = ctx->pollfds[i].revents;
 
-      if (p->cb && p->cb(p, fd, revents, p->cb_data) < 0) {
-        /* the poll was removed, reload the used counter and start again */
-        used = ctx->polls_used;
+      if (ctx->slots[i].cb &&
+          ctx->slots[i].cb(p, fd, revents, ctx->slots[i].cb_data) < 0) {
+        /* the poll was removed, start again */
         i=0;
       } else {
-        ctx->pollfds[i].revents = 0;
+        /* the callback may have removed handles - even this one, moving
+         * it to another context; only touch p's slot if it still sits in
+         * this context (removal swaps the last handle into the hole, the
+         * x.idx back-reference keeps the lookup valid) */
+        if (p->ctx == ctx && p->x.idx < ctx->polls_used &&
+            ctx->slots[p->x.idx].p == p) {
+          ctx->pollfds[p->x.idx].revents = 0;
+        }
         i++;
       }
 
@@ -632,6 +1089,124 @@ int ssh_poll_ctx_dopoll(ssh_poll_ctx ctx, int timeout) {
   return rc;
 }
 
+static int ssh_poll_ctx_dopoll_once(ssh_poll_ctx ctx, int timeout) {
+  int rc;
+
+  /* one clock read serves every timeout computed this loop turn */
+  ssh_timestamp_cache_refresh();
+
+  /* don't sleep past the earliest armed timer */
+  if (ctx->timers_armed > 0) {
+    int tdelta = ssh_timer_next_delta(ctx, ssh_timer_now_ms());
+
+    if (tdelta >= 0 && (timeout < 0 || tdelta < timeout)) {
+      timeout = tdelta;
+    }
+  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  if (ctx->epfd != SSH_INVALID_SOCKET) {
+    struct epoll_event events[SSH_EPOLL_MAX_EVENTS];
+    int nev;
+    int i;
+
+    do {
+      nev = epoll_wait(ctx->epfd, events, SSH_EPOLL_MAX_EVENTS, timeout);
+    } while (nev < 0 && errno == EINTR);
+    ssh_timestamp_cache_refresh();
+    if (nev < 0)
+      return SSH_ERROR;
+    ctx->wakeups++;
+    ssh_timer_fire(ctx);
+    if (nev == 0)
+      return SSH_AGAIN;
+
+    /* Mark the ready handles, then dispatch through the common loop which
+     * copes with handles being added or removed by the callbacks. */
+    rc = 0;
+    for (i = 0; i < nev; i++) {
+      ssh_poll_handle p = events[i].data.ptr;
+
+      if (p != NULL && p->ctx == ctx && p->x.idx < ctx->polls_used &&
+          ctx->slots[p->x.idx].p == p) {
+        ctx->pollfds[p->x.idx].revents =
+            ssh_epoll_events_to_poll(events[i].events);
+        rc++;
+      }
+    }
+
+    return ssh_poll_ctx_dispatch(ctx, rc);
+  }
+#endif /* HAVE_SYS_EPOLL_H */
+
+  rc = ssh_poll(ctx->pollfds, ctx->polls_used, timeout);
+  ssh_timestamp_cache_refresh();
+  if(rc < 0)
+    return SSH_ERROR;
+  ctx->wakeups++;
+  ssh_timer_fire(ctx);
+  if (rc == 0)
+    return SSH_AGAIN;
+
+  return ssh_poll_ctx_dispatch(ctx, rc);
+}
+
+int ssh_poll_ctx_dopoll(ssh_poll_ctx ctx, int timeout) {
+  int rc;
+
+  if (!ctx->polls_used)
+    return 0;
+
+  /* Spin-then-poll: right after activity the next message is usually
+   * already in a socket buffer, so a few zero-timeout probes skip the
+   * sleep/wake cycle of a blocking poll. The credit only renews when a
+   * probe (or the eventual blocking poll) finds something, so an idle
+   * context falls back to plain sleeping within spin_budget turns. */
+  while (ctx->spin_credit > 0 && timeout != 0) {
+    rc = ssh_poll_ctx_dopoll_once(ctx, 0);
+    if (rc != SSH_AGAIN) {
+      if (rc != SSH_ERROR) {
+        ctx->spin_credit = ctx->spin_budget;
+      }
+      return rc;
+    }
+    ctx->spin_credit--;
+  }
+
+  rc = ssh_poll_ctx_dopoll_once(ctx, timeout);
+  if (rc != SSH_AGAIN && rc != SSH_ERROR) {
+    ctx->spin_credit = ctx->spin_budget;
+  }
+  return rc;
+}
+
+/**
+ * @internal
+ * @brief Sets the busy-poll budget of a poll context: how many
+ * zero-timeout probes ssh_poll_ctx_dopoll() makes after activity before
+ * it arms a sleeping poll again. 0 (the default) disables spinning.
+ */
+void ssh_poll_ctx_set_spin(ssh_poll_ctx ctx, int budget) {
+  if (ctx == NULL) {
+    return;
+  }
+  if (budget < 0) {
+    budget = 0;
+  }
+  ctx->spin_budget = budget;
+  ctx->spin_credit = budget;
+}
+
+/** @internal
+ * @brief returns how often the context's poll call woke up so far.
+ */
+uint64_t ssh_poll_ctx_get_wakeups(ssh_poll_ctx ctx) {
+  if (ctx == NULL) {
+    return 0;
+  }
+  return ctx->wakeups;
+}
+
 /**
  * @internal
  * @brief gets the default poll structure for the current session,
@@ -647,6 +1222,108 @@ ssh_poll_ctx ssh_poll_get_default_ctx(ssh_session session){
 	return session->default_poll_ctx;
 }
 
+/**
+ * @brief Return the socket and the poll events an external event loop
+ * should wait for on behalf of a session.
+ *
+ * Together with ssh_session_process_events() this lets a reactor built
+ * on poll or epoll drive many sessions from a single thread without
+ * handing control to the library's own poll loop: register the returned
+ * fd with the returned events, and feed the received revents back with
+ * ssh_session_process_events() when they fire. The wanted events change
+ * as the session advances - POLLOUT while connecting or flushing,
+ * POLLIN while waiting for packets - so query them again after every
+ * processed batch.
+ *
+ * The session should be in nonblocking mode, see ssh_set_blocking().
+ *
+ * @param[in]  session  The session to inspect.
+ *
+ * @param[out] fd       The file descriptor to wait on.
+ *
+ * @param[out] events   The poll events (POLLIN/POLLOUT) currently
+ *                      wanted by the session.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the session has
+ *                      no socket.
+ *
+ * @see ssh_session_process_events()
+ */
+int ssh_session_get_fd_events(ssh_session session, socket_t *fd,
+    short *events) {
+  ssh_poll_handle in, out;
+
+  if (session == NULL || session->socket == NULL ||
+      fd == NULL || events == NULL) {
+    return SSH_ERROR;
+  }
+
+  in = ssh_socket_get_poll_handle_in(session->socket);
+  out = ssh_socket_get_poll_handle_out(session->socket);
+  if (in == NULL || out == NULL) {
+    return SSH_ERROR;
+  }
+
+  *fd = ssh_poll_get_fd(in);
+  *events = in->events | out->events;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Advance a session's state machine with events collected by an
+ * external event loop.
+ *
+ * The revents are dispatched to the session's socket callbacks exactly
+ * as the internal poll loop would, so connect, key exchange,
+ * authentication and channel I/O all progress without blocking; use the
+ * usual nonblocking calls (ssh_connect(), ssh_userauth_*,
+ * ssh_channel_read_nonblocking(), ...) to collect the results.
+ *
+ * @param[in]  session  The session to advance.
+ *
+ * @param[in]  revents  The poll revents reported for the session's fd.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the session
+ *                      entered an error state.
+ *
+ * @see ssh_session_get_fd_events()
+ */
+int ssh_session_process_events(ssh_session session, short revents) {
+  ssh_poll_handle in, out;
+  short ev;
+  int rc = 0;
+
+  if (session == NULL || session->socket == NULL) {
+    return SSH_ERROR;
+  }
+
+  in = ssh_socket_get_poll_handle_in(session->socket);
+  out = ssh_socket_get_poll_handle_out(session->socket);
+  if (in == NULL || out == NULL) {
+    return SSH_ERROR;
+  }
+
+  /* deliver only what the handle asked for, plus error conditions */
+  ev = revents & (in->events | POLLERR | POLLHUP | POLLNVAL);
+  if (ev != 0 && in->cb != NULL) {
+    rc = in->cb(in, ssh_poll_get_fd(in), ev, in->cb_data);
+  }
+  /* a negative return means the callback disposed of its handle */
+  if (rc >= 0 && out != in) {
+    ev = revents & (out->events | POLLERR | POLLHUP | POLLNVAL);
+    if (ev != 0 && out->cb != NULL) {
+      (void) out->cb(out, ssh_poll_get_fd(out), ev, out->cb_data);
+    }
+  }
+
+  if (session->session_state == SSH_SESSION_STATE_ERROR) {
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
 /* public event API */
 
 struct ssh_event_fd_wrapper {
@@ -658,6 +1335,9 @@ struct ssh_event_struct {
     ssh_poll_ctx ctx;
 #ifdef WITH_SERVER
     struct ssh_list *sessions;
+    /* bumped on every add/remove so the dispatch walk in
+     * ssh_event_dopoll() notices the list changed under it */
+    unsigned int sessions_gen;
 #endif
 };
 
@@ -779,10 +1459,11 @@ int ssh_event_add_session(ssh_event event, ssh_session session) {
         return SSH_ERROR;
     }
     for(i = 0; i < session->default_poll_ctx->polls_used; i++) {
-        p = session->default_poll_ctx->pollptrs[i];
+        p = session->default_poll_ctx->slots[i].p;
         ssh_poll_ctx_remove(session->default_poll_ctx, p);
         ssh_poll_ctx_add(event->ctx, p);
     }
+    ssh_keepalive_attach(event->ctx, session);
 #ifdef WITH_SERVER
     iterator = ssh_list_get_iterator(event->sessions);
     while(iterator != NULL) {
@@ -795,6 +1476,7 @@ int ssh_event_add_session(ssh_event event, ssh_session session) {
     if(ssh_list_append(event->sessions, session) == SSH_ERROR) {
         return SSH_ERROR;
     }
+    event->sessions_gen++;
 #endif
     return SSH_OK;
 }
@@ -820,9 +1502,95 @@ int ssh_event_dopoll(ssh_event event, int timeout) {
         return SSH_ERROR;
     }
     rc = ssh_poll_ctx_dopoll(event->ctx, timeout);
+#ifdef WITH_SERVER
+    if (rc != SSH_ERROR) {
+        struct ssh_iterator *iterator;
+        unsigned int gen;
+
+        /* drain the message queues the socket callbacks just filled; a
+         * callback may add or remove sessions, in which case the walk is
+         * restarted (harmless, drained sessions are a cheap no-op) */
+restart:
+        gen = event->sessions_gen;
+        for (iterator = ssh_list_get_iterator(event->sessions);
+             iterator != NULL;
+             iterator = iterator->next) {
+            ssh_execute_message_callbacks((ssh_session)iterator->data);
+            if (event->sessions_gen != gen) {
+                goto restart;
+            }
+        }
+    }
+#endif
     return rc;
 }
 
+/**
+ * @brief  Set the busy-poll budget of an event context.
+ *
+ * After a poll found activity, ssh_event_dopoll() makes up to this many
+ * zero-timeout probes before arming a sleeping poll again, trading a
+ * little CPU for the sleep/wake latency on the next message. An idle
+ * event falls back to plain blocking polls within the budget.
+ *
+ * @param  event        The ssh_event object.
+ * @param  budget       Number of probes, 0 (the default) to disable.
+ *
+ * @returns SSH_OK      on success
+ *          SSH_ERROR   on failure
+ */
+int ssh_event_set_spin(ssh_event event, int budget) {
+    if(event == NULL || event->ctx == NULL) {
+        return SSH_ERROR;
+    }
+    ssh_poll_ctx_set_spin(event->ctx, budget);
+    return SSH_OK;
+}
+
+/**
+ * @brief  Pin the calling thread, which must be the one driving this
+ *         event context, to one CPU.
+ *
+ * A loop dedicated to a CPU keeps the sessions it serves on one NUMA
+ * node: the buffer recycling pool is per-thread, so once the thread can
+ * no longer migrate every pooled buffer stays on the node that first
+ * touched it. The buffers the thread cached before the move may live on
+ * another node and are dropped. For the same reason a session should be
+ * added to a single event context at accept time and stay there.
+ *
+ * @param  event        The ssh_event object driven by the calling thread.
+ * @param  cpu          The CPU to pin to, numbered as in /proc/cpuinfo.
+ *
+ * @returns SSH_OK      on success
+ *          SSH_ERROR   on failure or when the platform has no thread
+ *                      affinity support.
+ */
+int ssh_event_set_affinity(ssh_event event, int cpu) {
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+
+    if(event == NULL || event->ctx == NULL || cpu < 0) {
+        return SSH_ERROR;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        return SSH_ERROR;
+    }
+
+    /* drop the buffers pooled before the move, they may sit on the
+     * wrong node */
+    buffer_pool_cleanup();
+
+    return SSH_OK;
+#else
+    (void) event;
+    (void) cpu;
+    return SSH_ERROR;
+#endif
+}
+
 /**
  * @brief  Remove a socket fd from an event context.
  *
@@ -844,7 +1612,7 @@ int ssh_event_remove_fd(ssh_event event, socket_t fd) {
     used = event->ctx->polls_used;
     for (i = 0; i < used; i++) {
         if(fd == event->ctx->pollfds[i].fd) {
-            p = event->ctx->pollptrs[i];
+            p = event->ctx->slots[i].p;
             ssh_poll_ctx_remove(event->ctx, p);
             free(p->cb_data);
             ssh_poll_free(p);
@@ -869,7 +1637,7 @@ int ssh_event_remove_fd(ssh_event event, socket_t fd) {
  */
 int ssh_event_remove_session(ssh_event event, ssh_session session) {
     ssh_poll_handle p;
-    register size_t i, used;
+    register size_t i;
     int rc = SSH_ERROR;
     socket_t session_fd;
 #ifdef WITH_SERVER
@@ -881,20 +1649,29 @@ int ssh_event_remove_session(ssh_event event, ssh_session session) {
     }
 
     session_fd = ssh_get_fd(session);
-    used = event->ctx->polls_used;
-    for(i = 0; i < used; i++) {
+    i = 0;
+    while (i < event->ctx->polls_used) {
         if(session_fd == event->ctx->pollfds[i].fd) {
-            p = event->ctx->pollptrs[i];
+            p = event->ctx->slots[i].p;
             ssh_poll_ctx_remove(event->ctx, p);
             ssh_poll_ctx_add(session->default_poll_ctx, p);
             rc = SSH_OK;
+            /* removal swapped the last handle into slot i, rescan it */
+        } else {
+            i++;
         }
     }
+    /* hand the keepalive schedule back to the session's own context */
+    ssh_keepalive_detach(session);
+    if (session->default_poll_ctx != NULL) {
+        ssh_keepalive_attach(session->default_poll_ctx, session);
+    }
 #ifdef WITH_SERVER
     iterator = ssh_list_get_iterator(event->sessions);
     while(iterator != NULL) {
         if((ssh_session)iterator->data == session) {
             ssh_list_remove(event->sessions, iterator);
+            event->sessions_gen++;
             /* there should be only one instance of this session */
             break;
         }
@@ -22,11 +22,22 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "libssh/priv.h"
+#include "libssh/session.h"
 #include "libssh/scp.h"
 
+static int ssh_scp_harvest_acks(ssh_scp scp, int block);
+
 /**
  * @defgroup libssh_scp The SSH scp functions
  * @ingroup libssh
@@ -142,6 +153,13 @@ int ssh_scp_close(ssh_scp scp){
   if(scp==NULL)
     return SSH_ERROR;
   if(scp->channel != NULL){
+    if(scp->pipelined){
+      /* collect the acks of everything still in flight and flush the
+       * corked writes before signalling EOF */
+      if(ssh_scp_drain(scp) == SSH_ERROR)
+        return SSH_ERROR;
+      ssh_scp_pipeline(scp,0);
+    }
     if(ssh_channel_send_eof(scp->channel) == SSH_ERROR){
       scp->state=SSH_SCP_ERROR;
       return SSH_ERROR;
@@ -215,6 +233,10 @@ int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode){
     scp->state=SSH_SCP_ERROR;
     return SSH_ERROR;
   }
+  if(scp->pipelined){
+    scp->pending_acks++;
+    return ssh_scp_harvest_acks(scp,0);
+  }
   r=ssh_channel_read(scp->channel,&code,1,0);
   if(r<=0){
     ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
@@ -252,6 +274,10 @@ int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode){
     scp->state=SSH_SCP_ERROR;
     return SSH_ERROR;
   }
+  if(scp->pipelined){
+    scp->pending_acks++;
+    return ssh_scp_harvest_acks(scp,0);
+  }
   r=ssh_channel_read(scp->channel,&code,1,0);
   if(r<=0){
     ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
@@ -306,6 +332,15 @@ int ssh_scp_push_file64(ssh_scp scp, const char *filename, uint64_t size, int mo
     scp->state=SSH_SCP_ERROR;
     return SSH_ERROR;
   }
+  if(scp->pipelined){
+    scp->pending_acks++;
+    if(ssh_scp_harvest_acks(scp,0) == SSH_ERROR)
+      return SSH_ERROR;
+    scp->filelen = size;
+    scp->processed = 0;
+    scp->state=SSH_SCP_WRITE_WRITING;
+    return SSH_OK;
+  }
   r=ssh_channel_read(scp->channel,&code,1,0);
   if(r<=0){
     ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
@@ -391,6 +426,110 @@ int ssh_scp_response(ssh_scp scp, char **response){
 	return SSH_ERROR;
 }
 
+/**
+ * @internal
+ *
+ * @brief Collect acknowledgments owed to pipelined requests.
+ *
+ * @param[in]  scp      The scp handle.
+ *
+ * @param[in]  block    0 to only consume acks the sink already sent,
+ *                      1 to wait until none is pending anymore.
+ *
+ * @returns             SSH_OK, or SSH_ERROR once the sink reported a
+ *                      fatal status for any pipelined request.
+ */
+static int ssh_scp_harvest_acks(ssh_scp scp, int block){
+  unsigned char code;
+  char msg[128];
+  int r;
+
+  while(scp->pending_acks > 0){
+    if(!block && ssh_channel_poll(scp->channel,0) <= 0)
+      return SSH_OK;
+    r=ssh_channel_read(scp->channel,&code,1,0);
+    if(r<=0){
+      ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
+      scp->state=SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+    if(code == 0){
+      scp->pending_acks--;
+      continue;
+    }
+    if(code > 2){
+      ssh_set_error(scp->session,SSH_FATAL, "SCP: invalid status code %ud received", code);
+      scp->state=SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+    r=ssh_scp_read_string(scp,msg,sizeof(msg));
+    if(r==SSH_ERROR){
+      scp->state=SSH_SCP_ERROR;
+      return r;
+    }
+    if(code == 1){
+      ssh_log(scp->session,SSH_LOG_RARE,"SCP: Warning: status code 1 received: %s", msg);
+      scp->pending_acks--;
+      continue;
+    }
+    ssh_set_error(scp->session,SSH_FATAL, "SCP: Error: status code 2 received: %s", msg);
+    scp->state=SSH_SCP_ERROR;
+    return SSH_ERROR;
+  }
+  return SSH_OK;
+}
+
+/**
+ * @brief Switch a sink-mode scp session to pipelined operation.
+ *
+ * Pushing a tree of small files costs two round trips per file when
+ * every C/D/E line waits for its acknowledgment. Pipelined, the
+ * headers and file data are streamed back to back - the session is
+ * corked so consecutive small writes leave as full packets - and the
+ * acknowledgments are collected asynchronously as they come back.
+ * A sink error surfaces on a later push or on ssh_scp_drain(), which
+ * must be called before relying on the transfer having completed;
+ * ssh_scp_close() drains implicitly.
+ *
+ * @param[in]  scp      The scp handle, created in write mode.
+ *
+ * @param[in]  enable   1 to pipeline, 0 to return to the synchronous
+ *                      behaviour (flushes buffered writes).
+ *
+ * @returns             SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_scp_drain()
+ */
+int ssh_scp_pipeline(ssh_scp scp, int enable){
+  if(scp==NULL)
+      return SSH_ERROR;
+  if(scp->mode != SSH_SCP_WRITE){
+    ssh_set_error(scp->session,SSH_FATAL,"ssh_scp_pipeline is for write mode sessions");
+    return SSH_ERROR;
+  }
+  scp->pipelined = enable != 0;
+  ssh_set_cork(scp->session, scp->pipelined);
+  return SSH_OK;
+}
+
+/**
+ * @brief Wait for every pipelined request to be acknowledged.
+ *
+ * @param[in]  scp      The scp handle.
+ *
+ * @returns             SSH_OK when all pending requests were accepted,
+ *                      SSH_ERROR if the sink reported an error.
+ *
+ * @see ssh_scp_pipeline()
+ */
+int ssh_scp_drain(ssh_scp scp){
+  if(scp==NULL)
+      return SSH_ERROR;
+  if(scp->pipelined)
+    ssh_session_flush(scp->session);
+  return ssh_scp_harvest_acks(scp,1);
+}
+
 /**
  * @brief Write into a remote scp file.
  *
@@ -444,6 +583,83 @@ int ssh_scp_write(ssh_scp scp, const void *buffer, size_t len){
   return SSH_OK;
 }
 
+/* chunk size of ssh_scp_push_fd(). Large enough to fill several packets
+ * per read(2), small enough to stay cache friendly during encryption */
+#define SSH_SCP_PUSH_FD_BUFSIZE 65536
+
+/**
+ * @brief Stream file data into the scp channel straight from a file
+ * descriptor.
+ *
+ * This replaces the read-into-userspace loop around ssh_scp_write(): the
+ * data goes from the descriptor into a single internal buffer sized for the
+ * channel and from there into packets, so the only remaining copy besides
+ * encryption is the read(2) itself. The descriptor is read sequentially
+ * from its current offset; regular files, pipes and sockets all work.
+ *
+ * @param[in]  scp      The scp handle.
+ *
+ * @param[in]  fd       The file descriptor to read the data from.
+ *
+ * @param[in]  size     The number of bytes to transfer. Should not be
+ *                      bigger than what is left to send of the file
+ *                      announced with ssh_scp_push_file().
+ *
+ * @returns             SSH_OK if the data was written, SSH_ERROR if an
+ *                      error occured while reading or writing.
+ *
+ * @see ssh_scp_push_file()
+ * @see ssh_scp_write()
+ */
+int ssh_scp_push_fd(ssh_scp scp, int fd, uint64_t size){
+  char *buffer;
+  uint64_t remaining = size;
+  size_t chunk;
+  int r;
+
+  if(scp==NULL)
+      return SSH_ERROR;
+  if(scp->state != SSH_SCP_WRITE_WRITING){
+    ssh_set_error(scp->session,SSH_FATAL,"ssh_scp_push_fd called under invalid state");
+    return SSH_ERROR;
+  }
+  buffer=malloc(SSH_SCP_PUSH_FD_BUFSIZE);
+  if(buffer == NULL){
+    ssh_set_error_oom(scp->session);
+    return SSH_ERROR;
+  }
+  while(remaining > 0){
+    chunk = SSH_SCP_PUSH_FD_BUFSIZE;
+    if(remaining < chunk)
+      chunk = (size_t) remaining;
+    r=read(fd,buffer,chunk);
+    if(r < 0){
+      if(errno == EINTR)
+        continue;
+      ssh_set_error(scp->session,SSH_FATAL,"Error reading file data: %s",
+          strerror(errno));
+      scp->state=SSH_SCP_ERROR;
+      SAFE_FREE(buffer);
+      return SSH_ERROR;
+    }
+    if(r == 0){
+      ssh_set_error(scp->session,SSH_FATAL,
+          "Premature end of file while %llu bytes were announced",
+          (unsigned long long) size);
+      scp->state=SSH_SCP_ERROR;
+      SAFE_FREE(buffer);
+      return SSH_ERROR;
+    }
+    if(ssh_scp_write(scp,buffer,r) == SSH_ERROR){
+      SAFE_FREE(buffer);
+      return SSH_ERROR;
+    }
+    remaining -= r;
+  }
+  SAFE_FREE(buffer);
+  return SSH_OK;
+}
+
 /**
  * @brief Read a string on a channel, terminated by '\n'
  *
@@ -669,8 +885,8 @@ int ssh_scp_read(ssh_scp scp, void *buffer, size_t size){
   }
   if(scp->processed + size > scp->filelen)
     size = (size_t) (scp->filelen - scp->processed);
-  if(size > 65536)
-    size=65536; /* avoid too large reads */
+  if(size > 262144)
+    size=262144; /* avoid too large reads */
   r=ssh_channel_read(scp->channel,buffer,size,0);
   if(r != SSH_ERROR)
     scp->processed += r;
@@ -694,6 +910,10 @@ int ssh_scp_read(ssh_scp scp, void *buffer, size_t size){
     scp->state=SSH_SCP_ERROR;
     return SSH_ERROR;
   }
+  /* Drain packets the socket already received into the channel buffer, so
+   * the sender keeps streaming while the caller is busy writing this block
+   * to disk. */
+  ssh_channel_poll(scp->channel,0);
   return r;
 }
 
@@ -56,6 +56,8 @@
 #include "libssh/misc.h"
 #include "libssh/keys.h"
 #include "libssh/dh.h"
+#include "libssh/crypto.h"
+#include "libssh/ecdh.h"
 #include "libssh/messages.h"
 
 #define set_status(session, status) do {\
@@ -86,22 +88,22 @@ static int server_set_kex(ssh_session session) {
   KEX *server = &session->server_kex;
   int i, j;
   char *wanted;
+  char hostkeys[64] = {0};
 
   ZERO_STRUCTP(server);
   ssh_get_random(server->cookie, 16, 0);
-  if (session->dsa_key != NULL && session->rsa_key != NULL) {
-    if (ssh_options_set_algo(session, SSH_HOSTKEYS,
-          "ssh-dss,ssh-rsa") < 0) {
-      return -1;
-    }
-  } else if (session->dsa_key != NULL) {
-    if (ssh_options_set_algo(session, SSH_HOSTKEYS, "ssh-dss") < 0) {
-      return -1;
-    }
-  } else {
-    if (ssh_options_set_algo(session, SSH_HOSTKEYS, "ssh-rsa") < 0) {
-      return -1;
-    }
+  if (session->ecdsa_key != NULL) {
+    strcat(hostkeys, "ecdsa-sha2-nistp256,");
+  }
+  if (session->dsa_key != NULL) {
+    strcat(hostkeys, "ssh-dss,");
+  }
+  if (session->rsa_key != NULL || hostkeys[0] == '\0') {
+    strcat(hostkeys, "ssh-rsa,");
+  }
+  hostkeys[strlen(hostkeys) - 1] = '\0';
+  if (ssh_options_set_algo(session, SSH_HOSTKEYS, hostkeys) < 0) {
+    return -1;
   }
 
   server->methods = malloc(10 * sizeof(char *));
@@ -128,6 +130,8 @@ static int server_set_kex(ssh_session session) {
 
 SSH_PACKET_CALLBACK(ssh_packet_kexdh_init){
   ssh_string e;
+  char *kex_algo = NULL;
+  int rc;
   (void)type;
   (void)user;enter_function();
   ssh_log(session,SSH_LOG_PACKET,"Received SSH_MSG_KEXDH_INIT");
@@ -135,6 +139,25 @@ SSH_PACKET_CALLBACK(ssh_packet_kexdh_init){
     ssh_log(session,SSH_LOG_RARE,"Invalid state for SSH_MSG_KEXDH_INIT");
     goto error;
   }
+
+  kex_algo = ssh_find_matching(session->server_kex.methods[SSH_KEX],
+      session->client_kex.methods[SSH_KEX]);
+  rc = ssh_kex_select_kex_type(session, kex_algo);
+  SAFE_FREE(kex_algo);
+  if (rc != SSH_OK) {
+    session->session_state=SSH_SESSION_STATE_ERROR;
+    goto error;
+  }
+
+#ifdef HAVE_ECC
+  if (session->next_crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+    if (ssh_server_ecdh_init(session, packet) != SSH_OK) {
+      session->session_state=SSH_SESSION_STATE_ERROR;
+    }
+    goto error;
+  }
+#endif
+
   e = buffer_get_ssh_string(packet);
   if (e == NULL) {
     ssh_set_error(session, SSH_FATAL, "No e number in client request");
@@ -183,6 +206,9 @@ static int dh_handshake_server(ssh_session session) {
     case SSH_KEYTYPE_RSA:
       prv = session->rsa_key;
       break;
+    case SSH_KEYTYPE_ECDSA:
+      prv = session->ecdsa_key;
+      break;
     default:
       prv = NULL;
   }
@@ -231,6 +257,10 @@ static int dh_handshake_server(ssh_session session) {
     privatekey_free(session->dsa_key);
     session->dsa_key = NULL;
   }
+  if (session->ecdsa_key) {
+    privatekey_free(session->ecdsa_key);
+    session->ecdsa_key = NULL;
+  }
 
   if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEXDH_REPLY) < 0 ||
       buffer_add_ssh_string(session->out_buffer, pubkey) < 0 ||
@@ -361,6 +391,7 @@ static void ssh_server_connection_callback(ssh_session session){
 
                 /* FIXME TODO later, include a function to change keys */
                 session->current_crypto = session->next_crypto;
+                session->out_crypto = session->current_crypto;
                 session->next_crypto = crypto_new();
                 if (session->next_crypto == NULL) {
                   goto error;
@@ -1052,7 +1083,7 @@ int ssh_execute_message_callbacks(ssh_session session){
   ssh_message msg=NULL;
   int ret;
   ssh_handle_packets(session, 0);
-  if(!session->ssh_message_list)
+  if(session->msg_queue_head == NULL)
     return SSH_OK;
   if(session->ssh_message_callback){
     while((msg=ssh_message_pop_head(session)) != NULL) {
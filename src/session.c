@@ -33,8 +33,13 @@
 #include "libssh/packet.h"
 #include "libssh/session.h"
 #include "libssh/misc.h"
+#include "libssh/keys.h"
 #include "libssh/buffer.h"
+#include "libssh/channels.h"
 #include "libssh/poll.h"
+#include "libssh/dh.h"
+#include "libssh/messages.h"
+#include "libssh/callbacks.h"
 
 #define FIRST_CHANNEL 42 // why not ? it helps to find bugs.
 
@@ -62,6 +67,7 @@ ssh_session ssh_new(void) {
     return NULL;
   }
   ZERO_STRUCTP(session);
+  ssh_error_init(&session->error);
 
   session->next_crypto = crypto_new();
   if (session->next_crypto == NULL) {
@@ -92,9 +98,22 @@ ssh_session ssh_new(void) {
   /* options */
   session->StrictHostKeyChecking = 1;
   session->port = 22;
+  /* interactive traffic suffers from Nagle batching and the output
+   * scheduler already coalesces bulk writes, so NODELAY defaults on */
+  session->tcp_nodelay = 1;
+  session->tcp_keepalive = -1;
+  session->tcp_quickack = -1;
+  session->ip_tos = -1;
   session->fd = -1;
+  session->deadline_ms = -1;
   session->ssh2 = 1;
-  session->compressionlevel=7;
+  /* rebound when the protocol version is decided, see
+   * ssh_packet_set_default_callbacks() */
+  session->packet_send_fn = packet_send2;
+  session->channel_write_fn = channel_write2;
+  /* zlib's own default, past it the ratio gains are marginal for several
+   * times the CPU cost */
+  session->compressionlevel=6;
 #ifdef WITH_SSH1
   session->ssh1 = 1;
 #else
@@ -163,9 +182,12 @@ void ssh_free(ssh_session session) {
     return;
   }
 
+  /* a signature worker may still hold the session's key material */
+  ssh_sign_job_abort(session);
+
   SAFE_FREE(session->serverbanner);
   SAFE_FREE(session->clientbanner);
-  SAFE_FREE(session->bindaddr);
+  ssh_options_field_free(session, &session->bindaddr);
   SAFE_FREE(session->banner);
 #ifdef WITH_PCAP
   if(session->pcap_ctx){
@@ -179,10 +201,18 @@ void ssh_free(ssh_session session) {
     ssh_buffer_free(session->in_hashbuf);
   if(session->out_hashbuf != NULL)
     ssh_buffer_free(session->out_hashbuf);
+  ssh_buffer_free(session->kexinit_methods_cache);
+  ssh_buffer_free(session->sign_packet);
   session->in_buffer=session->out_buffer=NULL;
+  ssh_crypt_worker_stop(session);
   crypto_free(session->current_crypto);
   crypto_free(session->next_crypto);
   ssh_socket_free(session->socket);
+  ssh_keepalive_detach(session);
+  if (session->pacing_timer != NULL) {
+    ssh_poll_timer_cancel(session->pacing_timer);
+    session->pacing_timer = NULL;
+  }
   if(session->default_poll_ctx){
   	ssh_poll_ctx_free(session->default_poll_ctx);
   }
@@ -190,6 +220,16 @@ void ssh_free(ssh_session session) {
   while (session->channels) {
     ssh_channel_free(session->channels);
   }
+  /* global requests whose reply never came */
+  while (session->global_reqs != NULL) {
+    struct ssh_global_req_struct *req = session->global_reqs;
+    session->global_reqs = req->next;
+    SAFE_FREE(req->name);
+    SAFE_FREE(req);
+  }
+  session->global_reqs_tail = NULL;
+  SAFE_FREE(session->channel_table);
+  session->channel_table_size = 0;
 #ifndef _WIN32
   agent_free(session->agent);
 #endif /* _WIN32 */
@@ -209,14 +249,14 @@ void ssh_free(ssh_session session) {
 
   privatekey_free(session->dsa_key);
   privatekey_free(session->rsa_key);
-  if(session->ssh_message_list){
+  privatekey_free(session->ecdsa_key);
+  {
     ssh_message msg;
-    while((msg=ssh_list_pop_head(ssh_message ,session->ssh_message_list))
-        != NULL){
+    while((msg=ssh_message_pop_head(session)) != NULL){
       ssh_message_free(msg);
     }
-    ssh_list_free(session->ssh_message_list);
   }
+  channel_accept_queues_free(session);
 
   if (session->packet_callbacks)
     ssh_list_free(session->packet_callbacks);
@@ -227,27 +267,35 @@ void ssh_free(ssh_session session) {
     for (id = ssh_list_pop_head(char *, session->identity);
          id != NULL;
          id = ssh_list_pop_head(char *, session->identity)) {
-      SAFE_FREE(id);
+      ssh_options_field_free(session, &id);
     }
     ssh_list_free(session->identity);
   }
 
-  /* options */
-  SAFE_FREE(session->username);
-  SAFE_FREE(session->host);
-  SAFE_FREE(session->sshdir);
-  SAFE_FREE(session->knownhosts);
-  SAFE_FREE(session->ProxyCommand);
+  /* options: strings may be borrowed from a shared snapshot */
+  ssh_options_field_free(session, &session->username);
+  ssh_options_field_free(session, &session->host);
+  ssh_options_field_free(session, &session->sshdir);
+  ssh_options_field_free(session, &session->knownhosts);
+  ssh_options_field_free(session, &session->ProxyCommand);
 
   for (i = 0; i < 10; i++) {
-    if (session->wanted_methods[i]) {
-      SAFE_FREE(session->wanted_methods[i]);
-    }
+    ssh_options_field_free(session, &session->wanted_methods[i]);
   }
 
+  ssh_options_snapshot_free(session->opts_snapshot);
+
+  i = session->client;
+
   /* burn connection, it could hang sensitive datas */
   ZERO_STRUCTP(session);
   SAFE_FREE(session);
+
+  if (i) {
+    /* a client thread releasing a session is likely to open another one:
+     * prepare the next key exchange now, off the connect path */
+    ssh_dh_precompute();
+  }
 }
 
 /**
@@ -297,6 +345,194 @@ int ssh_is_blocking(ssh_session session){
 	return (session->flags&SSH_SESSION_FLAG_BLOCKING) ? 1 : 0;
 }
 
+/**
+ * @brief Set the busy-poll window used by blocking waits.
+ *
+ * A blocking wait normally parks the calling thread in poll() and
+ * relies on a scheduler wakeup, which costs tens of microseconds on a
+ * good day. With a busy-poll window the wait first spins on
+ * nonblocking polls for up to usec microseconds and only then goes to
+ * sleep, so data arriving shortly after the wait starts is picked up
+ * with sub-millisecond latency at the price of a busy CPU.
+ *
+ * This affects ssh_channel_read(), ssh_channel_read_deadline() and the
+ * other waits built on them. Latency-critical applications typically
+ * set a window somewhat above their expected inter-message gap.
+ *
+ * @param[in] session  The ssh session.
+ *
+ * @param[in] usec     Microseconds to busy-poll before blocking, 0 to
+ *                     disable (the default).
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid argument.
+ */
+int ssh_session_set_busy_poll(ssh_session session, int usec) {
+  if (session == NULL || usec < 0) {
+    return SSH_ERROR;
+  }
+  session->busy_poll_usec = usec;
+
+  return SSH_OK;
+}
+
+/* process-wide buffer memory telemetry, see
+ * ssh_set_memory_highwater_callback() */
+static size_t mem_highwater_threshold;
+static ssh_memory_highwater_callback mem_highwater_cb;
+static void *mem_highwater_userdata;
+
+/**
+ * @brief Report the buffer memory a session currently holds.
+ *
+ * Sums the allocated capacity of the session's packet buffers and of
+ * every channel's receive, stderr and outbound queues plus write
+ * rings. Allocations outside the buffer system (crypto contexts,
+ * parsed keys) are not counted.
+ *
+ * @param[in] session  The ssh session.
+ *
+ * @return              Bytes of buffer memory currently allocated.
+ */
+size_t ssh_get_memory_usage(ssh_session session) {
+  size_t used = 0;
+  ssh_channel it;
+
+  if (session == NULL) {
+    return 0;
+  }
+  if (session->in_buffer != NULL) {
+    used += session->in_buffer->allocated;
+  }
+  if (session->out_buffer != NULL) {
+    used += session->out_buffer->allocated;
+  }
+  if (session->in_hashbuf != NULL) {
+    used += session->in_hashbuf->allocated;
+  }
+  if (session->out_hashbuf != NULL) {
+    used += session->out_hashbuf->allocated;
+  }
+  if (session->channels != NULL) {
+    it = session->channels;
+    do {
+      used += ssh_channel_memory_usage(it);
+      it = it->next;
+    } while (it != session->channels);
+  }
+
+  return used;
+}
+
+/**
+ * @brief Cap the buffer memory a session may hold.
+ *
+ * Above the cap the receive window is no longer regrown, so remote
+ * senders stall on window control until the local consumers drain
+ * their buffers; nothing is dropped and no allocation fails because of
+ * the cap. Outbound queues are bounded by their own backpressure
+ * already.
+ *
+ * @param[in] session  The ssh session.
+ *
+ * @param[in] limit    Cap in bytes, 0 to remove it (the default).
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid argument.
+ */
+int ssh_session_set_memory_limit(ssh_session session, size_t limit) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  session->memory_limit = limit;
+
+  return SSH_OK;
+}
+
+void ssh_set_memory_highwater_callback(size_t threshold,
+    ssh_memory_highwater_callback cb, void *userdata) {
+  mem_highwater_threshold = threshold;
+  mem_highwater_cb = cb;
+  mem_highwater_userdata = userdata;
+}
+
+/** @internal
+ * @brief Whether the memory usage of this session needs computing at
+ * window-grant time, either for its own cap or for the global
+ * high-water telemetry.
+ */
+int ssh_memory_watch_active(ssh_session session) {
+  return session->memory_limit > 0 ||
+      (mem_highwater_cb != NULL && mem_highwater_threshold > 0);
+}
+
+/** @internal
+ * @brief Recompute a session's buffer memory usage and fire the global
+ * high-water callback once per upward crossing of the threshold.
+ */
+size_t ssh_memory_usage_update(ssh_session session) {
+  size_t used = ssh_get_memory_usage(session);
+
+  if (mem_highwater_cb != NULL && mem_highwater_threshold > 0) {
+    if (used >= mem_highwater_threshold) {
+      if (!session->mem_highwater_notified) {
+        session->mem_highwater_notified = 1;
+        mem_highwater_cb(session, used, mem_highwater_userdata);
+      }
+    } else {
+      session->mem_highwater_notified = 0;
+    }
+  }
+
+  return used;
+}
+
+/**
+ * @brief Enable or disable cork mode on the session.
+ *
+ * While corked, small outgoing packets accumulate in the session's write
+ * buffer instead of hitting the socket one by one. The buffered bytes are
+ * written out by ssh_session_flush(), once enough data has piled up, or
+ * before the session blocks waiting for new events. Uncorking flushes
+ * immediately.
+ *
+ * @param[in] session  The ssh session to change.
+ *
+ * @param[in] cork     Nonzero to cork the session, zero to uncork and flush.
+ *
+ * @returns             SSH_OK on success, SSH_ERROR on invalid session.
+ */
+int ssh_set_cork(ssh_session session, int cork) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+
+  session->corked = cork ? 1 : 0;
+  if (cork == 0 && ssh_socket_is_open(session->socket)) {
+    ssh_socket_nonblocking_flush(session->socket);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Hand the packets buffered by cork mode to the socket.
+ *
+ * The session stays corked, only the bytes buffered so far are written out.
+ *
+ * @param[in] session  The ssh session.
+ *
+ * @returns             SSH_OK on success, SSH_ERROR otherwise.
+ */
+int ssh_session_flush(ssh_session session) {
+  if (session == NULL || session->socket == NULL) {
+    return SSH_ERROR;
+  }
+  if (!ssh_socket_is_open(session->socket)) {
+    return SSH_ERROR;
+  }
+
+  return ssh_socket_nonblocking_flush(session->socket);
+}
+
 /**
  * @brief Blocking flush of the outgoing buffer
  * @param[in] session The SSH session
@@ -428,6 +664,22 @@ int ssh_handle_packets(ssh_session session, int timeout) {
   if(session==NULL || session->socket==NULL)
   	return SSH_ERROR;
   enter_function();
+  /* the session deadline caps every internal wait, see
+   * ssh_set_deadline() */
+  if (session->deadline_ms >= 0) {
+    int left = ssh_timeout_update(&session->deadline_ts,
+        session->deadline_ms);
+
+    if (left == 0) {
+      ssh_set_error(session, SSH_REQUEST_DENIED,
+          "Session deadline exceeded");
+      leave_function();
+      return SSH_AGAIN;
+    }
+    if (left > 0 && (timeout < 0 || timeout > left)) {
+      timeout = left;
+    }
+  }
   spoll_in=ssh_socket_get_poll_handle_in(session->socket);
   spoll_out=ssh_socket_get_poll_handle_out(session->socket);
   if(session->server)
@@ -439,6 +691,15 @@ int ssh_handle_packets(ssh_session session, int timeout) {
   	if(spoll_in != spoll_out)
   	  ssh_poll_ctx_add(ctx,spoll_out);
   }
+  /* keepalives are scheduled on the context the session is polled on */
+  ssh_keepalive_attach(ctx, session);
+  /* writes worker threads pushed on their channel rings since last time */
+  channel_ring_drain_all(session);
+  /* don't go to sleep on top of packets a corked session left buffered */
+  if (session->corked && ssh_socket_is_open(session->socket) &&
+      ssh_socket_buffered_write_bytes(session->socket) > 0) {
+    ssh_socket_nonblocking_flush(session->socket);
+  }
   rc = ssh_poll_ctx_dopoll(ctx,timeout);
   if(rc == SSH_ERROR)
     session->session_state = SSH_SESSION_STATE_ERROR;
@@ -478,6 +739,8 @@ int ssh_handle_packets_termination(ssh_session session, int timeout,
     ret = ssh_handle_packets(session, timeout);
     if(ret == SSH_ERROR)
       return SSH_ERROR;
+    if(ret == SSH_AGAIN)
+      return SSH_AGAIN;
     if(fct(user)) {
       return SSH_OK;
     } else if (ssh_timeout_elapsed(&ts, timeout)) {
@@ -488,6 +751,64 @@ int ssh_handle_packets_termination(ssh_session session, int timeout,
   return ret;
 }
 
+/**
+ * @brief Set a deadline bounding the total time of the following calls.
+ *
+ * Multi-step operations (an sftp open, a write loop, a close) each
+ * apply their own timeout to their internal waits, so the total
+ * elapsed time of such a sequence is otherwise unbounded. The deadline
+ * is measured from now; every internal wait of the session clamps its
+ * poll to the remaining budget and, once it is spent, waiting calls
+ * fail with SSH_AGAIN (or an error for APIs without an again code) and
+ * the error string set, instead of blocking.
+ *
+ * The deadline is sticky: it stays armed until replaced by the next
+ * call or removed with a negative timeout.
+ *
+ * @param[in] session    The ssh session.
+ *
+ * @param[in] timeout_ms Total budget in milliseconds, counted from now.
+ *                       A negative value removes the deadline.
+ *
+ * @return               SSH_OK on success, SSH_ERROR on invalid session.
+ *
+ * @see ssh_get_deadline_remaining()
+ */
+int ssh_set_deadline(ssh_session session, int timeout_ms) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (timeout_ms < 0) {
+    session->deadline_ms = -1;
+    return SSH_OK;
+  }
+
+  ssh_timestamp_init(&session->deadline_ts);
+  session->deadline_ms = timeout_ms;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Return the unspent part of the session deadline.
+ *
+ * Useful to subdivide the budget over steps the library does not see,
+ * like application-level retries.
+ *
+ * @param[in] session   The ssh session.
+ *
+ * @return              The remaining milliseconds, 0 when the deadline
+ *                      expired, -1 when no deadline is set.
+ */
+int ssh_get_deadline_remaining(ssh_session session) {
+  if (session == NULL || session->deadline_ms < 0) {
+    return -1;
+  }
+
+  return ssh_timeout_update(&session->deadline_ts, session->deadline_ms);
+}
+
 /**
  * @brief Get session status
  *
@@ -520,6 +841,38 @@ int ssh_get_status(ssh_session session) {
   return r;
 }
 
+/**
+ * @brief Snapshot the performance counters of a session.
+ *
+ * The counters are collected inline on the hot paths at negligible cost
+ * and cover the whole lifetime of the session: cipher bytes in both
+ * directions, packet counts, compressed payload volumes, poll wakeups,
+ * accumulated key exchange time and the time writes spent stalled on a
+ * closed remote window.
+ *
+ * @param[in]  session  The ssh session.
+ *
+ * @param[out] stats    A caller-allocated ssh_stats_struct receiving a
+ *                      copy of the counters.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on invalid argument.
+ *
+ * @see ssh_channel_get_stats()
+ */
+int ssh_get_stats(ssh_session session, ssh_stats stats) {
+  if (session == NULL || stats == NULL) {
+    return SSH_ERROR;
+  }
+
+  *stats = session->stats;
+  stats->poll_wakeups = ssh_poll_ctx_get_wakeups(session->default_poll_ctx);
+  stats->msg_queue_depth = session->msg_queue_depth;
+  stats->rate_in_ewma = session->rate_est_in;
+  stats->rate_out_ewma = session->rate_est_out;
+
+  return SSH_OK;
+}
+
 /**
  * @brief Get the disconnect message from the server.
  *
@@ -0,0 +1,434 @@
+/*
+ * sessionpool.c - pool of authenticated sessions for connection reuse
+ *
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2011 by Aris Adamantiadis
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/misc.h"
+
+/**
+ * @defgroup libssh_pool The session pool functions
+ * @ingroup libssh
+ *
+ * Tools that run many operations against the same hosts pay a full key
+ * exchange and authentication per operation when they open a session
+ * each time. A pool keeps authenticated sessions keyed by host, port
+ * and user; callers take a session, open their channels on it (several
+ * operations can share one session, a session carries many channels)
+ * and give it back, so the next operation skips the handshake entirely.
+ *
+ * The pool cannot authenticate on its own, so a miss is reported to the
+ * caller who connects and authenticates as usual and adds the new
+ * session. Dead sessions are detected when they are requested and
+ * dropped, which makes reconnection a normal pool miss.
+ *
+ * @{
+ */
+
+/* sessions idle longer than this are dropped by default */
+#define SSH_POOL_DEFAULT_IDLE_TIMEOUT 300
+
+struct ssh_pool_entry {
+  struct ssh_pool_entry *next;
+  ssh_session session;
+  /* how many callers hold the session right now */
+  int checkouts;
+  /* when the last checkout was released */
+  struct ssh_timestamp idle_since;
+  /* traffic class served by this session, one of the
+   * SSH_CHANNEL_PRIORITY_* values, -1 when the session serves any */
+  int channel_class;
+};
+
+/* conventional TOS markings applied to classed sessions whose caller
+ * did not choose one, see ssh_pool_add_class() */
+#ifndef IPTOS_LOWDELAY
+#define IPTOS_LOWDELAY 0x10
+#endif
+#ifndef IPTOS_THROUGHPUT
+#define IPTOS_THROUGHPUT 0x08
+#endif
+
+struct ssh_pool_struct {
+  struct ssh_pool_entry *entries;
+  int idle_timeout; /* seconds */
+};
+
+/**
+ * @brief Create a new session pool.
+ *
+ * @return              The new pool, NULL on error.
+ *
+ * @see ssh_pool_free()
+ */
+ssh_pool ssh_pool_new(void) {
+  ssh_pool pool;
+
+  pool = malloc(sizeof(struct ssh_pool_struct));
+  if (pool == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(pool);
+  pool->idle_timeout = SSH_POOL_DEFAULT_IDLE_TIMEOUT;
+
+  return pool;
+}
+
+/**
+ * @brief Destroy a pool, disconnecting and freeing every pooled session.
+ *
+ * Sessions currently checked out must have been released (or must no
+ * longer be used) before the pool is freed.
+ *
+ * @param[in]  pool     The pool to destroy.
+ */
+void ssh_pool_free(ssh_pool pool) {
+  struct ssh_pool_entry *entry;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  while (pool->entries != NULL) {
+    entry = pool->entries;
+    pool->entries = entry->next;
+    ssh_disconnect(entry->session);
+    ssh_free(entry->session);
+    SAFE_FREE(entry);
+  }
+  SAFE_FREE(pool);
+}
+
+/**
+ * @brief Set how long an unused session may sit in the pool.
+ *
+ * @param[in]  pool     The pool to configure.
+ *
+ * @param[in]  seconds  Idle timeout in seconds, 0 to keep sessions
+ *                      forever.
+ */
+void ssh_pool_set_idle_timeout(ssh_pool pool, int seconds) {
+  if (pool == NULL || seconds < 0) {
+    return;
+  }
+  pool->idle_timeout = seconds;
+}
+
+static int ssh_pool_entry_matches(struct ssh_pool_entry *entry,
+    const char *host, int port, const char *user) {
+  ssh_session session = entry->session;
+
+  if (session->host == NULL || strcmp(session->host, host) != 0) {
+    return 0;
+  }
+  if (port > 0 && session->port != (unsigned int) port) {
+    return 0;
+  }
+  if (user != NULL &&
+      (session->username == NULL || strcmp(session->username, user) != 0)) {
+    return 0;
+  }
+
+  return 1;
+}
+
+static int ssh_pool_entry_expired(ssh_pool pool, struct ssh_pool_entry *entry) {
+  if (entry->checkouts > 0 || pool->idle_timeout == 0) {
+    return 0;
+  }
+
+  return ssh_timestamp_elapsed_ms(&entry->idle_since) >
+      pool->idle_timeout * 1000;
+}
+
+static void ssh_pool_entry_drop(ssh_pool pool, struct ssh_pool_entry *entry) {
+  struct ssh_pool_entry **prev = &pool->entries;
+
+  while (*prev != entry) {
+    prev = &(*prev)->next;
+  }
+  *prev = entry->next;
+
+  ssh_disconnect(entry->session);
+  ssh_free(entry->session);
+  SAFE_FREE(entry);
+}
+
+/**
+ * @brief Hand an authenticated session over to the pool.
+ *
+ * The pool becomes the owner of the session and keys it by the host,
+ * port and user it was connected with. The session counts as checked
+ * out by the caller: release it with ssh_pool_release() when the
+ * current operation is done.
+ *
+ * @param[in]  pool     The pool to add to.
+ *
+ * @param[in]  session  A connected, authenticated session.
+ *
+ * @return              SSH_OK on success, SSH_ERROR otherwise.
+ */
+int ssh_pool_add(ssh_pool pool, ssh_session session) {
+  struct ssh_pool_entry *entry;
+
+  if (pool == NULL || session == NULL || session->host == NULL) {
+    return SSH_ERROR;
+  }
+
+  entry = malloc(sizeof(struct ssh_pool_entry));
+  if (entry == NULL) {
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(entry);
+  entry->session = session;
+  entry->checkouts = 1;
+  entry->channel_class = -1;
+  entry->next = pool->entries;
+  pool->entries = entry;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Hand a session over to the pool, dedicated to a traffic class.
+ *
+ * Works like ssh_pool_add(), but the session only serves requests of
+ * the given class from ssh_pool_get_class(), so interactive channels
+ * ride a different connection than bulk transfers and the network can
+ * prioritize them. When the caller has not set SSH_OPTIONS_IP_TOS on
+ * the session, the conventional marking of the class is applied:
+ * low-delay for interactive, throughput for bulk.
+ *
+ * @param[in]  pool     The pool to add to.
+ *
+ * @param[in]  session  A connected, authenticated session.
+ *
+ * @param[in]  channel_class  SSH_CHANNEL_PRIORITY_INTERACTIVE or
+ *                      SSH_CHANNEL_PRIORITY_BULK.
+ *
+ * @return              SSH_OK on success, SSH_ERROR otherwise.
+ *
+ * @see ssh_pool_get_class()
+ */
+int ssh_pool_add_class(ssh_pool pool, ssh_session session,
+    int channel_class) {
+  int rc;
+
+  if (channel_class != SSH_CHANNEL_PRIORITY_INTERACTIVE &&
+      channel_class != SSH_CHANNEL_PRIORITY_BULK) {
+    return SSH_ERROR;
+  }
+
+  rc = ssh_pool_add(pool, session);
+  if (rc != SSH_OK) {
+    return rc;
+  }
+  pool->entries->channel_class = channel_class;
+
+  if (session->ip_tos < 0) {
+    int tos = channel_class == SSH_CHANNEL_PRIORITY_INTERACTIVE ?
+        IPTOS_LOWDELAY : IPTOS_THROUGHPUT;
+
+    ssh_options_set(session, SSH_OPTIONS_IP_TOS, &tos);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Take a pooled session for the given host, port and user.
+ *
+ * A live idle session matching the key is preferred; when every match
+ * is busy the least-loaded one is shared, since a session multiplexes
+ * any number of channels. Sessions found dead are dropped on the spot,
+ * so after a disconnect this simply reports a miss and the caller
+ * reconnects the usual way.
+ *
+ * @param[in]  pool     The pool to take from.
+ *
+ * @param[in]  host     The host to match.
+ *
+ * @param[in]  port     The port to match, 0 for any.
+ *
+ * @param[in]  user     The user to match, NULL for any.
+ *
+ * @return              A connected, authenticated session, or NULL if
+ *                      the pool has none for this key.
+ *
+ * @see ssh_pool_release()
+ */
+ssh_session ssh_pool_get(ssh_pool pool, const char *host, int port,
+    const char *user) {
+  return ssh_pool_get_class(pool, host, port, user, -1);
+}
+
+/**
+ * @brief Take a pooled session of a traffic class.
+ *
+ * Works like ssh_pool_get(), but routes the request to a session
+ * dedicated to the given class with ssh_pool_add_class(): interactive
+ * requests never share a connection with bulk ones, so the per-class
+ * QoS marking stays meaningful. Unclassed sessions serve as a fallback
+ * when no session of the class is pooled; sessions of another class
+ * are never returned. A miss means the caller should connect a new
+ * session and add it with the class.
+ *
+ * @param[in]  pool     The pool to take from.
+ *
+ * @param[in]  host     The host to match.
+ *
+ * @param[in]  port     The port to match, 0 for any.
+ *
+ * @param[in]  user     The user to match, NULL for any.
+ *
+ * @param[in]  channel_class  SSH_CHANNEL_PRIORITY_INTERACTIVE or
+ *                      SSH_CHANNEL_PRIORITY_BULK, -1 for any session.
+ *
+ * @return              A connected, authenticated session, or NULL if
+ *                      the pool has none for this key and class.
+ *
+ * @see ssh_pool_add_class()
+ */
+ssh_session ssh_pool_get_class(ssh_pool pool, const char *host, int port,
+    const char *user, int channel_class) {
+  struct ssh_pool_entry *entry;
+  struct ssh_pool_entry *next;
+  struct ssh_pool_entry *best = NULL;
+  struct ssh_pool_entry *fallback = NULL;
+
+  if (pool == NULL || host == NULL) {
+    return NULL;
+  }
+
+  for (entry = pool->entries; entry != NULL; entry = next) {
+    next = entry->next;
+    if (!ssh_pool_entry_matches(entry, host, port, user)) {
+      continue;
+    }
+    if (channel_class >= 0 && entry->channel_class >= 0 &&
+        entry->channel_class != channel_class) {
+      continue;
+    }
+    if (!ssh_is_connected(entry->session) ||
+        ssh_pool_entry_expired(pool, entry)) {
+      ssh_pool_entry_drop(pool, entry);
+      continue;
+    }
+    if (channel_class >= 0 && entry->channel_class < 0) {
+      /* an unclassed session is only taken when no dedicated one is */
+      if (fallback == NULL || entry->checkouts < fallback->checkouts) {
+        fallback = entry;
+      }
+      continue;
+    }
+    if (best == NULL || entry->checkouts < best->checkouts) {
+      best = entry;
+    }
+  }
+
+  if (best == NULL) {
+    best = fallback;
+  }
+  if (best == NULL) {
+    return NULL;
+  }
+  best->checkouts++;
+
+  return best->session;
+}
+
+/**
+ * @brief Give a session taken with ssh_pool_get() back to the pool.
+ *
+ * The session stays connected and becomes available to the next
+ * operation; the idle clock starts once nobody holds it anymore.
+ *
+ * @param[in]  pool     The pool the session belongs to.
+ *
+ * @param[in]  session  The session to release.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the session is
+ *                      not pooled.
+ */
+int ssh_pool_release(ssh_pool pool, ssh_session session) {
+  struct ssh_pool_entry *entry;
+
+  if (pool == NULL || session == NULL) {
+    return SSH_ERROR;
+  }
+
+  for (entry = pool->entries; entry != NULL; entry = entry->next) {
+    if (entry->session == session) {
+      break;
+    }
+  }
+  if (entry == NULL || entry->checkouts == 0) {
+    return SSH_ERROR;
+  }
+
+  entry->checkouts--;
+  if (entry->checkouts == 0) {
+    ssh_timestamp_init(&entry->idle_since);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Drop dead and idle-expired sessions from the pool.
+ *
+ * ssh_pool_get() already prunes the key it looks at; long-running
+ * programs should call this periodically so connections to hosts that
+ * are no longer used get closed too.
+ *
+ * @param[in]  pool     The pool to prune.
+ *
+ * @return              The number of sessions dropped.
+ */
+int ssh_pool_prune(ssh_pool pool) {
+  struct ssh_pool_entry *entry;
+  struct ssh_pool_entry *next;
+  int dropped = 0;
+
+  if (pool == NULL) {
+    return 0;
+  }
+
+  for (entry = pool->entries; entry != NULL; entry = next) {
+    next = entry->next;
+    if (entry->checkouts == 0 &&
+        (!ssh_is_connected(entry->session) ||
+         ssh_pool_entry_expired(pool, entry))) {
+      ssh_pool_entry_drop(pool, entry);
+      dropped++;
+    }
+  }
+
+  return dropped;
+}
+
+/** @} */
+
+/* vim: set ts=4 sw=4 et cindent: */
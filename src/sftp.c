@@ -36,6 +36,7 @@
 
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <unistd.h>
 #else
 #define S_IFSOCK 0140000
 #define S_IFLNK  0120000
@@ -50,10 +51,15 @@
 #include "libssh/ssh2.h"
 #include "libssh/sftp.h"
 #include "libssh/buffer.h"
+#include "libssh/string.h"
 #include "libssh/channels.h"
 #include "libssh/session.h"
 #include "libssh/misc.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #ifdef WITH_SFTP
 
 #define sftp_enter_function() _enter_function(sftp->channel->session)
@@ -70,6 +76,8 @@ static int sftp_enqueue(sftp_session session, sftp_message msg);
 static void sftp_message_free(sftp_message msg);
 static void sftp_set_error(sftp_session sftp, int errnum);
 static void status_msg_free(sftp_status_message status);
+static void sftp_attr_cache_free(struct sftp_attr_cache_struct *cache);
+static void sftp_query_limits(sftp_session sftp);
 
 static sftp_ext sftp_ext_new(void) {
   sftp_ext ext;
@@ -164,6 +172,7 @@ sftp_session sftp_server_new(ssh_session session, ssh_channel chan){
 
   sftp->session = session;
   sftp->channel = chan;
+  sftp->read_fd = -1;
 
   return sftp;
 }
@@ -237,23 +246,29 @@ int sftp_server_init(sftp_session sftp){
 
 void sftp_free(sftp_session sftp){
   sftp_request_queue ptr;
+  int i;
 
   if (sftp == NULL) {
     return;
   }
 
   ssh_channel_send_eof(sftp->channel);
-  ptr = sftp->queue;
-  while(ptr) {
-    sftp_request_queue old;
-    sftp_message_free(ptr->message);
-    old = ptr->next;
-    SAFE_FREE(ptr);
-    ptr = old;
+  for (i = 0; i < SFTP_QUEUE_BUCKETS; i++) {
+    ptr = sftp->queue[i];
+    while(ptr) {
+      sftp_request_queue old;
+      sftp_message_free(ptr->message);
+      old = ptr->next;
+      SAFE_FREE(ptr);
+      ptr = old;
+    }
   }
 
   ssh_channel_free(sftp->channel);
   sftp_ext_free(sftp->ext);
+  ssh_buffer_free(sftp->partial);
+  ssh_buffer_free(sftp->reply_queue);
+  sftp_attr_cache_free(sftp->attr_cache);
   ZERO_STRUCTP(sftp);
 
   SAFE_FREE(sftp);
@@ -273,6 +288,30 @@ int sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload){
     return -1;
   }
 
+  /* while corked, queue the framed packet instead of writing it out,
+   * see sftp_reply_cork() */
+  if (sftp->reply_corked) {
+    size = buffer_get_rest_len(payload);
+    if (sftp->reply_queue == NULL) {
+      sftp->reply_queue = ssh_buffer_new();
+      if (sftp->reply_queue == NULL) {
+        ssh_set_error_oom(sftp->session);
+        return -1;
+      }
+    }
+    if (buffer_add_data(sftp->reply_queue, buffer_get_rest(payload),
+          size) < 0) {
+      ssh_set_error_oom(sftp->session);
+      return -1;
+    }
+    if (buffer_get_rest_len(sftp->reply_queue) >= SFTP_REPLY_QUEUE_LIMIT &&
+        sftp_reply_flush(sftp) < 0) {
+      return -1;
+    }
+
+    return size;
+  }
+
   size = ssh_channel_write(sftp->channel, buffer_get_rest(payload),
       buffer_get_rest_len(payload));
   if (size < 0) {
@@ -287,13 +326,164 @@ int sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload){
   return size;
 }
 
-sftp_packet sftp_packet_read(sftp_session sftp) {
+/**
+ * @internal
+ *
+ * @brief Start coalescing server replies.
+ *
+ * While corked, the reply helpers queue their framed packets instead of
+ * issuing one ssh_channel_write() each. A server answering a burst of
+ * pipelined requests corks once, serves every request pending on the
+ * channel, and calls sftp_reply_flush() to push all replies out in a
+ * single channel write. Queued replies are flushed automatically past
+ * SFTP_REPLY_QUEUE_LIMIT to bound memory.
+ *
+ * @param sftp          The sftp session handle.
+ */
+void sftp_reply_cork(sftp_session sftp) {
+  sftp->reply_corked = 1;
+}
+
+/**
+ * @internal
+ *
+ * @brief Write all queued server replies in one channel write.
+ *
+ * The session stays corked, call again after the next burst.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+int sftp_reply_flush(sftp_session sftp) {
+  uint32_t len;
+  int size;
+
+  if (sftp->reply_queue == NULL) {
+    return 0;
+  }
+
+  len = buffer_get_rest_len(sftp->reply_queue);
+  if (len == 0) {
+    return 0;
+  }
+
+  size = ssh_channel_write(sftp->channel, buffer_get_rest(sftp->reply_queue),
+      len);
+  if (size < 0) {
+    return -1;
+  } else if ((uint32_t) size != len) {
+    ssh_log(sftp->session, SSH_LOG_PACKET,
+        "Had to write %d bytes, wrote only %d", len, size);
+  }
+
+  if (buffer_reinit(sftp->reply_queue) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Feed the frame reassembly buffer from the channel.
+ *
+ * Bytes the channel has already decrypted are drained without blocking
+ * first, so every frame they complete becomes available at once. The
+ * length prefix is consumed as soon as its four bytes are in and
+ * remembered in partial_need, letting a frame straddle any number of
+ * channel reads. When block is set and the frame under reassembly is
+ * still incomplete, the missing bytes are read the blocking way.
+ *
+ * @return              1 when a complete frame is buffered, 0 when
+ *                      nonblocking and more bytes are needed, -1 on
+ *                      error.
+ */
+static int sftp_frame_complete(sftp_session sftp, int block) {
   unsigned char buffer[4096];
-  sftp_packet packet = NULL;
+  uint32_t need;
   uint32_t size;
   int r;
 
-  sftp_enter_function();
+  if (sftp->partial == NULL) {
+    sftp->partial = ssh_buffer_new();
+    if (sftp->partial == NULL) {
+      ssh_set_error_oom(sftp->session);
+      return -1;
+    }
+  }
+
+  for (;;) {
+    if (sftp->partial_need == 0 &&
+        buffer_get_rest_len(sftp->partial) >= sizeof(uint32_t)) {
+      buffer_get_u32(sftp->partial, &size);
+      size = ntohl(size);
+      if (size == 0) {
+        ssh_set_error(sftp->session, SSH_FATAL, "Invalid zero-length sftp packet");
+        return -1;
+      }
+      sftp->partial_need = size;
+    }
+    if (sftp->partial_need > 0 &&
+        buffer_get_rest_len(sftp->partial) >= sftp->partial_need) {
+      return 1;
+    }
+
+    /* take whatever the channel already has without blocking */
+    r = ssh_channel_read_nonblocking(sftp->channel, buffer, sizeof(buffer), 0);
+    if (r == SSH_ERROR) {
+      return -1;
+    }
+    if (r > 0) {
+      if (buffer_add_data(sftp->partial, buffer, r) < 0) {
+        ssh_set_error_oom(sftp->session);
+        return -1;
+      }
+      continue;
+    }
+
+    if (!block) {
+      return 0;
+    }
+
+    /* block for the missing piece of the current frame */
+    if (sftp->partial_need == 0) {
+      need = sizeof(uint32_t) - buffer_get_rest_len(sftp->partial);
+    } else {
+      need = sftp->partial_need - buffer_get_rest_len(sftp->partial);
+      if (need > sizeof(buffer)) {
+        need = sizeof(buffer);
+      }
+    }
+    r = ssh_channel_read(sftp->channel, buffer, need, 0);
+    if (r < 0) {
+      /* TODO: check if there are cases where an error needs to be set here */
+      return -1;
+    }
+    if (r == 0) {
+      ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
+      return -1;
+    }
+    if (buffer_add_data(sftp->partial, buffer, r) < 0) {
+      ssh_set_error_oom(sftp->session);
+      return -1;
+    }
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Detach the completed frame from the reassembly buffer.
+ *
+ * Only call after sftp_frame_complete() returned 1.
+ *
+ * @return              The packet, NULL on error.
+ */
+static sftp_packet sftp_packet_from_partial(sftp_session sftp) {
+  sftp_packet packet = NULL;
+  uint32_t len = sftp->partial_need - 1;
 
   packet = malloc(sizeof(struct sftp_packet_struct));
   if (packet == NULL) {
@@ -308,54 +498,36 @@ sftp_packet sftp_packet_read(sftp_session sftp) {
     return NULL;
   }
 
-  r=ssh_channel_read(sftp->channel, buffer, 4, 0);
-  if (r < 0) {
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
-    sftp_leave_function();
-    return NULL;
+  buffer_get_u8(sftp->partial, &packet->type);
+  if (len > 0) {
+    if (buffer_add_data(packet->payload, buffer_get_rest(sftp->partial),
+          len) < 0) {
+      ssh_set_error_oom(sftp->session);
+      sftp_packet_free(packet);
+      return NULL;
+    }
+    buffer_pass_bytes(sftp->partial, len);
   }
-  buffer_add_data(packet->payload,buffer, r);
-  if (buffer_get_u32(packet->payload, &size) != sizeof(uint32_t)) {
-    ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
-    sftp_leave_function();
-    return NULL;
+  sftp->partial_need = 0;
+
+  /* reclaim the storage once every buffered frame has been cut */
+  if (buffer_get_rest_len(sftp->partial) == 0) {
+    buffer_reinit(sftp->partial);
   }
 
-  size = ntohl(size);
-  r=ssh_channel_read(sftp->channel, buffer, 1, 0);
-  if (r <= 0) {
-    /* TODO: check if there are cases where an error needs to be set here */
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
+  return packet;
+}
+
+sftp_packet sftp_packet_read(sftp_session sftp) {
+  sftp_packet packet = NULL;
+
+  sftp_enter_function();
+
+  if (sftp_frame_complete(sftp, 1) != 1) {
     sftp_leave_function();
     return NULL;
   }
-  buffer_add_data(packet->payload, buffer, r);
-  buffer_get_u8(packet->payload, &packet->type);
-  size=size-1;
-  while (size>0){
-    r=ssh_channel_read(sftp->channel,buffer,
-        sizeof(buffer)>size ? size:sizeof(buffer),0);
-
-    if(r <= 0) {
-      /* TODO: check if there are cases where an error needs to be set here */
-      ssh_buffer_free(packet->payload);
-      SAFE_FREE(packet);
-      sftp_leave_function();
-      return NULL;
-    }
-    if(buffer_add_data(packet->payload,buffer,r)==SSH_ERROR){
-      ssh_buffer_free(packet->payload);
-      SAFE_FREE(packet);
-      sftp_leave_function();
-      ssh_set_error_oom(sftp->session);
-      return NULL;
-    }
-    size -= r;
-  }
+  packet = sftp_packet_from_partial(sftp);
 
   sftp_leave_function();
   return packet;
@@ -454,24 +626,70 @@ static sftp_message sftp_get_message(sftp_packet packet) {
       msg->id,
       msg->packet_type);
 
-  if (buffer_add_data(msg->payload, buffer_get_rest(packet->payload),
-        buffer_get_rest_len(packet->payload)) < 0) {
-    ssh_set_error_oom(sftp->session);
-    sftp_message_free(msg);
-    sftp_leave_function();
-    return NULL;
-  }
+  /* hand the body over instead of copying it, a large SSH_FXP_DATA
+   * would be materialized a second time otherwise; the packet is left
+   * without a payload and freed by the caller right after us */
+  ssh_buffer_free(msg->payload);
+  msg->payload = packet->payload;
+  packet->payload = NULL;
 
   sftp_leave_function();
   return msg;
 }
 
+/**
+ * @internal
+ *
+ * @brief Deliver every response already buffered on the channel.
+ *
+ * Each frame is enqueued under its request id as soon as it is cut, so
+ * the completions queued behind a large SSH_FXP_DATA body all become
+ * visible in the same wakeup instead of costing one blocking
+ * sftp_packet_read() round trip each.
+ *
+ * @return              The number of messages enqueued, -1 on error.
+ */
+static int sftp_poll_frames(sftp_session sftp) {
+  sftp_packet packet = NULL;
+  sftp_message msg = NULL;
+  int n = 0;
+  int rc;
+
+  while ((rc = sftp_frame_complete(sftp, 0)) == 1) {
+    packet = sftp_packet_from_partial(sftp);
+    if (packet == NULL) {
+      return -1;
+    }
+    msg = sftp_get_message(packet);
+    sftp_packet_free(packet);
+    if (msg == NULL) {
+      return -1;
+    }
+    if (sftp_enqueue(sftp, msg) < 0) {
+      sftp_message_free(msg);
+      return -1;
+    }
+    n++;
+  }
+
+  return rc < 0 ? -1 : n;
+}
+
 static int sftp_read_and_dispatch(sftp_session sftp) {
   sftp_packet packet = NULL;
   sftp_message msg = NULL;
+  int n;
 
   sftp_enter_function();
 
+  /* drain complete frames first: under deep pipelining several
+   * responses usually land in a single channel wakeup */
+  n = sftp_poll_frames(sftp);
+  if (n != 0) {
+    sftp_leave_function();
+    return n < 0 ? -1 : 0;
+  }
+
   packet = sftp_packet_read(sftp);
   if (packet == NULL) {
     sftp_leave_function();
@@ -619,6 +837,10 @@ int sftp_init(sftp_session sftp) {
 
   sftp->version = sftp->server_version = version;
 
+  if (sftp_extension_supported(sftp, "limits@openssh.com", "1")) {
+    sftp_query_limits(sftp);
+  }
+
   sftp_leave_function();
 
   return 0;
@@ -703,9 +925,11 @@ static void request_queue_free(sftp_request_queue queue) {
   SAFE_FREE(queue);
 }
 
+/* Responses are stored in a hash table keyed by their request id, so
+ * matching a response is O(1) no matter how many requests are in flight. */
 static int sftp_enqueue(sftp_session sftp, sftp_message msg) {
   sftp_request_queue queue = NULL;
-  sftp_request_queue ptr;
+  uint32_t bucket = msg->id % SFTP_QUEUE_BUCKETS;
 
   queue = request_queue_new(msg);
   if (queue == NULL) {
@@ -716,15 +940,8 @@ static int sftp_enqueue(sftp_session sftp, sftp_message msg) {
       "Queued msg type %d id %d",
       msg->id, msg->packet_type);
 
-  if(sftp->queue == NULL) {
-    sftp->queue = queue;
-  } else {
-    ptr = sftp->queue;
-    while(ptr->next) {
-      ptr=ptr->next; /* find end of linked list */
-    }
-    ptr->next = queue; /* add it on bottom */
-  }
+  queue->next = sftp->queue[bucket];
+  sftp->queue[bucket] = queue;
 
   return 0;
 }
@@ -737,17 +954,14 @@ static sftp_message sftp_dequeue(sftp_session sftp, uint32_t id){
   sftp_request_queue prev = NULL;
   sftp_request_queue queue;
   sftp_message msg;
+  uint32_t bucket = id % SFTP_QUEUE_BUCKETS;
 
-  if(sftp->queue == NULL) {
-    return NULL;
-  }
-
-  queue = sftp->queue;
+  queue = sftp->queue[bucket];
   while (queue) {
     if(queue->message->id == id) {
-      /* remove from queue */
+      /* remove from bucket */
       if (prev == NULL) {
-        sftp->queue = queue->next;
+        sftp->queue[bucket] = queue->next;
       } else {
         prev->next = queue->next;
       }
@@ -842,6 +1056,85 @@ static void status_msg_free(sftp_status_message status){
   SAFE_FREE(status);
 }
 
+/*
+ * Ask the server for its transfer limits (limits@openssh.com). Any
+ * failure is non-fatal: the limits stay at zero and the callers keep
+ * using the built-in chunk sizes.
+ */
+static void sftp_query_limits(sftp_session sftp) {
+  sftp_message msg = NULL;
+  ssh_string ext;
+  ssh_buffer buffer;
+  uint64_t tmp;
+  uint32_t id;
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    return;
+  }
+
+  ext = ssh_string_from_char("limits@openssh.com");
+  if (ext == NULL) {
+    ssh_buffer_free(buffer);
+    return;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, ext) < 0 ||
+      sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    return;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(ext);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  if (msg->packet_type != SSH_FXP_EXTENDED_REPLY) {
+    sftp_message_free(msg);
+    return;
+  }
+
+  if (buffer_get_u64(msg->payload, &tmp) != sizeof(uint64_t)) {
+    sftp_message_free(msg);
+    return;
+  }
+  sftp->limit_max_packet = ntohll(tmp);
+
+  if (buffer_get_u64(msg->payload, &tmp) != sizeof(uint64_t)) {
+    sftp_message_free(msg);
+    return;
+  }
+  sftp->limit_max_read = ntohll(tmp);
+
+  if (buffer_get_u64(msg->payload, &tmp) != sizeof(uint64_t)) {
+    sftp_message_free(msg);
+    return;
+  }
+  sftp->limit_max_write = ntohll(tmp);
+
+  if (buffer_get_u64(msg->payload, &tmp) != sizeof(uint64_t)) {
+    sftp_message_free(msg);
+    return;
+  }
+  sftp->limit_max_open_handles = ntohll(tmp);
+
+  ssh_log(sftp->session, SSH_LOG_RARE,
+      "SFTP server limits: packet %llu, read %llu, write %llu",
+      (unsigned long long) sftp->limit_max_packet,
+      (unsigned long long) sftp->limit_max_read,
+      (unsigned long long) sftp->limit_max_write);
+
+  sftp_message_free(msg);
+}
+
 static sftp_file parse_handle_msg(sftp_message msg){
   sftp_file file;
 
@@ -1128,48 +1421,418 @@ static sftp_attributes sftp_parse_attr_4(sftp_session sftp, ssh_buffer buf,
   return attr;
 }
 
-enum sftp_longname_field_e {
-  SFTP_LONGNAME_PERM = 0,
-  SFTP_LONGNAME_FIXME,
-  SFTP_LONGNAME_OWNER,
-  SFTP_LONGNAME_GROUP,
-  SFTP_LONGNAME_SIZE,
-  SFTP_LONGNAME_DATE,
-  SFTP_LONGNAME_TIME,
-  SFTP_LONGNAME_NAME,
+/*
+ * A per-message bump allocator: one malloc sized from the payload holds
+ * the parsed struct and every string cut out of it, and one free
+ * releases the whole message. Directory listings otherwise spend a
+ * large share of their time in malloc/free for the many small parse
+ * products.
+ */
+struct sftp_arena_struct {
+  size_t used;
+  size_t size;
+  /* storage follows the header */
 };
 
-static char *sftp_parse_longname(const char *longname,
-        enum sftp_longname_field_e longname_field) {
-    const char *p, *q;
-    size_t len, field = 0;
-    char *x;
+sftp_arena sftp_arena_new(size_t size) {
+  sftp_arena arena;
 
-    p = longname;
-    /* Find the beginning of the field which is specified by sftp_longanme_field_e. */
-    while(field != longname_field) {
-        if(isspace(*p)) {
-            field++;
-            p++;
-            while(*p && isspace(*p)) {
-                p++;
-            }
-        } else {
-            p++;
-        }
-    }
+  arena = malloc(sizeof(struct sftp_arena_struct) + size);
+  if (arena == NULL) {
+    return NULL;
+  }
+  arena->used = 0;
+  arena->size = size;
 
-    q = p;
-    while (! isspace(*q)) {
-        q++;
-    }
+  return arena;
+}
 
-    /* There is no strndup on windows */
-    len = q - p + 1;
-    x = malloc(len);
-    if (x == NULL) {
-      return NULL;
-    }
+void *sftp_arena_alloc(sftp_arena arena, size_t len) {
+  char *ptr;
+
+  /* keep every object 8 byte aligned */
+  len = (len + 7) & ~(size_t) 7;
+  if (len > arena->size - arena->used) {
+    return NULL;
+  }
+  ptr = (char *) (arena + 1) + arena->used;
+  arena->used += len;
+
+  return ptr;
+}
+
+char *sftp_arena_strdup(sftp_arena arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *ptr;
+
+  ptr = sftp_arena_alloc(arena, len);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  memcpy(ptr, str, len);
+
+  return ptr;
+}
+
+/** @internal
+ * @brief copies one wire string from buf into the arena, NUL-terminated
+ */
+char *sftp_arena_get_string_char(sftp_arena arena, ssh_buffer buf) {
+  uint32_t len;
+  char *ptr;
+
+  if (buffer_get_u32(buf, &len) != sizeof(uint32_t)) {
+    return NULL;
+  }
+  len = ntohl(len);
+  if (len > buffer_get_rest_len(buf)) {
+    return NULL;
+  }
+
+  ptr = sftp_arena_alloc(arena, (size_t) len + 1);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  memcpy(ptr, buffer_get_rest(buf), len);
+  ptr[len] = '\0';
+  buffer_pass_bytes(buf, len);
+
+  return ptr;
+}
+
+/** @internal
+ * @brief copies one wire string from buf into the arena as an ssh_string
+ */
+ssh_string sftp_arena_get_string(sftp_arena arena, ssh_buffer buf) {
+  ssh_string str;
+  uint32_t len;
+
+  if (buffer_get_u32(buf, &len) != sizeof(uint32_t)) {
+    return NULL;
+  }
+  len = ntohl(len);
+  if (len > buffer_get_rest_len(buf)) {
+    return NULL;
+  }
+
+  str = sftp_arena_alloc(arena, sizeof(uint32_t) + (size_t) len);
+  if (str == NULL) {
+    return NULL;
+  }
+  str->size = htonl(len);
+  memcpy(str->string, buffer_get_rest(buf), len);
+  buffer_pass_bytes(buf, len);
+
+  return str;
+}
+
+/*
+ * Client-side attribute cache. Scan-heavy tools stat the same paths
+ * over and over; each sftp_stat()/sftp_lstat() is a full round trip.
+ * When enabled with sftp_attr_cache_enable(), replies are kept hashed
+ * by path for a TTL and repeated lookups are answered from memory.
+ * Every mutating operation going through this session (write, unlink,
+ * rename, setstat, ...) drops the affected paths, so the cache only
+ * goes stale when somebody else changes the file behind our back -
+ * which the TTL bounds.
+ */
+struct sftp_attr_cache_entry {
+  struct sftp_attr_cache_entry *next;
+  char *path;
+  int type; /* SSH_FXP_STAT or SSH_FXP_LSTAT */
+  struct ssh_timestamp when;
+  sftp_attributes attr;
+};
+
+struct sftp_attr_cache_struct {
+  int ttl_ms;
+  struct sftp_attr_cache_entry *buckets[SFTP_ATTR_CACHE_BUCKETS];
+};
+
+static unsigned int sftp_attr_cache_hash(const char *path) {
+  unsigned int h = 5381;
+
+  while (*path != '\0') {
+    h = h * 33 + (unsigned char) *path++;
+  }
+
+  return h % SFTP_ATTR_CACHE_BUCKETS;
+}
+
+/* Deep copy of an attribute struct; the cache keeps its own copy and
+ * hands out copies, so callers free their result as usual. */
+static sftp_attributes sftp_attr_dup(sftp_attributes attr) {
+  sftp_attributes copy;
+
+  if (attr->arena != NULL) {
+    /* the struct and its strings live in one block: copy the block and
+     * rebase the internal pointers */
+    size_t blocklen = sizeof(struct sftp_arena_struct) + attr->arena->used;
+    sftp_arena arena;
+    ptrdiff_t delta;
+
+    arena = malloc(blocklen);
+    if (arena == NULL) {
+      return NULL;
+    }
+    memcpy(arena, attr->arena, blocklen);
+    arena->size = arena->used;
+
+    delta = (char *) arena - (char *) attr->arena;
+    copy = (sftp_attributes) ((char *) attr + delta);
+    if (copy->name != NULL) {
+      copy->name += delta;
+    }
+    if (copy->longname != NULL) {
+      copy->longname += delta;
+    }
+    if (copy->owner != NULL) {
+      copy->owner += delta;
+    }
+    if (copy->group != NULL) {
+      copy->group += delta;
+    }
+    if (copy->acl != NULL) {
+      copy->acl = (ssh_string) ((char *) copy->acl + delta);
+    }
+    if (copy->extended_type != NULL) {
+      copy->extended_type = (ssh_string) ((char *) copy->extended_type + delta);
+    }
+    if (copy->extended_data != NULL) {
+      copy->extended_data = (ssh_string) ((char *) copy->extended_data + delta);
+    }
+    copy->arena = arena;
+
+    return copy;
+  }
+
+  copy = malloc(sizeof(struct sftp_attributes_struct));
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, attr, sizeof(struct sftp_attributes_struct));
+  copy->name = NULL;
+  copy->longname = NULL;
+  copy->owner = NULL;
+  copy->group = NULL;
+  copy->acl = NULL;
+  copy->extended_type = NULL;
+  copy->extended_data = NULL;
+
+  if ((attr->name != NULL && (copy->name = strdup(attr->name)) == NULL) ||
+      (attr->longname != NULL &&
+       (copy->longname = strdup(attr->longname)) == NULL) ||
+      (attr->owner != NULL && (copy->owner = strdup(attr->owner)) == NULL) ||
+      (attr->group != NULL && (copy->group = strdup(attr->group)) == NULL) ||
+      (attr->acl != NULL && (copy->acl = ssh_string_copy(attr->acl)) == NULL) ||
+      (attr->extended_type != NULL &&
+       (copy->extended_type = ssh_string_copy(attr->extended_type)) == NULL) ||
+      (attr->extended_data != NULL &&
+       (copy->extended_data = ssh_string_copy(attr->extended_data)) == NULL)) {
+    sftp_attributes_free(copy);
+    return NULL;
+  }
+
+  return copy;
+}
+
+static void sftp_attr_cache_entry_free(struct sftp_attr_cache_entry *entry) {
+  sftp_attributes_free(entry->attr);
+  SAFE_FREE(entry->path);
+  SAFE_FREE(entry);
+}
+
+static void sftp_attr_cache_free(struct sftp_attr_cache_struct *cache) {
+  struct sftp_attr_cache_entry *entry;
+  int i;
+
+  if (cache == NULL) {
+    return;
+  }
+  for (i = 0; i < SFTP_ATTR_CACHE_BUCKETS; i++) {
+    while (cache->buckets[i] != NULL) {
+      entry = cache->buckets[i];
+      cache->buckets[i] = entry->next;
+      sftp_attr_cache_entry_free(entry);
+    }
+  }
+  SAFE_FREE(cache);
+}
+
+/* Drop both the stat and lstat entries of a path, if cached. */
+static void sftp_attr_cache_invalidate(sftp_session sftp, const char *path) {
+  struct sftp_attr_cache_entry **prev;
+  struct sftp_attr_cache_entry *entry;
+
+  if (sftp->attr_cache == NULL || path == NULL) {
+    return;
+  }
+
+  prev = &sftp->attr_cache->buckets[sftp_attr_cache_hash(path)];
+  while ((entry = *prev) != NULL) {
+    if (strcmp(entry->path, path) == 0) {
+      *prev = entry->next;
+      sftp_attr_cache_entry_free(entry);
+    } else {
+      prev = &entry->next;
+    }
+  }
+}
+
+static sftp_attributes sftp_attr_cache_lookup(sftp_session sftp,
+    const char *path, int type) {
+  struct sftp_attr_cache_entry **prev;
+  struct sftp_attr_cache_entry *entry;
+
+  if (sftp->attr_cache == NULL) {
+    return NULL;
+  }
+
+  prev = &sftp->attr_cache->buckets[sftp_attr_cache_hash(path)];
+  while ((entry = *prev) != NULL) {
+    if (entry->type != type || strcmp(entry->path, path) != 0) {
+      prev = &entry->next;
+      continue;
+    }
+    if (ssh_timestamp_elapsed_ms(&entry->when) > sftp->attr_cache->ttl_ms) {
+      *prev = entry->next;
+      sftp_attr_cache_entry_free(entry);
+      return NULL;
+    }
+    return sftp_attr_dup(entry->attr);
+  }
+
+  return NULL;
+}
+
+static void sftp_attr_cache_store(sftp_session sftp, const char *path,
+    int type, sftp_attributes attr) {
+  struct sftp_attr_cache_entry *entry;
+  unsigned int bucket;
+
+  if (sftp->attr_cache == NULL) {
+    return;
+  }
+
+  entry = malloc(sizeof(struct sftp_attr_cache_entry));
+  if (entry == NULL) {
+    return;
+  }
+  ZERO_STRUCTP(entry);
+  entry->path = strdup(path);
+  entry->attr = sftp_attr_dup(attr);
+  if (entry->path == NULL || entry->attr == NULL) {
+    sftp_attr_cache_entry_free(entry);
+    return;
+  }
+  entry->type = type;
+  ssh_timestamp_init(&entry->when);
+
+  /* replace a previous entry of the same path and type */
+  {
+    struct sftp_attr_cache_entry **prev;
+    struct sftp_attr_cache_entry *old;
+
+    bucket = sftp_attr_cache_hash(path);
+    prev = &sftp->attr_cache->buckets[bucket];
+    while ((old = *prev) != NULL) {
+      if (old->type == type && strcmp(old->path, path) == 0) {
+        *prev = old->next;
+        sftp_attr_cache_entry_free(old);
+        break;
+      }
+      prev = &old->next;
+    }
+  }
+
+  entry->next = sftp->attr_cache->buckets[bucket];
+  sftp->attr_cache->buckets[bucket] = entry;
+}
+
+/**
+ * @brief Enable or disable the client-side attribute cache.
+ *
+ * With the cache enabled, sftp_stat() and sftp_lstat() answer repeated
+ * lookups of the same path from memory for up to ttl_ms milliseconds
+ * instead of doing a round trip. Writes, renames, removals and
+ * attribute changes done through this sftp session invalidate the
+ * affected paths immediately; changes made by other clients are only
+ * bounded by the TTL, so pick one matching how stale your application
+ * can tolerate.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param ttl_ms        Lifetime of a cached entry in milliseconds, 0
+ *                      disables and empties the cache.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+int sftp_attr_cache_enable(sftp_session sftp, int ttl_ms) {
+  if (sftp == NULL || ttl_ms < 0) {
+    return -1;
+  }
+
+  if (ttl_ms == 0) {
+    sftp_attr_cache_free(sftp->attr_cache);
+    sftp->attr_cache = NULL;
+    return 0;
+  }
+
+  if (sftp->attr_cache == NULL) {
+    sftp->attr_cache = malloc(sizeof(struct sftp_attr_cache_struct));
+    if (sftp->attr_cache == NULL) {
+      ssh_set_error_oom(sftp->session);
+      return -1;
+    }
+    ZERO_STRUCTP(sftp->attr_cache);
+  }
+  sftp->attr_cache->ttl_ms = ttl_ms;
+
+  return 0;
+}
+
+enum sftp_longname_field_e {
+  SFTP_LONGNAME_PERM = 0,
+  SFTP_LONGNAME_FIXME,
+  SFTP_LONGNAME_OWNER,
+  SFTP_LONGNAME_GROUP,
+  SFTP_LONGNAME_SIZE,
+  SFTP_LONGNAME_DATE,
+  SFTP_LONGNAME_TIME,
+  SFTP_LONGNAME_NAME,
+};
+
+static char *sftp_parse_longname(const char *longname,
+        enum sftp_longname_field_e longname_field) {
+    const char *p, *q;
+    size_t len, field = 0;
+    char *x;
+
+    p = longname;
+    /* Find the beginning of the field which is specified by sftp_longanme_field_e. */
+    while(field != longname_field) {
+        if(isspace(*p)) {
+            field++;
+            p++;
+            while(*p && isspace(*p)) {
+                p++;
+            }
+        } else {
+            p++;
+        }
+    }
+
+    q = p;
+    while (! isspace(*q)) {
+        q++;
+    }
+
+    /* There is no strndup on windows */
+    len = q - p + 1;
+    x = malloc(len);
+    if (x == NULL) {
+      return NULL;
+    }
 
     snprintf(x, len, "%s", p);
 
@@ -1193,44 +1856,59 @@ static char *sftp_parse_longname(const char *longname,
                    so that number of pairs equals extended_count              */
 static sftp_attributes sftp_parse_attr_3(sftp_session sftp, ssh_buffer buf,
     int expectname) {
-  ssh_string longname = NULL;
-  ssh_string name = NULL;
+  sftp_arena arena;
   sftp_attributes attr;
+  char *field = NULL;
   uint32_t flags = 0;
   int ok = 0;
 
-  attr = malloc(sizeof(struct sftp_attributes_struct));
-  if (attr == NULL) {
+  /* one block holds the struct and every string of the message: the
+   * wire strings are disjoint slices of the payload and owner and group
+   * are each at most as long as the longname, so three times the
+   * payload plus slack always fits */
+  arena = sftp_arena_new(sizeof(struct sftp_attributes_struct) +
+      3 * (size_t) buffer_get_rest_len(buf) + 128);
+  if (arena == NULL) {
     ssh_set_error_oom(sftp->session);
     return NULL;
   }
+  attr = sftp_arena_alloc(arena, sizeof(struct sftp_attributes_struct));
   ZERO_STRUCTP(attr);
+  attr->arena = arena;
 
   /* This isn't really a loop, but it is like a try..catch.. */
   do {
     if (expectname) {
-      if ((name = buffer_get_ssh_string(buf)) == NULL ||
-          (attr->name = ssh_string_to_char(name)) == NULL) {
+      attr->name = sftp_arena_get_string_char(arena, buf);
+      if (attr->name == NULL) {
         break;
       }
-      ssh_string_free(name);
 
       ssh_log(sftp->session, SSH_LOG_RARE, "Name: %s", attr->name);
 
-      if ((longname=buffer_get_ssh_string(buf)) == NULL ||
-          (attr->longname=ssh_string_to_char(longname)) == NULL) {
+      attr->longname = sftp_arena_get_string_char(arena, buf);
+      if (attr->longname == NULL) {
         break;
       }
-      ssh_string_free(longname);
 
       /* Set owner and group if we talk to openssh and have the longname */
       if (ssh_get_openssh_version(sftp->session)) {
-        attr->owner = sftp_parse_longname(attr->longname, SFTP_LONGNAME_OWNER);
+        field = sftp_parse_longname(attr->longname, SFTP_LONGNAME_OWNER);
+        if (field == NULL) {
+          break;
+        }
+        attr->owner = sftp_arena_strdup(arena, field);
+        SAFE_FREE(field);
         if (attr->owner == NULL) {
           break;
         }
 
-        attr->group = sftp_parse_longname(attr->longname, SFTP_LONGNAME_GROUP);
+        field = sftp_parse_longname(attr->longname, SFTP_LONGNAME_GROUP);
+        if (field == NULL) {
+          break;
+        }
+        attr->group = sftp_arena_strdup(arena, field);
+        SAFE_FREE(field);
         if (attr->group == NULL) {
           break;
         }
@@ -1312,8 +1990,8 @@ static sftp_attributes sftp_parse_attr_3(sftp_session sftp, ssh_buffer buf,
 
       attr->extended_count = ntohl(attr->extended_count);
       while (attr->extended_count &&
-          (attr->extended_type = buffer_get_ssh_string(buf))
-          && (attr->extended_data = buffer_get_ssh_string(buf))) {
+          (attr->extended_type = sftp_arena_get_string(arena, buf))
+          && (attr->extended_data = sftp_arena_get_string(arena, buf))) {
         attr->extended_count--;
       }
 
@@ -1325,16 +2003,8 @@ static sftp_attributes sftp_parse_attr_3(sftp_session sftp, ssh_buffer buf,
   } while (0);
 
   if (!ok) {
-    /* break issued somewhere */
-    ssh_string_free(name);
-    ssh_string_free(longname);
-    ssh_string_free(attr->extended_type);
-    ssh_string_free(attr->extended_data);
-    SAFE_FREE(attr->name);
-    SAFE_FREE(attr->longname);
-    SAFE_FREE(attr->owner);
-    SAFE_FREE(attr->group);
-    SAFE_FREE(attr);
+    /* break issued somewhere, one free covers everything parsed */
+    SAFE_FREE(arena);
 
     ssh_set_error(sftp->session, SSH_FATAL, "Invalid ATTR structure");
 
@@ -1521,65 +2191,444 @@ int sftp_dir_eof(sftp_dir dir) {
   return dir->eof;
 }
 
-/* Free a SFTP_ATTRIBUTE handle */
-void sftp_attributes_free(sftp_attributes file){
-  if (file == NULL) {
-    return;
-  }
-
-  ssh_string_free(file->acl);
-  ssh_string_free(file->extended_data);
-  ssh_string_free(file->extended_type);
-
-  SAFE_FREE(file->name);
-  SAFE_FREE(file->longname);
-  SAFE_FREE(file->group);
-  SAFE_FREE(file->owner);
-
-  SAFE_FREE(file);
-}
+#define SFTP_DIR_BULK_DEFAULT_REQUESTS 8
 
-static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
-  sftp_status_message status;
-  sftp_message msg = NULL;
-  ssh_buffer buffer = NULL;
+/** @internal
+ * @brief Send one SSH_FXP_READDIR for the bulk cursor and remember its id.
+ */
+static int sftp_dir_bulk_request(sftp_dir_bulk bulk) {
+  sftp_session sftp = bulk->sftp;
+  ssh_buffer payload;
   uint32_t id;
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
     ssh_set_error_oom(sftp->session);
     return -1;
   }
 
   id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, handle) < 0) {
+  if (buffer_add_u32(payload, id) < 0 ||
+      buffer_add_ssh_string(payload, bulk->dir->handle) < 0) {
     ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
+    ssh_buffer_free(payload);
     return -1;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_CLOSE ,buffer) < 0) {
-    ssh_buffer_free(buffer);
+
+  if (sftp_packet_write(sftp, SSH_FXP_READDIR, payload) < 0) {
+    ssh_buffer_free(payload);
     return -1;
   }
-  ssh_buffer_free(buffer);
+  ssh_buffer_free(payload);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      /* something nasty has happened */
-      return -1;
-    }
-    msg = sftp_dequeue(sftp,id);
+  bulk->queue[(bulk->head + bulk->pending) % bulk->n_requests] = id;
+  bulk->pending++;
+
+  return 0;
+}
+
+/** @internal
+ * @brief Copy one wire string into the batch arena, NUL-terminated.
+ *
+ * The arena may still move while the batch grows, so the slot receives
+ * the offset for now; sftp_dir_bulk_decode() turns it into a pointer
+ * once the arena has its final size.
+ */
+static int sftp_dir_bulk_string(sftp_dir_bulk bulk, ssh_buffer buf,
+    const char **slot) {
+  uint32_t len;
+
+  if (buffer_get_u32(buf, &len) != sizeof(uint32_t)) {
+    return -1;
+  }
+  len = ntohl(len);
+  if (len > buffer_get_rest_len(buf)) {
+    return -1;
   }
 
-  switch (msg->packet_type) {
-    case SSH_FXP_STATUS:
-      status = parse_status_msg(msg);
-      sftp_message_free(msg);
-      if(status == NULL) {
-        return -1;
-      }
-      sftp_set_error(sftp, status->status);
+  *slot = (const char *) (size_t) buffer_get_rest_len(bulk->arena);
+  if (buffer_add_data(bulk->arena, buffer_get_rest(buf), len) < 0 ||
+      buffer_add_data(bulk->arena, "", 1) < 0) {
+    return -1;
+  }
+  buffer_pass_bytes(buf, len);
+
+  return 0;
+}
+
+/** @internal
+ * @brief Skip one wire string without copying it.
+ */
+static int sftp_dir_bulk_skip_string(ssh_buffer buf) {
+  uint32_t len;
+
+  if (buffer_get_u32(buf, &len) != sizeof(uint32_t)) {
+    return -1;
+  }
+  len = ntohl(len);
+  if (buffer_pass_bytes(buf, len) != len) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/** @internal
+ * @brief Decode a version 3 SSH_FXP_NAME reply into the batch arena.
+ *
+ * This is sftp_parse_attr_3() without the per-entry allocations: the
+ * strings of the whole batch share one growing arena and the fixed-size
+ * fields live in the reused entries array.
+ */
+static int sftp_dir_bulk_decode(sftp_dir_bulk bulk, ssh_buffer buf) {
+  sftp_session sftp = bulk->sftp;
+  uint32_t count;
+  uint32_t i;
+  char *base;
+
+  if (buffer_get_u32(buf, &count) != sizeof(uint32_t)) {
+    goto error;
+  }
+  count = ntohl(count);
+  if (count == 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Count of files sent by the server is zero, which is invalid, or "
+        "libsftp bug");
+    return -1;
+  }
+
+  if (count > bulk->entries_size) {
+    struct sftp_dir_entry_struct *entries;
+
+    entries = realloc(bulk->entries,
+        count * sizeof(struct sftp_dir_entry_struct));
+    if (entries == NULL) {
+      ssh_set_error_oom(sftp->session);
+      return -1;
+    }
+    bulk->entries = entries;
+    bulk->entries_size = count;
+  }
+  buffer_reinit(bulk->arena);
+
+  for (i = 0; i < count; i++) {
+    struct sftp_dir_entry_struct *e = &bulk->entries[i];
+    uint32_t flags;
+
+    ZERO_STRUCTP(e);
+    if (sftp_dir_bulk_string(bulk, buf, &e->name) < 0 ||
+        sftp_dir_bulk_string(bulk, buf, &e->longname) < 0) {
+      goto error;
+    }
+
+    if (buffer_get_u32(buf, &flags) != sizeof(uint32_t)) {
+      goto error;
+    }
+    flags = ntohl(flags);
+    e->flags = flags;
+
+    if (flags & SSH_FILEXFER_ATTR_SIZE) {
+      if (buffer_get_u64(buf, &e->size) != sizeof(uint64_t)) {
+        goto error;
+      }
+      e->size = ntohll(e->size);
+    }
+
+    if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+      if (buffer_get_u32(buf, &e->uid) != sizeof(uint32_t) ||
+          buffer_get_u32(buf, &e->gid) != sizeof(uint32_t)) {
+        goto error;
+      }
+      e->uid = ntohl(e->uid);
+      e->gid = ntohl(e->gid);
+    }
+
+    if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+      if (buffer_get_u32(buf, &e->permissions) != sizeof(uint32_t)) {
+        goto error;
+      }
+      e->permissions = ntohl(e->permissions);
+
+      switch (e->permissions & S_IFMT) {
+        case S_IFSOCK:
+        case S_IFBLK:
+        case S_IFCHR:
+        case S_IFIFO:
+          e->type = SSH_FILEXFER_TYPE_SPECIAL;
+          break;
+        case S_IFLNK:
+          e->type = SSH_FILEXFER_TYPE_SYMLINK;
+          break;
+        case S_IFREG:
+          e->type = SSH_FILEXFER_TYPE_REGULAR;
+          break;
+        case S_IFDIR:
+          e->type = SSH_FILEXFER_TYPE_DIRECTORY;
+          break;
+        default:
+          e->type = SSH_FILEXFER_TYPE_UNKNOWN;
+          break;
+      }
+    }
+
+    if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+      if (buffer_get_u32(buf, &e->atime) != sizeof(uint32_t) ||
+          buffer_get_u32(buf, &e->mtime) != sizeof(uint32_t)) {
+        goto error;
+      }
+      e->atime = ntohl(e->atime);
+      e->mtime = ntohl(e->mtime);
+    }
+
+    if (flags & SSH_FILEXFER_ATTR_EXTENDED) {
+      uint32_t extended;
+
+      if (buffer_get_u32(buf, &extended) != sizeof(uint32_t)) {
+        goto error;
+      }
+      extended = ntohl(extended);
+      while (extended > 0) {
+        if (sftp_dir_bulk_skip_string(buf) < 0 ||
+            sftp_dir_bulk_skip_string(buf) < 0) {
+          goto error;
+        }
+        extended--;
+      }
+    }
+  }
+
+  /* the arena has stopped growing, turn the offsets into pointers */
+  base = buffer_get_rest(bulk->arena);
+  for (i = 0; i < count; i++) {
+    bulk->entries[i].name = base + (size_t) bulk->entries[i].name;
+    bulk->entries[i].longname = base + (size_t) bulk->entries[i].longname;
+  }
+  bulk->batch_count = count;
+  bulk->batch_pos = 0;
+
+  return 0;
+error:
+  ssh_set_error(sftp->session, SSH_FATAL,
+      "Couldn't parse the SFTP attributes");
+  return -1;
+}
+
+/* Start a bulk enumeration of an open directory. */
+sftp_dir_bulk sftp_dir_bulk_begin(sftp_session sftp, sftp_dir dir,
+    uint32_t n_requests) {
+  sftp_dir_bulk bulk;
+
+  if (sftp == NULL || dir == NULL) {
+    return NULL;
+  }
+  if (sftp->version > 3) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Bulk readdir not implemented for protocol version %d",
+        sftp->version);
+    return NULL;
+  }
+  if (n_requests == 0) {
+    n_requests = SFTP_DIR_BULK_DEFAULT_REQUESTS;
+  }
+
+  bulk = malloc(sizeof(struct sftp_dir_bulk_struct));
+  if (bulk == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  ZERO_STRUCTP(bulk);
+  bulk->sftp = sftp;
+  bulk->dir = dir;
+  bulk->n_requests = n_requests;
+
+  bulk->queue = malloc(n_requests * sizeof(uint32_t));
+  bulk->arena = ssh_buffer_new();
+  if (bulk->queue == NULL || bulk->arena == NULL) {
+    ssh_set_error_oom(sftp->session);
+    sftp_dir_bulk_free(bulk);
+    return NULL;
+  }
+
+  while (bulk->pending < bulk->n_requests) {
+    if (sftp_dir_bulk_request(bulk) < 0) {
+      sftp_dir_bulk_free(bulk);
+      return NULL;
+    }
+  }
+
+  return bulk;
+}
+
+/* Return the next entry of a bulk directory enumeration. */
+sftp_dir_entry sftp_dir_bulk_next(sftp_dir_bulk bulk) {
+  sftp_session sftp;
+  sftp_status_message status;
+  sftp_message msg;
+  uint32_t id;
+
+  if (bulk == NULL) {
+    return NULL;
+  }
+  sftp = bulk->sftp;
+
+  if (bulk->batch_pos < bulk->batch_count) {
+    return &bulk->entries[bulk->batch_pos++];
+  }
+
+  while (bulk->pending > 0) {
+    id = bulk->queue[bulk->head];
+    msg = sftp_dequeue(sftp, id);
+    while (msg == NULL) {
+      if (sftp_read_and_dispatch(sftp) < 0) {
+        /* something nasty has happened */
+        return NULL;
+      }
+      msg = sftp_dequeue(sftp, id);
+    }
+    bulk->head = (bulk->head + 1) % bulk->n_requests;
+    bulk->pending--;
+
+    switch (msg->packet_type) {
+      case SSH_FXP_STATUS:
+        status = parse_status_msg(msg);
+        sftp_message_free(msg);
+        if (status == NULL) {
+          return NULL;
+        }
+        sftp_set_error(sftp, status->status);
+        if (status->status == SSH_FX_EOF) {
+          bulk->dir->eof = 1;
+          status_msg_free(status);
+          /* requests pipelined past the end answer EOF too, drain them */
+          continue;
+        }
+        ssh_set_error(sftp->session, SSH_FATAL,
+            "Unknown error status: %d", status->status);
+        status_msg_free(status);
+        return NULL;
+      case SSH_FXP_NAME:
+        if (sftp_dir_bulk_decode(bulk, msg->payload) < 0) {
+          sftp_message_free(msg);
+          return NULL;
+        }
+        sftp_message_free(msg);
+        /* keep the pipeline full behind the reader */
+        while (!bulk->dir->eof && bulk->pending < bulk->n_requests) {
+          if (sftp_dir_bulk_request(bulk) < 0) {
+            return NULL;
+          }
+        }
+        return &bulk->entries[bulk->batch_pos++];
+      default:
+        ssh_set_error(sftp->session, SSH_FATAL,
+            "Unsupported message back %d", msg->packet_type);
+        sftp_message_free(msg);
+        return NULL;
+    }
+  }
+
+  /* every request drained, dir->eof is set */
+  return NULL;
+}
+
+/* Release a bulk enumeration cursor. */
+void sftp_dir_bulk_free(sftp_dir_bulk bulk) {
+  sftp_message msg;
+  uint32_t id;
+
+  if (bulk == NULL) {
+    return;
+  }
+
+  /* drain what is still in flight so the ids don't collide later */
+  while (bulk->pending > 0) {
+    id = bulk->queue[bulk->head];
+    msg = sftp_dequeue(bulk->sftp, id);
+    while (msg == NULL) {
+      if (sftp_read_and_dispatch(bulk->sftp) < 0) {
+        bulk->pending = 0;
+        break;
+      }
+      msg = sftp_dequeue(bulk->sftp, id);
+    }
+    if (msg != NULL) {
+      sftp_message_free(msg);
+      bulk->head = (bulk->head + 1) % bulk->n_requests;
+      bulk->pending--;
+    }
+  }
+
+  SAFE_FREE(bulk->queue);
+  SAFE_FREE(bulk->entries);
+  ssh_buffer_free(bulk->arena);
+  SAFE_FREE(bulk);
+}
+
+/* Free a SFTP_ATTRIBUTE handle */
+void sftp_attributes_free(sftp_attributes file){
+  if (file == NULL) {
+    return;
+  }
+
+  if (file->arena != NULL) {
+    /* the struct and its strings share the arena block */
+    SAFE_FREE(file->arena);
+    return;
+  }
+
+  ssh_string_free(file->acl);
+  ssh_string_free(file->extended_data);
+  ssh_string_free(file->extended_type);
+
+  SAFE_FREE(file->name);
+  SAFE_FREE(file->longname);
+  SAFE_FREE(file->group);
+  SAFE_FREE(file->owner);
+
+  SAFE_FREE(file);
+}
+
+static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
+  sftp_status_message status;
+  sftp_message msg = NULL;
+  ssh_buffer buffer = NULL;
+  uint32_t id;
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, handle) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_CLOSE ,buffer) < 0) {
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      /* something nasty has happened */
+      return -1;
+    }
+    msg = sftp_dequeue(sftp,id);
+  }
+
+  switch (msg->packet_type) {
+    case SSH_FXP_STATUS:
+      status = parse_status_msg(msg);
+      sftp_message_free(msg);
+      if(status == NULL) {
+        return -1;
+      }
+      sftp_set_error(sftp, status->status);
       switch (status->status) {
         case SSH_FX_OK:
           status_msg_free(status);
@@ -1605,9 +2654,18 @@ static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
 int sftp_close(sftp_file file){
   int err = SSH_NO_ERROR;
 
+  if (file->ra_requests > 0) {
+    sftp_file_set_readahead(file, 0, 0);
+  }
+  if (file->ww_requests > 0 && sftp_file_flush(file) < 0) {
+    err = SSH_ERROR;
+  }
+  SAFE_FREE(file->ww_queue);
   SAFE_FREE(file->name);
   if (file->handle){
-    err = sftp_handle_close(file->sftp,file->handle);
+    if (sftp_handle_close(file->sftp,file->handle) < 0) {
+      err = SSH_ERROR;
+    }
     ssh_string_free(file->handle);
   }
   /* FIXME: check server response and implement errno */
@@ -1644,6 +2702,10 @@ sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
   uint32_t sftp_flags = 0;
   uint32_t id;
 
+  if ((flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) != 0) {
+    sftp_attr_cache_invalidate(sftp, file);
+  }
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -1721,6 +2783,10 @@ sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
     case SSH_FXP_HANDLE:
       handle = parse_handle_msg(msg);
       sftp_message_free(msg);
+      if (handle != NULL) {
+        /* remembered so writes can invalidate the attribute cache */
+        handle->name = strdup(file);
+      }
       return handle;
     default:
       ssh_set_error(sftp->session, SSH_FATAL,
@@ -1738,6 +2804,176 @@ void sftp_file_set_blocking(sftp_file handle){
     handle->nonblocking=0;
 }
 
+#define SFTP_READAHEAD_DEFAULT_CHUNK 32768
+
+/* never size a chunk above 1MB even if the server allows more */
+#define SFTP_LIMIT_CHUNK_CAP (1024 * 1024)
+
+/** @internal
+ * @brief Pick a read chunk size from the negotiated server limits,
+ * falling back to the built-in default when the server did not report
+ * any.
+ */
+static uint32_t sftp_read_chunk_size(sftp_session sftp) {
+  if (sftp->limit_max_read == 0) {
+    return SFTP_READAHEAD_DEFAULT_CHUNK;
+  }
+  if (sftp->limit_max_read > SFTP_LIMIT_CHUNK_CAP) {
+    return SFTP_LIMIT_CHUNK_CAP;
+  }
+
+  return (uint32_t) sftp->limit_max_read;
+}
+
+/** @internal
+ * @brief Wait for every outstanding readahead request and discard the
+ * results.
+ */
+static int sftp_readahead_drain(sftp_file file) {
+  sftp_session sftp = file->sftp;
+  sftp_message msg;
+
+  while (file->ra_count > 0) {
+    uint32_t id = file->ra_queue[file->ra_head].id;
+
+    msg = sftp_dequeue(sftp, id);
+    while (msg == NULL) {
+      if (sftp_read_and_dispatch(sftp) < 0) {
+        return -1;
+      }
+      msg = sftp_dequeue(sftp, id);
+    }
+    sftp_message_free(msg);
+    file->ra_head = (file->ra_head + 1) % file->ra_requests;
+    file->ra_count--;
+  }
+
+  return 0;
+}
+
+/* Enable or disable pipelined readahead on an open file. */
+int sftp_file_set_readahead(sftp_file file, uint32_t n_requests,
+    uint32_t chunk_size) {
+  if (file == NULL) {
+    return -1;
+  }
+
+  if (file->ra_requests > 0 && sftp_readahead_drain(file) < 0) {
+    return -1;
+  }
+  SAFE_FREE(file->ra_queue);
+  SAFE_FREE(file->ra_scratch);
+  ssh_buffer_free(file->ra_buffer);
+  file->ra_buffer = NULL;
+  file->ra_requests = 0;
+  file->ra_head = 0;
+  file->ra_count = 0;
+
+  if (n_requests == 0) {
+    return 0;
+  }
+  if (chunk_size == 0) {
+    chunk_size = sftp_read_chunk_size(file->sftp);
+  }
+
+  file->ra_queue = malloc(n_requests * sizeof(struct sftp_ra_request_struct));
+  file->ra_scratch = malloc(chunk_size);
+  file->ra_buffer = ssh_buffer_new();
+  if (file->ra_queue == NULL || file->ra_scratch == NULL ||
+      file->ra_buffer == NULL) {
+    SAFE_FREE(file->ra_queue);
+    SAFE_FREE(file->ra_scratch);
+    ssh_buffer_free(file->ra_buffer);
+    file->ra_buffer = NULL;
+    ssh_set_error_oom(file->sftp->session);
+    return -1;
+  }
+
+  ssh_buffer_reserve(file->ra_buffer, chunk_size);
+
+  file->ra_requests = n_requests;
+  file->ra_chunk = chunk_size;
+
+  return 0;
+}
+
+/** @internal
+ * @brief sftp_read() served from the readahead pipeline.
+ */
+static ssize_t sftp_read_readahead(sftp_file handle, void *buf, size_t count) {
+  sftp_session sftp = handle->sftp;
+  uint32_t avail;
+
+  /* keep the pipeline full */
+  while (!handle->eof && handle->ra_count < handle->ra_requests) {
+    struct sftp_ra_request_struct *req;
+    uint64_t offset = handle->offset;
+    int id;
+
+    id = sftp_async_read_begin(handle, handle->ra_chunk);
+    if (id < 0) {
+      return -1;
+    }
+    req = &handle->ra_queue[(handle->ra_head + handle->ra_count) %
+        handle->ra_requests];
+    req->id = id;
+    req->offset = offset;
+    req->len = handle->ra_chunk;
+    handle->ra_count++;
+  }
+
+  while (buffer_get_rest_len(handle->ra_buffer) == 0) {
+    struct sftp_ra_request_struct req;
+    int r;
+
+    if (handle->ra_count == 0) {
+      /* end of file and nothing left buffered */
+      return 0;
+    }
+    req = handle->ra_queue[handle->ra_head];
+    r = sftp_async_read(handle, handle->ra_scratch, req.len, req.id);
+    if (r == SSH_AGAIN) {
+      /* we cannot block */
+      return 0;
+    }
+    handle->ra_head = (handle->ra_head + 1) % handle->ra_requests;
+    handle->ra_count--;
+    if (r == SSH_ERROR) {
+      return -1;
+    }
+    if (r == 0) {
+      /* end of file: the requests still in flight are past it and will
+       * only report EOF as well */
+      if (sftp_readahead_drain(handle) < 0) {
+        return -1;
+      }
+      return 0;
+    }
+    if (buffer_add_data(handle->ra_buffer, handle->ra_scratch, r) < 0) {
+      ssh_set_error_oom(sftp->session);
+      return -1;
+    }
+    if ((uint32_t)r < req.len && !handle->eof) {
+      /* Short read: the offsets the in-flight requests were issued with
+       * assumed a full chunk, so restart the pipeline from the actual
+       * position. */
+      if (sftp_readahead_drain(handle) < 0) {
+        return -1;
+      }
+      handle->offset = req.offset + r;
+    }
+  }
+
+  avail = buffer_get_rest_len(handle->ra_buffer);
+  if (avail > count) {
+    avail = count;
+  }
+  memcpy(buf, buffer_get_rest(handle->ra_buffer), avail);
+  buffer_pass_bytes(handle->ra_buffer, avail);
+
+  return avail;
+}
+
 /* Read from a file using an opened sftp file handle. */
 ssize_t sftp_read(sftp_file handle, void *buf, size_t count) {
   sftp_session sftp = handle->sftp;
@@ -1747,10 +2983,19 @@ ssize_t sftp_read(sftp_file handle, void *buf, size_t count) {
   ssh_buffer buffer;
   int id;
 
+  if (handle->ra_requests > 0) {
+    return sftp_read_readahead(handle, buf, count);
+  }
+
   if (handle->eof) {
     return 0;
   }
 
+  /* a short read is fine, the callers loop */
+  if (sftp->limit_max_read > 0 && count > sftp->limit_max_read) {
+    count = sftp->limit_max_read;
+  }
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -1963,6 +3208,104 @@ int sftp_async_read(sftp_file file, void *data, uint32_t size, uint32_t id){
   return SSH_ERROR;
 }
 
+/** @internal
+ * @brief Wait for the status reply of the oldest outstanding write.
+ *
+ * Server-side failures are latched in ww_error and reported by the next
+ * sftp_write() or sftp_file_flush(); only transport errors fail here.
+ */
+static int sftp_write_wait_ack(sftp_file file) {
+  sftp_session sftp = file->sftp;
+  sftp_status_message status;
+  sftp_message msg = NULL;
+  uint32_t id;
+
+  if (file->ww_count == 0) {
+    return 0;
+  }
+  id = file->ww_queue[file->ww_head];
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+  file->ww_head = (file->ww_head + 1) % file->ww_requests;
+  file->ww_count--;
+
+  if (msg->packet_type != SSH_FXP_STATUS) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d during write!", msg->packet_type);
+    sftp_message_free(msg);
+    return -1;
+  }
+
+  status = parse_status_msg(msg);
+  sftp_message_free(msg);
+  if (status == NULL) {
+    return -1;
+  }
+  if (status->status != SSH_FX_OK && file->ww_error == SSH_FX_OK) {
+    file->ww_error = status->status;
+    sftp_set_error(sftp, status->status);
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+  }
+  status_msg_free(status);
+
+  return 0;
+}
+
+/* Enable or disable pipelined writes on an open file. */
+int sftp_file_set_write_window(sftp_file file, uint32_t n_requests) {
+  if (file == NULL) {
+    return -1;
+  }
+
+  if (file->ww_requests > 0 && sftp_file_flush(file) < 0) {
+    return -1;
+  }
+  SAFE_FREE(file->ww_queue);
+  file->ww_requests = 0;
+  file->ww_head = 0;
+  file->ww_count = 0;
+
+  if (n_requests == 0) {
+    return 0;
+  }
+
+  file->ww_queue = malloc(n_requests * sizeof(uint32_t));
+  if (file->ww_queue == NULL) {
+    ssh_set_error_oom(file->sftp->session);
+    return -1;
+  }
+  file->ww_requests = n_requests;
+
+  return 0;
+}
+
+/* Wait for every outstanding write to be acknowledged. */
+int sftp_file_flush(sftp_file file) {
+  if (file == NULL) {
+    return -1;
+  }
+
+  while (file->ww_count > 0) {
+    if (sftp_write_wait_ack(file) < 0) {
+      return -1;
+    }
+  }
+
+  if (file->ww_error != SSH_FX_OK) {
+    /* the error string was set when the status came in */
+    file->ww_error = SSH_FX_OK;
+    return -1;
+  }
+
+  return 0;
+}
+
 ssize_t sftp_write(sftp_file file, const void *buf, size_t count) {
   sftp_session sftp = file->sftp;
   sftp_message msg = NULL;
@@ -1973,6 +3316,26 @@ ssize_t sftp_write(sftp_file file, const void *buf, size_t count) {
   int len;
   int packetlen;
 
+  sftp_attr_cache_invalidate(sftp, file->name);
+
+  if (file->ww_requests > 0) {
+    /* make room in the window, surfacing any deferred failure first */
+    while (file->ww_count >= file->ww_requests) {
+      if (sftp_write_wait_ack(file) < 0) {
+        return -1;
+      }
+    }
+    if (file->ww_error != SSH_FX_OK) {
+      file->ww_error = SSH_FX_OK;
+      return -1;
+    }
+  }
+
+  /* a short write is fine, the callers loop */
+  if (sftp->limit_max_write > 0 && count > sftp->limit_max_write) {
+    count = sftp->limit_max_write;
+  }
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2008,6 +3371,14 @@ ssize_t sftp_write(sftp_file file, const void *buf, size_t count) {
         "Could not write as much data as expected");
   }
 
+  if (file->ww_requests > 0) {
+    /* pipelined: collect the status later, see sftp_write_wait_ack() */
+    file->ww_queue[(file->ww_head + file->ww_count) % file->ww_requests] = id;
+    file->ww_count++;
+    file->offset += count;
+    return count;
+  }
+
   while (msg == NULL) {
     if (sftp_read_and_dispatch(file->sftp) < 0) {
       /* something nasty has happened */
@@ -2048,11 +3419,23 @@ ssize_t sftp_write(sftp_file file, const void *buf, size_t count) {
 }
 
 /* Seek to a specific location in a file. */
+/** @internal
+ * @brief Drop prefetched data after an explicit change of the file offset.
+ */
+static void sftp_readahead_flush(sftp_file file) {
+  if (file->ra_requests == 0) {
+    return;
+  }
+  sftp_readahead_drain(file);
+  buffer_reinit(file->ra_buffer);
+}
+
 int sftp_seek(sftp_file file, uint32_t new_offset) {
   if (file == NULL) {
     return -1;
   }
 
+  sftp_readahead_flush(file);
   file->offset = new_offset;
   file->eof = 0;
 
@@ -2064,6 +3447,7 @@ int sftp_seek64(sftp_file file, uint64_t new_offset) {
     return -1;
   }
 
+  sftp_readahead_flush(file);
   file->offset = new_offset;
   file->eof = 0;
 
@@ -2081,6 +3465,7 @@ uint64_t sftp_tell64(sftp_file file) {
 
 /* Rewinds the position of the file pointer to the beginning of the file.*/
 void sftp_rewind(sftp_file file) {
+  sftp_readahead_flush(file);
   file->offset = 0;
   file->eof = 0;
 }
@@ -2093,6 +3478,8 @@ int sftp_unlink(sftp_session sftp, const char *file) {
   ssh_buffer buffer;
   uint32_t id;
 
+  sftp_attr_cache_invalidate(sftp, file);
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2170,6 +3557,8 @@ int sftp_rmdir(sftp_session sftp, const char *directory) {
   ssh_buffer buffer;
   uint32_t id;
 
+  sftp_attr_cache_invalidate(sftp, directory);
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2246,6 +3635,8 @@ int sftp_mkdir(sftp_session sftp, const char *directory, mode_t mode) {
   ssh_string path;
   uint32_t id;
 
+  sftp_attr_cache_invalidate(sftp, directory);
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2336,6 +3727,9 @@ int sftp_rename(sftp_session sftp, const char *original, const char *newname) {
   ssh_string newpath;
   uint32_t id;
 
+  sftp_attr_cache_invalidate(sftp, original);
+  sftp_attr_cache_invalidate(sftp, newname);
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2429,6 +3823,8 @@ int sftp_setstat(sftp_session sftp, const char *file, sftp_attributes attr) {
   sftp_message msg = NULL;
   sftp_status_message status = NULL;
 
+  sftp_attr_cache_invalidate(sftp, file);
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2554,6 +3950,8 @@ int sftp_symlink(sftp_session sftp, const char *target, const char *dest) {
     return -1;
   }
 
+  sftp_attr_cache_invalidate(sftp, dest);
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -2991,23 +4389,182 @@ sftp_statvfs_t sftp_fstatvfs(sftp_file file) {
       return NULL;
     }
     ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-  } else { /* this shouldn't happen */
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to set stats", msg->packet_type);
-    sftp_message_free(msg);
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+  } else { /* this shouldn't happen */
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to set stats", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return NULL;
+}
+
+void sftp_statvfs_free(sftp_statvfs_t statvfs) {
+  if (statvfs == NULL) {
+    return;
+  }
+
+  SAFE_FREE(statvfs);
+}
+
+/** @internal
+ * @brief Waits for the SSH_FXP_STATUS reply of an extended request and
+ * translates it to 0 / -1 with the errors set. Shared by the openssh
+ * extensions which only return a status (hardlink, fsync).
+ */
+static int sftp_extended_status(sftp_session sftp, uint32_t id,
+    const char *what) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    if (status->status == SSH_FX_OK) {
+      status_msg_free(status);
+      return 0;
+    }
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  }
+
+  ssh_set_error(sftp->session, SSH_FATAL,
+      "Received message %d when attempting to %s", msg->packet_type, what);
+  sftp_message_free(msg);
+
+  return -1;
+}
+
+int sftp_hardlink(sftp_session sftp, const char *oldpath,
+    const char *newpath) {
+  ssh_string oldpath_s;
+  ssh_string newpath_s;
+  ssh_string ext;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  if (sftp == NULL)
+    return -1;
+  if (oldpath == NULL || newpath == NULL) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return -1;
+  }
+  if (!sftp_extension_supported(sftp, "hardlink@openssh.com", "1")) {
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server does not support the hardlink@openssh.com extension");
+    return -1;
+  }
+
+  /* the link changes the nlink count of the existing file too */
+  sftp_attr_cache_invalidate(sftp, oldpath);
+  sftp_attr_cache_invalidate(sftp, newpath);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  ext = ssh_string_from_char("hardlink@openssh.com");
+  if (ext == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  oldpath_s = ssh_string_from_char(oldpath);
+  if (oldpath_s == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_string_free(ext);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  newpath_s = ssh_string_from_char(newpath);
+  if (newpath_s == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_string_free(oldpath_s);
+    ssh_string_free(ext);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, ext) < 0 ||
+      buffer_add_ssh_string(buffer, oldpath_s) < 0 ||
+      buffer_add_ssh_string(buffer, newpath_s) < 0 ||
+      sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    ssh_string_free(oldpath_s);
+    ssh_string_free(newpath_s);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(ext);
+  ssh_string_free(oldpath_s);
+  ssh_string_free(newpath_s);
+
+  return sftp_extended_status(sftp, id, "create a hardlink");
+}
+
+int sftp_fsync(sftp_file file) {
+  sftp_session sftp;
+  ssh_string ext;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  if (file == NULL)
+    return -1;
+  sftp = file->sftp;
+
+  if (!sftp_extension_supported(sftp, "fsync@openssh.com", "1")) {
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server does not support the fsync@openssh.com extension");
+    return -1;
   }
 
-  return NULL;
-}
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
 
-void sftp_statvfs_free(sftp_statvfs_t statvfs) {
-  if (statvfs == NULL) {
-    return;
+  ext = ssh_string_from_char("fsync@openssh.com");
+  if (ext == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
   }
 
-  SAFE_FREE(statvfs);
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, ext) < 0 ||
+      buffer_add_ssh_string(buffer, file->handle) < 0 ||
+      sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(ext);
+
+  return sftp_extended_status(sftp, id, "fsync");
 }
 
 /* another code written by Nick */
@@ -3102,10 +4659,16 @@ static sftp_attributes sftp_xstat(sftp_session sftp, const char *path,
     int param) {
   sftp_status_message status = NULL;
   sftp_message msg = NULL;
+  sftp_attributes cached;
   ssh_string pathstr;
   ssh_buffer buffer;
   uint32_t id;
 
+  cached = sftp_attr_cache_lookup(sftp, path, param);
+  if (cached != NULL) {
+    return cached;
+  }
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -3145,6 +4708,9 @@ static sftp_attributes sftp_xstat(sftp_session sftp, const char *path,
   if (msg->packet_type == SSH_FXP_ATTRS) {
     sftp_attributes attr = sftp_parse_attr(sftp, msg->payload, 0);
     sftp_message_free(msg);
+    if (attr != NULL) {
+      sftp_attr_cache_store(sftp, path, param, attr);
+    }
 
     return attr;
   } else if (msg->packet_type == SSH_FXP_STATUS) {
@@ -3227,5 +4793,559 @@ sftp_attributes sftp_fstat(sftp_file file) {
   return NULL;
 }
 
+/* block size the parallel streams read and write with */
+#define SFTP_PARALLEL_CHUNK 16384
+/* outstanding requests kept in flight on each stream */
+#define SFTP_PARALLEL_REQUESTS 8
+/* a stream is only worth its setup cost for at least this many bytes */
+#define SFTP_PARALLEL_MIN_RANGE 262144
+
+/* One stripe of a parallel transfer, see sftp_parallel_get(). */
+struct sftp_parallel_worker_struct {
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+#endif
+  sftp_session sftp;
+  const char *remotefile;
+  const char *localfile;
+  uint64_t offset;
+  uint64_t len;
+  int (*range_fn)(struct sftp_parallel_worker_struct *worker);
+  int rc;
+};
+
+static int sftp_parallel_get_range(struct sftp_parallel_worker_struct *w) {
+  char buf[SFTP_PARALLEL_CHUNK];
+  sftp_file file;
+  uint64_t done;
+  ssize_t r;
+  ssize_t written;
+  size_t n;
+  size_t off;
+  int fd;
+
+  file = sftp_open(w->sftp, w->remotefile, O_RDONLY, 0);
+  if (file == NULL) {
+    return SSH_ERROR;
+  }
+  if (sftp_seek64(file, w->offset) < 0) {
+    sftp_close(file);
+    return SSH_ERROR;
+  }
+  sftp_file_set_readahead(file, SFTP_PARALLEL_REQUESTS, SFTP_PARALLEL_CHUNK);
+
+  fd = open(w->localfile, O_WRONLY, 0);
+  if (fd < 0 || lseek(fd, (off_t) w->offset, SEEK_SET) == (off_t) -1) {
+    ssh_set_error(w->sftp->session, SSH_REQUEST_DENIED,
+        "Error opening %s: %s", w->localfile, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    sftp_close(file);
+    return SSH_ERROR;
+  }
+
+  for (done = 0; done < w->len; done += r) {
+    n = sizeof(buf);
+    if (w->len - done < (uint64_t) n) {
+      n = (size_t) (w->len - done);
+    }
+    r = sftp_read(file, buf, n);
+    if (r <= 0) {
+      break;
+    }
+    for (off = 0; off < (size_t) r; off += written) {
+      written = write(fd, buf + off, (size_t) r - off);
+      if (written < 0) {
+        ssh_set_error(w->sftp->session, SSH_REQUEST_DENIED,
+            "Error writing %s: %s", w->localfile, strerror(errno));
+        close(fd);
+        sftp_close(file);
+        return SSH_ERROR;
+      }
+    }
+  }
+
+  close(fd);
+  sftp_close(file);
+
+  return done == w->len ? SSH_OK : SSH_ERROR;
+}
+
+static int sftp_parallel_put_range(struct sftp_parallel_worker_struct *w) {
+  char buf[SFTP_PARALLEL_CHUNK];
+  sftp_file file;
+  uint64_t done;
+  ssize_t r;
+  size_t n;
+  int fd;
+  int rc;
+
+  fd = open(w->localfile, O_RDONLY, 0);
+  if (fd < 0 || lseek(fd, (off_t) w->offset, SEEK_SET) == (off_t) -1) {
+    ssh_set_error(w->sftp->session, SSH_REQUEST_DENIED,
+        "Error opening %s: %s", w->localfile, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return SSH_ERROR;
+  }
+
+  /* the file was created by sftp_parallel_put() before the streams start */
+  file = sftp_open(w->sftp, w->remotefile, O_WRONLY, 0);
+  if (file == NULL) {
+    close(fd);
+    return SSH_ERROR;
+  }
+  if (sftp_seek64(file, w->offset) < 0) {
+    sftp_close(file);
+    close(fd);
+    return SSH_ERROR;
+  }
+  sftp_file_set_write_window(file, SFTP_PARALLEL_REQUESTS);
+
+  for (done = 0; done < w->len; done += r) {
+    n = sizeof(buf);
+    if (w->len - done < (uint64_t) n) {
+      n = (size_t) (w->len - done);
+    }
+    r = read(fd, buf, n);
+    if (r <= 0) {
+      break;
+    }
+    if (sftp_write(file, buf, (size_t) r) != r) {
+      close(fd);
+      sftp_close(file);
+      return SSH_ERROR;
+    }
+  }
+
+  close(fd);
+  /* sftp_close() waits for the outstanding write acks */
+  rc = sftp_close(file);
+
+  return (done == w->len && rc == SSH_NO_ERROR) ? SSH_OK : SSH_ERROR;
+}
+
+#ifdef HAVE_PTHREAD
+static void *sftp_parallel_thread(void *arg) {
+  struct sftp_parallel_worker_struct *w = arg;
+
+  w->rc = w->range_fn(w);
+
+  return NULL;
+}
+#endif
+
+/* Run every stripe, on its own thread when the platform has them. */
+static int sftp_parallel_run(struct sftp_parallel_worker_struct *workers,
+    int count) {
+  int rc = SSH_OK;
+  int i;
+#ifdef HAVE_PTHREAD
+  int spawned = 0;
+
+  for (i = 1; i < count; i++) {
+    if (pthread_create(&workers[i].thread, NULL, sftp_parallel_thread,
+          &workers[i]) != 0) {
+      break;
+    }
+    spawned++;
+  }
+  workers[0].rc = workers[0].range_fn(&workers[0]);
+  /* stripes whose thread did not start run here, after our own */
+  for (i = spawned + 1; i < count; i++) {
+    workers[i].rc = workers[i].range_fn(&workers[i]);
+  }
+  for (i = 1; i <= spawned; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+#else
+  for (i = 0; i < count; i++) {
+    workers[i].rc = workers[i].range_fn(&workers[i]);
+  }
+#endif
+
+  for (i = 0; i < count; i++) {
+    if (workers[i].rc != SSH_OK) {
+      rc = SSH_ERROR;
+    }
+  }
+
+  return rc;
+}
+
+static struct sftp_parallel_worker_struct *sftp_parallel_workers_new(
+    sftp_session *sftps, int *count, uint64_t size, const char *remotefile,
+    const char *localfile,
+    int (*range_fn)(struct sftp_parallel_worker_struct *worker)) {
+  struct sftp_parallel_worker_struct *workers;
+  uint64_t chunk;
+  int i;
+
+  /* no point in more streams than there is data to split */
+  while (*count > 1 && size / (uint64_t) *count < SFTP_PARALLEL_MIN_RANGE) {
+    (*count)--;
+  }
+
+  workers = calloc(*count, sizeof(struct sftp_parallel_worker_struct));
+  if (workers == NULL) {
+    ssh_set_error_oom(sftps[0]->session);
+    return NULL;
+  }
+
+  chunk = size / (uint64_t) *count;
+  for (i = 0; i < *count; i++) {
+    workers[i].sftp = sftps[i];
+    workers[i].remotefile = remotefile;
+    workers[i].localfile = localfile;
+    workers[i].offset = chunk * (uint64_t) i;
+    workers[i].len = (i == *count - 1) ? size - workers[i].offset : chunk;
+    workers[i].range_fn = range_fn;
+    workers[i].rc = SSH_ERROR;
+  }
+
+  return workers;
+}
+
+/**
+ * @brief Download a file over several sftp sessions at once.
+ *
+ * The remote file is split into one contiguous range per sftp session
+ * and the ranges are fetched in parallel, each stream writing straight
+ * into its slice of the local file. Sessions running over separate ssh
+ * connections additionally spread the cipher work, which is where the
+ * real multiplier is; on one connection the streams still share the
+ * transport.
+ *
+ * Each sftp session must not be used by anything else for the duration
+ * of the call. Without thread support the ranges are transferred one
+ * after the other, which stays correct but not faster.
+ *
+ * @param[in]  sftps      Array of initialized sftp sessions to spread
+ *                        the transfer over.
+ *
+ * @param[in]  count      How many sessions the array holds, at least 1.
+ *
+ * @param[in]  remotefile The file to download.
+ *
+ * @param[in]  localfile  The local path to write, created or truncated.
+ *
+ * @param[in]  mode       Permissions for the local file if it is created.
+ *
+ * @return                SSH_OK on success, SSH_ERROR if any range
+ *                        failed.
+ */
+int sftp_parallel_get(sftp_session *sftps, int count, const char *remotefile,
+    const char *localfile, mode_t mode) {
+  struct sftp_parallel_worker_struct *workers;
+  sftp_attributes attr;
+  uint64_t size;
+  int fd;
+  int i;
+  int rc;
+
+  if (sftps == NULL || count < 1 || remotefile == NULL || localfile == NULL) {
+    return SSH_ERROR;
+  }
+  for (i = 0; i < count; i++) {
+    if (sftps[i] == NULL) {
+      return SSH_ERROR;
+    }
+  }
+
+  attr = sftp_stat(sftps[0], remotefile);
+  if (attr == NULL) {
+    return SSH_ERROR;
+  }
+  size = attr->size;
+  sftp_attributes_free(attr);
+
+  fd = open(localfile, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  if (fd < 0) {
+    ssh_set_error(sftps[0]->session, SSH_REQUEST_DENIED,
+        "Error creating %s: %s", localfile, strerror(errno));
+    return SSH_ERROR;
+  }
+  close(fd);
+
+  if (size == 0) {
+    return SSH_OK;
+  }
+
+  workers = sftp_parallel_workers_new(sftps, &count, size, remotefile,
+      localfile, sftp_parallel_get_range);
+  if (workers == NULL) {
+    return SSH_ERROR;
+  }
+
+  rc = sftp_parallel_run(workers, count);
+  SAFE_FREE(workers);
+
+  return rc;
+}
+
+/**
+ * @brief Upload a file over several sftp sessions at once.
+ *
+ * The local file is split into one contiguous range per sftp session and
+ * the ranges are sent in parallel, each stream writing its slice of the
+ * remote file at the right offset. The same session rules as for
+ * sftp_parallel_get() apply.
+ *
+ * @param[in]  sftps      Array of initialized sftp sessions to spread
+ *                        the transfer over.
+ *
+ * @param[in]  count      How many sessions the array holds, at least 1.
+ *
+ * @param[in]  localfile  The file to upload.
+ *
+ * @param[in]  remotefile The remote path to write, created or truncated.
+ *
+ * @param[in]  mode       Permissions for the remote file if it is
+ *                        created.
+ *
+ * @return                SSH_OK on success, SSH_ERROR if any range
+ *                        failed.
+ */
+int sftp_parallel_put(sftp_session *sftps, int count, const char *localfile,
+    const char *remotefile, mode_t mode) {
+  struct sftp_parallel_worker_struct *workers;
+  struct stat st;
+  sftp_file file;
+  uint64_t size;
+  int i;
+  int rc;
+
+  if (sftps == NULL || count < 1 || remotefile == NULL || localfile == NULL) {
+    return SSH_ERROR;
+  }
+  for (i = 0; i < count; i++) {
+    if (sftps[i] == NULL) {
+      return SSH_ERROR;
+    }
+  }
+
+  if (stat(localfile, &st) < 0) {
+    ssh_set_error(sftps[0]->session, SSH_REQUEST_DENIED,
+        "Error opening %s: %s", localfile, strerror(errno));
+    return SSH_ERROR;
+  }
+  size = (uint64_t) st.st_size;
+
+  file = sftp_open(sftps[0], remotefile, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  if (file == NULL) {
+    return SSH_ERROR;
+  }
+  if (sftp_close(file) != SSH_NO_ERROR) {
+    return SSH_ERROR;
+  }
+
+  if (size == 0) {
+    return SSH_OK;
+  }
+
+  workers = sftp_parallel_workers_new(sftps, &count, size, remotefile,
+      localfile, sftp_parallel_put_range);
+  if (workers == NULL) {
+    return SSH_ERROR;
+  }
+
+  rc = sftp_parallel_run(workers, count);
+  SAFE_FREE(workers);
+
+  return rc;
+}
+
+#ifndef _WIN32
+/* write all of buf at offset, coping with partial writes */
+static int sftp_pwrite_all(int fd, const void *buf, size_t len,
+    uint64_t offset) {
+  size_t off;
+  ssize_t written;
+
+  for (off = 0; off < len; off += written) {
+    written = pwrite(fd, (const char *) buf + off, len - off,
+        (off_t) (offset + off));
+    if (written < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+/**
+ * @brief Download the rest of an open remote file straight to a local
+ * file descriptor.
+ *
+ * A window of read requests is kept in flight and every SSH_FXP_DATA
+ * payload is written with pwrite() at its remote offset directly from
+ * the parsed response, so nothing is staged in an intermediate buffer
+ * and responses may complete in any order. Local and remote offsets
+ * coincide: the transfer starts at the current file position (see
+ * sftp_seek64()) and writes at the same positions in fd.
+ *
+ * @param[in]  file     The open remote file to read.
+ *
+ * @param[in]  fd       A local file descriptor open for writing.
+ *
+ * @return              The number of bytes transferred, SSH_ERROR on
+ *                      error.
+ */
+ssize_t sftp_get_to_fd(sftp_file file, int fd) {
+#ifdef _WIN32
+  if (file != NULL) {
+    ssh_set_error(file->sftp->session, SSH_REQUEST_DENIED,
+        "sftp_get_to_fd() is not supported on this platform");
+  }
+  (void) fd;
+  return SSH_ERROR;
+#else
+  struct {
+    uint32_t id;
+    uint64_t offset;
+    uint32_t len;
+  } req[SFTP_PARALLEL_REQUESTS];
+  sftp_session sftp;
+  sftp_message msg;
+  sftp_status_message status;
+  ssh_string datastring;
+  ssh_buffer buffer;
+  uint64_t next_offset;
+  uint64_t total = 0;
+  uint32_t chunk;
+  int head = 0;
+  int tail = 0;
+  int count = 0;
+  int eof = 0;
+
+  if (file == NULL || fd < 0) {
+    return SSH_ERROR;
+  }
+  sftp = file->sftp;
+  chunk = sftp_read_chunk_size(sftp);
+  next_offset = file->offset;
+
+  while (!eof || count > 0) {
+    /* keep the request window full */
+    while (!eof && count < SFTP_PARALLEL_REQUESTS) {
+      uint32_t id = sftp_get_new_id(sftp);
+
+      buffer = ssh_buffer_new();
+      if (buffer == NULL) {
+        ssh_set_error_oom(sftp->session);
+        return SSH_ERROR;
+      }
+      if (buffer_add_u32(buffer, id) < 0 ||
+          buffer_add_ssh_string(buffer, file->handle) < 0 ||
+          buffer_add_u64(buffer, htonll(next_offset)) < 0 ||
+          buffer_add_u32(buffer, htonl(chunk)) < 0 ||
+          sftp_packet_write(sftp, SSH_FXP_READ, buffer) < 0) {
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+      }
+      ssh_buffer_free(buffer);
+
+      req[tail].id = id;
+      req[tail].offset = next_offset;
+      req[tail].len = chunk;
+      tail = (tail + 1) % SFTP_PARALLEL_REQUESTS;
+      count++;
+      next_offset += chunk;
+    }
+
+    msg = sftp_dequeue(sftp, req[head].id);
+    while (msg == NULL) {
+      if (sftp_read_and_dispatch(sftp) < 0) {
+        return SSH_ERROR;
+      }
+      msg = sftp_dequeue(sftp, req[head].id);
+    }
+
+    if (msg->packet_type == SSH_FXP_STATUS) {
+      status = parse_status_msg(msg);
+      sftp_message_free(msg);
+      if (status == NULL) {
+        return SSH_ERROR;
+      }
+      sftp_set_error(sftp, status->status);
+      if (status->status != SSH_FX_EOF) {
+        ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+            "SFTP server: %s", status->errormsg);
+        status_msg_free(status);
+        return SSH_ERROR;
+      }
+      status_msg_free(status);
+      eof = 1;
+    } else if (msg->packet_type == SSH_FXP_DATA) {
+      uint32_t len;
+
+      datastring = buffer_get_ssh_string(msg->payload);
+      if (datastring == NULL) {
+        ssh_set_error(sftp->session, SSH_FATAL,
+            "Received invalid DATA packet from sftp server");
+        sftp_message_free(msg);
+        return SSH_ERROR;
+      }
+      len = ssh_string_len(datastring);
+      if (!eof &&
+          sftp_pwrite_all(fd, ssh_string_data(datastring), len,
+              req[head].offset) < 0) {
+        ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+            "Error writing to fd %d: %s", fd, strerror(errno));
+        ssh_string_free(datastring);
+        sftp_message_free(msg);
+        return SSH_ERROR;
+      }
+      if (!eof) {
+        total += len;
+      }
+      if (len < req[head].len && !eof) {
+        /* short read before EOF: the requests in flight were issued
+         * past the gap, drain them and restart just after the data */
+        uint64_t resync = req[head].offset + len;
+        int i;
+
+        ssh_string_free(datastring);
+        sftp_message_free(msg);
+        for (i = (head + 1) % SFTP_PARALLEL_REQUESTS; count > 1;
+             i = (i + 1) % SFTP_PARALLEL_REQUESTS, count--) {
+          msg = sftp_dequeue(sftp, req[i].id);
+          while (msg == NULL) {
+            if (sftp_read_and_dispatch(sftp) < 0) {
+              return SSH_ERROR;
+            }
+            msg = sftp_dequeue(sftp, req[i].id);
+          }
+          sftp_message_free(msg);
+        }
+        head = 0;
+        tail = 0;
+        count = 0;
+        next_offset = resync;
+        continue;
+      }
+      ssh_string_free(datastring);
+      sftp_message_free(msg);
+    } else {
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Received message %d during read", msg->packet_type);
+      sftp_message_free(msg);
+      return SSH_ERROR;
+    }
+
+    head = (head + 1) % SFTP_PARALLEL_REQUESTS;
+    count--;
+  }
+
+  file->offset += total;
+  file->eof = 1;
+
+  return (ssize_t) total;
+#endif /* _WIN32 */
+}
+
 #endif /* WITH_SFTP */
 /* vim: set ts=2 sw=2 et cindent: */
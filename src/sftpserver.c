@@ -27,6 +27,8 @@
 
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #include "libssh/libssh.h"
@@ -36,26 +38,173 @@
 #include "libssh/buffer.h"
 #include "libssh/misc.h"
 
+/*
+ * Per-type request decoders, driven by the dispatch table below. Each
+ * decoder consumes the payload of one request into msg and returns 0,
+ * or -1 on a short or unparsable packet.
+ */
+static int sftp_decode_handle(sftp_client_message msg, ssh_buffer payload) {
+  msg->handle = sftp_arena_get_string(msg->arena, payload);
+  if (msg->handle == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_read(sftp_client_message msg, ssh_buffer payload) {
+  if (sftp_decode_handle(msg, payload) < 0) {
+    return -1;
+  }
+  buffer_get_u64(payload, &msg->offset);
+  buffer_get_u32(payload, &msg->len);
+
+  return 0;
+}
+
+static int sftp_decode_write(sftp_client_message msg, ssh_buffer payload) {
+  if (sftp_decode_handle(msg, payload) < 0) {
+    return -1;
+  }
+  buffer_get_u64(payload, &msg->offset);
+  msg->data = sftp_arena_get_string(msg->arena, payload);
+  if (msg->data == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_filename(sftp_client_message msg, ssh_buffer payload) {
+  msg->filename = sftp_arena_get_string_char(msg->arena, payload);
+  if (msg->filename == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_filename_data(sftp_client_message msg,
+    ssh_buffer payload) {
+  if (sftp_decode_filename(msg, payload) < 0) {
+    return -1;
+  }
+  msg->data = sftp_arena_get_string(msg->arena, payload);
+  if (msg->data == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_filename_attr(sftp_client_message msg,
+    ssh_buffer payload) {
+  if (sftp_decode_filename(msg, payload) < 0) {
+    return -1;
+  }
+  msg->attr = sftp_parse_attr(msg->sftp, payload, 0);
+  if (msg->attr == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_handle_attr(sftp_client_message msg,
+    ssh_buffer payload) {
+  if (sftp_decode_handle(msg, payload) < 0) {
+    return -1;
+  }
+  msg->attr = sftp_parse_attr(msg->sftp, payload, 0);
+  if (msg->attr == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_stat(sftp_client_message msg, ssh_buffer payload) {
+  if (sftp_decode_filename(msg, payload) < 0) {
+    return -1;
+  }
+  if (msg->sftp->version > 3) {
+    buffer_get_u32(payload, &msg->flags);
+  }
+
+  return 0;
+}
+
+static int sftp_decode_open(sftp_client_message msg, ssh_buffer payload) {
+  if (sftp_decode_filename(msg, payload) < 0) {
+    return -1;
+  }
+  buffer_get_u32(payload, &msg->flags);
+  msg->attr = sftp_parse_attr(msg->sftp, payload, 0);
+  if (msg->attr == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sftp_decode_fstat(sftp_client_message msg, ssh_buffer payload) {
+  if (sftp_decode_handle(msg, payload) < 0) {
+    return -1;
+  }
+  buffer_get_u32(payload, &msg->flags);
+
+  return 0;
+}
+
+static const struct sftp_request_decoder {
+  uint8_t type;
+  int (*decode)(sftp_client_message msg, ssh_buffer payload);
+} client_message_decoders[] = {
+  {SSH_FXP_CLOSE,    sftp_decode_handle},
+  {SSH_FXP_READDIR,  sftp_decode_handle},
+  {SSH_FXP_READ,     sftp_decode_read},
+  {SSH_FXP_WRITE,    sftp_decode_write},
+  {SSH_FXP_REMOVE,   sftp_decode_filename},
+  {SSH_FXP_RMDIR,    sftp_decode_filename},
+  {SSH_FXP_OPENDIR,  sftp_decode_filename},
+  {SSH_FXP_READLINK, sftp_decode_filename},
+  {SSH_FXP_REALPATH, sftp_decode_filename},
+  {SSH_FXP_RENAME,   sftp_decode_filename_data},
+  {SSH_FXP_SYMLINK,  sftp_decode_filename_data},
+  {SSH_FXP_MKDIR,    sftp_decode_filename_attr},
+  {SSH_FXP_SETSTAT,  sftp_decode_filename_attr},
+  {SSH_FXP_FSETSTAT, sftp_decode_handle_attr},
+  {SSH_FXP_LSTAT,    sftp_decode_stat},
+  {SSH_FXP_STAT,     sftp_decode_stat},
+  {SSH_FXP_OPEN,     sftp_decode_open},
+  {SSH_FXP_FSTAT,    sftp_decode_fstat},
+};
+
 sftp_client_message sftp_get_client_message(sftp_session sftp) {
   ssh_session session = sftp->session;
   sftp_packet packet;
   sftp_client_message msg;
+  sftp_arena arena;
   ssh_buffer payload;
-  ssh_string tmp;
 
-  msg = malloc(sizeof (struct sftp_client_message_struct));
-  if (msg == NULL) {
+  packet = sftp_packet_read(sftp);
+  if (packet == NULL) {
     ssh_set_error_oom(session);
     return NULL;
   }
-  ZERO_STRUCTP(msg);
 
-  packet = sftp_packet_read(sftp);
-  if (packet == NULL) {
+  /* the struct, filename, handle and data are disjoint slices of the
+   * payload, one block twice its size holds all of them */
+  arena = sftp_arena_new(sizeof(struct sftp_client_message_struct) +
+      2 * (size_t) buffer_get_rest_len(packet->payload) + 64);
+  if (arena == NULL) {
     ssh_set_error_oom(session);
-    sftp_client_message_free(msg);
+    sftp_packet_free(packet);
     return NULL;
   }
+  msg = sftp_arena_alloc(arena, sizeof(struct sftp_client_message_struct));
+  ZERO_STRUCTP(msg);
+  msg->arena = arena;
 
   payload = packet->payload;
   msg->type = packet->type;
@@ -63,172 +212,30 @@ sftp_client_message sftp_get_client_message(sftp_session sftp) {
 
   buffer_get_u32(payload, &msg->id);
 
-  switch(msg->type) {
-    case SSH_FXP_CLOSE:
-    case SSH_FXP_READDIR:
-      msg->handle = buffer_get_ssh_string(payload);
-      if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      break;
-    case SSH_FXP_READ:
-      msg->handle = buffer_get_ssh_string(payload);
-      if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      buffer_get_u64(payload, &msg->offset);
-      buffer_get_u32(payload, &msg->len);
-      break;
-    case SSH_FXP_WRITE:
-      msg->handle = buffer_get_ssh_string(payload);
-      if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      buffer_get_u64(payload, &msg->offset);
-      msg->data = buffer_get_ssh_string(payload);
-      if (msg->data == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      break;
-    case SSH_FXP_REMOVE:
-    case SSH_FXP_RMDIR:
-    case SSH_FXP_OPENDIR:
-    case SSH_FXP_READLINK:
-    case SSH_FXP_REALPATH:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
-      if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      break;
-    case SSH_FXP_RENAME:
-    case SSH_FXP_SYMLINK:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
-      if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->data = buffer_get_ssh_string(payload);
-      if (msg->data == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      break;
-    case SSH_FXP_MKDIR:
-    case SSH_FXP_SETSTAT:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename=ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
-      if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->attr = sftp_parse_attr(sftp, payload, 0);
-      if (msg->attr == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      break;
-    case SSH_FXP_FSETSTAT:
-      msg->handle = buffer_get_ssh_string(payload);
-      if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->attr = sftp_parse_attr(sftp, payload, 0);
-      if (msg->attr == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      break;
-    case SSH_FXP_LSTAT:
-    case SSH_FXP_STAT:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
-      if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      if(sftp->version > 3) {
-        buffer_get_u32(payload,&msg->flags);
-      }
-      break;
-    case SSH_FXP_OPEN:
-      tmp=buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
-      if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      buffer_get_u32(payload,&msg->flags);
-      msg->attr = sftp_parse_attr(sftp, payload, 0);
-      if (msg->attr == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-    case SSH_FXP_FSTAT:
-      msg->handle = buffer_get_ssh_string(payload);
-      if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+  {
+    const struct sftp_request_decoder *decoder = NULL;
+    size_t i;
+
+    for (i = 0; i < sizeof(client_message_decoders) /
+        sizeof(client_message_decoders[0]); i++) {
+      if (client_message_decoders[i].type == msg->type) {
+        decoder = &client_message_decoders[i];
+        break;
       }
-      buffer_get_u32(payload, &msg->flags);
-      break;
-    default:
+    }
+    if (decoder == NULL) {
       ssh_set_error(sftp->session, SSH_FATAL,
                     "Received unhandled sftp message %d\n", msg->type);
+      sftp_packet_free(packet);
       sftp_client_message_free(msg);
       return NULL;
+    }
+    if (decoder->decode(msg, payload) < 0) {
+      ssh_set_error_oom(session);
+      sftp_packet_free(packet);
+      sftp_client_message_free(msg);
+      return NULL;
+    }
   }
 
   msg->flags = ntohl(msg->flags);
@@ -240,14 +247,25 @@ sftp_client_message sftp_get_client_message(sftp_session sftp) {
 }
 
 void sftp_client_message_free(sftp_client_message msg) {
+  sftp_arena arena;
+
   if (msg == NULL) {
     return;
   }
 
+  sftp_attributes_free(msg->attr);
+
+  if (msg->arena != NULL) {
+    /* filename, handle and data live in the same block as msg */
+    arena = msg->arena;
+    ZERO_STRUCTP(msg);
+    SAFE_FREE(arena);
+    return;
+  }
+
   SAFE_FREE(msg->filename);
   ssh_string_free(msg->data);
   ssh_string_free(msg->handle);
-  sftp_attributes_free(msg->attr);
 
   ZERO_STRUCTP(msg);
   SAFE_FREE(msg);
@@ -441,6 +459,89 @@ int sftp_reply_data(sftp_client_message msg, const void *data, int len) {
   return 0;
 }
 
+/* how far ahead of a sequential reader the kernel is asked to fetch */
+#define SFTP_SERVER_READAHEAD (256 * 1024)
+
+/* When a client walks a file with back to back SSH_FXP_READ requests,
+ * ask the kernel to pull the next stretch into the page cache while the
+ * current reply is encrypted and sent. */
+static void sftp_read_fd_advise(sftp_session sftp, int fd, uint64_t offset,
+    uint32_t len) {
+#if defined(POSIX_FADV_WILLNEED) && !defined(_WIN32)
+  if (fd == sftp->read_fd && offset == sftp->read_next_offset) {
+    posix_fadvise(fd, (off_t) (offset + len), SFTP_SERVER_READAHEAD,
+        POSIX_FADV_WILLNEED);
+  }
+#endif
+  sftp->read_fd = fd;
+  sftp->read_next_offset = offset + (uint64_t) len;
+}
+
+int sftp_reply_data_fd(sftp_client_message msg, int fd, uint64_t offset,
+    uint32_t len) {
+  ssh_buffer out;
+  char *payload;
+  uint32_t done;
+  uint32_t field;
+  ssize_t r;
+
+  out = ssh_buffer_new();
+  if (out == NULL) {
+    return -1;
+  }
+
+  /* id, length and file bytes are assembled in place; the length is
+   * patched afterwards in case the file ends short of the request */
+  payload = buffer_allocate(out, 8 + len);
+  if (payload == NULL) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+
+  for (done = 0; done < len; done += (uint32_t) r) {
+#ifndef _WIN32
+    r = pread(fd, payload + 8 + done, len - done, (off_t) (offset + done));
+#else
+    if (lseek(fd, (off_t) (offset + done), SEEK_SET) == (off_t) -1) {
+      r = -1;
+    } else {
+      r = read(fd, payload + 8 + done, len - done);
+    }
+#endif
+    if (r < 0) {
+      ssh_buffer_free(out);
+      return -1;
+    }
+    if (r == 0) {
+      break;
+    }
+  }
+
+  if (done == 0) {
+    /* end of file before the first byte, nothing to send */
+    ssh_buffer_free(out);
+    return 0;
+  }
+
+  memcpy(payload, &msg->id, sizeof(uint32_t));
+  field = htonl(done);
+  memcpy(payload + 4, &field, sizeof(uint32_t));
+  if (done < len && buffer_chop(out, len - done) < 0) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+
+  if (sftp_packet_write(msg->sftp, SSH_FXP_DATA, out) < 0) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+  ssh_buffer_free(out);
+
+  sftp_read_fd_advise(msg->sftp, fd, offset, done);
+
+  return (int) done;
+}
+
 /*
  * This function will return you a new handle to give the client.
  * the function accepts an info that can be retrieved later with
@@ -41,12 +41,21 @@
 #endif /* _MSC_VER */
 #else /* _WIN32 */
 #include <fcntl.h>
+#include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif /* _WIN32 */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "libssh/priv.h"
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #include "libssh/callbacks.h"
 #include "libssh/socket.h"
 #include "libssh/buffer.h"
@@ -89,13 +98,78 @@ struct ssh_socket_struct {
   ssh_socket_callbacks callbacks;
   ssh_poll_handle poll_in;
   ssh_poll_handle poll_out;
+  /* connect racing state, see ssh_socket_connect() */
+  struct addrinfo *connect_ai;
+  struct addrinfo *connect_next;
+  struct addrinfo *race_ai;
+  char *connect_bind_addr;
+  int connect_family;
+  socket_t race_fd;
+  ssh_poll_handle race_poll;
+  /* adaptive read sizing, see ssh_socket_set_read_hint() */
+  uint32_t read_hint;
+  uint32_t read_chunk;
+  /* in-process loopback transport, NULL for a real fd, see
+   * ssh_socket_loopback_attach() */
+  struct ssh_loopback_pair_struct *loop;
+  int loop_side;
+  /* cached TCP_MAXSEG, 0 before the first ssh_socket_get_mss() */
+  int mss;
 };
 
+/* bounds for one recv() into in_buffer; the chunk grows towards the
+ * maximum while reads keep coming back full and snaps back when the
+ * flow dries up */
+#define SSH_SOCKET_READ_MIN 4096
+#define SSH_SOCKET_READ_MAX 65536
+
+/* a corked session flushes its buffered packets once this much piled
+ * up even without an explicit ssh_session_flush() */
+#define SSH_SOCKET_CORK_THRESHOLD 32768
+
 static int sockets_initialized = 0;
 
+/* One direction of an in-process loopback transport: the bytes one side
+ * wrote and the other has not read yet. The doorbell pipe only exists so
+ * the regular poll machinery has a file descriptor to sleep on: one byte
+ * is written when the ring goes from empty to non-empty (and once more
+ * on EOF) and read back once the ring has been drained, so POLLIN on the
+ * doorbell read end mirrors "data or EOF pending". */
+struct ssh_loopback_half_struct {
+  ssh_buffer ring;
+  int eof;
+  socket_t doorbell[2];
+};
+
+struct ssh_loopback_pair_struct {
+  /* half[i] carries the bytes written by side i */
+  struct ssh_loopback_half_struct half[2];
+  /* one reference per attached socket */
+  int refcount;
+#ifdef HAVE_PTHREAD
+  /* the two sessions of a pair usually run in different threads */
+  pthread_mutex_t mutex;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+#define loopback_lock(pair) pthread_mutex_lock(&(pair)->mutex)
+#define loopback_unlock(pair) pthread_mutex_unlock(&(pair)->mutex)
+#else
+#define loopback_lock(pair) do { } while(0)
+#define loopback_unlock(pair) do { } while(0)
+#endif
+
 static int ssh_socket_unbuffered_read(ssh_socket s, void *buffer, uint32_t len);
 static int ssh_socket_unbuffered_write(ssh_socket s, const void *buffer,
 		uint32_t len);
+#ifndef _WIN32
+static void ssh_socket_loopback_detach(ssh_socket s);
+#endif
+static void ssh_socket_connect_cleanup(ssh_socket s);
+static void ssh_socket_connect_race_start(ssh_socket s);
+static void ssh_socket_connect_race_stop(ssh_socket s);
+static int ssh_socket_connect_fallback(ssh_socket s, ssh_poll_handle p);
 
 /**
  * \internal
@@ -169,6 +243,18 @@ ssh_socket ssh_socket_new(ssh_session session) {
   s->data_except = 0;
   s->poll_in=s->poll_out=NULL;
   s->state=SSH_SOCKET_NONE;
+  s->connect_ai = NULL;
+  s->connect_next = NULL;
+  s->race_ai = NULL;
+  s->connect_bind_addr = NULL;
+  s->connect_family = 0;
+  s->race_fd = SSH_INVALID_SOCKET;
+  s->race_poll = NULL;
+  s->read_hint = 0;
+  s->read_chunk = SSH_SOCKET_READ_MIN;
+  s->loop = NULL;
+  s->loop_side = 0;
+  s->mss = 0;
   return s;
 }
 
@@ -178,6 +264,12 @@ ssh_socket ssh_socket_new(ssh_session session) {
  * @param[in] s socket to rest
  */
 void ssh_socket_reset(ssh_socket s){
+  ssh_socket_connect_cleanup(s);
+#ifndef _WIN32
+  if (s->loop != NULL) {
+    ssh_socket_loopback_detach(s);
+  }
+#endif
   s->fd_in = SSH_INVALID_SOCKET;
   s->fd_out= SSH_INVALID_SOCKET;
   s->last_errno = -1;
@@ -189,6 +281,7 @@ void ssh_socket_reset(ssh_socket s){
   s->data_except = 0;
   s->poll_in=s->poll_out=NULL;
   s->state=SSH_SOCKET_NONE;
+  s->mss = 0;
 }
 
 /**
@@ -203,6 +296,192 @@ void ssh_socket_set_callbacks(ssh_socket s, ssh_socket_callbacks callbacks){
 	s->callbacks=callbacks;
 }
 
+static void ssh_socket_fd_close(socket_t fd) {
+#ifdef _WIN32
+  closesocket(fd);
+#else
+  close(fd);
+#endif
+}
+
+/*
+ * Racing connect ("happy eyeballs"):
+ *
+ * ssh_socket_connect() starts a nonblocking connect to the first resolved
+ * address and, when the host also resolved to an address of another family,
+ * races a second connect against it. Whichever attempt completes first is
+ * adopted and the loser is closed, so a blackholed route on one address
+ * family costs nothing instead of a full connect timeout. An attempt that
+ * fails outright is replaced by the next address of the resolved list.
+ */
+
+static int ssh_socket_race_callback(ssh_poll_handle p, socket_t fd,
+    int revents, void *v_s);
+
+/** @internal
+ * @brief Releases the state tracking an ongoing connect.
+ */
+static void ssh_socket_connect_cleanup(ssh_socket s) {
+  ssh_socket_connect_race_stop(s);
+  if (s->connect_ai != NULL) {
+    freeaddrinfo(s->connect_ai);
+    s->connect_ai = NULL;
+  }
+  s->connect_next = NULL;
+  s->race_ai = NULL;
+  SAFE_FREE(s->connect_bind_addr);
+}
+
+/** @internal
+ * @brief Starts a racing connect to the first address whose family differs
+ * from the primary attempt, if the host resolved to one.
+ */
+static void ssh_socket_connect_race_start(ssh_socket s) {
+  struct addrinfo *itr;
+  socket_t fd;
+
+  if (s->race_poll != NULL) {
+    return;
+  }
+  for (itr = s->connect_next; itr != NULL; itr = itr->ai_next) {
+    if (itr->ai_family != s->connect_family) {
+      break;
+    }
+  }
+  if (itr == NULL) {
+    return;
+  }
+
+  fd = ssh_connect_ai_nonblocking(s->session, itr, s->connect_bind_addr);
+  if (fd == SSH_INVALID_SOCKET) {
+    return;
+  }
+  s->race_poll = ssh_poll_new(fd, POLLOUT, ssh_socket_race_callback, s);
+  if (s->race_poll == NULL) {
+    ssh_socket_fd_close(fd);
+    return;
+  }
+  s->race_fd = fd;
+  s->race_ai = itr;
+  ssh_log(s->session, SSH_LOG_PROTOCOL,
+      "Racing a second connection attempt on another address family");
+}
+
+/** @internal
+ * @brief Closes the racing connection attempt, if any.
+ */
+static void ssh_socket_connect_race_stop(ssh_socket s) {
+  if (s->race_poll != NULL) {
+    ssh_poll_free(s->race_poll);
+    s->race_poll = NULL;
+  }
+  if (s->race_fd != SSH_INVALID_SOCKET) {
+    ssh_socket_fd_close(s->race_fd);
+    s->race_fd = SSH_INVALID_SOCKET;
+  }
+}
+
+/** @internal
+ * @brief Replaces a failed primary connect by an attempt to the next
+ * resolved address, or adopts the still pending racing attempt.
+ * @returns 0 if another attempt is in progress, -1 if out of addresses.
+ */
+static int ssh_socket_connect_fallback(ssh_socket s, ssh_poll_handle p) {
+  struct addrinfo *itr;
+  socket_t oldfd = s->fd_in;
+  socket_t fd = SSH_INVALID_SOCKET;
+
+  for (itr = s->connect_next; itr != NULL; itr = itr->ai_next) {
+    if (itr == s->race_ai) {
+      /* the racing attempt already has this one */
+      continue;
+    }
+    fd = ssh_connect_ai_nonblocking(s->session, itr, s->connect_bind_addr);
+    if (fd != SSH_INVALID_SOCKET) {
+      break;
+    }
+  }
+
+  if (itr != NULL) {
+    s->connect_family = itr->ai_family;
+    s->connect_next = itr->ai_next;
+  } else if (s->race_poll != NULL) {
+    /* out of fresh addresses, hand the racing attempt over to the main
+     * poll handle and keep waiting for it */
+    fd = s->race_fd;
+    s->race_fd = SSH_INVALID_SOCKET;
+    ssh_poll_free(s->race_poll);
+    s->race_poll = NULL;
+    s->connect_family = s->race_ai->ai_family;
+    s->connect_next = s->race_ai->ai_next;
+    s->race_ai = NULL;
+  } else {
+    return -1;
+  }
+
+  s->fd_in = s->fd_out = fd;
+  if (p != NULL) {
+    ssh_poll_set_fd(p, fd);
+  }
+  if (oldfd != SSH_INVALID_SOCKET) {
+    ssh_socket_fd_close(oldfd);
+  }
+  ssh_log(s->session, SSH_LOG_PROTOCOL,
+      "Connection attempt failed, waiting on the next address");
+  return 0;
+}
+
+/** @internal
+ * @brief Poll callback of the racing connection attempt.
+ */
+static int ssh_socket_race_callback(ssh_poll_handle p, socket_t fd,
+    int revents, void *v_s) {
+  ssh_socket s = (ssh_socket) v_s;
+  socket_t oldfd = s->fd_in;
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  (void) revents;
+
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *) &err, &errlen);
+  s->race_poll = NULL;
+  s->race_fd = SSH_INVALID_SOCKET;
+  s->race_ai = NULL;
+  ssh_poll_free(p);
+  if (s->state != SSH_SOCKET_CONNECTING || err != 0) {
+    /* the primary attempt already decided, or this one failed: drop it */
+    ssh_socket_fd_close(fd);
+    return -1;
+  }
+
+  /* the secondary attempt won, adopt its fd on the main poll handle */
+  ssh_log(s->session, SSH_LOG_PROTOCOL,
+      "Secondary connection attempt completed first, adopting it");
+  s->fd_in = s->fd_out = fd;
+  if (s->poll_in != NULL) {
+    ssh_poll_set_fd(s->poll_in, fd);
+    ssh_poll_set_events(s->poll_in, POLLOUT | POLLIN);
+  }
+  if (oldfd != SSH_INVALID_SOCKET) {
+    ssh_socket_fd_close(oldfd);
+  }
+  ssh_socket_set_tcp_options(s);
+  s->state = SSH_SOCKET_CONNECTED;
+  ssh_sock_set_blocking(fd);
+  ssh_socket_connect_cleanup(s);
+  if (s->callbacks && s->callbacks->connected) {
+    s->callbacks->connected(SSH_SOCKET_CONNECTED_OK, 0, s->callbacks->userdata);
+  }
+  return -1;
+}
+
+/** @internal
+ * @brief returns the poll handle of the racing connection attempt, if any.
+ */
+ssh_poll_handle ssh_socket_get_race_poll(ssh_socket s) {
+  return s->race_poll;
+}
+
 /**
  * @brief 							SSH poll callback. This callback will be used when an event
  *                      caught on the socket.
@@ -218,7 +497,6 @@ void ssh_socket_set_callbacks(ssh_socket s, ssh_socket_callbacks callbacks){
  */
 int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int revents, void *v_s){
 	ssh_socket s=(ssh_socket )v_s;
-	char buffer[4096];
 	int r;
 	int err=0;
 	socklen_t errlen=sizeof(err);
@@ -229,6 +507,9 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 	if(revents & POLLERR || revents & POLLHUP){
 		/* Check if we are in a connecting state */
 		if(s->state==SSH_SOCKET_CONNECTING){
+			/* try the remaining resolved addresses before giving up */
+			if(ssh_socket_connect_fallback(s,p)==0)
+				return 0;
 			s->state=SSH_SOCKET_ERROR;
 			getsockopt(fd,SOL_SOCKET,SO_ERROR,(char *)&err,&errlen);
 			s->last_errno=err;
@@ -243,8 +524,33 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 		revents |= POLLIN;
 	}
 	if(revents & POLLIN){
+		uint32_t to_read;
+		void *dst;
+
 		s->read_wontblock=1;
-		r=ssh_socket_unbuffered_read(s,buffer,sizeof(buffer));
+		/* recv straight into in_buffer, sized by the packet layer's hint
+		 * of what it is still missing and the adaptive bulk chunk */
+		to_read = s->read_chunk;
+		if (s->read_hint > to_read) {
+			to_read = s->read_hint;
+		}
+		if (to_read > SSH_SOCKET_READ_MAX) {
+			to_read = SSH_SOCKET_READ_MAX;
+		}
+		dst = buffer_allocate(s->in_buffer, to_read);
+		if (dst == NULL) {
+			return -1;
+		}
+		r=ssh_socket_unbuffered_read(s,dst,to_read);
+		buffer_chop(s->in_buffer, r > 0 ? to_read - (uint32_t) r : to_read);
+		if (r == (int) to_read) {
+			if (s->read_chunk < SSH_SOCKET_READ_MAX) {
+				s->read_chunk *= 2;
+			}
+		} else if (r >= 0) {
+			s->read_chunk = SSH_SOCKET_READ_MIN;
+		}
+		s->read_hint = 0;
 		if(r<0){
             if(p != NULL) {
                 ssh_poll_remove_events(p, POLLIN);
@@ -275,8 +581,7 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 			}
 		}
 		if(r>0){
-			/* Bufferize the data and then call the callback */
-			buffer_add_data(s->in_buffer,buffer,r);
+			/* the data already sits in in_buffer, hand it to the callback */
 			if(s->callbacks && s->callbacks->data){
 				r= s->callbacks->data(buffer_get_rest(s->in_buffer),
 						buffer_get_rest_len(s->in_buffer),
@@ -296,9 +601,11 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 		/* First, POLLOUT is a sign we may be connected */
 		if(s->state == SSH_SOCKET_CONNECTING){
 			ssh_log(s->session,SSH_LOG_PACKET,"Received POLLOUT in connecting state");
+			ssh_socket_set_tcp_options(s);
 			s->state = SSH_SOCKET_CONNECTED;
 			ssh_poll_set_events(p,POLLOUT | POLLIN);
 			ssh_sock_set_blocking(ssh_socket_get_fd_in(s));
+			ssh_socket_connect_cleanup(s);
 			if(s->callbacks && s->callbacks->connected)
 				s->callbacks->connected(SSH_SOCKET_CONNECTED_OK,0,s->callbacks->userdata);
 			return 0;
@@ -402,6 +709,12 @@ int ssh_socket_unix(ssh_socket s, const char *path) {
  * \brief closes a socket
  */
 void ssh_socket_close(ssh_socket s){
+  ssh_socket_connect_cleanup(s);
+#ifndef _WIN32
+  if (s->loop != NULL) {
+    ssh_socket_loopback_detach(s);
+  }
+#endif
   if (ssh_socket_is_open(s)) {
 #ifdef _WIN32
     closesocket(s->fd_in);
@@ -435,10 +748,95 @@ void ssh_socket_close(ssh_socket s){
  * @warning this function updates boths the input and output
  * file descriptors
  */
+/** @internal
+ * @brief applies the session's TCP tuning options to the socket
+ *
+ * Called once the fd is known, from ssh_socket_set_fd() and the
+ * connect completion paths. Failures are ignored on purpose: the
+ * options are best effort and the fd may not be a TCP socket at all
+ * (ProxyCommand pipes, unix domain sockets).
+ */
+void ssh_socket_set_tcp_options(ssh_socket s) {
+  ssh_session session = s->session;
+  socket_t fd = s->fd_out;
+
+  if (fd == SSH_INVALID_SOCKET || s->fd_is_socket == 0 || session == NULL) {
+    return;
+  }
+
+  if (session->tcp_nodelay >= 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+        (char *) &session->tcp_nodelay, sizeof(int));
+  }
+  if (session->tcp_keepalive >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE,
+        (char *) &session->tcp_keepalive, sizeof(int));
+  }
+#ifdef TCP_QUICKACK
+  if (session->tcp_quickack >= 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK,
+        (char *) &session->tcp_quickack, sizeof(int));
+  }
+#endif
+  if (session->tcp_sndbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+        (char *) &session->tcp_sndbuf, sizeof(int));
+  }
+#ifdef IP_TOS
+  if (session->ip_tos >= 0) {
+    /* DSCP/TOS marking so the network can treat interactive and bulk
+     * connections differently */
+    setsockopt(fd, IPPROTO_IP, IP_TOS,
+        (char *) &session->ip_tos, sizeof(int));
+  }
+#endif
+  if (session->tcp_rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+        (char *) &session->tcp_rcvbuf, sizeof(int));
+  }
+}
+
+/** @internal
+ * @brief returns the TCP maximum segment size of the connection
+ *
+ * Queried once per connection and cached; the value only settles after
+ * the TCP handshake, which is why this is not done when the options are
+ * applied.
+ *
+ * @return The segment size in bytes, 0 when unknown or not TCP.
+ */
+int ssh_socket_get_mss(ssh_socket s) {
+#if defined(TCP_MAXSEG) && !defined(_WIN32)
+  socklen_t len = sizeof(int);
+  int mss;
+
+  if (s->mss != 0) {
+    return s->mss > 0 ? s->mss : 0;
+  }
+  if (s->fd_out == SSH_INVALID_SOCKET || s->fd_is_socket == 0) {
+    return 0;
+  }
+  if (getsockopt(s->fd_out, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) < 0 ||
+      mss <= 0) {
+    /* remember the failure, not a TCP socket */
+    s->mss = -1;
+    return 0;
+  }
+  s->mss = mss;
+
+  return mss;
+#else
+  (void) s;
+
+  return 0;
+#endif
+}
+
 void ssh_socket_set_fd(ssh_socket s, socket_t fd) {
   s->fd_in = s->fd_out = fd;
   if(s->poll_in)
   	ssh_poll_set_fd(s->poll_in,fd);
+  ssh_socket_set_tcp_options(s);
 }
 
 /**
@@ -481,6 +879,239 @@ int ssh_socket_is_open(ssh_socket s) {
   return s->fd_in != SSH_INVALID_SOCKET;
 }
 
+#ifndef _WIN32
+/** @internal
+ * @brief allocates a loopback transport pair
+ *
+ * A pair connects two sockets living in the same process without any
+ * TCP or socketpair in between: each direction is an unbounded ring
+ * buffer plus a doorbell pipe the reader's poll loop sleeps on. Both
+ * endpoints are attached with ssh_socket_loopback_attach(); the pair
+ * frees itself once the last endpoint detaches.
+ *
+ * @returns an allocated pair, NULL on error.
+ */
+ssh_loopback_pair ssh_loopback_pair_new(void) {
+  ssh_loopback_pair pair;
+  int i;
+
+  pair = malloc(sizeof(struct ssh_loopback_pair_struct));
+  if (pair == NULL) {
+    return NULL;
+  }
+  memset(pair, 0, sizeof(struct ssh_loopback_pair_struct));
+  pair->half[0].doorbell[0] = pair->half[0].doorbell[1] = SSH_INVALID_SOCKET;
+  pair->half[1].doorbell[0] = pair->half[1].doorbell[1] = SSH_INVALID_SOCKET;
+  for (i = 0; i < 2; i++) {
+    pair->half[i].ring = ssh_buffer_new();
+    if (pair->half[i].ring == NULL) {
+      goto error;
+    }
+    if (pipe(pair->half[i].doorbell) < 0) {
+      pair->half[i].doorbell[0] = pair->half[i].doorbell[1] =
+          SSH_INVALID_SOCKET;
+      goto error;
+    }
+  }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&pair->mutex, NULL);
+#endif
+  return pair;
+error:
+  for (i = 0; i < 2; i++) {
+    ssh_buffer_free(pair->half[i].ring);
+    if (pair->half[i].doorbell[0] != SSH_INVALID_SOCKET) {
+      close(pair->half[i].doorbell[0]);
+      close(pair->half[i].doorbell[1]);
+    }
+  }
+  SAFE_FREE(pair);
+  return NULL;
+}
+
+/** @internal
+ * @brief drops one reference on a loopback pair, freeing it at zero
+ */
+void ssh_loopback_pair_unref(ssh_loopback_pair pair) {
+  int refcount;
+  int i;
+
+  if (pair == NULL) {
+    return;
+  }
+  loopback_lock(pair);
+  refcount = --pair->refcount;
+  loopback_unlock(pair);
+  if (refcount > 0) {
+    return;
+  }
+#ifdef HAVE_PTHREAD
+  pthread_mutex_destroy(&pair->mutex);
+#endif
+  for (i = 0; i < 2; i++) {
+    ssh_buffer_free(pair->half[i].ring);
+    if (pair->half[i].doorbell[0] != SSH_INVALID_SOCKET) {
+      close(pair->half[i].doorbell[0]);
+      close(pair->half[i].doorbell[1]);
+    }
+  }
+  SAFE_FREE(pair);
+}
+
+/** @internal
+ * @brief wires a socket to one side of a loopback pair
+ *
+ * The socket reads what the other side writes and vice versa. The
+ * doorbell read end is installed as the socket's fd so the poll
+ * machinery works unchanged; the socket never closes it, the pair owns
+ * all the descriptors.
+ *
+ * @param s      socket to wire.
+ * @param pair   pair created with ssh_loopback_pair_new().
+ * @param side   0 or 1; the two endpoints must use different sides.
+ * @returns SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_socket_loopback_attach(ssh_socket s, ssh_loopback_pair pair,
+    int side) {
+  if (s == NULL || pair == NULL || (side != 0 && side != 1)) {
+    return SSH_ERROR;
+  }
+  loopback_lock(pair);
+  pair->refcount++;
+  loopback_unlock(pair);
+  s->loop = pair;
+  s->loop_side = side;
+  /* poll on the doorbell of the incoming direction */
+  s->fd_in = s->fd_out = pair->half[side ^ 1].doorbell[0];
+  s->fd_is_socket = 0;
+  s->state = SSH_SOCKET_CONNECTED;
+  /* writes into the ring always complete */
+  s->write_wontblock = 1;
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief detaches a socket from its loopback pair
+ *
+ * Marks both directions EOF so the peer reads end-of-file and its
+ * writes fail, rings the peer's doorbell, and drops the reference. The
+ * descriptors belong to the pair, so they are only forgotten here, not
+ * closed.
+ */
+static void ssh_socket_loopback_detach(ssh_socket s) {
+  ssh_loopback_pair pair = s->loop;
+  int r;
+
+  loopback_lock(pair);
+  pair->half[s->loop_side].eof = 1;
+  pair->half[s->loop_side ^ 1].eof = 1;
+  r = write(pair->half[s->loop_side].doorbell[1], "", 1);
+  (void) r;
+  loopback_unlock(pair);
+  s->fd_in = s->fd_out = SSH_INVALID_SOCKET;
+  s->loop = NULL;
+  ssh_loopback_pair_unref(pair);
+}
+
+/** @internal
+ * @brief loopback flavour of ssh_socket_unbuffered_read()
+ */
+static int ssh_loopback_read(ssh_socket s, void *buffer, uint32_t len) {
+  struct ssh_loopback_half_struct *in = &s->loop->half[s->loop_side ^ 1];
+  uint32_t avail;
+  char bell;
+  int r;
+
+  s->read_wontblock = 0;
+  loopback_lock(s->loop);
+  avail = buffer_get_rest_len(in->ring);
+  if (avail == 0) {
+    if (in->eof) {
+      loopback_unlock(s->loop);
+      return 0;
+    }
+    /* cannot happen while the doorbell protocol is honoured: POLLIN
+     * only fires with data or EOF pending. Fail loudly rather than
+     * report a bogus EOF. */
+    loopback_unlock(s->loop);
+    s->last_errno = EIO;
+    s->data_except = 1;
+    return -1;
+  }
+  if (len > avail) {
+    len = avail;
+  }
+  memcpy(buffer, buffer_get_rest(in->ring), len);
+  buffer_pass_bytes(in->ring, len);
+  if (buffer_get_rest_len(in->ring) == 0) {
+    /* ring drained, take the pending byte out of the doorbell */
+    r = read(in->doorbell[0], &bell, 1);
+    (void) r;
+  }
+  loopback_unlock(s->loop);
+  return (int) len;
+}
+
+/** @internal
+ * @brief loopback flavour of ssh_socket_unbuffered_write()
+ */
+static int ssh_loopback_write(ssh_socket s, const void *buffer, uint32_t len) {
+  struct ssh_loopback_half_struct *out = &s->loop->half[s->loop_side];
+  int was_empty;
+  int r;
+
+  loopback_lock(s->loop);
+  if (out->eof) {
+    /* the peer detached */
+    loopback_unlock(s->loop);
+    s->last_errno = EPIPE;
+    s->data_except = 1;
+    return -1;
+  }
+  was_empty = (buffer_get_rest_len(out->ring) == 0);
+  if (buffer_add_data(out->ring, buffer, len) < 0) {
+    loopback_unlock(s->loop);
+    s->last_errno = ENOMEM;
+    s->data_except = 1;
+    return -1;
+  }
+  if (was_empty) {
+    r = write(out->doorbell[1], "", 1);
+    (void) r;
+  }
+  loopback_unlock(s->loop);
+  /* the ring is unbounded, the socket stays writable */
+  s->write_wontblock = 1;
+  return (int) len;
+}
+#endif /* _WIN32 */
+
+/** @internal
+ * @brief returns nonzero if the socket is wired to a loopback pair
+ */
+int ssh_socket_is_loopback(ssh_socket s) {
+  return s != NULL && s->loop != NULL;
+}
+
+/** @internal
+ * @brief starts I/O on a loopback-wired client socket
+ *
+ * A loopback endpoint is connected from the moment it is attached, so
+ * there is no connect completion event to wait for. Called from
+ * ssh_connect() once the socket callbacks are in place: arms POLLIN and
+ * fires the connected callback, which sends the client banner.
+ */
+void ssh_socket_loopback_kick(ssh_socket s) {
+  if (s == NULL || s->loop == NULL) {
+    return;
+  }
+  ssh_poll_add_events(ssh_socket_get_poll_handle_in(s), POLLIN);
+  if (s->callbacks && s->callbacks->connected) {
+    s->callbacks->connected(SSH_SOCKET_CONNECTED_OK, 0,
+        s->callbacks->userdata);
+  }
+}
+
 /** \internal
  * \brief read len bytes from socket into buffer
  */
@@ -490,6 +1121,11 @@ static int ssh_socket_unbuffered_read(ssh_socket s, void *buffer, uint32_t len)
   if (s->data_except) {
     return -1;
   }
+#ifndef _WIN32
+  if (s->loop != NULL) {
+    return ssh_loopback_read(s, buffer, len);
+  }
+#endif
   if(s->fd_is_socket)
     rc = recv(s->fd_in,buffer, len, 0);
   else
@@ -518,6 +1154,11 @@ static int ssh_socket_unbuffered_write(ssh_socket s, const void *buffer,
   if (s->data_except) {
     return -1;
   }
+#ifndef _WIN32
+  if (s->loop != NULL) {
+    return ssh_loopback_write(s, buffer, len);
+  }
+#endif
   if (s->fd_is_socket)
     w = send(s->fd_out,buffer, len, 0);
   else
@@ -587,6 +1228,12 @@ int ssh_socket_write(ssh_socket s, const void *buffer, int len) {
       ssh_set_error_oom(s->session);
       return SSH_ERROR;
     }
+    if (session->corked &&
+        buffer_get_rest_len(s->out_buffer) < SSH_SOCKET_CORK_THRESHOLD) {
+      /* pile the packet up for a later flush */
+      leave_function();
+      return SSH_OK;
+    }
     ssh_socket_nonblocking_flush(s);
   }
   leave_function();
@@ -594,6 +1241,105 @@ int ssh_socket_write(ssh_socket s, const void *buffer, int len) {
 }
 
 
+/** \internal
+ * \brief tell the socket how many bytes the packet layer still expects,
+ * so the next recv() can pull a whole packet in one call
+ */
+void ssh_socket_set_read_hint(ssh_socket s, uint32_t len) {
+  if (s == NULL) {
+    return;
+  }
+  if (len > SSH_SOCKET_READ_MAX) {
+    len = SSH_SOCKET_READ_MAX;
+  }
+  s->read_hint = len;
+}
+
+/** \internal
+ * \brief vectored buffered write of data
+ *
+ * Queues several segments for sending in order. When the socket is ready
+ * for writing and nothing else is pending, the segments are handed to the
+ * kernel with writev() without being coalesced first; whatever the kernel
+ * did not take is buffered. On platforms without writev() this degrades to
+ * consecutive buffered writes.
+ *
+ * \returns SSH_OK, or SSH_ERROR
+ */
+int ssh_socket_write_iov(ssh_socket s, const struct ssh_iovec_struct *iov,
+    int count) {
+  ssh_session session = s->session;
+  int i = 0;
+
+  enter_function();
+#if defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+  if (s->fd_is_socket && s->write_wontblock && !s->data_except &&
+      session->corked == 0 &&
+      count <= 16 && buffer_get_rest_len(s->out_buffer) == 0) {
+    struct iovec vec[16];
+    ssize_t w;
+
+    for (i = 0; i < count; i++) {
+      vec[i].iov_base = (void *)iov[i].data;
+      vec[i].iov_len = iov[i].len;
+    }
+    w = writev(s->fd_out, vec, count);
+    s->last_errno = errno;
+    s->write_wontblock = 0;
+    if (s->poll_out) {
+      ssh_poll_set_events(s->poll_out,
+          ssh_poll_get_events(s->poll_out) | POLLOUT);
+    }
+    if (w < 0) {
+      s->data_except = 1;
+      session->alive = 0;
+      ssh_socket_close(s);
+      ssh_set_error(session, SSH_FATAL,
+          "Writing packet: error on socket (or connection closed): %s",
+          strerror(s->last_errno));
+      leave_function();
+      return SSH_ERROR;
+    }
+    /* Buffer the segments (or parts of them) the kernel did not take */
+    for (i = 0; i < count; i++) {
+      size_t skip = ((size_t)w > iov[i].len) ? iov[i].len : (size_t)w;
+
+      w -= skip;
+      if (skip < iov[i].len) {
+        if (buffer_add_data(s->out_buffer, (const char *)iov[i].data + skip,
+              iov[i].len - skip) < 0) {
+          ssh_set_error_oom(session);
+          leave_function();
+          return SSH_ERROR;
+        }
+      }
+    }
+    if (buffer_get_rest_len(s->out_buffer) > 0 && s->poll_out) {
+      ssh_poll_add_events(s->poll_out, POLLOUT);
+    }
+    leave_function();
+    return SSH_OK;
+  }
+#endif /* HAVE_SYS_UIO_H */
+  for (i = 0; i < count; i++) {
+    if (iov[i].len > 0) {
+      if (buffer_add_data(s->out_buffer, iov[i].data, iov[i].len) < 0) {
+        ssh_set_error_oom(session);
+        leave_function();
+        return SSH_ERROR;
+      }
+    }
+  }
+  if (session->corked &&
+      buffer_get_rest_len(s->out_buffer) < SSH_SOCKET_CORK_THRESHOLD) {
+    leave_function();
+    return SSH_OK;
+  }
+  ssh_socket_nonblocking_flush(s);
+  leave_function();
+  return SSH_OK;
+}
+
 /** \internal
  * \brief starts a nonblocking flush of the output buffer
  *
@@ -641,6 +1387,9 @@ int ssh_socket_nonblocking_flush(ssh_socket s) {
 
   /* Is there some data pending? */
   len = buffer_get_rest_len(s->out_buffer);
+  /* wake the producers waiting on a drain watermark */
+  ssh_channel_drain_notify(session, len);
+  len = buffer_get_rest_len(s->out_buffer);
   if (s->poll_out && len > 0) {
       /* force the poll system to catch pollout events */
       ssh_poll_add_events(s->poll_out, POLLOUT);
@@ -717,16 +1466,37 @@ int ssh_socket_get_status(ssh_socket s) {
 int ssh_socket_connect(ssh_socket s, const char *host, int port, const char *bind_addr){
 	socket_t fd;
 	ssh_session session=s->session;
+	struct addrinfo *itr;
+	int rc;
 	enter_function();
 	if(s->state != SSH_SOCKET_NONE) {
 		ssh_set_error(s->session, SSH_FATAL,
 				"ssh_socket_connect called on socket not unconnected");
 		return SSH_ERROR;
 	}
-	fd=ssh_connect_host_nonblocking(s->session,host,bind_addr,port);
+	rc=ssh_connect_ai(session,host,port,&s->connect_ai);
+	if(rc != 0){
+		ssh_set_error(session, SSH_FATAL,
+				"Failed to resolve hostname %s (%s)", host, gai_strerror(rc));
+		leave_function();
+		return SSH_ERROR;
+	}
+	if(bind_addr != NULL)
+		s->connect_bind_addr=strdup(bind_addr);
+	fd=SSH_INVALID_SOCKET;
+	for(itr=s->connect_ai;itr != NULL;itr=itr->ai_next){
+		fd=ssh_connect_ai_nonblocking(session,itr,bind_addr);
+		if(fd != SSH_INVALID_SOCKET)
+			break;
+	}
 	ssh_log(session,SSH_LOG_PROTOCOL,"Nonblocking connection socket: %d",fd);
-	if(fd == SSH_INVALID_SOCKET)
+	if(fd == SSH_INVALID_SOCKET){
+		ssh_socket_connect_cleanup(s);
+		leave_function();
 		return SSH_ERROR;
+	}
+	s->connect_family=itr->ai_family;
+	s->connect_next=itr->ai_next;
 	ssh_socket_set_fd(s,fd);
 	s->state=SSH_SOCKET_CONNECTING;
 	/* POLLOUT is the event to wait for in a nonblocking connect */
@@ -734,6 +1504,9 @@ int ssh_socket_connect(ssh_socket s, const char *host, int port, const char *bin
 #ifdef _WIN32
 	ssh_poll_add_events(ssh_socket_get_poll_handle_in(s),POLLWRNORM);
 #endif
+	/* race the first address of another family against this attempt, so a
+	 * broken route on one family doesn't cost a full connect timeout */
+	ssh_socket_connect_race_start(s);
 	leave_function();
 	return SSH_OK;
 }
@@ -21,6 +21,10 @@
  * MA 02111-1307, USA.
  */
 
+/* keep the exported getter definitions unshadowed by the inline
+ * fast paths in the header */
+#define SSH_GETTERS_NO_INLINE
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -40,6 +44,32 @@
  * @{
  */
 
+/*
+ * Packet parsing churns through thousands of short-lived strings
+ * (algorithm names, usernames, bignum fragments) per kex/auth exchange.
+ * Small strings are carved from fixed-capacity blocks recycled on a
+ * per-thread freelist instead of hitting malloc each time. Every small
+ * string allocated here has the full block capacity, so any string whose
+ * size fits the threshold can safely go back on the list.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define STRING_FREELIST
+#endif
+
+#ifdef STRING_FREELIST
+/* covers the common short strings without bloating the freelist blocks */
+#define STRING_FREELIST_PAYLOAD 64
+/* upper bound on cached blocks, beyond it blocks go back to malloc */
+#define STRING_FREELIST_MAX_BLOCKS 128
+
+struct string_freelist_block {
+  struct string_freelist_block *next;
+};
+
+static __thread struct string_freelist_block *string_freelist;
+static __thread unsigned int string_freelist_blocks;
+#endif
+
 /**
  * @brief Create a new SSH String object.
  *
@@ -50,6 +80,24 @@
 struct ssh_string_struct *ssh_string_new(size_t size) {
   struct ssh_string_struct *str = NULL;
 
+#ifdef STRING_FREELIST
+  if (size <= STRING_FREELIST_PAYLOAD) {
+    if (string_freelist != NULL) {
+      str = (struct ssh_string_struct *) string_freelist;
+      string_freelist = string_freelist->next;
+      string_freelist_blocks--;
+    } else {
+      str = malloc(4 + STRING_FREELIST_PAYLOAD);
+    }
+    if (str == NULL) {
+      return NULL;
+    }
+
+    str->size = htonl(size);
+    return str;
+  }
+#endif
+
   str = malloc(size + 4);
   if (str == NULL) {
     return NULL;
@@ -93,18 +141,17 @@ int ssh_string_fill(struct ssh_string_struct *s, const void *data, size_t len) {
 struct ssh_string_struct *ssh_string_from_char(const char *what) {
   struct ssh_string_struct *ptr = NULL;
   size_t len;
-  
+
   if(what == NULL) {
       return NULL;
   }
 
   len = strlen(what);
 
-  ptr = malloc(4 + len);
+  ptr = ssh_string_new(len);
   if (ptr == NULL) {
     return NULL;
   }
-  ptr->size = htonl(len);
   memcpy(ptr->string, what, len);
 
   return ptr;
@@ -175,12 +222,11 @@ struct ssh_string_struct *ssh_string_copy(struct ssh_string_struct *s) {
   if(s == NULL || s->string == NULL) {
       return NULL;
   }
-  new = malloc(ntohl(s->size) + 4);
+  new = ssh_string_new(ntohl(s->size));
 
   if (new == NULL) {
     return NULL;
   }
-  new->size = s->size;
   memcpy(new->string, s->string, ntohl(s->size));
 
   return new;
@@ -195,7 +241,7 @@ void ssh_string_burn(struct ssh_string_struct *s) {
   if (s == NULL) {
     return;
   }
-  memset(s->string, 'X', ssh_string_len(s));
+  ssh_burn(s->string, ssh_string_len(s));
 }
 
 /**
@@ -219,9 +265,40 @@ void *ssh_string_data(struct ssh_string_struct *s) {
  * \param[in] s         The SSH string to delete.
  */
 void ssh_string_free(struct ssh_string_struct *s) {
+#ifdef STRING_FREELIST
+  if (s != NULL && ntohl(s->size) <= STRING_FREELIST_PAYLOAD &&
+      string_freelist_blocks < STRING_FREELIST_MAX_BLOCKS) {
+    /* blocks come straight from malloc, so the cast keeps alignment */
+    void *block_mem = s;
+    struct string_freelist_block *block = block_mem;
+
+    block->next = string_freelist;
+    string_freelist = block;
+    string_freelist_blocks++;
+    return;
+  }
+#endif
   SAFE_FREE(s);
 }
 
+/**
+ * @internal
+ *
+ * @brief Release the thread's small string freelist.
+ */
+void ssh_string_freelist_flush(void) {
+#ifdef STRING_FREELIST
+  struct string_freelist_block *block;
+
+  while (string_freelist != NULL) {
+    block = string_freelist;
+    string_freelist = block->next;
+    SAFE_FREE(block);
+  }
+  string_freelist_blocks = 0;
+#endif
+}
+
 /** @} */
 
 /* vim: set ts=4 sw=4 et cindent: */
@@ -42,10 +42,49 @@
 #include <zlib.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
 #include "libssh/priv.h"
 #include "libssh/session.h"
 #include "libssh/crypto.h"
 #include "libssh/wrapper.h"
+#include "libssh/misc.h"
+
+/**
+ * @internal
+ *
+ * @brief Check whether the CPU hashes SHA-1/SHA-256 in hardware.
+ *
+ * Both crypto backends route their digests through the fastest code the
+ * CPU supports on their own; this probe only exists so callers can tune
+ * thresholds that depend on how expensive a MAC pass is, see
+ * packet_encrypt() in crypt.c.
+ *
+ * @return              1 when the SHA extensions are present, 0 otherwise.
+ */
+int ssh_digest_accel(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  static int cached = -1;
+  unsigned int eax, ebx, ecx, edx;
+
+  if (cached < 0) {
+    cached = 0;
+    /* CPUID.(EAX=7,ECX=0):EBX bit 29 is the SHA extension flag */
+    if (__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      if (ebx & (1u << 29)) {
+        cached = 1;
+      }
+    }
+  }
+
+  return cached;
+#else
+  return 0;
+#endif
+}
 
 /* it allocates a new cipher structure based on its offset into the global table */
 static struct crypto_struct *cipher_new(int offset) {
@@ -71,6 +110,10 @@ static void cipher_free(struct crypto_struct *cipher) {
     return;
   }
 
+  if (cipher->cleanup) {
+    cipher->cleanup(cipher);
+  }
+
   if(cipher->key) {
 #ifdef HAVE_LIBGCRYPT
     for (i = 0; i < (cipher->keylen / sizeof(gcry_cipher_hd_t)); i++) {
@@ -78,13 +121,153 @@ static void cipher_free(struct crypto_struct *cipher) {
     }
 #elif defined HAVE_LIBCRYPTO
     /* destroy the key */
-    memset(cipher->key, 0, cipher->keylen);
+    ssh_burn(cipher->key, cipher->keylen);
 #endif
     SAFE_FREE(cipher->key);
   }
   SAFE_FREE(cipher);
 }
 
+/* how long each cipher is run when measuring, in milliseconds */
+#define CIPHER_BENCH_MS 4
+#define CIPHER_BENCH_BUFSIZE 16384
+
+/* comma list of cipher names ordered by measured speed, built once per
+ * process by ssh_benchmark_cipher_order() */
+static char *cipher_benchmark_order = NULL;
+
+/** @internal
+ * @brief orders the cipher table by encryption speed on this host
+ *
+ * Every SSH-2 cipher of the table is keyed and run over a 16KB buffer
+ * for a few milliseconds; the result reflects whatever acceleration the
+ * crypto library picked up (AES-NI or not). The comma list is built
+ * once and cached for the process.
+ *
+ * @return  A comma-separated cipher list, fastest first, or NULL on
+ *          allocation failure.
+ *
+ * @see SSH_PROFILE_BENCHMARK
+ */
+const char *ssh_benchmark_cipher_order(void) {
+  struct crypto_struct *tab = ssh_get_ciphertab();
+  struct bench_result {
+    const char *name;
+    double score; /* bytes per millisecond */
+  } results[32], tmp;
+  unsigned char key[64];
+  unsigned char iv[64];
+  unsigned char *in;
+  unsigned char *out;
+  size_t total;
+  int count = 0;
+  int i, j;
+
+  if (cipher_benchmark_order != NULL) {
+    return cipher_benchmark_order;
+  }
+
+  in = calloc(1, CIPHER_BENCH_BUFSIZE);
+  out = malloc(CIPHER_BENCH_BUFSIZE);
+  if (in == NULL || out == NULL) {
+    SAFE_FREE(in);
+    SAFE_FREE(out);
+    return NULL;
+  }
+  /* patterned rather than zero so 3des does not hit a weak key check */
+  for (i = 0; i < (int) sizeof(key); i++) {
+    key[i] = i + 1;
+    iv[i] = i;
+  }
+
+  for (i = 0; tab[i].name != NULL &&
+       count < (int) (sizeof(results) / sizeof(results[0])); i++) {
+    struct crypto_struct *cipher;
+    struct ssh_timestamp ts;
+    uint64_t bytes = 0;
+    int elapsed;
+
+    if (strcmp(tab[i].name, "3des-cbc-ssh1") == 0) {
+      /* SSH-1 only, never negotiated by version 2 */
+      continue;
+    }
+
+    cipher = cipher_new(i);
+    if (cipher == NULL) {
+      continue;
+    }
+#ifdef HAVE_LIBGCRYPT
+    if (cipher->set_encrypt_key(cipher, key, iv) < 0) {
+      cipher_free(cipher);
+      continue;
+    }
+#elif defined HAVE_LIBCRYPTO
+    if (cipher->set_encrypt_key(cipher, key) < 0) {
+      cipher_free(cipher);
+      continue;
+    }
+#endif
+
+    ssh_timestamp_init(&ts);
+    do {
+#ifdef HAVE_LIBGCRYPT
+      cipher->cbc_encrypt(cipher, in, out, CIPHER_BENCH_BUFSIZE);
+#elif defined HAVE_LIBCRYPTO
+      cipher->cbc_encrypt(cipher, in, out, CIPHER_BENCH_BUFSIZE, iv);
+#endif
+      bytes += CIPHER_BENCH_BUFSIZE;
+      elapsed = ssh_timestamp_elapsed_ms(&ts);
+    } while (elapsed < CIPHER_BENCH_MS);
+
+    results[count].name = tab[i].name;
+    results[count].score = (double) bytes / (elapsed > 0 ? elapsed : 1);
+    count++;
+
+    cipher_free(cipher);
+  }
+
+  SAFE_FREE(in);
+  SAFE_FREE(out);
+
+  if (count == 0) {
+    return NULL;
+  }
+
+  /* insertion sort, fastest first */
+  for (i = 1; i < count; i++) {
+    for (j = i; j > 0 && results[j - 1].score < results[j].score; j--) {
+      tmp = results[j - 1];
+      results[j - 1] = results[j];
+      results[j] = tmp;
+    }
+  }
+
+  total = 0;
+  for (i = 0; i < count; i++) {
+    total += strlen(results[i].name) + 1;
+  }
+  cipher_benchmark_order = malloc(total);
+  if (cipher_benchmark_order == NULL) {
+    return NULL;
+  }
+  cipher_benchmark_order[0] = '\0';
+  for (i = 0; i < count; i++) {
+    if (i > 0) {
+      strcat(cipher_benchmark_order, ",");
+    }
+    strcat(cipher_benchmark_order, results[i].name);
+  }
+
+  return cipher_benchmark_order;
+}
+
+/** @internal
+ * @brief releases the cached benchmark result, called by ssh_finalize()
+ */
+void ssh_benchmark_cipher_flush(void) {
+  SAFE_FREE(cipher_benchmark_order);
+}
+
 struct ssh_crypto_struct *crypto_new(void) {
    struct ssh_crypto_struct *crypto;
 
@@ -103,9 +286,27 @@ void crypto_free(struct ssh_crypto_struct *crypto){
 
   SAFE_FREE(crypto->server_pubkey);
 
+#ifdef HAVE_ECC
+  if (crypto->ecdh_privkey) {
+    EC_KEY_free(crypto->ecdh_privkey);
+    crypto->ecdh_privkey = NULL;
+  }
+  SAFE_FREE(crypto->ecdh_client_pubkey);
+  SAFE_FREE(crypto->ecdh_server_pubkey);
+#endif
+
   cipher_free(crypto->in_cipher);
   cipher_free(crypto->out_cipher);
 
+  if (crypto->crypt_scratch) {
+    /* burn the last plaintext that went through it */
+    ssh_burn(crypto->crypt_scratch, crypto->crypt_scratch_len);
+    SAFE_FREE(crypto->crypt_scratch);
+  }
+
+  hmac_free(crypto->encrypt_mac_ctx);
+  hmac_free(crypto->decrypt_mac_ctx);
+
   bignum_free(crypto->e);
   bignum_free(crypto->f);
   bignum_free(crypto->x);
@@ -122,10 +323,11 @@ void crypto_free(struct ssh_crypto_struct *crypto){
       (deflateEnd(crypto->compress_in_ctx) != 0)) {
     inflateEnd(crypto->compress_in_ctx);
   }
+  buffer_free(crypto->compress_scratch);
 #endif
 
   /* i'm lost in my own code. good work */
-  memset(crypto,0,sizeof(*crypto));
+  ssh_burn(crypto, sizeof(*crypto));
 
   SAFE_FREE(crypto);
 }
@@ -330,6 +532,8 @@ int crypt_set_algorithms_server(ssh_session session){
         session->hostkeys=SSH_KEYTYPE_DSS;
     else if(match && !strcmp(match,"ssh-rsa"))
         session->hostkeys=SSH_KEYTYPE_RSA;
+    else if(match && !strcmp(match,"ecdsa-sha2-nistp256"))
+        session->hostkeys=SSH_KEYTYPE_ECDSA;
     else {
         ssh_set_error(session, SSH_FATAL, "Cannot know what %s is into %s",
             match ? match : NULL, server);
@@ -0,0 +1,258 @@
+/*
+ * bench_crypto.c - cipher and MAC microbenchmarks
+ *
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2011 by Aris Adamantiadis
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Drives every cipher of the ciphertab and the HMAC implementations
+ * standalone, the same way packet_encrypt()/packet_decrypt() do, and
+ * prints MB/s (and cycles/byte where a cycle counter is available) per
+ * algorithm and packet size. Useful to pick cipher lists on a given
+ * machine and to catch regressions when a crypto backend changes.
+ *
+ * Usage: bench_crypto [size...]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <libssh/libssh.h>
+#include "libssh/priv.h"
+#include "libssh/crypto.h"
+#include "libssh/wrapper.h"
+
+/* run each measurement for roughly this long */
+#define BENCH_MS 300
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_BENCH_CYCLES
+static unsigned long long bench_cycles(void) {
+  unsigned int lo, hi;
+
+  __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((unsigned long long) hi << 32) | lo;
+}
+#endif
+
+static float bench_elapsed_ms(struct timeval *begin) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - begin->tv_sec) * 1000.0f +
+      (now.tv_usec - begin->tv_usec) / 1000.0f;
+}
+
+static void bench_report(const char *name, const char *op, size_t size,
+    unsigned long long bytes, float ms, unsigned long long cycles) {
+  printf("%-15s %-7s %7zu %10.1f MB/s", name, op, size,
+      bytes / (1024.0f * 1024.0f) / (ms / 1000.0f));
+  if (cycles > 0) {
+    printf(" %8.2f cycles/byte", (float) ((double) cycles / bytes));
+  }
+  printf("\n");
+}
+
+static void bench_cipher(struct crypto_struct *tab_entry, size_t size,
+    int decrypt) {
+  struct crypto_struct cipher;
+  unsigned char key[64];
+  unsigned char IV[64];
+  unsigned char *in;
+  unsigned char *out;
+  struct timeval begin;
+  unsigned long long bytes = 0;
+  unsigned long long cycles = 0;
+  float ms;
+  size_t i;
+
+  /* the library keys a fresh copy of the tab entry per direction too */
+  memcpy(&cipher, tab_entry, sizeof(cipher));
+  cipher.key = NULL;
+
+  for (i = 0; i < sizeof(key); i++) {
+    key[i] = (unsigned char) i;
+  }
+  memset(IV, 0, sizeof(IV));
+
+  in = malloc(size);
+  out = malloc(size);
+  if (in == NULL || out == NULL) {
+    free(in);
+    free(out);
+    return;
+  }
+  memset(in, 'x', size);
+
+#ifdef HAVE_LIBGCRYPT
+  if (decrypt) {
+    if (cipher.set_decrypt_key(&cipher, key, IV) < 0) {
+      goto error;
+    }
+  } else {
+    if (cipher.set_encrypt_key(&cipher, key, IV) < 0) {
+      goto error;
+    }
+  }
+#elif defined HAVE_LIBCRYPTO
+  if (decrypt) {
+    if (cipher.set_decrypt_key(&cipher, key) < 0) {
+      goto error;
+    }
+  } else {
+    if (cipher.set_encrypt_key(&cipher, key) < 0) {
+      goto error;
+    }
+  }
+#endif
+
+  gettimeofday(&begin, NULL);
+  do {
+#ifdef HAVE_BENCH_CYCLES
+    unsigned long long c = bench_cycles();
+#endif
+#ifdef HAVE_LIBGCRYPT
+    if (decrypt) {
+      cipher.cbc_decrypt(&cipher, in, out, size);
+    } else {
+      cipher.cbc_encrypt(&cipher, in, out, size);
+    }
+#elif defined HAVE_LIBCRYPTO
+    if (decrypt) {
+      cipher.cbc_decrypt(&cipher, in, out, size, IV);
+    } else {
+      cipher.cbc_encrypt(&cipher, in, out, size, IV);
+    }
+#endif
+#ifdef HAVE_BENCH_CYCLES
+    cycles += bench_cycles() - c;
+#endif
+    bytes += size;
+    ms = bench_elapsed_ms(&begin);
+  } while (ms < BENCH_MS);
+
+  bench_report(cipher.name, decrypt ? "decrypt" : "encrypt", size,
+      bytes, ms, cycles);
+error:
+  free(in);
+  free(out);
+}
+
+static void bench_hmac(const char *name, int type, size_t size) {
+  unsigned char key[20] = "0123456789abcdefghi";
+  unsigned char mac[64];
+  unsigned char *in;
+  unsigned int maclen;
+  HMACCTX ctx;
+  struct timeval begin;
+  unsigned long long bytes = 0;
+  unsigned long long cycles = 0;
+  float ms;
+
+  in = malloc(size);
+  if (in == NULL) {
+    return;
+  }
+  memset(in, 'x', size);
+
+  ctx = hmac_init(key, sizeof(key), type);
+  if (ctx == NULL) {
+    free(in);
+    return;
+  }
+
+  gettimeofday(&begin, NULL);
+  do {
+#ifdef HAVE_BENCH_CYCLES
+    unsigned long long c = bench_cycles();
+#endif
+    hmac_update(ctx, in, size);
+    hmac_final_reset(ctx, mac, &maclen);
+#ifdef HAVE_BENCH_CYCLES
+    cycles += bench_cycles() - c;
+#endif
+    bytes += size;
+    ms = bench_elapsed_ms(&begin);
+  } while (ms < BENCH_MS);
+
+  hmac_final(ctx, mac, &maclen);
+
+  bench_report(name, "mac", size, bytes, ms, cycles);
+  free(in);
+}
+
+int main(int argc, char **argv) {
+  static const size_t default_sizes[] = { 256, 1024, 8192, 32768 };
+  struct crypto_struct *tab;
+  size_t sizes[16];
+  int nsizes = 0;
+  int i, s;
+
+  if (argc > 1) {
+    for (i = 1; i < argc && nsizes < 16; i++) {
+      long size = strtol(argv[i], NULL, 0);
+      if (size <= 0) {
+        fprintf(stderr, "invalid size: %s\n", argv[i]);
+        return 1;
+      }
+      sizes[nsizes++] = (size_t) size;
+    }
+  } else {
+    for (i = 0; i < (int) (sizeof(default_sizes)/sizeof(default_sizes[0])); i++) {
+      sizes[nsizes++] = default_sizes[i];
+    }
+  }
+
+  if (ssh_init() < 0) {
+    fprintf(stderr, "ssh_init failed\n");
+    return 1;
+  }
+
+  printf("%-15s %-7s %7s %15s\n", "algorithm", "op", "bytes", "speed");
+
+  tab = ssh_get_ciphertab();
+  for (i = 0; tab[i].name != NULL; i++) {
+    if (tab[i].cbc_encrypt == NULL) {
+      /* "none" */
+      continue;
+    }
+    for (s = 0; s < nsizes; s++) {
+      bench_cipher(&tab[i], sizes[s], 0);
+    }
+    for (s = 0; s < nsizes; s++) {
+      bench_cipher(&tab[i], sizes[s], 1);
+    }
+  }
+
+  for (s = 0; s < nsizes; s++) {
+    bench_hmac("hmac-sha1", HMAC_SHA1, sizes[s]);
+  }
+  for (s = 0; s < nsizes; s++) {
+    bench_hmac("hmac-md5", HMAC_MD5, sizes[s]);
+  }
+
+  ssh_finalize();
+
+  return 0;
+}
@@ -68,7 +68,7 @@ static char *get_python_eater(unsigned long bytes){
  * @param[in] content of the file to copy
  * @return 0 on success, -1 on error
  */
-static int upload_script(ssh_session session, const char *path,
+int benchmarks_upload_script(ssh_session session, const char *path,
     const char *script){
   ssh_channel channel;
   char cmd[128];
@@ -117,7 +117,7 @@ int benchmarks_raw_up (ssh_session session, struct argument_s *args,
   unsigned long total=0;
   (void)bps;
 
-  err=upload_script(session,"/tmp/eater.py",script);
+  err=benchmarks_upload_script(session,"/tmp/eater.py",script);
   free(script);
   if(err<0)
     return err;
@@ -180,3 +180,99 @@ error:
   }
   return -1;
 }
+
+const char python_spitter[]=
+"#!/usr/bin/python\n"
+"import sys\n"
+"towrite=XXXXXXXXXX\n"
+"wrote=0\n"
+"buffer='0'*4096\n"
+"while(wrote < towrite):\n"
+"    buffersize=towrite-wrote\n"
+"    if(buffersize > 4096):\n"
+"        buffersize=4096\n"
+"    sys.stdout.write(buffer[:buffersize])\n"
+"    wrote+=buffersize\n"
+"sys.stdout.flush()\n";
+
+static char *get_python_spitter(unsigned long bytes){
+  char *spitter=malloc(sizeof(python_spitter));
+  char *ptr;
+  char buffer[12];
+
+  memcpy(spitter,python_spitter,sizeof(python_spitter));
+  ptr=strstr(spitter,"XXXXXXXXXX");
+  if(!ptr){
+    free(spitter);
+    return NULL;
+  }
+  sprintf(buffer,"0x%.8lx",bytes);
+  memcpy(ptr,buffer,10);
+  return spitter;
+}
+
+/** @internal
+ * @brief benchmarks a raw download (ssh_channel_read of the output of a
+ * remote command) using an existing SSH session.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bytes per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_raw_down (ssh_session session, struct argument_s *args,
+    float *bps){
+  unsigned long bytes=0x1000000;
+  char *script=get_python_spitter(bytes);
+  char cmd[128];
+  char buffer[32768];
+  int err;
+  ssh_channel channel;
+  struct timestamp_struct ts;
+  float ms=0.0;
+  unsigned long total=0;
+
+  err=benchmarks_upload_script(session,"/tmp/spitter.py",script);
+  free(script);
+  if(err<0)
+    return err;
+  channel=ssh_channel_new(session);
+  if(channel == NULL)
+    goto error;
+  if(ssh_channel_open_session(channel)==SSH_ERROR)
+    goto error;
+  if(args->verbose>0)
+    fprintf(stdout,"Starting download of %lu bytes now\n",bytes);
+  snprintf(cmd,sizeof(cmd),"%s /tmp/spitter.py", PYTHON_PATH);
+  timestamp_init(&ts);
+  if(ssh_channel_request_exec(channel,cmd)==SSH_ERROR)
+    goto error;
+  while(total < bytes){
+    int r=ssh_channel_read(channel,buffer,sizeof(buffer),0);
+    if(r == SSH_ERROR)
+      goto error;
+    if(r == 0)
+      break;
+    total += r;
+  }
+  ms=elapsed_time(&ts);
+  if(total != bytes){
+    fprintf(stderr,"parse error : expected %lu bytes, got %lu\n",bytes,total);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return -1;
+  }
+  *bps=8000 * (float)bytes / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"Download took %f ms for %lu bytes, at %f bps\n",ms,
+        bytes,*bps);
+  ssh_channel_close(channel);
+  ssh_channel_free(channel);
+  return 0;
+error:
+  fprintf(stderr,"Error during raw download : %s\n",ssh_get_error(session));
+  if(channel){
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+  }
+  return -1;
+}
@@ -0,0 +1,528 @@
+/*
+ * bench_replay.c - offline replay of captured packet streams
+ *
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2011 by Aris Adamantiadis
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Feeds a recorded byte stream through ssh_packet_socket_callback() the
+ * way the socket layer would, against a session with no peer, so the
+ * parse/dispatch/channel paths can be profiled offline on captured
+ * production workloads and regressions bisected without a live server.
+ *
+ * Two input formats are understood:
+ *
+ *  - the pcap files written by ssh_set_pcap_file(): those hold the
+ *    plaintext packet images behind a fake IP/TCP header, so the replay
+ *    runs with crypto disabled and exercises everything above the
+ *    cipher. The direction whose records answer the first record of the
+ *    file (i.e. the server's stream) is replayed; -s swaps that.
+ *
+ *  - a compact replay format with timing, for captures made by other
+ *    tools: the bytes "SSHR" followed by records of uint32_t length,
+ *    uint64_t microsecond offset since capture start and the raw
+ *    stream bytes, all little-endian. -o converts a pcap capture into
+ *    this format.
+ *
+ * Channel ids are allocated in order, so a capture taken from a libssh
+ * client is replayed against -c N channels opened here in the same
+ * order: the recorded CHANNEL_DATA packets then find their channel in
+ * the demux table. The harness consumes delivered bytes from the data
+ * callback and tops the receive window back up, no packet is ever sent.
+ *
+ * Usage: bench_replay [-t] [-s] [-c channels] [-o out.sshr] capture
+ *   -t  honor the recorded inter-packet timing instead of replaying
+ *       at full speed
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/packet.h"
+#include "libssh/buffer.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1
+#define PCAP_FILE_HEADER_LEN 24
+#define PCAP_RECORD_HEADER_LEN 16
+#define FAKE_TCPIP_HEADER_LEN 40
+
+#define REPLAY_MAGIC "SSHR"
+
+/* keep the receive window topped up so the replay never tries to send
+ * a WINDOW_ADJUST on the peerless session */
+#define REPLAY_WINDOW (1U << 30)
+
+struct replay_record {
+  const unsigned char *data;
+  uint32_t len;
+  uint64_t usec; /* offset since the start of the capture */
+};
+
+struct replay_stream {
+  struct replay_record *records;
+  size_t count;
+};
+
+static uint64_t replay_delivered;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_BENCH_CYCLES
+static unsigned long long bench_cycles(void) {
+  unsigned int lo, hi;
+
+  __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((unsigned long long) hi << 32) | lo;
+}
+#endif
+
+static uint32_t get_u32(const unsigned char *p, int swap) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  if (swap) {
+    v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+  }
+  return v;
+}
+
+static void put_u32_le(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+static void put_u64_le(unsigned char *p, uint64_t v) {
+  put_u32_le(p, (uint32_t) v);
+  put_u32_le(p + 4, (uint32_t) (v >> 32));
+}
+
+static unsigned char *load_file(const char *path, size_t *len) {
+  FILE *f;
+  unsigned char *data;
+  long size;
+
+  f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Opening %s failed\n", path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size <= 0) {
+    fclose(f);
+    return NULL;
+  }
+  data = malloc(size);
+  if (data == NULL || fread(data, 1, size, f) != (size_t) size) {
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *len = size;
+  return data;
+}
+
+/* the capture holds both directions; keep the records answering the
+ * first one (the server's stream unless swap is set) */
+static int parse_pcap(const unsigned char *data, size_t len, int swap_dir,
+    struct replay_stream *stream) {
+  size_t off = PCAP_FILE_HEADER_LEN;
+  size_t capacity = 64;
+  uint32_t magic;
+  uint64_t first_usec = 0;
+  uint16_t want_src = 0, want_dst = 0;
+  int have_tuple = 0;
+  int swap;
+
+  if (len < PCAP_FILE_HEADER_LEN) {
+    return -1;
+  }
+  magic = get_u32(data, 0);
+  if (magic == PCAP_MAGIC) {
+    swap = 0;
+  } else if (magic == PCAP_MAGIC_SWAPPED) {
+    swap = 1;
+  } else {
+    return -1;
+  }
+
+  stream->records = malloc(capacity * sizeof(struct replay_record));
+  if (stream->records == NULL) {
+    return -1;
+  }
+  stream->count = 0;
+
+  while (off + PCAP_RECORD_HEADER_LEN <= len) {
+    uint32_t ts_sec = get_u32(data + off, swap);
+    uint32_t ts_usec = get_u32(data + off + 4, swap);
+    uint32_t incl = get_u32(data + off + 8, swap);
+    uint32_t orig = get_u32(data + off + 12, swap);
+    const unsigned char *payload = data + off + PCAP_RECORD_HEADER_LEN;
+    uint16_t sp, dp;
+
+    off += PCAP_RECORD_HEADER_LEN;
+    if (incl > len - off || incl < FAKE_TCPIP_HEADER_LEN) {
+      fprintf(stderr, "Truncated pcap record\n");
+      return -1;
+    }
+    if (incl != orig) {
+      fprintf(stderr, "The capture was taken with a snaplen, the stream "
+          "cannot be replayed faithfully\n");
+      return -1;
+    }
+    off += incl;
+
+    sp = (uint16_t) ((payload[20] << 8) | payload[21]);
+    dp = (uint16_t) ((payload[22] << 8) | payload[23]);
+    if (!have_tuple) {
+      /* the first record is the client's opening volley */
+      have_tuple = 1;
+      if (swap_dir) {
+        want_src = sp;
+        want_dst = dp;
+      } else {
+        want_src = dp;
+        want_dst = sp;
+      }
+      first_usec = (uint64_t) ts_sec * 1000000 + ts_usec;
+    }
+    if (sp != want_src || dp != want_dst) {
+      continue;
+    }
+    if (incl == FAKE_TCPIP_HEADER_LEN) {
+      continue; /* bare ACK */
+    }
+
+    if (stream->count == capacity) {
+      struct replay_record *tmp;
+
+      capacity *= 2;
+      tmp = realloc(stream->records, capacity * sizeof(struct replay_record));
+      if (tmp == NULL) {
+        return -1;
+      }
+      stream->records = tmp;
+    }
+    stream->records[stream->count].data = payload + FAKE_TCPIP_HEADER_LEN;
+    stream->records[stream->count].len = incl - FAKE_TCPIP_HEADER_LEN;
+    stream->records[stream->count].usec =
+        (uint64_t) ts_sec * 1000000 + ts_usec - first_usec;
+    stream->count++;
+  }
+
+  return 0;
+}
+
+static int parse_replay(const unsigned char *data, size_t len,
+    struct replay_stream *stream) {
+  size_t off = 4;
+  size_t capacity = 64;
+
+  stream->records = malloc(capacity * sizeof(struct replay_record));
+  if (stream->records == NULL) {
+    return -1;
+  }
+  stream->count = 0;
+
+  while (off + 12 <= len) {
+    uint32_t rlen = get_u32(data + off, 0);
+    uint64_t usec = (uint64_t) get_u32(data + off + 4, 0) |
+        ((uint64_t) get_u32(data + off + 8, 0) << 32);
+
+    off += 12;
+    if (rlen > len - off) {
+      fprintf(stderr, "Truncated replay record\n");
+      return -1;
+    }
+    if (stream->count == capacity) {
+      struct replay_record *tmp;
+
+      capacity *= 2;
+      tmp = realloc(stream->records, capacity * sizeof(struct replay_record));
+      if (tmp == NULL) {
+        return -1;
+      }
+      stream->records = tmp;
+    }
+    stream->records[stream->count].data = data + off;
+    stream->records[stream->count].len = rlen;
+    stream->records[stream->count].usec = usec;
+    stream->count++;
+    off += rlen;
+  }
+
+  return 0;
+}
+
+static int write_replay(const char *path, struct replay_stream *stream) {
+  FILE *f;
+  unsigned char header[12];
+  size_t i;
+
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Opening %s failed\n", path);
+    return -1;
+  }
+  fwrite(REPLAY_MAGIC, 1, 4, f);
+  for (i = 0; i < stream->count; i++) {
+    put_u32_le(header, stream->records[i].len);
+    put_u64_le(header + 4, stream->records[i].usec);
+    fwrite(header, 1, 12, f);
+    fwrite(stream->records[i].data, 1, stream->records[i].len, f);
+  }
+  fclose(f);
+  return 0;
+}
+
+static int replay_on_data(ssh_session session, ssh_channel channel,
+    void *data, uint32_t len, int is_stderr, void *userdata) {
+  (void) session;
+  (void) data;
+  (void) is_stderr;
+  (void) userdata;
+
+  replay_delivered += len;
+  /* refill what the data packet consumed, without sending anything */
+  channel->local_window = REPLAY_WINDOW;
+  return len;
+}
+
+static struct ssh_channel_callbacks_struct replay_channel_cb = {
+  .channel_data_function = replay_on_data,
+};
+
+static ssh_session replay_session_new(int nchannels) {
+  ssh_session session;
+  int i;
+
+  session = ssh_new();
+  if (session == NULL) {
+    return NULL;
+  }
+  ssh_packet_set_default_callbacks(session);
+  ssh_callbacks_init(&replay_channel_cb);
+
+  /* open the channels the way the captured client did: ids are handed
+   * out in order, so channel N here demuxes the capture's channel N */
+  for (i = 0; i < nchannels; i++) {
+    ssh_channel channel = ssh_channel_new(session);
+
+    if (channel == NULL) {
+      ssh_free(session);
+      return NULL;
+    }
+    channel->local_channel = ssh_channel_new_id(session);
+    channel->local_window = REPLAY_WINDOW;
+    channel->window_fixed = 1;
+    channel->local_maxpacket = 32000;
+    channel->remote_channel = i;
+    channel->remote_window = REPLAY_WINDOW;
+    channel->remote_maxpacket = 32000;
+    channel->state = SSH_CHANNEL_STATE_OPEN;
+    ssh_channel_table_register(session, channel);
+    ssh_set_channel_callbacks(channel, &replay_channel_cb);
+  }
+
+  return session;
+}
+
+static uint64_t now_usec(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main(int argc, char **argv) {
+  const char *in_path = NULL;
+  const char *out_path = NULL;
+  struct replay_stream stream;
+  unsigned char *capture;
+  unsigned char *carry = NULL;
+  size_t capture_len, carry_len = 0, carry_size = 0;
+  ssh_session session;
+  uint64_t fed = 0;
+  uint64_t start_usec, elapsed;
+  unsigned long long cycles = 0;
+  int timed = 0, swap_dir = 0, nchannels = 1;
+  size_t i;
+  int i_arg;
+
+  memset(&stream, 0, sizeof(stream));
+  for (i_arg = 1; i_arg < argc; i_arg++) {
+    if (strcmp(argv[i_arg], "-t") == 0) {
+      timed = 1;
+    } else if (strcmp(argv[i_arg], "-s") == 0) {
+      swap_dir = 1;
+    } else if (strcmp(argv[i_arg], "-c") == 0 && i_arg + 1 < argc) {
+      nchannels = atoi(argv[++i_arg]);
+    } else if (strcmp(argv[i_arg], "-o") == 0 && i_arg + 1 < argc) {
+      out_path = argv[++i_arg];
+    } else {
+      in_path = argv[i_arg];
+    }
+  }
+  if (in_path == NULL) {
+    fprintf(stderr,
+        "Usage: bench_replay [-t] [-s] [-c channels] [-o out.sshr] capture\n");
+    return 1;
+  }
+
+  capture = load_file(in_path, &capture_len);
+  if (capture == NULL) {
+    return 1;
+  }
+
+  if (capture_len >= 4 && memcmp(capture, REPLAY_MAGIC, 4) == 0) {
+    if (parse_replay(capture, capture_len, &stream) < 0) {
+      return 1;
+    }
+  } else if (parse_pcap(capture, capture_len, swap_dir, &stream) < 0) {
+    fprintf(stderr, "%s is neither a pcap nor a replay capture\n", in_path);
+    return 1;
+  }
+
+  if (out_path != NULL) {
+    int rc = write_replay(out_path, &stream);
+
+    if (rc == 0) {
+      printf("Wrote %lu records to %s\n",
+          (unsigned long) stream.count, out_path);
+    }
+    return rc == 0 ? 0 : 1;
+  }
+
+  ssh_init();
+  session = replay_session_new(nchannels);
+  if (session == NULL) {
+    return 1;
+  }
+
+  start_usec = now_usec();
+  for (i = 0; i < stream.count; i++) {
+    const unsigned char *data = stream.records[i].data;
+    size_t len = stream.records[i].len;
+    int processed;
+
+#ifndef _WIN32
+    if (timed) {
+      uint64_t due = start_usec + stream.records[i].usec;
+      uint64_t now = now_usec();
+
+      if (due > now) {
+        usleep(due - now);
+      }
+    }
+#endif
+
+    /* a record may end mid-packet; what the packet layer leaves
+     * unconsumed is carried over and prepended to the next record */
+    if (carry_len > 0) {
+      if (carry_len + len > carry_size) {
+        carry_size = (carry_len + len) * 2;
+        carry = realloc(carry, carry_size);
+        if (carry == NULL) {
+          return 1;
+        }
+      }
+      memcpy(carry + carry_len, data, len);
+      carry_len += len;
+      data = carry;
+      len = carry_len;
+    }
+
+#ifdef HAVE_BENCH_CYCLES
+    cycles -= bench_cycles();
+#endif
+    processed = ssh_packet_socket_callback(data, len, session);
+#ifdef HAVE_BENCH_CYCLES
+    cycles += bench_cycles();
+#endif
+    if (processed < 0) {
+      fprintf(stderr, "Replay failed at record %lu: %s\n",
+          (unsigned long) i, ssh_get_error(session));
+      return 1;
+    }
+    fed += processed;
+
+    if ((size_t) processed < len) {
+      size_t rest = len - (size_t) processed;
+
+      if (data != carry) {
+        if (rest > carry_size) {
+          carry_size = rest * 2;
+          free(carry);
+          carry = malloc(carry_size);
+          if (carry == NULL) {
+            return 1;
+          }
+        }
+        memcpy(carry, data + processed, rest);
+      } else {
+        memmove(carry, carry + processed, rest);
+      }
+      carry_len = rest;
+    } else {
+      carry_len = 0;
+    }
+  }
+  elapsed = now_usec() - start_usec;
+  if (elapsed == 0) {
+    elapsed = 1;
+  }
+
+  printf("Replayed %llu bytes in %lu records: %.1f MB/s, "
+      "%llu bytes delivered to channels\n",
+      (unsigned long long) fed, (unsigned long) stream.count,
+      fed / (1024.0f * 1024.0f) / (elapsed / 1000000.0f),
+      (unsigned long long) replay_delivered);
+#ifdef HAVE_BENCH_CYCLES
+  if (fed > 0 && !timed) {
+    printf("%.2f cycles/byte in the packet layer\n",
+        (float) ((double) cycles / fed));
+  }
+#endif
+
+  ssh_free(session);
+  free(carry);
+  free(stream.records);
+  free(capture);
+  ssh_finalize();
+
+  return 0;
+}
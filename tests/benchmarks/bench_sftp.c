@@ -0,0 +1,128 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2010 by Aris Adamantiadis
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "benchmarks.h"
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#define SFTP_BENCH_FILE "/tmp/libssh_sftp_benchmark"
+#define SFTP_BENCH_CHUNK 32768
+
+/** @internal
+ * @brief create the remote scratch file the download benchmark reads.
+ */
+static int create_remote_file(ssh_session session, unsigned long bytes){
+  ssh_channel channel;
+  char cmd[256];
+  char buffer[128];
+  int err;
+
+  channel=ssh_channel_new(session);
+  if(channel == NULL)
+    goto error;
+  if(ssh_channel_open_session(channel) == SSH_ERROR)
+    goto error;
+  snprintf(cmd,sizeof(cmd),"dd if=/dev/zero of=%s bs=4096 count=%lu 2>/dev/null",
+      SFTP_BENCH_FILE, bytes/4096);
+  if(ssh_channel_request_exec(channel,cmd) == SSH_ERROR)
+    goto error;
+  /* drain until the command finishes */
+  while((err=ssh_channel_read(channel,buffer,sizeof(buffer),0)) > 0)
+    ;
+  if(err == SSH_ERROR)
+    goto error;
+  ssh_channel_close(channel);
+  ssh_channel_free(channel);
+  return 0;
+error:
+  fprintf(stderr,"Error while creating scratch file : %s\n",
+      ssh_get_error(session));
+  if(channel){
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+  }
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks a SFTP download at a given pipeline depth using an
+ * existing SSH session.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[in] nrequests Number of SSH_FXP_READ requests kept in flight.
+ * @param[out] bps The calculated bytes per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_down (ssh_session session, struct argument_s *args,
+    int nrequests, float *bps){
+  unsigned long bytes=0x1000000;
+  static char buffer[SFTP_BENCH_CHUNK];
+  sftp_session sftp=NULL;
+  sftp_file file=NULL;
+  struct timestamp_struct ts;
+  float ms=0.0;
+  unsigned long total=0;
+  ssize_t r;
+
+  if(create_remote_file(session,bytes) < 0)
+    return -1;
+  sftp=sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  if(sftp_init(sftp) < 0)
+    goto error;
+  file=sftp_open(sftp,SFTP_BENCH_FILE,O_RDONLY,0);
+  if(file == NULL)
+    goto error;
+  if(nrequests > 1 &&
+      sftp_file_set_readahead(file,nrequests,SFTP_BENCH_CHUNK) < 0)
+    goto error;
+  if(args->verbose>0)
+    fprintf(stdout,"Starting SFTP download of %lu bytes, %d requests in "
+        "flight\n",bytes,nrequests);
+  timestamp_init(&ts);
+  while((r=sftp_read(file,buffer,sizeof(buffer))) > 0)
+    total += r;
+  ms=elapsed_time(&ts);
+  if(r < 0 || total != bytes){
+    fprintf(stderr,"SFTP download failed: expected %lu bytes, got %lu\n",
+        bytes,total);
+    goto error;
+  }
+  *bps=8000 * (float)bytes / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"SFTP download took %f ms for %lu bytes, at %f bps\n",
+        ms,bytes,*bps);
+  sftp_close(file);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during SFTP download : %s\n",ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  if(sftp)
+    sftp_free(sftp);
+  return -1;
+}
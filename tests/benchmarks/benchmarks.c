@@ -29,7 +29,9 @@
 
 const char *libssh_benchmarks_names[]={
     "null",
-    "benchmark_raw_upload"
+    "benchmark_raw_upload",
+    "benchmark_raw_download",
+    "benchmark_sftp_download"
 };
 
 #ifdef HAVE_ARGP_H
@@ -62,6 +64,30 @@ static struct argp_option options[] = {
     .doc   = "Upload raw data using channel",
     .group = 0
   },
+  {
+    .name  = "raw-download",
+    .key   = '2',
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Download raw data using channel",
+    .group = 0
+  },
+  {
+    .name  = "sftp-download",
+    .key   = '3',
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Download data using SFTP at several pipeline depths",
+    .group = 0
+  },
+  {
+    .name  = "csv",
+    .key   = 'c',
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Output results as host,benchmark,parameter,value,unit lines",
+    .group = 0
+  },
   {
     .name  = "host",
     .key   = 'h',
@@ -85,9 +111,14 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
   switch (key) {
     case '1':
-      arguments->benchmarks[key - '1' + 1] = 1;
+    case '2':
+    case '3':
+      arguments->benchmarks[key - '1'] = 1;
       arguments->ntests ++;
       break;
+    case 'c':
+      arguments->csv = 1;
+      break;
     case 'v':
       arguments->verbose++;
       break;
@@ -168,28 +199,73 @@ static char *network_speed(float bps){
   return buffer;
 }
 
+void benchmarks_output_csv(const char *host, const char *benchmark,
+    int parameter, float value, const char *unit){
+  fprintf(stdout, "%s,%s,%d,%f,%s\n", host, benchmark, parameter, value,
+      unit);
+}
+
 static void do_benchmarks(ssh_session session, struct argument_s *arguments,
     const char *hostname){
   float ping_rtt=0.0;
   float ssh_rtt=0.0;
   float bps=0.0;
   int err;
+  int depth;
 
   if(arguments->verbose>0)
     fprintf(stdout,"Testing ICMP RTT\n");
   err=benchmarks_ping_latency(hostname, &ping_rtt);
   if(err == 0){
-    fprintf(stdout,"ping RTT : %f ms\n",ping_rtt);
+    if(arguments->csv)
+      benchmarks_output_csv(hostname, "ping_rtt", 0, ping_rtt, "ms");
+    else
+      fprintf(stdout,"ping RTT : %f ms\n",ping_rtt);
   }
   err=benchmarks_ssh_latency(session, &ssh_rtt);
   if(err==0){
-    fprintf(stdout, "SSH RTT : %f ms\n",ssh_rtt);
+    if(arguments->csv)
+      benchmarks_output_csv(hostname, "ssh_rtt", 0, ssh_rtt, "ms");
+    else
+      fprintf(stdout, "SSH RTT : %f ms\n",ssh_rtt);
   }
   if(arguments->benchmarks[BENCHMARK_RAW_UPLOAD-1]){
     err=benchmarks_raw_up(session,arguments,&bps);
     if(err==0){
-      fprintf(stdout, "%s : %s : %s\n",hostname,
-          libssh_benchmarks_names[BENCHMARK_RAW_UPLOAD], network_speed(bps));
+      if(arguments->csv)
+        benchmarks_output_csv(hostname,
+            libssh_benchmarks_names[BENCHMARK_RAW_UPLOAD], 0, bps, "bps");
+      else
+        fprintf(stdout, "%s : %s : %s\n",hostname,
+            libssh_benchmarks_names[BENCHMARK_RAW_UPLOAD], network_speed(bps));
+    }
+  }
+  if(arguments->benchmarks[BENCHMARK_RAW_DOWNLOAD-1]){
+    err=benchmarks_raw_down(session,arguments,&bps);
+    if(err==0){
+      if(arguments->csv)
+        benchmarks_output_csv(hostname,
+            libssh_benchmarks_names[BENCHMARK_RAW_DOWNLOAD], 0, bps, "bps");
+      else
+        fprintf(stdout, "%s : %s : %s\n",hostname,
+            libssh_benchmarks_names[BENCHMARK_RAW_DOWNLOAD],
+            network_speed(bps));
+    }
+  }
+  if(arguments->benchmarks[BENCHMARK_SFTP_DOWNLOAD-1]){
+    /* one synchronous run, then deeper and deeper pipelines */
+    for(depth=1; depth<=16; depth*=4){
+      err=benchmarks_sftp_down(session,arguments,depth,&bps);
+      if(err!=0)
+        break;
+      if(arguments->csv)
+        benchmarks_output_csv(hostname,
+            libssh_benchmarks_names[BENCHMARK_SFTP_DOWNLOAD], depth, bps,
+            "bps");
+      else
+        fprintf(stdout, "%s : %s (%d in flight) : %s\n",hostname,
+            libssh_benchmarks_names[BENCHMARK_SFTP_DOWNLOAD], depth,
+            network_speed(bps));
     }
   }
 }
@@ -225,9 +301,23 @@ int main(int argc, char **argv){
   }
 
   for(i=0; i<arguments.nhosts;++i){
+    struct timestamp_struct ts;
+    float connect_ms;
+
     if(arguments.verbose > 0)
       fprintf(stdout,"Connecting to \"%s\"...\n",arguments.hosts[i]);
+    /* time-to-session covers the banner exchange, key exchange and
+     * authentication */
+    timestamp_init(&ts);
     session=connect_host(arguments.hosts[i], arguments.verbose);
+    connect_ms=elapsed_time(&ts);
+    if(session != NULL){
+      if(arguments.csv)
+        benchmarks_output_csv(arguments.hosts[i], "time_to_session", 0,
+            connect_ms, "ms");
+      else
+        fprintf(stdout,"Time to authenticated session : %f ms\n",connect_ms);
+    }
     if(session != NULL && arguments.verbose > 0)
       fprintf(stdout,"Success\n");
     if(session == NULL){
@@ -31,6 +31,8 @@
 
 enum libssh_benchmarks {
     BENCHMARK_RAW_UPLOAD=1,
+    BENCHMARK_RAW_DOWNLOAD,
+    BENCHMARK_SFTP_DOWNLOAD,
     BENCHMARK_NUMBER
 };
 
@@ -40,8 +42,13 @@ struct argument_s {
   int verbose;
   int nhosts;
   int ntests;
+  int csv;
 };
 
+/* print a machine-readable result line: host,benchmark,parameter,value,unit */
+void benchmarks_output_csv(const char *host, const char *benchmark,
+    int parameter, float value, const char *unit);
+
 /* latency.c */
 
 struct timestamp_struct {
@@ -56,7 +63,16 @@ float elapsed_time(struct timestamp_struct *ts);
 
 /* bench_raw.c */
 
+int benchmarks_upload_script (ssh_session session, const char *path,
+    const char *script);
 int benchmarks_raw_up (ssh_session session, struct argument_s *args,
     float *bps);
+int benchmarks_raw_down (ssh_session session, struct argument_s *args,
+    float *bps);
+
+/* bench_sftp.c */
+
+int benchmarks_sftp_down (ssh_session session, struct argument_s *args,
+    int nrequests, float *bps);
 
 #endif /* BENCHMARKS_H_ */